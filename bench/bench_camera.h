@@ -0,0 +1,131 @@
+// A synthetic H.264 camera for the benchmarks that pull live video.
+//
+// Served over RTSP as "/cam" by an RtspServer of its own (add it as the
+// provider for "/"): 25 fps at the given bitrate, a keyframe every 2 s,
+// and delta frames alternating between reference (nal_ref_idc 2) and
+// non-reference ones. Every frame carries its send time (bench_stamp.h,
+// monotonic clock). Lives on one loop of its server; any number of
+// sessions share its relay.
+
+#ifndef NVR_BENCH_BENCH_CAMERA_H
+#define NVR_BENCH_BENCH_CAMERA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/clock.h"
+#include "base/event_loop.h"
+#include "base/packet_buffer.h"
+#include "bench_stamp.h"
+#include "media/nal.h"
+#include "media/rtp_packetizer.h"
+#include "relay/stream_relay.h"
+#include "rtsp/rtsp_server.h"
+#include "rtsp/rtsp_server_session.h"
+#include "rtsp/sdp.h"
+
+namespace nvr {
+namespace bench {
+
+constexpr int kCameraFps = 25;
+constexpr int kCameraGopFrames = 50;
+
+class SyntheticCamera : public RtspMediaProvider {
+ public:
+  SyntheticCamera(EventLoop* loop, int kbps)
+      : loop_(loop), relay_(loop), packetizer_(&pool_, VideoCodec::H264, 96, 0x11111111) {
+    size_t gopBytes = static_cast<size_t>(kbps) * 125 * kCameraGopFrames / kCameraFps;
+    keyBytes_ = gopBytes / 3;
+    deltaBytes_ = (gopBytes - keyBytes_) / (kCameraGopFrames - 1);
+    relay_.enableGopCache(0, VideoCodec::H264);
+  }
+
+  void start() {
+    loop_->post([this] {
+      timer_ = loop_->runEvery(1000 / kCameraFps, [this] { sendFrame(); });
+    });
+  }
+
+  void stop() {
+    std::promise<void> done;
+    loop_->post([&] {
+      loop_->cancel(timer_);
+      relay_.resetGopCache();
+      done.set_value();
+    });
+    done.get_future().wait();
+  }
+
+  void describe(const std::string& path, const std::string& query,
+                DescribeCallback done) override {
+    SdpMedia video;
+    video.type = "video";
+    video.payloadType = 96;
+    video.encoding = "H264";
+    video.clockRate = 90000;
+    ParameterSets sets;
+    sets.sps.assign(reinterpret_cast<const char*>(kSps), sizeof(kSps));
+    sets.pps.assign(reinterpret_cast<const char*>(kPps), sizeof(kPps));
+    video.fmtp = formatSdpFmtp(VideoCodec::H264, sets);
+    done(path == "cam" ? 200 : 404, {video});
+  }
+
+  void play(RtspPlayRequest request) override {
+    loop_->post([this, request]() mutable {
+      auto* session = new RtspServerSession(loop_, &request, RtspSessionOptions(), &stats_);
+      relay_.addSubscriber(std::unique_ptr<RelaySubscriber>(session));
+    });
+  }
+
+ private:
+  static constexpr uint8_t kSps[] = {0x67, 0x42, 0xc0, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8};
+  static constexpr uint8_t kPps[] = {0x68, 0xce, 0x3c, 0x80};
+
+  void sendFrame() {
+    static const uint8_t kStart[] = {0, 0, 0, 1};
+    bool key = frameIndex_ % kCameraGopFrames == 0;
+    au_.clear();
+    if (key) {
+      au_.insert(au_.end(), kStart, kStart + 4);
+      au_.insert(au_.end(), kSps, kSps + sizeof(kSps));
+      au_.insert(au_.end(), kStart, kStart + 4);
+      au_.insert(au_.end(), kPps, kPps + sizeof(kPps));
+    }
+    au_.insert(au_.end(), kStart, kStart + 4);
+    size_t at = au_.size();
+    au_.resize(at + std::max<size_t>(key ? keyBytes_ : deltaBytes_, 1 + kStampBytes), 0x5a);
+    // Reference and non-reference delta frames take turns.
+    au_[at] = key ? 0x65 : (frameIndex_ % 2 ? 0x01 : 0x41);
+    putStamp(&au_[at + 1], monotonicUs());
+    packetizer_.packetize(au_.data(), au_.size(), timestamp_, &packets_);
+    for (const auto& packet : packets_) relay_.publish(0, false, packet);
+    packets_.clear();
+    relay_.flush();
+    timestamp_ += 90000 / kCameraFps;
+    ++frameIndex_;
+  }
+
+  EventLoop* loop_;
+  PacketPool pool_{PacketPools::kStreamChunkSize, 16};  // outlives the relay
+  StreamRelay relay_;
+  RtpPacketizer packetizer_;
+  RtspSessionStats stats_;
+  std::vector<uint8_t> au_;
+  std::vector<PacketRef> packets_;
+  size_t keyBytes_;
+  size_t deltaBytes_;
+  uint64_t frameIndex_ = 0;
+  uint32_t timestamp_ = 0;
+  EventLoop::TimerId timer_ = 0;
+};
+
+}  // namespace bench
+}  // namespace nvr
+
+#endif  // NVR_BENCH_BENCH_CAMERA_H
@@ -0,0 +1,223 @@
+// How closely recordings of different cameras line up, by how their frames
+// are timed.
+//
+// [cameras] simulated cameras capture 25 fps video of the same scene for
+// [seconds]. Each has an RTP clock off nominal by up to 50 ppm, an NTP
+// clock within 2 ms of true time, and sends an RTCP sender report every
+// 5 s whose NTP and RTP times are sampled up to [sr jitter] ms apart.
+// Frames reach the NVR after 80 to 300 ms of encoding and network latency
+// that differs per camera and wanders per frame.
+//
+// Each frame is timed three ways: by arrival (the RTP clock anchored at the
+// first frame's arrival, as without sender reports), by extrapolating from
+// the latest sender report at the nominal rate, and by RtpClockSync's fit.
+// Frames a replay would show together (same capture instant) are compared
+// across cameras: the spread of their timestamps is how far apart the
+// cameras play. Reported: the spread's percentiles, the share of instants
+// within one frame interval, and each method's error against true capture
+// time. Then the cost of the fit per report and per frame.
+//
+//   bench_clock_sync [cameras] [seconds] [sr jitter ms]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "rtp/rtp_clock_sync.h"
+
+namespace {
+
+constexpr uint32_t kClockRate = 90000;
+constexpr int kFps = 25;
+constexpr int64_t kFrameUs = 1000000 / kFps;
+constexpr int64_t kReportIntervalUs = 5000000;
+constexpr int64_t kMaxClockSkewUs = 2000000;
+// Frames before this are left out: every camera has had a report.
+constexpr int64_t kWarmupUs = 10000000;
+constexpr int64_t kEpochUs = 1700000000000000LL;
+
+enum Method { kArrival, kLastReport, kFitted, kMethods };
+const char* kMethodNames[kMethods] = {"arrival", "latest sender report", "fitted (RtpClockSync)"};
+
+struct Camera {
+  double rate;  // RTP ticks per true second
+  uint32_t rtpBase;
+  int64_t ntpOffsetUs;
+  int64_t latencyUs;
+  int64_t phaseUs;  // first capture after the common start
+
+  uint32_t rtpAt(int64_t trueUs) const {
+    return rtpBase + static_cast<uint32_t>(static_cast<int64_t>(trueUs * rate / 1e6));
+  }
+};
+
+// The frame timing of one camera by every method.
+struct Timing {
+  explicit Timing(uint32_t clockRate) : sync(clockRate) {}
+
+  nvr::RtpClockSync sync;
+  bool anchored = false;
+  int64_t anchorUs = 0;
+  int64_t anchorRtp = 0;
+  int64_t lastRtp = 0;
+  uint32_t lastRaw = 0;
+  bool haveReport = false;
+  uint32_t reportRtp = 0;
+  int64_t reportUs = 0;
+
+  int64_t arrival(uint32_t rtp, int64_t arrivalUs) {
+    lastRtp = anchored ? lastRtp + static_cast<int32_t>(rtp - lastRaw) : rtp;
+    lastRaw = rtp;
+    int64_t us = anchorUs + (lastRtp - anchorRtp) * 1000000 / kClockRate;
+    if (!anchored || us - arrivalUs > kMaxClockSkewUs || arrivalUs - us > kMaxClockSkewUs) {
+      anchored = true;
+      anchorUs = arrivalUs;
+      anchorRtp = lastRtp;
+      us = arrivalUs;
+    }
+    return us;
+  }
+  int64_t latest(uint32_t rtp) const {
+    return reportUs + static_cast<int32_t>(rtp - reportRtp) * 1000000LL / kClockRate;
+  }
+};
+
+double percentile(std::vector<double> v, double p) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int cameras = argc > 1 ? atoi(argv[1]) : 16;
+  int seconds = argc > 2 ? atoi(argv[2]) : 3600;
+  double srJitterMs = argc > 3 ? atof(argv[3]) : 3;
+  if (cameras < 2 || seconds * 1000000LL <= 2 * kWarmupUs || srJitterMs < 0) {
+    fprintf(stderr, "usage: bench_clock_sync [cameras >= 2] [seconds > 20] [sr jitter ms]\n");
+    return 1;
+  }
+
+  std::mt19937_64 rng(42);
+  std::uniform_real_distribution<double> unit(0, 1);
+  std::vector<Camera> cams(cameras);
+  std::vector<Timing> timings;
+  std::vector<int64_t> nextReportUs(cameras);
+  for (int c = 0; c < cameras; ++c) {
+    Camera& cam = cams[c];
+    cam.rate = kClockRate * (1 + (unit(rng) * 100 - 50) * 1e-6);
+    cam.rtpBase = static_cast<uint32_t>(rng());
+    cam.ntpOffsetUs = static_cast<int64_t>(unit(rng) * 4000) - 2000;
+    cam.latencyUs = 80000 + static_cast<int64_t>(unit(rng) * 220000);
+    cam.phaseUs = static_cast<int64_t>(unit(rng) * kFrameUs);
+    timings.emplace_back(kClockRate);
+    nextReportUs[c] = static_cast<int64_t>(unit(rng) * kReportIntervalUs);
+  }
+
+  // Frame k of every camera is captured within one frame interval of the
+  // others: what a synchronized replay shows side by side.
+  std::vector<double> spread[kMethods];
+  std::vector<double> error[kMethods];
+  std::vector<int64_t> stamp[kMethods];
+  std::vector<int64_t> wander(cameras, 0);
+  int64_t frames = seconds * 1000000LL / kFrameUs;
+  for (int64_t k = 0; k < frames; ++k) {
+    for (auto& s : stamp) s.assign(cameras, 0);
+    for (int c = 0; c < cameras; ++c) {
+      const Camera& cam = cams[c];
+      Timing& t = timings[c];
+      int64_t captureUs = cam.phaseUs + k * kFrameUs;
+      // Reports sent before this frame's capture have arrived by the time
+      // the frame does.
+      while (nextReportUs[c] <= captureUs) {
+        int64_t sentUs = nextReportUs[c];
+        int64_t jitter = static_cast<int64_t>(unit(rng) * srJitterMs * 1000);
+        uint32_t rtp = cam.rtpAt(sentUs);
+        int64_t ntpUs = kEpochUs + sentUs + jitter + cam.ntpOffsetUs;
+        t.sync.addReport(rtp, ntpUs);
+        t.haveReport = true;
+        t.reportRtp = rtp;
+        t.reportUs = ntpUs;
+        nextReportUs[c] += kReportIntervalUs;
+      }
+      // Network delay wanders over 0 to 20 ms; encoding adds up to 30 ms.
+      wander[c] += static_cast<int64_t>((unit(rng) - 0.5) * 2000);
+      wander[c] = std::max<int64_t>(0, std::min<int64_t>(20000, wander[c]));
+      int64_t encodeUs = static_cast<int64_t>(unit(rng) * 30000);
+      int64_t arrivalUs = kEpochUs + captureUs + cam.latencyUs + wander[c] + encodeUs;
+      uint32_t rtp = cam.rtpAt(captureUs);
+      int64_t byArrival = t.arrival(rtp, arrivalUs);
+      stamp[kArrival][c] = byArrival;
+      stamp[kLastReport][c] = t.haveReport ? t.latest(rtp) : byArrival;
+      stamp[kFitted][c] = t.sync.synced() ? t.sync.senderUs(rtp) : byArrival;
+      if (k * kFrameUs >= kWarmupUs)
+        for (int m = 0; m < kMethods; ++m)
+          error[m].push_back(static_cast<double>(stamp[m][c] - kEpochUs - captureUs) / 1000);
+    }
+    if (k * kFrameUs < kWarmupUs) continue;
+    for (int m = 0; m < kMethods; ++m) {
+      // Against the capture instant, since the cameras' phases differ.
+      int64_t lo = INT64_MAX, hi = INT64_MIN;
+      for (int c = 0; c < cameras; ++c) {
+        int64_t skew = stamp[m][c] - cams[c].phaseUs;
+        lo = std::min(lo, skew);
+        hi = std::max(hi, skew);
+      }
+      spread[m].push_back(static_cast<double>(hi - lo) / 1000);
+    }
+  }
+
+  printf("%d cameras, %d s at %d fps, sender reports every %lld s with up to %.1f ms jitter\n\n",
+         cameras, seconds, kFps, static_cast<long long>(kReportIntervalUs / 1000000), srJitterMs);
+  printf("%-24s %28s %10s %26s\n", "", "spread across cameras (ms)", "within",
+         "error vs capture (ms)");
+  printf("%-24s %28s %10s %26s\n", "timed by", "p50 / p99 / max", "1 frame", "p1 / p50 / p99");
+  for (int m = 0; m < kMethods; ++m) {
+    size_t within = 0;
+    for (double s : spread[m]) within += s < kFrameUs / 1000.0;
+    char spreadText[64], errorText[64];
+    snprintf(spreadText, sizeof(spreadText), "%.2f / %.2f / %.2f", percentile(spread[m], 0.5),
+             percentile(spread[m], 0.99), percentile(spread[m], 1));
+    snprintf(errorText, sizeof(errorText), "%.2f / %.2f / %.2f", percentile(error[m], 0.01),
+             percentile(error[m], 0.5), percentile(error[m], 0.99));
+    printf("%-24s %28s %9.2f%% %26s\n", kMethodNames[m], spreadText,
+           100.0 * within / spread[m].size(), errorText);
+  }
+
+  int32_t maxDrift = 0;
+  uint32_t maxResidual = 0;
+  for (int c = 0; c < cameras; ++c) {
+    int32_t actual = static_cast<int32_t>((cams[c].rate / kClockRate - 1) * 1e9);
+    maxDrift = std::max(maxDrift, std::abs(timings[c].sync.driftPpb() - actual));
+    maxResidual = std::max(maxResidual, timings[c].sync.residualUs());
+  }
+  printf("\nfitted drift within %.3f ppm of the true rate, RMS fit error up to %.2f ms\n",
+         maxDrift / 1000.0, maxResidual / 1000.0);
+
+  // Cost: a report refits up to 64 points; a frame is one multiply.
+  const int kReports = 200000;
+  nvr::RtpClockSync sync(kClockRate);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kReports; ++i)
+    sync.addReport(static_cast<uint32_t>(i) * 450000u, kEpochUs + i * 5000000LL + (i % 7) * 300);
+  double reportNs =
+      std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+      kReports;
+  const int kFrames = 10000000;
+  // Wraps freely: ten million wall-clock times overflow any signed sum.
+  uint64_t sum = 0;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kFrames; ++i)
+    sum += static_cast<uint64_t>(sync.senderUs(static_cast<uint32_t>(i) * 3600u));
+  double frameNs =
+      std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+      kFrames;
+  printf("cost: %.0f ns per sender report, %.1f ns per frame (%llu)\n", reportNs, frameNs,
+         static_cast<unsigned long long>(sum & 1));
+  return 0;
+}
@@ -0,0 +1,346 @@
+// WS-Discovery sweep of a flat network against simulated responders.
+//
+// A responder thread plays the cameras of a loopback block: one UDP socket
+// on 0.0.0.0 learns from IP_PKTINFO which 127.x.y.z a probe was sent to and
+// answers from that address, so every camera has its own source address as
+// on a real LAN. About 70% of the swept addresses have a camera; each one
+// answers every probe after a random 0-50 ms delay with one to three copies
+// of its ProbeMatches (several interfaces, or a chatty firmware). The
+// scanner sweeps the block with batched unicast probes and reports devices
+// found, duplicates suppressed, time to 99% and 100% of devices, datagrams
+// per recvmmsg and CPU, then compares against probing one address at a
+// time and waiting for the answer. Multicast is left out: loopback
+// multicast delivery depends on the sandbox's routing.
+//
+//   bench_discovery [cidr] [batch] [repeats]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "base/hash.h"
+#include "base/log.h"
+#include "base/socket_util.h"
+#include "onvif/ws_discovery.h"
+
+namespace {
+
+constexpr uint64_t kMaxReplyDelayMs = 50;
+constexpr size_t kSerialSample = 200;
+
+uint32_t ipOf(const nvr::SocketAddress& addr) {
+  return ntohl(reinterpret_cast<const struct sockaddr_in*>(&addr.storage)->sin_addr.s_addr);
+}
+
+std::string ipString(uint32_t ip) {
+  struct in_addr a;
+  a.s_addr = htonl(ip);
+  char buf[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &a, buf, sizeof(buf));
+  return buf;
+}
+
+bool hasCamera(uint32_t ip) { return nvr::mix64(ip) % 10 < 7; }
+
+std::string cameraUuid(uint32_t ip) {
+  char buf[40];
+  uint64_t h = nvr::mix64(ip ^ 0x5bd1e995u);
+  snprintf(buf, sizeof(buf), "2419d6a0-%04x-4b1c-%04x-%012x", ip >> 16, ip & 0xffff,
+           static_cast<unsigned>(h & 0xffffffffu));
+  return buf;
+}
+
+std::string cameraUrl(uint32_t ip) {
+  return "http://" + ipString(ip) + "/onvif/device_service";
+}
+
+double threadCpuSeconds() {
+  rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+std::string probeMatches(uint32_t ip, const std::string& relatesTo, uint64_t reply) {
+  std::string ipText = ipString(ip);
+  return "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+         "<SOAP-ENV:Envelope xmlns:SOAP-ENV=\"http://www.w3.org/2003/05/soap-envelope\" "
+         "xmlns:wsa=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\" "
+         "xmlns:d=\"http://schemas.xmlsoap.org/ws/2005/04/discovery\" "
+         "xmlns:dn=\"http://www.onvif.org/ver10/network/wsdl\" "
+         "xmlns:tds=\"http://www.onvif.org/ver10/device/wsdl\">"
+         "<SOAP-ENV:Header><wsa:MessageID>urn:uuid:" +
+         cameraUuid(ip ^ static_cast<uint32_t>(reply << 24)) +
+         "</wsa:MessageID><wsa:RelatesTo>" + relatesTo +
+         "</wsa:RelatesTo><wsa:To SOAP-ENV:mustUnderstand=\"true\">"
+         "http://schemas.xmlsoap.org/ws/2004/08/addressing/role/anonymous</wsa:To>"
+         "<wsa:Action SOAP-ENV:mustUnderstand=\"true\">"
+         "http://schemas.xmlsoap.org/ws/2005/04/discovery/ProbeMatches</wsa:Action>"
+         "<d:AppSequence InstanceId=\"1\" MessageNumber=\"" + std::to_string(reply) +
+         "\"/></SOAP-ENV:Header><SOAP-ENV:Body><d:ProbeMatches><d:ProbeMatch>"
+         "<wsa:EndpointReference><wsa:Address>urn:uuid:" + cameraUuid(ip) +
+         "</wsa:Address></wsa:EndpointReference>"
+         "<d:Types>dn:NetworkVideoTransmitter tds:Device</d:Types>"
+         "<d:Scopes>onvif://www.onvif.org/type/video_encoder "
+         "onvif://www.onvif.org/Profile/Streaming onvif://www.onvif.org/Profile/T "
+         "onvif://www.onvif.org/hardware/DS-2CD2143G2-I "
+         "onvif://www.onvif.org/location/city/hangzhou "
+         "onvif://www.onvif.org/name/cam%20" + ipText + "</d:Scopes>"
+         "<d:XAddrs>" + cameraUrl(ip) + " http://[fe80::" + std::to_string(ip & 0xffff) +
+         "]/onvif/device_service</d:XAddrs>"
+         "<d:MetadataVersion>10</d:MetadataVersion>"
+         "</d:ProbeMatch></d:ProbeMatches></SOAP-ENV:Body></SOAP-ENV:Envelope>";
+}
+
+// All simulated cameras behind one socket.
+class Responders : public nvr::EventHandler {
+ public:
+  Responders(nvr::EventLoop* loop, int fd) : loop_(loop), fd_(fd), rng_(12345) {}
+
+  void start() { loop_->add(fd_, EPOLLIN, this); }
+  void stop() { loop_->remove(fd_); }
+
+  void onEvents(uint32_t) override {
+    char buf[4096];
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    for (;;) {
+      struct sockaddr_in from;
+      struct iovec iov = {buf, sizeof(buf) - 1};
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_name = &from;
+      msg.msg_namelen = sizeof(from);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      ssize_t n = recvmsg(fd_, &msg, MSG_DONTWAIT);
+      if (n <= 0) return;
+      buf[n] = '\0';
+      struct in_addr to = {};
+      for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO)
+          to = reinterpret_cast<struct in_pktinfo*>(CMSG_DATA(c))->ipi_addr;
+      }
+      ++probes;
+      uint32_t ip = ntohl(to.s_addr);
+      if (!hasCamera(ip)) continue;
+      const char* id = strstr(buf, "MessageID>");
+      const char* end = id ? strchr(id, '<') : nullptr;
+      if (!end) continue;
+      std::string relatesTo(id + 10, end);
+      int copies = 1 + static_cast<int>(rng_() % 3);
+      uint64_t delay = rng_() % (kMaxReplyDelayMs + 1);
+      loop_->runAfter(delay, [this, ip, from, relatesTo, copies] {
+        for (int i = 0; i < copies; ++i) reply(ip, from, relatesTo);
+      });
+    }
+  }
+
+  std::atomic<uint64_t> probes{0};
+  std::atomic<uint64_t> replies{0};
+
+ private:
+  void reply(uint32_t ip, const struct sockaddr_in& to, const std::string& relatesTo) {
+    std::string body = probeMatches(ip, relatesTo, ++sequence_);
+    struct iovec iov = {const_cast<char*>(body.data()), body.size()};
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = const_cast<struct sockaddr_in*>(&to);
+    msg.msg_namelen = sizeof(to);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    // Answer from the address that was probed.
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = IPPROTO_IP;
+    c->cmsg_type = IP_PKTINFO;
+    c->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+    reinterpret_cast<struct in_pktinfo*>(CMSG_DATA(c))->ipi_spec_dst.s_addr = htonl(ip);
+    if (sendmsg(fd_, &msg, MSG_DONTWAIT) > 0) ++replies;
+  }
+
+  nvr::EventLoop* loop_;
+  int fd_;
+  std::mt19937_64 rng_;
+  uint64_t sequence_ = 0;
+};
+
+struct SweepResult {
+  double wallSeconds = 0;
+  double cpuSeconds = 0;
+  double ms99 = 0;
+  double ms100 = 0;
+  size_t found = 0;
+  size_t wrong = 0;
+  nvr::WsDiscovery::Stats stats;
+  nvr::UdpReceiverStats receive;
+};
+
+SweepResult sweep(const std::vector<nvr::SocketAddress>& targets, size_t expected,
+                  const nvr::WsDiscoveryOptions& options) {
+  nvr::EventLoop loop;
+  nvr::WsDiscovery discovery(&loop, options);
+  SweepResult result;
+  std::vector<double> foundMs;
+  uint64_t startMs = nvr::EventLoop::monotonicMs();
+  double startCpu = threadCpuSeconds();
+  loop.post([&] {
+    int rc = discovery.start(
+        targets,
+        [&](const nvr::DiscoveredDevice& device) {
+          foundMs.push_back(static_cast<double>(nvr::EventLoop::monotonicMs() - startMs));
+          uint32_t ip = ipOf(device.from);
+          nvr::OnvifDevice entry;
+          bool good = hasCamera(ip) && nvr::onvifDeviceFor(device, "admin", "pw", &entry) &&
+                      entry.id == cameraUuid(ip) &&
+                      entry.url == "http://admin:pw@" + ipString(ip) + "/onvif/device_service" &&
+                      device.scope("name") == "cam " + ipString(ip);
+          if (!good) ++result.wrong;
+        },
+        [&] { loop.quit(); });
+    if (rc < 0) {
+      fprintf(stderr, "start: %s\n", strerror(-rc));
+      loop.quit();
+    }
+  });
+  loop.run();
+  result.wallSeconds = (nvr::EventLoop::monotonicMs() - startMs) / 1000.0;
+  result.cpuSeconds = threadCpuSeconds() - startCpu;
+  result.found = foundMs.size();
+  if (!foundMs.empty() && expected > 0) {
+    size_t i99 = std::min(foundMs.size(), (expected * 99 + 99) / 100);
+    result.ms99 = foundMs.size() >= i99 ? foundMs[i99 - 1] : 0;
+    result.ms100 = foundMs.size() >= expected ? foundMs[expected - 1] : 0;
+  }
+  result.stats = discovery.stats();
+  result.receive = discovery.receiveStats();
+  return result;
+}
+
+// Probe one address, wait out the reply window, move on.
+double serialSeconds(const std::vector<nvr::SocketAddress>& targets, size_t* found) {
+  nvr::EventLoop loop;
+  nvr::WsDiscoveryOptions options;
+  options.multicast = false;
+  options.repeats = 1;
+  options.listenMs = kMaxReplyDelayMs + 10;
+  nvr::WsDiscovery discovery(&loop, options);
+  size_t next = 0;
+  std::function<void()> probeNext = [&] {
+    if (next == targets.size()) {
+      loop.quit();
+      return;
+    }
+    discovery.start({targets[next++]}, [&](const nvr::DiscoveredDevice&) { ++*found; },
+                    [&] { loop.post(probeNext); });
+  };
+  uint64_t startMs = nvr::EventLoop::monotonicMs();
+  loop.post(probeNext);
+  loop.run();
+  return (nvr::EventLoop::monotonicMs() - startMs) / 1000.0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  nvr::setLogLevel(nvr::LogLevel::Warn);
+  std::string cidr = argc > 1 ? argv[1] : "127.0.0.0/18";
+  uint32_t batch = argc > 2 ? static_cast<uint32_t>(atoi(argv[2])) : 64;
+  uint32_t repeats = argc > 3 ? static_cast<uint32_t>(atoi(argv[3])) : 2;
+
+  int fd = nvr::udpBind(AF_INET, 0);
+  if (fd < 0) {
+    fprintf(stderr, "bind: %s\n", strerror(-fd));
+    return 1;
+  }
+  int on = 1;
+  setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+  nvr::setRecvBufferSize(fd, 4 << 20);
+  nvr::setSendBufferSize(fd, 4 << 20);
+  nvr::SocketAddress bound;
+  nvr::localAddress(fd, &bound);
+
+  std::vector<nvr::SocketAddress> targets;
+  if (nvr::subnetTargets(cidr, bound.port(), &targets) < 0 ||
+      (ipOf(targets.front()) >> 24) != 127 || batch == 0 || repeats == 0) {
+    fprintf(stderr, "usage: bench_discovery [127.x.y.z/n] [batch] [repeats]\n");
+    ::close(fd);
+    return 1;
+  }
+  size_t expected = 0;
+  for (const auto& t : targets) expected += hasCamera(ipOf(t));
+
+  nvr::EventLoop responderLoop(1);
+  Responders responders(&responderLoop, fd);
+  responderLoop.post([&] { responders.start(); });
+  std::thread responderThread([&] { responderLoop.run(); });
+
+  printf("%s: %zu addresses, %zu cameras, 1-3 replies per probe after 0-%llu ms\n\n",
+         cidr.c_str(), targets.size(), expected,
+         static_cast<unsigned long long>(kMaxReplyDelayMs));
+
+  nvr::WsDiscoveryOptions options;
+  options.multicast = false;
+  options.port = bound.port();
+  options.batchSize = batch;
+  options.repeats = repeats;
+  options.listenMs = 500;
+  SweepResult r = sweep(targets, expected, options);
+  uint64_t matches = r.stats.matches;
+  printf("batched sweep (%u per sendmmsg, %u rounds)\n", batch, repeats);
+  printf("  found        %zu / %zu (%zu wrong)\n", r.found, expected, r.wrong);
+  printf("  matches      %llu, %llu duplicates suppressed (%.1f%%), %llu ignored\n",
+         static_cast<unsigned long long>(matches),
+         static_cast<unsigned long long>(r.stats.duplicates),
+         100.0 * r.stats.duplicates / std::max<uint64_t>(1, matches),
+         static_cast<unsigned long long>(r.stats.ignored));
+  printf("  probes       %llu in %llu sendmmsg calls, %llu dropped\n",
+         static_cast<unsigned long long>(r.stats.probesSent),
+         static_cast<unsigned long long>(r.stats.sendBatches),
+         static_cast<unsigned long long>(r.stats.sendDrops));
+  printf("  receive      %llu datagrams, %.1f per recvmmsg, %llu kernel drops\n",
+         static_cast<unsigned long long>(r.receive.packets), r.receive.packetsPerSyscall(),
+         static_cast<unsigned long long>(r.receive.kernelDrops));
+  printf("  time to 99%%  %.0f ms, to 100%% %s\n", r.ms99,
+         r.ms100 > 0 ? (std::to_string(static_cast<int>(r.ms100)) + " ms").c_str() : "-");
+  printf("  wall         %.2f s (incl. %u ms listen), cpu %.2f s\n", r.wallSeconds,
+         options.listenMs, r.cpuSeconds);
+
+  std::vector<nvr::SocketAddress> sample(
+      targets.begin(), targets.begin() + static_cast<long>(std::min(kSerialSample,
+                                                                    targets.size())));
+  size_t serialFound = 0;
+  double serial = serialSeconds(sample, &serialFound);
+  double perTarget = serial / static_cast<double>(sample.size());
+  printf("\nserial probe-and-wait: %zu addresses in %.2f s (%zu found), %.0f s extrapolated\n",
+         sample.size(), serial, serialFound, perTarget * static_cast<double>(targets.size()));
+
+  printf("responders: %llu probes, %llu replies\n",
+         static_cast<unsigned long long>(responders.probes.load()),
+         static_cast<unsigned long long>(responders.replies.load()));
+
+  responderLoop.post([&] { responders.stop(); });
+  responderLoop.quit();
+  responderThread.join();
+  ::close(fd);
+  return r.wrong == 0 && r.found == expected ? 0 : 1;
+}
@@ -0,0 +1,634 @@
+// ONVIF motion events from many cameras to event-only recording.
+//
+// A mock server thread plays N cameras (127.0.x.y on one port) with ONVIF
+// PullPoint subscriptions: PullMessages is held until the camera has
+// events or the poll times out, exactly like device firmware. A generator
+// on the same thread raises motion and alarm-input events at a fixed total
+// rate across random cameras, stamping each with its wall-clock time in
+// UtcTime. The NVR side is the server's: OnvifEventMultiplexer on one
+// loop, an EventChannel into a "trigger" thread where EventTrigger turns
+// the records into IngestEngine::triggerRecording(), and an IngestEngine
+// in event-only mode. The first R cameras also stream live video from a
+// synthetic RTSP camera into that engine and record on disk with their
+// pre-roll; for them the record start is timed when the camera's loop has
+// run the trigger (pre-roll written, recorder live). Reports
+// event-to-consumer and event-to-record-start latency, losses, consumer
+// wakeups and CPU.
+//
+//   bench_events [cameras] [events-per-sec] [seconds] [recorded] [dir]
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/clock.h"
+#include "base/event_loop.h"
+#include "base/event_loop_pool.h"
+#include "base/log.h"
+#include "base/socket_util.h"
+#include "bench_camera.h"
+#include "event/event_channel.h"
+#include "http/http_client.h"
+#include "http/http_message.h"
+#include "ingest/event_trigger.h"
+#include "ingest/ingest_engine.h"
+#include "onvif/event_multiplexer.h"
+#include "onvif/xml_reader.h"
+#include "rtsp/rtsp_server.h"
+#include "storage/file_util.h"
+#include "storage/pre_event_buffer.h"
+#include "storage/recording_store.h"
+
+namespace {
+
+constexpr int kHostsPerSubnet = 250;
+constexpr uint32_t kPullTimeoutSec = 5;
+// The recorded cameras.
+constexpr int kKbps = 256;
+constexpr uint32_t kPreRollMs = 5000;
+
+std::string cameraIp(int index) {
+  return "127.0." + std::to_string(1 + index / kHostsPerSubnet) + "." +
+         std::to_string(1 + index % kHostsPerSubnet);
+}
+
+double threadCpuSeconds() {
+  rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+std::string utcTime(int64_t us) {
+  time_t seconds = static_cast<time_t>(us / 1000000);
+  struct tm tm;
+  gmtime_r(&seconds, &tm);
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ", tm.tm_year + 1900,
+           tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+           static_cast<int>(us % 1000000));
+  return buf;
+}
+
+const char kResponseHead[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<env:Envelope xmlns:env=\"http://www.w3.org/2003/05/soap-envelope\" "
+    "xmlns:tt=\"http://www.onvif.org/ver10/schema\" "
+    "xmlns:tds=\"http://www.onvif.org/ver10/device/wsdl\" "
+    "xmlns:tev=\"http://www.onvif.org/ver10/events/wsdl\" "
+    "xmlns:wsnt=\"http://docs.oasis-open.org/wsn/b-2\" "
+    "xmlns:wsa5=\"http://www.w3.org/2005/08/addressing\" "
+    "xmlns:tns1=\"http://www.onvif.org/ver10/topics\">\n<env:Body>";
+const char kResponseTail[] = "</env:Body>\n</env:Envelope>\n";
+
+std::string notificationXml(int64_t us, bool motion, bool active, const char* operation) {
+  std::string xml =
+      "<wsnt:NotificationMessage><wsnt:Topic Dialect=\"http://www.onvif.org/ver10/tev/"
+      "topicExpression/ConcreteSet\">";
+  xml += motion ? "tns1:RuleEngine/CellMotionDetector/Motion" : "tns1:Device/Trigger/DigitalInput";
+  xml += "</wsnt:Topic><wsnt:Message><tt:Message UtcTime=\"" + utcTime(us) +
+         "\" PropertyOperation=\"" + operation + "\"><tt:Source>";
+  xml += motion ? "<tt:SimpleItem Name=\"VideoSourceConfigurationToken\" Value=\"VideoSource_1\"/>"
+                  "<tt:SimpleItem Name=\"VideoAnalyticsConfigurationToken\" "
+                  "Value=\"VideoAnalyticsToken\"/><tt:SimpleItem Name=\"Rule\" "
+                  "Value=\"MyMotionDetectorRule\"/>"
+                : "<tt:SimpleItem Name=\"InputToken\" Value=\"AlarmIn_1\"/>";
+  xml += "</tt:Source><tt:Data><tt:SimpleItem Name=\"";
+  xml += motion ? "IsMotion" : "LogicalState";
+  xml += "\" Value=\"";
+  xml += active ? "true" : "false";
+  xml += "\"/></tt:Data></tt:Message></wsnt:Message></wsnt:NotificationMessage>";
+  return xml;
+}
+
+class MockCameras;
+
+class MockConnection : public nvr::EventHandler {
+ public:
+  MockConnection(MockCameras* cameras, int fd, int camera)
+      : cameras_(cameras), fd_(fd), camera_(camera) {}
+  void onEvents(uint32_t events) override;
+  void respond(const std::string& response);
+
+ private:
+  void flush();
+  void shutdown();
+
+  MockCameras* cameras_;
+  int fd_;
+  int camera_;
+  nvr::ByteBuffer input_;
+  nvr::ByteBuffer output_{4 * 1024};
+  bool wantWrite_ = false;
+};
+
+class MockCameras : public nvr::EventHandler {
+ public:
+  MockCameras(nvr::EventLoop* loop, int listenFd, int cameras)
+      : loop_(loop), listenFd_(listenFd), cameras_(cameras), rng_(7) {}
+
+  void start() { loop_->add(listenFd_, EPOLLIN, this); }
+
+  void onEvents(uint32_t) override {
+    for (;;) {
+      int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) return;
+      nvr::SocketAddress local;
+      nvr::localAddress(fd, &local);
+      auto* sin = reinterpret_cast<const sockaddr_in*>(local.get());
+      uint32_t ip = ntohl(sin->sin_addr.s_addr);
+      int camera = (static_cast<int>((ip >> 8) & 0xff) - 1) * kHostsPerSubnet +
+                   static_cast<int>(ip & 0xff) - 1;
+      if (camera < 0 || camera >= cameras_) {
+        ::close(fd);
+        continue;
+      }
+      auto* conn = new MockConnection(this, fd, camera);
+      loop_->add(fd, EPOLLIN, conn);
+    }
+  }
+
+  // Answers now, or parks a PullMessages until there is something to say.
+  void handle(int camera, MockConnection* conn, const nvr::HttpRequest& request) {
+    ++requests;
+    std::string operation;
+    nvr::XmlReader xml(request.body);
+    if (xml.findElement("Body") && xml.next() == nvr::XmlReader::Token::StartElement)
+      operation = xml.localName();
+    Camera& cam = state_[camera];
+    std::string body;
+    if (operation == "GetSystemDateAndTime") {
+      body = dateTimeXml();
+    } else if (operation == "CreatePullPointSubscription") {
+      ++subscriptions;
+      cam.subscribed = true;
+      int64_t now = nvr::wallClockUs();
+      // Devices report the current state of every property first.
+      cam.queue.push_back(notificationXml(now, true, false, "Initialized"));
+      body = "<tev:CreatePullPointSubscriptionResponse><tev:SubscriptionReference>"
+             "<wsa5:Address>http://" + cameraIp(camera) + "/onvif/Events/PullSubManager_" +
+             std::to_string(camera) + "</wsa5:Address></tev:SubscriptionReference>"
+             "<wsnt:CurrentTime>" + utcTime(now) + "</wsnt:CurrentTime><wsnt:TerminationTime>" +
+             utcTime(now + 60000000) + "</wsnt:TerminationTime>"
+             "</tev:CreatePullPointSubscriptionResponse>";
+    } else if (operation == "PullMessages") {
+      cam.parked = conn;
+      uint64_t generation = ++cam.generation;
+      if (!cam.queue.empty()) {
+        answerPull(camera);
+      } else {
+        loop_->runAfter(kPullTimeoutSec * 1000, [this, camera, generation] {
+          if (state_[camera].generation == generation && state_[camera].parked)
+            answerPull(camera);
+        });
+      }
+      return;
+    } else if (operation == "Renew") {
+      ++renewals;
+      int64_t now = nvr::wallClockUs();
+      body = "<wsnt:RenewResponse><wsnt:TerminationTime>" + utcTime(now + 60000000) +
+             "</wsnt:TerminationTime><wsnt:CurrentTime>" + utcTime(now) +
+             "</wsnt:CurrentTime></wsnt:RenewResponse>";
+    } else if (operation == "Unsubscribe") {
+      cam.subscribed = false;
+      body = "<wsnt:UnsubscribeResponse/>";
+    } else {
+      conn->respond(nvr::buildHttpResponse(400, "Bad Request", soapHeaders(),
+                                           std::string(kResponseHead) + kResponseTail, true));
+      return;
+    }
+    conn->respond(nvr::buildHttpResponse(200, "OK", soapHeaders(),
+                                         kResponseHead + body + kResponseTail, true));
+  }
+
+  void connectionClosed(int camera, MockConnection* conn) {
+    if (state_[camera].parked == conn) state_[camera].parked = nullptr;
+  }
+
+  // Raises events at `rate` per second until stopGenerating().
+  void generate(uint32_t rate) {
+    startUs_ = nvr::wallClockUs();
+    rate_ = rate;
+    timer_ = loop_->runEvery(1, [this] { tick(); });
+  }
+
+  void stopGenerating() {
+    if (timer_) loop_->cancel(timer_);
+    timer_ = 0;
+  }
+
+  nvr::EventLoop* loop() const { return loop_; }
+
+  std::atomic<uint64_t> requests{0};
+  std::atomic<uint64_t> subscriptions{0};
+  std::atomic<uint64_t> renewals{0};
+  std::atomic<uint64_t> generated{0};
+  std::atomic<uint64_t> motionOn{0};
+  // Raised before the camera was subscribed; nobody could have seen them.
+  std::atomic<uint64_t> unheard{0};
+
+ private:
+  struct Camera {
+    bool subscribed = false;
+    bool motion = false;
+    bool input = false;
+    std::vector<std::string> queue;
+    MockConnection* parked = nullptr;
+    uint64_t generation = 0;
+  };
+
+  static nvr::HeaderList soapHeaders() {
+    return {{"Server", "gSOAP/2.8"},
+            {"Content-Type", "application/soap+xml; charset=utf-8"}};
+  }
+
+  static std::string dateTimeXml() {
+    time_t now = time(nullptr);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "<tds:GetSystemDateAndTimeResponse><tds:SystemDateAndTime><tt:UTCDateTime>"
+             "<tt:Time><tt:Hour>%d</tt:Hour><tt:Minute>%d</tt:Minute><tt:Second>%d"
+             "</tt:Second></tt:Time><tt:Date><tt:Year>%d</tt:Year><tt:Month>%d</tt:Month>"
+             "<tt:Day>%d</tt:Day></tt:Date></tt:UTCDateTime></tds:SystemDateAndTime>"
+             "</tds:GetSystemDateAndTimeResponse>",
+             tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    return buf;
+  }
+
+  void answerPull(int camera) {
+    Camera& cam = state_[camera];
+    MockConnection* conn = cam.parked;
+    cam.parked = nullptr;
+    int64_t now = nvr::wallClockUs();
+    std::string body = "<tev:PullMessagesResponse><tev:CurrentTime>" + utcTime(now) +
+                       "</tev:CurrentTime><tev:TerminationTime>" + utcTime(now + 60000000) +
+                       "</tev:TerminationTime>";
+    for (const auto& message : cam.queue) body += message;
+    cam.queue.clear();
+    body += "</tev:PullMessagesResponse>";
+    conn->respond(nvr::buildHttpResponse(200, "OK", soapHeaders(),
+                                         kResponseHead + body + kResponseTail, true));
+  }
+
+  void tick() {
+    uint64_t due = static_cast<uint64_t>((nvr::wallClockUs() - startUs_) * rate_ / 1000000);
+    touched_.clear();
+    while (generated < due) {
+      int camera = static_cast<int>(rng_() % static_cast<uint64_t>(cameras_));
+      Camera& cam = state_[camera];
+      if (!cam.subscribed) {
+        ++generated;  // counted so the rate holds
+        ++unheard;
+        continue;
+      }
+      bool motion = rng_() % 10 != 0;
+      bool active;
+      if (motion) {
+        active = cam.motion = !cam.motion;
+        if (active) ++motionOn;
+      } else {
+        active = cam.input = !cam.input;
+      }
+      cam.queue.push_back(notificationXml(nvr::wallClockUs(), motion, active, "Changed"));
+      ++generated;
+      touched_.push_back(camera);
+    }
+    for (int camera : touched_) {
+      if (state_[camera].parked && !state_[camera].queue.empty()) answerPull(camera);
+    }
+  }
+
+  nvr::EventLoop* loop_;
+  int listenFd_;
+  int cameras_;
+  std::mt19937_64 rng_;
+  std::unordered_map<int, Camera> state_;
+  std::vector<int> touched_;
+  int64_t startUs_ = 0;
+  uint64_t rate_ = 0;
+  nvr::EventLoop::TimerId timer_ = 0;
+};
+
+void MockConnection::onEvents(uint32_t events) {
+  if (fd_ < 0) return;
+  if (events & EPOLLOUT) flush();
+  if (fd_ < 0 || !(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) return;
+  for (;;) {
+    ssize_t n = input_.readFd(fd_);
+    if (n == -EAGAIN) break;
+    if (n <= 0) {
+      shutdown();
+      return;
+    }
+  }
+  for (;;) {
+    nvr::HttpRequest request;
+    int used = nvr::parseHttpRequest(reinterpret_cast<const char*>(input_.data()),
+                                     input_.size(), &request);
+    if (used < 0) {
+      shutdown();
+      return;
+    }
+    if (used == 0) return;
+    input_.consume(used);
+    cameras_->handle(camera_, this, request);
+    if (fd_ < 0) return;
+  }
+}
+
+void MockConnection::respond(const std::string& response) {
+  if (fd_ < 0) return;
+  output_.append(response);
+  flush();
+}
+
+void MockConnection::flush() {
+  while (!output_.empty()) {
+    ssize_t n = output_.writeFd(fd_);
+    if (n == -EAGAIN) {
+      if (!wantWrite_) {
+        wantWrite_ = true;
+        cameras_->loop()->modify(fd_, EPOLLIN | EPOLLOUT, this);
+      }
+      return;
+    }
+    if (n < 0) {
+      shutdown();
+      return;
+    }
+  }
+  if (wantWrite_) {
+    wantWrite_ = false;
+    cameras_->loop()->modify(fd_, EPOLLIN, this);
+  }
+}
+
+void MockConnection::shutdown() {
+  if (fd_ < 0) return;
+  cameras_->connectionClosed(camera_, this);
+  cameras_->loop()->remove(fd_);
+  ::close(fd_);
+  fd_ = -1;
+  cameras_->loop()->deleteLater(this);
+}
+
+std::string cameraId(int index) { return "cam-" + std::to_string(index); }
+
+void removeRecordings(const std::string& dir) {
+  std::vector<std::string> groups;
+  nvr::listDirectory(dir, &groups);
+  for (const auto& group : groups) {
+    std::string groupDir = nvr::joinPath(dir, group);
+    std::vector<std::string> names;
+    nvr::listDirectory(groupDir, &names);
+    for (const auto& name : names) unlink(nvr::joinPath(groupDir, name).c_str());
+    rmdir(groupDir.c_str());
+  }
+  rmdir(dir.c_str());
+}
+
+double percentile(std::vector<double>* v, double p) {
+  if (v->empty()) return 0;
+  size_t i = std::min(v->size() - 1, static_cast<size_t>(p * static_cast<double>(v->size())));
+  std::nth_element(v->begin(), v->begin() + static_cast<long>(i), v->end());
+  return (*v)[i];
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  nvr::setLogLevel(nvr::LogLevel::Warn);
+  int cameras = argc > 1 ? atoi(argv[1]) : 2000;
+  uint32_t rate = argc > 2 ? static_cast<uint32_t>(atoi(argv[2])) : 10000;
+  int seconds = argc > 3 ? atoi(argv[3]) : 10;
+  int recorded = argc > 4 ? atoi(argv[4]) : 100;
+  std::string dir = argc > 5 ? argv[5] : "/tmp/nvr_bench_events";
+  if (cameras <= 0 || cameras > 250 * kHostsPerSubnet || rate == 0 || seconds <= 0 ||
+      recorded < 0 || recorded > cameras) {
+    fprintf(stderr,
+            "usage: bench_events [cameras] [events-per-sec] [seconds] [recorded <= cameras] "
+            "[dir]\n");
+    return 1;
+  }
+
+  nvr::SocketAddress any;
+  nvr::resolveAddress("0.0.0.0", 0, &any);
+  int listenFd = nvr::tcpListen(any, 4096);
+  if (listenFd < 0) {
+    fprintf(stderr, "listen: %s\n", strerror(-listenFd));
+    return 1;
+  }
+  nvr::SocketAddress bound;
+  nvr::localAddress(listenFd, &bound);
+
+  nvr::EventLoop mockLoop(1);
+  MockCameras mock(&mockLoop, listenFd, cameras);
+  mockLoop.post([&] { mock.start(); });
+  std::thread mockThread([&] { mockLoop.run(); });
+
+  // The recorded cameras' video: one synthetic camera that every session
+  // pulls.
+  nvr::EventLoopPool cameraLoops(1, false);
+  cameraLoops.start();
+  nvr::bench::SyntheticCamera camera(cameraLoops.loop(0), kKbps);
+  nvr::RtspServerOptions cameraOptions;
+  cameraOptions.host = "127.0.0.1";
+  cameraOptions.port = 0;
+  nvr::RtspServer cameraServer(&cameraLoops, cameraOptions);
+  cameraServer.addProvider("/", &camera);
+  if (cameraServer.start() < 0) return 1;
+  camera.start();
+
+  nvr::SegmentWriterOptions defaults;
+  defaults.dir = dir;
+  nvr::RecordingStore store(defaults);
+  if (store.start() < 0) {
+    fprintf(stderr, "cannot record under %s\n", dir.c_str());
+    return 1;
+  }
+  const uint32_t gopMs = nvr::bench::kCameraGopFrames * 1000 / nvr::bench::kCameraFps;
+  nvr::PreEventArena arena(static_cast<size_t>(std::max(recorded, 1)),
+                           nvr::preEventSlotBytes(kKbps, kPreRollMs, gopMs));
+  nvr::IngestOptions ingestOptions;
+  ingestOptions.recording = &store;
+  ingestOptions.eventOnly = true;
+  ingestOptions.preEvent = &arena;
+  ingestOptions.preEventMs = kPreRollMs;
+  nvr::IngestEngine ingest(ingestOptions);
+  ingest.start();
+  for (int i = 0; i < recorded; ++i) {
+    nvr::CameraConfig config;
+    config.id = cameraId(i);
+    config.url = "rtsp://127.0.0.1:" + std::to_string(cameraServer.port()) + "/cam";
+    ingest.addCamera(config);
+  }
+  while (ingest.stats().playing < static_cast<size_t>(recorded))
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  // Trigger thread: drains the channel into EventTrigger, which lives on
+  // its loop. Records of the recorded cameras that start a recording are
+  // followed onto the camera's loop: withRelay() runs there after the
+  // trigger posted just before it.
+  nvr::EventLoop triggerLoop(2);
+  std::unique_ptr<nvr::EventTrigger> trigger;
+  nvr::EventTrigger::Stats triggerStats;
+  triggerLoop.post([&] {
+    trigger.reset(new nvr::EventTrigger(&triggerLoop, &ingest));
+    for (int i = 0; i < cameras; ++i) trigger->addCamera(static_cast<uint32_t>(i), cameraId(i));
+  });
+  std::vector<double> eventMs;
+  uint64_t initial = 0;
+  uint64_t motion = 0;
+  uint64_t inputs = 0;
+  std::mutex startMutex;
+  std::vector<double> startMs;
+  nvr::EventChannel channel(&triggerLoop, 64 * 1024, [&](const nvr::EventRecord& record) {
+    if (record.flags & nvr::EventRecord::kInitial) {
+      ++initial;
+    } else {
+      eventMs.push_back((nvr::wallClockUs() - record.timeUs) / 1000.0);
+      if (record.topic == nvr::EventTopic::Motion) ++motion;
+      if (record.topic == nvr::EventTopic::DigitalInput) ++inputs;
+    }
+    if (!trigger || !trigger->onEvent(record) || record.camera >= static_cast<uint32_t>(recorded))
+      return;
+    int64_t timeUs = record.timeUs;
+    ingest.withRelay(cameraId(static_cast<int>(record.camera)),
+                     [&, timeUs](nvr::EventLoop*, nvr::StreamRelay*) {
+                       double ms = (nvr::wallClockUs() - timeUs) / 1000.0;
+                       std::lock_guard<std::mutex> lock(startMutex);
+                       startMs.push_back(ms);
+                     });
+  });
+  double triggerCpu = 0;
+  std::thread triggerThread([&] {
+    double start = threadCpuSeconds();
+    triggerLoop.run();
+    triggerCpu = threadCpuSeconds() - start;
+  });
+
+  nvr::EventLoop loop;
+  nvr::HttpClientOptions httpOptions;
+  httpOptions.maxConnections = static_cast<uint32_t>(cameras) * 2 + 16;
+  std::unique_ptr<nvr::HttpClient> http(new nvr::HttpClient(&loop, httpOptions));
+  nvr::OnvifEventOptions options;
+  options.pullTimeoutSec = kPullTimeoutSec;
+  // Short enough that the run renews every subscription.
+  options.subscriptionSec = std::max(10, seconds);
+  std::unique_ptr<nvr::OnvifEventMultiplexer> mux(
+      new nvr::OnvifEventMultiplexer(http.get(), &channel, options));
+
+  printf("%d cameras, %u events/s for %d s, PullMessages long poll %u s\n", cameras, rate,
+         seconds, kPullTimeoutSec);
+  printf("%d of them recorded on events: %d kbps, %u s pre-roll\n\n", recorded, kKbps,
+         kPreRollMs / 1000);
+  uint64_t startMsTotal = nvr::EventLoop::monotonicMs();
+  double startCpu = threadCpuSeconds();
+  double subscribeSeconds = 0;
+  loop.post([&] {
+    for (int i = 0; i < cameras; ++i) {
+      mux->addCamera(static_cast<uint32_t>(i),
+                     "http://admin:pw@" + cameraIp(i) + ":" + std::to_string(bound.port()) +
+                         "/onvif/device_service");
+    }
+  });
+  nvr::EventLoop::TimerId waitTimer = 0;
+  loop.post([&] {
+    waitTimer = loop.runEvery(10, [&] {
+      if (mux->stats().subscribed < static_cast<size_t>(cameras)) return;
+      loop.cancel(waitTimer);
+      subscribeSeconds = (nvr::EventLoop::monotonicMs() - startMsTotal) / 1000.0;
+      mockLoop.post([&] { mock.generate(rate); });
+      loop.runAfter(static_cast<uint64_t>(seconds) * 1000, [&] {
+        mockLoop.post([&] { mock.stopGenerating(); });
+        // Let the last polls come home.
+        loop.runAfter(500, [&] { loop.quit(); });
+      });
+    });
+  });
+  loop.run();
+  double muxCpu = threadCpuSeconds() - startCpu;
+  double elapsed = (nvr::EventLoop::monotonicMs() - startMsTotal) / 1000.0;
+  nvr::OnvifEventMultiplexer::Stats stats = mux->stats();
+  nvr::HttpClient::Stats httpStats = http->stats();
+  // Outstanding long polls refer to the multiplexer.
+  http.reset();
+  mux.reset();
+
+  triggerLoop.post([&] {
+    triggerStats = trigger->stats();
+    trigger.reset();
+    triggerLoop.quit();
+  });
+  triggerThread.join();
+  mockLoop.quit();
+  mockThread.join();
+  ::close(listenFd);
+  nvr::IngestStats ingestStats = ingest.stats();
+  ingest.stop();
+  camera.stop();
+  cameraServer.stop();
+  cameraLoops.stop();
+  store.stop();
+  removeRecordings(dir);
+
+  nvr::EventChannel::Stats channelStats = channel.stats();
+  uint64_t generated = mock.generated - mock.unheard;
+  uint64_t delivered = eventMs.size();
+  printf("subscribed   %zu in %.2f s, %llu renewals\n", stats.subscribed, subscribeSeconds,
+         static_cast<unsigned long long>(stats.renewals));
+  printf("events       %llu raised, %llu delivered (%llu motion, %llu input), %llu lost\n",
+         static_cast<unsigned long long>(generated), static_cast<unsigned long long>(delivered),
+         static_cast<unsigned long long>(motion), static_cast<unsigned long long>(inputs),
+         static_cast<unsigned long long>(generated > delivered ? generated - delivered : 0));
+  printf("             %llu initial-state records, %llu channel drops\n",
+         static_cast<unsigned long long>(initial),
+         static_cast<unsigned long long>(channelStats.dropped));
+  printf("pulls        %llu (%.1f events each), %llu errors, %llu requests on %llu "
+         "connections\n",
+         static_cast<unsigned long long>(stats.pulls),
+         static_cast<double>(stats.events) / std::max<uint64_t>(1, stats.pulls),
+         static_cast<unsigned long long>(stats.pullErrors),
+         static_cast<unsigned long long>(httpStats.requests),
+         static_cast<unsigned long long>(httpStats.connectionsOpened));
+  printf("trigger      %llu starts (%llu motion-on raised), %llu triggerRecording calls, "
+         "%zu cameras on at the end\n",
+         static_cast<unsigned long long>(triggerStats.starts),
+         static_cast<unsigned long long>(mock.motionOn.load()),
+         static_cast<unsigned long long>(triggerStats.triggers), triggerStats.active);
+  printf("recording    %llu triggers ran on the recorded cameras, %llu frames written\n",
+         static_cast<unsigned long long>(ingestStats.recordingTriggers),
+         static_cast<unsigned long long>(ingestStats.recordedFrames));
+  printf("latency      event->trigger p50 %.2f p99 %.2f max %.2f ms\n",
+         percentile(&eventMs, 0.5), percentile(&eventMs, 0.99),
+         eventMs.empty() ? 0 : *std::max_element(eventMs.begin(), eventMs.end()));
+  printf("             event->record start p50 %.2f p99 %.2f ms (%zu starts)\n",
+         percentile(&startMs, 0.5), percentile(&startMs, 0.99), startMs.size());
+  printf("consumer     %llu wakeups (%.1f records each), cpu %.2f s\n",
+         static_cast<unsigned long long>(channelStats.wakeups),
+         static_cast<double>(channelStats.delivered) /
+             std::max<uint64_t>(1, channelStats.wakeups),
+         triggerCpu);
+  printf("multiplexer  cpu %.2f s for %.1f s (%.1f%% of a core)\n", muxCpu, elapsed,
+         100.0 * muxCpu / elapsed);
+  return 0;
+}
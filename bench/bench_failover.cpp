@@ -0,0 +1,362 @@
+// Cluster failover on loopback.
+//
+// A coordinator (HeartbeatMonitor + PlacementScheduler) and in-process
+// recording nodes share one event loop; every node sends real UDP
+// heartbeats to the coordinator over 127.0.0.1. A node confirms a camera
+// after a random start delay (connect, SETUP, first keyframe). Once placed,
+// one node stalls its heartbeats for a while (a GC or disk stall) and then
+// another node dies. Each detector setting (phi threshold, acceptable
+// pause) runs the same script and reports:
+// failures declared for the stalled node (false positives), time from the
+// kill to detection, and the recording gaps of the dead node's cameras,
+// measured by the bench and as reported by the scheduler, separately for
+// cameras with a hot standby.
+//
+//   bench_failover [nodes] [cameras] [standby-percent] [heartbeat-ms] [stall-ms]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "base/log.h"
+#include "base/socket_util.h"
+#include "cluster/heartbeat.h"
+#include "cluster/placement.h"
+
+namespace {
+
+constexpr uint64_t kWarmupMs = 1500;
+constexpr uint64_t kKillAtMs = 3000;
+constexpr uint64_t kEndMs = 5000;
+constexpr uint64_t kRebalanceMs = 100;
+constexpr uint64_t kSampleMs = 10;
+constexpr uint64_t kMinStartMs = 150;
+constexpr uint64_t kMaxStartMs = 450;
+
+struct Params {
+  int nodes = 6;
+  int cameras = 300;
+  int standbyPercent = 20;
+  uint64_t heartbeatMs = 100;
+  uint64_t stallMs = 400;
+};
+
+struct Setting {
+  double threshold;
+  uint64_t acceptablePauseMs;
+};
+
+struct Result {
+  int falseFailures = 0;
+  int64_t detectMs = -1;
+  size_t lost = 0;
+  size_t promoted = 0;
+  std::vector<uint64_t> gaps;          // measured, cameras without standby
+  std::vector<uint64_t> reportedGaps;  // from FailoverReport, same cameras
+  uint64_t standbyGapMax = 0;          // measured, cameras with standby
+  size_t ungapped = 0;                 // lost cameras never recovered
+  uint64_t otherGapMs = 0;             // any other camera unrecorded, summed
+};
+
+class Scenario;
+
+class LoopbackNode : public nvr::NodeAgent {
+ public:
+  LoopbackNode(Scenario* scenario, std::string id, const nvr::SocketAddress& coordinator,
+               uint64_t heartbeatMs);
+
+  void startRecording(const std::string& cameraId) override;
+  void stopRecording(const std::string& cameraId) override;
+
+  int start() { return sender_.start(); }
+  void stall(uint64_t ms);
+  void kill();
+  // Confirms every camera still recorded, after rejoining.
+  void reconfirm();
+
+  const std::string& id() const { return id_; }
+  bool alive() const { return alive_; }
+  const std::set<std::string>& recording() const { return recording_; }
+
+ private:
+  nvr::NodeStatus status() const;
+
+  Scenario* scenario_;
+  const std::string id_;
+  nvr::HeartbeatSender sender_;
+  bool alive_ = true;
+  std::set<std::string> recording_;
+  std::set<std::string> starting_;
+};
+
+class Scenario {
+ public:
+  Scenario(const Params& params, const Setting& setting, uint32_t seed)
+      : params_(params), rng_(seed) {
+    nvr::HeartbeatMonitorOptions options;
+    options.detector.threshold = setting.threshold;
+    options.detector.acceptablePauseMs = setting.acceptablePauseMs;
+    options.detector.firstIntervalMs = params.heartbeatMs;
+    monitor_.reset(new nvr::HeartbeatMonitor(
+        &loop_, options,
+        [this](const nvr::NodeStatus& status, bool joined) { onStatus(status, joined); },
+        [this](const std::string& nodeId, uint64_t lastSeenMs) {
+          onFailure(nodeId, lastSeenMs);
+        }));
+    scheduler_.setFailoverHandler([this](const nvr::FailoverReport& report) {
+      if (report.fromNode == victim_ && !report.standby)
+        reported_[report.cameraId] = report.gapMs();
+    });
+  }
+
+  Result run() {
+    int port = monitor_->start(0);
+    if (port < 0) {
+      fprintf(stderr, "heartbeat monitor: %d\n", port);
+      exit(1);
+    }
+    nvr::SocketAddress coordinator;
+    nvr::resolveAddress("127.0.0.1", static_cast<uint16_t>(port), &coordinator);
+
+    std::discrete_distribution<int> mix({60, 30, 10});
+    const uint64_t rates[] = {2000000, 4000000, 8000000};
+    for (int i = 0; i < params_.cameras; ++i) {
+      std::string id = "cam-" + std::to_string(i);
+      bool standby = static_cast<int>(rng_() % 100) < params_.standbyPercent;
+      if (standby) standbyCameras_.insert(id);
+      scheduler_.addCamera(id, rates[mix(rng_)], standby);
+    }
+    for (int i = 0; i < params_.nodes; ++i) {
+      std::string id = "node-" + std::to_string(i);
+      nodes_[id].reset(new LoopbackNode(this, id, coordinator, params_.heartbeatMs));
+    }
+    loop_.post([this] {
+      for (auto& kv : nodes_) kv.second->start();
+      loop_.runEvery(kRebalanceMs, [this] { scheduler_.rebalance(); });
+      loop_.runEvery(kSampleMs, [this] { sample(); });
+      loop_.runAfter(kWarmupMs, [this] { stallOne(); });
+      loop_.runAfter(kKillAtMs, [this] { killOne(); });
+      loop_.runAfter(kEndMs, [this] { loop_.quit(); });
+    });
+    loop_.run();
+    monitor_->stop();
+    finish();
+    return result_;
+  }
+
+  uint64_t nowMs() const { return loop_.nowMs(); }
+  nvr::EventLoop* loop() { return &loop_; }
+  uint64_t startDelayMs() {
+    return kMinStartMs + rng_() % (kMaxStartMs - kMinStartMs + 1);
+  }
+  nvr::PlacementScheduler* scheduler() { return &scheduler_; }
+
+  // A node began recording cameraId: ends the camera's gap, if any.
+  void recorded(const std::string& cameraId) {
+    auto it = gapStart_.find(cameraId);
+    if (it == gapStart_.end()) return;
+    uint64_t gap = nowMs() - it->second;
+    if (standbyCameras_.count(cameraId)) {
+      result_.standbyGapMax = std::max(result_.standbyGapMax, gap);
+    } else {
+      measured_[cameraId] = gap;
+    }
+    gapStart_.erase(it);
+  }
+
+ private:
+  void onStatus(const nvr::NodeStatus& status, bool joined) {
+    auto node = nodes_.find(status.id);
+    if (node == nodes_.end() || !node->second->alive()) return;
+    if (!joined) {
+      scheduler_.updateNode(status);
+      return;
+    }
+    scheduler_.addNode(status, node->second.get());
+    node->second->reconfirm();
+    scheduler_.rebalance();
+  }
+
+  void onFailure(const std::string& nodeId, uint64_t lastSeenMs) {
+    if (nodeId == stalled_) ++result_.falseFailures;
+    if (nodeId == victim_ && result_.detectMs < 0)
+      result_.detectMs = static_cast<int64_t>(nowMs() - killMs_);
+    scheduler_.removeNode(nodeId, lastSeenMs);
+    // Re-pull at once rather than on the next rebalance tick.
+    scheduler_.rebalance();
+  }
+
+  // Every camera once recorded, other than the dead node's, must stay
+  // recorded through stalls, false failures and rejoins.
+  void sample() {
+    std::set<std::string> recorded;
+    for (auto& kv : nodes_)
+      recorded.insert(kv.second->recording().begin(), kv.second->recording().end());
+    for (const std::string& camera : recorded) everRecorded_.insert(camera);
+    for (const std::string& camera : everRecorded_)
+      if (!recorded.count(camera) && !victimCameras_.count(camera))
+        result_.otherGapMs += kSampleMs;
+  }
+
+  void stallOne() {
+    stalled_ = "node-0";
+    nodes_[stalled_]->stall(params_.stallMs);
+  }
+
+  void killOne() {
+    victim_ = "node-1";
+    LoopbackNode* node = nodes_[victim_].get();
+    killMs_ = nowMs();
+    // Cameras that lose their only recorder.
+    for (const std::string& camera : node->recording()) {
+      bool elsewhere = false;
+      for (auto& kv : nodes_)
+        if (kv.second.get() != node && kv.second->recording().count(camera)) elsewhere = true;
+      const std::string* owner = scheduler_.ownerOf(camera);
+      if (!owner || *owner != victim_) continue;
+      ++result_.lost;
+      victimCameras_.insert(camera);
+      if (elsewhere) {
+        ++result_.promoted;
+        continue;
+      }
+      gapStart_[camera] = killMs_;
+    }
+    node->kill();
+  }
+
+  void finish() {
+    for (const auto& kv : measured_) {
+      result_.gaps.push_back(kv.second);
+      auto it = reported_.find(kv.first);
+      if (it != reported_.end()) result_.reportedGaps.push_back(it->second);
+    }
+    result_.ungapped = gapStart_.size();
+  }
+
+  const Params params_;
+  std::mt19937 rng_;
+  nvr::EventLoop loop_;
+  nvr::PlacementScheduler scheduler_;
+  std::unique_ptr<nvr::HeartbeatMonitor> monitor_;
+  std::map<std::string, std::unique_ptr<LoopbackNode>> nodes_;
+  std::set<std::string> standbyCameras_;
+  std::set<std::string> victimCameras_;
+  std::set<std::string> everRecorded_;
+  std::map<std::string, uint64_t> gapStart_;
+  std::map<std::string, uint64_t> measured_;
+  std::map<std::string, uint64_t> reported_;
+  std::string stalled_;
+  std::string victim_;
+  uint64_t killMs_ = 0;
+  Result result_;
+};
+
+LoopbackNode::LoopbackNode(Scenario* scenario, std::string id,
+                           const nvr::SocketAddress& coordinator, uint64_t heartbeatMs)
+    : scenario_(scenario),
+      id_(std::move(id)),
+      sender_(scenario->loop(), coordinator, heartbeatMs, [this] { return status(); }) {}
+
+void LoopbackNode::startRecording(const std::string& cameraId) {
+  if (!alive_ || recording_.count(cameraId) || !starting_.insert(cameraId).second) return;
+  scenario_->loop()->runAfter(scenario_->startDelayMs(), [this, cameraId] {
+    if (!alive_ || !starting_.erase(cameraId)) return;
+    recording_.insert(cameraId);
+    scenario_->recorded(cameraId);
+    scenario_->scheduler()->onRecording(id_, cameraId, scenario_->nowMs());
+  });
+}
+
+void LoopbackNode::stopRecording(const std::string& cameraId) {
+  recording_.erase(cameraId);
+  starting_.erase(cameraId);
+}
+
+void LoopbackNode::stall(uint64_t ms) {
+  sender_.stop();
+  scenario_->loop()->runAfter(ms, [this] {
+    if (alive_) sender_.start();
+  });
+}
+
+void LoopbackNode::kill() {
+  alive_ = false;
+  sender_.stop();
+  recording_.clear();
+  starting_.clear();
+}
+
+void LoopbackNode::reconfirm() {
+  std::vector<std::string> cameras(recording_.begin(), recording_.end());
+  for (const std::string& camera : cameras)
+    scenario_->scheduler()->onRecording(id_, camera, scenario_->nowMs());
+}
+
+nvr::NodeStatus LoopbackNode::status() const {
+  nvr::NodeStatus status;
+  status.id = id_;
+  status.diskBandwidthBps = 1600000000;
+  status.freeBytes = 4ull << 40;
+  return status;
+}
+
+uint64_t percentile(std::vector<uint64_t> values, double q) {
+  if (values.empty()) return 0;
+  std::sort(values.begin(), values.end());
+  return values[static_cast<size_t>(q * (values.size() - 1))];
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Params params;
+  if (argc > 1) params.nodes = atoi(argv[1]);
+  if (argc > 2) params.cameras = atoi(argv[2]);
+  if (argc > 3) params.standbyPercent = atoi(argv[3]);
+  if (argc > 4) params.heartbeatMs = static_cast<uint64_t>(atoll(argv[4]));
+  if (argc > 5) params.stallMs = static_cast<uint64_t>(atoll(argv[5]));
+  if (params.nodes < 3 || params.cameras <= 0 || params.heartbeatMs == 0) {
+    fprintf(stderr, "usage: %s [nodes >= 3] [cameras] [standby-percent] [heartbeat-ms] "
+                    "[stall-ms]\n", argv[0]);
+    return 2;
+  }
+  nvr::setLogLevel(nvr::LogLevel::Error);
+
+  printf("%d nodes, %d cameras (%d%% with standby), heartbeat %llu ms, stall %llu ms\n",
+         params.nodes, params.cameras, params.standbyPercent,
+         static_cast<unsigned long long>(params.heartbeatMs),
+         static_cast<unsigned long long>(params.stallMs));
+  printf("%5s %7s %6s %8s %6s %8s %14s %14s %12s %11s %11s\n", "phi", "pause", "false",
+         "detect", "lost", "standby", "gap p50/max", "reported max", "standby gap", "unrecovered",
+         "other gaps");
+  const Setting settings[] = {{3, 0}, {8, 0}, {8, 300}, {12, 600}};
+  for (const Setting& setting : settings) {
+    Scenario scenario(params, setting, 1);
+    Result r = scenario.run();
+    char gap[32];
+    snprintf(gap, sizeof(gap), "%llu/%llu ms",
+             static_cast<unsigned long long>(percentile(r.gaps, 0.5)),
+             static_cast<unsigned long long>(percentile(r.gaps, 1.0)));
+    char detect[32];
+    if (r.detectMs >= 0)
+      snprintf(detect, sizeof(detect), "%lld ms", static_cast<long long>(r.detectMs));
+    else
+      snprintf(detect, sizeof(detect), "never");
+    printf("%5.0f %4llu ms %6d %8s %6zu %8zu %14s %11llu ms %9llu ms %11zu %8llu ms\n",
+           setting.threshold, static_cast<unsigned long long>(setting.acceptablePauseMs),
+           r.falseFailures, detect, r.lost, r.promoted, gap,
+           static_cast<unsigned long long>(percentile(r.reportedGaps, 1.0)),
+           static_cast<unsigned long long>(r.standbyGapMax), r.ungapped,
+           static_cast<unsigned long long>(r.otherGapMs));
+  }
+  return 0;
+}
@@ -0,0 +1,281 @@
+// Time to first frame for live viewers, with and without the GOP cache.
+//
+// A synthetic camera publishes H.264 over RTP into a StreamRelay in real
+// time: 25 fps and a keyframe every 2 s, sent as SPS, PPS and an IDR
+// fragmented with FU-A. Viewers join at random moments as RTSP-interleaved
+// TCP subscribers (socketpairs). A client thread plays each one the way an
+// RTSP player does: it depacketizes what arrives and times the interval
+// from joining to the first frame it could decode, which is a keyframe with
+// its parameter sets. Without the cache that is the next keyframe. With
+// it, the cached one is sent on joining. Also reported: the bytes a viewer
+// read up to that frame, and the cache's footprint, sampled every frame.
+//
+//   bench_gop_cache [viewers] [seconds] [kbps]
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/event_loop.h"
+#include "base/packet_buffer.h"
+#include "media/frame_assembler.h"
+#include "media/rtp_depacketizer.h"
+#include "relay/stream_relay.h"
+
+namespace {
+
+constexpr int kFps = 25;
+constexpr int kGopFrames = 50;
+constexpr size_t kMaxPayload = 1400;
+constexpr uint32_t kTimestampStep = 90000 / kFps;
+
+int64_t nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+double percentile(std::vector<double> v, double p) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+// Packetizes synthetic H.264 frames (RFC 6184, non-interleaved mode).
+class Camera {
+ public:
+  Camera(nvr::StreamRelay* relay, nvr::PacketPool* pool, int kbps) : relay_(relay), pool_(pool) {
+    size_t gopBytes = static_cast<size_t>(kbps) * 125 * kGopFrames / kFps;
+    keyBytes_ = gopBytes / 3;
+    deltaBytes_ = (gopBytes - keyBytes_) / (kGopFrames - 1);
+  }
+
+  void sendFrame() {
+    bool key = frame_ % kGopFrames == 0;
+    if (key) {
+      static const uint8_t kSps[] = {0x67, 0x42, 0xc0, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8};
+      static const uint8_t kPps[] = {0x68, 0xce, 0x3c, 0x80};
+      sendNal(kSps, sizeof(kSps), false);
+      sendNal(kPps, sizeof(kPps), false);
+    }
+    std::vector<uint8_t>& nal = scratch_;
+    nal.assign(key ? keyBytes_ : deltaBytes_, 0x5a);
+    nal[0] = key ? 0x65 : 0x41;
+    sendNal(nal.data(), nal.size(), true);
+    relay_->flush();
+    timestamp_ += kTimestampStep;
+    ++frame_;
+  }
+
+ private:
+  void sendNal(const uint8_t* nal, size_t size, bool last) {
+    if (size <= kMaxPayload) {
+      sendPacket(nal, size, nullptr, 0, last);
+      return;
+    }
+    // FU-A: indicator and header replace the NAL header byte.
+    uint8_t indicator = static_cast<uint8_t>((nal[0] & 0xe0) | 28);
+    size_t offset = 1;
+    while (offset < size) {
+      size_t n = std::min(kMaxPayload - 2, size - offset);
+      uint8_t fu[2] = {indicator, static_cast<uint8_t>(nal[0] & 0x1f)};
+      if (offset == 1) fu[1] |= 0x80;
+      if (offset + n == size) fu[1] |= 0x40;
+      sendPacket(fu, 2, nal + offset, n, last && offset + n == size);
+      offset += n;
+    }
+  }
+
+  void sendPacket(const uint8_t* head, size_t headSize, const uint8_t* body, size_t bodySize,
+                  bool marker) {
+    nvr::PacketBuffer* buffer = pool_->acquire();
+    uint8_t* p = buffer->data();
+    p[0] = 0x80;
+    p[1] = static_cast<uint8_t>(96 | (marker ? 0x80 : 0));
+    p[2] = static_cast<uint8_t>(sequence_ >> 8);
+    p[3] = static_cast<uint8_t>(sequence_);
+    for (int i = 0; i < 4; ++i) p[4 + i] = static_cast<uint8_t>(timestamp_ >> (24 - 8 * i));
+    memset(p + 8, 0x11, 4);
+    memcpy(p + 12, head, headSize);
+    if (bodySize) memcpy(p + 12 + headSize, body, bodySize);
+    ++sequence_;
+    uint32_t size = static_cast<uint32_t>(12 + headSize + bodySize);
+    relay_->publish(0, false, nvr::PacketRef::adopt(buffer, 0, size));
+  }
+
+  nvr::StreamRelay* relay_;
+  nvr::PacketPool* pool_;
+  std::vector<uint8_t> scratch_;
+  size_t keyBytes_;
+  size_t deltaBytes_;
+  uint64_t frame_ = 0;
+  uint16_t sequence_ = 0;
+  uint32_t timestamp_ = 0;
+};
+
+// Client side of one viewer: reads interleaved RTP until a decodable frame.
+class Viewer : public nvr::EventHandler, public nvr::FrameHandler {
+ public:
+  Viewer(nvr::EventLoop* loop, int fd, int64_t joinedUs, std::function<void(Viewer*)> done)
+      : loop_(loop),
+        fd_(fd),
+        joinedUs_(joinedUs),
+        done_(std::move(done)),
+        assembler_(nvr::VideoCodec::H264, this),
+        depacketizer_(nvr::VideoCodec::H264, &assembler_) {}
+  ~Viewer() override { ::close(fd_); }
+
+  void onEvents(uint32_t) override {
+    if (finished_) return;
+    for (;;) {
+      ssize_t n = input_.readFd(fd_);
+      if (n <= 0) break;
+      bytes_ += static_cast<uint64_t>(n);
+    }
+    while (!finished_ && input_.size() >= 4) {
+      const uint8_t* p = input_.data();
+      size_t length = static_cast<size_t>(p[2] << 8 | p[3]);
+      if (input_.size() < 4 + length) break;
+      if (p[1] == 0) depacketizer_.push(p + 4, length);
+      input_.consume(4 + length);
+    }
+  }
+
+  void onFrame(const nvr::Frame& frame) override {
+    if (finished_ || !frame.keyframe ||
+        !assembler_.parameterSets().complete(nvr::VideoCodec::H264))
+      return;
+    finished_ = true;
+    firstFrameUs_ = nowUs() - joinedUs_;
+    loop_->remove(fd_);
+    done_(this);
+  }
+
+  int64_t firstFrameUs() const { return firstFrameUs_; }
+  uint64_t bytes() const { return bytes_; }
+
+ private:
+  nvr::EventLoop* loop_;
+  int fd_;
+  int64_t joinedUs_;
+  std::function<void(Viewer*)> done_;
+  nvr::FrameAssembler assembler_;
+  nvr::RtpDepacketizer depacketizer_;
+  nvr::ByteBuffer input_{256 * 1024};
+  uint64_t bytes_ = 0;
+  bool finished_ = false;
+  int64_t firstFrameUs_ = 0;
+};
+
+struct Result {
+  std::vector<double> ttffMs;
+  std::vector<double> burstKB;
+  double cacheKBAvg = 0;
+  double cacheKBMax = 0;
+  double pinnedKBMax = 0;
+  uint64_t drops = 0;
+};
+
+Result run(int viewers, int seconds, int kbps, bool gopCache) {
+  nvr::EventLoop loop;
+  nvr::EventLoop clientLoop;
+  std::thread client([&] { clientLoop.run(); });
+  // Outlives the relay, whose cache and subscribers hold its buffers.
+  nvr::PacketPool pool(nvr::PacketPools::kDatagramSize, 256);
+  nvr::StreamRelay relay(&loop);
+  if (gopCache) relay.enableGopCache(0, nvr::VideoCodec::H264);
+  Camera camera(&relay, &pool, kbps);
+
+  Result result;
+  int finished = 0;
+  double cacheSum = 0;
+  uint64_t samples = 0;
+  // Joins spread over the run, after the first GOP is out.
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<uint64_t> joinAt(2500, seconds * 1000ULL);
+  for (int i = 0; i < viewers; ++i) {
+    loop.runAfter(joinAt(rng), [&] {
+      int sv[2];
+      socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv);
+      int size = 4 << 20;
+      setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+      setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+      int64_t joined = nowUs();
+      clientLoop.post([&, fd = sv[1], joined] {
+        auto* viewer = new Viewer(&clientLoop, fd, joined, [&](Viewer* v) {
+          double ttff = v->firstFrameUs() / 1000.0;
+          double kb = v->bytes() / 1024.0;
+          clientLoop.deleteLater(v);
+          loop.post([&, ttff, kb] {
+            result.ttffMs.push_back(ttff);
+            result.burstKB.push_back(kb);
+            ++finished;
+          });
+        });
+        clientLoop.add(fd, EPOLLIN, viewer);
+      });
+      auto* sub = new nvr::TcpRelaySubscriber(&loop, sv[0], relay.mutableStats());
+      relay.addSubscriber(std::unique_ptr<nvr::RelaySubscriber>(sub));
+    });
+  }
+
+  std::function<void()> tick = [&] {
+    camera.sendFrame();
+    const nvr::RelayStats& s = relay.stats();
+    cacheSum += s.gopCacheBytes / 1024.0;
+    ++samples;
+    result.cacheKBMax = std::max(result.cacheKBMax, s.gopCacheBytes / 1024.0);
+    result.pinnedKBMax = std::max(result.pinnedKBMax, s.gopCachePinnedBytes / 1024.0);
+    if (finished == viewers) {
+      loop.quit();
+      return;
+    }
+    loop.runAfter(1000 / kFps, tick);
+  };
+  loop.post(tick);
+  loop.run();
+  clientLoop.quit();
+  client.join();
+  result.cacheKBAvg = samples ? cacheSum / samples : 0;
+  result.drops = relay.stats().drops;
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  // Viewers hang up once they have their first frame.
+  signal(SIGPIPE, SIG_IGN);
+  int viewers = argc > 1 ? atoi(argv[1]) : 200;
+  int seconds = argc > 2 ? atoi(argv[2]) : 10;
+  int kbps = argc > 3 ? atoi(argv[3]) : 4096;
+  if (viewers <= 0 || seconds < 3 || kbps <= 0) {
+    fprintf(stderr, "usage: bench_gop_cache [viewers] [seconds >= 3] [kbps]\n");
+    return 2;
+  }
+  printf("%d viewers joining over %d s, %d kbps H.264, %d fps, keyframe every %d ms\n\n",
+         viewers, seconds, kbps, kFps, kGopFrames * 1000 / kFps);
+  printf("%-10s %9s %9s %9s %9s %11s %11s %11s %8s\n", "gop cache", "ttff p50", "ttff p99",
+         "ttff max", "read KB", "cache avg", "cache max", "pinned max", "drops");
+  for (bool gopCache : {false, true}) {
+    Result r = run(viewers, seconds, kbps, gopCache);
+    printf("%-10s %7.1fms %7.1fms %7.1fms %9.0f %9.0fKB %9.0fKB %9.0fKB %8llu\n",
+           gopCache ? "on" : "off", percentile(r.ttffMs, 0.5), percentile(r.ttffMs, 0.99),
+           percentile(r.ttffMs, 1.0), percentile(r.burstKB, 0.5), r.cacheKBAvg, r.cacheKBMax,
+           r.pinnedKBMax, static_cast<unsigned long long>(r.drops));
+  }
+  return 0;
+}
@@ -0,0 +1,354 @@
+// Storage I/O backend benchmark: recording and replay on one disk.
+//
+// For each backend, records a fleet of writers (one stream each, 25 fps,
+// a keyframe every 2 s) in real time through SegmentWriter groups on one
+// loop thread, while replay readers on a second loop each read a random
+// chunk (O_DIRECT) of a pre-written archive file every 40 ms, as a reader
+// replaying at a few times real time would.
+// Reports what recording cost (CPU seconds per GB written, across every
+// thread of the process, and how much was dropped) and the replay read
+// latency the readers saw under that write load.
+//
+//   bench_io [dir] [writers] [readers] [seconds] [kbps]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "storage/aligned_buffer.h"
+#include "storage/file_util.h"
+#include "storage/recording_store.h"
+
+namespace {
+
+constexpr int kFps = 25;
+constexpr int kGopFrames = 50;
+constexpr int kKeyframeWeight = 8;
+constexpr int kGroups = 8;
+constexpr uint64_t kArchiveSize = 256ull << 20;
+constexpr size_t kReadSize = 256 << 10;
+constexpr uint64_t kReadIntervalMs = 40;
+
+struct Options {
+  std::string dir;
+  int writers;
+  int readers;
+  int seconds;
+  int kbps;
+};
+
+struct Result {
+  nvr::IoStats io;
+  nvr::SegmentWriterStats writers;
+  double cpuSeconds = 0;
+  double wallSeconds = 0;
+  std::vector<double> readUs;
+  uint64_t readErrors = 0;
+};
+
+double cpuSeconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+double percentile(std::vector<double>* v, double p) {
+  if (v->empty()) return 0;
+  size_t i = std::min(v->size() - 1, static_cast<size_t>(p * static_cast<double>(v->size())));
+  std::nth_element(v->begin(), v->begin() + static_cast<long>(i), v->end());
+  return (*v)[i];
+}
+
+void removeRecordings(const std::string& dir) {
+  std::vector<std::string> groups;
+  nvr::listDirectory(dir, &groups);
+  for (const auto& group : groups) {
+    std::string groupDir = nvr::joinPath(dir, group);
+    std::vector<std::string> names;
+    nvr::listDirectory(groupDir, &names);
+    for (const auto& name : names) unlink(nvr::joinPath(groupDir, name).c_str());
+    rmdir(groupDir.c_str());
+  }
+  rmdir(dir.c_str());
+}
+
+// The file replay reads from; written once and reused.
+std::string prepareArchive(const std::string& dir) {
+  std::string path = nvr::joinPath(dir, "archive.dat");
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && static_cast<uint64_t>(st.st_size) == kArchiveSize)
+    return path;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return std::string();
+  std::vector<uint8_t> block(1 << 20);
+  std::mt19937 rng(7);
+  for (auto& b : block) b = static_cast<uint8_t>(rng());
+  for (uint64_t off = 0; off < kArchiveSize; off += block.size()) {
+    if (pwrite(fd, block.data(), block.size(), static_cast<off_t>(off)) !=
+        static_cast<ssize_t>(block.size())) {
+      close(fd);
+      return std::string();
+    }
+  }
+  fsync(fd);
+  close(fd);
+  return path;
+}
+
+// Appends every writer's frames in real time on the recording loop.
+class Recorder {
+ public:
+  Recorder(const Options& options, nvr::RecordingStore* store, nvr::EventLoop* loop)
+      : options_(options), loop_(loop) {
+    size_t unit = static_cast<size_t>(options.kbps) * 125 * kGopFrames / kFps /
+                  (kGopFrames - 1 + kKeyframeWeight);
+    frame_.assign(unit * kKeyframeWeight, 0x5a);
+    pFrameSize_ = unit;
+    for (int g = 0; g < kGroups; ++g) {
+      writers_.push_back(store->createWriter(loop, "group-" + std::to_string(g)));
+      writers_.back()->open();
+    }
+    for (int w = 0; w < options.writers; ++w) {
+      nvr::StreamInfo info;
+      info.cameraId = "cam" + std::to_string(w);
+      info.codec = "H264";
+      info.clockRate = 90000;
+      nvr::SegmentWriter* writer = writers_[w % kGroups].get();
+      streams_.push_back(writer->addStream(info));
+      streamWriters_.push_back(writer);
+    }
+  }
+
+  void start() {
+    startMs_ = loop_->nowMs();
+    timer_ = loop_->runEvery(1000 / kFps, [this] { tick(); });
+  }
+
+  void stop(std::function<void()> done) {
+    loop_->cancel(timer_);
+    auto pending = std::make_shared<size_t>(writers_.size());
+    for (auto& writer : writers_) {
+      nvr::SegmentWriter* w = writer.get();
+      w->close([this, w, pending, done] {
+        stats_.add(w->stats());
+        if (--*pending == 0) done();
+      });
+    }
+  }
+
+  const nvr::SegmentWriterStats& stats() const { return stats_; }
+
+ private:
+  void tick() {
+    // Catch up on ticks a busy loop delayed, so the offered load holds.
+    int64_t due = static_cast<int64_t>(loop_->nowMs() - startMs_) * kFps / 1000;
+    int64_t frameUs = 1000000 / kFps;
+    for (; nextFrame_ <= due; ++nextFrame_) {
+      int64_t ts = 1700000000ll * 1000000 + nextFrame_ * frameUs;
+      for (int w = 0; w < options_.writers; ++w) {
+        bool keyframe = (nextFrame_ + w) % kGopFrames == 0;
+        streamWriters_[w]->append(streams_[w], nvr::RecordType::Video,
+                                  keyframe ? nvr::kRecordKeyframe : 0, ts, frame_.data(),
+                                  keyframe ? frame_.size() : pFrameSize_);
+      }
+    }
+  }
+
+  Options options_;
+  nvr::EventLoop* loop_;
+  std::vector<std::unique_ptr<nvr::SegmentWriter>> writers_;
+  std::vector<nvr::SegmentWriter*> streamWriters_;
+  std::vector<uint32_t> streams_;
+  std::vector<uint8_t> frame_;
+  size_t pFrameSize_ = 0;
+  uint64_t startMs_ = 0;
+  int64_t nextFrame_ = 0;
+  nvr::EventLoop::TimerId timer_ = 0;
+  nvr::SegmentWriterStats stats_;
+};
+
+// Replay readers, each reading one chunk per interval; a reader whose read
+// is still in flight when the next is due issues it on completion.
+class Readers {
+ public:
+  Readers(int count, int fd, nvr::IoBackend* io, nvr::EventLoop* loop)
+      : fd_(fd), io_(io), loop_(loop), rng_(11) {
+    for (int i = 0; i < count; ++i) {
+      buffers_.emplace_back(new nvr::AlignedBuffer(kReadSize));
+      io_->registerBuffer(buffers_.back()->data(), kReadSize);
+    }
+    due_.resize(buffers_.size());
+    busy_.resize(buffers_.size());
+  }
+
+  ~Readers() {
+    for (auto& buffer : buffers_) io_->unregisterBuffer(buffer->data());
+  }
+
+  void start() {
+    uint64_t now = loop_->nowMs();
+    for (size_t i = 0; i < due_.size(); ++i) due_[i] = now + i * kReadIntervalMs / due_.size();
+    timer_ = loop_->runEvery(1, [this] { tick(); });
+  }
+
+  // Stops issuing; done runs once the last read completed.
+  void stop(std::function<void()> done) {
+    loop_->cancel(timer_);
+    stopping_ = true;
+    done_ = std::move(done);
+    if (inFlight_ == 0) done_();
+  }
+
+  std::vector<double>* latencies() { return &latencies_; }
+  uint64_t errors() const { return errors_; }
+
+ private:
+  void tick() {
+    uint64_t now = loop_->nowMs();
+    for (size_t i = 0; i < due_.size(); ++i) {
+      if (busy_[i] || now < due_[i]) continue;
+      due_[i] += kReadIntervalMs;
+      issue(i);
+    }
+  }
+
+  void issue(size_t i) {
+    uint64_t blocks = (kArchiveSize - kReadSize) / nvr::kBlockAlign;
+    uint64_t offset = rng_() % blocks * nvr::kBlockAlign;
+    auto start = std::chrono::steady_clock::now();
+    ++inFlight_;
+    busy_[i] = true;
+    io_->read(fd_, buffers_[i]->data(), kReadSize, offset, loop_, [this, i, start](int64_t n) {
+      --inFlight_;
+      busy_[i] = false;
+      latencies_.push_back(std::chrono::duration<double, std::micro>(
+                               std::chrono::steady_clock::now() - start)
+                               .count());
+      if (n != static_cast<int64_t>(kReadSize)) ++errors_;
+      if (stopping_ && inFlight_ == 0) done_();
+    });
+  }
+
+  int fd_;
+  nvr::IoBackend* io_;
+  nvr::EventLoop* loop_;
+  std::mt19937_64 rng_;
+  std::vector<std::unique_ptr<nvr::AlignedBuffer>> buffers_;
+  std::vector<uint64_t> due_;
+  std::vector<bool> busy_;
+  nvr::EventLoop::TimerId timer_ = 0;
+  std::vector<double> latencies_;
+  uint64_t errors_ = 0;
+  size_t inFlight_ = 0;
+  bool stopping_ = false;
+  std::function<void()> done_;
+};
+
+bool run(const Options& options, nvr::IoBackendKind kind, const std::string& archive,
+         Result* result) {
+  std::string dir = nvr::joinPath(options.dir, nvr::ioBackendKindName(kind));
+  nvr::SegmentWriterOptions defaults;
+  defaults.dir = dir;
+  defaults.segmentSize = 64 << 20;
+  defaults.blockSize = 64 << 10;
+  nvr::IoBackendOptions io;
+  io.kind = kind;
+  io.maxBuffers = 4096;
+  io.maxRegisteredBytes = 512 << 20;
+  nvr::RecordingStore store(defaults, io);
+  if (store.start() < 0) return false;
+  int fd = open(archive.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+  if (fd < 0) return false;
+  store.io()->registerFile(fd);
+
+  nvr::EventLoop recordLoop;
+  nvr::EventLoop replayLoop;
+  Recorder recorder(options, &store, &recordLoop);
+  Readers readers(options.readers, fd, store.io(), &replayLoop);
+  std::thread replayThread([&] { replayLoop.run(); });
+
+  double cpu = cpuSeconds();
+  auto start = std::chrono::steady_clock::now();
+  recordLoop.post([&] { recorder.start(); });
+  replayLoop.post([&] { readers.start(); });
+  recordLoop.runAfter(static_cast<uint64_t>(options.seconds) * 1000, [&] {
+    replayLoop.post([&] { readers.stop([&] { replayLoop.quit(); }); });
+    recorder.stop([&] { recordLoop.quit(); });
+  });
+  recordLoop.run();
+  replayThread.join();
+  result->wallSeconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  result->cpuSeconds = cpuSeconds() - cpu;
+  store.io()->unregisterFile(fd);
+  store.stop();
+  close(fd);
+  result->io = store.io()->stats();
+  result->writers = recorder.stats();
+  result->readUs = std::move(*readers.latencies());
+  result->readErrors = readers.errors();
+  removeRecordings(dir);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  options.dir = argc > 1 ? argv[1] : "/tmp/nvr_bench_io";
+  options.writers = argc > 2 ? atoi(argv[2]) : 2000;
+  options.readers = argc > 3 ? atoi(argv[3]) : 50;
+  options.seconds = argc > 4 ? atoi(argv[4]) : 10;
+  options.kbps = argc > 5 ? atoi(argv[5]) : 256;
+  if (options.writers <= 0 || options.readers < 0 || options.seconds <= 0 || options.kbps <= 0) {
+    fprintf(stderr, "usage: %s [dir] [writers] [readers] [seconds] [kbps]\n", argv[0]);
+    return 2;
+  }
+  if (nvr::makeDirectories(options.dir) < 0) {
+    fprintf(stderr, "cannot create %s\n", options.dir.c_str());
+    return 1;
+  }
+  std::string archive = prepareArchive(options.dir);
+  if (archive.empty()) {
+    fprintf(stderr, "cannot write the replay archive in %s\n", options.dir.c_str());
+    return 1;
+  }
+
+  printf("%d writers at %d kbps in %d groups, %d replay readers (%zu KB every %llu ms), %d s\n",
+         options.writers, options.kbps, kGroups, options.readers, kReadSize >> 10,
+         static_cast<unsigned long long>(kReadIntervalMs), options.seconds);
+  printf("%-8s %8s %9s %8s %9s %10s %9s %9s %9s %9s %9s\n", "backend", "MB/s", "writes/s",
+         "fixed %", "dropped", "CPU s/GB", "reads/s", "p50 us", "p99 us", "p999 us", "errors");
+  for (auto kind : {nvr::IoBackendKind::Threads, nvr::IoBackendKind::Uring}) {
+    Result r;
+    if (!run(options, kind, archive, &r)) {
+      printf("%-8s unavailable\n", nvr::ioBackendKindName(kind));
+      continue;
+    }
+    double gb = static_cast<double>(r.writers.bytesWritten) / 1e9;
+    double ops = static_cast<double>(r.io.writes + r.io.reads);
+    size_t reads = r.readUs.size();
+    printf("%-8s %8.1f %9.0f %8.1f %9llu %10.2f %9.0f %9.0f %9.0f %9.0f %9llu\n",
+           nvr::ioBackendKindName(kind), r.writers.bytesWritten / 1e6 / r.wallSeconds,
+           static_cast<double>(r.io.writes) / r.wallSeconds,
+           ops > 0 ? 100.0 * static_cast<double>(r.io.fixedOps) / ops : 0.0,
+           static_cast<unsigned long long>(r.writers.droppedRecords),
+           gb > 0 ? r.cpuSeconds / gb : 0.0, static_cast<double>(reads) / r.wallSeconds,
+           percentile(&r.readUs, 0.5), percentile(&r.readUs, 0.99),
+           percentile(&r.readUs, 0.999), static_cast<unsigned long long>(r.readErrors));
+  }
+  return 0;
+}
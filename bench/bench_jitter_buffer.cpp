@@ -0,0 +1,326 @@
+// RTP over a lossy WAN: what the reorder buffer saves, and what it costs.
+//
+// A synthetic H.264 camera (25 fps, a keyframe every 2 s, FU-A fragments)
+// sends [seconds] of video through a simulated network: a base delay plus
+// a queueing delay that wanders (the queue keeps packets in order), single
+// packets that take a slower path, occasional spikes that hold up a whole
+// run of packets, and [loss] per mille random loss. The same arrivals are
+// played, on a simulated clock, through each configuration into a
+// depacketizer and frame assembler, and the frames are counted the way the
+// recorder does: a corrupt frame, and everything after it up to the next
+// keyframe, is not recordable.
+//
+// Reported per configuration: recordable frames, corrupt frames, packets
+// given up on (against the loss injected) and late, and the latency the
+// buffer added to each packet. Then the buffer's own cost per packet, in
+// order and on the lossy stream, and the heap allocations it made.
+//
+//   bench_jitter_buffer [seconds] [loss per mille]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <random>
+#include <vector>
+
+#include "base/packet_buffer.h"
+#include "media/frame_assembler.h"
+#include "media/rtp_depacketizer.h"
+#include "rtp/rtp_jitter_buffer.h"
+#include "rtp/rtp_receive_stats.h"
+
+namespace {
+
+size_t gAllocations = 0;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  ++gAllocations;
+  if (void* p = malloc(size)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+namespace {
+
+constexpr int kFps = 25;
+constexpr int kGopFrames = 50;
+constexpr size_t kMaxPayload = 1200;
+constexpr uint32_t kTimestampStep = 90000 / kFps;
+constexpr int64_t kFrameUs = 1000000 / kFps;
+constexpr int64_t kPacketGapUs = 150;  // sender pacing within a frame
+
+// Network: 40 ms base and up to 15 ms of queueing; 0.5% of packets
+// detour by 1 to 40 ms, and 0.05% start a 3 ms spike of 5 to 80 ms.
+constexpr int64_t kBaseDelayUs = 40000;
+constexpr int64_t kMaxQueueUs = 15000;
+constexpr int kDetourPerTenThousand = 50;
+constexpr int kSpikePerTenThousand = 5;
+
+struct Sent {
+  nvr::PacketRef packet;
+  nvr::RtpHeader header;
+  int64_t arrivalUs;
+};
+
+double nowMs() {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+double percentile(std::vector<double> v, double p) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+// Camera and network. Returns what arrived, in arrival order.
+std::vector<Sent> simulate(nvr::PacketPool* pool, int seconds, int lossPerMille,
+                           uint64_t* sentPackets, uint64_t* frames) {
+  std::mt19937_64 rng(5);
+  std::uniform_int_distribution<int> perTenThousand(0, 9999);
+  std::normal_distribution<double> queueStep(0, 300);
+  std::uniform_int_distribution<int64_t> detour(1000, 40000);
+  std::uniform_int_distribution<int64_t> spike(5000, 80000);
+  const size_t keyBytes = 50000, deltaBytes = 7000;  // about 2 Mbit/s
+
+  std::vector<Sent> arrived;
+  uint16_t sequence = 0;
+  int64_t spikeUntilUs = 0, spikeUs = 0;
+  double queueUs = 0;
+  int64_t queueOutUs = 0;  // when the queue last let a packet out
+  std::vector<uint8_t> nal;
+  *frames = static_cast<uint64_t>(seconds) * kFps;
+  for (uint64_t f = 0; f < *frames; ++f) {
+    bool key = f % kGopFrames == 0;
+    nal.assign(key ? keyBytes : deltaBytes, 0x5a);
+    nal[0] = key ? 0x65 : 0x41;
+    int64_t sendUs = static_cast<int64_t>(f) * kFrameUs;
+    uint32_t timestamp = static_cast<uint32_t>(f * kTimestampStep);
+    std::vector<std::vector<uint8_t>> payloads;
+    if (key) {
+      payloads.push_back({0x67, 0x42, 0xc0, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8});
+      payloads.push_back({0x68, 0xce, 0x3c, 0x80});
+    }
+    uint8_t indicator = static_cast<uint8_t>((nal[0] & 0xe0) | 28);
+    for (size_t offset = 1; offset < nal.size();) {
+      size_t n = std::min(kMaxPayload - 2, nal.size() - offset);
+      std::vector<uint8_t> payload = {indicator, static_cast<uint8_t>(nal[0] & 0x1f)};
+      if (offset == 1) payload[1] |= 0x80;
+      if (offset + n == nal.size()) payload[1] |= 0x40;
+      payload.insert(payload.end(), nal.begin() + offset, nal.begin() + offset + n);
+      payloads.push_back(std::move(payload));
+      offset += n;
+    }
+    for (size_t i = 0; i < payloads.size(); ++i, sendUs += kPacketGapUs) {
+      nvr::PacketBuffer* buffer = pool->acquire();
+      uint8_t* p = buffer->data();
+      bool marker = i + 1 == payloads.size();
+      p[0] = 0x80;
+      p[1] = static_cast<uint8_t>(96 | (marker ? 0x80 : 0));
+      p[2] = static_cast<uint8_t>(sequence >> 8);
+      p[3] = static_cast<uint8_t>(sequence);
+      for (int b = 0; b < 4; ++b) p[4 + b] = static_cast<uint8_t>(timestamp >> (24 - 8 * b));
+      memset(p + 8, 0x11, 4);
+      memcpy(p + 12, payloads[i].data(), payloads[i].size());
+      ++sequence;
+      ++*sentPackets;
+      nvr::PacketRef packet =
+          nvr::PacketRef::adopt(buffer, 0, static_cast<uint32_t>(12 + payloads[i].size()));
+      if (perTenThousand(rng) < lossPerMille * 10) continue;
+      queueUs = std::min<double>(std::max<double>(queueUs + queueStep(rng), 0), kMaxQueueUs);
+      int64_t arrivalUs = std::max(sendUs + kBaseDelayUs + static_cast<int64_t>(queueUs),
+                                   queueOutUs + 10);
+      queueOutUs = arrivalUs;
+      // A spike holds up every packet sent while it lasts; a detour, one.
+      if (sendUs >= spikeUntilUs && perTenThousand(rng) < kSpikePerTenThousand) {
+        spikeUs = spike(rng);
+        spikeUntilUs = sendUs + 3000;
+      }
+      if (sendUs < spikeUntilUs) arrivalUs += spikeUs;
+      if (perTenThousand(rng) < kDetourPerTenThousand) arrivalUs += detour(rng);
+      Sent sent;
+      sent.packet = packet;
+      nvr::parseRtpHeader(packet.data(), packet.size(), &sent.header);
+      sent.arrivalUs = arrivalUs;
+      arrived.push_back(std::move(sent));
+    }
+  }
+  std::stable_sort(arrived.begin(), arrived.end(),
+                   [](const Sent& a, const Sent& b) { return a.arrivalUs < b.arrivalUs; });
+  return arrived;
+}
+
+// Depacketizes what comes out in order and counts frames as the recorder
+// would take them.
+class Sink : public nvr::RtpJitterBufferHandler, public nvr::FrameHandler {
+ public:
+  explicit Sink(const std::vector<int64_t>* arrivalBySequence)
+      : arrivalBySequence_(arrivalBySequence),
+        assembler_(nvr::VideoCodec::H264, this),
+        depacketizer_(nvr::VideoCodec::H264, &assembler_) {}
+
+  void setNow(int64_t nowUs) { nowUs_ = nowUs; }
+
+  void onOrderedRtp(int track, const nvr::PacketRef& packet, uint32_t lost) override {
+    uint16_t sequence = static_cast<uint16_t>(packet.data()[2] << 8 | packet.data()[3]);
+    addedMs_.push_back((nowUs_ - (*arrivalBySequence_)[sequence]) / 1000.0);
+    depacketizer_.push(packet.data(), packet.size());
+  }
+
+  void onFrame(const nvr::Frame& frame) override {
+    ++frames_;
+    if (frame.corrupt) {
+      ++corrupt_;
+      waiting_ = true;
+      return;
+    }
+    if (waiting_ && !frame.keyframe) return;
+    waiting_ = false;
+    ++recordable_;
+  }
+
+  uint64_t frames_ = 0;
+  uint64_t corrupt_ = 0;
+  uint64_t recordable_ = 0;
+  std::vector<double> addedMs_;
+
+ private:
+  const std::vector<int64_t>* arrivalBySequence_;
+  int64_t nowUs_ = 0;
+  bool waiting_ = true;
+  nvr::FrameAssembler assembler_;
+  nvr::RtpDepacketizer depacketizer_;
+};
+
+// Takes packets and counts them, for the buffer's own cost.
+class NullSink : public nvr::RtpJitterBufferHandler {
+ public:
+  void onOrderedRtp(int track, const nvr::PacketRef& packet, uint32_t lost) override {
+    ++packets_;
+  }
+  uint64_t packets_ = 0;
+};
+
+int64_t timerTick(int64_t deadlineUs) { return (deadlineUs + 999) / 1000 * 1000; }
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int seconds = argc > 1 ? atoi(argv[1]) : 300;
+  int lossPerMille = argc > 2 ? atoi(argv[2]) : 2;
+  if (seconds <= 0 || lossPerMille < 0 || lossPerMille > 1000) {
+    fprintf(stderr, "usage: bench_jitter_buffer [seconds] [loss per mille]\n");
+    return 2;
+  }
+
+  nvr::PacketPool pool(nvr::PacketPools::kDatagramSize, 256);
+  uint64_t sent = 0, frames = 0;
+  std::vector<Sent> arrived = simulate(&pool, seconds, lossPerMille, &sent, &frames);
+  std::vector<int64_t> arrivalBySequence(65536);
+  uint64_t outOfOrder = 0;
+  for (size_t i = 0; i < arrived.size(); ++i) {
+    if (i > 0 && nvr::sequenceBefore(arrived[i].header.sequence, arrived[i - 1].header.sequence))
+      ++outOfOrder;
+  }
+  printf("%d s of 25 fps H.264, %llu packets sent, %llu lost (%d per mille), %llu arrived "
+         "after a later one\n\n",
+         seconds, static_cast<unsigned long long>(sent),
+         static_cast<unsigned long long>(sent - arrived.size()), lossPerMille,
+         static_cast<unsigned long long>(outOfOrder));
+
+  struct Config {
+    const char* name;
+    bool buffer;
+    uint32_t minMs, maxMs;
+  };
+  const Config configs[] = {
+      {"arrival order, no buffer", false, 0, 0},
+      {"gap is loss at once", true, 0, 0},
+      {"fixed 20 ms", true, 20, 20},
+      {"fixed 200 ms", true, 200, 200},
+      {"adaptive 10-200 ms", true, 10, 200},
+  };
+  printf("%-26s %12s %8s %8s %6s %22s %8s\n", "", "recordable", "corrupt", "lost", "late",
+         "added ms p50/p99/max", "delay");
+  for (const Config& config : configs) {
+    Sink sink(&arrivalBySequence);
+    nvr::RtpJitterBufferOptions options;
+    options.minDelayMs = config.minMs;
+    options.maxDelayMs = config.maxMs;
+    nvr::RtpJitterBuffer buffer(0, &sink, options);
+    for (const Sent& s : arrived) arrivalBySequence[s.header.sequence] = s.arrivalUs;
+    // Sequence numbers wrap within the run, so the table is kept current
+    // as packets arrive. Timers fire on the millisecond, as on a loop.
+    if (config.buffer) {
+      nvr::RtpReceiveStats stats;
+      for (const Sent& s : arrived) {
+        for (int64_t due; (due = buffer.deadlineUs()) != 0 && timerTick(due) <= s.arrivalUs;) {
+          sink.setNow(timerTick(due));
+          buffer.poll(timerTick(due));
+        }
+        arrivalBySequence[s.header.sequence] = s.arrivalUs;
+        sink.setNow(s.arrivalUs);
+        stats.onPacket(s.header, s.arrivalUs, 90000);
+        buffer.push(s.packet, s.header, s.arrivalUs, stats.jitterUs());
+      }
+      buffer.flush();
+    } else {
+      for (const Sent& s : arrived) {
+        arrivalBySequence[s.header.sequence] = s.arrivalUs;
+        sink.setNow(s.arrivalUs);
+        sink.onOrderedRtp(0, s.packet, 0);
+      }
+    }
+    const nvr::RtpJitterBuffer::Stats& stats = buffer.stats();
+    char added[64];
+    snprintf(added, sizeof(added), "%.1f / %.1f / %.1f", percentile(sink.addedMs_, 0.5),
+             percentile(sink.addedMs_, 0.99), percentile(sink.addedMs_, 1));
+    printf("%-26s %11.2f%% %8llu %8llu %6llu %22s %5.1f ms\n", config.name,
+           100.0 * sink.recordable_ / frames, static_cast<unsigned long long>(sink.corrupt_),
+           static_cast<unsigned long long>(stats.lost), static_cast<unsigned long long>(stats.late),
+           added, buffer.delayUs() / 1000.0);
+  }
+
+  // The buffer alone: in order (the fast path), then the lossy stream.
+  std::vector<Sent> inOrder = arrived;
+  std::sort(inOrder.begin(), inOrder.end(), [](const Sent& a, const Sent& b) {
+    return a.header.timestamp != b.header.timestamp
+               ? a.header.timestamp < b.header.timestamp
+               : nvr::sequenceBefore(a.header.sequence, b.header.sequence);
+  });
+  printf("\n");
+  for (int lossy = 0; lossy < 2; ++lossy) {
+    const std::vector<Sent>& input = lossy ? arrived : inOrder;
+    const int kRounds = 20;
+    double elapsed = 0;
+    size_t allocations = 0;
+    uint64_t packets = 0;
+    for (int round = 0; round < kRounds; ++round) {
+      NullSink sink;
+      nvr::RtpJitterBuffer buffer(0, &sink);
+      size_t before = gAllocations;
+      double start = nowMs();
+      for (const Sent& s : input) {
+        for (int64_t due; (due = buffer.deadlineUs()) != 0 && timerTick(due) <= s.arrivalUs;)
+          buffer.poll(timerTick(due));
+        buffer.push(s.packet, s.header, s.arrivalUs, 1500);
+      }
+      buffer.flush();
+      elapsed += nowMs() - start;
+      allocations += gAllocations - before;
+      packets += input.size();
+    }
+    printf("buffer alone, %-12s %6.1f ns per packet, %.1f heap allocations per %zu packets\n",
+           lossy ? "lossy:" : "in order:", elapsed * 1e6 / packets,
+           static_cast<double>(allocations) / kRounds, input.size());
+  }
+  return 0;
+}
@@ -0,0 +1,226 @@
+// Recording layout benchmark: per-camera segment files vs striped groups.
+//
+// Records a synthetic fleet (25 fps, a keyframe every 2 s at 8x the size of
+// a P frame, cameras out of phase) through SegmentWriter into each layout,
+// on simulated time: every simulated second all frames are appended, every
+// writer is flushed as its 1 s flush interval would, and the bench waits
+// for the disk before moving on. Reports the write pattern the disk saw
+// (writes, seeks, bytes written per byte recorded) and then replays a few
+// cameras through CameraReader, reporting bytes read per byte of video.
+//
+//   bench_layout [dir] [cameras] [seconds] [kbps]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "storage/camera_reader.h"
+#include "storage/file_util.h"
+#include "storage/recording_store.h"
+#include "storage/segment_format.h"
+
+namespace {
+
+constexpr int kFps = 25;
+constexpr int kGopFrames = 50;
+constexpr int kKeyframeWeight = 8;
+constexpr int kReplayCameras = 4;
+constexpr int64_t kStartUs = 1700000000ll * 1000000;
+
+struct Options {
+  std::string dir;
+  int cameras;
+  int seconds;
+  int kbps;
+};
+
+struct Result {
+  nvr::IoStats io;
+  nvr::SegmentWriterStats writers;
+  double writeSeconds = 0;
+  uint64_t replayVideoBytes = 0;
+  uint64_t replayBytesRead = 0;
+  uint64_t replayChunks = 0;
+  double replaySeconds = 0;
+};
+
+double seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string cameraId(int c) { return "cam" + std::to_string(c); }
+
+std::string groupOf(nvr::RecordingLayout layout, int camera) {
+  return layout == nvr::RecordingLayout::Striped ? "loop-0" : "camera-" + cameraId(camera);
+}
+
+// Drives the writers on the loop thread, one simulated second per step.
+class Recorder {
+ public:
+  Recorder(const Options& options, nvr::RecordingLayout layout, nvr::RecordingStore* store,
+           nvr::EventLoop* loop)
+      : options_(options), loop_(loop) {
+    size_t unit = static_cast<size_t>(options.kbps) * 125 * kGopFrames / kFps /
+                  (kGopFrames - 1 + kKeyframeWeight);
+    frame_.assign(unit * kKeyframeWeight, 0x5a);
+    pFrameSize_ = unit;
+    int groups = layout == nvr::RecordingLayout::Striped ? 1 : options.cameras;
+    for (int g = 0; g < groups; ++g) {
+      writers_.push_back(store->createWriter(loop, groupOf(layout, g)));
+      writers_.back()->open();
+    }
+    for (int c = 0; c < options.cameras; ++c) {
+      nvr::SegmentWriter* writer = writers_[groups == 1 ? 0 : c].get();
+      nvr::StreamInfo info;
+      info.cameraId = cameraId(c);
+      info.codec = "H264";
+      info.clockRate = 90000;
+      streams_.push_back(writer->addStream(info));
+      cameraWriters_.push_back(writer);
+    }
+    io_ = store->io();
+  }
+
+  void start(std::function<void()> done) {
+    done_ = std::move(done);
+    step();
+  }
+
+  const nvr::SegmentWriterStats& stats() const { return stats_; }
+
+ private:
+  void step() {
+    if (second_ == options_.seconds) {
+      auto pending = std::make_shared<size_t>(writers_.size());
+      for (auto& writer : writers_) {
+        nvr::SegmentWriter* w = writer.get();
+        w->close([this, w, pending] {
+          stats_.add(w->stats());
+          if (--*pending == 0) done_();
+        });
+      }
+      return;
+    }
+    int64_t frameUs = 1000000 / kFps;
+    for (int f = 0; f < kFps; ++f) {
+      for (int c = 0; c < options_.cameras; ++c) {
+        int64_t n = static_cast<int64_t>(second_) * kFps + f + c * 7;
+        bool keyframe = n % kGopFrames == 0;
+        int64_t ts = kStartUs + (static_cast<int64_t>(second_) * kFps + f) * frameUs +
+                     c * frameUs / options_.cameras;
+        cameraWriters_[c]->append(streams_[c], nvr::RecordType::Video,
+                                  keyframe ? nvr::kRecordKeyframe : 0, ts, frame_.data(),
+                                  keyframe ? frame_.size() : pFrameSize_);
+      }
+    }
+    for (auto& writer : writers_) writer->flush();
+    ++second_;
+    waitIdle();
+  }
+
+  void waitIdle() {
+    bool idle = io_->pending() == 0;
+    for (auto& writer : writers_) idle = idle && writer->stats().buffersInFlight == 0;
+    if (idle) {
+      step();
+    } else {
+      loop_->runAfter(1, [this] { waitIdle(); });
+    }
+  }
+
+  Options options_;
+  nvr::EventLoop* loop_;
+  nvr::IoBackend* io_ = nullptr;
+  std::vector<std::unique_ptr<nvr::SegmentWriter>> writers_;
+  std::vector<nvr::SegmentWriter*> cameraWriters_;
+  std::vector<uint32_t> streams_;
+  std::vector<uint8_t> frame_;
+  size_t pFrameSize_ = 0;
+  int second_ = 0;
+  std::function<void()> done_;
+  nvr::SegmentWriterStats stats_;
+};
+
+bool run(const Options& options, nvr::RecordingLayout layout, Result* result) {
+  std::string dir = nvr::joinPath(options.dir, nvr::recordingLayoutName(layout));
+  nvr::SegmentWriterOptions defaults;
+  defaults.dir = dir;
+  defaults.segmentSize = 16 << 20;
+  // The bench flushes on simulated time.
+  defaults.flushIntervalMs = 1 << 30;
+  defaults.syncIntervalMs = 1 << 30;
+  nvr::RecordingStore store(defaults);
+  if (store.start() < 0) return false;
+
+  nvr::EventLoop loop;
+  Recorder recorder(options, layout, &store, &loop);
+  auto start = std::chrono::steady_clock::now();
+  loop.post([&] { recorder.start([&] { loop.quit(); }); });
+  loop.run();
+  result->writeSeconds = seconds(start);
+  store.stop();
+  result->io = store.io()->stats();
+  result->writers = recorder.stats();
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kReplayCameras; ++i) {
+    int camera = i * options.cameras / kReplayCameras;
+    std::string groupDir = nvr::joinPath(dir, groupOf(layout, camera));
+    std::vector<std::string> names;
+    nvr::listDirectory(groupDir, &names);
+    for (const auto& name : names) {
+      uint64_t id;
+      if (!nvr::parseSegmentFileName(name, &id)) continue;
+      nvr::CameraReader reader;
+      if (reader.open(nvr::joinPath(groupDir, name), cameraId(camera)) < 0) continue;
+      nvr::SegmentReader::Record record;
+      while (reader.next(&record))
+        if (record.header.type == static_cast<uint8_t>(nvr::RecordType::Video))
+          result->replayVideoBytes += record.header.size;
+      result->replayBytesRead += reader.bytesRead();
+      result->replayChunks += reader.chunksRead();
+    }
+  }
+  result->replaySeconds = seconds(start);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  options.dir = argc > 1 ? argv[1] : "/tmp/nvr_bench_layout";
+  options.cameras = argc > 2 ? atoi(argv[2]) : 200;
+  options.seconds = argc > 3 ? atoi(argv[3]) : 20;
+  options.kbps = argc > 4 ? atoi(argv[4]) : 2000;
+  if (options.cameras <= 0 || options.seconds <= 0 || options.kbps <= 0) {
+    fprintf(stderr, "usage: %s [dir] [cameras] [seconds] [kbps]\n", argv[0]);
+    return 2;
+  }
+  printf("%d cameras at %d kbps for %d s (simulated), 1 s flush interval\n", options.cameras,
+         options.kbps, options.seconds);
+  printf("%-11s %8s %9s %10s %9s %10s %9s %12s %10s\n", "layout", "writes", "avg KB",
+         "seeks/s", "write amp", "dropped", "write s", "replay read", "replay MB/s");
+  for (auto layout : {nvr::RecordingLayout::PerCamera, nvr::RecordingLayout::Striped}) {
+    Result r;
+    if (!run(options, layout, &r)) {
+      fprintf(stderr, "cannot record into %s\n", options.dir.c_str());
+      return 1;
+    }
+    printf("%-11s %8llu %9.1f %10.1f %9.3f %10llu %9.2f %11.2fx %10.1f\n",
+           nvr::recordingLayoutName(layout), static_cast<unsigned long long>(r.io.writes),
+           r.io.bytesWritten / 1024.0 / static_cast<double>(r.io.writes),
+           static_cast<double>(r.io.seeks) / options.seconds,
+           static_cast<double>(r.io.bytesWritten) / static_cast<double>(r.writers.recordBytes),
+           static_cast<unsigned long long>(r.writers.droppedRecords), r.writeSeconds,
+           static_cast<double>(r.replayBytesRead) / static_cast<double>(r.replayVideoBytes),
+           r.replayBytesRead / 1e6 / r.replaySeconds);
+  }
+  return 0;
+}
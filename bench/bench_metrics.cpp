@@ -0,0 +1,248 @@
+// Metrics: cost on the media path, and the cost of a /metrics scrape for a
+// node with many cameras.
+//
+// Hot path: RTP reception statistics (header parse plus RtpReceiveStats)
+// over a synthetic 25 fps stream with known loss, reordering and arrival
+// jitter, reporting ns per packet and what the statistics made of it.
+//
+// Scrape: an IngestEngine with [cameras] cameras on its loops (their RTSP
+// servers do not exist, so they sit waiting to reconnect), scraped through
+// a MetricsServer on loopback. Collecting posts to every loop and copies
+// counters there; the values are then replaced with a live node's
+// magnitudes (recording, with lag and a disk queue) so that the text is as
+// long as in production. Reported: collection, rendering and the full HTTP
+// scrape, median and worst of [scrapes].
+//
+//   bench_metrics [cameras] [scrapes] [loops]
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/log.h"
+#include "base/socket_util.h"
+#include "http/http_message.h"
+#include "ingest/ingest_engine.h"
+#include "ingest/ingest_metrics.h"
+#include "metrics/metrics_server.h"
+#include "rtp/rtp_packet.h"
+#include "rtp/rtp_receive_stats.h"
+
+namespace {
+
+double nowMs() {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+double percentile(std::vector<double> v, double p) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+struct Packet {
+  uint8_t bytes[12];
+  int64_t arrivalUs;
+};
+
+void benchReceiveStats() {
+  constexpr int kPackets = 2000000;
+  constexpr int kPacketsPerFrame = 10;
+  constexpr int64_t kFrameUs = 40000;
+  constexpr int64_t kJitterUs = 3000;  // arrival noise, uniform
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<int> percent(0, 9999);
+  std::uniform_int_distribution<int64_t> noise(0, kJitterUs);
+
+  std::vector<Packet> packets;
+  packets.reserve(kPackets);
+  uint64_t lost = 0;
+  for (int i = 0; i < kPackets; ++i) {
+    if (percent(rng) < 100) {  // 1%
+      ++lost;
+      continue;
+    }
+    Packet p;
+    memset(p.bytes, 0, sizeof(p.bytes));
+    uint16_t sequence = static_cast<uint16_t>(i);
+    uint32_t timestamp = static_cast<uint32_t>(i / kPacketsPerFrame * 3600);
+    p.bytes[0] = 0x80;
+    p.bytes[1] = 96 | (i % kPacketsPerFrame == kPacketsPerFrame - 1 ? 0x80 : 0);
+    p.bytes[2] = static_cast<uint8_t>(sequence >> 8);
+    p.bytes[3] = static_cast<uint8_t>(sequence);
+    for (int b = 0; b < 4; ++b) p.bytes[4 + b] = static_cast<uint8_t>(timestamp >> (24 - 8 * b));
+    p.bytes[11] = 1;
+    p.arrivalUs = i / kPacketsPerFrame * kFrameUs + i % kPacketsPerFrame * 100 + noise(rng);
+    packets.push_back(p);
+  }
+  uint64_t reordered = 0;
+  for (size_t i = 0; i + 1 < packets.size(); ++i) {
+    if (percent(rng) < 50) {  // 0.5%
+      std::swap(packets[i], packets[i + 1]);
+      ++reordered;
+      ++i;
+    }
+  }
+
+  nvr::RtpReceiveStats stats;
+  double start = nowMs();
+  for (const Packet& p : packets) {
+    nvr::RtpHeader header;
+    if (nvr::parseRtpHeader(p.bytes, sizeof(p.bytes), &header))
+      stats.onPacket(header, p.arrivalUs, 90000);
+  }
+  double elapsed = nowMs() - start;
+  printf("hot path: %.1f ns per packet (RTP header parse and reception statistics)\n",
+         elapsed * 1e6 / packets.size());
+  printf("          lost %llu (injected %llu), reordered %llu (injected %llu), "
+         "jitter %.2f ms (uniform %.0f ms noise: about %.2f ms)\n\n",
+         static_cast<unsigned long long>(stats.lost()), static_cast<unsigned long long>(lost),
+         static_cast<unsigned long long>(stats.reordered()),
+         static_cast<unsigned long long>(reordered), stats.jitterUs() / 1000.0,
+         kJitterUs / 1000.0, kJitterUs / 3000.0);
+}
+
+// A live node's magnitudes, so the text has its real length.
+void fill(nvr::IngestMetrics* metrics) {
+  std::mt19937_64 rng(11);
+  for (auto& c : metrics->cameras) {
+    c.playing = true;
+    c.reconnects = rng() % 20;
+    c.rtpPackets = 100000000 + rng() % 900000000;
+    c.rtpBytes = c.rtpPackets * 1200;
+    c.frames = c.rtpPackets / 10;
+    c.bitsPerSecond = 2000000 + rng() % 6000000;
+    c.framesPerSecondMilli = 24000 + static_cast<uint32_t>(rng() % 2000);
+    c.packetsLost = rng() % 100000;
+    c.packetsReordered = rng() % 10000;
+    c.jitterUs = static_cast<uint32_t>(rng() % 20000);
+    c.recording = true;
+    c.recordedFrames = c.frames - rng() % 1000;
+    c.skippedFrames = rng() % 1000;
+    c.recorderLagUs = 300000 + static_cast<int64_t>(rng() % 1500000);
+    c.diskQueueChunks = static_cast<uint32_t>(rng() % 3);
+    c.diskQueueBytes = rng() % (1 << 20);
+  }
+}
+
+// One GET over a connection; the body's size, or -1.
+long scrape(int fd) {
+  std::string request = nvr::buildHttpRequest("GET", "/metrics", "localhost", nvr::HeaderList());
+  if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) !=
+      static_cast<ssize_t>(request.size()))
+    return -1;
+  nvr::HttpResponseParser parser(256 << 20);
+  parser.reset();
+  std::vector<char> buf(1 << 20);
+  for (;;) {
+    ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+    if (n <= 0) return -1;
+    size_t used = 0;
+    auto result = parser.feed(buf.data(), static_cast<size_t>(n), &used);
+    if (result == nvr::HttpResponseParser::Result::Error) return -1;
+    if (result == nvr::HttpResponseParser::Result::Done)
+      return parser.response().status == 200 ? static_cast<long>(parser.response().body.size())
+                                             : -1;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int cameras = argc > 1 ? atoi(argv[1]) : 10000;
+  int scrapes = argc > 2 ? atoi(argv[2]) : 20;
+  int loops = argc > 3 ? atoi(argv[3]) : 0;
+  if (cameras <= 0 || scrapes <= 0) {
+    fprintf(stderr, "usage: bench_metrics [cameras] [scrapes] [loops]\n");
+    return 2;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  nvr::setLogLevel(nvr::LogLevel::Error);  // every camera fails to connect
+  benchReceiveStats();
+
+  nvr::IngestOptions options;
+  options.loops = loops;
+  options.rtsp.reconnectMinMs = options.rtsp.reconnectMaxMs = 3600 * 1000;
+  nvr::IngestEngine ingest(options);
+  if (ingest.start() < 0) return 1;
+  for (int i = 0; i < cameras; ++i) {
+    nvr::CameraConfig camera;
+    char id[32];
+    snprintf(id, sizeof(id), "camera-%05d", i);
+    camera.id = id;
+    camera.url = "rtsp://127.0.0.1:9/" + camera.id;  // nothing listens there
+    ingest.addCamera(camera);
+  }
+  while (ingest.metrics().cameras.size() < static_cast<size_t>(cameras))
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  // Rendered into the same string every time, as a server connection does.
+  std::vector<double> collectMs, renderMs;
+  std::string text;
+  for (int i = 0; i < scrapes; ++i) {
+    double start = nowMs();
+    nvr::IngestMetrics metrics = ingest.metrics();
+    collectMs.push_back(nowMs() - start);
+    fill(&metrics);
+    text.clear();
+    nvr::MetricsWriter out(&text);
+    start = nowMs();
+    nvr::writeIngestMetrics(metrics, &out);
+    renderMs.push_back(nowMs() - start);
+  }
+
+  nvr::MetricsServerOptions serverOptions;
+  serverOptions.port = 0;
+  nvr::MetricsServer server(serverOptions);
+  server.addCollector([&ingest](nvr::MetricsWriter* out) {
+    nvr::IngestMetrics metrics = ingest.metrics();
+    fill(&metrics);
+    nvr::writeIngestMetrics(metrics, out);
+  });
+  if (server.start() < 0) return 1;
+  nvr::SocketAddress addr;
+  nvr::resolveAddress("127.0.0.1", server.port(), &addr);
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, addr.get(), addr.length) < 0) {
+    perror("connect");
+    return 1;
+  }
+  std::vector<double> scrapeMs;
+  long body = 0;
+  for (int i = 0; i < scrapes; ++i) {
+    double start = nowMs();
+    body = scrape(fd);
+    if (body < 0) {
+      fprintf(stderr, "scrape failed\n");
+      return 1;
+    }
+    scrapeMs.push_back(nowMs() - start);
+  }
+  close(fd);
+  nvr::MetricsServerStats stats = server.stats();
+
+  printf("scrape:   %d cameras on %d loop(s), %.1f MB of text, %zu bytes per camera\n", cameras,
+         ingest.loops().size(), text.size() / 1e6, text.size() / static_cast<size_t>(cameras));
+  printf("          collect from loops  p50 %6.2f ms  max %6.2f ms\n",
+         percentile(collectMs, 0.5), percentile(collectMs, 1));
+  printf("          render text         p50 %6.2f ms  max %6.2f ms\n", percentile(renderMs, 0.5),
+         percentile(renderMs, 1));
+  printf("          HTTP GET /metrics   p50 %6.2f ms  max %6.2f ms  (server side %.2f ms)\n",
+         percentile(scrapeMs, 0.5), percentile(scrapeMs, 1), stats.lastScrapeUs / 1000.0);
+  server.stop();
+  ingest.stop();
+  return 0;
+}
@@ -0,0 +1,525 @@
+// Bulk ONVIF provisioning against a local mock.
+//
+// A mock server on its own loop thread plays N ONVIF devices: every device
+// is a distinct loopback address (127.0.x.y) on one listening port, checks
+// WS-Security digests like a camera does, answers after a fixed processing
+// delay and returns responses of realistic size (a two-profile GetProfiles
+// is about 8 KB). The client side runs OnvifProvisioner on the main thread
+// and reports wall time, request rate, connection reuse, digest cache hits
+// and client CPU, once with keep-alive and cached tokens and once with a
+// connection and a digest per request.
+//
+//   bench_onvif [devices] [concurrency] [device-latency-ms]
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/base64.h"
+#include "base/byte_buffer.h"
+#include "base/clock.h"
+#include "base/event_loop.h"
+#include "base/log.h"
+#include "base/socket_util.h"
+#include "http/http_client.h"
+#include "http/http_message.h"
+#include "onvif/onvif_provisioner.h"
+#include "onvif/ws_security.h"
+#include "onvif/xml_reader.h"
+
+namespace {
+
+constexpr int kHostsPerSubnet = 250;
+
+std::string deviceIp(int index) {
+  return "127.0." + std::to_string(1 + index / kHostsPerSubnet) + "." +
+         std::to_string(1 + index % kHostsPerSubnet);
+}
+
+std::string devicePassword(int index) { return "pw-" + std::to_string(index); }
+
+std::string expectedUri(int index, int stream) {
+  return "rtsp://admin:" + devicePassword(index) + "@" + deviceIp(index) +
+         ":554/Streaming/Channels/10" + std::to_string(stream + 1);
+}
+
+double threadCpuSeconds() {
+  rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+const char kResponseHead[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<env:Envelope xmlns:env=\"http://www.w3.org/2003/05/soap-envelope\" "
+    "xmlns:soapenc=\"http://www.w3.org/2003/05/soap-encoding\" "
+    "xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
+    "xmlns:xs=\"http://www.w3.org/2001/XMLSchema\" "
+    "xmlns:tt=\"http://www.onvif.org/ver10/schema\" "
+    "xmlns:tds=\"http://www.onvif.org/ver10/device/wsdl\" "
+    "xmlns:trt=\"http://www.onvif.org/ver10/media/wsdl\" "
+    "xmlns:timg=\"http://www.onvif.org/ver20/imaging/wsdl\" "
+    "xmlns:tev=\"http://www.onvif.org/ver10/events/wsdl\" "
+    "xmlns:tptz=\"http://www.onvif.org/ver20/ptz/wsdl\" "
+    "xmlns:ter=\"http://www.onvif.org/ver10/error\" "
+    "xmlns:wsa=\"http://www.w3.org/2005/08/addressing\">\n<env:Body>";
+const char kResponseTail[] = "</env:Body>\n</env:Envelope>\n";
+
+std::string profileXml(int stream) {
+  bool main = stream == 0;
+  std::string n = std::to_string(stream + 1);
+  std::string width = main ? "1920" : "640";
+  std::string height = main ? "1080" : "360";
+  return "<trt:Profiles token=\"Profile_" + n + "\" fixed=\"true\">"
+         "<tt:Name>" + (main ? "mainStream" : "subStream") + "</tt:Name>"
+         "<tt:VideoSourceConfiguration token=\"VideoSourceToken\"><tt:Name>VideoSourceConfig"
+         "</tt:Name><tt:UseCount>2</tt:UseCount><tt:SourceToken>VideoSource_1</tt:SourceToken>"
+         "<tt:Bounds x=\"0\" y=\"0\" width=\"1920\" height=\"1080\"></tt:Bounds>"
+         "</tt:VideoSourceConfiguration>"
+         "<tt:AudioSourceConfiguration token=\"AudioSourceConfigToken\"><tt:Name>"
+         "AudioSourceConfig</tt:Name><tt:UseCount>2</tt:UseCount><tt:SourceToken>"
+         "AudioSourceChannel</tt:SourceToken></tt:AudioSourceConfiguration>"
+         "<tt:VideoEncoderConfiguration token=\"VideoEncoderToken_" + n + "\"><tt:Name>"
+         "VideoEncoder_" + n + "</tt:Name><tt:UseCount>1</tt:UseCount><tt:Encoding>H264"
+         "</tt:Encoding><tt:Resolution><tt:Width>" + width + "</tt:Width><tt:Height>" + height +
+         "</tt:Height></tt:Resolution><tt:Quality>3.000000</tt:Quality><tt:RateControl>"
+         "<tt:FrameRateLimit>25</tt:FrameRateLimit><tt:EncodingInterval>1</tt:EncodingInterval>"
+         "<tt:BitrateLimit>" + (main ? "4096" : "512") + "</tt:BitrateLimit></tt:RateControl>"
+         "<tt:H264><tt:GovLength>50</tt:GovLength><tt:H264Profile>Main</tt:H264Profile>"
+         "</tt:H264><tt:Multicast><tt:Address><tt:Type>IPv4</tt:Type><tt:IPv4Address>0.0.0.0"
+         "</tt:IPv4Address></tt:Address><tt:Port>8860</tt:Port><tt:TTL>128</tt:TTL>"
+         "<tt:AutoStart>false</tt:AutoStart></tt:Multicast><tt:SessionTimeout>PT5S"
+         "</tt:SessionTimeout></tt:VideoEncoderConfiguration>"
+         "<tt:AudioEncoderConfiguration token=\"MainAudioEncoderToken\"><tt:Name>"
+         "AudioEncoderConfig</tt:Name><tt:UseCount>2</tt:UseCount><tt:Encoding>G711"
+         "</tt:Encoding><tt:Bitrate>64</tt:Bitrate><tt:SampleRate>8</tt:SampleRate>"
+         "<tt:Multicast><tt:Address><tt:Type>IPv4</tt:Type><tt:IPv4Address>0.0.0.0"
+         "</tt:IPv4Address></tt:Address><tt:Port>8862</tt:Port><tt:TTL>128</tt:TTL>"
+         "<tt:AutoStart>false</tt:AutoStart></tt:Multicast><tt:SessionTimeout>PT5S"
+         "</tt:SessionTimeout></tt:AudioEncoderConfiguration>"
+         "<tt:VideoAnalyticsConfiguration token=\"VideoAnalyticsToken\"><tt:Name>"
+         "VideoAnalyticsName</tt:Name><tt:UseCount>2</tt:UseCount><tt:AnalyticsEngine"
+         "Configuration><tt:AnalyticsModule Name=\"MyCellMotionModule\" "
+         "Type=\"tt:CellMotionEngine\"><tt:Parameters><tt:SimpleItem Name=\"Sensitivity\" "
+         "Value=\"0\"/><tt:ElementItem Name=\"Layout\"><tt:CellLayout Columns=\"22\" "
+         "Rows=\"18\"><tt:Transformation><tt:Translate x=\"-1.000000\" y=\"-1.000000\"/>"
+         "<tt:Scale x=\"0.090909\" y=\"0.111111\"/></tt:Transformation></tt:CellLayout>"
+         "</tt:ElementItem></tt:Parameters></tt:AnalyticsModule></tt:AnalyticsEngine"
+         "Configuration><tt:RuleEngineConfiguration><tt:Rule Name=\"MyMotionDetectorRule\" "
+         "Type=\"tt:CellMotionDetector\"><tt:Parameters><tt:SimpleItem Name=\"MinCount\" "
+         "Value=\"5\"/><tt:SimpleItem Name=\"AlarmOnDelay\" Value=\"1000\"/><tt:SimpleItem "
+         "Name=\"AlarmOffDelay\" Value=\"1000\"/><tt:SimpleItem Name=\"ActiveCells\" "
+         "Value=\"0P8A8A==\"/></tt:Parameters></tt:Rule></tt:RuleEngineConfiguration>"
+         "</tt:VideoAnalyticsConfiguration>"
+         "<tt:PTZConfiguration token=\"PTZToken\"><tt:Name>PTZ</tt:Name><tt:UseCount>2"
+         "</tt:UseCount><tt:NodeToken>PTZNODETOKEN</tt:NodeToken><tt:DefaultAbsolutePantTilt"
+         "PositionSpace>http://www.onvif.org/ver10/tptz/PanTiltSpaces/PositionGenericSpace"
+         "</tt:DefaultAbsolutePantTiltPositionSpace><tt:DefaultPTZTimeout>PT300S"
+         "</tt:DefaultPTZTimeout></tt:PTZConfiguration>"
+         "<tt:Extension><tt:AudioOutputConfiguration token=\"AudioOutputConfigToken\">"
+         "<tt:Name>AudioOutputConfigName</tt:Name><tt:UseCount>2</tt:UseCount><tt:OutputToken>"
+         "AudioOutputToken</tt:OutputToken><tt:SendPrimacy>www.onvif.org/ver20/HalfDuplex/"
+         "Server</tt:SendPrimacy><tt:OutputLevel>50</tt:OutputLevel></tt:AudioOutput"
+         "Configuration></tt:Extension></trt:Profiles>";
+}
+
+std::string capabilitiesXml(const std::string& ip) {
+  std::string base = "http://" + ip + "/onvif/";
+  return "<tds:GetCapabilitiesResponse><tds:Capabilities>"
+         "<tt:Analytics><tt:XAddr>" + base + "Analytics</tt:XAddr><tt:RuleSupport>true"
+         "</tt:RuleSupport><tt:AnalyticsModuleSupport>true</tt:AnalyticsModuleSupport>"
+         "</tt:Analytics><tt:Device><tt:XAddr>" + base + "device_service</tt:XAddr>"
+         "<tt:Network><tt:IPFilter>true</tt:IPFilter><tt:ZeroConfiguration>true"
+         "</tt:ZeroConfiguration><tt:IPVersion6>true</tt:IPVersion6><tt:DynDNS>true</tt:DynDNS>"
+         "</tt:Network><tt:System><tt:DiscoveryResolve>false</tt:DiscoveryResolve>"
+         "<tt:DiscoveryBye>true</tt:DiscoveryBye><tt:RemoteDiscovery>false"
+         "</tt:RemoteDiscovery><tt:SystemBackup>false</tt:SystemBackup><tt:SystemLogging>true"
+         "</tt:SystemLogging><tt:FirmwareUpgrade>true</tt:FirmwareUpgrade>"
+         "<tt:SupportedVersions><tt:Major>2</tt:Major><tt:Minor>60</tt:Minor>"
+         "</tt:SupportedVersions></tt:System><tt:IO><tt:InputConnectors>1"
+         "</tt:InputConnectors><tt:RelayOutputs>1</tt:RelayOutputs></tt:IO><tt:Security>"
+         "<tt:TLS1.1>true</tt:TLS1.1><tt:TLS1.2>true</tt:TLS1.2><tt:OnboardKeyGeneration>false"
+         "</tt:OnboardKeyGeneration><tt:AccessPolicyConfig>true</tt:AccessPolicyConfig>"
+         "<tt:X.509Token>false</tt:X.509Token><tt:SAMLToken>false</tt:SAMLToken>"
+         "<tt:KerberosToken>false</tt:KerberosToken><tt:RELToken>false</tt:RELToken>"
+         "</tt:Security></tt:Device><tt:Events><tt:XAddr>" + base + "Events</tt:XAddr>"
+         "<tt:WSSubscriptionPolicySupport>true</tt:WSSubscriptionPolicySupport>"
+         "<tt:WSPullPointSupport>true</tt:WSPullPointSupport>"
+         "<tt:WSPausableSubscriptionManagerInterfaceSupport>false"
+         "</tt:WSPausableSubscriptionManagerInterfaceSupport></tt:Events>"
+         "<tt:Imaging><tt:XAddr>" + base + "Imaging</tt:XAddr></tt:Imaging>"
+         "<tt:Media><tt:XAddr>" + base + "Media</tt:XAddr><tt:StreamingCapabilities>"
+         "<tt:RTPMulticast>true</tt:RTPMulticast><tt:RTP_TCP>true</tt:RTP_TCP>"
+         "<tt:RTP_RTSP_TCP>true</tt:RTP_RTSP_TCP></tt:StreamingCapabilities></tt:Media>"
+         "<tt:PTZ><tt:XAddr>" + base + "PTZ</tt:XAddr></tt:PTZ>"
+         "</tds:Capabilities></tds:GetCapabilitiesResponse>";
+}
+
+std::string dateTimeXml() {
+  time_t now = time(nullptr);
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           "<tds:GetSystemDateAndTimeResponse><tds:SystemDateAndTime><tt:DateTimeType>NTP"
+           "</tt:DateTimeType><tt:DaylightSavings>false</tt:DaylightSavings><tt:TimeZone>"
+           "<tt:TZ>UTC</tt:TZ></tt:TimeZone><tt:UTCDateTime><tt:Time><tt:Hour>%d</tt:Hour>"
+           "<tt:Minute>%d</tt:Minute><tt:Second>%d</tt:Second></tt:Time><tt:Date>"
+           "<tt:Year>%d</tt:Year><tt:Month>%d</tt:Month><tt:Day>%d</tt:Day></tt:Date>"
+           "</tt:UTCDateTime></tds:SystemDateAndTime></tds:GetSystemDateAndTimeResponse>",
+           tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+  return buf;
+}
+
+const char kNotAuthorized[] =
+    "<env:Fault><env:Code><env:Value>env:Sender</env:Value><env:Subcode><env:Value>"
+    "ter:NotAuthorized</env:Value></env:Subcode></env:Code><env:Reason><env:Text "
+    "xml:lang=\"en\">Sender not Authorized</env:Text></env:Reason></env:Fault>";
+
+class MockDevices;
+
+class MockConnection : public nvr::EventHandler {
+ public:
+  MockConnection(MockDevices* devices, int fd, int device) : devices_(devices), fd_(fd),
+                                                             device_(device) {}
+  void onEvents(uint32_t events) override;
+  void respond(const std::string& response, bool close);
+
+ private:
+  void flush();
+  void shutdown();
+
+  MockDevices* devices_;
+  int fd_;
+  int device_;
+  nvr::ByteBuffer input_;
+  nvr::ByteBuffer output_{4 * 1024};
+  int pending_ = 0;
+  bool closing_ = false;
+  bool wantWrite_ = false;
+};
+
+class MockDevices : public nvr::EventHandler {
+ public:
+  MockDevices(nvr::EventLoop* loop, int listenFd, int devices, uint64_t latencyMs)
+      : loop_(loop), listenFd_(listenFd), devices_(devices), latencyMs_(latencyMs) {}
+
+  void start() { loop_->add(listenFd_, EPOLLIN, this); }
+
+  void onEvents(uint32_t) override {
+    for (;;) {
+      int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) return;
+      nvr::SocketAddress local;
+      nvr::localAddress(fd, &local);
+      auto* sin = reinterpret_cast<const sockaddr_in*>(local.get());
+      uint32_t ip = ntohl(sin->sin_addr.s_addr);
+      int device = (static_cast<int>((ip >> 8) & 0xff) - 1) * kHostsPerSubnet +
+                   static_cast<int>(ip & 0xff) - 1;
+      auto* conn = new MockConnection(this, fd, device);
+      loop_->add(fd, EPOLLIN, conn);
+    }
+  }
+
+  // Builds the SOAP response to one request from device.
+  std::string handle(int device, const nvr::HttpRequest& request) {
+    ++requests;
+    std::string user, password, nonce, created, operation, token;
+    nvr::XmlReader xml(request.body);
+    for (;;) {
+      auto t = xml.next();
+      if (t == nvr::XmlReader::Token::End || t == nvr::XmlReader::Token::Error) break;
+      if (t != nvr::XmlReader::Token::StartElement) continue;
+      std::string_view name = xml.localName();
+      if (name == "Username") {
+        user = xml.readText();
+      } else if (name == "Password") {
+        password = xml.readText();
+      } else if (name == "Nonce") {
+        nonce = xml.readText();
+      } else if (name == "Created") {
+        created = xml.readText();
+      } else if (name == "Body") {
+        if (xml.next() == nvr::XmlReader::Token::StartElement) operation = xml.localName();
+        if (operation == "GetStreamUri" && xml.findElement("ProfileToken"))
+          token = xml.readText();
+        break;
+      }
+    }
+    if (operation != "GetSystemDateAndTime" && !authorized(device, user, password, nonce,
+                                                           created)) {
+      ++rejected;
+      return nvr::buildHttpResponse(400, "Bad Request", soapHeaders(),
+                                    kResponseHead + std::string(kNotAuthorized) + kResponseTail,
+                                    !closeAfterResponse);
+    }
+    std::string body;
+    if (operation == "GetSystemDateAndTime") {
+      body = dateTimeXml();
+    } else if (operation == "GetCapabilities") {
+      body = capabilitiesXml(deviceIp(device));
+    } else if (operation == "GetProfiles") {
+      body = "<trt:GetProfilesResponse>" + profileXml(0) + profileXml(1) +
+             "</trt:GetProfilesResponse>";
+    } else if (operation == "GetStreamUri") {
+      int stream = token == "Profile_2" ? 1 : 0;
+      body = "<trt:GetStreamUriResponse><trt:MediaUri><tt:Uri>rtsp://" + deviceIp(device) +
+             ":554/Streaming/Channels/10" + std::to_string(stream + 1) +
+             "</tt:Uri><tt:InvalidAfterConnect>false</tt:InvalidAfterConnect>"
+             "<tt:InvalidAfterReboot>false</tt:InvalidAfterReboot><tt:Timeout>PT60S"
+             "</tt:Timeout></trt:MediaUri></trt:GetStreamUriResponse>";
+    } else {
+      return nvr::buildHttpResponse(400, "Bad Request", soapHeaders(),
+                                    std::string(kResponseHead) + kResponseTail,
+                                    !closeAfterResponse);
+    }
+    return nvr::buildHttpResponse(200, "OK", soapHeaders(), kResponseHead + body + kResponseTail,
+                                  !closeAfterResponse);
+  }
+
+  nvr::EventLoop* loop() const { return loop_; }
+  uint64_t latencyMs() const { return latencyMs_; }
+
+  std::atomic<bool> closeAfterResponse{false};
+  std::atomic<uint64_t> requests{0};
+  std::atomic<uint64_t> rejected{0};
+
+ private:
+  static nvr::HeaderList soapHeaders() {
+    return {{"Server", "gSOAP/2.8"},
+            {"Content-Type", "application/soap+xml; charset=utf-8"}};
+  }
+
+  bool authorized(int device, const std::string& user, const std::string& password,
+                  const std::string& nonce, const std::string& created) {
+    if (device < 0 || device >= devices_ || user != "admin") return false;
+    struct tm tm = {};
+    if (sscanf(created.c_str(), "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+      return false;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    // Cameras accept tokens created within a few minutes of their clock.
+    if (llabs(static_cast<long long>(timegm(&tm) - time(nullptr))) > 300) return false;
+    std::string rawNonce;
+    if (!nvr::base64Decode(nonce, &rawNonce)) return false;
+    return password ==
+           nvr::WsSecurity::passwordDigest(rawNonce, created, devicePassword(device));
+  }
+
+  nvr::EventLoop* loop_;
+  int listenFd_;
+  int devices_;
+  uint64_t latencyMs_;
+};
+
+void MockConnection::onEvents(uint32_t events) {
+  if (fd_ < 0) return;
+  if (events & EPOLLOUT) flush();
+  if (fd_ < 0 || !(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) return;
+  for (;;) {
+    ssize_t n = input_.readFd(fd_);
+    if (n == -EAGAIN) break;
+    if (n <= 0) {
+      shutdown();
+      return;
+    }
+  }
+  for (;;) {
+    nvr::HttpRequest request;
+    int used = nvr::parseHttpRequest(reinterpret_cast<const char*>(input_.data()),
+                                     input_.size(), &request);
+    if (used < 0) {
+      shutdown();
+      return;
+    }
+    if (used == 0) return;
+    input_.consume(used);
+    std::string response = devices_->handle(device_, request);
+    bool close = devices_->closeAfterResponse || !request.keepAlive;
+    ++pending_;
+    // Device firmware is slow; answer after the processing delay.
+    devices_->loop()->runAfter(devices_->latencyMs(), [this, response, close] {
+      respond(response, close);
+    });
+  }
+}
+
+void MockConnection::respond(const std::string& response, bool close) {
+  --pending_;
+  if (fd_ < 0) {
+    if (pending_ == 0) delete this;
+    return;
+  }
+  output_.append(response);
+  closing_ = closing_ || close;
+  flush();
+}
+
+void MockConnection::flush() {
+  while (!output_.empty()) {
+    ssize_t n = output_.writeFd(fd_);
+    if (n == -EAGAIN) {
+      if (!wantWrite_) {
+        wantWrite_ = true;
+        devices_->loop()->modify(fd_, EPOLLIN | EPOLLOUT, this);
+      }
+      return;
+    }
+    if (n < 0) {
+      shutdown();
+      return;
+    }
+  }
+  if (wantWrite_) {
+    wantWrite_ = false;
+    devices_->loop()->modify(fd_, EPOLLIN, this);
+  }
+  if (closing_) shutdown();
+}
+
+void MockConnection::shutdown() {
+  if (fd_ < 0) return;
+  devices_->loop()->remove(fd_);
+  ::close(fd_);
+  fd_ = -1;
+  if (pending_ == 0) devices_->loop()->deleteLater(this);
+}
+
+struct RunResult {
+  double wallSeconds = 0;
+  double cpuSeconds = 0;
+  size_t ok = 0;
+  size_t failed = 0;
+  size_t wrong = 0;
+  std::vector<double> deviceMs;
+  nvr::HttpClient::Stats http;
+  nvr::OnvifProvisioner::Stats provisioner;
+};
+
+RunResult run(int devices, int concurrency, uint16_t port, bool pooled, MockDevices* mock) {
+  mock->closeAfterResponse = !pooled;
+  nvr::EventLoop loop;
+  nvr::HttpClientOptions httpOptions;
+  httpOptions.maxConnectionsPerHost = 1;
+  httpOptions.maxConnections = static_cast<uint32_t>(concurrency) * 2;
+  nvr::HttpClient http(&loop, httpOptions);
+  nvr::OnvifProvisionerOptions options;
+  options.concurrency = static_cast<uint32_t>(concurrency);
+  options.tokenReuseMs = pooled ? 10000 : 0;
+  nvr::OnvifProvisioner provisioner(&http, options);
+
+  std::vector<nvr::OnvifDevice> list;
+  for (int i = 0; i < devices; ++i) {
+    list.push_back({std::to_string(i), "http://admin:" + devicePassword(i) + "@" + deviceIp(i) +
+                                           ":" + std::to_string(port) + "/onvif/device_service"});
+  }
+
+  RunResult result;
+  uint64_t startMs = nvr::EventLoop::monotonicMs();
+  double startCpu = threadCpuSeconds();
+  loop.post([&] {
+    provisioner.provision(
+        std::move(list),
+        [&](const nvr::OnvifProvisionResult& r) {
+          result.deviceMs.push_back(static_cast<double>(r.elapsedMs));
+          if (r.error) {
+            ++result.failed;
+            if (result.failed <= 3)
+              fprintf(stderr, "device %s: %s failed: %s %s\n", r.id.c_str(), r.step,
+                      strerror(-r.error), r.fault.c_str());
+            return;
+          }
+          int index = atoi(r.id.c_str());
+          bool good = r.streamUris.size() == 2 && r.profiles.size() == 2 &&
+                      r.profiles[0].width == 1920 && r.profiles[1].encoding == "H264" &&
+                      r.services.hasPtz;
+          for (size_t s = 0; good && s < r.streamUris.size(); ++s)
+            good = r.streamUris[s] == expectedUri(index, static_cast<int>(s));
+          if (good) {
+            ++result.ok;
+          } else {
+            ++result.wrong;
+          }
+        },
+        [&] { loop.quit(); });
+  });
+  loop.run();
+  result.wallSeconds = (nvr::EventLoop::monotonicMs() - startMs) / 1000.0;
+  result.cpuSeconds = threadCpuSeconds() - startCpu;
+  result.http = http.stats();
+  result.provisioner = provisioner.stats();
+  return result;
+}
+
+double percentile(std::vector<double>* v, double p) {
+  if (v->empty()) return 0;
+  size_t i = std::min(v->size() - 1, static_cast<size_t>(p * static_cast<double>(v->size())));
+  std::nth_element(v->begin(), v->begin() + static_cast<long>(i), v->end());
+  return (*v)[i];
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  nvr::setLogLevel(nvr::LogLevel::Warn);
+  int devices = argc > 1 ? atoi(argv[1]) : 5000;
+  int concurrency = argc > 2 ? atoi(argv[2]) : 256;
+  uint64_t latencyMs = argc > 3 ? strtoull(argv[3], nullptr, 10) : 20;
+  if (devices <= 0 || devices > 250 * kHostsPerSubnet || concurrency <= 0) {
+    fprintf(stderr, "usage: bench_onvif [devices] [concurrency] [device-latency-ms]\n");
+    return 1;
+  }
+
+  nvr::SocketAddress any;
+  nvr::resolveAddress("0.0.0.0", 0, &any);
+  int listenFd = nvr::tcpListen(any, 4096);
+  if (listenFd < 0) {
+    fprintf(stderr, "listen: %s\n", strerror(-listenFd));
+    return 1;
+  }
+  nvr::SocketAddress bound;
+  nvr::localAddress(listenFd, &bound);
+
+  nvr::EventLoop serverLoop(1);
+  MockDevices mock(&serverLoop, listenFd, devices, latencyMs);
+  serverLoop.post([&] { mock.start(); });
+  std::thread server([&] { serverLoop.run(); });
+
+  printf("%d devices, %d in flight, %llu ms device latency, 5 requests per device\n\n", devices,
+         concurrency, static_cast<unsigned long long>(latencyMs));
+  printf("%-9s %7s %6s %8s %9s %8s %8s %9s %9s %8s %8s %8s\n", "mode", "ok", "fail", "wall s",
+         "req/s", "conns", "reused", "digests", "tok hits", "cpu s", "p50 ms", "p99 ms");
+  for (bool pooled : {true, false}) {
+    RunResult r = run(devices, concurrency, bound.port(), pooled, &mock);
+    double requests = static_cast<double>(r.http.requests);
+    uint64_t tokens = r.provisioner.digests + r.provisioner.digestReuses;
+    printf("%-9s %7zu %6zu %8.2f %9.0f %8llu %7.1f%% %9llu %8.1f%% %8.2f %8.0f %8.0f\n",
+           pooled ? "pooled" : "per-req", r.ok, r.failed + r.wrong, r.wallSeconds,
+           requests / r.wallSeconds, static_cast<unsigned long long>(r.http.connectionsOpened),
+           100.0 * r.http.reused / std::max(1.0, requests),
+           static_cast<unsigned long long>(r.provisioner.digests),
+           100.0 * r.provisioner.digestReuses / std::max<uint64_t>(1, tokens), r.cpuSeconds,
+           percentile(&r.deviceMs, 0.5), percentile(&r.deviceMs, 0.99));
+  }
+  printf("\nmock: %llu requests, %llu rejected\n",
+         static_cast<unsigned long long>(mock.requests.load()),
+         static_cast<unsigned long long>(mock.rejected.load()));
+
+  serverLoop.quit();
+  server.join();
+  ::close(listenFd);
+  return 0;
+}
@@ -0,0 +1,313 @@
+// Cluster placement simulation.
+//
+// Runs PlacementScheduler against in-process SimulatedNodes: cameras with
+// mixed bitrates over nodes of different disk bandwidth and CPU, driven in
+// ticks (each node confirms starts, reports its status, then the scheduler
+// rebalances). Phases: initial placement, nodes joining, a planned drain,
+// a node failure, a bitrate surge and a CPU-starved node. For each phase it
+// reports the cameras moved against the bitrate that had to move, the
+// cameras a from-scratch placement on the new membership would have moved,
+// ticks to settle, the worst node utilization and the camera-ticks during
+// which a camera that had been recorded was not (must be 0 outside a
+// failure). It also times rebalance().
+//
+//   bench_placement [nodes] [cameras] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "base/log.h"
+#include "cluster/placement.h"
+#include "cluster/simulated_node.h"
+
+namespace {
+
+constexpr int kStartTicks = 3;
+constexpr int kMaxTicks = 400;
+constexpr uint64_t kTickMs = 1000;
+constexpr uint64_t kFreeBytes = 4ull << 40;
+
+class NullAgent : public nvr::NodeAgent {
+ public:
+  void startRecording(const std::string&) override {}
+  void stopRecording(const std::string&) override {}
+};
+
+struct SimNode {
+  std::unique_ptr<nvr::SimulatedNode> agent;
+  uint64_t diskBps = 0;
+  uint64_t cpuBps = 0;  // bitrate that saturates the CPU
+  double otherLoad = 0.05;
+};
+
+class Simulation {
+ public:
+  Simulation(int cameras, uint32_t seed) : rng_(seed) {
+    nvr::PlacementOptions options;
+    scheduler_.reset(new nvr::PlacementScheduler(options));
+    std::discrete_distribution<int> mix({60, 30, 10});
+    const uint64_t rates[] = {2000000, 4000000, 8000000};
+    for (int i = 0; i < cameras; ++i) {
+      std::string id = "cam-" + std::to_string(i);
+      bitrate_[id] = rates[mix(rng_)];
+      scheduler_->addCamera(id, bitrate_[id]);
+    }
+  }
+
+  void addNode() {
+    std::string id = "node-" + std::to_string(nextNode_++);
+    SimNode& node = nodes_[id];
+    const uint64_t disks[] = {1000000000, 1600000000, 2400000000};
+    node.diskBps = disks[rng_() % 3];
+    node.cpuBps = node.diskBps * 3 / 2;
+    node.agent.reset(new nvr::SimulatedNode(id, scheduler_.get(), kStartTicks));
+    scheduler_->addNode(status(id, node), node.agent.get());
+  }
+
+  std::string anyNode() {
+    auto it = nodes_.begin();
+    std::advance(it, static_cast<long>(rng_() % nodes_.size()));
+    return it->first;
+  }
+
+  void drain(const std::string& id) {
+    scheduler_->drainNode(id);
+    draining_.insert(id);
+  }
+
+  void fail(const std::string& id) {
+    nodes_[id].agent->fail();
+    scheduler_->removeNode(id, nowMs_);
+    nodes_.erase(id);
+  }
+
+  void starveCpu(const std::string& id, double otherLoad) { nodes_[id].otherLoad = otherLoad; }
+
+  void surge(double fraction, double factor) {
+    for (auto& kv : bitrate_) {
+      if (std::uniform_real_distribution<double>(0, 1)(rng_) >= fraction) continue;
+      kv.second = static_cast<uint64_t>(static_cast<double>(kv.second) * factor);
+      scheduler_->updateCamera(kv.first, kv.second);
+    }
+  }
+
+  // Ticks until no camera is unplaced or in handover and a round starts
+  // nothing. Returns the ticks taken.
+  int settle() {
+    for (int tick = 1; tick <= kMaxTicks; ++tick) {
+      nowMs_ += kTickMs;
+      for (auto& kv : nodes_) kv.second.agent->tick(nowMs_);
+      for (auto it = draining_.begin(); it != draining_.end();) {
+        if (!scheduler_->drained(*it)) {
+          ++it;
+          continue;
+        }
+        scheduler_->removeNode(*it, nowMs_);
+        nodes_.erase(*it);
+        it = draining_.erase(it);
+      }
+      for (auto& kv : nodes_) scheduler_->updateNode(status(kv.first, kv.second));
+      auto start = std::chrono::steady_clock::now();
+      size_t starts = scheduler_->rebalance();
+      double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() -
+                                                            start)
+                      .count();
+      rebalanceUs_.push_back(us);
+      countGaps();
+      nvr::PlacementStats stats = scheduler_->stats();
+      if (starts == 0 && stats.starting + stats.handovers + stats.unplaced == 0 &&
+          draining_.empty())
+        return tick;
+    }
+    return kMaxTicks;
+  }
+
+  std::map<std::string, std::string> assignment() const {
+    std::map<std::string, std::string> out;
+    for (const auto& kv : bitrate_) {
+      const std::string* owner = scheduler_->ownerOf(kv.first);
+      if (owner) out[kv.first] = *owner;
+    }
+    return out;
+  }
+
+  // Cameras a scheduler starting from nothing on the current membership
+  // would put elsewhere than `before`.
+  size_t rehashMoves(const std::map<std::string, std::string>& before) {
+    NullAgent agent;
+    nvr::PlacementScheduler fresh;
+    for (const auto& kv : nodes_)
+      if (!draining_.count(kv.first)) fresh.addNode(status(kv.first, kv.second), &agent);
+    for (const auto& kv : bitrate_) fresh.addCamera(kv.first, kv.second);
+    fresh.rebalance();
+    size_t moves = 0;
+    for (const auto& kv : before) {
+      const std::string* target = fresh.targetOf(kv.first);
+      if (!target || *target != kv.second) ++moves;
+    }
+    return moves;
+  }
+
+  uint64_t capacityOf(const std::string& id) {
+    const SimNode& node = nodes_[id];
+    return std::min<uint64_t>(node.diskBps * 8 / 10, node.cpuBps * 85 / 100);
+  }
+
+  uint64_t demand() const {
+    uint64_t total = 0;
+    for (const auto& kv : bitrate_) total += kv.second;
+    return total;
+  }
+
+  uint64_t bitrateOf(const std::string& camera) const { return bitrate_.at(camera); }
+  nvr::PlacementScheduler& scheduler() { return *scheduler_; }
+  const std::map<std::string, SimNode>& nodes() const { return nodes_; }
+  std::vector<double>* rebalanceUs() { return &rebalanceUs_; }
+
+  uint64_t takeGaps() {
+    uint64_t gaps = gapTicks_;
+    gapTicks_ = 0;
+    return gaps;
+  }
+
+ private:
+  nvr::NodeStatus status(const std::string& id, const SimNode& node) const {
+    nvr::NodeStatus status;
+    status.id = id;
+    status.diskBandwidthBps = node.diskBps;
+    status.freeBytes = kFreeBytes;
+    uint64_t recorded = 0;
+    for (const std::string& camera : node.agent->recording()) recorded += bitrate_.at(camera);
+    status.recordedBps = recorded;
+    status.cpuLoad = std::min(
+        1.0, node.otherLoad + static_cast<double>(recorded) / static_cast<double>(node.cpuBps));
+    return status;
+  }
+
+  void countGaps() {
+    std::set<std::string> recorded;
+    for (const auto& kv : nodes_)
+      recorded.insert(kv.second.agent->recording().begin(), kv.second.agent->recording().end());
+    for (const std::string& camera : recorded) everRecorded_.insert(camera);
+    for (const std::string& camera : everRecorded_)
+      if (!recorded.count(camera)) ++gapTicks_;
+  }
+
+  std::mt19937 rng_;
+  std::unique_ptr<nvr::PlacementScheduler> scheduler_;
+  std::map<std::string, uint64_t> bitrate_;
+  std::map<std::string, SimNode> nodes_;
+  std::set<std::string> draining_;
+  std::set<std::string> everRecorded_;
+  std::vector<double> rebalanceUs_;
+  uint64_t gapTicks_ = 0;
+  uint64_t nowMs_ = 0;
+  int nextNode_ = 0;
+};
+
+void report(const char* phase, Simulation* sim, const std::map<std::string, std::string>& before,
+            uint64_t mustMoveBps, size_t rehash, int ticks) {
+  std::map<std::string, std::string> after = sim->assignment();
+  size_t moved = 0;
+  uint64_t movedBps = 0;
+  for (const auto& kv : after) {
+    auto it = before.find(kv.first);
+    if (it == before.end() || it->second == kv.second) continue;
+    ++moved;
+    movedBps += sim->bitrateOf(kv.first);
+  }
+  nvr::PlacementStats stats = sim->scheduler().stats();
+  printf("%-14s moved %5zu (%7.1f Mbit/s, needed %7.1f)  rehash %5zu  ticks %3d  "
+         "max util %.2f  overcommitted %zu  gap camera-ticks %llu\n",
+         phase, moved, movedBps / 1e6, mustMoveBps / 1e6, rehash, ticks, stats.maxUtilization,
+         stats.overcommitted, static_cast<unsigned long long>(sim->takeGaps()));
+}
+
+uint64_t bitrateOn(Simulation* sim, const std::map<std::string, std::string>& assignment,
+                   const std::string& node) {
+  uint64_t total = 0;
+  for (const auto& kv : assignment)
+    if (kv.second == node) total += sim->bitrateOf(kv.first);
+  return total;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int nodes = argc > 1 ? atoi(argv[1]) : 30;
+  int cameras = argc > 2 ? atoi(argv[2]) : 10000;
+  uint32_t seed = argc > 3 ? static_cast<uint32_t>(atoi(argv[3])) : 1;
+  if (nodes < 3 || cameras <= 0) {
+    fprintf(stderr, "usage: %s [nodes >= 3] [cameras] [seed]\n", argv[0]);
+    return 2;
+  }
+  nvr::setLogLevel(nvr::LogLevel::Warn);
+
+  Simulation sim(cameras, seed);
+  for (int i = 0; i < nodes; ++i) sim.addNode();
+  uint64_t capacity = 0;
+  for (const auto& kv : sim.nodes()) capacity += sim.capacityOf(kv.first);
+  printf("%d nodes, %d cameras, %.1f Gbit/s demand, %.1f Gbit/s capacity\n", nodes, cameras,
+         sim.demand() / 1e9, capacity / 1e9);
+
+  std::map<std::string, std::string> before = sim.assignment();
+  int ticks = sim.settle();
+  report("initial", &sim, before, sim.demand(), 0, ticks);
+
+  // Two nodes join: they should take about their capacity share and no more.
+  before = sim.assignment();
+  sim.addNode();
+  sim.addNode();
+  size_t rehash = sim.rehashMoves(before);
+  uint64_t joined = 0;
+  capacity = 0;
+  for (const auto& kv : sim.nodes()) capacity += sim.capacityOf(kv.first);
+  for (const auto& kv : sim.nodes())
+    if (bitrateOn(&sim, before, kv.first) == 0) joined += sim.capacityOf(kv.first);
+  uint64_t share = static_cast<uint64_t>(static_cast<double>(sim.demand()) * joined / capacity);
+  ticks = sim.settle();
+  report("join 2", &sim, before, share, rehash, ticks);
+
+  before = sim.assignment();
+  std::string node = sim.anyNode();
+  uint64_t onNode = bitrateOn(&sim, before, node);
+  sim.drain(node);
+  rehash = sim.rehashMoves(before);
+  ticks = sim.settle();
+  report("drain 1", &sim, before, onNode, rehash, ticks);
+
+  before = sim.assignment();
+  node = sim.anyNode();
+  onNode = bitrateOn(&sim, before, node);
+  sim.fail(node);
+  rehash = sim.rehashMoves(before);
+  ticks = sim.settle();
+  report("fail 1", &sim, before, onNode, rehash, ticks);
+
+  before = sim.assignment();
+  sim.surge(0.2, 1.5);
+  rehash = sim.rehashMoves(before);
+  ticks = sim.settle();
+  report("surge 20% x1.5", &sim, before, 0, rehash, ticks);
+
+  before = sim.assignment();
+  node = sim.anyNode();
+  sim.starveCpu(node, 0.6);
+  ticks = sim.settle();
+  report("cpu starved", &sim, before, 0, 0, ticks);
+
+  std::vector<double>* us = sim.rebalanceUs();
+  std::sort(us->begin(), us->end());
+  printf("rebalance(): %zu rounds  p50 %.0f us  p99 %.0f us  max %.0f us\n", us->size(),
+         (*us)[us->size() / 2], (*us)[static_cast<size_t>(0.99 * (us->size() - 1))], us->back());
+  return 0;
+}
@@ -0,0 +1,241 @@
+// Pre-event ring buffers: RAM budget, push cost and trigger flushes.
+//
+// Simulates event-only recording on one node: every camera pushes frames
+// of a constant-bitrate H.264-like stream (a keyframe every 2 s at 25 fps)
+// into its ring in one PreEventArena for a while, with nothing recorded.
+// Reports what the arena reserves and what the process really holds, the
+// cost per pushed frame and the heap allocations made while pushing
+// (expected: none), and the pre-roll every ring ends up covering. Then a
+// share of the cameras is triggered one after another, and each ring is
+// flushed into a real SegmentWriter; the flush time per trigger and the
+// first flushed frame of every camera (which must be a keyframe) are
+// checked.
+//
+//   bench_pre_event [cameras] [pre-roll-s] [kbps] [seconds] [dir]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "base/log.h"
+#include "storage/file_util.h"
+#include "storage/pre_event_buffer.h"
+#include "storage/recording_store.h"
+
+namespace {
+
+std::atomic<uint64_t> g_allocations{0};
+
+constexpr int kFps = 25;
+constexpr int kGopFrames = 50;
+constexpr int64_t kFrameUs = 1000000 / kFps;
+constexpr double kGiB = 1024.0 * 1024 * 1024;
+
+size_t residentBytes() {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == nullptr) return 0;
+  unsigned long size = 0, resident = 0;
+  int n = fscanf(f, "%lu %lu", &size, &resident);
+  fclose(f);
+  return n == 2 ? resident * static_cast<size_t>(sysconf(_SC_PAGESIZE)) : 0;
+}
+
+double elapsedSeconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double percentile(std::vector<double> v, double p) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+uint32_t xorshift(uint32_t* state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+void removeRecordings(const std::string& dir) {
+  std::vector<std::string> groups;
+  nvr::listDirectory(dir, &groups);
+  for (const auto& group : groups) {
+    std::string groupDir = nvr::joinPath(dir, group);
+    std::vector<std::string> names;
+    nvr::listDirectory(groupDir, &names);
+    for (const auto& name : names) unlink(nvr::joinPath(groupDir, name).c_str());
+    rmdir(groupDir.c_str());
+  }
+  rmdir(dir.c_str());
+}
+
+}  // namespace
+
+// Counts heap allocations, to show the push path makes none. GCC flags
+// the free() below as mismatched because it cannot see this replacement.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+int main(int argc, char** argv) {
+  nvr::setLogLevel(nvr::LogLevel::Warn);
+  int cameras = argc > 1 ? atoi(argv[1]) : 2000;
+  int preRollSec = argc > 2 ? atoi(argv[2]) : 10;
+  int kbps = argc > 3 ? atoi(argv[3]) : 512;
+  int seconds = argc > 4 ? atoi(argv[4]) : 30;
+  std::string dir = argc > 5 ? argv[5] : "/tmp/nvr_bench_pre_event";
+  if (cameras <= 0 || preRollSec <= 0 || kbps <= 0 || seconds <= preRollSec) {
+    fprintf(stderr, "usage: %s [cameras] [pre-roll-s] [kbps] [seconds > pre-roll] [dir]\n",
+            argv[0]);
+    return 2;
+  }
+  const uint32_t gopMs = kGopFrames * 1000 / kFps;
+  const int64_t preRollUs = preRollSec * 1000000LL;
+
+  printf("%d cameras, %d s pre-roll, %d kbps, keyframe every %u ms at %d fps\n\n", cameras,
+         preRollSec, kbps, gopMs, kFps);
+  printf("budget for 2000 cameras x %d s:", preRollSec);
+  for (uint32_t rate : {512u, 1024u, 2048u, 4096u}) {
+    size_t slot = nvr::preEventSlotBytes(rate, preRollSec * 1000, gopMs);
+    printf("  %u kbps %.1f GiB", rate, 2000.0 * slot / kGiB);
+  }
+  printf("\n");
+
+  size_t before = residentBytes();
+  size_t slotBytes = nvr::preEventSlotBytes(kbps, preRollSec * 1000, gopMs);
+  nvr::PreEventArena arena(cameras, slotBytes, true);
+  if (!arena.valid()) return 1;
+  size_t populated = residentBytes();
+  std::vector<std::unique_ptr<nvr::PreEventRing>> rings;
+  for (int i = 0; i < cameras; ++i) rings.push_back(arena.acquire(preRollUs));
+  printf("arena: %d slots x %zu KB = %.2f GiB reserved, resident +%.2f GiB after populate\n",
+         cameras, arena.slotBytes() / 1024, arena.stats().reservedBytes / kGiB,
+         (populated - before) / kGiB);
+
+  // Frame sizes: a keyframe is a third of its GOP's bytes.
+  const size_t gopBytes = static_cast<size_t>(kbps) * 125 * gopMs / 1000;
+  const size_t keyBytes = gopBytes / 3;
+  const size_t deltaBytes = (gopBytes - keyBytes) / (kGopFrames - 1);
+  std::vector<uint8_t> source(keyBytes * 2);
+  uint32_t rng = 2463534242u;
+  for (auto& b : source) b = static_cast<uint8_t>(xorshift(&rng));
+  std::vector<int> phase(cameras);
+  for (int c = 0; c < cameras; ++c) phase[c] = static_cast<int>(xorshift(&rng) % kGopFrames);
+
+  const int64_t startUs = 1700000000000000LL;
+  const int ticks = seconds * kFps;
+  uint64_t bytes = 0;
+  uint64_t allocations = g_allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < ticks; ++t) {
+    for (int c = 0; c < cameras; ++c) {
+      bool key = (t + phase[c]) % kGopFrames == 0;
+      size_t base = key ? keyBytes : deltaBytes;
+      // +-25% around the mean.
+      size_t size = base * 3 / 4 + xorshift(&rng) % (base / 2 + 1);
+      int64_t ts = startUs + t * kFrameUs + c * kFrameUs / cameras;
+      rings[c]->push(ts, key, source.data(), size);
+      bytes += size;
+    }
+  }
+  double fillSeconds = elapsedSeconds(start);
+  allocations = g_allocations.load() - allocations;
+  uint64_t frames = static_cast<uint64_t>(ticks) * cameras;
+  printf("push:  %.2fM frames (%.2f GiB) in %.2f s: %.0f ns/frame, %.1f GB/s, "
+         "%llu heap allocations\n",
+         frames / 1e6, bytes / kGiB, fillSeconds, 1e9 * fillSeconds / frames,
+         bytes / fillSeconds / 1e9, static_cast<unsigned long long>(allocations));
+
+  int64_t minCover = INT64_MAX, maxCover = 0;
+  size_t maxHigh = 0;
+  uint64_t evictedGops = 0, skipped = 0;
+  for (const auto& ring : rings) {
+    minCover = std::min(minCover, ring->durationUs());
+    maxCover = std::max(maxCover, ring->durationUs());
+    maxHigh = std::max(maxHigh, ring->highWaterBytes());
+    evictedGops += ring->stats().evictedGops;
+    skipped += ring->stats().skipped;
+  }
+  nvr::PreEventArena::Stats stats = arena.stats();
+  printf("rings: %.2f GiB buffered (%.0f%% of reserve), fullest %.0f%% of its slot, "
+         "pre-roll %.1f-%.1f s, %llu GOPs evicted, %llu frames before a first keyframe\n",
+         stats.bufferedBytes / kGiB, 100.0 * stats.bufferedBytes / stats.reservedBytes,
+         100.0 * maxHigh / arena.slotBytes(), minCover / 1e6, (maxCover + kFrameUs) / 1e6,
+         static_cast<unsigned long long>(evictedGops), static_cast<unsigned long long>(skipped));
+  printf("process resident: %.2f GiB\n", residentBytes() / kGiB);
+
+  // Triggers: a tenth of the cameras, one every 5 ms, flushed to disk.
+  nvr::SegmentWriterOptions defaults;
+  defaults.dir = dir;
+  defaults.maxBuffers = 64;
+  nvr::RecordingStore store(defaults);
+  if (store.start() < 0) {
+    fprintf(stderr, "cannot record under %s\n", dir.c_str());
+    return 1;
+  }
+  nvr::EventLoop loop;
+  std::unique_ptr<nvr::SegmentWriter> writer = store.createWriter(&loop, "events");
+  if (writer->open() < 0) return 1;
+  nvr::StreamInfo info;
+  info.codec = "H264";
+  info.clockRate = 90000;
+  uint32_t streamId = writer->addStream(info);
+
+  int triggers = std::max(1, cameras / 10);
+  std::vector<double> flushUs;
+  uint64_t flushedFrames = 0, flushedBytes = 0, notKeyframe = 0, shortPreRoll = 0;
+  std::function<void(int)> trigger = [&](int i) {
+    nvr::PreEventRing* ring = rings[static_cast<size_t>(i) * cameras / triggers].get();
+    if (ring->durationUs() + kFrameUs < preRollUs) ++shortPreRoll;
+    bool first = true;
+    auto t0 = std::chrono::steady_clock::now();
+    ring->flush([&](const nvr::PreEventFrame& frame) {
+      if (first && !frame.keyframe) ++notKeyframe;
+      first = false;
+      writer->append(streamId, nvr::RecordType::Video, frame.keyframe ? nvr::kRecordKeyframe : 0,
+                     frame.timestampUs, frame.data, frame.size);
+      ++flushedFrames;
+      flushedBytes += frame.size;
+    });
+    flushUs.push_back(elapsedSeconds(t0) * 1e6);
+    if (i + 1 < triggers) {
+      loop.runAfter(5, [&trigger, i] { trigger(i + 1); });
+    } else {
+      writer->close([&] { loop.quit(); });
+    }
+  };
+  start = std::chrono::steady_clock::now();
+  loop.post([&] { trigger(0); });
+  loop.run();
+  double flushSeconds = elapsedSeconds(start);
+  const nvr::SegmentWriterStats& ws = writer->stats();
+  printf("flush: %d triggers in %.2f s, %.0f frames (%.1f MB) each, p50 %.0f us p99 %.0f us; "
+         "%llu records dropped, %llu not starting at a keyframe, %llu short of the pre-roll\n",
+         triggers, flushSeconds, static_cast<double>(flushedFrames) / triggers,
+         flushedBytes / 1e6 / triggers, percentile(flushUs, 0.5), percentile(flushUs, 0.99),
+         static_cast<unsigned long long>(ws.droppedRecords),
+         static_cast<unsigned long long>(notKeyframe),
+         static_cast<unsigned long long>(shortPreRoll));
+  writer.reset();
+  store.stop();
+  removeRecordings(dir);
+  return 0;
+}
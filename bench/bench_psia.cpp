@@ -0,0 +1,461 @@
+// Bulk PSIA provisioning against a local mock.
+//
+// The PSIA twin of bench_onvif: a mock server on its own loop thread plays
+// N PSIA devices on distinct loopback addresses (127.0.x.y), demands HTTP
+// Digest (qop=auth) on every request like a camera does, answers after a
+// fixed processing delay and returns documents of realistic size. The
+// client side runs PsiaProvisioner on the main thread and reports wall
+// time, request rate, connection reuse, 401 round trips and client CPU per
+// device, once with keep-alive and once with a connection per request, so
+// the per-device cost can be set against bench_onvif's.
+//
+//   bench_psia [devices] [concurrency] [device-latency-ms]
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/event_loop.h"
+#include "base/log.h"
+#include "base/md5.h"
+#include "base/socket_util.h"
+#include "http/http_client.h"
+#include "http/http_message.h"
+#include "psia/psia_provisioner.h"
+#include "rtsp/rtsp_message.h"
+
+namespace {
+
+constexpr int kHostsPerSubnet = 250;
+constexpr char kRealm[] = "IP Camera(C1234)";
+
+std::string deviceIp(int index) {
+  return "127.0." + std::to_string(1 + index / kHostsPerSubnet) + "." +
+         std::to_string(1 + index % kHostsPerSubnet);
+}
+
+std::string devicePassword(int index) { return "pw-" + std::to_string(index); }
+
+std::string expectedUri(int index, int stream) {
+  return "rtsp://admin:" + devicePassword(index) + "@" + deviceIp(index) +
+         "/PSIA/Streaming/channels/10" + std::to_string(stream + 1);
+}
+
+double threadCpuSeconds() {
+  rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+const char kXmlHead[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+
+std::string deviceInfoXml(int device) {
+  return kXmlHead + std::string(
+             "<DeviceInfo version=\"1.0\" xmlns=\"urn:psialliance-org\">\n"
+             "<deviceName>IP CAMERA</deviceName>\n<deviceID>88") +
+         std::to_string(device) +
+         "</deviceID>\n<deviceDescription>IPCamera</deviceDescription>\n"
+         "<deviceLocation>hangzhou</deviceLocation>\n<systemContact>Hikvision.China"
+         "</systemContact>\n<model>DS-2CD2143G2-I</model>\n<serialNumber>DS-2CD2143G2-"
+         "I20231101AAWRJ" + std::to_string(device) + "</serialNumber>\n<macAddress>"
+         "44:47:cc:00:00:00</macAddress>\n<firmwareVersion>V5.7.3</firmwareVersion>\n"
+         "<firmwareReleasedDate>build 220112</firmwareReleasedDate>\n<encoderVersion>V7.3"
+         "</encoderVersion>\n<encoderReleasedDate>build 211223</encoderReleasedDate>\n"
+         "<deviceType>IPCamera</deviceType>\n<telecontrolID>88</telecontrolID>\n"
+         "</DeviceInfo>\n";
+}
+
+std::string channelXml(int stream) {
+  bool main = stream == 0;
+  std::string id = "10" + std::to_string(stream + 1);
+  return "<StreamingChannel version=\"1.0\" xmlns=\"urn:psialliance-org\">\n<id>" + id +
+         "</id>\n<channelName>Camera 01</channelName>\n<enabled>true</enabled>\n"
+         "<Transport>\n<rtspPortNo>554</rtspPortNo>\n<maxPacketSize>1000</maxPacketSize>\n"
+         "<ControlProtocolList>\n<ControlProtocol>\n<streamingTransport>RTSP"
+         "</streamingTransport>\n</ControlProtocol>\n<ControlProtocol>\n"
+         "<streamingTransport>HTTP</streamingTransport>\n</ControlProtocol>\n"
+         "</ControlProtocolList>\n<Multicast>\n<enabled>false</enabled>\n"
+         "<userTriggerThreshold>false</userTriggerThreshold>\n<destIPAddress>0.0.0.0"
+         "</destIPAddress>\n<videoDestPortNo>8860</videoDestPortNo>\n<audioDestPortNo>8862"
+         "</audioDestPortNo>\n</Multicast>\n<Security>\n<enabled>true</enabled>\n"
+         "</Security>\n</Transport>\n<Video>\n<enabled>true</enabled>\n"
+         "<videoInputChannelID>1</videoInputChannelID>\n<videoCodecType>H.264"
+         "</videoCodecType>\n<videoScanType>progressive</videoScanType>\n"
+         "<videoResolutionWidth>" + (main ? "1920" : "640") + "</videoResolutionWidth>\n"
+         "<videoResolutionHeight>" + (main ? "1080" : "360") + "</videoResolutionHeight>\n"
+         "<videoQualityControlType>VBR</videoQualityControlType>\n<constantBitRate>" +
+         (main ? "4096" : "512") + "</constantBitRate>\n<fixedQuality>60</fixedQuality>\n"
+         "<vbrUpperCap>" + (main ? "4096" : "512") + "</vbrUpperCap>\n<vbrLowerCap>32"
+         "</vbrLowerCap>\n<maxFrameRate>2500</maxFrameRate>\n<keyFrameInterval>2000"
+         "</keyFrameInterval>\n<rotationDegree>0</rotationDegree>\n<mirrorEnabled>false"
+         "</mirrorEnabled>\n<snapShotImageType>JPEG</snapShotImageType>\n</Video>\n"
+         "<Audio>\n<enabled>false</enabled>\n<audioInputChannelID>1</audioInputChannelID>\n"
+         "<audioCompressionType>G.711ulaw</audioCompressionType>\n</Audio>\n"
+         "</StreamingChannel>\n";
+}
+
+std::string channelsXml() {
+  return kXmlHead +
+         std::string("<StreamingChannelList version=\"1.0\" xmlns=\"urn:psialliance-org\">\n") +
+         channelXml(0) + channelXml(1) + "</StreamingChannelList>\n";
+}
+
+std::string triggerXml(const char* id, const char* type, const char* input, bool record) {
+  return std::string("<EventTrigger version=\"1.0\" xmlns=\"urn:psialliance-org\">\n<id>") +
+         id + "</id>\n<eventType>" + type + "</eventType>\n<eventDescription>" + type +
+         " Event trigger Information</eventDescription>\n" + input +
+         "<EventTriggerNotificationList version=\"1.0\">\n<EventTriggerNotification>\n<id>"
+         "center</id>\n<notificationMethod>center</notificationMethod>\n"
+         "<notificationRecurrence>beginning</notificationRecurrence>\n"
+         "</EventTriggerNotification>\n" +
+         (record ? "<EventTriggerNotification>\n<id>record-1</id>\n<notificationMethod>record"
+                   "</notificationMethod>\n<notificationRecurrence>beginning"
+                   "</notificationRecurrence>\n<videoInputID>1</videoInputID>\n"
+                   "</EventTriggerNotification>\n"
+                 : "") +
+         "</EventTriggerNotificationList>\n</EventTrigger>\n";
+}
+
+std::string triggersXml() {
+  return kXmlHead +
+         std::string("<EventTriggerList version=\"1.0\" xmlns=\"urn:psialliance-org\">\n") +
+         triggerXml("VMD-1", "VMD", "<videoInputChannelID>1</videoInputChannelID>\n", true) +
+         triggerXml("tamper-1", "tamperdetection",
+                    "<videoInputChannelID>1</videoInputChannelID>\n", false) +
+         triggerXml("IO-1", "IO", "<inputIOPortID>1</inputIOPortID>\n", true) +
+         triggerXml("videoloss-1", "videoloss",
+                    "<videoInputChannelID>1</videoInputChannelID>\n", false) +
+         "</EventTriggerList>\n";
+}
+
+std::string responseStatusXml(const char* path, int code, const char* text) {
+  return kXmlHead + std::string("<ResponseStatus version=\"1.0\" "
+                                "xmlns=\"urn:psialliance-org\">\n<requestURL>") +
+         path + "</requestURL>\n<statusCode>" + std::to_string(code) +
+         "</statusCode>\n<statusString>" + text + "</statusString>\n</ResponseStatus>\n";
+}
+
+class MockDevices;
+
+class MockConnection : public nvr::EventHandler {
+ public:
+  MockConnection(MockDevices* devices, int fd, int device)
+      : devices_(devices), fd_(fd), device_(device) {}
+  void onEvents(uint32_t events) override;
+  void respond(const std::string& response, bool close);
+
+ private:
+  void flush();
+  void shutdown();
+
+  MockDevices* devices_;
+  int fd_;
+  int device_;
+  nvr::ByteBuffer input_;
+  nvr::ByteBuffer output_{4 * 1024};
+  int pending_ = 0;
+  bool closing_ = false;
+  bool wantWrite_ = false;
+};
+
+class MockDevices : public nvr::EventHandler {
+ public:
+  MockDevices(nvr::EventLoop* loop, int listenFd, int devices, uint64_t latencyMs)
+      : loop_(loop), listenFd_(listenFd), devices_(devices), latencyMs_(latencyMs) {}
+
+  void start() { loop_->add(listenFd_, EPOLLIN, this); }
+
+  void onEvents(uint32_t) override {
+    for (;;) {
+      int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) return;
+      nvr::SocketAddress local;
+      nvr::localAddress(fd, &local);
+      auto* sin = reinterpret_cast<const sockaddr_in*>(local.get());
+      uint32_t ip = ntohl(sin->sin_addr.s_addr);
+      int device = (static_cast<int>((ip >> 8) & 0xff) - 1) * kHostsPerSubnet +
+                   static_cast<int>(ip & 0xff) - 1;
+      auto* conn = new MockConnection(this, fd, device);
+      loop_->add(fd, EPOLLIN, conn);
+    }
+  }
+
+  // Builds the response to one request from device.
+  std::string handle(int device, const nvr::HttpRequest& request) {
+    ++requests;
+    bool keepAlive = !closeAfterResponse;
+    if (!authorized(device, request)) {
+      ++challenged;
+      nvr::HeaderList headers = {
+          {"WWW-Authenticate", std::string("Digest qop=\"auth\", realm=\"") + kRealm +
+                                   "\", nonce=\"" + nonceFor(device) + "\", stale=\"FALSE\""},
+          {"Content-Type", "application/xml"}};
+      return nvr::buildHttpResponse(401, "Unauthorized", headers,
+                                    responseStatusXml(request.target.c_str(), 4,
+                                                      "Invalid Operation"),
+                                    keepAlive);
+    }
+    std::string body;
+    if (request.method == "GET" && request.target == "/PSIA/System/deviceInfo") {
+      body = deviceInfoXml(device);
+    } else if (request.method == "GET" && request.target == "/PSIA/Streaming/channels") {
+      body = channelsXml();
+    } else if (request.method == "GET" && request.target == "/PSIA/Custom/Event/triggers") {
+      body = triggersXml();
+    } else {
+      return nvr::buildHttpResponse(404, "Not Found", xmlHeaders(),
+                                    responseStatusXml(request.target.c_str(), 4,
+                                                      "Invalid Operation"),
+                                    keepAlive);
+    }
+    return nvr::buildHttpResponse(200, "OK", xmlHeaders(), body, keepAlive);
+  }
+
+  nvr::EventLoop* loop() const { return loop_; }
+  uint64_t latencyMs() const { return latencyMs_; }
+
+  std::atomic<bool> closeAfterResponse{false};
+  std::atomic<uint64_t> requests{0};
+  std::atomic<uint64_t> challenged{0};
+  std::atomic<uint64_t> rejected{0};
+
+ private:
+  static nvr::HeaderList xmlHeaders() {
+    return {{"Server", "App-webs/"}, {"Content-Type", "application/xml; charset=\"UTF-8\""}};
+  }
+
+  static std::string nonceFor(int device) {
+    return nvr::Md5::hex("nonce-" + std::to_string(device));
+  }
+
+  bool authorized(int device, const nvr::HttpRequest& request) {
+    const std::string* header = request.header("Authorization");
+    if (!header || header->compare(0, 7, "Digest ") != 0) return false;
+    std::string user, realm, nonce, uri, nc, cnonce, response;
+    for (const auto& kv : nvr::splitParameters(header->substr(7), ',')) {
+      if (kv.first == "username") user = kv.second;
+      else if (kv.first == "realm") realm = kv.second;
+      else if (kv.first == "nonce") nonce = kv.second;
+      else if (kv.first == "uri") uri = kv.second;
+      else if (kv.first == "nc") nc = kv.second;
+      else if (kv.first == "cnonce") cnonce = kv.second;
+      else if (kv.first == "response") response = kv.second;
+    }
+    bool ok = device >= 0 && device < devices_ && user == "admin" && realm == kRealm &&
+              nonce == nonceFor(device) && uri == request.target;
+    if (ok) {
+      std::string ha1 = nvr::Md5::hex(user + ":" + realm + ":" + devicePassword(device));
+      std::string ha2 = nvr::Md5::hex(request.method + ":" + uri);
+      ok = response == nvr::Md5::hex(ha1 + ":" + nonce + ":" + nc + ":" + cnonce + ":auth:" +
+                                     ha2);
+    }
+    if (!ok && header) ++rejected;
+    return ok;
+  }
+
+  nvr::EventLoop* loop_;
+  int listenFd_;
+  int devices_;
+  uint64_t latencyMs_;
+};
+
+void MockConnection::onEvents(uint32_t events) {
+  if (fd_ < 0) return;
+  if (events & EPOLLOUT) flush();
+  if (fd_ < 0 || !(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) return;
+  for (;;) {
+    ssize_t n = input_.readFd(fd_);
+    if (n == -EAGAIN) break;
+    if (n <= 0) {
+      shutdown();
+      return;
+    }
+  }
+  for (;;) {
+    nvr::HttpRequest request;
+    int used = nvr::parseHttpRequest(reinterpret_cast<const char*>(input_.data()),
+                                     input_.size(), &request);
+    if (used < 0) {
+      shutdown();
+      return;
+    }
+    if (used == 0) return;
+    input_.consume(used);
+    std::string response = devices_->handle(device_, request);
+    bool close = devices_->closeAfterResponse || !request.keepAlive;
+    ++pending_;
+    // Device firmware is slow; answer after the processing delay.
+    devices_->loop()->runAfter(devices_->latencyMs(), [this, response, close] {
+      respond(response, close);
+    });
+  }
+}
+
+void MockConnection::respond(const std::string& response, bool close) {
+  --pending_;
+  if (fd_ < 0) {
+    if (pending_ == 0) delete this;
+    return;
+  }
+  output_.append(response);
+  closing_ = closing_ || close;
+  flush();
+}
+
+void MockConnection::flush() {
+  while (!output_.empty()) {
+    ssize_t n = output_.writeFd(fd_);
+    if (n == -EAGAIN) {
+      if (!wantWrite_) {
+        wantWrite_ = true;
+        devices_->loop()->modify(fd_, EPOLLIN | EPOLLOUT, this);
+      }
+      return;
+    }
+    if (n < 0) {
+      shutdown();
+      return;
+    }
+  }
+  if (wantWrite_) {
+    wantWrite_ = false;
+    devices_->loop()->modify(fd_, EPOLLIN, this);
+  }
+  if (closing_) shutdown();
+}
+
+void MockConnection::shutdown() {
+  if (fd_ < 0) return;
+  devices_->loop()->remove(fd_);
+  ::close(fd_);
+  fd_ = -1;
+  if (pending_ == 0) devices_->loop()->deleteLater(this);
+}
+
+struct RunResult {
+  double wallSeconds = 0;
+  double cpuSeconds = 0;
+  size_t ok = 0;
+  size_t failed = 0;
+  size_t wrong = 0;
+  nvr::HttpClient::Stats http;
+  nvr::PsiaProvisioner::Stats provisioner;
+};
+
+RunResult run(int devices, int concurrency, uint16_t port, bool pooled, MockDevices* mock) {
+  mock->closeAfterResponse = !pooled;
+  nvr::EventLoop loop;
+  nvr::HttpClientOptions httpOptions;
+  httpOptions.maxConnectionsPerHost = 1;
+  httpOptions.maxConnections = static_cast<uint32_t>(concurrency) * 2;
+  nvr::HttpClient http(&loop, httpOptions);
+  nvr::PsiaProvisionerOptions options;
+  options.concurrency = static_cast<uint32_t>(concurrency);
+  nvr::PsiaProvisioner provisioner(&http, options);
+
+  std::vector<nvr::PsiaDevice> list;
+  for (int i = 0; i < devices; ++i) {
+    list.push_back({std::to_string(i), "http://admin:" + devicePassword(i) + "@" +
+                                           deviceIp(i) + ":" + std::to_string(port) + "/"});
+  }
+
+  RunResult result;
+  uint64_t startMs = nvr::EventLoop::monotonicMs();
+  double startCpu = threadCpuSeconds();
+  loop.post([&] {
+    provisioner.provision(
+        std::move(list),
+        [&](const nvr::PsiaProvisionResult& r) {
+          if (r.error) {
+            ++result.failed;
+            if (result.failed <= 3)
+              fprintf(stderr, "device %s: %s failed: %s %s\n", r.id.c_str(), r.step,
+                      strerror(-r.error), r.fault.c_str());
+            return;
+          }
+          int index = atoi(r.id.c_str());
+          bool good = r.streamUris.size() == 2 && r.channels.size() == 2 &&
+                      r.channels[0].width == 1920 && r.channels[1].codec == "H264" &&
+                      r.channels[0].frameRate == 25 && r.triggers.size() == 4 &&
+                      r.triggers[0].records && r.info.model == "DS-2CD2143G2-I";
+          for (size_t s = 0; good && s < r.streamUris.size(); ++s)
+            good = r.streamUris[s] == expectedUri(index, static_cast<int>(s));
+          if (good) {
+            ++result.ok;
+          } else {
+            ++result.wrong;
+          }
+        },
+        [&] { loop.quit(); });
+  });
+  loop.run();
+  result.wallSeconds = (nvr::EventLoop::monotonicMs() - startMs) / 1000.0;
+  result.cpuSeconds = threadCpuSeconds() - startCpu;
+  result.http = http.stats();
+  result.provisioner = provisioner.stats();
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  nvr::setLogLevel(nvr::LogLevel::Warn);
+  int devices = argc > 1 ? atoi(argv[1]) : 5000;
+  int concurrency = argc > 2 ? atoi(argv[2]) : 256;
+  uint64_t latencyMs = argc > 3 ? strtoull(argv[3], nullptr, 10) : 20;
+  if (devices <= 0 || devices > 250 * kHostsPerSubnet || concurrency <= 0) {
+    fprintf(stderr, "usage: bench_psia [devices] [concurrency] [device-latency-ms]\n");
+    return 1;
+  }
+
+  nvr::SocketAddress any;
+  nvr::resolveAddress("0.0.0.0", 0, &any);
+  int listenFd = nvr::tcpListen(any, 4096);
+  if (listenFd < 0) {
+    fprintf(stderr, "listen: %s\n", strerror(-listenFd));
+    return 1;
+  }
+  nvr::SocketAddress bound;
+  nvr::localAddress(listenFd, &bound);
+
+  nvr::EventLoop serverLoop(1);
+  MockDevices mock(&serverLoop, listenFd, devices, latencyMs);
+  serverLoop.post([&] { mock.start(); });
+  std::thread server([&] { serverLoop.run(); });
+
+  printf("%d devices, %d in flight, %llu ms device latency, 3 resources per device\n\n",
+         devices, concurrency, static_cast<unsigned long long>(latencyMs));
+  printf("%-9s %7s %6s %8s %9s %8s %8s %8s %8s %11s\n", "mode", "ok", "fail", "wall s",
+         "req/s", "conns", "reused", "401s", "cpu s", "cpu us/dev");
+  for (bool pooled : {true, false}) {
+    RunResult r = run(devices, concurrency, bound.port(), pooled, &mock);
+    double requests = static_cast<double>(r.http.requests);
+    printf("%-9s %7zu %6zu %8.2f %9.0f %8llu %7.1f%% %8llu %8.2f %11.0f\n",
+           pooled ? "pooled" : "per-req", r.ok, r.failed + r.wrong, r.wallSeconds,
+           requests / r.wallSeconds, static_cast<unsigned long long>(r.http.connectionsOpened),
+           100.0 * r.http.reused / std::max(1.0, requests),
+           static_cast<unsigned long long>(r.provisioner.challenges), r.cpuSeconds,
+           1e6 * r.cpuSeconds / devices);
+  }
+  printf("\nmock: %llu requests, %llu challenged, %llu bad digests\n",
+         static_cast<unsigned long long>(mock.requests.load()),
+         static_cast<unsigned long long>(mock.challenged.load()),
+         static_cast<unsigned long long>(mock.rejected.load()));
+
+  serverLoop.quit();
+  server.join();
+  ::close(listenFd);
+  return 0;
+}
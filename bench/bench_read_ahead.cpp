@@ -0,0 +1,458 @@
+// Replay read-ahead benchmark: many single-camera replays of an archive
+// that is not in the page cache.
+//
+// Records [cameras] synthetic cameras through one SegmentWriter on
+// simulated time (25 fps, a keyframe every 2 s, every frame carrying its
+// recorded stamp), so that their chunks interleave in the group's segment
+// files, then plays [viewers] replays at [scale], each of one camera from
+// its own start, from a ReplayMediaProvider with a single loop. Twice, the
+// segment files dropped from the page cache (POSIX_FADV_DONTNEED) before
+// each: without an IoBackend, every chunk read with pread() on the loop as
+// it comes, then with one, read ahead and never waited for on the loop
+// (read_ahead.h). Viewers are socket pairs read by a client thread.
+// Reported per run:
+//
+//  - pacing error: how much later than its RTP time a frame arrived,
+//    against the viewer's most punctual frame (p50, p99, max), and the
+//    frames more than 100 ms late: stutter;
+//  - chunk reads the page cache served, of all the replays' chunk reads,
+//    and the chunks fetched after a miss;
+//  - what the process read from the disk, per second, against what the
+//    replays read: the kernel's own read-ahead shows as the difference;
+//  - the read-ahead hinted and its node budget's peak;
+//  - the loop's CPU.
+//
+//   bench_read_ahead [dir] [cameras] [viewers] [seconds] [kbps] [scale]
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/clock.h"
+#include "base/event_loop.h"
+#include "base/event_loop_pool.h"
+#include "bench_stamp.h"
+#include "replay/replay_provider.h"
+#include "storage/archive_index.h"
+#include "storage/file_util.h"
+#include "storage/io_backend.h"
+#include "storage/read_ahead.h"
+#include "storage/recording_store.h"
+#include "storage/segment_format.h"
+
+namespace {
+
+using nvr::bench::findStamp;
+using nvr::bench::kStampBytes;
+using nvr::bench::putStamp;
+
+constexpr int kFps = 25;
+constexpr int64_t kFrameUs = 1000000 / kFps;
+constexpr int kGopFrames = 50;
+constexpr int kKeyframeWeight = 8;
+constexpr int64_t kStartUs = 1700000000ll * 1000000;
+constexpr double kStutterMs = 100;
+
+const uint8_t kSps[] = {0x67, 0x42, 0xc0, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8};
+const uint8_t kPps[] = {0x68, 0xce, 0x3c, 0x80};
+
+double percentile(std::vector<double> v, double p) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+double cpuSeconds(int who) {
+  struct rusage usage;
+  getrusage(who, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Bytes the process had read from storage, read-ahead included.
+uint64_t diskReadBytes() {
+  FILE* f = fopen("/proc/self/io", "r");
+  if (f == nullptr) return 0;
+  char line[128];
+  unsigned long long bytes = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "read_bytes: %llu", &bytes) == 1) break;
+  }
+  fclose(f);
+  return bytes;
+}
+
+// Leftovers of an earlier run would overlap this one's recording.
+void clearGroup(const std::string& groupDir) {
+  std::vector<std::string> names;
+  if (nvr::listDirectory(groupDir, &names) < 0) return;
+  for (const auto& name : names) ::unlink(nvr::joinPath(groupDir, name).c_str());
+}
+
+// Drops the group's files from the page cache; they were synced when the
+// store stopped.
+void evictGroup(const std::string& groupDir) {
+  std::vector<std::string> names;
+  if (nvr::listDirectory(groupDir, &names) < 0) return;
+  for (const auto& name : names) {
+    int fd = ::open(nvr::joinPath(groupDir, name).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) continue;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+  }
+}
+
+std::string cameraName(int c) {
+  char name[16];
+  snprintf(name, sizeof(name), "cam-%02d", c);
+  return name;
+}
+
+// Records seconds of every camera on the loop thread, one simulated
+// second per step, waiting for the disk in between.
+class Recorder {
+ public:
+  Recorder(nvr::RecordingStore* store, nvr::EventLoop* loop, int cameras, int seconds, int kbps)
+      : loop_(loop), seconds_(seconds) {
+    size_t unit = static_cast<size_t>(kbps) * 125 * kGopFrames / kFps /
+                  (kGopFrames - 1 + kKeyframeWeight);
+    keyBytes_ = unit * kKeyframeWeight;
+    deltaBytes_ = unit;
+    writer_ = store->createWriter(loop, "loop-0");
+    writer_->open();
+    for (int c = 0; c < cameras; ++c) {
+      nvr::StreamInfo info;
+      info.cameraId = cameraName(c);
+      info.codec = "H264";
+      info.clockRate = 90000;
+      streams_.push_back(writer_->addStream(info));
+    }
+    io_ = store->io();
+  }
+
+  void start(std::function<void()> done) {
+    done_ = std::move(done);
+    step();
+  }
+
+  uint64_t dropped() const { return writer_->stats().droppedRecords; }
+
+ private:
+  void step() {
+    if (second_ == seconds_) {
+      writer_->close([this] { done_(); });
+      return;
+    }
+    for (size_t c = 0; c < streams_.size(); ++c) {
+      for (int f = 0; f < kFps; ++f) {
+        int64_t n = static_cast<int64_t>(second_) * kFps + f;
+        bool keyframe = (n + static_cast<int64_t>(c) * 7) % kGopFrames == 0;
+        int64_t ts = kStartUs + n * kFrameUs;
+        frame_.clear();
+        static const uint8_t kStart[] = {0, 0, 0, 1};
+        if (keyframe) {
+          frame_.insert(frame_.end(), kStart, kStart + 4);
+          frame_.insert(frame_.end(), kSps, kSps + sizeof(kSps));
+          frame_.insert(frame_.end(), kStart, kStart + 4);
+          frame_.insert(frame_.end(), kPps, kPps + sizeof(kPps));
+        }
+        frame_.insert(frame_.end(), kStart, kStart + 4);
+        size_t at = frame_.size();
+        frame_.resize(at + std::max<size_t>(keyframe ? keyBytes_ : deltaBytes_, 1 + kStampBytes),
+                      0x5a);
+        frame_[at] = keyframe ? 0x65 : 0x41;
+        putStamp(&frame_[at + 1], ts);
+        writer_->append(streams_[c], nvr::RecordType::Video, keyframe ? nvr::kRecordKeyframe : 0,
+                        ts, frame_.data(), frame_.size());
+      }
+    }
+    writer_->flush();
+    ++second_;
+    waitIdle();
+  }
+
+  void waitIdle() {
+    if (io_->pending() == 0 && writer_->stats().buffersInFlight == 0) {
+      step();
+    } else {
+      loop_->runAfter(1, [this] { waitIdle(); });
+    }
+  }
+
+  nvr::EventLoop* loop_;
+  int seconds_;
+  nvr::IoBackend* io_ = nullptr;
+  std::unique_ptr<nvr::SegmentWriter> writer_;
+  std::vector<uint32_t> streams_;
+  size_t keyBytes_ = 0;
+  size_t deltaBytes_ = 0;
+  std::vector<uint8_t> frame_;
+  int second_ = 0;
+  std::function<void()> done_;
+};
+
+struct RunResult {
+  std::vector<double> errorMs;
+  uint64_t frames = 0;
+  uint64_t stutters = 0;
+  uint64_t ended = 0;  // hung up by the server
+};
+
+// One viewer's end of its socket pair.
+class Viewer : public nvr::EventHandler {
+ public:
+  Viewer(nvr::EventLoop* loop, int fd) : loop_(loop), fd_(fd) {}
+  ~Viewer() override { close(); }
+
+  // On the client loop's thread.
+  void start() { loop_->add(fd_, EPOLLIN, this); }
+
+  void onEvents(uint32_t events) override {
+    if (fd_ < 0) return;
+    for (;;) {
+      ssize_t n = input_.readFd(fd_, 64 * 1024);
+      if (n == 0) {
+        ended_ = true;
+        return close();
+      }
+      if (n < 0) break;
+    }
+    while (input_.size() >= 4) {
+      const uint8_t* p = input_.data();
+      size_t length = static_cast<size_t>(p[2] << 8 | p[3]);
+      if (input_.size() < 4 + length) break;
+      if (p[0] == '$' && p[1] == 0) onRtp(p + 4, length);
+      input_.consume(4 + length);
+    }
+  }
+
+  // After the client loop stopped.
+  void finish(RunResult* r) const {
+    r->frames += offsetsMs_.size();
+    r->ended += ended_;
+    if (offsetsMs_.empty()) return;
+    double best = *std::min_element(offsetsMs_.begin(), offsetsMs_.end());
+    for (double offset : offsetsMs_) {
+      r->errorMs.push_back(offset - best);
+      r->stutters += offset - best > kStutterMs;
+    }
+  }
+
+  void close() {
+    if (fd_ < 0) return;
+    loop_->remove(fd_);
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+ private:
+  void onRtp(const uint8_t* p, size_t size) {
+    if (size < 12 + 2 + kStampBytes) return;  // parameter sets
+    uint32_t timestamp = static_cast<uint32_t>(p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7]);
+    const uint8_t* payload = p + 12;
+    const uint8_t* stamp = findStamp(payload);
+    if (stamp == nullptr) return;
+    int64_t now = nvr::monotonicUs();
+    if (offsetsMs_.empty()) {
+      firstArrival_ = now;
+      firstTimestamp_ = timestamp;
+    }
+    double rtpMs = static_cast<uint32_t>(timestamp - firstTimestamp_) / 90.0;
+    offsetsMs_.push_back((now - firstArrival_) / 1000.0 - rtpMs);
+  }
+
+  nvr::EventLoop* loop_;
+  int fd_;
+  nvr::ByteBuffer input_{64 * 1024};
+  bool ended_ = false;
+  int64_t firstArrival_ = 0;
+  uint32_t firstTimestamp_ = 0;
+  std::vector<double> offsetsMs_;  // arrival against RTP time, per frame
+};
+
+struct RunStats {
+  RunResult result;
+  nvr::ReplayMediaProvider::Stats provider;
+  double wall = 0;
+  double engineCpu = 0;
+  uint64_t diskBytes = 0;
+};
+
+// Every viewer of camera i % cameras from its start in starts, for
+// seconds; read ahead if io is set.
+bool replay(const nvr::ArchiveIndex* archive, nvr::IoBackend* io, int cameras,
+            const std::vector<int64_t>& starts, double scale, int seconds, RunStats* out) {
+  nvr::EventLoopPool loops(1, false);
+  loops.start();
+  nvr::RtspSessionOptions options;
+  nvr::ReplayMediaProvider provider(&loops, archive, options, io);
+
+  nvr::EventLoop clientLoop;
+  std::vector<std::unique_ptr<Viewer>> viewers;
+  std::vector<nvr::RtspPlayRequest> requests;
+  for (size_t i = 0; i < starts.size(); ++i) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+      perror("socketpair");
+      return false;
+    }
+    viewers.emplace_back(new Viewer(&clientLoop, fds[0]));
+    char query[64];
+    snprintf(query, sizeof(query), "start=%.6f", starts[i] / 1e6);
+    nvr::RtspPlayRequest request;
+    request.fd = fds[1];
+    request.path = cameraName(static_cast<int>(i) % cameras);
+    request.query = query;
+    request.sessionId = "replay-" + std::to_string(i);
+    request.scale = scale;
+    nvr::RtspSessionTrack track;
+    track.channel = 0;
+    track.codec = nvr::VideoCodec::H264;
+    request.tracks.push_back(track);
+    requests.push_back(std::move(request));
+  }
+
+  uint64_t disk0 = diskReadBytes();
+  double cpu0 = cpuSeconds(RUSAGE_SELF);
+  double clientCpu = 0;
+  std::thread clientThread([&] {
+    clientLoop.post([&] {
+      for (auto& v : viewers) v->start();
+    });
+    clientLoop.run();
+    clientCpu = cpuSeconds(RUSAGE_THREAD);
+  });
+  int64_t begin = nvr::monotonicUs();
+  for (auto& request : requests) provider.play(std::move(request));
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  out->provider = provider.stats();
+  out->wall = (nvr::monotonicUs() - begin) / 1e6;
+  out->diskBytes = diskReadBytes() - disk0;
+  clientLoop.quit();
+  clientThread.join();
+  provider.stop();
+  out->engineCpu = cpuSeconds(RUSAGE_SELF) - cpu0 - clientCpu;
+  for (auto& v : viewers) v->finish(&out->result);
+  // Hints and fetches still in flight complete to nothing.
+  while (io && io->pending() > 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  loops.stop();
+  return true;
+}
+
+void report(const char* name, int viewers, const RunStats& run) {
+  const RunResult& r = run.result;
+  const nvr::ReplayMediaProvider::Stats& s = run.provider;
+  uint64_t reads = s.cacheHits + s.cacheMisses;
+  printf("%s\n", name);
+  printf("  %.1f frames/s per viewer, %llu ended early\n", r.frames / run.wall / viewers,
+         static_cast<unsigned long long>(r.ended));
+  printf("  pacing error p50 %.2f ms, p99 %.2f ms, max %.1f ms; %llu frames over %.0f ms late\n",
+         percentile(r.errorMs, 0.5), percentile(r.errorMs, 0.99), percentile(r.errorMs, 1.0),
+         static_cast<unsigned long long>(r.stutters), kStutterMs);
+  printf("  page cache served %.1f%% of %llu chunk reads; %llu chunks fetched after a miss\n",
+         reads ? 100.0 * s.cacheHits / reads : 0, static_cast<unsigned long long>(reads),
+         static_cast<unsigned long long>(s.fetches));
+  printf("  disk %.2f MB/s for %.2f MB/s of replay reads\n", run.diskBytes / run.wall / 1e6,
+         s.bytesRead / run.wall / 1e6);
+  printf("  read-ahead hinted %.1f MB; budget peak %.1f MB, %llu hints denied\n",
+         s.hintedBytes / 1e6, s.readAheadPeak / 1e6,
+         static_cast<unsigned long long>(s.readAheadDenied));
+  printf("  %.0f%% of a core\n", 100 * run.engineCpu / run.wall);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  signal(SIGPIPE, SIG_IGN);
+  std::string dir = argc > 1 ? argv[1] : "/tmp/nvr_bench_read_ahead";
+  int cameras = argc > 2 ? atoi(argv[2]) : 32;
+  int viewers = argc > 3 ? atoi(argv[3]) : 64;
+  int seconds = argc > 4 ? atoi(argv[4]) : 20;
+  int kbps = argc > 5 ? atoi(argv[5]) : 2048;
+  double scale = argc > 6 ? atof(argv[6]) : 1;
+  if (cameras < 1 || viewers < 1 || seconds <= 0 || kbps <= 0 || !(scale > 0) ||
+      scale > nvr::ReplayMediaProvider::kMaxScale) {
+    fprintf(stderr, "usage: bench_read_ahead [dir] [cameras] [viewers] [seconds] [kbps] "
+            "[scale > 0]\n");
+    return 2;
+  }
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+
+  // Room for every viewer to start anywhere in the first half.
+  int reach = static_cast<int>(scale * seconds) + 5;
+  int archiveSeconds = 2 * reach + 5;
+  std::string groupDir = nvr::joinPath(dir, "loop-0");
+  clearGroup(groupDir);
+  nvr::SegmentWriterOptions defaults;
+  defaults.dir = dir;
+  defaults.segmentSize = 64 << 20;
+  defaults.maxBuffers = 2 * cameras;
+  defaults.flushIntervalMs = 1 << 30;
+  defaults.syncIntervalMs = 1 << 30;
+  {
+    nvr::RecordingStore store(defaults);
+    if (store.start() < 0) return 1;
+    nvr::EventLoop loop;
+    Recorder recorder(&store, &loop, cameras, archiveSeconds, kbps);
+    loop.post([&] { recorder.start([&] { loop.quit(); }); });
+    loop.run();
+    store.stop();
+    if (recorder.dropped() > 0) {
+      fprintf(stderr, "%llu records dropped while recording\n",
+              static_cast<unsigned long long>(recorder.dropped()));
+      return 1;
+    }
+  }
+  nvr::ArchiveIndex archive(dir);
+  int segments = archive.load();
+  if (segments <= 0) {
+    fprintf(stderr, "no archive in %s\n", dir.c_str());
+    return 1;
+  }
+  printf("%d cameras of %d s of %d kbps H.264 in %d segments; %d viewers at %gx on one loop "
+         "for %d s, from a cold page cache\n\n",
+         cameras, archiveSeconds, kbps, segments, viewers, scale, seconds);
+
+  std::mt19937_64 rng(1);
+  std::vector<int64_t> starts;
+  for (int i = 0; i < viewers; ++i)
+    starts.push_back(kStartUs + 2000000 +
+                     static_cast<int64_t>(rng() % (static_cast<uint64_t>(reach) * 1000000)));
+
+  evictGroup(groupDir);
+  RunStats direct;
+  if (!replay(&archive, nullptr, cameras, starts, scale, seconds, &direct)) return 1;
+  report("pread() on the loop, kernel read-ahead:", viewers, direct);
+
+  nvr::IoBackendOptions ioOptions;
+  std::unique_ptr<nvr::IoBackend> io = nvr::createIoBackend(ioOptions);
+  if (!io || io->start() < 0) return 1;
+  evictGroup(groupDir);
+  RunStats ahead;
+  if (!replay(&archive, io.get(), cameras, starts, scale, seconds, &ahead)) return 1;
+  char name[128];
+  snprintf(name, sizeof(name), "\nread ahead (%s backend), page cache only on the loop:",
+           io->name());
+  report(name, viewers, ahead);
+  io->stop();
+  return 0;
+}
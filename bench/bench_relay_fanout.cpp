@@ -0,0 +1,195 @@
+// Relay fan-out benchmark: one stream relayed to 1, 10 and 100 TCP viewers.
+//
+// Compares the zero-copy relay (shared PacketRefs sent with writev) against
+// a copying baseline that appends every packet into a per-viewer output
+// buffer, the way a naive relay would. Reports user-space bytes copied per
+// received packet and throughput. Viewers are socketpairs drained by a
+// reader thread.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/event_loop.h"
+#include "base/packet_buffer.h"
+#include "relay/stream_relay.h"
+
+namespace {
+
+constexpr size_t kPacketSize = 1400;
+constexpr int kPacketsPerChunk = 64;
+constexpr uint64_t kDeliveries = 2000000;
+
+// Baseline: copies each packet into its own output buffer.
+class CopyingSubscriber : public nvr::RelaySubscriber {
+ public:
+  CopyingSubscriber(int fd, uint64_t* copied) : fd_(fd), copied_(copied) {}
+  ~CopyingSubscriber() override { close(fd_); }
+
+  void enqueue(int track, bool rtcp, const nvr::PacketRef& packet) override {
+    uint8_t header[4] = {'$', static_cast<uint8_t>(track * 2),
+                         static_cast<uint8_t>(packet.size() >> 8),
+                         static_cast<uint8_t>(packet.size())};
+    out_.append(header, 4);
+    out_.append(packet.data(), packet.size());
+    *copied_ += packet.size();
+  }
+  void flush() override {
+    while (!out_.empty()) {
+      ssize_t n = out_.writeFd(fd_);
+      if (n == -EAGAIN) {
+        // Keep the comparison fair: wait for the reader instead of dropping.
+        std::this_thread::yield();
+        continue;
+      }
+      if (n < 0) return;
+    }
+  }
+  bool closed() const override { return false; }
+
+ private:
+  int fd_;
+  uint64_t* copied_;
+  nvr::ByteBuffer out_;
+};
+
+struct Result {
+  double seconds;
+  uint64_t packets;
+  uint64_t copied;
+  uint64_t syscalls;
+  uint64_t drops;
+};
+
+Result run(int subscribers, bool zeroCopy) {
+  nvr::EventLoop loop;
+  nvr::PacketPools pools;
+  nvr::StreamRelay relay(&loop);
+  uint64_t baselineCopied = 0;
+
+  std::vector<int> readers;
+  std::vector<nvr::TcpRelaySubscriber*> tcpSubscribers;
+  for (int i = 0; i < subscribers; ++i) {
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv);
+    int size = 1 << 20;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    readers.push_back(sv[1]);
+    if (zeroCopy) {
+      auto* sub = new nvr::TcpRelaySubscriber(&loop, sv[0], relay.mutableStats(), 64 << 20);
+      tcpSubscribers.push_back(sub);
+      relay.addSubscriber(std::unique_ptr<nvr::RelaySubscriber>(sub));
+    } else {
+      relay.addSubscriber(
+          std::unique_ptr<nvr::RelaySubscriber>(new CopyingSubscriber(sv[0], &baselineCopied)));
+    }
+  }
+
+  uint64_t packets = kDeliveries / subscribers;
+  uint64_t expectedBytes = packets * (kPacketSize + 4) * subscribers;
+  std::atomic<uint64_t> received{0};
+  std::atomic<bool> done{false};
+  std::thread reader([&] {
+    int ep = epoll_create1(0);
+    for (int fd : readers) {
+      struct epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+    }
+    std::vector<char> buf(256 * 1024);
+    struct epoll_event events[128];
+    while (!done.load()) {
+      int n = epoll_wait(ep, events, 128, 10);
+      for (int i = 0; i < n; ++i) {
+        ssize_t r;
+        while ((r = read(events[i].data.fd, buf.data(), buf.size())) > 0) received += r;
+      }
+    }
+    close(ep);
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t published = 0;
+  std::function<void()> waitDrain = [&] {
+    // Wait for queued output to drain, then stop.
+    relay.flush();
+    if (received.load() + relay.stats().drops * (kPacketSize + 4) >= expectedBytes) {
+      loop.quit();
+      return;
+    }
+    loop.runAfter(1, waitDrain);
+  };
+  std::function<void()> produce = [&] {
+    // Like the copying baseline, pace on the slowest viewer instead of
+    // letting the queue limit drop packets.
+    for (auto* sub : tcpSubscribers) {
+      if (sub->queuedBytes() > (8 << 20)) {
+        loop.post(produce);
+        return;
+      }
+    }
+    // Simulates one ingest socket read: a chunk holding several packets,
+    // each published as a slice.
+    nvr::PacketBuffer* chunk = pools.stream.acquire();
+    int count = 0;
+    for (; count < kPacketsPerChunk && published < packets; ++count, ++published) {
+      uint8_t* p = chunk->data() + count * kPacketSize;
+      memset(p, static_cast<int>(published), 12);
+      relay.publish(0, false, nvr::PacketRef(chunk, count * kPacketSize, kPacketSize));
+    }
+    chunk->unref();
+    relay.flush();
+    if (published < packets) {
+      loop.post(produce);
+      return;
+    }
+    waitDrain();
+  };
+  loop.post(produce);
+  loop.run();
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  done = true;
+  reader.join();
+  for (int fd : readers) close(fd);
+
+  Result r;
+  r.seconds = elapsed;
+  r.packets = packets;
+  r.copied = zeroCopy ? relay.stats().bytesCopied : baselineCopied;
+  r.syscalls = zeroCopy ? relay.stats().writevCalls : 0;
+  r.drops = relay.stats().drops;
+  return r;
+}
+
+}  // namespace
+
+int main() {
+  printf("%-5s %-10s %12s %14s %14s %10s %8s\n", "subs", "mode", "copied B/pkt", "pkts/s in",
+         "deliveries/s", "writev/pkt", "drops");
+  for (int subs : {1, 10, 100}) {
+    for (bool zeroCopy : {false, true}) {
+      Result r = run(subs, zeroCopy);
+      printf("%-5d %-10s %12.1f %14.0f %14.0f %10s %8llu\n", subs, zeroCopy ? "zero-copy" : "copying",
+             static_cast<double>(r.copied) / r.packets, r.packets / r.seconds,
+             r.packets * subs / r.seconds,
+             zeroCopy ? std::to_string(static_cast<double>(r.syscalls) / r.packets).substr(0, 6).c_str()
+                      : "-",
+             static_cast<unsigned long long>(r.drops));
+    }
+  }
+  return 0;
+}
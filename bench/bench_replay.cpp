@@ -0,0 +1,422 @@
+// Replay engine benchmark: concurrent viewers of recorded video on one loop.
+//
+// Records a synthetic camera through SegmentWriter on simulated time (25
+// fps, a keyframe every 2 s, every frame carrying its recorded stamp,
+// spread over several segments), then plays it to many viewers at once
+// from a ReplayMediaProvider with a single loop: a third each at 1x, at 8x
+// (keyframes only) and at -4x (keyframes, backward), started
+// kStartsPerBatch at a time. Viewers are socket pairs read by a client
+// thread in the same process, so the bench covers the engine rather than
+// RTSP handshakes; on a machine with fewer cores than threads the client
+// competes with the loop, which shows in the pacing. Reported per mode:
+//
+//  - pacing error: how much later than its RTP time a frame arrived,
+//    against the viewer's most punctual frame (p50, p99, max), from a
+//    second after the last start, and p99 before that;
+//  - the speed seen, recorded time covered per second of viewing;
+//  - frames out of order for the direction, and delta frames in trick play
+//    (both must be 0);
+//  - the loop's CPU time per viewer and the process's RSS.
+//
+//   bench_replay [dir] [viewers] [seconds] [kbps]
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/clock.h"
+#include "base/event_loop.h"
+#include "base/event_loop_pool.h"
+#include "bench_stamp.h"
+#include "replay/replay_provider.h"
+#include "storage/archive_index.h"
+#include "storage/file_util.h"
+#include "storage/recording_store.h"
+#include "storage/segment_format.h"
+
+namespace {
+
+using nvr::bench::findStamp;
+using nvr::bench::getStamp;
+using nvr::bench::kStampBytes;
+using nvr::bench::putStamp;
+
+constexpr int kFps = 25;
+constexpr int kGopFrames = 50;
+constexpr int kKeyframeWeight = 8;
+constexpr int kArchiveSeconds = 900;
+constexpr int64_t kStartUs = 1700000000ll * 1000000;
+constexpr int kStartsPerBatch = 100;
+constexpr int kBatchMs = 50;
+constexpr int kModes = 3;
+const double kScales[kModes] = {1, 8, -4};
+
+const uint8_t kSps[] = {0x67, 0x42, 0xc0, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8};
+const uint8_t kPps[] = {0x68, 0xce, 0x3c, 0x80};
+
+double percentile(std::vector<double> v, double p) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+double cpuSeconds(int who) {
+  struct rusage usage;
+  getrusage(who, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+double rssMB() {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == nullptr) return 0;
+  long pages = 0, resident = 0;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1048576.0);
+}
+
+// Leftovers of an earlier run would overlap this one's recording.
+void clearGroup(const std::string& groupDir) {
+  std::vector<std::string> names;
+  if (nvr::listDirectory(groupDir, &names) < 0) return;
+  for (const auto& name : names) ::unlink(nvr::joinPath(groupDir, name).c_str());
+}
+
+// Records kArchiveSeconds of "cam" on the loop thread, one simulated
+// second per step, waiting for the disk in between.
+class Recorder {
+ public:
+  Recorder(nvr::RecordingStore* store, nvr::EventLoop* loop, int kbps) : loop_(loop) {
+    size_t unit = static_cast<size_t>(kbps) * 125 * kGopFrames / kFps /
+                  (kGopFrames - 1 + kKeyframeWeight);
+    keyBytes_ = unit * kKeyframeWeight;
+    deltaBytes_ = unit;
+    writer_ = store->createWriter(loop, "loop-0");
+    writer_->open();
+    nvr::StreamInfo info;
+    info.cameraId = "cam";
+    info.codec = "H264";
+    info.clockRate = 90000;
+    stream_ = writer_->addStream(info);
+    io_ = store->io();
+  }
+
+  void start(std::function<void()> done) {
+    done_ = std::move(done);
+    step();
+  }
+
+ private:
+  void step() {
+    if (second_ == kArchiveSeconds) {
+      writer_->close([this] { done_(); });
+      return;
+    }
+    for (int f = 0; f < kFps; ++f) {
+      int64_t n = static_cast<int64_t>(second_) * kFps + f;
+      bool keyframe = n % kGopFrames == 0;
+      int64_t ts = kStartUs + n * 1000000 / kFps;
+      frame_.clear();
+      static const uint8_t kStart[] = {0, 0, 0, 1};
+      if (keyframe) {
+        frame_.insert(frame_.end(), kStart, kStart + 4);
+        frame_.insert(frame_.end(), kSps, kSps + sizeof(kSps));
+        frame_.insert(frame_.end(), kStart, kStart + 4);
+        frame_.insert(frame_.end(), kPps, kPps + sizeof(kPps));
+      }
+      frame_.insert(frame_.end(), kStart, kStart + 4);
+      size_t at = frame_.size();
+      frame_.resize(at + std::max<size_t>(keyframe ? keyBytes_ : deltaBytes_, 1 + kStampBytes),
+                    0x5a);
+      frame_[at] = keyframe ? 0x65 : 0x41;
+      putStamp(&frame_[at + 1], ts);
+      writer_->append(stream_, nvr::RecordType::Video, keyframe ? nvr::kRecordKeyframe : 0, ts,
+                      frame_.data(), frame_.size());
+    }
+    writer_->flush();
+    ++second_;
+    waitIdle();
+  }
+
+  void waitIdle() {
+    if (io_->pending() == 0 && writer_->stats().buffersInFlight == 0) {
+      step();
+    } else {
+      loop_->runAfter(1, [this] { waitIdle(); });
+    }
+  }
+
+  nvr::EventLoop* loop_;
+  nvr::IoBackend* io_ = nullptr;
+  std::unique_ptr<nvr::SegmentWriter> writer_;
+  uint32_t stream_ = 0;
+  size_t keyBytes_ = 0;
+  size_t deltaBytes_ = 0;
+  std::vector<uint8_t> frame_;
+  int second_ = 0;
+  std::function<void()> done_;
+};
+
+struct ModeResult {
+  std::vector<double> errorMs;
+  std::vector<double> startErrorMs;  // while viewers were still starting
+  double mediaSeconds = 0;    // recorded time covered, all viewers
+  double viewingSeconds = 0;
+  uint64_t frames = 0;
+  uint64_t outOfOrder = 0;
+  uint64_t deltaFrames = 0;   // in trick play
+  uint64_t ended = 0;         // hung up by the server
+};
+
+// One viewer's end of its socket pair.
+class Viewer : public nvr::EventHandler {
+ public:
+  Viewer(nvr::EventLoop* loop, int fd, double scale, ModeResult* result)
+      : loop_(loop), fd_(fd), scale_(scale), result_(result) {}
+  ~Viewer() override { close(); }
+
+  // On the client loop's thread.
+  void start() { loop_->add(fd_, EPOLLIN, this); }
+
+  void onEvents(uint32_t events) override {
+    if (fd_ < 0) return;
+    for (;;) {
+      ssize_t n = input_.readFd(fd_, 64 * 1024);
+      if (n == 0) {
+        ++result_->ended;
+        return close();
+      }
+      if (n < 0) break;
+    }
+    while (input_.size() >= 4) {
+      const uint8_t* p = input_.data();
+      size_t length = static_cast<size_t>(p[2] << 8 | p[3]);
+      if (input_.size() < 4 + length) break;
+      if (p[0] == '$' && p[1] == 0) onRtp(p + 4, length);
+      input_.consume(4 + length);
+    }
+  }
+
+  // Adds the viewer's frames to the totals; steadyUs ends the start.
+  void finish(int64_t steadyUs) {
+    if (frames_ < 2) return;
+    double best = *std::min_element(offsetsMs_.begin(), offsetsMs_.end());
+    for (size_t i = 0; i < offsetsMs_.size(); ++i) {
+      auto* errors = arrivals_[i] < steadyUs ? &result_->startErrorMs : &result_->errorMs;
+      errors->push_back(offsetsMs_[i] - best);
+    }
+    result_->mediaSeconds += std::abs(lastStamp_ - firstStamp_) / 1e6;
+    result_->viewingSeconds += (lastArrival_ - firstArrival_) / 1e6;
+  }
+
+  void close() {
+    if (fd_ < 0) return;
+    loop_->remove(fd_);
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+ private:
+  void onRtp(const uint8_t* p, size_t size) {
+    if (size < 12 + 2 + kStampBytes) return;  // parameter sets
+    uint32_t timestamp = static_cast<uint32_t>(p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7]);
+    const uint8_t* payload = p + 12;
+    const uint8_t* stamp = findStamp(payload);
+    if (stamp == nullptr) return;
+    bool keyframe = (stamp[-1] & 0x1f) == 5;  // the slice's NAL or FU header
+    int64_t now = nvr::monotonicUs();
+    int64_t recorded = getStamp(stamp);
+    ++result_->frames;
+    if (frames_++ == 0) {
+      firstArrival_ = now;
+      firstTimestamp_ = timestamp;
+      firstStamp_ = recorded;
+    } else {
+      if (scale_ > 0 ? recorded <= lastStamp_ : recorded >= lastStamp_) ++result_->outOfOrder;
+    }
+    if (!keyframe && (scale_ < 0 || scale_ >= nvr::ReplayStream::kMaxAllFramesScale))
+      ++result_->deltaFrames;
+    double rtpMs = static_cast<uint32_t>(timestamp - firstTimestamp_) / 90.0;
+    offsetsMs_.push_back((now - firstArrival_) / 1000.0 - rtpMs);
+    arrivals_.push_back(now);
+    lastArrival_ = now;
+    lastStamp_ = recorded;
+  }
+
+  nvr::EventLoop* loop_;
+  int fd_;
+  double scale_;
+  ModeResult* result_;
+  nvr::ByteBuffer input_{64 * 1024};
+  uint64_t frames_ = 0;
+  int64_t firstArrival_ = 0;
+  int64_t lastArrival_ = 0;
+  uint32_t firstTimestamp_ = 0;
+  int64_t firstStamp_ = 0;
+  int64_t lastStamp_ = 0;
+  std::vector<double> offsetsMs_;  // arrival against RTP time, per frame
+  std::vector<int64_t> arrivals_;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  signal(SIGPIPE, SIG_IGN);
+  std::string dir = argc > 1 ? argv[1] : "/tmp/nvr_bench_replay";
+  int viewers = argc > 2 ? atoi(argv[2]) : 3000;
+  int seconds = argc > 3 ? atoi(argv[3]) : 20;
+  int kbps = argc > 4 ? atoi(argv[4]) : 512;
+  if (viewers <= 0 || seconds <= 0 || kbps <= 0) {
+    fprintf(stderr, "usage: bench_replay [dir] [viewers] [seconds] [kbps]\n");
+    return 2;
+  }
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < 2 * static_cast<rlim_t>(viewers) + 64) {
+    fprintf(stderr, "open file limit %llu is too low for %d viewers\n",
+            static_cast<unsigned long long>(limit.rlim_cur), viewers);
+    return 2;
+  }
+
+  clearGroup(nvr::joinPath(dir, "loop-0"));
+  nvr::SegmentWriterOptions defaults;
+  defaults.dir = dir;
+  defaults.segmentSize = 16 << 20;
+  defaults.flushIntervalMs = 1 << 30;
+  defaults.syncIntervalMs = 1 << 30;
+  {
+    nvr::RecordingStore store(defaults);
+    if (store.start() < 0) return 1;
+    nvr::EventLoop loop;
+    Recorder recorder(&store, &loop, kbps);
+    loop.post([&] { recorder.start([&] { loop.quit(); }); });
+    loop.run();
+    store.stop();
+  }
+  nvr::ArchiveIndex archive(dir);
+  int segments = archive.load();
+  if (segments <= 0) {
+    fprintf(stderr, "no archive in %s\n", dir.c_str());
+    return 1;
+  }
+  printf("%d viewers of %d s of %d kbps H.264 in %d segments, on one loop, for %d s\n\n",
+         viewers, kArchiveSeconds, kbps, segments, seconds);
+
+  nvr::EventLoopPool loops(1, false);
+  loops.start();
+  nvr::RtspSessionOptions options;
+  nvr::ReplayMediaProvider provider(&loops, &archive, options);
+
+  // The viewers' side, on a thread of its own.
+  ModeResult results[kModes];
+  nvr::EventLoop clientLoop;
+  std::vector<std::unique_ptr<Viewer>> clients;
+  std::vector<nvr::RtspPlayRequest> requests;
+  std::mt19937_64 rng(1);
+  // Starts where no viewer reaches either end of the archive in time.
+  int64_t archiveUs = static_cast<int64_t>(kArchiveSeconds) * 1000000;
+  for (int i = 0; i < viewers; ++i) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+      perror("socketpair");
+      return 1;
+    }
+    double scale = kScales[i % kModes];
+    clients.emplace_back(new Viewer(&clientLoop, fds[0], scale, &results[i % kModes]));
+    int64_t reachUs = static_cast<int64_t>(std::abs(scale) * (seconds + 10) * 1000000);
+    int64_t room = std::max<int64_t>(1, archiveUs - reachUs);
+    int64_t offset = static_cast<int64_t>(rng() % static_cast<uint64_t>(room));
+    int64_t startUs = kStartUs + (scale > 0 ? offset : archiveUs - offset);
+    char query[64];
+    snprintf(query, sizeof(query), "start=%.6f", startUs / 1e6);
+    nvr::RtspPlayRequest request;
+    request.fd = fds[1];
+    request.path = "cam";
+    request.query = query;
+    request.sessionId = "replay-" + std::to_string(i);
+    request.scale = scale;
+    nvr::RtspSessionTrack track;
+    track.channel = 0;
+    track.codec = nvr::VideoCodec::H264;
+    request.tracks.push_back(track);
+    requests.push_back(std::move(request));
+  }
+
+  double cpu0 = cpuSeconds(RUSAGE_SELF);
+  double clientCpu = 0;
+  std::thread clientThread([&] {
+    clientLoop.post([&] {
+      for (auto& c : clients) c->start();
+    });
+    clientLoop.run();
+    clientCpu = cpuSeconds(RUSAGE_THREAD);
+  });
+  int64_t begin = nvr::monotonicUs();
+  for (size_t i = 0; i < requests.size(); ++i) {
+    provider.play(std::move(requests[i]));
+    if (i % kStartsPerBatch == kStartsPerBatch - 1)
+      std::this_thread::sleep_for(std::chrono::milliseconds(kBatchMs));
+  }
+  // Queued behind the last start.
+  std::promise<int64_t> started;
+  loops.loop(0)->post([&started] { started.set_value(nvr::monotonicUs()); });
+  int64_t startedUs = started.get_future().get();
+  double rssPeak = 0;
+  while (nvr::monotonicUs() < begin + static_cast<int64_t>(seconds) * 1000000) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    rssPeak = std::max(rssPeak, rssMB());
+  }
+  nvr::ReplayMediaProvider::Stats stats = provider.stats();
+  clientLoop.quit();
+  clientThread.join();
+  double wall = (nvr::monotonicUs() - begin) / 1e6;
+  double engineCpu = cpuSeconds(RUSAGE_SELF) - cpu0 - clientCpu;
+
+  printf("start:   %d viewers in %.0f ms\n\n", viewers, (startedUs - begin) / 1000.0);
+  const char* names[kModes] = {"1x", "8x", "-4x"};
+  for (int m = 0; m < kModes; ++m) {
+    ModeResult& r = results[m];
+    int count = viewers / kModes + (m < viewers % kModes ? 1 : 0);
+    if (count == 0) continue;
+    for (int i = m; i < viewers; i += kModes) clients[i]->finish(startedUs + 1000000);
+    printf("%-4s %5d viewers, %5.1f frames/s each, speed %.2fx\n", names[m], count,
+           r.frames / wall / count,
+           r.viewingSeconds > 0 ? r.mediaSeconds / r.viewingSeconds * (kScales[m] < 0 ? -1 : 1)
+                                : 0);
+    printf("     pacing error p50 %.2f ms, p99 %.2f ms, max %.1f ms; while starting p99 %.1f ms\n",
+           percentile(r.errorMs, 0.5), percentile(r.errorMs, 0.99), percentile(r.errorMs, 1.0),
+           percentile(r.startErrorMs, 0.99));
+    printf("     %llu out of order, %llu delta frames, %llu ended early\n",
+           static_cast<unsigned long long>(r.outOfOrder),
+           static_cast<unsigned long long>(r.deltaFrames),
+           static_cast<unsigned long long>(r.ended));
+  }
+  printf("\nengine:  %llu streams playing, %llu waits; %.0f%% of a core, %.1f us of CPU per "
+         "viewer-second\n",
+         static_cast<unsigned long long>(stats.streams),
+         static_cast<unsigned long long>(stats.waits), 100 * engineCpu / wall,
+         engineCpu * 1e6 / wall / viewers);
+  printf("process: peak RSS %.0f MB\n", rssPeak);
+
+  provider.stop();
+  loops.stop();
+  clients.clear();
+  return 0;
+}
@@ -0,0 +1,536 @@
+// Retention benchmark: compaction throughput, and what it costs recording.
+//
+// Writes an aged archive through SegmentWriter: [cameras] synthetic
+// cameras (25 fps, a keyframe every 2 s, [kbps]) in four groups of shared
+// segments, timestamped to span the last 40 days. In two of the groups a
+// quarter of the cameras record event clips only (kRecordEvent). Then, for
+// [seconds], records [live] cameras in real time to a group of their own
+// while the RetentionEngine runs one pass with keep=30d, events=90d,
+// keyframes=7d, moving segments older than 14 days to [cold-dir]:
+//
+//   baseline     no engine
+//   unthrottled  no byte rate, no yielding to the recording, normal I/O
+//                priority
+//   throttled    [mbps] MB/s, yielding while the recording's backend has
+//                more than 4 operations queued, idle I/O priority
+//
+// The archive is written anew and dropped from the page cache before each
+// run. Reported per run: the recording's block write latency (submission to
+// completion on its loop, p50, p99, max) and records dropped; the pass's
+// segments deleted, rewritten and moved, its bytes read and written and
+// their rate, and the archive's disk space in both tiers before and after.
+// Every segment left is then read back in full and its index checked.
+//
+//   bench_retention [dir] [cold-dir] [cameras] [live] [seconds] [kbps] [archive-mb] [mbps]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "base/clock.h"
+#include "base/event_loop.h"
+#include "storage/archive_index.h"
+#include "storage/file_util.h"
+#include "storage/io_backend.h"
+#include "storage/retention_engine.h"
+#include "storage/segment_index.h"
+#include "storage/segment_reader.h"
+#include "storage/segment_writer.h"
+
+namespace {
+
+constexpr int kFps = 25;
+constexpr int64_t kFrameUs = 1000000 / kFps;
+constexpr int kGopFrames = 50;
+constexpr int kKeyframeWeight = 8;
+constexpr int kGroups = 4;
+constexpr int kEventGopPeriod = 5;  // an event camera records one GOP in 5
+constexpr int64_t kDayUs = 86400ll * 1000000;
+constexpr uint64_t kArchiveSegmentSize = 8 << 20;
+constexpr char kLiveGroup[] = "live";
+
+double percentile(std::vector<double> v, double p) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, static_cast<size_t>(p * static_cast<double>(v.size())))];
+}
+
+std::string cameraName(const char* prefix, int c) {
+  char name[32];
+  snprintf(name, sizeof(name), "%s-%02d", prefix, c);
+  return name;
+}
+
+// Removes the group directories under root and their files.
+void clearTree(const std::string& root) {
+  std::vector<std::string> groups;
+  if (nvr::listDirectory(root, &groups) < 0) return;
+  for (const auto& group : groups) {
+    std::string groupDir = nvr::joinPath(root, group);
+    std::vector<std::string> names;
+    nvr::listDirectory(groupDir, &names);
+    for (const auto& name : names) ::unlink(nvr::joinPath(groupDir, name).c_str());
+    ::rmdir(groupDir.c_str());
+  }
+}
+
+// Calls fn with the path of every file under root's groups but skip.
+void forEachFile(const std::string& root, const std::function<void(const std::string&)>& fn,
+                 const std::string& skip = std::string()) {
+  std::vector<std::string> groups;
+  if (nvr::listDirectory(root, &groups) < 0) return;
+  for (const auto& group : groups) {
+    if (group == skip) continue;
+    std::string groupDir = nvr::joinPath(root, group);
+    std::vector<std::string> names;
+    nvr::listDirectory(groupDir, &names);
+    for (const auto& name : names) fn(nvr::joinPath(groupDir, name));
+  }
+}
+
+// Disk space of the archive, the live recording left out.
+uint64_t treeBytes(const std::string& root) {
+  uint64_t bytes = 0;
+  forEachFile(
+      root,
+      [&bytes](const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) bytes += static_cast<uint64_t>(st.st_blocks) * 512;
+      },
+      kLiveGroup);
+  return bytes;
+}
+
+void evictTree(const std::string& root) {
+  forEachFile(root, [](const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+  });
+}
+
+// Times block writes from submission to completion on the caller's loop.
+class TimedIo : public nvr::IoBackend {
+ public:
+  explicit TimedIo(nvr::IoBackend* io) : io_(io) {}
+
+  const char* name() const override { return io_->name(); }
+  int start() override { return 0; }
+  void stop() override {}
+  void write(int fd, const void* data, size_t size, uint64_t offset, nvr::EventLoop* loop,
+             Completion done) override {
+    io_->write(fd, data, size, offset, loop, timed(std::move(done)));
+  }
+  void writeSync(int fd, const void* data, size_t size, uint64_t offset, nvr::EventLoop* loop,
+                 Completion done) override {
+    io_->writeSync(fd, data, size, offset, loop, std::move(done));
+  }
+  void read(int fd, void* data, size_t size, uint64_t offset, nvr::EventLoop* loop,
+            Completion done) override {
+    io_->read(fd, data, size, offset, loop, std::move(done));
+  }
+  void sync(int fd, nvr::EventLoop* loop, Completion done) override {
+    io_->sync(fd, loop, std::move(done));
+  }
+  void call(std::function<int64_t()> op, nvr::EventLoop* loop, Completion done) override {
+    io_->call(std::move(op), loop, std::move(done));
+  }
+  void registerFile(int fd) override { io_->registerFile(fd); }
+  void unregisterFile(int fd) override { io_->unregisterFile(fd); }
+  void registerBuffer(const void* data, size_t size) override {
+    io_->registerBuffer(data, size);
+  }
+  void unregisterBuffer(const void* data) override { io_->unregisterBuffer(data); }
+  size_t pending() const override { return io_->pending(); }
+
+  std::vector<double> latenciesMs() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return latenciesMs_;
+  }
+
+ private:
+  Completion timed(Completion done) {
+    int64_t startUs = nvr::monotonicUs();
+    return [this, startUs, done](int64_t result) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        latenciesMs_.push_back((nvr::monotonicUs() - startUs) / 1e3);
+      }
+      done(result);
+    };
+  }
+
+  nvr::IoBackend* io_;
+  mutable std::mutex mutex_;
+  std::vector<double> latenciesMs_;
+};
+
+struct Frames {
+  explicit Frames(int kbps) {
+    size_t unit = static_cast<size_t>(kbps) * 125 * kGopFrames / kFps /
+                  (kGopFrames - 1 + kKeyframeWeight);
+    keyBytes = unit * kKeyframeWeight;
+    deltaBytes = std::max<size_t>(unit, 1);
+    data.assign(keyBytes, 0x5a);
+  }
+  size_t keyBytes;
+  size_t deltaBytes;
+  std::vector<uint8_t> data;
+};
+
+// Writes the aged archive on simulated time, one second of every camera per
+// step, waiting for the disk in between.
+class ArchiveRecorder {
+ public:
+  ArchiveRecorder(nvr::EventLoop* loop, nvr::IoBackend* io, const std::string& dir, int cameras,
+                  int kbps, int steps)
+      : loop_(loop), io_(io), frames_(kbps), steps_(steps) {
+    int64_t frames = static_cast<int64_t>(steps) * kFps;
+    startUs_ = nvr::wallClockUs() - 40 * kDayUs;
+    frameStepUs_ = 39 * kDayUs / frames;
+    for (int g = 0; g < kGroups; ++g) {
+      nvr::SegmentWriterOptions options;
+      options.dir = dir;
+      options.group = cameraName("archive", g);
+      options.segmentSize = kArchiveSegmentSize;
+      options.flushIntervalMs = 1 << 30;
+      options.syncIntervalMs = 1 << 30;
+      writers_.emplace_back(new nvr::SegmentWriter(loop, io, options));
+      writers_.back()->open();
+    }
+    for (int c = 0; c < cameras; ++c) {
+      Camera camera;
+      camera.group = c % kGroups;
+      camera.events = camera.group % 2 == 1 && (c / kGroups) % 4 == 0;
+      nvr::StreamInfo info;
+      info.cameraId = cameraName("cam", c);
+      info.codec = "H264";
+      info.clockRate = 90000;
+      camera.stream = writers_[static_cast<size_t>(camera.group)]->addStream(info);
+      cameras_.push_back(camera);
+    }
+  }
+
+  void start(std::function<void()> done) {
+    done_ = std::move(done);
+    step();
+  }
+
+  uint64_t dropped() const {
+    uint64_t n = 0;
+    for (const auto& writer : writers_) n += writer->stats().droppedRecords;
+    return n;
+  }
+
+ private:
+  struct Camera {
+    int group = 0;
+    bool events = false;
+    uint32_t stream = 0;
+  };
+
+  void step() {
+    if (step_ == steps_) {
+      auto left = std::make_shared<size_t>(writers_.size());
+      for (auto& writer : writers_)
+        writer->close([this, left] {
+          if (--*left == 0) done_();
+        });
+      return;
+    }
+    for (size_t c = 0; c < cameras_.size(); ++c) {
+      const Camera& camera = cameras_[c];
+      for (int f = 0; f < kFps; ++f) {
+        int64_t n = static_cast<int64_t>(step_) * kFps + f;
+        int64_t gopFrame = n + static_cast<int64_t>(c) * 7;
+        if (camera.events && gopFrame / kGopFrames % kEventGopPeriod != 0) continue;
+        bool keyframe = gopFrame % kGopFrames == 0;
+        uint8_t flags = (keyframe ? nvr::kRecordKeyframe : 0) |
+                        (camera.events ? nvr::kRecordEvent : 0);
+        writers_[static_cast<size_t>(camera.group)]->append(
+            camera.stream, nvr::RecordType::Video, flags, startUs_ + n * frameStepUs_,
+            frames_.data.data(), keyframe ? frames_.keyBytes : frames_.deltaBytes);
+      }
+    }
+    for (auto& writer : writers_) writer->flush();
+    ++step_;
+    waitIdle();
+  }
+
+  void waitIdle() {
+    size_t inFlight = 0;
+    for (const auto& writer : writers_) inFlight += writer->stats().buffersInFlight;
+    if (io_->pending() == 0 && inFlight == 0) {
+      step();
+    } else {
+      loop_->runAfter(1, [this] { waitIdle(); });
+    }
+  }
+
+  nvr::EventLoop* loop_;
+  nvr::IoBackend* io_;
+  Frames frames_;
+  int steps_;
+  int step_ = 0;
+  int64_t startUs_ = 0;
+  int64_t frameStepUs_ = 0;
+  std::vector<std::unique_ptr<nvr::SegmentWriter>> writers_;
+  std::vector<Camera> cameras_;
+  std::function<void()> done_;
+};
+
+// Records cameras in real time, a frame of each every 40 ms.
+class LiveRecorder {
+ public:
+  LiveRecorder(nvr::EventLoop* loop, nvr::IoBackend* io, const std::string& dir, int cameras,
+               int kbps)
+      : loop_(loop), frames_(kbps) {
+    nvr::SegmentWriterOptions options;
+    options.dir = dir;
+    options.group = kLiveGroup;
+    // Every stream's chunk is flushed at once.
+    options.maxBuffers = 2 * static_cast<size_t>(cameras);
+    writer_.reset(new nvr::SegmentWriter(loop, io, options));
+    for (int c = 0; c < cameras; ++c) {
+      nvr::StreamInfo info;
+      info.cameraId = cameraName("live", c);
+      info.codec = "H264";
+      info.clockRate = 90000;
+      streams_.push_back(writer_->addStream(info));
+    }
+  }
+
+  int start() {
+    int rc = writer_->open();
+    if (rc < 0) return rc;
+    timer_ = loop_->runEvery(kFrameUs / 1000, [this] { tick(); });
+    return 0;
+  }
+
+  void stop(std::function<void()> done) {
+    loop_->cancel(timer_);
+    writer_->close(std::move(done));
+  }
+
+  const nvr::SegmentWriterStats& stats() const { return writer_->stats(); }
+
+ private:
+  void tick() {
+    int64_t now = nvr::wallClockUs();
+    for (size_t c = 0; c < streams_.size(); ++c) {
+      bool keyframe = (frame_ + static_cast<int64_t>(c) * 7) % kGopFrames == 0;
+      writer_->append(streams_[c], nvr::RecordType::Video, keyframe ? nvr::kRecordKeyframe : 0,
+                      now, frames_.data.data(), keyframe ? frames_.keyBytes : frames_.deltaBytes);
+    }
+    ++frame_;
+  }
+
+  nvr::EventLoop* loop_;
+  Frames frames_;
+  std::unique_ptr<nvr::SegmentWriter> writer_;
+  std::vector<uint32_t> streams_;
+  nvr::EventLoop::TimerId timer_ = 0;
+  int64_t frame_ = 0;
+};
+
+struct Options {
+  std::string dir;
+  std::string coldDir;
+  int cameras;
+  int live;
+  int seconds;
+  int kbps;
+  int archiveMb;
+  int mbps;
+};
+
+enum class Mode { Baseline, Unthrottled, Throttled };
+
+bool writeArchive(const Options& o) {
+  clearTree(o.dir);
+  clearTree(o.coldDir);
+  nvr::IoBackendOptions ioOptions;
+  std::unique_ptr<nvr::IoBackend> io = nvr::createIoBackend(ioOptions);
+  if (!io || io->start() < 0) return false;
+  int64_t perStep = static_cast<int64_t>(o.cameras) * o.kbps * 125;
+  int steps = static_cast<int>(std::max<int64_t>(1, (int64_t(o.archiveMb) << 20) / perStep));
+  nvr::EventLoop loop;
+  ArchiveRecorder recorder(&loop, io.get(), o.dir, o.cameras, o.kbps, steps);
+  loop.post([&] { recorder.start([&] { loop.quit(); }); });
+  loop.run();
+  io->stop();
+  if (recorder.dropped() > 0) {
+    fprintf(stderr, "%llu records dropped while writing the archive\n",
+            static_cast<unsigned long long>(recorder.dropped()));
+    return false;
+  }
+  evictTree(o.dir);
+  return true;
+}
+
+// Reads every segment left in full and checks its index; false if any
+// fails.
+bool verify(const Options& o, size_t* segments, uint64_t* records) {
+  bool ok = true;
+  *segments = 0;
+  *records = 0;
+  auto check = [&](const std::string& path) {
+    uint64_t id;
+    std::string name = path.substr(path.rfind('/') + 1);
+    if (!nvr::parseSegmentFileName(name, &id)) return;
+    nvr::SegmentReader reader;
+    nvr::SegmentIndex index;
+    if (reader.open(path) < 0 || index.open(nvr::segmentIndexPath(path)) < 0 ||
+        index.segmentId() != id) {
+      fprintf(stderr, "cannot read %s\n", path.c_str());
+      ok = false;
+      return;
+    }
+    nvr::SegmentReader::Record record;
+    while (reader.next(&record)) ++*records;
+    if (reader.recovered()) {
+      fprintf(stderr, "%s is not sealed\n", path.c_str());
+      ok = false;
+    }
+    ++*segments;
+  };
+  forEachFile(o.dir, check);
+  forEachFile(o.coldDir, check);
+  nvr::ArchiveIndex archive(o.dir, o.coldDir);
+  if (archive.load() != static_cast<int>(*segments)) {
+    fprintf(stderr, "archive index finds %d segments of %zu\n", archive.load(), *segments);
+    ok = false;
+  }
+  return ok;
+}
+
+bool run(const Options& o, Mode mode, const char* title) {
+  if (!writeArchive(o)) return false;
+  uint64_t before = treeBytes(o.dir) + treeBytes(o.coldDir);
+
+  nvr::IoBackendOptions ioOptions;
+  std::unique_ptr<nvr::IoBackend> backend = nvr::createIoBackend(ioOptions);
+  if (!backend || backend->start() < 0) return false;
+  TimedIo io(backend.get());
+  nvr::EventLoop loop;
+  LiveRecorder live(&loop, &io, o.dir, o.live, o.kbps);
+  if (live.start() < 0) return false;
+
+  nvr::RetentionOptions options;
+  options.dir = o.dir;
+  options.coldDir = o.coldDir;
+  options.coldAfterUs = 14 * kDayUs;
+  nvr::parseRetentionPolicy("keep=30d,events=90d,keyframes=7d", &options.defaults);
+  options.intervalMs = 1 << 30;
+  if (mode == Mode::Unthrottled) {
+    options.maxBytesPerSecond = 0;
+    options.idlePriority = false;
+  } else {
+    options.maxBytesPerSecond = static_cast<uint64_t>(o.mbps) << 20;
+    options.foreground = &io;
+  }
+  std::unique_ptr<nvr::RetentionEngine> engine;
+  int64_t startUs = nvr::monotonicUs();
+  int64_t passUs = 0;
+  if (mode != Mode::Baseline) {
+    engine.reset(new nvr::RetentionEngine(options));
+    engine->start();
+    loop.runEvery(10, [&] {
+      if (passUs == 0 && engine->stats().passes > 0) passUs = nvr::monotonicUs() - startUs;
+    });
+  }
+  loop.runAfter(static_cast<uint64_t>(o.seconds) * 1000, [&] {
+    live.stop([&] { loop.quit(); });
+  });
+  loop.run();
+  int64_t elapsedUs = nvr::monotonicUs() - startUs;
+  if (engine) engine->stop();
+  backend->stop();
+
+  std::vector<double> latencies = io.latenciesMs();
+  printf("%s\n", title);
+  printf("  recording: %zu block writes, latency p50 %.1f ms p99 %.1f ms max %.1f ms, "
+         "%llu records dropped\n",
+         latencies.size(), percentile(latencies, 0.5), percentile(latencies, 0.99),
+         latencies.empty() ? 0 : *std::max_element(latencies.begin(), latencies.end()),
+         static_cast<unsigned long long>(live.stats().droppedRecords));
+  if (engine) {
+    nvr::RetentionEngine::Stats s = engine->stats();
+    double seconds = (passUs ? passUs : elapsedUs) / 1e6;
+    printf("  pass: %s in %.1f s, %llu segments scanned: %llu deleted, %llu rewritten, "
+           "%llu moved\n",
+           passUs ? "done" : "cut short", seconds, static_cast<unsigned long long>(s.scanned),
+           static_cast<unsigned long long>(s.deleted),
+           static_cast<unsigned long long>(s.rewritten),
+           static_cast<unsigned long long>(s.migrated));
+    printf("  %.0f MB read + %.0f MB written: %.1f MB/s, %.1f segments/s; waited %.1f s for "
+           "the rate, %.1f s for recording\n",
+           s.bytesRead / 1048576.0, s.bytesWritten / 1048576.0,
+           (s.bytesRead + s.bytesWritten) / 1048576.0 / seconds,
+           (s.deleted + s.rewritten + s.migrated) / seconds, s.throttledMs / 1e3,
+           s.yieldedMs / 1e3);
+    printf("  rewritten segments %.0f MB -> %.0f MB; archive %.0f MB -> %.0f MB "
+           "(hot %.0f MB, cold %.0f MB)\n",
+           s.bytesBefore / 1048576.0, s.bytesAfter / 1048576.0, before / 1048576.0,
+           (treeBytes(o.dir) + treeBytes(o.coldDir)) / 1048576.0, treeBytes(o.dir) / 1048576.0,
+           treeBytes(o.coldDir) / 1048576.0);
+    if (s.errors > 0) {
+      fprintf(stderr, "%llu retention errors\n", static_cast<unsigned long long>(s.errors));
+      return false;
+    }
+  }
+  size_t segments;
+  uint64_t records;
+  if (!verify(o, &segments, &records)) return false;
+  printf("  %zu segments left, %llu records, all readable\n\n", segments,
+         static_cast<unsigned long long>(records));
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options o;
+  o.dir = argc > 1 ? argv[1] : "/tmp/nvr_bench_retention";
+  o.coldDir = argc > 2 ? argv[2] : "/tmp/nvr_bench_retention_cold";
+  o.cameras = argc > 3 ? atoi(argv[3]) : 32;
+  o.live = argc > 4 ? atoi(argv[4]) : 16;
+  o.seconds = argc > 5 ? atoi(argv[5]) : 20;
+  o.kbps = argc > 6 ? atoi(argv[6]) : 2048;
+  o.archiveMb = argc > 7 ? atoi(argv[7]) : 512;
+  o.mbps = argc > 8 ? atoi(argv[8]) : 16;
+  if (o.cameras < kGroups || o.live < 1 || o.seconds <= 0 || o.kbps <= 0 || o.archiveMb <= 0 ||
+      o.mbps <= 0) {
+    fprintf(stderr, "usage: bench_retention [dir] [cold-dir] [cameras >= %d] [live] [seconds] "
+            "[kbps] [archive-mb] [mbps]\n", kGroups);
+    return 2;
+  }
+  if (nvr::makeDirectories(o.dir) < 0 || nvr::makeDirectories(o.coldDir) < 0) {
+    fprintf(stderr, "cannot create %s or %s\n", o.dir.c_str(), o.coldDir.c_str());
+    return 1;
+  }
+  printf("archive: %d cameras of %d kbps in %d groups, %d MB over 40 days; recording %d live "
+         "cameras for %d s\n\n",
+         o.cameras, o.kbps, kGroups, o.archiveMb, o.live, o.seconds);
+  if (!run(o, Mode::Baseline, "baseline, no retention:")) return 1;
+  if (!run(o, Mode::Unthrottled, "retention unthrottled:")) return 1;
+  char title[128];
+  snprintf(title, sizeof(title), "retention throttled to %d MB/s, yielding to recording:",
+           o.mbps);
+  if (!run(o, Mode::Throttled, title)) return 1;
+  clearTree(o.dir);
+  clearTree(o.coldDir);
+  return 0;
+}
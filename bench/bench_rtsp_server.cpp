@@ -0,0 +1,455 @@
+// Concurrent RTSP viewers of one live camera, end to end.
+//
+// A synthetic camera serves H.264 over RTSP (interleaved TCP) from its own
+// RtspServer: 25 fps, a keyframe every 2 s, and delta frames alternating
+// between reference (nal_ref_idc 2) and non-reference ones, each carrying
+// its send time. An IngestEngine pulls it like any camera and a second
+// RtspServer serves it on "/live/" through LiveMediaProvider.
+//
+// A load generator in a child process (so that each side has its own fd
+// limit and the numbers below are the server's alone) opens the viewers
+// at up to kMaxConnecting handshakes at a time, runs DESCRIBE, SETUP and
+// PLAY, and reads. Most viewers read everything; some are slow (a small
+// receive buffer, read at a fraction of the bitrate) and some never read
+// after PLAY. Reported:
+//
+//  - handshake time, connect to PLAY reply, and how long until all play;
+//  - fast viewers' latency from the camera's send to their read, and RTP
+//    sequence gaps (anything a fast viewer misses is a server fault);
+//  - server side: drops by class, sessions closed as stalled, peak queue,
+//    CPU time and RSS of the server process over the streaming window.
+//
+//   bench_rtsp_server [viewers] [seconds] [kbps] [slow %] [stuck %]
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/clock.h"
+#include "base/event_loop.h"
+#include "base/event_loop_pool.h"
+#include "base/socket_util.h"
+#include "bench_camera.h"
+#include "bench_stamp.h"
+#include "ingest/ingest_engine.h"
+#include "ingest/live_media_provider.h"
+#include "rtsp/rtsp_message.h"
+#include "rtsp/rtsp_server.h"
+
+namespace {
+
+using nvr::bench::findStamp;
+using nvr::bench::getStamp;
+using nvr::bench::kStampBytes;
+
+constexpr int kMaxConnecting = 256;
+// Slow viewers read half the bitrate, every kSlowReadMs.
+constexpr int kSlowReadMs = 250;
+
+double percentile(std::vector<double> v, double p) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+double cpuSeconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+double rssMB() {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == nullptr) return 0;
+  long pages = 0, resident = 0;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1048576.0);
+}
+
+enum class Kind { Fast, Slow, Stuck };
+
+struct ClientResult {
+  std::vector<double> handshakeMs;
+  std::vector<double> latencyMs;  // fast viewers, first packet of each frame
+  uint64_t playing = 0;
+  uint64_t failed = 0;
+  uint64_t gaps = 0;               // fast viewers, missing packets
+  uint64_t bytes = 0;
+  double allPlayingMs = 0;
+};
+
+class Client : public nvr::EventHandler {
+ public:
+  Client(nvr::EventLoop* loop, int fd, Kind kind, const std::string& url, size_t slowReadBytes,
+         ClientResult* result, std::function<void(Client*)> handshakeDone)
+      : loop_(loop),
+        fd_(fd),
+        kind_(kind),
+        url_(url),
+        slowReadBytes_(slowReadBytes),
+        result_(result),
+        handshakeDone_(std::move(handshakeDone)),
+        startUs_(nvr::monotonicUs()) {}
+  ~Client() override {
+    if (fd_ >= 0) ::close(fd_);
+  }
+
+  bool streaming() const { return state_ == State::Streaming; }
+  bool closed() const { return fd_ < 0; }
+  Kind kind() const { return kind_; }
+
+  void onEvents(uint32_t events) override {
+    if (fd_ < 0) return;
+    if (state_ == State::Connecting) {
+      if (nvr::socketError(fd_) != 0) return fail();
+      loop_->modify(fd_, EPOLLIN, this);
+      send("DESCRIBE", url_, {{"Accept", "application/sdp"}});
+      state_ = State::Describe;
+      return;
+    }
+    if (state_ == State::Streaming && kind_ != Kind::Fast) {
+      // Read on the client's own schedule; only notice a hang-up here.
+      if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) hangUp();
+      return;
+    }
+    read(64 * 1024);
+  }
+
+  // Slow viewers: a trickle, on a timer.
+  void trickle() {
+    if (fd_ >= 0 && state_ == State::Streaming) read(slowReadBytes_);
+  }
+
+  void close() {
+    if (fd_ < 0) return;
+    loop_->remove(fd_);
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+ private:
+  enum class State { Connecting, Describe, Setup, Play, Streaming };
+
+  void send(const char* method, const std::string& uri, const nvr::HeaderList& headers) {
+    std::string request = nvr::buildRtspRequest(method, uri, ++cseq_, headers);
+    // A handful of bytes into an empty socket buffer.
+    if (::write(fd_, request.data(), request.size()) != static_cast<ssize_t>(request.size()))
+      fail();
+  }
+
+  void read(size_t budget) {
+    while (budget > 0) {
+      ssize_t n = input_.readFd(fd_, budget);
+      if (n == 0) return hangUp();
+      if (n < 0) break;
+      budget -= static_cast<size_t>(n);
+      result_->bytes += static_cast<uint64_t>(n);
+    }
+    parse();
+  }
+
+  void parse() {
+    while (fd_ >= 0 && input_.size() > 0) {
+      const char* data = reinterpret_cast<const char*>(input_.data());
+      if (data[0] == '$') {
+        if (input_.size() < 4) return;
+        const uint8_t* p = input_.data();
+        size_t length = static_cast<size_t>(p[2] << 8 | p[3]);
+        if (input_.size() < 4 + length) return;
+        if (p[1] == 0 && kind_ == Kind::Fast) onRtp(p + 4, length);
+        input_.consume(4 + length);
+        continue;
+      }
+      nvr::RtspResponse response;
+      int n = nvr::parseRtspResponse(data, input_.size(), &response);
+      if (n < 0) return fail();
+      if (n == 0) return;
+      input_.consume(static_cast<size_t>(n));
+      onResponse(response);
+    }
+  }
+
+  void onResponse(const nvr::RtspResponse& response) {
+    if (response.status != 200) return fail();
+    switch (state_) {
+      case State::Describe:
+        send("SETUP", url_ + "/trackID=0", {{"Transport", "RTP/AVP/TCP;unicast;interleaved=0-1"}});
+        state_ = State::Setup;
+        break;
+      case State::Setup: {
+        const std::string* session = response.header("Session");
+        if (session == nullptr) return fail();
+        session_ = session->substr(0, session->find(';'));
+        send("PLAY", url_, {{"Session", session_}, {"Range", "npt=0.000-"}});
+        state_ = State::Play;
+        break;
+      }
+      case State::Play:
+        state_ = State::Streaming;
+        ++result_->playing;
+        if (kind_ != Kind::Fast) loop_->modify(fd_, EPOLLRDHUP, this);
+        result_->handshakeMs.push_back((nvr::monotonicUs() - startUs_) / 1000.0);
+        handshakeDone_(this);
+        break;
+      default:
+        break;
+    }
+  }
+
+  void onRtp(const uint8_t* p, size_t size) {
+    if (size < 12 + 1) return;
+    uint16_t sequence = static_cast<uint16_t>(p[2] << 8 | p[3]);
+    if (haveSequence_ && sequence != static_cast<uint16_t>(sequence_ + 1))
+      result_->gaps += static_cast<uint16_t>(sequence - sequence_ - 1);
+    haveSequence_ = true;
+    sequence_ = sequence;
+    const uint8_t* payload = p + 12;
+    if (size < 12 + 2 + kStampBytes) return;  // parameter sets
+    const uint8_t* stamp = findStamp(payload);
+    if (stamp == nullptr) return;
+    int64_t latencyUs = nvr::monotonicUs() - getStamp(stamp);
+    // Not the cached GOP a viewer gets on joining: that was sent long ago.
+    if (!live_ && latencyUs < 1000000 / nvr::bench::kCameraFps) live_ = true;
+    if (live_) result_->latencyMs.push_back(latencyUs / 1000.0);
+  }
+
+  void fail() {
+    if (state_ != State::Streaming) {
+      ++result_->failed;
+      handshakeDone_(this);
+    }
+    close();
+  }
+
+  void hangUp() {
+    if (state_ != State::Streaming) return fail();
+    close();
+  }
+
+  nvr::EventLoop* loop_;
+  int fd_;
+  Kind kind_;
+  std::string url_;
+  size_t slowReadBytes_;
+  ClientResult* result_;
+  std::function<void(Client*)> handshakeDone_;
+  int64_t startUs_;
+  State state_ = State::Connecting;
+  int cseq_ = 0;
+  std::string session_;
+  nvr::ByteBuffer input_{16 * 1024};
+  bool haveSequence_ = false;
+  uint16_t sequence_ = 0;
+  bool live_ = false;
+};
+
+// Runs the viewers against port; writes its lines of the report to out.
+void runClients(uint16_t port, int viewers, int seconds, int kbps, int slowPct, int stuckPct,
+                int ready, FILE* out) {
+  nvr::EventLoop loop;
+  nvr::SocketAddress addr;
+  nvr::resolveAddress("127.0.0.1", port, &addr);
+  std::string url = "rtsp://127.0.0.1:" + std::to_string(port) + "/live/cam";
+  size_t slowReadBytes = static_cast<size_t>(kbps) * 125 * kSlowReadMs / 1000 / 2;
+  ClientResult result;
+  std::vector<std::unique_ptr<Client>> clients;
+  int started = 0, connecting = 0, handshaken = 0;
+  int64_t beginUs = nvr::monotonicUs();
+  std::function<void()> connectMore;
+  auto handshakeDone = [&](Client*) {
+    --connecting;
+    if (++handshaken == viewers) {
+      result.allPlayingMs = (nvr::monotonicUs() - beginUs) / 1000.0;
+      // Tell the server the streaming window starts.
+      char c = 's';
+      if (::write(ready, &c, 1) != 1) perror("write");
+      loop.runAfter(seconds * 1000ULL, [&] { loop.quit(); });
+    }
+    loop.post([&] { connectMore(); });
+  };
+  connectMore = [&] {
+    while (started < viewers && connecting < kMaxConnecting) {
+      // Spread the kinds evenly over the run of connections.
+      int slot = started % 100;
+      Kind kind = slot < stuckPct ? Kind::Stuck
+                                  : slot < stuckPct + slowPct ? Kind::Slow : Kind::Fast;
+      ++started;
+      int fd = nvr::tcpConnect(addr);
+      if (fd < 0) {
+        ++result.failed;
+        if (++handshaken == viewers) loop.quit();
+        continue;
+      }
+      if (kind != Kind::Fast) nvr::setRecvBufferSize(fd, 32 * 1024);
+      clients.emplace_back(new Client(&loop, fd, kind, url, slowReadBytes, &result,
+                                       handshakeDone));
+      loop.add(fd, EPOLLOUT, clients.back().get());
+      ++connecting;
+    }
+  };
+  loop.post(connectMore);
+  loop.runEvery(kSlowReadMs, [&] {
+    for (auto& c : clients)
+      if (c->kind() == Kind::Slow) c->trickle();
+  });
+  loop.run();
+
+  fprintf(out, "viewers:   %llu playing, %llu failed; all playing after %.0f ms\n",
+          static_cast<unsigned long long>(result.playing),
+          static_cast<unsigned long long>(result.failed), result.allPlayingMs);
+  fprintf(out, "handshake: p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+          percentile(result.handshakeMs, 0.5), percentile(result.handshakeMs, 0.99),
+          percentile(result.handshakeMs, 1.0));
+  fprintf(out, "fast:      latency p50 %.1f ms, p99 %.1f ms, max %.1f ms; %llu packets missed\n",
+          percentile(result.latencyMs, 0.5), percentile(result.latencyMs, 0.99),
+          percentile(result.latencyMs, 1.0), static_cast<unsigned long long>(result.gaps));
+  fflush(out);
+  for (auto& c : clients) c->close();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  signal(SIGPIPE, SIG_IGN);
+  int viewers = argc > 1 ? atoi(argv[1]) : 10000;
+  int seconds = argc > 2 ? atoi(argv[2]) : 30;
+  int kbps = argc > 3 ? atoi(argv[3]) : 128;
+  int slowPct = argc > 4 ? atoi(argv[4]) : 5;
+  int stuckPct = argc > 5 ? atoi(argv[5]) : 1;
+  if (viewers <= 0 || seconds <= 1 || kbps <= 0 || slowPct < 0 || stuckPct < 0 ||
+      slowPct + stuckPct > 100) {
+    fprintf(stderr,
+            "usage: bench_rtsp_server [viewers] [seconds > 1] [kbps] [slow %%] [stuck %%]\n");
+    return 2;
+  }
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < static_cast<rlim_t>(viewers) + 64) {
+    fprintf(stderr, "open file limit %llu is too low for %d viewers\n",
+            static_cast<unsigned long long>(limit.rlim_cur), viewers);
+    return 2;
+  }
+
+  // Before any thread: the port goes down one pipe, "streaming" and the
+  // report's client half come back up the other.
+  int down[2], up[2], report[2];
+  if (pipe(down) < 0 || pipe(up) < 0 || pipe(report) < 0) return 1;
+  pid_t child = fork();
+  if (child == 0) {
+    ::close(down[1]);
+    ::close(up[0]);
+    ::close(report[0]);
+    uint16_t port = 0;
+    if (::read(down[0], &port, sizeof(port)) != sizeof(port)) _exit(1);
+    FILE* out = fdopen(report[1], "w");
+    runClients(port, viewers, seconds, kbps, slowPct, stuckPct, up[1], out);
+    fclose(out);
+    _exit(0);
+  }
+  ::close(down[0]);
+  ::close(up[1]);
+  ::close(report[1]);
+
+  printf("%d viewers of one %d kbps H.264 camera (%d%% slow, %d%% never read), %d s\n\n",
+         viewers, kbps, slowPct, stuckPct, seconds);
+
+  nvr::EventLoopPool cameraLoops(1, false);
+  cameraLoops.start();
+  nvr::bench::SyntheticCamera camera(cameraLoops.loop(0), kbps);
+  nvr::RtspServerOptions cameraOptions;
+  cameraOptions.host = "127.0.0.1";
+  cameraOptions.port = 0;
+  nvr::RtspServer cameraServer(&cameraLoops, cameraOptions);
+  cameraServer.addProvider("/", &camera);
+  if (cameraServer.start() < 0) return 1;
+  camera.start();
+
+  nvr::IngestEngine ingest;
+  ingest.start();
+  // Queues small enough for slow viewers to reach both limits in a short
+  // run; the cached GOP still fits below the soft one.
+  nvr::RtspServerOptions options;
+  options.host = "127.0.0.1";
+  options.port = 0;
+  options.session.softQueueBytes = 64 * 1024;
+  options.session.hardQueueBytes = 256 * 1024;
+  options.session.sendBufferBytes = 32 * 1024;
+  // Declared before the server and stopped after ingest, which owns the
+  // sessions.
+  nvr::LiveMediaProvider live(&ingest, options.session);
+  nvr::RtspServer server(&ingest.loops(), options);
+  server.addProvider("/live/", &live);
+  if (server.start() < 0) return 1;
+  nvr::CameraConfig config;
+  config.id = "cam";
+  config.url = "rtsp://127.0.0.1:" + std::to_string(cameraServer.port()) + "/cam";
+  ingest.addCamera(config);
+  while (ingest.stats().playing == 0) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  uint16_t port = server.port();
+  if (::write(down[1], &port, sizeof(port)) != sizeof(port)) return 1;
+  char c;
+  if (::read(up[0], &c, 1) != 1) {
+    fprintf(stderr, "load generator failed\n");
+    return 1;
+  }
+  nvr::RtspSessionStats s0 = live.stats();
+  double cpu0 = cpuSeconds();
+  int64_t begin = nvr::monotonicUs();
+  double rssPeak = 0;
+  // Ends a little before the load generator hangs up.
+  for (int i = 0; i < seconds * 10 - 5; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    rssPeak = std::max(rssPeak, rssMB());
+  }
+  double cpu = cpuSeconds() - cpu0;
+  double wall = (nvr::monotonicUs() - begin) / 1e6;
+  nvr::RtspServerStats hs = server.stats();
+  nvr::RtspSessionStats s = live.stats();
+
+  char line[256];
+  FILE* in = fdopen(report[0], "r");
+  while (fgets(line, sizeof(line), in)) fputs(line, stdout);
+  fclose(in);
+  waitpid(child, nullptr, 0);
+
+  printf("server:    %llu accepted, %llu played, %llu bad, %llu timed out\n",
+         static_cast<unsigned long long>(hs.accepted), static_cast<unsigned long long>(hs.played),
+         static_cast<unsigned long long>(hs.badRequests),
+         static_cast<unsigned long long>(hs.timeouts));
+  printf("sessions:  %llu open, %.0f packets/s out in %.0f writev/s\n",
+         static_cast<unsigned long long>(s.open), (s.packetsOut - s0.packetsOut) / wall,
+         (s.writevCalls - s0.writevCalls) / wall);
+  printf("drops:     %llu non-reference, %llu up to a keyframe, %llu other; %llu stalled, "
+         "peak queue %.0f KB\n",
+         static_cast<unsigned long long>(s.droppedNonReference),
+         static_cast<unsigned long long>(s.droppedReference),
+         static_cast<unsigned long long>(s.droppedOther),
+         static_cast<unsigned long long>(s.stalled), s.maxQueuedBytes / 1024.0);
+  printf("process:   %.0f%% of a core, peak RSS %.0f MB\n", 100 * cpu / wall, rssPeak);
+
+  server.stop();
+  ingest.stop();
+  camera.stop();
+  cameraServer.stop();
+  cameraLoops.stop();
+  return 0;
+}
@@ -0,0 +1,158 @@
+// Replay seek benchmark.
+//
+// Writes the keyframe index files of a synthetic 30-day archive (cameras
+// sharing one recording group, a segment every few minutes, a keyframe
+// every 2 s at growing block offsets), loads it with ArchiveIndex and
+// measures random seeks: p50/p99/max of ArchiveIndex::seek() with every
+// index mapped, and of a cold lookup that opens, verifies and maps a
+// single segment index before seeking. Every result is checked against the
+// expected keyframe.
+//
+//   bench_seek [dir] [days] [cameras] [segment-minutes]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "storage/archive_index.h"
+#include "storage/file_util.h"
+#include "storage/segment_format.h"
+#include "storage/segment_index.h"
+
+namespace {
+
+constexpr int64_t kStartUs = 1700000000ll * 1000000;
+constexpr int64_t kGopUs = 2000000;
+constexpr int kSeeks = 200000;
+constexpr int kColdSeeks = 20000;
+
+double seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double usSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void report(const char* name, std::vector<double>* samples) {
+  std::sort(samples->begin(), samples->end());
+  auto at = [samples](double q) {
+    return (*samples)[static_cast<size_t>(q * (samples->size() - 1))];
+  };
+  printf("%-12s %8zu seeks  p50 %7.2f us  p99 %7.2f us  max %8.2f us\n", name, samples->size(),
+         at(0.5), at(0.99), samples->back());
+}
+
+// Camera c's keyframes are staggered so cameras never share timestamps.
+int64_t keyframeTime(int camera, int64_t n) { return kStartUs + n * kGopUs + camera * 40000; }
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string dir = argc > 1 ? argv[1] : "/tmp/nvr_bench_seek";
+  int days = argc > 2 ? atoi(argv[2]) : 30;
+  int cameras = argc > 3 ? atoi(argv[3]) : 4;
+  int segmentMinutes = argc > 4 ? atoi(argv[4]) : 5;
+  if (days <= 0 || cameras <= 0 || segmentMinutes <= 0) {
+    fprintf(stderr, "usage: %s [dir] [days] [cameras] [segment-minutes]\n", argv[0]);
+    return 2;
+  }
+
+  std::string groupDir = nvr::joinPath(dir, "bench");
+  if (nvr::makeDirectories(groupDir) < 0) {
+    perror(groupDir.c_str());
+    return 1;
+  }
+  int64_t segmentUs = static_cast<int64_t>(segmentMinutes) * 60 * 1000000;
+  int64_t segments = static_cast<int64_t>(days) * 24 * 60 / segmentMinutes;
+  int64_t perSegment = segmentUs / kGopUs;
+  size_t indexBytes = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  nvr::SegmentIndexBuilder builder;
+  for (int64_t s = 0; s < segments; ++s) {
+    builder.reset(static_cast<uint64_t>(s + 1));
+    for (int c = 0; c < cameras; ++c) builder.addStream(c + 1, "cam" + std::to_string(c));
+    uint64_t offset = nvr::kBlockAlign;
+    for (int64_t k = 0; k < perSegment; ++k) {
+      for (int c = 0; c < cameras; ++c)
+        builder.add(c + 1, keyframeTime(c, s * perSegment + k), offset + c * 1000000);
+      offset += static_cast<uint64_t>(cameras) * 1000000;
+    }
+    std::string segPath = nvr::joinPath(groupDir, nvr::segmentFileName(s + 1));
+    std::string data = builder.build(true);
+    indexBytes += data.size();
+    // An empty placeholder is enough for ArchiveIndex to find the index.
+    FILE* f = fopen(segPath.c_str(), "w");
+    if (f) fclose(f);
+    if (nvr::writeFileAtomic(nvr::segmentIndexPath(segPath), data) < 0) {
+      perror(segPath.c_str());
+      return 1;
+    }
+  }
+  int64_t keyframes = segments * perSegment;
+  printf("archive: %d days, %d cameras, %lld segments, %lld keyframes/camera, index %.1f MB"
+         " (%.1f bytes/keyframe), written in %.1f s\n",
+         days, cameras, static_cast<long long>(segments), static_cast<long long>(keyframes),
+         indexBytes / 1e6, static_cast<double>(indexBytes) / (keyframes * cameras),
+         seconds(start));
+
+  start = std::chrono::steady_clock::now();
+  nvr::ArchiveIndex archive(dir);
+  int loaded = archive.load();
+  if (loaded != segments) {
+    fprintf(stderr, "loaded %d of %lld segments\n", loaded, static_cast<long long>(segments));
+    return 1;
+  }
+  printf("load: %.1f ms\n", seconds(start) * 1e3);
+
+  std::mt19937_64 rng(42);
+  int64_t spanUs = keyframes * kGopUs;
+  int errors = 0;
+  std::vector<double> samples;
+  samples.reserve(kSeeks);
+  for (int i = 0; i < kSeeks; ++i) {
+    int camera = static_cast<int>(rng() % cameras);
+    int64_t ts = kStartUs + static_cast<int64_t>(rng() % static_cast<uint64_t>(spanUs));
+    std::string cameraId = "cam" + std::to_string(camera);
+    nvr::ArchiveSeekResult result;
+    auto t0 = std::chrono::steady_clock::now();
+    bool found = archive.seek(cameraId, ts, &result);
+    samples.push_back(usSince(t0));
+    int64_t n = std::max<int64_t>(0, (ts - keyframeTime(camera, 0)) / kGopUs);
+    if (!found || result.keyframe.timestampUs != keyframeTime(camera, n) ||
+        result.segmentId != static_cast<uint64_t>(n / perSegment + 1))
+      ++errors;
+  }
+  report("mapped", &samples);
+
+  samples.clear();
+  for (int i = 0; i < kColdSeeks; ++i) {
+    int camera = static_cast<int>(rng() % cameras);
+    int64_t ts = kStartUs + static_cast<int64_t>(rng() % static_cast<uint64_t>(spanUs));
+    int64_t n = std::max<int64_t>(0, (ts - keyframeTime(camera, 0)) / kGopUs);
+    int64_t s = n / perSegment;
+    std::string path = nvr::segmentIndexPath(
+        nvr::joinPath(groupDir, nvr::segmentFileName(static_cast<uint64_t>(s + 1))));
+    auto t0 = std::chrono::steady_clock::now();
+    nvr::SegmentIndex index;
+    nvr::KeyframeEntry entry;
+    int stream = index.open(path) == 0 ? index.findStream("cam" + std::to_string(camera)) : -1;
+    bool found = stream >= 0 && index.seek(static_cast<size_t>(stream), ts, &entry);
+    samples.push_back(usSince(t0));
+    if (!found || entry.timestampUs != keyframeTime(camera, n)) ++errors;
+  }
+  report("open+seek", &samples);
+
+  if (errors > 0) {
+    fprintf(stderr, "%d wrong seek results\n", errors);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,44 @@
+// Time stamps carried inside synthetic H.264 frames, for the benchmarks that
+// measure latency end to end.
+//
+// A sender writes the stamp right after the NAL header of every slice, so a
+// reader finds it in the first RTP packet of each frame, whether the frame
+// went out whole (single NAL unit packet) or fragmented (FU-A start).
+
+#ifndef NVR_BENCH_BENCH_STAMP_H
+#define NVR_BENCH_BENCH_STAMP_H
+
+#include <stdint.h>
+
+namespace nvr {
+namespace bench {
+
+constexpr int kStampBytes = 8;
+
+// 56 bits of a stamp, 7 per byte with the top bit set: never a zero byte,
+// so never a start code.
+inline void putStamp(uint8_t* p, int64_t us) {
+  for (int i = 0; i < kStampBytes; ++i)
+    p[i] = static_cast<uint8_t>(0x80 | ((us >> (7 * (kStampBytes - 1 - i))) & 0x7f));
+}
+
+inline int64_t getStamp(const uint8_t* p) {
+  int64_t us = 0;
+  for (int i = 0; i < kStampBytes; ++i) us = us << 7 | (p[i] & 0x7f);
+  return us;
+}
+
+// The stamp in an RTP payload of at least 2 + kStampBytes bytes, or null
+// when the packet does not start a slice (parameter sets, FU-A middles).
+inline const uint8_t* findStamp(const uint8_t* payload) {
+  int type = payload[0] & 0x1f;
+  int fuType = payload[1] & 0x1f;
+  if (type == 1 || type == 5) return payload + 1;
+  if (type == 28 && (payload[1] & 0x80) && (fuType == 1 || fuType == 5)) return payload + 2;
+  return nullptr;
+}
+
+}  // namespace bench
+}  // namespace nvr
+
+#endif  // NVR_BENCH_BENCH_STAMP_H
@@ -0,0 +1,515 @@
+// Synchronized replay benchmark: many cameras played in step to one viewer.
+//
+// Records [cameras] synthetic cameras through one SegmentWriter on
+// simulated time (25 fps, a keyframe every 2 s at a different phase per
+// camera, every frame carrying its recorded stamp, the same instants on
+// every camera), then plays them as the tracks of one replay session per
+// viewer from a ReplayMediaProvider with a single loop, each camera read
+// ahead by its GopPrefetcher. Twice: off the disk as it is, then through a
+// backend that serves reads in turn at [throttle]% of the cameras' total
+// bitrate, which no prefetch depth makes up for. The viewer is a socket
+// pair read by a client thread. Reported per run:
+//
+//  - the cameras' frames per second, keyframes among them, fallbacks to
+//    keyframes only and frames sent late for the disk;
+//  - pacing error: how much later than its RTP time a frame arrived,
+//    against the replay's most punctual frame (p50, p99, max), and the
+//    frames more than 100 ms late: stutter;
+//  - how far apart one recorded instant reached the viewer across the
+//    cameras that played it on the shared RTP timeline (p50, p99, max);
+//  - frames whose RTP time differs from another camera's for the same
+//    instant, and delta frames whose predecessor was not sent (both must
+//    be 0);
+//  - the read rate and the loop's CPU.
+//
+//   bench_sync_replay [dir] [cameras] [seconds] [kbps] [throttle %]
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/clock.h"
+#include "base/event_loop.h"
+#include "base/event_loop_pool.h"
+#include "bench_stamp.h"
+#include "replay/replay_provider.h"
+#include "replay/sync_replay.h"
+#include "storage/archive_index.h"
+#include "storage/file_util.h"
+#include "storage/io_backend.h"
+#include "storage/recording_store.h"
+#include "storage/segment_format.h"
+
+namespace {
+
+using nvr::bench::findStamp;
+using nvr::bench::getStamp;
+using nvr::bench::kStampBytes;
+using nvr::bench::putStamp;
+
+constexpr int kFps = 25;
+constexpr int64_t kFrameUs = 1000000 / kFps;
+constexpr int kGopFrames = 50;
+constexpr int kKeyframeWeight = 8;
+constexpr int kLeadSeconds = 5;  // recorded before the replays start
+constexpr int64_t kStartUs = 1700000000ll * 1000000;
+constexpr double kStutterMs = 100;
+
+const uint8_t kSps[] = {0x67, 0x42, 0xc0, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8};
+const uint8_t kPps[] = {0x68, 0xce, 0x3c, 0x80};
+
+double percentile(std::vector<double> v, double p) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+double cpuSeconds(int who) {
+  struct rusage usage;
+  getrusage(who, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Leftovers of an earlier run would overlap this one's recording.
+void clearGroup(const std::string& groupDir) {
+  std::vector<std::string> names;
+  if (nvr::listDirectory(groupDir, &names) < 0) return;
+  for (const auto& name : names) ::unlink(nvr::joinPath(groupDir, name).c_str());
+}
+
+std::string cameraName(int c) {
+  char name[16];
+  snprintf(name, sizeof(name), "cam-%02d", c);
+  return name;
+}
+
+// Records seconds of every camera on the loop thread, one simulated
+// second per step, waiting for the disk in between.
+class Recorder {
+ public:
+  Recorder(nvr::RecordingStore* store, nvr::EventLoop* loop, int cameras, int seconds, int kbps)
+      : loop_(loop), seconds_(seconds) {
+    size_t unit = static_cast<size_t>(kbps) * 125 * kGopFrames / kFps /
+                  (kGopFrames - 1 + kKeyframeWeight);
+    keyBytes_ = unit * kKeyframeWeight;
+    deltaBytes_ = unit;
+    writer_ = store->createWriter(loop, "loop-0");
+    writer_->open();
+    for (int c = 0; c < cameras; ++c) {
+      nvr::StreamInfo info;
+      info.cameraId = cameraName(c);
+      info.codec = "H264";
+      info.clockRate = 90000;
+      streams_.push_back(writer_->addStream(info));
+    }
+    io_ = store->io();
+  }
+
+  void start(std::function<void()> done) {
+    done_ = std::move(done);
+    step();
+  }
+
+  uint64_t dropped() const { return writer_->stats().droppedRecords; }
+
+ private:
+  void step() {
+    if (second_ == seconds_) {
+      writer_->close([this] { done_(); });
+      return;
+    }
+    for (size_t c = 0; c < streams_.size(); ++c) {
+      for (int f = 0; f < kFps; ++f) {
+        int64_t n = static_cast<int64_t>(second_) * kFps + f;
+        // GOPs staggered across cameras, as real ones are.
+        bool keyframe = (n + static_cast<int64_t>(c) * 7) % kGopFrames == 0;
+        int64_t ts = kStartUs + n * kFrameUs;
+        frame_.clear();
+        static const uint8_t kStart[] = {0, 0, 0, 1};
+        if (keyframe) {
+          frame_.insert(frame_.end(), kStart, kStart + 4);
+          frame_.insert(frame_.end(), kSps, kSps + sizeof(kSps));
+          frame_.insert(frame_.end(), kStart, kStart + 4);
+          frame_.insert(frame_.end(), kPps, kPps + sizeof(kPps));
+        }
+        frame_.insert(frame_.end(), kStart, kStart + 4);
+        size_t at = frame_.size();
+        frame_.resize(at + std::max<size_t>(keyframe ? keyBytes_ : deltaBytes_, 1 + kStampBytes),
+                      0x5a);
+        frame_[at] = keyframe ? 0x65 : 0x41;
+        putStamp(&frame_[at + 1], ts);
+        writer_->append(streams_[c], nvr::RecordType::Video, keyframe ? nvr::kRecordKeyframe : 0,
+                        ts, frame_.data(), frame_.size());
+      }
+    }
+    writer_->flush();
+    ++second_;
+    waitIdle();
+  }
+
+  void waitIdle() {
+    if (io_->pending() == 0 && writer_->stats().buffersInFlight == 0) {
+      step();
+    } else {
+      loop_->runAfter(1, [this] { waitIdle(); });
+    }
+  }
+
+  nvr::EventLoop* loop_;
+  int seconds_;
+  nvr::IoBackend* io_ = nullptr;
+  std::unique_ptr<nvr::SegmentWriter> writer_;
+  std::vector<uint32_t> streams_;
+  size_t keyBytes_ = 0;
+  size_t deltaBytes_ = 0;
+  std::vector<uint8_t> frame_;
+  int second_ = 0;
+  std::function<void()> done_;
+};
+
+// A disk of a given bandwidth: reads complete in turn, each taking its size
+// at that rate, however fast the real one was. Everything else goes
+// straight through.
+class ThrottledIo : public nvr::IoBackend {
+ public:
+  ThrottledIo(nvr::IoBackend* disk, double bytesPerSecond)
+      : disk_(disk), bytesPerSecond_(bytesPerSecond) {}
+
+  const char* name() const override { return "throttled"; }
+  int start() override { return 0; }
+  void stop() override {}
+  void write(int fd, const void* data, size_t size, uint64_t offset, nvr::EventLoop* loop,
+             Completion done) override {
+    disk_->write(fd, data, size, offset, loop, std::move(done));
+  }
+  void writeSync(int fd, const void* data, size_t size, uint64_t offset, nvr::EventLoop* loop,
+                 Completion done) override {
+    disk_->writeSync(fd, data, size, offset, loop, std::move(done));
+  }
+  void read(int fd, void* data, size_t size, uint64_t offset, nvr::EventLoop* loop,
+            Completion done) override {
+    int64_t readyUs;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      busyUntilUs_ = std::max(busyUntilUs_, nvr::monotonicUs()) +
+                     static_cast<int64_t>(size * 1e6 / bytesPerSecond_);
+      readyUs = busyUntilUs_;
+    }
+    disk_->read(fd, data, size, offset, loop, [loop, readyUs, done](int64_t result) {
+      if (nvr::monotonicUs() >= readyUs) return done(result);
+      loop->runAt(static_cast<uint64_t>((readyUs + 999) / 1000), [done, result] { done(result); });
+    });
+  }
+  void sync(int fd, nvr::EventLoop* loop, Completion done) override {
+    disk_->sync(fd, loop, std::move(done));
+  }
+  void call(std::function<int64_t()> op, nvr::EventLoop* loop, Completion done) override {
+    disk_->call(std::move(op), loop, std::move(done));
+  }
+  size_t pending() const override { return disk_->pending(); }
+
+ private:
+  nvr::IoBackend* disk_;
+  double bytesPerSecond_;
+  std::mutex mutex_;
+  int64_t busyUntilUs_ = 0;
+};
+
+struct RunResult {
+  std::vector<double> errorMs;
+  std::vector<double> spreadMs;  // one instant across the cameras that played it
+  uint64_t cameraInstants = 0;    // those cameras, summed
+  uint64_t frames = 0;
+  uint64_t keyframes = 0;
+  uint64_t stutters = 0;
+  uint64_t offTimeline = 0;
+  uint64_t brokenDeltas = 0;
+  bool ended = false;  // hung up by the server
+};
+
+// The viewer's end of its socket pair: one track per camera, on channel
+// 2 * camera.
+class Viewer : public nvr::EventHandler {
+ public:
+  Viewer(nvr::EventLoop* loop, int fd, int cameras, int64_t startUs)
+      : loop_(loop), fd_(fd), startUs_(startUs), lastStamp_(cameras, INT64_MIN) {}
+  ~Viewer() override { close(); }
+
+  // On the client loop's thread.
+  void start() { loop_->add(fd_, EPOLLIN, this); }
+
+  void onEvents(uint32_t events) override {
+    if (fd_ < 0) return;
+    for (;;) {
+      ssize_t n = input_.readFd(fd_, 256 * 1024);
+      if (n == 0) {
+        result_.ended = true;
+        return close();
+      }
+      if (n < 0) break;
+    }
+    while (input_.size() >= 4) {
+      const uint8_t* p = input_.data();
+      size_t length = static_cast<size_t>(p[2] << 8 | p[3]);
+      if (input_.size() < 4 + length) break;
+      if (p[0] == '$' && p[1] % 2 == 0 && p[1] / 2 < lastStamp_.size())
+        onRtp(p[1] / 2, p + 4, length);
+      input_.consume(4 + length);
+    }
+  }
+
+  // After the client loop stopped.
+  RunResult finish() {
+    RunResult r = result_;
+    if (!offsetsMs_.empty()) {
+      double best = *std::min_element(offsetsMs_.begin(), offsetsMs_.end());
+      for (double offset : offsetsMs_) {
+        r.errorMs.push_back(offset - best);
+        r.stutters += offset - best > kStutterMs;
+      }
+    }
+    for (const auto& entry : instants_) {
+      if (entry.second.cameras < 2) continue;
+      r.spreadMs.push_back((entry.second.lastUs - entry.second.firstUs) / 1000.0);
+      r.cameraInstants += entry.second.cameras;
+    }
+    return r;
+  }
+
+  void close() {
+    if (fd_ < 0) return;
+    loop_->remove(fd_);
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+ private:
+  struct Instant {
+    uint32_t timestamp = 0;
+    size_t cameras = 0;
+    int64_t firstUs = 0;
+    int64_t lastUs = 0;
+  };
+
+  void onRtp(size_t camera, const uint8_t* p, size_t size) {
+    if (size < 12 + 2 + kStampBytes) return;  // parameter sets
+    uint32_t timestamp = static_cast<uint32_t>(p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7]);
+    const uint8_t* payload = p + 12;
+    const uint8_t* stamp = findStamp(payload);
+    if (stamp == nullptr) return;
+    bool keyframe = (stamp[-1] & 0x1f) == 5;  // the slice's NAL or FU header
+    int64_t now = nvr::monotonicUs();
+    int64_t recorded = getStamp(stamp);
+    ++result_.frames;
+    result_.keyframes += keyframe;
+    // A delta frame needs the frame before it.
+    if (!keyframe && recorded != lastStamp_[camera] + kFrameUs) ++result_.brokenDeltas;
+    lastStamp_[camera] = recorded;
+    // The GOPs leading up to the start go out at once.
+    if (recorded < startUs_) return;
+    if (!anchored_) {
+      anchored_ = true;
+      firstArrival_ = now;
+      firstTimestamp_ = timestamp;
+    }
+    double rtpMs = static_cast<int32_t>(timestamp - firstTimestamp_) / 90.0;
+    offsetsMs_.push_back((now - firstArrival_) / 1000.0 - rtpMs);
+    Instant& instant = instants_[recorded];
+    if (instant.cameras == 0) {
+      instant.timestamp = timestamp;
+      instant.firstUs = now;
+    } else if (timestamp != instant.timestamp) {
+      ++result_.offTimeline;
+      return;
+    }
+    ++instant.cameras;
+    instant.lastUs = now;
+  }
+
+  nvr::EventLoop* loop_;
+  int fd_;
+  int64_t startUs_;
+  nvr::ByteBuffer input_{256 * 1024};
+  RunResult result_;
+  std::vector<int64_t> lastStamp_;  // per camera
+  bool anchored_ = false;
+  int64_t firstArrival_ = 0;
+  uint32_t firstTimestamp_ = 0;
+  std::vector<double> offsetsMs_;  // arrival against RTP time, per frame
+  std::map<int64_t, Instant> instants_;
+};
+
+struct RunStats {
+  RunResult result;
+  nvr::ReplayMediaProvider::Stats provider;
+  double wall = 0;
+  double engineCpu = 0;
+};
+
+// One replay of every camera from kLeadSeconds into the archive, for
+// seconds.
+bool replay(const nvr::ArchiveIndex* archive, nvr::IoBackend* io, int cameras, int seconds,
+            RunStats* out) {
+  nvr::EventLoopPool loops(1, false);
+  loops.start();
+  nvr::RtspSessionOptions options;
+  nvr::ReplayMediaProvider provider(&loops, archive, options, io);
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+    perror("socketpair");
+    return false;
+  }
+  int64_t startUs = kStartUs + kLeadSeconds * 1000000ll;
+  nvr::EventLoop clientLoop;
+  Viewer viewer(&clientLoop, fds[0], cameras, startUs);
+  nvr::RtspPlayRequest request;
+  request.fd = fds[1];
+  for (int c = 0; c < cameras; ++c) {
+    request.path += (c ? "," : "") + cameraName(c);
+    nvr::RtspSessionTrack track;
+    track.channel = 2 * c;
+    track.codec = nvr::VideoCodec::H264;
+    request.tracks.push_back(track);
+  }
+  char query[64];
+  snprintf(query, sizeof(query), "start=%.6f", startUs / 1e6);
+  request.query = query;
+  request.sessionId = "sync-replay";
+  request.scale = 1;
+
+  double cpu0 = cpuSeconds(RUSAGE_SELF);
+  double clientCpu = 0;
+  std::thread clientThread([&] {
+    clientLoop.post([&] { viewer.start(); });
+    clientLoop.run();
+    clientCpu = cpuSeconds(RUSAGE_THREAD);
+  });
+  int64_t begin = nvr::monotonicUs();
+  provider.play(std::move(request));
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  out->wall = (nvr::monotonicUs() - begin) / 1e6;
+  clientLoop.quit();
+  clientThread.join();
+  provider.stop();
+  out->engineCpu = cpuSeconds(RUSAGE_SELF) - cpu0 - clientCpu;
+  out->provider = provider.stats();
+  out->result = viewer.finish();
+  // Reads still in flight complete to the loop.
+  while (io->pending() > 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  loops.stop();
+  return true;
+}
+
+void report(const char* name, int cameras, const RunStats& run) {
+  const RunResult& r = run.result;
+  const nvr::ReplayMediaProvider::Stats& s = run.provider;
+  printf("%s\n", name);
+  printf("  %.1f frames/s per camera, %.0f%% keyframes; %llu fallbacks to keyframes only, "
+         "%llu frames late\n",
+         r.frames / run.wall / cameras, r.frames ? 100.0 * r.keyframes / r.frames : 0,
+         static_cast<unsigned long long>(s.syncFallbacks),
+         static_cast<unsigned long long>(s.syncLateFrames));
+  printf("  pacing error p50 %.2f ms, p99 %.2f ms, max %.1f ms; %llu frames over %.0f ms late\n",
+         percentile(r.errorMs, 0.5), percentile(r.errorMs, 0.99), percentile(r.errorMs, 1.0),
+         static_cast<unsigned long long>(r.stutters), kStutterMs);
+  printf("  one instant across %.1f cameras on average (%zu instants): p50 %.2f ms, p99 %.2f ms, "
+         "max %.1f ms apart\n",
+         r.spreadMs.empty() ? 0.0 : static_cast<double>(r.cameraInstants) / r.spreadMs.size(),
+         r.spreadMs.size(), percentile(r.spreadMs, 0.5), percentile(r.spreadMs, 0.99),
+         percentile(r.spreadMs, 1.0));
+  printf("  %llu frames off the shared RTP timeline, %llu delta frames without their "
+         "predecessor%s\n",
+         static_cast<unsigned long long>(r.offTimeline),
+         static_cast<unsigned long long>(r.brokenDeltas), r.ended ? ", ended early" : "");
+  printf("  read %.1f MB/s; %.0f%% of a core\n", s.syncBytesRead / run.wall / 1e6,
+         100 * run.engineCpu / run.wall);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  signal(SIGPIPE, SIG_IGN);
+  std::string dir = argc > 1 ? argv[1] : "/tmp/nvr_bench_sync_replay";
+  int cameras = argc > 2 ? atoi(argv[2]) : 64;
+  int seconds = argc > 3 ? atoi(argv[3]) : 20;
+  int kbps = argc > 4 ? atoi(argv[4]) : 1024;
+  int throttle = argc > 5 ? atoi(argv[5]) : 75;
+  if (cameras < 1 || cameras > static_cast<int>(nvr::SyncReplay::kMaxCameras) || seconds <= 0 ||
+      kbps <= 0 || throttle <= 0) {
+    fprintf(stderr, "usage: bench_sync_replay [dir] [cameras <= %zu] [seconds] [kbps] "
+            "[throttle %%]\n", nvr::SyncReplay::kMaxCameras);
+    return 2;
+  }
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+
+  // Past the end of both runs, with a second to spare.
+  int archiveSeconds = kLeadSeconds + seconds + 5;
+  clearGroup(nvr::joinPath(dir, "loop-0"));
+  nvr::SegmentWriterOptions defaults;
+  defaults.dir = dir;
+  defaults.segmentSize = 32 << 20;
+  defaults.maxBuffers = 2 * cameras;
+  defaults.flushIntervalMs = 1 << 30;
+  defaults.syncIntervalMs = 1 << 30;
+  {
+    nvr::RecordingStore store(defaults);
+    if (store.start() < 0) return 1;
+    nvr::EventLoop loop;
+    Recorder recorder(&store, &loop, cameras, archiveSeconds, kbps);
+    loop.post([&] { recorder.start([&] { loop.quit(); }); });
+    loop.run();
+    store.stop();
+    if (recorder.dropped() > 0) {
+      fprintf(stderr, "%llu records dropped while recording\n",
+              static_cast<unsigned long long>(recorder.dropped()));
+      return 1;
+    }
+  }
+  nvr::ArchiveIndex archive(dir);
+  int segments = archive.load();
+  if (segments <= 0) {
+    fprintf(stderr, "no archive in %s\n", dir.c_str());
+    return 1;
+  }
+  printf("%d cameras of %d s of %d kbps H.264 in %d segments, played together to one viewer "
+         "on one loop for %d s\n\n",
+         cameras, archiveSeconds, kbps, segments, seconds);
+
+  nvr::IoBackendOptions ioOptions;
+  std::unique_ptr<nvr::IoBackend> disk = nvr::createIoBackend(ioOptions);
+  if (!disk || disk->start() < 0) return 1;
+  RunStats direct;
+  if (!replay(&archive, disk.get(), cameras, seconds, &direct)) return 1;
+  char name[128];
+  snprintf(name, sizeof(name), "off the disk (%s backend):", disk->name());
+  report(name, cameras, direct);
+
+  double rate = static_cast<double>(kbps) * 125 * cameras * throttle / 100;
+  ThrottledIo slow(disk.get(), rate);
+  RunStats throttled;
+  if (!replay(&archive, &slow, cameras, seconds, &throttled)) return 1;
+  snprintf(name, sizeof(name), "\nthrottled to %.1f MB/s, %d%% of the cameras' bitrate:",
+           rate / 1e6, throttle);
+  report(name, cameras, throttled);
+  disk->stop();
+  return 0;
+}
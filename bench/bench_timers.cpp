@@ -0,0 +1,244 @@
+// Timer structures at a node's scale: TimerWheel against a binary heap
+// (std::priority_queue with lazy cancellation) and a std::multimap.
+//
+// A million session timers, each one a timeout pushed back whenever its
+// session is active and re-armed by its own task when it fires (a
+// keepalive), on simulated 1 ms ticks. Every tick a random set of sessions
+// is active (cancel and schedule again, 30-60 s out) and the structure is
+// advanced to the tick. Each structure runs in a child process of its own
+// so that its memory is measured alone. Reported per structure: ns per
+// schedule while filling, per cancel+schedule of an active session, per
+// timer fired (including its re-arm), per cancel when tearing down, CPU
+// time per simulated second, and bytes of RSS per timer.
+//
+//   bench_timers [timers] [seconds] [active per tick]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <queue>
+#include <vector>
+
+#include "base/timer_wheel.h"
+
+namespace {
+
+using Task = std::function<void()>;
+
+double rssMB() {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == nullptr) return 0;
+  long pages = 0, resident = 0;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1048576.0);
+}
+
+double nsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Cheap and the same sequence for every structure.
+struct Random {
+  uint64_t state = 88172645463325252ull;
+  uint64_t next() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+  uint64_t between(uint64_t low, uint64_t high) { return low + next() % (high - low); }
+};
+
+class WheelTimers {
+ public:
+  using Id = nvr::TimerWheel::Id;
+  static constexpr const char* kName = "wheel";
+
+  Id schedule(uint64_t deadline, Task task) { return wheel_.schedule(deadline, std::move(task)); }
+  void cancel(Id id) { wheel_.cancel(id); }
+  void advance(uint64_t now) { wheel_.advance(now); }
+
+ private:
+  nvr::TimerWheel wheel_;
+};
+
+class MapTimers {
+ public:
+  using Id = std::multimap<uint64_t, Task>::iterator;
+  static constexpr const char* kName = "multimap";
+
+  Id schedule(uint64_t deadline, Task task) { return timers_.emplace(deadline, std::move(task)); }
+  void cancel(Id id) { timers_.erase(id); }
+  void advance(uint64_t now) {
+    while (!timers_.empty() && timers_.begin()->first <= now) {
+      Task task = std::move(timers_.begin()->second);
+      timers_.erase(timers_.begin());
+      task();
+    }
+  }
+
+ private:
+  std::multimap<uint64_t, Task> timers_;
+};
+
+// Cancelling leaves the heap entry behind; it is skipped when it surfaces.
+class HeapTimers {
+ public:
+  using Id = uint64_t;  // generation << 32 | slot
+  static constexpr const char* kName = "heap";
+
+  Id schedule(uint64_t deadline, Task task) {
+    uint32_t slot;
+    if (!free_.empty()) {
+      slot = free_.back();
+      free_.pop_back();
+    } else {
+      slot = static_cast<uint32_t>(slots_.size());
+      slots_.emplace_back();
+    }
+    slots_[slot].task = std::move(task);
+    heap_.push(Entry{deadline, slot, slots_[slot].generation});
+    return static_cast<uint64_t>(slots_[slot].generation) << 32 | slot;
+  }
+  void cancel(Id id) {
+    Slot& slot = slots_[static_cast<uint32_t>(id)];
+    if (slot.generation != id >> 32) return;
+    release(static_cast<uint32_t>(id));
+  }
+  void advance(uint64_t now) {
+    while (!heap_.empty() && heap_.top().deadline <= now) {
+      Entry entry = heap_.top();
+      heap_.pop();
+      if (slots_[entry.slot].generation != entry.generation) continue;
+      Task task = std::move(slots_[entry.slot].task);
+      release(entry.slot);
+      task();
+    }
+  }
+
+ private:
+  struct Entry {
+    uint64_t deadline;
+    uint32_t slot;
+    uint32_t generation;
+    bool operator<(const Entry& other) const { return deadline > other.deadline; }
+  };
+  struct Slot {
+    Task task;
+    uint32_t generation = 0;
+  };
+
+  void release(uint32_t slot) {
+    slots_[slot].task = nullptr;
+    ++slots_[slot].generation;
+    free_.push_back(slot);
+  }
+
+  std::priority_queue<Entry> heap_;
+  std::vector<Slot> slots_;
+  std::vector<uint32_t> free_;
+};
+
+struct Options {
+  int timers;
+  int seconds;
+  int activePerTick;
+};
+
+template <typename Timers>
+void run(const Options& options) {
+  constexpr uint64_t kMinMs = 30000;
+  constexpr uint64_t kMaxMs = 60000;
+  double rss0 = rssMB();
+  Timers timers;
+  Random random;
+  std::vector<typename Timers::Id> ids(static_cast<size_t>(options.timers));
+  uint64_t now = 0;
+  uint64_t fired = 0;
+  std::function<void(size_t)> arm = [&](size_t session) {
+    ids[session] = timers.schedule(now + random.between(kMinMs, kMaxMs), [&, session] {
+      ++fired;
+      arm(session);
+    });
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < ids.size(); ++i) {
+    // Spread over the first minute, so that timers fire from the start.
+    ids[i] = timers.schedule(random.between(1, kMaxMs), [&, i] {
+      ++fired;
+      arm(i);
+    });
+  }
+  double fillNs = nsSince(start) / ids.size();
+  double rss = rssMB() - rss0;
+
+  uint64_t active = 0;
+  double activeNs = 0;
+  double advanceNs = 0;
+  int ticks = options.seconds * 1000;
+  start = std::chrono::steady_clock::now();
+  for (int t = 0; t < ticks; ++t) {
+    ++now;
+    auto tick = std::chrono::steady_clock::now();
+    for (int a = 0; a < options.activePerTick; ++a) {
+      size_t session = random.next() % ids.size();
+      timers.cancel(ids[session]);
+      arm(session);
+      ++active;
+    }
+    auto expire = std::chrono::steady_clock::now();
+    activeNs += nsSince(tick) - nsSince(expire);
+    timers.advance(now);
+    advanceNs += nsSince(expire);
+  }
+  double runNs = nsSince(start);
+
+  start = std::chrono::steady_clock::now();
+  for (auto id : ids) timers.cancel(id);
+  double cancelNs = nsSince(start) / ids.size();
+
+  printf("%-9s %8.0f %10.0f %8.0f %8.0f %12.1f %11.0f\n", Timers::kName, fillNs,
+         active ? activeNs / active : 0, fired ? advanceNs / fired : 0, cancelNs,
+         runNs / 1e6 / options.seconds, rss * 1048576 / ids.size());
+  fflush(stdout);
+}
+
+template <typename Timers>
+void runInChild(const Options& options) {
+  pid_t child = fork();
+  if (child == 0) {
+    run<Timers>(options);
+    _exit(0);
+  }
+  waitpid(child, nullptr, 0);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  options.timers = argc > 1 ? atoi(argv[1]) : 1000000;
+  options.seconds = argc > 2 ? atoi(argv[2]) : 10;
+  options.activePerTick = argc > 3 ? atoi(argv[3]) : 200;
+  if (options.timers <= 0 || options.seconds <= 0 || options.activePerTick < 0) {
+    fprintf(stderr, "usage: bench_timers [timers] [seconds] [active per tick]\n");
+    return 2;
+  }
+  printf("%d timers, %d s simulated in 1 ms ticks, %d active sessions per tick\n\n",
+         options.timers, options.seconds, options.activePerTick);
+  printf("%-9s %8s %10s %8s %8s %12s %11s\n", "", "fill ns", "active ns", "fire ns",
+         "cancel ns", "ms per sim s", "bytes/timer");
+  fflush(stdout);
+  runInChild<WheelTimers>(options);
+  runInChild<HeapTimers>(options);
+  runInChild<MapTimers>(options);
+  return 0;
+}
@@ -0,0 +1,21 @@
+// Base64 encoding/decoding (RFC 4648, standard alphabet, padded).
+
+#ifndef NVR_BASE_BASE64_H
+#define NVR_BASE_BASE64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace nvr {
+
+std::string base64Encode(const void* data, size_t len);
+inline std::string base64Encode(const std::string& s) { return base64Encode(s.data(), s.size()); }
+
+// Decodes into out. Whitespace is skipped; returns false on invalid input.
+bool base64Decode(const std::string& in, std::string* out);
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_BASE64_H
@@ -0,0 +1,57 @@
+#include "base/byte_buffer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace nvr {
+
+ByteBuffer::ByteBuffer(size_t initialSize) : buf_(initialSize) {}
+
+void ByteBuffer::consume(size_t n) {
+  if (n >= size()) {
+    readPos_ = writePos_ = 0;
+  } else {
+    readPos_ += n;
+  }
+}
+
+void ByteBuffer::append(const void* data, size_t len) {
+  memcpy(writableTail(len), data, len);
+  writePos_ += len;
+}
+
+uint8_t* ByteBuffer::writableTail(size_t minBytes) {
+  if (buf_.size() - writePos_ >= minBytes) return buf_.data() + writePos_;
+  size_t live = size();
+  if (readPos_ > 0) {
+    // Compact before growing; parsers consume from the front.
+    memmove(buf_.data(), buf_.data() + readPos_, live);
+    readPos_ = 0;
+    writePos_ = live;
+  }
+  if (buf_.size() - writePos_ < minBytes) {
+    size_t want = buf_.size() * 2;
+    if (want < writePos_ + minBytes) want = writePos_ + minBytes;
+    buf_.resize(want);
+  }
+  return buf_.data() + writePos_;
+}
+
+ssize_t ByteBuffer::readFd(int fd, size_t maxBytes) {
+  uint8_t* tail = writableTail(maxBytes);
+  ssize_t n = ::read(fd, tail, maxBytes);
+  if (n < 0) return -errno;
+  writePos_ += n;
+  return n;
+}
+
+ssize_t ByteBuffer::writeFd(int fd) {
+  if (empty()) return 0;
+  ssize_t n = ::write(fd, data(), size());
+  if (n < 0) return -errno;
+  consume(n);
+  return n;
+}
+
+}  // namespace nvr
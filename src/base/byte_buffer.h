@@ -0,0 +1,48 @@
+// Growable byte buffer used for stream-oriented socket input and output.
+
+#ifndef NVR_BASE_BYTE_BUFFER_H
+#define NVR_BASE_BYTE_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+namespace nvr {
+
+class ByteBuffer {
+ public:
+  explicit ByteBuffer(size_t initialSize = 16 * 1024);
+
+  const uint8_t* data() const { return buf_.data() + readPos_; }
+  uint8_t* data() { return buf_.data() + readPos_; }
+  size_t size() const { return writePos_ - readPos_; }
+  bool empty() const { return size() == 0; }
+
+  void consume(size_t n);
+  void clear() { readPos_ = writePos_ = 0; }
+
+  void append(const void* data, size_t len);
+  void append(const std::string& s) { append(s.data(), s.size()); }
+
+  // Writable tail, grown to at least minBytes. Call commit() after writing.
+  uint8_t* writableTail(size_t minBytes);
+  size_t writableBytes() const { return buf_.size() - writePos_; }
+  void commit(size_t n) { writePos_ += n; }
+
+  // One read(2) into the tail. Returns bytes read, 0 on EOF, -errno on error.
+  ssize_t readFd(int fd, size_t maxBytes = 64 * 1024);
+  // One write(2) of the pending bytes. Returns bytes written or -errno.
+  ssize_t writeFd(int fd);
+
+ private:
+  std::vector<uint8_t> buf_;
+  size_t readPos_ = 0;
+  size_t writePos_ = 0;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_BYTE_BUFFER_H
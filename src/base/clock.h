@@ -0,0 +1,28 @@
+// Wall clock helpers. Recorded media is stamped with wall time (UTC
+// microseconds since the epoch) so that archives from different cameras and
+// nodes line up; EventLoop::nowMs() is monotonic and only for timers.
+
+#ifndef NVR_BASE_CLOCK_H
+#define NVR_BASE_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+namespace nvr {
+
+inline int64_t wallClockUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Monotonic microseconds, for pacing media against the wall clock stamps.
+inline int64_t monotonicUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_CLOCK_H
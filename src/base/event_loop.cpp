@@ -0,0 +1,166 @@
+#include "base/event_loop.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base/log.h"
+
+namespace nvr {
+
+namespace {
+
+thread_local EventLoop* t_currentLoop = nullptr;
+
+constexpr int kMaxEventsPerPoll = 256;
+
+}  // namespace
+
+EventLoop::EventLoop(int index)
+    : index_(index), threadId_(std::this_thread::get_id()), timers_(monotonicMs()) {
+  epfd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd_ < 0) {
+    NVR_ERROR("epoll_create1: %s", strerror(errno));
+    abort();
+  }
+  wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeFd_ < 0) {
+    NVR_ERROR("eventfd: %s", strerror(errno));
+    abort();
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;  // nullptr marks the wakeup fd
+  epoll_ctl(epfd_, EPOLL_CTL_ADD, wakeFd_, &ev);
+  nowMs_ = monotonicMs();
+}
+
+EventLoop::~EventLoop() {
+  // Run whatever is left (typically deleteLater()) so nothing leaks.
+  runPending();
+  close(wakeFd_);
+  close(epfd_);
+}
+
+int EventLoop::add(int fd, uint32_t events, EventHandler* handler) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = handler;
+  if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0) return -errno;
+  return 0;
+}
+
+int EventLoop::modify(int fd, uint32_t events, EventHandler* handler) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = handler;
+  if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) < 0) return -errno;
+  return 0;
+}
+
+void EventLoop::remove(int fd) { epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr); }
+
+void EventLoop::post(Task task) {
+  {
+    std::lock_guard<std::mutex> lock(pendingMutex_);
+    pending_.push_back(std::move(task));
+  }
+  wakeup();
+}
+
+EventLoop::TimerId EventLoop::runAfter(uint64_t delayMs, Task task) {
+  return timers_.schedule(nowMs_ + delayMs, std::move(task));
+}
+
+EventLoop::TimerId EventLoop::runAt(uint64_t deadlineMs, Task task) {
+  return timers_.schedule(deadlineMs, std::move(task));
+}
+
+EventLoop::TimerId EventLoop::runEvery(uint64_t intervalMs, Task task) {
+  if (intervalMs == 0) intervalMs = 1;
+  return timers_.schedule(nowMs_ + intervalMs, std::move(task), intervalMs);
+}
+
+void EventLoop::cancel(TimerId id) { timers_.cancel(id); }
+
+void EventLoop::run() {
+  threadId_ = std::this_thread::get_id();
+  t_currentLoop = this;
+  struct epoll_event events[kMaxEventsPerPoll];
+
+  while (!quit_.load(std::memory_order_acquire)) {
+    int n = epoll_wait(epfd_, events, kMaxEventsPerPoll, pollTimeout());
+    nowMs_ = monotonicMs();
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      NVR_ERROR("epoll_wait: %s", strerror(errno));
+      break;
+    }
+    for (int i = 0; i < n; ++i) {
+      auto* handler = static_cast<EventHandler*>(events[i].data.ptr);
+      if (handler == nullptr) {
+        drainWakeup();
+        continue;
+      }
+      handler->onEvents(events[i].events);
+    }
+    runTimers();
+    runPending();
+  }
+  t_currentLoop = nullptr;
+}
+
+void EventLoop::quit() {
+  quit_.store(true, std::memory_order_release);
+  wakeup();
+}
+
+EventLoop* EventLoop::current() { return t_currentLoop; }
+
+uint64_t EventLoop::monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+void EventLoop::wakeup() {
+  uint64_t one = 1;
+  ssize_t n = write(wakeFd_, &one, sizeof(one));
+  (void)n;
+}
+
+void EventLoop::drainWakeup() {
+  uint64_t value;
+  ssize_t n = read(wakeFd_, &value, sizeof(value));
+  (void)n;
+}
+
+void EventLoop::runPending() {
+  std::vector<Task> tasks;
+  {
+    std::lock_guard<std::mutex> lock(pendingMutex_);
+    tasks.swap(pending_);
+  }
+  for (auto& task : tasks) task();
+}
+
+void EventLoop::runTimers() { timers_.advance(nowMs_); }
+
+int EventLoop::pollTimeout() const {
+  // A lower bound when the next timer is still in a coarser wheel: waking
+  // up early just moves it closer.
+  uint64_t next = timers_.nextDeadline();
+  if (next == UINT64_MAX) return 1000;
+  uint64_t now = monotonicMs();
+  if (next <= now) return 0;
+  uint64_t wait = next - now;
+  return wait > 1000 ? 1000 : static_cast<int>(wait);
+}
+
+}  // namespace nvr
@@ -0,0 +1,113 @@
+// Single-threaded epoll event loop.
+//
+// Every loop is owned by exactly one thread. All objects registered with a
+// loop (sockets, timers, sessions) are only touched from that thread, so the
+// hot path needs no locks. Other threads hand work to a loop with post().
+//
+// Timers live in a hierarchical timing wheel of 1 ms ticks (timer_wheel.h):
+// a node carries hundreds of thousands of session timeouts, keepalives and
+// renewals, which are mostly cancelled or pushed back long before they
+// expire, and the wheel schedules and cancels in O(1).
+
+#ifndef NVR_BASE_EVENT_LOOP_H
+#define NVR_BASE_EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "base/timer_wheel.h"
+
+namespace nvr {
+
+class EventHandler {
+ public:
+  virtual ~EventHandler() = default;
+
+  // Called with the epoll event mask. A handler may be called once more after
+  // it removed its fd if the event was already fetched in the same batch, so
+  // implementations must tolerate events after close.
+  virtual void onEvents(uint32_t events) = 0;
+};
+
+class EventLoop {
+ public:
+  using Task = std::function<void()>;
+  using TimerId = TimerWheel::Id;  // never 0
+
+  explicit EventLoop(int index = 0);
+  ~EventLoop();
+
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  int index() const { return index_; }
+
+  // fd registration. Loop thread only. Return 0 or -errno.
+  int add(int fd, uint32_t events, EventHandler* handler);
+  int modify(int fd, uint32_t events, EventHandler* handler);
+  void remove(int fd);
+
+  // Queues a task to run on the loop thread. Safe from any thread.
+  void post(Task task);
+
+  // Destroys an object after the current event batch, so that handlers may
+  // drop themselves from inside their own callbacks.
+  template <typename T>
+  void deleteLater(T* object) {
+    post([object] { delete object; });
+  }
+
+  // Timers. Loop thread only. Callbacks run on the loop thread; a timer may
+  // cancel itself from its own callback.
+  TimerId runAfter(uint64_t delayMs, Task task);
+  // At a point in monotonicMs(), rather than after nowMs(), which may lag
+  // behind by the work of the current iteration.
+  TimerId runAt(uint64_t deadlineMs, Task task);
+  TimerId runEvery(uint64_t intervalMs, Task task);
+  void cancel(TimerId id);
+  size_t timers() const { return timers_.size(); }
+
+  // Runs until quit() is called. Binds the loop to the calling thread.
+  void run();
+  // Safe from any thread.
+  void quit();
+
+  bool inLoopThread() const { return std::this_thread::get_id() == threadId_; }
+
+  // Monotonic milliseconds, cached once per loop iteration.
+  uint64_t nowMs() const { return nowMs_; }
+
+  // Loop running on the calling thread, or nullptr.
+  static EventLoop* current();
+
+  static uint64_t monotonicMs();
+
+ private:
+  void wakeup();
+  void drainWakeup();
+  void runPending();
+  void runTimers();
+  int pollTimeout() const;
+
+  const int index_;
+  int epfd_ = -1;
+  int wakeFd_ = -1;
+  std::thread::id threadId_;
+  std::atomic<bool> quit_{false};
+  uint64_t nowMs_ = 0;
+
+  std::mutex pendingMutex_;
+  std::vector<Task> pending_;
+
+  TimerWheel timers_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_EVENT_LOOP_H
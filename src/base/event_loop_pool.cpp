@@ -0,0 +1,51 @@
+#include "base/event_loop_pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "base/log.h"
+
+namespace nvr {
+
+EventLoopPool::EventLoopPool(int numLoops, bool pinThreads) : pinThreads_(pinThreads) {
+  if (numLoops <= 0) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    numLoops = ncpu > 0 ? static_cast<int>(ncpu) : 1;
+  }
+  loops_.reserve(numLoops);
+  for (int i = 0; i < numLoops; ++i) loops_.emplace_back(new EventLoop(i));
+}
+
+EventLoopPool::~EventLoopPool() { stop(); }
+
+void EventLoopPool::start() {
+  if (started_) return;
+  started_ = true;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  for (size_t i = 0; i < loops_.size(); ++i) {
+    EventLoop* loop = loops_[i].get();
+    threads_.emplace_back([loop] { loop->run(); });
+    if (pinThreads_ && ncpu > 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(static_cast<int>(i % ncpu), &set);
+      int rc = pthread_setaffinity_np(threads_.back().native_handle(), sizeof(set), &set);
+      if (rc != 0) NVR_WARN("loop %zu: cannot pin to cpu %ld", i, i % ncpu);
+    }
+    char name[16];
+    snprintf(name, sizeof(name), "nvr-loop-%d", static_cast<int>(i % 1000));
+    pthread_setname_np(threads_.back().native_handle(), name);
+  }
+}
+
+void EventLoopPool::stop() {
+  if (!started_) return;
+  started_ = false;
+  for (auto& loop : loops_) loop->quit();
+  for (auto& t : threads_) t.join();
+  threads_.clear();
+}
+
+}  // namespace nvr
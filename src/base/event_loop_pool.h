@@ -0,0 +1,47 @@
+// Fixed pool of event loops, one thread per loop.
+//
+// Work is sharded onto loops by key (camera id hash, connection id, ...) so
+// that every object lives on exactly one loop for its whole lifetime and no
+// state is shared between loops.
+
+#ifndef NVR_BASE_EVENT_LOOP_POOL_H
+#define NVR_BASE_EVENT_LOOP_POOL_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "base/event_loop.h"
+
+namespace nvr {
+
+class EventLoopPool {
+ public:
+  // numLoops <= 0 picks one loop per online CPU. When pinThreads is set loop
+  // i is bound to CPU (i % ncpu).
+  explicit EventLoopPool(int numLoops = 0, bool pinThreads = true);
+  ~EventLoopPool();
+
+  EventLoopPool(const EventLoopPool&) = delete;
+  EventLoopPool& operator=(const EventLoopPool&) = delete;
+
+  void start();
+  // Quits every loop and joins its thread. Idempotent.
+  void stop();
+
+  int size() const { return static_cast<int>(loops_.size()); }
+  EventLoop* loop(int index) { return loops_[index].get(); }
+  EventLoop* loopForKey(uint64_t key) { return loops_[key % loops_.size()].get(); }
+
+ private:
+  bool pinThreads_;
+  bool started_ = false;
+  std::vector<std::unique_ptr<EventLoop>> loops_;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_EVENT_LOOP_POOL_H
@@ -0,0 +1,38 @@
+// Stable hashes for sharding. Unlike std::hash these give the same value on
+// every node and every run, so placement decisions agree across a cluster.
+
+#ifndef NVR_BASE_HASH_H
+#define NVR_BASE_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace nvr {
+
+inline uint64_t fnv1a64(const void* data, size_t len, uint64_t seed = 0xcbf29ce484222325ULL) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  uint64_t h = seed;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+inline uint64_t fnv1a64(const std::string& s) { return fnv1a64(s.data(), s.size()); }
+
+// Finalizer from MurmurHash3; spreads low-entropy keys over all bits.
+inline uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_HASH_H
@@ -0,0 +1,58 @@
+#include "base/log.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <atomic>
+
+namespace nvr {
+
+namespace {
+
+std::atomic<int> g_level{static_cast<int>(LogLevel::Info)};
+
+const char* levelName(LogLevel level) {
+  switch (level) {
+    case LogLevel::Debug: return "D";
+    case LogLevel::Info: return "I";
+    case LogLevel::Warn: return "W";
+    case LogLevel::Error: return "E";
+  }
+  return "?";
+}
+
+}  // namespace
+
+void setLogLevel(LogLevel level) {
+  g_level.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+LogLevel logLevel() {
+  return static_cast<LogLevel>(g_level.load(std::memory_order_relaxed));
+}
+
+void logWrite(LogLevel level, const char* file, int line, const char* fmt, ...) {
+  char msg[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  struct tm tm;
+  localtime_r(&tv.tv_sec, &tm);
+
+  const char* base = strrchr(file, '/');
+  base = base ? base + 1 : file;
+
+  // One fprintf per line keeps lines from different loops unmixed.
+  fprintf(stderr, "%02d:%02d:%02d.%03d %s %s:%d] %s\n", tm.tm_hour, tm.tm_min,
+          tm.tm_sec, static_cast<int>(tv.tv_usec / 1000), levelName(level), base,
+          line, msg);
+}
+
+}  // namespace nvr
@@ -0,0 +1,29 @@
+// Minimal leveled logging to stderr.
+
+#ifndef NVR_BASE_LOG_H
+#define NVR_BASE_LOG_H
+
+namespace nvr {
+
+enum class LogLevel { Debug = 0, Info, Warn, Error };
+
+void setLogLevel(LogLevel level);
+LogLevel logLevel();
+
+void logWrite(LogLevel level, const char* file, int line, const char* fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+}  // namespace nvr
+
+#define NVR_LOG(level, ...)                                      \
+  do {                                                           \
+    if ((level) >= ::nvr::logLevel())                            \
+      ::nvr::logWrite((level), __FILE__, __LINE__, __VA_ARGS__); \
+  } while (0)
+
+#define NVR_DEBUG(...) NVR_LOG(::nvr::LogLevel::Debug, __VA_ARGS__)
+#define NVR_INFO(...) NVR_LOG(::nvr::LogLevel::Info, __VA_ARGS__)
+#define NVR_WARN(...) NVR_LOG(::nvr::LogLevel::Warn, __VA_ARGS__)
+#define NVR_ERROR(...) NVR_LOG(::nvr::LogLevel::Error, __VA_ARGS__)
+
+#endif  // NVR_BASE_LOG_H
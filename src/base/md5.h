@@ -0,0 +1,33 @@
+// MD5 digest (RFC 1321), used for RTSP/HTTP Digest authentication.
+
+#ifndef NVR_BASE_MD5_H
+#define NVR_BASE_MD5_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace nvr {
+
+class Md5 {
+ public:
+  Md5();
+  void update(const void* data, size_t len);
+  void update(const std::string& s) { update(s.data(), s.size()); }
+  void final(uint8_t digest[16]);
+
+  // Lowercase hex digest of s.
+  static std::string hex(const std::string& s);
+
+ private:
+  void transform(const uint8_t block[64]);
+
+  uint32_t state_[4];
+  uint64_t bytes_ = 0;
+  uint8_t buffer_[64];
+};
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_MD5_H
@@ -0,0 +1,90 @@
+// Bounded lock-free multi-producer, single-consumer queue.
+//
+// A ring of cells with per-cell sequence numbers (Vyukov's bounded queue):
+// producers claim a slot with one compare-and-swap on the tail and publish
+// it by bumping the cell's sequence, the consumer reads cells in order
+// without atomic read-modify-writes. push() never blocks or allocates; a
+// full queue is reported to the producer instead.
+//
+// T must be cheap to copy; records are copied in and out.
+
+#ifndef NVR_BASE_MPSC_QUEUE_H
+#define NVR_BASE_MPSC_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+namespace nvr {
+
+template <typename T>
+class MpscQueue {
+ public:
+  // capacity is rounded up to a power of two.
+  explicit MpscQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+    mask_ = size - 1;
+    cells_.reset(new Cell[size]);
+    for (size_t i = 0; i < size; ++i) cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // Any thread. Returns false when the queue is full.
+  bool push(const T& value) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        return false;  // the consumer has not freed this cell yet
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = value;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer thread only. Returns false when empty.
+  bool pop(T* out) {
+    Cell& cell = cells_[head_ & mask_];
+    if (cell.sequence.load(std::memory_order_acquire) != head_ + 1) return false;
+    *out = cell.value;
+    cell.sequence.store(head_ + mask_ + 1, std::memory_order_release);
+    ++head_;
+    return true;
+  }
+
+  // Consumer thread only; a hint while producers are active.
+  bool empty() const {
+    return cells_[head_ & mask_].sequence.load(std::memory_order_acquire) != head_ + 1;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_ = 0;
+  // Producers and the consumer write these; keep them on separate lines.
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) size_t head_ = 0;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_MPSC_QUEUE_H
@@ -0,0 +1,98 @@
+#include "base/packet_buffer.h"
+
+#include <stdlib.h>
+
+#include <new>
+
+#include "base/log.h"
+
+namespace nvr {
+
+void PacketBuffer::unref() {
+  if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) pool_->release(this);
+}
+
+PacketPool::PacketPool(size_t bufferSize, size_t buffersPerSlab)
+    : bufferSize_(bufferSize),
+      stride_((sizeof(PacketBuffer) + bufferSize + 63) & ~size_t(63)),
+      buffersPerSlab_(buffersPerSlab ? buffersPerSlab : 1) {}
+
+PacketPool::~PacketPool() {
+  Stats s = stats();
+  size_t remote = 0;
+  for (PacketBuffer* b = remoteFree_.load(); b; b = b->next_) ++remote;
+  if (s.free + remote != s.total)
+    NVR_ERROR("packet pool(%zu): %zu buffer(s) still referenced at destruction", bufferSize_,
+              s.total - s.free - remote);
+  for (void* slab : slabs_) free(slab);
+}
+
+PacketBuffer* PacketPool::acquire() {
+  if (!ownerSet_) {
+    owner_ = std::this_thread::get_id();
+    ownerSet_ = true;
+  }
+  if (freeList_ == nullptr) {
+    // Pick up everything other threads released since last time.
+    PacketBuffer* remote = remoteFree_.exchange(nullptr, std::memory_order_acquire);
+    while (remote) {
+      PacketBuffer* next = remote->next_;
+      remote->next_ = freeList_;
+      freeList_ = remote;
+      ++freeCount_;
+      remote = next;
+    }
+    if (freeList_ == nullptr) addSlab();
+  }
+  PacketBuffer* buffer = freeList_;
+  freeList_ = buffer->next_;
+  --freeCount_;
+  buffer->next_ = nullptr;
+  buffer->refs_.store(1, std::memory_order_relaxed);
+  ++acquires_;
+  return buffer;
+}
+
+void PacketPool::release(PacketBuffer* buffer) {
+  if (ownerSet_ && std::this_thread::get_id() == owner_) {
+    buffer->next_ = freeList_;
+    freeList_ = buffer;
+    ++freeCount_;
+    return;
+  }
+  // Push-only Treiber stack; the owner drains it wholesale, so there is no
+  // ABA hazard.
+  PacketBuffer* head = remoteFree_.load(std::memory_order_relaxed);
+  do {
+    buffer->next_ = head;
+  } while (!remoteFree_.compare_exchange_weak(head, buffer, std::memory_order_release,
+                                              std::memory_order_relaxed));
+  remoteReleases_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PacketPool::addSlab() {
+  void* slab = aligned_alloc(64, stride_ * buffersPerSlab_);
+  if (slab == nullptr) throw std::bad_alloc();
+  slabs_.push_back(slab);
+  auto* base = static_cast<uint8_t*>(slab);
+  for (size_t i = 0; i < buffersPerSlab_; ++i) {
+    auto* buffer = new (base + i * stride_) PacketBuffer;
+    buffer->capacity_ = static_cast<uint32_t>(bufferSize_);
+    buffer->pool_ = this;
+    buffer->next_ = freeList_;
+    freeList_ = buffer;
+    ++freeCount_;
+  }
+}
+
+PacketPool::Stats PacketPool::stats() const {
+  Stats s;
+  s.bufferSize = bufferSize_;
+  s.total = slabs_.size() * buffersPerSlab_;
+  s.free = freeCount_;
+  s.acquires = acquires_;
+  s.remoteReleases = remoteReleases_.load(std::memory_order_relaxed);
+  return s;
+}
+
+}  // namespace nvr
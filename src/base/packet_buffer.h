@@ -0,0 +1,161 @@
+// Refcounted, pool-allocated media buffers.
+//
+// Media is received once into a PacketBuffer and then shared by reference:
+// relay subscribers, the recorder and caches all hold PacketRefs (a buffer
+// plus an offset/length window) instead of copying bytes. Buffers go back to
+// their pool when the last reference is dropped.
+//
+// A pool is owned by one thread (normally an event loop), which is the only
+// thread allowed to acquire(). References may be released on any thread;
+// foreign releases are handed back through a lock-free stack and picked up
+// by the owner on its next acquire().
+
+#ifndef NVR_BASE_PACKET_BUFFER_H
+#define NVR_BASE_PACKET_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace nvr {
+
+class PacketPool;
+
+class PacketBuffer {
+ public:
+  uint8_t* data() { return reinterpret_cast<uint8_t*>(this + 1); }
+  const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(this + 1); }
+  size_t capacity() const { return capacity_; }
+
+  void ref() { refs_.fetch_add(1, std::memory_order_relaxed); }
+  void unref();
+  // Acquire ordering: a holder that sees 1 may safely reuse the bytes.
+  uint32_t refCount() const { return refs_.load(std::memory_order_acquire); }
+
+ private:
+  friend class PacketPool;
+
+  std::atomic<uint32_t> refs_{0};
+  uint32_t capacity_ = 0;
+  PacketPool* pool_ = nullptr;
+  PacketBuffer* next_ = nullptr;  // free list link
+} __attribute__((aligned(32)));
+
+class PacketPool {
+ public:
+  struct Stats {
+    size_t bufferSize = 0;
+    size_t total = 0;      // buffers carved from slabs
+    size_t free = 0;       // owner-side free list only
+    uint64_t acquires = 0;
+    uint64_t remoteReleases = 0;
+  };
+
+  explicit PacketPool(size_t bufferSize, size_t buffersPerSlab = 64);
+  // All references must have been released.
+  ~PacketPool();
+
+  PacketPool(const PacketPool&) = delete;
+  PacketPool& operator=(const PacketPool&) = delete;
+
+  // Returns a buffer with a reference count of one. Owner thread only.
+  PacketBuffer* acquire();
+
+  size_t bufferSize() const { return bufferSize_; }
+  Stats stats() const;
+
+ private:
+  friend class PacketBuffer;
+
+  void release(PacketBuffer* buffer);
+  void addSlab();
+
+  const size_t bufferSize_;
+  const size_t stride_;
+  const size_t buffersPerSlab_;
+  std::thread::id owner_;
+  bool ownerSet_ = false;
+  PacketBuffer* freeList_ = nullptr;
+  size_t freeCount_ = 0;
+  std::atomic<PacketBuffer*> remoteFree_{nullptr};
+  std::vector<void*> slabs_;
+  uint64_t acquires_ = 0;
+  std::atomic<uint64_t> remoteReleases_{0};
+};
+
+// Shared view of [offset, offset + size) inside a PacketBuffer.
+class PacketRef {
+ public:
+  PacketRef() = default;
+  // Takes a new reference.
+  PacketRef(PacketBuffer* buffer, uint32_t offset, uint32_t size)
+      : buffer_(buffer), offset_(offset), size_(size) {
+    if (buffer_) buffer_->ref();
+  }
+  // Takes over the caller's reference (e.g. the one from acquire()).
+  static PacketRef adopt(PacketBuffer* buffer, uint32_t offset, uint32_t size) {
+    PacketRef ref;
+    ref.buffer_ = buffer;
+    ref.offset_ = offset;
+    ref.size_ = size;
+    return ref;
+  }
+
+  PacketRef(const PacketRef& other) : PacketRef(other.buffer_, other.offset_, other.size_) {}
+  PacketRef(PacketRef&& other) noexcept
+      : buffer_(other.buffer_), offset_(other.offset_), size_(other.size_) {
+    other.buffer_ = nullptr;
+    other.size_ = 0;
+  }
+  PacketRef& operator=(PacketRef other) noexcept {
+    swap(other);
+    return *this;
+  }
+  ~PacketRef() {
+    if (buffer_) buffer_->unref();
+  }
+
+  void swap(PacketRef& other) noexcept {
+    std::swap(buffer_, other.buffer_);
+    std::swap(offset_, other.offset_);
+    std::swap(size_, other.size_);
+  }
+  void reset() { PacketRef().swap(*this); }
+
+  const uint8_t* data() const { return buffer_->data() + offset_; }
+  uint8_t* mutableData() { return buffer_->data() + offset_; }
+  uint32_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  explicit operator bool() const { return buffer_ != nullptr; }
+  PacketBuffer* buffer() const { return buffer_; }
+  uint32_t offset() const { return offset_; }
+
+  // Narrower view sharing the same buffer.
+  PacketRef slice(uint32_t offset, uint32_t size) const {
+    return PacketRef(buffer_, offset_ + offset, size);
+  }
+
+ private:
+  PacketBuffer* buffer_ = nullptr;
+  uint32_t offset_ = 0;
+  uint32_t size_ = 0;
+};
+
+// Buffer pools one event loop uses for received media: large chunks for
+// stream sockets (RTP over RTSP/TCP, sliced per packet) and datagram-sized
+// buffers for UDP.
+struct PacketPools {
+  static constexpr size_t kStreamChunkSize = 128 * 1024;
+  static constexpr size_t kDatagramSize = 2048;
+
+  PacketPool stream{kStreamChunkSize, 16};
+  PacketPool datagram{kDatagramSize, 256};
+};
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_PACKET_BUFFER_H
@@ -0,0 +1,99 @@
+#include "base/sha1.h"
+
+#include <string.h>
+
+namespace nvr {
+
+namespace {
+
+inline uint32_t rotl(uint32_t x, int c) { return (x << c) | (x >> (32 - c)); }
+
+}  // namespace
+
+Sha1::Sha1() {
+  state_[0] = 0x67452301;
+  state_[1] = 0xefcdab89;
+  state_[2] = 0x98badcfe;
+  state_[3] = 0x10325476;
+  state_[4] = 0xc3d2e1f0;
+}
+
+void Sha1::update(const void* data, size_t len) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  size_t used = bytes_ % 64;
+  bytes_ += len;
+  if (used) {
+    size_t take = 64 - used < len ? 64 - used : len;
+    memcpy(buffer_ + used, p, take);
+    p += take;
+    len -= take;
+    if (used + take < 64) return;
+    transform(buffer_);
+  }
+  while (len >= 64) {
+    transform(p);
+    p += 64;
+    len -= 64;
+  }
+  memcpy(buffer_, p, len);
+}
+
+void Sha1::final(uint8_t digest[20]) {
+  uint64_t bits = bytes_ * 8;
+  uint8_t pad = 0x80;
+  update(&pad, 1);
+  uint8_t zero = 0;
+  while (bytes_ % 64 != 56) update(&zero, 1);
+  uint8_t len[8];
+  for (int i = 0; i < 8; ++i) len[i] = static_cast<uint8_t>(bits >> (8 * (7 - i)));
+  update(len, 8);
+  for (int i = 0; i < 20; ++i)
+    digest[i] = static_cast<uint8_t>(state_[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+std::string Sha1::digest(const std::string& s) {
+  Sha1 sha1;
+  sha1.update(s);
+  uint8_t digest[20];
+  sha1.final(digest);
+  return std::string(reinterpret_cast<const char*>(digest), sizeof(digest));
+}
+
+void Sha1::transform(const uint8_t block[64]) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; ++i) {
+    w[i] = (static_cast<uint32_t>(block[i * 4]) << 24) | (block[i * 4 + 1] << 16) |
+           (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+  }
+  for (int i = 16; i < 80; ++i) w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3], e = state_[4];
+  for (int i = 0; i < 80; ++i) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    uint32_t tmp = rotl(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotl(b, 30);
+    b = a;
+    a = tmp;
+  }
+  state_[0] += a;
+  state_[1] += b;
+  state_[2] += c;
+  state_[3] += d;
+  state_[4] += e;
+}
+
+}  // namespace nvr
@@ -0,0 +1,33 @@
+// SHA-1 digest (RFC 3174), used for WS-Security UsernameToken digests.
+
+#ifndef NVR_BASE_SHA1_H
+#define NVR_BASE_SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace nvr {
+
+class Sha1 {
+ public:
+  Sha1();
+  void update(const void* data, size_t len);
+  void update(const std::string& s) { update(s.data(), s.size()); }
+  void final(uint8_t digest[20]);
+
+  // Raw 20-byte digest of s.
+  static std::string digest(const std::string& s);
+
+ private:
+  void transform(const uint8_t block[64]);
+
+  uint32_t state_[5];
+  uint64_t bytes_ = 0;
+  uint8_t buffer_[64];
+};
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_SHA1_H
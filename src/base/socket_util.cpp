@@ -0,0 +1,194 @@
+#include "base/socket_util.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace nvr {
+
+uint16_t SocketAddress::port() const {
+  if (storage.ss_family == AF_INET)
+    return ntohs(reinterpret_cast<const sockaddr_in*>(&storage)->sin_port);
+  if (storage.ss_family == AF_INET6)
+    return ntohs(reinterpret_cast<const sockaddr_in6*>(&storage)->sin6_port);
+  return 0;
+}
+
+void SocketAddress::setPort(uint16_t port) {
+  if (storage.ss_family == AF_INET)
+    reinterpret_cast<sockaddr_in*>(&storage)->sin_port = htons(port);
+  else if (storage.ss_family == AF_INET6)
+    reinterpret_cast<sockaddr_in6*>(&storage)->sin6_port = htons(port);
+}
+
+bool SocketAddress::sameHost(const SocketAddress& other) const {
+  if (storage.ss_family != other.storage.ss_family) return false;
+  if (storage.ss_family == AF_INET) {
+    return reinterpret_cast<const sockaddr_in*>(&storage)->sin_addr.s_addr ==
+           reinterpret_cast<const sockaddr_in*>(&other.storage)->sin_addr.s_addr;
+  }
+  if (storage.ss_family == AF_INET6) {
+    return memcmp(&reinterpret_cast<const sockaddr_in6*>(&storage)->sin6_addr,
+                  &reinterpret_cast<const sockaddr_in6*>(&other.storage)->sin6_addr,
+                  sizeof(in6_addr)) == 0;
+  }
+  return false;
+}
+
+std::string SocketAddress::toString() const {
+  char host[INET6_ADDRSTRLEN] = "?";
+  if (storage.ss_family == AF_INET) {
+    inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in*>(&storage)->sin_addr, host,
+              sizeof(host));
+    return std::string(host) + ":" + std::to_string(port());
+  }
+  if (storage.ss_family == AF_INET6) {
+    inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6*>(&storage)->sin6_addr, host,
+              sizeof(host));
+    return "[" + std::string(host) + "]:" + std::to_string(port());
+  }
+  return host;
+}
+
+int resolveAddress(const std::string& host, uint16_t port, SocketAddress* out) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* result = nullptr;
+  int rc = getaddrinfo(host.c_str(), nullptr, &hints, &result);
+  if (rc != 0 || result == nullptr) return -EHOSTUNREACH;
+  memcpy(&out->storage, result->ai_addr, result->ai_addrlen);
+  out->length = result->ai_addrlen;
+  out->setPort(port);
+  freeaddrinfo(result);
+  return 0;
+}
+
+int setNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return -errno;
+  return 0;
+}
+
+int setNoDelay(int fd) {
+  int one = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) return -errno;
+  return 0;
+}
+
+int setReuseAddr(int fd) {
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) return -errno;
+  return 0;
+}
+
+int setReusePort(int fd) {
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) return -errno;
+  return 0;
+}
+
+int setRecvBufferSize(int fd, int bytes) {
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) < 0) return -errno;
+  return 0;
+}
+
+int setSendBufferSize(int fd, int bytes) {
+  if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)) < 0) return -errno;
+  return 0;
+}
+
+int tcpConnect(const SocketAddress& addr) {
+  int fd = socket(addr.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -errno;
+  setNoDelay(fd);
+  if (connect(fd, addr.get(), addr.length) < 0 && errno != EINPROGRESS) {
+    int err = errno;
+    close(fd);
+    return -err;
+  }
+  return fd;
+}
+
+int tcpListen(const SocketAddress& addr, int backlog, bool reusePort) {
+  int fd = socket(addr.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -errno;
+  setReuseAddr(fd);
+  if (reusePort) setReusePort(fd);
+  if (bind(fd, addr.get(), addr.length) < 0 || listen(fd, backlog) < 0) {
+    int err = errno;
+    close(fd);
+    return -err;
+  }
+  return fd;
+}
+
+int socketError(int fd) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) return -errno;
+  return -err;
+}
+
+int udpBind(int family, uint16_t port, bool reusePort) {
+  int fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -errno;
+  if (reusePort) setReusePort(fd);
+  SocketAddress addr;
+  memset(&addr.storage, 0, sizeof(addr.storage));
+  if (family == AF_INET6) {
+    auto* sin6 = reinterpret_cast<sockaddr_in6*>(&addr.storage);
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_addr = in6addr_any;
+    sin6->sin6_port = htons(port);
+    addr.length = sizeof(sockaddr_in6);
+  } else {
+    auto* sin = reinterpret_cast<sockaddr_in*>(&addr.storage);
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(INADDR_ANY);
+    sin->sin_port = htons(port);
+    addr.length = sizeof(sockaddr_in);
+  }
+  if (bind(fd, addr.get(), addr.length) < 0) {
+    int err = errno;
+    close(fd);
+    return -err;
+  }
+  return fd;
+}
+
+int udpBindPair(int family, int* rtpFd, int* rtcpFd) {
+  for (int attempt = 0; attempt < 64; ++attempt) {
+    int fd = udpBind(family, 0);
+    if (fd < 0) return fd;
+    SocketAddress local;
+    localAddress(fd, &local);
+    uint16_t port = local.port();
+    if (port % 2 != 0) {
+      close(fd);
+      continue;
+    }
+    int fd2 = udpBind(family, port + 1);
+    if (fd2 < 0) {
+      close(fd);
+      continue;
+    }
+    *rtpFd = fd;
+    *rtcpFd = fd2;
+    return port;
+  }
+  return -EADDRINUSE;
+}
+
+int localAddress(int fd, SocketAddress* out) {
+  out->length = sizeof(out->storage);
+  if (getsockname(fd, out->get(), &out->length) < 0) return -errno;
+  return 0;
+}
+
+}  // namespace nvr
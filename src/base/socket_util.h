@@ -0,0 +1,56 @@
+// Thin helpers over the BSD socket API. All sockets are non-blocking and
+// close-on-exec. Functions return a descriptor or 0 on success, -errno on
+// failure.
+
+#ifndef NVR_BASE_SOCKET_UTIL_H
+#define NVR_BASE_SOCKET_UTIL_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <string>
+
+namespace nvr {
+
+struct SocketAddress {
+  struct sockaddr_storage storage;
+  socklen_t length = 0;
+
+  const struct sockaddr* get() const { return reinterpret_cast<const struct sockaddr*>(&storage); }
+  struct sockaddr* get() { return reinterpret_cast<struct sockaddr*>(&storage); }
+  int family() const { return storage.ss_family; }
+  uint16_t port() const;
+  void setPort(uint16_t port);
+  // Same address, ignoring the port.
+  bool sameHost(const SocketAddress& other) const;
+  std::string toString() const;
+};
+
+// Resolves numeric or symbolic host names. This blocks on DNS for symbolic
+// names, so call it before handing work to an event loop when possible.
+int resolveAddress(const std::string& host, uint16_t port, SocketAddress* out);
+
+int setNonBlocking(int fd);
+int setNoDelay(int fd);
+int setReuseAddr(int fd);
+int setReusePort(int fd);
+int setRecvBufferSize(int fd, int bytes);
+int setSendBufferSize(int fd, int bytes);
+
+// Starts a non-blocking connect. Success means the connect is in progress or
+// done; completion is signalled by EPOLLOUT and checked with socketError().
+int tcpConnect(const SocketAddress& addr);
+int tcpListen(const SocketAddress& addr, int backlog = 1024, bool reusePort = false);
+int socketError(int fd);
+
+// Binds a UDP socket on the wildcard address of the given family.
+int udpBind(int family, uint16_t port, bool reusePort = false);
+// Binds an even/odd RTP/RTCP port pair; returns the RTP port or -errno.
+int udpBindPair(int family, int* rtpFd, int* rtcpFd);
+
+int localAddress(int fd, SocketAddress* out);
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_SOCKET_UTIL_H
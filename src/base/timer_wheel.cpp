@@ -0,0 +1,213 @@
+#include "base/timer_wheel.h"
+
+#include <algorithm>
+
+namespace nvr {
+
+namespace {
+
+uint64_t levelShift(int level) { return static_cast<uint64_t>(TimerWheel::kSlotBits) * level; }
+
+}  // namespace
+
+TimerWheel::TimerWheel(uint64_t now) : current_(now) {
+  std::fill(heads_, heads_ + kLists, kNil);
+  std::fill(tails_, tails_ + kLists, kNil);
+}
+
+TimerWheel::Id TimerWheel::schedule(uint64_t deadline, Task task, uint64_t interval) {
+  uint32_t index;
+  if (freeHead_ != kNil) {
+    index = freeHead_;
+    freeHead_ = nodes_[index].next;
+  } else {
+    index = static_cast<uint32_t>(nodes_.size());
+    nodes_.emplace_back();
+  }
+  Node& node = nodes_[index];
+  node.deadline = deadline;
+  node.interval = interval;
+  node.task = std::move(task);
+  insert(index);
+  ++size_;
+  return static_cast<uint64_t>(node.generation) << 32 | index;
+}
+
+bool TimerWheel::cancel(Id id) {
+  uint32_t index = static_cast<uint32_t>(id);
+  if (index >= nodes_.size()) return false;
+  Node& node = nodes_[index];
+  if (node.list == kFree || node.list == kCancelled ||
+      node.generation != static_cast<uint32_t>(id >> 32))
+    return false;
+  if (node.list == kRunning) {
+    // Released once its task returns.
+    node.list = kCancelled;
+    return true;
+  }
+  unlink(index);
+  release(index);
+  --size_;
+  return true;
+}
+
+void TimerWheel::advance(uint64_t now) {
+  while (current_ <= now) {
+    uint64_t tick = nextWork();
+    if (tick > now) {
+      current_ = now + 1;
+      return;
+    }
+    current_ = tick;
+    // Coarsest first: a slot cascaded from above may land in the slot of
+    // the next finer wheel that is emptied right after.
+    if ((tick & 0xffffffffull) == 0 && heads_[kOverflowList] != kNil) {
+      uint32_t index = heads_[kOverflowList];
+      heads_[kOverflowList] = tails_[kOverflowList] = kNil;
+      while (index != kNil) {
+        uint32_t next = nodes_[index].next;
+        insert(index);
+        index = next;
+      }
+    }
+    for (int level = kLevels - 1; level > 0; --level) {
+      if ((tick & ((1ull << levelShift(level)) - 1)) == 0) cascade(level);
+    }
+    uint32_t slot = static_cast<uint32_t>(tick & (kSlots - 1));
+    heads_[kRunList] = heads_[slot];
+    tails_[kRunList] = tails_[slot];
+    heads_[slot] = tails_[slot] = kNil;
+    occupied_[0][slot / 64] &= ~(1ull << (slot % 64));
+    for (uint32_t i = heads_[kRunList]; i != kNil; i = nodes_[i].next) nodes_[i].list = kRunList;
+    // Anything scheduled from here on is for a later tick.
+    current_ = tick + 1;
+    while (heads_[kRunList] != kNil) {
+      uint32_t index = heads_[kRunList];
+      unlink(index);
+      nodes_[index].list = kRunning;
+      Task task = std::move(nodes_[index].task);
+      task();
+      Node& node = nodes_[index];  // nodes_ may have grown meanwhile
+      if (node.list == kRunning && node.interval != 0) {
+        node.task = std::move(task);
+        node.deadline = now + node.interval;
+        insert(index);
+      } else {
+        release(index);
+        --size_;
+      }
+    }
+  }
+}
+
+uint64_t TimerWheel::nextDeadline() const { return nextWork(); }
+
+void TimerWheel::insert(uint32_t index) {
+  Node& node = nodes_[index];
+  uint64_t deadline = std::max(node.deadline, current_);
+  node.deadline = deadline;
+  for (int level = 0; level < kLevels; ++level) {
+    // The finest wheel whose current turn still reaches the deadline.
+    uint64_t span = levelShift(level + 1);
+    if ((deadline >> span) == (current_ >> span)) {
+      uint32_t slot = static_cast<uint32_t>((deadline >> levelShift(level)) & (kSlots - 1));
+      link(index, static_cast<uint32_t>(level) * kSlots + slot);
+      return;
+    }
+  }
+  link(index, kOverflowList);
+}
+
+void TimerWheel::link(uint32_t index, uint32_t list) {
+  Node& node = nodes_[index];
+  node.list = list;
+  node.next = kNil;
+  node.prev = tails_[list];
+  if (tails_[list] != kNil) {
+    nodes_[tails_[list]].next = index;
+  } else {
+    heads_[list] = index;
+  }
+  tails_[list] = index;
+  if (list < kOverflowList) occupied_[list / kSlots][list % kSlots / 64] |= 1ull << (list % 64);
+}
+
+void TimerWheel::unlink(uint32_t index) {
+  Node& node = nodes_[index];
+  uint32_t list = node.list;
+  if (node.prev != kNil) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    heads_[list] = node.next;
+  }
+  if (node.next != kNil) {
+    nodes_[node.next].prev = node.prev;
+  } else {
+    tails_[list] = node.prev;
+  }
+  if (list < kOverflowList && heads_[list] == kNil)
+    occupied_[list / kSlots][list % kSlots / 64] &= ~(1ull << (list % 64));
+  node.prev = node.next = kNil;
+}
+
+void TimerWheel::release(uint32_t index) {
+  Node& node = nodes_[index];
+  node.task = nullptr;
+  node.list = kFree;
+  ++node.generation;
+  if (node.generation == 0) node.generation = 1;  // ids are never 0
+  node.next = freeHead_;
+  freeHead_ = index;
+}
+
+void TimerWheel::cascade(int level) {
+  uint32_t slot = static_cast<uint32_t>((current_ >> levelShift(level)) & (kSlots - 1));
+  uint32_t list = static_cast<uint32_t>(level) * kSlots + slot;
+  uint32_t index = heads_[list];
+  if (index == kNil) return;
+  heads_[list] = tails_[list] = kNil;
+  occupied_[level][slot / 64] &= ~(1ull << (slot % 64));
+  while (index != kNil) {
+    uint32_t next = nodes_[index].next;
+    insert(index);
+    index = next;
+  }
+}
+
+uint64_t TimerWheel::nextWork() const {
+  if (size_ == 0) return UINT64_MAX;
+  // A coarser slot for the current tick is left only when that tick is a
+  // boundary not processed yet; it may hold timers due before any of the
+  // finest wheel's.
+  for (int level = 1; level < kLevels; ++level) {
+    uint32_t slot = static_cast<uint32_t>((current_ >> levelShift(level)) & (kSlots - 1));
+    if (occupied_[level][slot / 64] & (1ull << (slot % 64))) return current_;
+  }
+  uint64_t best = UINT64_MAX;
+  for (int level = 0; level < kLevels; ++level) {
+    uint64_t shift = levelShift(level);
+    int slot = firstSet(level, static_cast<uint32_t>((current_ >> shift) & (kSlots - 1)));
+    if (slot < 0) continue;
+    // Timers of a wheel lie within its current turn, and those of a coarser
+    // wheel after all of a finer one's: the first hit is the earliest.
+    uint64_t turn = current_ >> levelShift(level + 1) << levelShift(level + 1);
+    best = std::max(turn | static_cast<uint64_t>(slot) << shift, current_);
+    break;
+  }
+  // The top wheel's next turn, which may be the current tick when it has
+  // not been processed yet.
+  if (best == UINT64_MAX && heads_[kOverflowList] != kNil)
+    best = (current_ + 0xffffffffull) >> 32 << 32;
+  return best;
+}
+
+int TimerWheel::firstSet(int level, uint32_t from) const {
+  for (uint32_t word = from / 64; word < kSlots / 64; ++word) {
+    uint64_t bits = occupied_[level][word];
+    if (word == from / 64) bits &= ~0ull << (from % 64);
+    if (bits) return static_cast<int>(word * 64 + __builtin_ctzll(bits));
+  }
+  return -1;
+}
+
+}  // namespace nvr
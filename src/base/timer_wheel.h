@@ -0,0 +1,111 @@
+// Hierarchical timing wheel.
+//
+// Four wheels of 256 slots each cover 2^32 ticks (49 days of 1 ms ticks).
+// A timer goes into the slot of the finest wheel whose span still holds
+// its deadline; every time the finer wheel completes a turn, the coarser
+// wheel's current slot is emptied into it. Scheduling and cancelling are
+// O(1), and an idle stretch is skipped by slot occupancy bitmaps rather
+// than walked tick by tick. Deadlines further out than the top wheel wait
+// in an overflow list that is sorted in as the top wheel turns.
+//
+// Nodes live in one vector with a free list and are linked by index, so a
+// steady state schedules without allocating beyond the task itself. An id
+// carries the node's generation, which makes cancelling a timer that has
+// already run (or an id from before a node was reused) a no-op. A periodic
+// timer keeps its node, and so its id, from one run to the next.
+//
+// A wheel belongs to one thread.
+
+#ifndef NVR_BASE_TIMER_WHEEL_H
+#define NVR_BASE_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+namespace nvr {
+
+class TimerWheel {
+ public:
+  using Id = uint64_t;  // never 0
+  using Task = std::function<void()>;
+
+  static constexpr int kLevels = 4;
+  static constexpr int kSlotBits = 8;
+  static constexpr uint32_t kSlots = 1u << kSlotBits;
+
+  // Ticks are whatever unit the caller counts in; now is the current one.
+  explicit TimerWheel(uint64_t now = 0);
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // Runs task from the first advance() reaching deadline. A deadline that
+  // has passed already counts as the next tick. With an interval, runs it
+  // again interval ticks after the now of each advance() that ran it,
+  // until cancelled.
+  Id schedule(uint64_t deadline, Task task, uint64_t interval = 0);
+  // False if the timer already ran or was cancelled. A timer may cancel
+  // itself from its own task.
+  bool cancel(Id id);
+
+  // Runs every timer due at or before now, in deadline order (ties in no
+  // particular order). Tasks may schedule and cancel timers; one scheduled
+  // for now or earlier runs at the next advance(), not this one.
+  void advance(uint64_t now);
+
+  // No timer is due before the returned tick: exact when a timer is in the
+  // finest wheel, otherwise the start of the coarser slot holding the
+  // earliest one. UINT64_MAX when empty.
+  uint64_t nextDeadline() const;
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  // The next tick advance() processes.
+  uint64_t now() const { return current_; }
+
+ private:
+  static constexpr uint32_t kNil = UINT32_MAX;
+  static constexpr uint32_t kOverflowList = kLevels * kSlots;
+  static constexpr uint32_t kRunList = kOverflowList + 1;
+  static constexpr uint32_t kLists = kRunList + 1;
+  // Not lists: states of a node outside the wheel.
+  static constexpr uint32_t kFree = kLists;
+  static constexpr uint32_t kRunning = kLists + 1;
+  static constexpr uint32_t kCancelled = kLists + 2;  // while running
+
+  struct Node {
+    uint64_t deadline = 0;
+    uint64_t interval = 0;
+    Task task;
+    uint32_t prev = kNil;
+    uint32_t next = kNil;
+    uint32_t list = kFree;
+    uint32_t generation = 1;
+  };
+
+  void insert(uint32_t index);
+  void link(uint32_t index, uint32_t list);
+  void unlink(uint32_t index);
+  void release(uint32_t index);
+  // Empties the level's slot for current_ into finer wheels.
+  void cascade(int level);
+  // First tick at or after current_ with work: a timer in the finest wheel,
+  // or a coarser slot to cascade. UINT64_MAX when empty.
+  uint64_t nextWork() const;
+  int firstSet(int level, uint32_t from) const;
+
+  std::vector<Node> nodes_;
+  uint32_t freeHead_ = kNil;
+  uint32_t heads_[kLists];  // lists: every slot of every wheel, overflow, run
+  uint32_t tails_[kLists];
+  uint64_t occupied_[kLevels][kSlots / 64] = {};
+  uint64_t current_;
+  size_t size_ = 0;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_TIMER_WHEEL_H
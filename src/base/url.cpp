@@ -0,0 +1,113 @@
+#include "base/url.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+
+namespace nvr {
+
+namespace {
+
+uint16_t defaultPort(const std::string& scheme) {
+  if (scheme == "rtsp") return 554;
+  if (scheme == "http") return 80;
+  if (scheme == "https") return 443;
+  return 0;
+}
+
+}  // namespace
+
+std::string Url::withoutCredentials() const {
+  std::string out = scheme + "://";
+  bool v6 = host.find(':') != std::string::npos;
+  out += v6 ? "[" + host + "]" : host;
+  if (port != defaultPort(scheme)) out += ":" + std::to_string(port);
+  out += path;
+  return out;
+}
+
+bool parseUrl(const std::string& text, Url* url) {
+  size_t schemeEnd = text.find("://");
+  if (schemeEnd == std::string::npos || schemeEnd == 0) return false;
+  url->scheme.clear();
+  for (size_t i = 0; i < schemeEnd; ++i) url->scheme.push_back(tolower(text[i]));
+
+  size_t authStart = schemeEnd + 3;
+  size_t pathStart = text.find_first_of("/?", authStart);
+  std::string authority = text.substr(authStart, pathStart == std::string::npos
+                                                     ? std::string::npos
+                                                     : pathStart - authStart);
+  url->path = pathStart == std::string::npos ? "/" : text.substr(pathStart);
+  if (url->path[0] == '?') url->path.insert(0, "/");
+
+  url->user.clear();
+  url->password.clear();
+  size_t at = authority.rfind('@');
+  if (at != std::string::npos) {
+    std::string cred = authority.substr(0, at);
+    authority = authority.substr(at + 1);
+    size_t colon = cred.find(':');
+    url->user = percentDecode(cred.substr(0, colon));
+    if (colon != std::string::npos) url->password = percentDecode(cred.substr(colon + 1));
+  }
+
+  std::string portText;
+  if (!authority.empty() && authority[0] == '[') {
+    size_t close = authority.find(']');
+    if (close == std::string::npos) return false;
+    url->host = authority.substr(1, close - 1);
+    if (close + 1 < authority.size()) {
+      if (authority[close + 1] != ':') return false;
+      portText = authority.substr(close + 2);
+    }
+  } else {
+    size_t colon = authority.rfind(':');
+    url->host = authority.substr(0, colon);
+    if (colon != std::string::npos) portText = authority.substr(colon + 1);
+  }
+  if (url->host.empty()) return false;
+
+  if (portText.empty()) {
+    url->port = defaultPort(url->scheme);
+  } else {
+    char* end = nullptr;
+    long port = strtol(portText.c_str(), &end, 10);
+    if (*end != '\0' || port <= 0 || port > 65535) return false;
+    url->port = static_cast<uint16_t>(port);
+  }
+  return url->port != 0;
+}
+
+std::string percentDecode(const std::string& s) {
+  std::string out;
+  out.reserve(s.size());
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '%' && i + 2 < s.size() && isxdigit(s[i + 1]) && isxdigit(s[i + 2])) {
+      out.push_back(static_cast<char>(strtol(s.substr(i + 1, 2).c_str(), nullptr, 16)));
+      i += 2;
+    } else {
+      out.push_back(s[i]);
+    }
+  }
+  return out;
+}
+
+std::string withCredentials(const std::string& uri, const std::string& user,
+                            const std::string& password) {
+  size_t scheme = uri.find("://");
+  if (user.empty() || scheme == std::string::npos) return uri;
+  size_t authority = scheme + 3;
+  size_t pathStart = uri.find('/', authority);
+  size_t at = uri.find('@', authority);
+  if (at != std::string::npos && (pathStart == std::string::npos || at < pathStart)) return uri;
+  std::string out = uri.substr(0, authority);
+  out += user;
+  if (!password.empty()) {
+    out += ':';
+    out += password;
+  }
+  out += '@';
+  out.append(uri, authority, std::string::npos);
+  return out;
+}
+
+}  // namespace nvr
@@ -0,0 +1,36 @@
+// Parser for rtsp:// and http:// URLs with optional credentials.
+
+#ifndef NVR_BASE_URL_H
+#define NVR_BASE_URL_H
+
+#include <stdint.h>
+
+#include <string>
+
+namespace nvr {
+
+struct Url {
+  std::string scheme;  // lowercase
+  std::string user;
+  std::string password;
+  std::string host;
+  uint16_t port = 0;   // scheme default when absent
+  std::string path;    // starts with '/', includes the query
+
+  // URL without credentials, as sent on the wire.
+  std::string withoutCredentials() const;
+};
+
+bool parseUrl(const std::string& text, Url* url);
+
+// Decodes %XX escapes (credentials in camera URLs are often escaped).
+std::string percentDecode(const std::string& s);
+
+// Adds credentials to a URL unless it already carries some. user and
+// password are taken as they appear in a URL, i.e. already percent-encoded.
+std::string withCredentials(const std::string& uri, const std::string& user,
+                            const std::string& password);
+
+}  // namespace nvr
+
+#endif  // NVR_BASE_URL_H
@@ -0,0 +1,70 @@
+#include "cluster/failure_detector.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+namespace nvr {
+
+PhiAccrualDetector::PhiAccrualDetector(const PhiAccrualOptions& options) : options_(options) {
+  if (options_.windowSize < 2) options_.windowSize = 2;
+}
+
+void PhiAccrualDetector::add(History* history, uint64_t interval) {
+  double value = static_cast<double>(interval);
+  if (history->intervals.size() < options_.windowSize) {
+    history->intervals.push_back(interval);
+  } else {
+    double old = static_cast<double>(history->intervals[history->next]);
+    history->sum -= old;
+    history->sumSquares -= old * old;
+    history->intervals[history->next] = interval;
+    history->next = (history->next + 1) % options_.windowSize;
+  }
+  history->sum += value;
+  history->sumSquares += value * value;
+}
+
+void PhiAccrualDetector::heartbeat(const std::string& nodeId, uint64_t nowMs) {
+  auto it = nodes_.find(nodeId);
+  if (it == nodes_.end()) {
+    History& history = nodes_[nodeId];
+    // Two synthetic samples give the first interval as the mean with a
+    // quarter of it as deviation until real samples take over.
+    uint64_t first = options_.firstIntervalMs;
+    add(&history, first - first / 4);
+    add(&history, first + first / 4);
+    history.lastMs = nowMs;
+    return;
+  }
+  History& history = it->second;
+  if (nowMs > history.lastMs) add(&history, nowMs - history.lastMs);
+  history.lastMs = std::max(history.lastMs, nowMs);
+}
+
+double PhiAccrualDetector::phi(const std::string& nodeId, uint64_t nowMs) const {
+  auto it = nodes_.find(nodeId);
+  if (it == nodes_.end()) return 0;
+  const History& history = it->second;
+  double n = static_cast<double>(history.intervals.size());
+  double mean = history.sum / n;
+  double variance = std::max(0.0, history.sumSquares / n - mean * mean);
+  double stdDev = std::max(sqrt(variance), static_cast<double>(options_.minStdDevMs));
+  mean += static_cast<double>(options_.acceptablePauseMs);
+  double elapsed = nowMs > history.lastMs ? static_cast<double>(nowMs - history.lastMs) : 0;
+
+  // Logistic approximation of the normal CDF, good to about 1e-4.
+  double y = (elapsed - mean) / stdDev;
+  double e = exp(-y * (1.5976 + 0.070566 * y * y));
+  if (elapsed > mean) return -log10(e / (1.0 + e));
+  return -log10(1.0 - 1.0 / (1.0 + e));
+}
+
+uint64_t PhiAccrualDetector::lastHeartbeatMs(const std::string& nodeId) const {
+  auto it = nodes_.find(nodeId);
+  return it == nodes_.end() ? 0 : it->second.lastMs;
+}
+
+void PhiAccrualDetector::remove(const std::string& nodeId) { nodes_.erase(nodeId); }
+
+}  // namespace nvr
@@ -0,0 +1,65 @@
+// Phi-accrual failure detector.
+//
+// Instead of a fixed timeout, the detector learns each node's heartbeat
+// inter-arrival times (mean and deviation over a sliding window) and turns
+// the time since the last heartbeat into phi = -log10(P(a heartbeat this
+// late)). phi 1 means a 10% chance that the node is still alive, 3 means
+// 0.1%, and so on. A threshold of 8 on a 100 ms heartbeat declares a steady
+// node dead in well under a second, while a node whose heartbeats are
+// already jittery is given proportionally longer. acceptablePauseMs widens
+// the distribution for known stalls (GC, disk flush).
+
+#ifndef NVR_CLUSTER_FAILURE_DETECTOR_H
+#define NVR_CLUSTER_FAILURE_DETECTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace nvr {
+
+struct PhiAccrualOptions {
+  double threshold = 8.0;
+  size_t windowSize = 200;          // inter-arrival samples kept per node
+  uint64_t minStdDevMs = 20;        // floor, so a perfectly regular node is not hair-trigger
+  uint64_t acceptablePauseMs = 0;   // added to the mean
+  uint64_t firstIntervalMs = 1000;  // assumed until real samples arrive
+};
+
+class PhiAccrualDetector {
+ public:
+  explicit PhiAccrualDetector(const PhiAccrualOptions& options = PhiAccrualOptions());
+
+  void heartbeat(const std::string& nodeId, uint64_t nowMs);
+  // 0 for a node never heard from.
+  double phi(const std::string& nodeId, uint64_t nowMs) const;
+  bool suspect(const std::string& nodeId, uint64_t nowMs) const {
+    return phi(nodeId, nowMs) >= options_.threshold;
+  }
+  // 0 for a node never heard from.
+  uint64_t lastHeartbeatMs(const std::string& nodeId) const;
+  void remove(const std::string& nodeId);
+
+  const PhiAccrualOptions& options() const { return options_; }
+
+ private:
+  struct History {
+    std::vector<uint64_t> intervals;  // ring of windowSize samples
+    size_t next = 0;
+    double sum = 0;
+    double sumSquares = 0;
+    uint64_t lastMs = 0;
+  };
+
+  void add(History* history, uint64_t interval);
+
+  PhiAccrualOptions options_;
+  std::map<std::string, History> nodes_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_CLUSTER_FAILURE_DETECTOR_H
@@ -0,0 +1,192 @@
+#include "cluster/heartbeat.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "base/clock.h"
+#include "base/log.h"
+
+namespace nvr {
+
+namespace {
+
+constexpr size_t kMaxNodeId = 255;
+
+}  // namespace
+
+HeartbeatSender::HeartbeatSender(EventLoop* loop, const SocketAddress& coordinator,
+                                 uint64_t intervalMs, StatusFn status)
+    : loop_(loop),
+      coordinator_(coordinator),
+      intervalMs_(intervalMs > 0 ? intervalMs : 1),
+      status_(std::move(status)),
+      incarnation_(static_cast<uint64_t>(wallClockUs())) {}
+
+HeartbeatSender::~HeartbeatSender() { stop(); }
+
+int HeartbeatSender::start() {
+  if (fd_ >= 0) return 0;
+  fd_ = socket(coordinator_.family(), SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) return -errno;
+  send();
+  timer_ = loop_->runEvery(intervalMs_, [this] { send(); });
+  return 0;
+}
+
+void HeartbeatSender::stop() {
+  if (fd_ < 0) return;
+  loop_->cancel(timer_);
+  ::close(fd_);
+  fd_ = -1;
+}
+
+void HeartbeatSender::send() {
+  if (fd_ < 0) return;
+  NodeStatus status = status_();
+  size_t idLength = std::min(status.id.size(), kMaxNodeId);
+  HeartbeatWire wire;
+  memset(&wire, 0, sizeof(wire));
+  wire.magic = kHeartbeatMagic;
+  wire.version = kHeartbeatVersion;
+  wire.idLength = static_cast<uint16_t>(idLength);
+  wire.incarnation = incarnation_;
+  wire.sequence = ++sequence_;
+  wire.diskBandwidthBps = status.diskBandwidthBps;
+  wire.freeBytes = status.freeBytes;
+  wire.recordedBps = status.recordedBps;
+  double cpu = status.cpuLoad < 0 ? 0 : (status.cpuLoad > 4000 ? 4000 : status.cpuLoad);
+  wire.cpuLoadPpm = static_cast<uint32_t>(cpu * 1e6);
+  char datagram[sizeof(HeartbeatWire) + kMaxNodeId];
+  memcpy(datagram, &wire, sizeof(wire));
+  memcpy(datagram + sizeof(wire), status.id.data(), idLength);
+  // A lost heartbeat is what the detector is for; no retry.
+  sendto(fd_, datagram, sizeof(wire) + idLength, MSG_DONTWAIT, coordinator_.get(),
+         coordinator_.length);
+}
+
+HeartbeatMonitor::HeartbeatMonitor(EventLoop* loop, const HeartbeatMonitorOptions& options,
+                                   StatusHandler onStatus, FailureHandler onFailure)
+    : loop_(loop),
+      options_(options),
+      onStatus_(std::move(onStatus)),
+      onFailure_(std::move(onFailure)),
+      detector_(options.detector) {}
+
+HeartbeatMonitor::~HeartbeatMonitor() { stop(); }
+
+int HeartbeatMonitor::start(uint16_t port) {
+  if (fd_ >= 0) return -EALREADY;
+  int fd = udpBind(AF_INET, port);
+  if (fd < 0) return fd;
+  SocketAddress local;
+  int err = localAddress(fd, &local);
+  if (err == 0) err = loop_->add(fd, EPOLLIN, this);
+  if (err < 0) {
+    ::close(fd);
+    return err;
+  }
+  fd_ = fd;
+  timer_ = loop_->runEvery(options_.checkIntervalMs, [this] { check(); });
+  return local.port();
+}
+
+void HeartbeatMonitor::stop() {
+  if (fd_ < 0) return;
+  loop_->cancel(timer_);
+  loop_->remove(fd_);
+  ::close(fd_);
+  fd_ = -1;
+}
+
+void HeartbeatMonitor::forget(const std::string& nodeId) {
+  peers_.erase(nodeId);
+  detector_.remove(nodeId);
+}
+
+double HeartbeatMonitor::phi(const std::string& nodeId) const {
+  return detector_.phi(nodeId, loop_->nowMs());
+}
+
+void HeartbeatMonitor::onEvents(uint32_t events) {
+  char datagram[sizeof(HeartbeatWire) + kMaxNodeId + 1];
+  for (int i = 0; i < 256 && fd_ >= 0; ++i) {
+    ssize_t n = recv(fd_, datagram, sizeof(datagram), MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    HeartbeatWire wire;
+    if (static_cast<size_t>(n) < sizeof(wire)) {
+      ++malformed_;
+      continue;
+    }
+    memcpy(&wire, datagram, sizeof(wire));
+    if (wire.magic != kHeartbeatMagic || wire.version != kHeartbeatVersion ||
+        wire.idLength == 0 || static_cast<size_t>(n) != sizeof(wire) + wire.idLength) {
+      ++malformed_;
+      continue;
+    }
+    ++received_;
+    onHeartbeat(wire, std::string(datagram + sizeof(wire), wire.idLength));
+  }
+}
+
+void HeartbeatMonitor::onHeartbeat(const HeartbeatWire& wire, const std::string& nodeId) {
+  uint64_t now = loop_->nowMs();
+  auto it = peers_.find(nodeId);
+  bool joined = it == peers_.end();
+  if (!joined) {
+    Peer& peer = it->second;
+    if (wire.incarnation == peer.incarnation && wire.sequence <= peer.sequence) return;
+    if (wire.incarnation < peer.incarnation) return;
+    bool restarted = wire.incarnation != peer.incarnation && !peer.failed;
+    joined = restarted || peer.failed;
+    if (restarted) {
+      // Restarted faster than the detector noticed: the old instance and
+      // everything it recorded are gone all the same.
+      NVR_WARN("cluster: node %s restarted", nodeId.c_str());
+      peer.failed = true;
+      onFailure_(nodeId, detector_.lastHeartbeatMs(nodeId));
+    }
+    if (joined) detector_.remove(nodeId);
+  }
+  Peer& peer = peers_[nodeId];
+  peer.incarnation = wire.incarnation;
+  peer.sequence = wire.sequence;
+  peer.failed = false;
+  detector_.heartbeat(nodeId, now);
+
+  NodeStatus status;
+  status.id = nodeId;
+  status.diskBandwidthBps = wire.diskBandwidthBps;
+  status.freeBytes = wire.freeBytes;
+  status.recordedBps = wire.recordedBps;
+  status.cpuLoad = wire.cpuLoadPpm / 1e6;
+  if (joined) NVR_INFO("cluster: node %s joined", nodeId.c_str());
+  onStatus_(status, joined);
+}
+
+void HeartbeatMonitor::check() {
+  uint64_t now = loop_->nowMs();
+  std::vector<std::pair<std::string, uint64_t>> failed;
+  for (auto& kv : peers_) {
+    Peer& peer = kv.second;
+    if (peer.failed) continue;
+    double phi = detector_.phi(kv.first, now);
+    if (phi < options_.detector.threshold) continue;
+    peer.failed = true;
+    uint64_t lastSeen = detector_.lastHeartbeatMs(kv.first);
+    NVR_WARN("cluster: node %s failed, silent for %llu ms (phi %.1f)", kv.first.c_str(),
+             static_cast<unsigned long long>(now - lastSeen), phi);
+    failed.emplace_back(kv.first, lastSeen);
+  }
+  // After the walk: the handler may forget() nodes.
+  for (const auto& entry : failed) onFailure_(entry.first, entry.second);
+}
+
+}  // namespace nvr
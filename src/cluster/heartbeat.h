@@ -0,0 +1,131 @@
+// Node heartbeats over UDP.
+//
+// Every node sends the coordinator one datagram per interval carrying its
+// NodeStatus, so the heartbeat doubles as the load report placement needs.
+// The coordinator's HeartbeatMonitor feeds arrivals to a phi-accrual
+// detector and checks every node on a short timer. A node is reported
+// failed once, with the time of its last heartbeat, the last moment it was
+// known to be recording. A failed node that speaks again, or a node that
+// restarted (new incarnation, after reporting the old one failed), is
+// reported as joining afresh.
+
+#ifndef NVR_CLUSTER_HEARTBEAT_H
+#define NVR_CLUSTER_HEARTBEAT_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <string>
+
+#include "base/event_loop.h"
+#include "base/socket_util.h"
+#include "cluster/failure_detector.h"
+#include "cluster/placement.h"
+
+namespace nvr {
+
+struct HeartbeatWire {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t idLength;  // node id bytes following the struct
+  uint64_t incarnation;
+  uint64_t sequence;
+  uint64_t diskBandwidthBps;
+  uint64_t freeBytes;
+  uint64_t recordedBps;
+  uint32_t cpuLoadPpm;  // cpuLoad * 1e6
+  uint32_t reserved;
+};
+static_assert(sizeof(HeartbeatWire) == 56, "HeartbeatWire layout");
+
+constexpr uint32_t kHeartbeatMagic = 0x4e564842;  // "NVHB"
+constexpr uint16_t kHeartbeatVersion = 1;
+
+class HeartbeatSender {
+ public:
+  using StatusFn = std::function<NodeStatus()>;
+
+  // status() is called on the loop thread before every heartbeat.
+  HeartbeatSender(EventLoop* loop, const SocketAddress& coordinator, uint64_t intervalMs,
+                  StatusFn status);
+  ~HeartbeatSender();
+
+  HeartbeatSender(const HeartbeatSender&) = delete;
+  HeartbeatSender& operator=(const HeartbeatSender&) = delete;
+
+  // One incarnation per sender: stop() and start() again look like a
+  // stalled node to the monitor, not a restarted one.
+  int start();
+  void stop();
+  // Sends one heartbeat now, outside the schedule.
+  void send();
+
+ private:
+  EventLoop* loop_;
+  SocketAddress coordinator_;
+  const uint64_t intervalMs_;
+  StatusFn status_;
+  int fd_ = -1;
+  EventLoop::TimerId timer_ = 0;
+  const uint64_t incarnation_;
+  uint64_t sequence_ = 0;
+};
+
+struct HeartbeatMonitorOptions {
+  PhiAccrualOptions detector;
+  uint64_t checkIntervalMs = 20;
+};
+
+class HeartbeatMonitor : public EventHandler {
+ public:
+  // Every heartbeat. joined is set for the first one from a node, a node
+  // that restarted, and a node that was reported failed.
+  using StatusHandler = std::function<void(const NodeStatus& status, bool joined)>;
+  using FailureHandler = std::function<void(const std::string& nodeId, uint64_t lastSeenMs)>;
+
+  HeartbeatMonitor(EventLoop* loop, const HeartbeatMonitorOptions& options, StatusHandler onStatus,
+                   FailureHandler onFailure);
+  ~HeartbeatMonitor() override;
+
+  HeartbeatMonitor(const HeartbeatMonitor&) = delete;
+  HeartbeatMonitor& operator=(const HeartbeatMonitor&) = delete;
+
+  // Binds the UDP port (0 picks one). Returns the port or -errno.
+  int start(uint16_t port);
+  void stop();
+
+  // Stops watching a node that left on purpose.
+  void forget(const std::string& nodeId);
+  double phi(const std::string& nodeId) const;
+
+  uint64_t received() const { return received_; }
+  uint64_t malformed() const { return malformed_; }
+
+  void onEvents(uint32_t events) override;
+
+ private:
+  struct Peer {
+    uint64_t incarnation = 0;
+    uint64_t sequence = 0;
+    bool failed = false;
+  };
+
+  void onHeartbeat(const HeartbeatWire& wire, const std::string& nodeId);
+  void check();
+
+  EventLoop* loop_;
+  HeartbeatMonitorOptions options_;
+  StatusHandler onStatus_;
+  FailureHandler onFailure_;
+  PhiAccrualDetector detector_;
+  std::map<std::string, Peer> peers_;
+  int fd_ = -1;
+  EventLoop::TimerId timer_ = 0;
+  uint64_t received_ = 0;
+  uint64_t malformed_ = 0;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_CLUSTER_HEARTBEAT_H
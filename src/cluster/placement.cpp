@@ -0,0 +1,479 @@
+#include "cluster/placement.h"
+
+#include <algorithm>
+#include <functional>
+
+#include "base/hash.h"
+#include "base/log.h"
+
+namespace nvr {
+
+PlacementScheduler::PlacementScheduler(const PlacementOptions& options) : options_(options) {
+  if (options_.virtualNodes < 1) options_.virtualNodes = 1;
+}
+
+uint64_t PlacementScheduler::capacityOf(const NodeStatus& status) const {
+  if (status.freeBytes < options_.minFreeBytes) return 0;
+  double capacity = static_cast<double>(status.diskBandwidthBps) * options_.maxDiskUtilization;
+  // CPU cost per recorded bit, as last measured; the node's other work is
+  // charged to recording, which errs on the safe side.
+  if (status.cpuLoad > 0.01 && status.recordedBps > 0)
+    capacity = std::min(capacity, static_cast<double>(status.recordedBps) * options_.maxCpu /
+                                      status.cpuLoad);
+  return static_cast<uint64_t>(capacity);
+}
+
+void PlacementScheduler::addNode(const NodeStatus& status, NodeAgent* agent) {
+  Node& node = nodes_[status.id];
+  node.status = status;
+  node.agent = agent;
+  node.draining = false;
+  node.capacity = capacityOf(status);
+  ringDirty_ = true;
+  NVR_INFO("placement: node %s joined, capacity %.1f Mbit/s", status.id.c_str(),
+           node.capacity / 1e6);
+}
+
+void PlacementScheduler::updateNode(const NodeStatus& status) {
+  auto it = nodes_.find(status.id);
+  if (it == nodes_.end()) return;
+  it->second.status = status;
+  it->second.capacity = capacityOf(status);
+}
+
+void PlacementScheduler::drainNode(const std::string& nodeId) {
+  auto it = nodes_.find(nodeId);
+  if (it == nodes_.end() || it->second.draining) return;
+  it->second.draining = true;
+  NVR_INFO("placement: draining node %s", nodeId.c_str());
+}
+
+bool PlacementScheduler::drained(const std::string& nodeId) const {
+  auto it = nodes_.find(nodeId);
+  if (it == nodes_.end()) return true;
+  if (!it->second.draining) return false;
+  for (const auto& kv : cameras_) {
+    const Camera& camera = kv.second;
+    if (camera.owner == nodeId || camera.target == nodeId || camera.standby == nodeId)
+      return false;
+  }
+  return true;
+}
+
+void PlacementScheduler::removeNode(const std::string& nodeId, uint64_t lastSeenMs) {
+  auto it = nodes_.find(nodeId);
+  if (it == nodes_.end()) return;
+  size_t lost = 0;
+  size_t promoted = 0;
+  for (auto& kv : cameras_) {
+    Camera& camera = kv.second;
+    if (camera.standby == nodeId) {
+      camera.standby.clear();
+      camera.standbyLive = false;
+    }
+    if (camera.target == nodeId) camera.target.clear();
+    if (camera.owner != nodeId) continue;
+    camera.owner.clear();
+    camera.lostFrom = nodeId;
+    camera.lostMs = lastSeenMs;
+    ++stats_.failovers;
+    if (camera.standbyLive) {
+      camera.owner = camera.standby;
+      camera.standby.clear();
+      camera.standbyLive = false;
+      ++stats_.standbyFailovers;
+      ++promoted;
+      reportFailover(kv.first, &camera, lastSeenMs, true);
+      continue;
+    }
+    // A standby still starting is as good as a handover target.
+    if (camera.target.empty() && !camera.standby.empty()) {
+      camera.target = camera.standby;
+      camera.standby.clear();
+    }
+    ++lost;
+  }
+  nodes_.erase(it);
+  ringDirty_ = true;
+  NVR_INFO("placement: node %s left, %zu camera(s) to re-place, %zu standby(s) promoted",
+           nodeId.c_str(), lost, promoted);
+}
+
+void PlacementScheduler::addCamera(const std::string& cameraId, uint64_t bitrateBps,
+                                   bool standby) {
+  Camera& camera = cameras_[cameraId];
+  camera.hash = mix64(fnv1a64(cameraId));
+  camera.bitrate = bitrateBps;
+  camera.wantStandby = standby;
+}
+
+void PlacementScheduler::setStandby(const std::string& cameraId, bool standby) {
+  auto it = cameras_.find(cameraId);
+  if (it == cameras_.end()) return;
+  it->second.wantStandby = standby;
+  if (!standby) dropStandby(cameraId, &it->second);
+}
+
+void PlacementScheduler::updateCamera(const std::string& cameraId, uint64_t bitrateBps) {
+  auto it = cameras_.find(cameraId);
+  if (it != cameras_.end()) it->second.bitrate = bitrateBps;
+}
+
+void PlacementScheduler::removeCamera(const std::string& cameraId) {
+  auto it = cameras_.find(cameraId);
+  if (it == cameras_.end()) return;
+  Camera& camera = it->second;
+  for (const std::string* nodeId : {&camera.owner, &camera.target, &camera.standby}) {
+    auto node = nodes_.find(*nodeId);
+    if (node != nodes_.end()) node->second.agent->stopRecording(cameraId);
+  }
+  cameras_.erase(it);
+}
+
+void PlacementScheduler::onRecording(const std::string& nodeId, const std::string& cameraId,
+                                     uint64_t nowMs) {
+  auto node = nodes_.find(nodeId);
+  if (node == nodes_.end()) return;
+  auto it = cameras_.find(cameraId);
+  if (it == cameras_.end()) {
+    node->second.agent->stopRecording(cameraId);
+    return;
+  }
+  Camera& camera = it->second;
+  if (camera.standby == nodeId) {
+    camera.standbyLive = true;
+    return;
+  }
+  if (camera.target != nodeId) {
+    if (camera.owner.empty() && accepting(node->second)) {
+      // Nobody else records it yet: most likely the node was declared
+      // failed but lived on. Adopted; a pending target still takes over.
+      camera.owner = nodeId;
+      if (!camera.lostFrom.empty()) reportFailover(cameraId, &camera, nowMs, false);
+      return;
+    }
+    // A handover abandoned while the node was starting.
+    if (camera.owner != nodeId) node->second.agent->stopRecording(cameraId);
+    return;
+  }
+  if (!camera.owner.empty()) {
+    auto old = nodes_.find(camera.owner);
+    if (old != nodes_.end()) old->second.agent->stopRecording(cameraId);
+    ++stats_.movesCompleted;
+  }
+  camera.owner = nodeId;
+  camera.target.clear();
+  if (!camera.lostFrom.empty()) reportFailover(cameraId, &camera, nowMs, false);
+}
+
+void PlacementScheduler::reportFailover(const std::string& cameraId, Camera* camera,
+                                        uint64_t nowMs, bool standby) {
+  FailoverReport report;
+  report.cameraId = cameraId;
+  report.fromNode = camera->lostFrom;
+  report.toNode = camera->owner;
+  report.standby = standby;
+  report.lostMs = camera->lostMs;
+  report.recoveredMs = std::max(nowMs, camera->lostMs);
+  camera->lostFrom.clear();
+  stats_.maxGapMs = std::max(stats_.maxGapMs, report.gapMs());
+  NVR_DEBUG("placement: %s failed over %s -> %s, gap %llu ms%s", cameraId.c_str(),
+            report.fromNode.c_str(), report.toNode.c_str(),
+            static_cast<unsigned long long>(report.gapMs()), standby ? " (standby)" : "");
+  if (onFailover_) onFailover_(report);
+}
+
+void PlacementScheduler::rebuildRing() {
+  ring_.clear();
+  ring_.reserve(nodes_.size() * static_cast<size_t>(options_.virtualNodes));
+  for (auto& kv : nodes_) {
+    uint64_t h = fnv1a64(kv.first);
+    for (int i = 0; i < options_.virtualNodes; ++i)
+      ring_.emplace_back(mix64(h + static_cast<uint64_t>(i)), &kv.second);
+  }
+  std::sort(ring_.begin(), ring_.end(),
+            [](const std::pair<uint64_t, Node*>& a, const std::pair<uint64_t, Node*>& b) {
+              return a.first < b.first;
+            });
+  ringDirty_ = false;
+}
+
+void PlacementScheduler::computeBounds() {
+  uint64_t demand = 0;
+  for (const auto& kv : cameras_)
+    demand += kv.second.bitrate * (kv.second.wantStandby ? 2 : 1);
+  double capacity = 0;
+  for (auto& kv : nodes_) {
+    kv.second.load = 0;
+    if (accepting(kv.second)) capacity += static_cast<double>(kv.second.capacity);
+  }
+  for (auto& kv : nodes_) {
+    Node& node = kv.second;
+    node.bound = 0;
+    if (!accepting(node) || capacity <= 0) continue;
+    double share = static_cast<double>(demand) * static_cast<double>(node.capacity) / capacity;
+    node.bound = std::min(node.capacity, static_cast<uint64_t>(share * (1 + options_.epsilon)));
+  }
+  // A camera weighs on the node it is headed for, and on its standby's.
+  for (auto& kv : cameras_) {
+    Camera& camera = kv.second;
+    if (Node* node = primary(camera)) node->load += camera.bitrate;
+    auto standby = nodes_.find(camera.standby);
+    if (standby != nodes_.end()) standby->second.load += camera.bitrate;
+  }
+}
+
+PlacementScheduler::Node* PlacementScheduler::primary(const Camera& camera) {
+  auto it = nodes_.find(camera.target.empty() ? camera.owner : camera.target);
+  return it == nodes_.end() ? nullptr : &it->second;
+}
+
+void PlacementScheduler::walk(uint64_t hash, std::vector<Node*>* out, const Node* until) {
+  out->clear();
+  if (ring_.empty()) return;
+  ++walks_;
+  auto start = std::lower_bound(
+      ring_.begin(), ring_.end(), hash,
+      [](const std::pair<uint64_t, Node*>& point, uint64_t h) { return point.first < h; });
+  size_t first = static_cast<size_t>(start - ring_.begin());
+  for (size_t i = 0; i < ring_.size() && out->size() < nodes_.size(); ++i) {
+    size_t at = first + i;
+    Node* node = ring_[at < ring_.size() ? at : at - ring_.size()].second;
+    if (node == until) return;
+    if (node->walked == walks_) continue;
+    node->walked = walks_;
+    out->push_back(node);
+  }
+}
+
+PlacementScheduler::Node* PlacementScheduler::choose(const Camera& camera, bool* overcommitted,
+                                                     const Node* exclude) {
+  std::vector<Node*> order;
+  walk(camera.hash, &order);
+  Node* best = nullptr;
+  double bestUtilization = 0;
+  for (Node* node : order) {
+    if (!accepting(*node) || node == exclude) continue;
+    if (node->load + camera.bitrate <= node->bound) {
+      *overcommitted = false;
+      return node;
+    }
+    double utilization = static_cast<double>(node->load + camera.bitrate) /
+                         static_cast<double>(node->capacity);
+    if (!best || utilization < bestUtilization) {
+      best = node;
+      bestUtilization = utilization;
+    }
+  }
+  *overcommitted = best != nullptr;
+  return best;
+}
+
+void PlacementScheduler::startMove(const std::string& cameraId, Camera* camera, Node* node) {
+  if (Node* old = primary(*camera)) old->load -= std::min(old->load, camera->bitrate);
+  node->load += camera->bitrate;
+  camera->target = node->status.id;
+  if (!camera->owner.empty()) ++stats_.movesStarted;
+  node->agent->startRecording(cameraId);
+}
+
+void PlacementScheduler::startStandby(const std::string& cameraId, Camera* camera, Node* node) {
+  node->load += camera->bitrate;
+  camera->standby = node->status.id;
+  camera->standbyLive = false;
+  node->agent->startRecording(cameraId);
+}
+
+bool PlacementScheduler::overloaded(const Node& node) const {
+  double limit = std::min(static_cast<double>(node.bound) * (1 + options_.hysteresis),
+                          static_cast<double>(node.capacity));
+  return static_cast<double>(node.load) > limit;
+}
+
+bool PlacementScheduler::roomFor(const Node& node, uint64_t bitrate) const {
+  return accepting(node) && static_cast<double>(node.load + bitrate) <=
+                                static_cast<double>(node.bound) / (1 + options_.hysteresis);
+}
+
+void PlacementScheduler::dropStandby(const std::string& cameraId, Camera* camera) {
+  auto it = nodes_.find(camera->standby);
+  if (it != nodes_.end()) {
+    it->second.load -= std::min(it->second.load, camera->bitrate);
+    it->second.agent->stopRecording(cameraId);
+  }
+  camera->standby.clear();
+  camera->standbyLive = false;
+}
+
+size_t PlacementScheduler::rebalance() {
+  if (ringDirty_) rebuildRing();
+  computeBounds();
+  size_t starts = 0;
+  size_t moves = 0;
+  stats_.overcommitted = 0;
+
+  // Cameras nobody records or is starting: always placed.
+  for (auto& kv : cameras_) {
+    Camera& camera = kv.second;
+    if (!camera.owner.empty() || !camera.target.empty()) continue;
+    auto standby = nodes_.find(camera.standby);
+    bool over = false;
+    Node* node = choose(camera, &over, standby == nodes_.end() ? nullptr : &standby->second);
+    if (!node) break;
+    if (over) ++stats_.overcommitted;
+    startMove(kv.first, &camera, node);
+    ++starts;
+  }
+
+  // Standbys likewise, on any node but the primary's, once a handover has
+  // settled (the old owner is not a candidate either). Those on draining
+  // nodes are simply replaced once the primary records and covers the
+  // switch.
+  for (auto& kv : cameras_) {
+    Camera& camera = kv.second;
+    if (!camera.wantStandby && camera.standby.empty()) continue;
+    auto standby = nodes_.find(camera.standby);
+    if (standby != nodes_.end() && standby->second.draining && !camera.owner.empty())
+      dropStandby(kv.first, &camera);
+    Node* node = primary(camera);
+    bool handover = !camera.owner.empty() && !camera.target.empty();
+    if (!camera.wantStandby || !camera.standby.empty() || !node || handover) continue;
+    bool over = false;
+    Node* target = choose(camera, &over, node);
+    if (!target) continue;
+    if (over) ++stats_.overcommitted;
+    startStandby(kv.first, &camera, target);
+    ++starts;
+  }
+
+  // Moves, up to the round's cap: off draining nodes, off nodes over their
+  // bound, then back to nodes earlier on the camera's walk that have room.
+  // Never onto the camera's standby.
+  std::vector<Node*> order;
+  for (auto& kv : cameras_) {
+    if (moves >= options_.maxMovesPerRound) break;
+    Camera& camera = kv.second;
+    if (!camera.target.empty()) continue;
+    auto owner = nodes_.find(camera.owner);
+    if (owner == nodes_.end() || !owner->second.draining) continue;
+    auto standby = nodes_.find(camera.standby);
+    bool over = false;
+    Node* node = choose(camera, &over, standby == nodes_.end() ? nullptr : &standby->second);
+    if (!node) break;
+    if (over) ++stats_.overcommitted;
+    startMove(kv.first, &camera, node);
+    ++starts;
+    ++moves;
+  }
+
+  for (auto& nodeKv : nodes_) {
+    Node& node = nodeKv.second;
+    if (moves >= options_.maxMovesPerRound) break;
+    if (!accepting(node) || !overloaded(node)) continue;
+    // Evict the cameras that were placed here as overflow first: those
+    // for which this node comes latest on their walk.
+    std::vector<std::pair<size_t, std::string>> owned;
+    for (auto& kv : cameras_) {
+      if (kv.second.owner != nodeKv.first || !kv.second.target.empty()) continue;
+      walk(kv.second.hash, &order, &node);
+      owned.emplace_back(order.size(), kv.first);
+    }
+    std::sort(owned.begin(), owned.end(), std::greater<std::pair<size_t, std::string>>());
+    for (const auto& entry : owned) {
+      if (node.load <= node.bound || moves >= options_.maxMovesPerRound) break;
+      Camera& camera = cameras_[entry.second];
+      auto standby = nodes_.find(camera.standby);
+      // Not back onto this node: it only has room for what stays.
+      uint64_t bound = node.bound;
+      node.bound = 0;
+      bool over = false;
+      Node* target =
+          choose(camera, &over, standby == nodes_.end() ? nullptr : &standby->second);
+      node.bound = bound;
+      if (!target || target == &node || over) continue;
+      startMove(entry.second, &camera, target);
+      ++starts;
+      ++moves;
+    }
+  }
+
+  for (auto& kv : cameras_) {
+    if (moves >= options_.maxMovesPerRound) break;
+    Camera& camera = kv.second;
+    if (!camera.target.empty() || camera.owner.empty()) continue;
+    walk(camera.hash, &order, &nodes_.find(camera.owner)->second);
+    for (Node* node : order) {
+      // Room with margin, so bitrate jitter does not bounce the camera.
+      if (node->status.id == camera.standby || !roomFor(*node, camera.bitrate)) continue;
+      startMove(kv.first, &camera, node);
+      ++starts;
+      ++moves;
+      break;
+    }
+  }
+
+  // Standbys follow the same walk, minus the primary's node. A standby is
+  // moved by dropping it and starting afresh, only while the primary
+  // records.
+  for (auto& kv : cameras_) {
+    if (moves >= options_.maxMovesPerRound) break;
+    Camera& camera = kv.second;
+    if (!camera.standbyLive || camera.owner.empty() || !camera.target.empty()) continue;
+    Node* standby = &nodes_.find(camera.standby)->second;
+    Node* node = primary(camera);
+    walk(camera.hash, &order, overloaded(*standby) ? nullptr : standby);
+    for (Node* candidate : order) {
+      if (candidate == node || candidate == standby || !roomFor(*candidate, camera.bitrate))
+        continue;
+      dropStandby(kv.first, &camera);
+      startStandby(kv.first, &camera, candidate);
+      ++starts;
+      ++moves;
+      break;
+    }
+  }
+  return starts;
+}
+
+const std::string* PlacementScheduler::ownerOf(const std::string& cameraId) const {
+  auto it = cameras_.find(cameraId);
+  if (it == cameras_.end() || it->second.owner.empty()) return nullptr;
+  return &it->second.owner;
+}
+
+const std::string* PlacementScheduler::targetOf(const std::string& cameraId) const {
+  auto it = cameras_.find(cameraId);
+  if (it == cameras_.end() || it->second.target.empty()) return nullptr;
+  return &it->second.target;
+}
+
+const std::string* PlacementScheduler::standbyOf(const std::string& cameraId) const {
+  auto it = cameras_.find(cameraId);
+  if (it == cameras_.end() || it->second.standby.empty()) return nullptr;
+  return &it->second.standby;
+}
+
+PlacementStats PlacementScheduler::stats() const {
+  PlacementStats stats = stats_;
+  stats.cameras = cameras_.size();
+  stats.nodes = nodes_.size();
+  std::map<std::string, uint64_t> load;
+  for (const auto& kv : cameras_) {
+    const Camera& camera = kv.second;
+    if (camera.owner.empty() && !camera.target.empty()) ++stats.starting;
+    if (!camera.owner.empty() && !camera.target.empty()) ++stats.handovers;
+    if (camera.owner.empty() && camera.target.empty()) ++stats.unplaced;
+    load[camera.target.empty() ? camera.owner : camera.target] += camera.bitrate;
+    if (!camera.standby.empty()) load[camera.standby] += camera.bitrate;
+    if (camera.standbyLive) ++stats.standbys;
+  }
+  for (const auto& kv : nodes_) {
+    if (kv.second.capacity == 0) continue;
+    double utilization =
+        static_cast<double>(load[kv.first]) / static_cast<double>(kv.second.capacity);
+    stats.maxUtilization = std::max(stats.maxUtilization, utilization);
+  }
+  return stats;
+}
+
+}  // namespace nvr
@@ -0,0 +1,200 @@
+// Camera placement across the recording nodes of a cluster.
+//
+// Cameras go to nodes by consistent hashing with bounded loads: each node
+// has virtual points on a hash ring, and a camera walks the ring from its
+// own hash to the first node whose load would stay within its bound. A
+// node's load is the live bitrate of the cameras it records. Its bound is
+// its share of the cluster's total bitrate, by capacity, plus headroom
+// (1 + epsilon), and never more than its capacity. Capacity comes from the
+// node's live report: disk write bandwidth, the bitrate its CPU can carry
+// at the measured cost per bit, and nothing once its free space falls
+// below the floor.
+//
+// Rebalancing is incremental. Cameras move only when their node fails or
+// drains, when their node is over its bound by more than the hysteresis,
+// or when a node earlier on their ring walk has room (a joined node takes
+// its arcs back). A round's moves are capped. Moves are make-before-break:
+// the target node starts recording and confirms with onRecording(). Only
+// then is the old node told to stop, so a handover never leaves a camera
+// unrecorded. Only a node failure can.
+//
+// Critical cameras can have a hot standby: a second node, never the
+// primary's, records them too. When the primary fails the standby is
+// promoted on the spot and a new standby is placed, so the failover costs
+// no recording at all. Every failover is reported with its gap: from the
+// failed node's last heartbeat to the moment the new node confirmed.
+//
+// Loop-thread only. Nodes are driven through NodeAgent, implemented by the
+// cluster transport for remote nodes and by SimulatedNode in-process.
+
+#ifndef NVR_CLUSTER_PLACEMENT_H
+#define NVR_CLUSTER_PLACEMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace nvr {
+
+// A node's periodic report.
+struct NodeStatus {
+  std::string id;
+  uint64_t diskBandwidthBps = 0;  // sustained recording write bandwidth
+  uint64_t freeBytes = 0;
+  double cpuLoad = 0;             // busy fraction of the node's cores
+  uint64_t recordedBps = 0;       // bitrate recorded when cpuLoad was taken
+};
+
+// Commands to one node. Both are idempotent.
+class NodeAgent {
+ public:
+  virtual ~NodeAgent() = default;
+  virtual void startRecording(const std::string& cameraId) = 0;
+  virtual void stopRecording(const std::string& cameraId) = 0;
+};
+
+struct PlacementOptions {
+  int virtualNodes = 128;           // ring points per node
+  double epsilon = 0.25;            // bound = (1 + epsilon) * fair share
+  double hysteresis = 0.1;          // evict only above bound * (1 + hysteresis)
+  double maxDiskUtilization = 0.8;  // of diskBandwidthBps
+  double maxCpu = 0.85;             // CPU load a node may be driven to
+  uint64_t minFreeBytes = 1ull << 30;
+  size_t maxMovesPerRound = 256;    // not counting cameras left without a node
+};
+
+struct FailoverReport {
+  std::string cameraId;
+  std::string fromNode;
+  std::string toNode;
+  bool standby = false;      // a hot standby was promoted
+  uint64_t lostMs = 0;       // the failed node's last sign of life
+  uint64_t recoveredMs = 0;  // toNode confirmed recording
+  uint64_t gapMs() const { return recoveredMs - lostMs; }
+};
+
+struct PlacementStats {
+  size_t cameras = 0;
+  size_t nodes = 0;
+  size_t starting = 0;     // first placements waiting for the node to confirm
+  size_t handovers = 0;    // moves waiting for the target to confirm
+  size_t unplaced = 0;     // cameras no node records or is starting
+  size_t overcommitted = 0;  // placed beyond every node's bound
+  size_t standbys = 0;     // hot standbys recording
+  uint64_t movesStarted = 0;
+  uint64_t movesCompleted = 0;
+  uint64_t failovers = 0;  // cameras whose recording node failed
+  uint64_t standbyFailovers = 0;  // of which a standby took over
+  uint64_t maxGapMs = 0;   // worst failover gap
+  double maxUtilization = 0;  // highest load / capacity
+};
+
+class PlacementScheduler {
+ public:
+  using FailoverHandler = std::function<void(const FailoverReport& report)>;
+
+  explicit PlacementScheduler(const PlacementOptions& options = PlacementOptions());
+
+  PlacementScheduler(const PlacementScheduler&) = delete;
+  PlacementScheduler& operator=(const PlacementScheduler&) = delete;
+
+  // The agent must outlive the node's membership.
+  void addNode(const NodeStatus& status, NodeAgent* agent);
+  void updateNode(const NodeStatus& status);
+  // Planned leave: the node's cameras move off make-before-break, and it
+  // takes no new ones. drained() tells when it can go.
+  void drainNode(const std::string& nodeId);
+  bool drained(const std::string& nodeId) const;
+  // The node is gone (failed, or drained): its cameras are re-placed and
+  // handovers to it are abandoned. lastSeenMs is when it was last known to
+  // be recording; failover gaps are measured from it.
+  void removeNode(const std::string& nodeId, uint64_t lastSeenMs);
+
+  // standby: keep a hot standby recording the camera on a second node.
+  void addCamera(const std::string& cameraId, uint64_t bitrateBps, bool standby = false);
+  void setStandby(const std::string& cameraId, bool standby);
+  // Live bitrate; takes effect at the next rebalance().
+  void updateCamera(const std::string& cameraId, uint64_t bitrateBps);
+  void removeCamera(const std::string& cameraId);
+
+  // nodeId has started recording cameraId; nowMs on the clock removeNode()
+  // is given. A node confirming a camera that has no owner adopts it (a
+  // node back after being declared failed reconfirms what it records). One
+  // confirming a camera recorded elsewhere is told to stop.
+  void onRecording(const std::string& nodeId, const std::string& cameraId, uint64_t nowMs);
+
+  void setFailoverHandler(FailoverHandler handler) { onFailover_ = std::move(handler); }
+
+  // Places unplaced cameras and starts the moves the current loads call
+  // for. Returns the number of start commands issued.
+  size_t rebalance();
+
+  // The node recording the camera (the old one during a handover), or
+  // null.
+  const std::string* ownerOf(const std::string& cameraId) const;
+  // The node a handover or first placement is waiting on, or null.
+  const std::string* targetOf(const std::string& cameraId) const;
+  // The hot standby, recording or starting, or null.
+  const std::string* standbyOf(const std::string& cameraId) const;
+  PlacementStats stats() const;
+
+ private:
+  struct Node {
+    NodeStatus status;
+    NodeAgent* agent = nullptr;
+    bool draining = false;
+    uint64_t capacity = 0;  // bps, from the last report
+    uint64_t bound = 0;     // for the current round
+    uint64_t load = 0;      // owned plus incoming cameras
+    uint64_t walked = 0;    // last walk that reached the node
+  };
+  struct Camera {
+    uint64_t hash = 0;
+    uint64_t bitrate = 0;
+    std::string owner;   // confirmed recording
+    std::string target;  // asked to start, not yet confirmed
+    bool wantStandby = false;
+    std::string standby;
+    bool standbyLive = false;  // confirmed
+    std::string lostFrom;      // failed owner, until the camera is recorded again
+    uint64_t lostMs = 0;
+  };
+
+  uint64_t capacityOf(const NodeStatus& status) const;
+  void rebuildRing();
+  void computeBounds();
+  // Nodes in ring order from the camera's hash, each once, up to but not
+  // including `until`.
+  void walk(uint64_t hash, std::vector<Node*>* out, const Node* until = nullptr);
+  // The first node on the walk with room, else the least utilized; null if
+  // no node takes cameras.
+  Node* choose(const Camera& camera, bool* overcommitted, const Node* exclude = nullptr);
+  void startMove(const std::string& cameraId, Camera* camera, Node* node);
+  void startStandby(const std::string& cameraId, Camera* camera, Node* node);
+  void dropStandby(const std::string& cameraId, Camera* camera);
+  // Over the bound by the hysteresis, or over capacity at all.
+  bool overloaded(const Node& node) const;
+  // Room for the bitrate with the hysteresis to spare.
+  bool roomFor(const Node& node, uint64_t bitrate) const;
+  // The node the camera counts on: its target, else its owner.
+  Node* primary(const Camera& camera);
+  void reportFailover(const std::string& cameraId, Camera* camera, uint64_t nowMs, bool standby);
+  bool accepting(const Node& node) const { return !node.draining && node.capacity > 0; }
+
+  PlacementOptions options_;
+  std::map<std::string, Node> nodes_;
+  std::map<std::string, Camera> cameras_;
+  std::vector<std::pair<uint64_t, Node*>> ring_;
+  bool ringDirty_ = false;
+  uint64_t walks_ = 0;
+  PlacementStats stats_;
+  FailoverHandler onFailover_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_CLUSTER_PLACEMENT_H
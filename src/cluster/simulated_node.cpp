@@ -0,0 +1,42 @@
+#include "cluster/simulated_node.h"
+
+#include <vector>
+
+namespace nvr {
+
+SimulatedNode::SimulatedNode(std::string id, PlacementScheduler* scheduler, int startTicks)
+    : id_(std::move(id)), scheduler_(scheduler), startTicks_(startTicks) {}
+
+void SimulatedNode::startRecording(const std::string& cameraId) {
+  if (failed_ || recording_.count(cameraId)) return;
+  starting_.emplace(cameraId, startTicks_);
+}
+
+void SimulatedNode::stopRecording(const std::string& cameraId) {
+  recording_.erase(cameraId);
+  starting_.erase(cameraId);
+}
+
+void SimulatedNode::tick(uint64_t nowMs) {
+  if (failed_) return;
+  std::vector<std::string> started;
+  for (auto it = starting_.begin(); it != starting_.end();) {
+    if (--it->second > 0) {
+      ++it;
+      continue;
+    }
+    started.push_back(it->first);
+    recording_.insert(it->first);
+    it = starting_.erase(it);
+  }
+  // Confirmed after the loop: the scheduler may call back into this node.
+  for (const std::string& cameraId : started) scheduler_->onRecording(id_, cameraId, nowMs);
+}
+
+void SimulatedNode::fail() {
+  failed_ = true;
+  recording_.clear();
+  starting_.clear();
+}
+
+}  // namespace nvr
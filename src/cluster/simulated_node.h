@@ -0,0 +1,47 @@
+// In-process recording node for placement simulations.
+//
+// Keeps the set of cameras it records. A start is confirmed to the
+// scheduler after a number of ticks, as a real node confirms once the
+// camera's first keyframe is on disk. A stop takes effect at once. A
+// failed node drops everything and ignores commands.
+
+#ifndef NVR_CLUSTER_SIMULATED_NODE_H
+#define NVR_CLUSTER_SIMULATED_NODE_H
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "cluster/placement.h"
+
+namespace nvr {
+
+class SimulatedNode : public NodeAgent {
+ public:
+  SimulatedNode(std::string id, PlacementScheduler* scheduler, int startTicks);
+
+  void startRecording(const std::string& cameraId) override;
+  void stopRecording(const std::string& cameraId) override;
+
+  // Confirms the starts that are due, as of nowMs.
+  void tick(uint64_t nowMs);
+  void fail();
+
+  const std::string& id() const { return id_; }
+  bool failed() const { return failed_; }
+  bool records(const std::string& cameraId) const { return recording_.count(cameraId) != 0; }
+  const std::set<std::string>& recording() const { return recording_; }
+  size_t starting() const { return starting_.size(); }
+
+ private:
+  const std::string id_;
+  PlacementScheduler* const scheduler_;
+  const int startTicks_;
+  bool failed_ = false;
+  std::set<std::string> recording_;
+  std::map<std::string, int> starting_;  // camera -> ticks left
+};
+
+}  // namespace nvr
+
+#endif  // NVR_CLUSTER_SIMULATED_NODE_H
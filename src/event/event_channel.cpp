@@ -0,0 +1,97 @@
+#include "event/event_channel.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <utility>
+
+#include "base/log.h"
+
+namespace nvr {
+
+namespace {
+
+// Bound one wakeup's work so a flood cannot starve the consumer's loop.
+constexpr int kMaxDrain = 4096;
+
+}  // namespace
+
+const char* eventTopicName(EventTopic topic) {
+  switch (topic) {
+    case EventTopic::Motion:
+      return "motion";
+    case EventTopic::Tamper:
+      return "tamper";
+    case EventTopic::DigitalInput:
+      return "input";
+    case EventTopic::VideoLoss:
+      return "video-loss";
+    case EventTopic::Other:
+      break;
+  }
+  return "other";
+}
+
+EventChannel::EventChannel(EventLoop* loop, size_t capacity, Handler handler)
+    : loop_(loop), handler_(std::move(handler)), queue_(capacity) {
+  fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd_ < 0) {
+    NVR_ERROR("eventfd: %s", strerror(errno));
+    return;
+  }
+  loop_->add(fd_, EPOLLIN, this);
+}
+
+EventChannel::~EventChannel() {
+  if (fd_ < 0) return;
+  loop_->remove(fd_);
+  close(fd_);
+}
+
+bool EventChannel::publish(const EventRecord& record) {
+  if (!queue_.push(record)) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  published_.fetch_add(1, std::memory_order_relaxed);
+  if (!notified_.exchange(true)) {
+    uint64_t one = 1;
+    ssize_t n = write(fd_, &one, sizeof(one));
+    (void)n;  // EAGAIN only when the counter is already non-zero
+  }
+  return true;
+}
+
+EventChannel::Stats EventChannel::stats() const {
+  Stats stats;
+  stats.published = published_.load(std::memory_order_relaxed);
+  stats.dropped = dropped_.load(std::memory_order_relaxed);
+  stats.delivered = delivered_.load(std::memory_order_relaxed);
+  stats.wakeups = wakeups_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void EventChannel::onEvents(uint32_t) {
+  uint64_t count;
+  if (read(fd_, &count, sizeof(count)) < 0) return;
+  wakeups_.fetch_add(1, std::memory_order_relaxed);
+  // Cleared before draining: a record pushed after this point is either
+  // drained below or notifies again.
+  notified_.store(false);
+  EventRecord record;
+  int n = 0;
+  while (n < kMaxDrain && queue_.pop(&record)) {
+    ++n;
+    handler_(record);
+  }
+  delivered_.fetch_add(static_cast<uint64_t>(n), std::memory_order_relaxed);
+  if (n == kMaxDrain && !queue_.empty() && !notified_.exchange(true)) {
+    uint64_t one = 1;
+    ssize_t w = write(fd_, &one, sizeof(one));
+    (void)w;
+  }
+}
+
+}  // namespace nvr
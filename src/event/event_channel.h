@@ -0,0 +1,95 @@
+// Camera events (motion, tamper, alarm inputs) on their way to the recorder.
+//
+// Device protocols normalize what cameras report into a fixed 32-byte
+// EventRecord and publish it to an EventChannel from whatever loop polls
+// the device. The channel is a lock-free MPSC queue drained on the
+// consumer's loop: publishing is a compare-and-swap plus, when the
+// consumer is idle, one eventfd write, so producers never contend on a
+// lock and a burst costs the consumer one wakeup.
+
+#ifndef NVR_EVENT_EVENT_CHANNEL_H
+#define NVR_EVENT_EVENT_CHANNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+
+#include "base/event_loop.h"
+#include "base/mpsc_queue.h"
+
+namespace nvr {
+
+enum class EventTopic : uint8_t {
+  Other = 0,
+  Motion,
+  Tamper,        // covered or moved camera, scene change
+  DigitalInput,  // alarm input contact
+  VideoLoss,
+};
+
+const char* eventTopicName(EventTopic topic);
+
+struct EventRecord {
+  static constexpr uint8_t kInitial = 1;  // state snapshot sent on subscribe
+
+  int64_t timeUs = 0;      // when it happened, local wall clock
+  int64_t receivedUs = 0;  // when the NVR parsed it
+  uint32_t camera = 0;     // key the camera was registered with
+  uint32_t source = 0;     // hash of the video source or input token
+  EventTopic topic = EventTopic::Other;
+  uint8_t active = 0;      // state after the event: motion on, input closed
+  uint8_t flags = 0;
+  uint8_t reserved[5] = {};
+};
+
+static_assert(sizeof(EventRecord) == 32, "EventRecord is a fixed 32-byte record");
+
+class EventChannel : public EventHandler {
+ public:
+  using Handler = std::function<void(const EventRecord& record)>;
+
+  struct Stats {
+    uint64_t published = 0;
+    uint64_t dropped = 0;    // queue full
+    uint64_t delivered = 0;
+    uint64_t wakeups = 0;    // consumer wakeups; delivered / wakeups is the batch size
+  };
+
+  // Create and destroy on loop's thread; handler runs there.
+  EventChannel(EventLoop* loop, size_t capacity, Handler handler);
+  ~EventChannel() override;
+
+  EventChannel(const EventChannel&) = delete;
+  EventChannel& operator=(const EventChannel&) = delete;
+
+  bool valid() const { return fd_ >= 0; }
+
+  // Any thread. Returns false, and counts a drop, when the queue is full.
+  bool publish(const EventRecord& record);
+
+  // Any thread; the counters are relaxed, so only roughly consistent with
+  // each other.
+  Stats stats() const;
+
+  void onEvents(uint32_t events) override;
+
+ private:
+  EventLoop* loop_;
+  Handler handler_;
+  MpscQueue<EventRecord> queue_;
+  int fd_ = -1;  // eventfd
+  // Set by the first producer after the consumer went idle; only that one
+  // writes the eventfd.
+  std::atomic<bool> notified_{false};
+  std::atomic<uint64_t> published_{0};
+  std::atomic<uint64_t> dropped_{0};
+  // Written on the loop, read by stats() from anywhere.
+  std::atomic<uint64_t> delivered_{0};
+  std::atomic<uint64_t> wakeups_{0};
+};
+
+}  // namespace nvr
+
+#endif  // NVR_EVENT_EVENT_CHANNEL_H
@@ -0,0 +1,351 @@
+#include "http/http_client.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "base/log.h"
+
+namespace nvr {
+
+namespace {
+
+constexpr uint32_t kTickMs = 100;
+
+}  // namespace
+
+class HttpClient::Connection : public EventHandler {
+ public:
+  Connection(HttpClient* client, Pool* pool, size_t maxResponseBytes)
+      : client_(client), pool(pool), input(16 * 1024), output(4 * 1024),
+        parser(maxResponseBytes) {}
+
+  void onEvents(uint32_t events) override {
+    // May still be queued in the epoll batch after close.
+    if (fd >= 0) client_->onConnectionEvents(this, events);
+  }
+
+  HttpClient* client_;
+  Pool* pool;
+  int fd = -1;
+  bool connecting = true;
+  bool busy = false;
+  bool wantWrite = false;
+  bool idle = false;
+  uint32_t served = 0;
+  // Connect or response deadline while busy, expiry while idle.
+  uint64_t deadlineMs = 0;
+  std::list<Connection*>::iterator idlePos;
+  ByteBuffer input;
+  ByteBuffer output;
+  HttpResponseParser parser;
+  Pending current;
+};
+
+HttpClient::HttpClient(EventLoop* loop, const HttpClientOptions& options)
+    : loop_(loop), options_(options) {
+  if (options_.maxConnectionsPerHost == 0) options_.maxConnectionsPerHost = 1;
+  if (options_.maxConnections == 0) options_.maxConnections = 1;
+  tickTimer_ = loop_->runEvery(kTickMs, [this] { tick(); });
+}
+
+HttpClient::~HttpClient() {
+  loop_->cancel(tickTimer_);
+  for (auto& entry : pools_) {
+    for (Connection* conn : entry.second.connections) {
+      loop_->remove(conn->fd);
+      ::close(conn->fd);
+      conn->fd = -1;
+      loop_->deleteLater(conn);
+    }
+  }
+}
+
+void HttpClient::request(const SocketAddress& server, const std::string& host,
+                         const HttpRequest& request, Callback callback) {
+  std::string key = server.toString();
+  Pool& pool = pools_[key];
+  if (pool.key.empty()) {
+    pool.key = std::move(key);
+    pool.server = server;
+  }
+  Pending pending;
+  pending.wire = buildHttpRequest(request.method, request.target, host, request.headers,
+                                  request.body);
+  pending.head = request.method == "HEAD";
+  pending.timeoutMs = request.timeoutMs ? request.timeoutMs : options_.requestTimeoutMs;
+  pending.callback = std::move(callback);
+  pool.queue.push_back(std::move(pending));
+  ++stats_.requests;
+  dispatch(&pool);
+}
+
+void HttpClient::dispatch(Pool* pool) {
+  while (!pool->queue.empty()) {
+    Connection* conn = nullptr;
+    for (Connection* c : pool->connections) {
+      if (c->idle) {
+        conn = c;
+        break;
+      }
+    }
+    if (conn == nullptr) {
+      if (pool->connections.size() >= options_.maxConnectionsPerHost) return;
+      if (!openConnection(pool)) {
+        if (!pool->waiting) {
+          pool->waiting = true;
+          waiting_.push_back(pool);
+        }
+        return;
+      }
+      continue;
+    }
+    takeIdle(conn);
+    Pending pending = std::move(pool->queue.front());
+    pool->queue.pop_front();
+    send(conn, std::move(pending));
+  }
+}
+
+bool HttpClient::openConnection(Pool* pool) {
+  if (connectionCount_ >= options_.maxConnections) {
+    if (idle_.empty()) return false;
+    close(idle_.front());
+  }
+  int fd = tcpConnect(pool->server);
+  if (fd < 0) {
+    Pending pending = std::move(pool->queue.front());
+    pool->queue.pop_front();
+    ++stats_.errors;
+    pending.callback(fd, HttpResponse());
+    return true;
+  }
+  auto* conn = new Connection(this, pool, options_.maxResponseBytes);
+  conn->fd = fd;
+  conn->wantWrite = true;
+  loop_->add(fd, EPOLLIN | EPOLLOUT, conn);
+  pool->connections.push_back(conn);
+  ++connectionCount_;
+  ++stats_.connectionsOpened;
+  stats_.peakConnections = std::max<uint32_t>(stats_.peakConnections,
+                                              static_cast<uint32_t>(connectionCount_));
+  Pending pending = std::move(pool->queue.front());
+  pool->queue.pop_front();
+  send(conn, std::move(pending));
+  return true;
+}
+
+void HttpClient::send(Connection* conn, Pending pending) {
+  conn->current = std::move(pending);
+  conn->busy = true;
+  conn->parser.reset(conn->current.head);
+  conn->input.clear();
+  conn->output.append(conn->current.wire);
+  if (conn->served > 0) ++stats_.reused;
+  conn->deadlineMs = loop_->nowMs() + conn->current.timeoutMs;
+  if (conn->connecting) {
+    conn->deadlineMs = loop_->nowMs() + options_.connectTimeoutMs;
+    return;
+  }
+  handleWritable(conn);
+}
+
+void HttpClient::onConnectionEvents(Connection* conn, uint32_t events) {
+  if (conn->connecting) {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+    int err = socketError(conn->fd);
+    if (err != 0) {
+      fail(conn, err);
+      return;
+    }
+    conn->connecting = false;
+    conn->deadlineMs = loop_->nowMs() + conn->current.timeoutMs;
+    handleWritable(conn);
+    return;
+  }
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) handleReadable(conn);
+  if (conn->fd >= 0 && (events & EPOLLOUT)) handleWritable(conn);
+}
+
+void HttpClient::handleWritable(Connection* conn) {
+  while (!conn->output.empty()) {
+    ssize_t n = conn->output.writeFd(conn->fd);
+    if (n < 0) {
+      if (n == -EAGAIN) {
+        if (!conn->wantWrite) {
+          conn->wantWrite = true;
+          loop_->modify(conn->fd, EPOLLIN | EPOLLOUT, conn);
+        }
+        return;
+      }
+      fail(conn, static_cast<int>(n));
+      return;
+    }
+  }
+  if (conn->wantWrite) {
+    conn->wantWrite = false;
+    loop_->modify(conn->fd, EPOLLIN, conn);
+  }
+}
+
+void HttpClient::handleReadable(Connection* conn) {
+  for (;;) {
+    ssize_t n = conn->input.readFd(conn->fd);
+    if (n == 0) {
+      if (conn->busy && conn->parser.finish() == HttpResponseParser::Result::Done) {
+        complete(conn);
+      } else if (conn->busy) {
+        fail(conn, -ECONNRESET);
+      } else {
+        close(conn);
+      }
+      return;
+    }
+    if (n < 0) {
+      if (n == -EAGAIN || n == -EINTR) return;
+      fail(conn, static_cast<int>(n));
+      return;
+    }
+    if (!conn->busy) {
+      // Nothing is outstanding; whatever this is, the connection is unusable.
+      close(conn);
+      return;
+    }
+    size_t used = 0;
+    auto result = conn->parser.feed(reinterpret_cast<const char*>(conn->input.data()),
+                                    conn->input.size(), &used);
+    conn->input.consume(used);
+    if (result == HttpResponseParser::Result::Error) {
+      fail(conn, -EBADMSG);
+      return;
+    }
+    if (result == HttpResponseParser::Result::Done) {
+      complete(conn);
+      return;
+    }
+  }
+}
+
+void HttpClient::complete(Connection* conn) {
+  Pool* pool = conn->pool;
+  Pending done = std::move(conn->current);
+  HttpResponse response = std::move(conn->parser.response());
+  conn->busy = false;
+  ++conn->served;
+  ++stats_.responses;
+  if (response.keepAlive && conn->input.empty()) {
+    makeIdle(conn);
+  } else {
+    close(conn);
+  }
+  dispatch(pool);
+  serveWaiting();
+  done.callback(0, response);
+}
+
+void HttpClient::fail(Connection* conn, int error) {
+  Pool* pool = conn->pool;
+  if (!conn->busy) {
+    close(conn);
+    serveWaiting();
+    return;
+  }
+  Pending failed = std::move(conn->current);
+  bool neverConnected = conn->connecting;
+  // A server may close a kept-alive connection just as we reuse it. Nothing
+  // was processed if no response byte came back, so resend once.
+  if (conn->served > 0 && !conn->parser.started() && !failed.retried &&
+      (error == -ECONNRESET || error == -EPIPE)) {
+    failed.retried = true;
+    ++stats_.retries;
+    close(conn);
+    pool->queue.push_front(std::move(failed));
+    dispatch(pool);
+    serveWaiting();
+    return;
+  }
+  close(conn);
+  NVR_DEBUG("http %s: request failed (%s)", pool->key.c_str(), strerror(-error));
+  std::vector<Pending> failedAll;
+  failedAll.push_back(std::move(failed));
+  if (neverConnected && pool->connections.empty()) {
+    // The host is unreachable; fail what is queued for it rather than
+    // timing out each request in turn.
+    for (auto& pending : pool->queue) failedAll.push_back(std::move(pending));
+    pool->queue.clear();
+  } else {
+    dispatch(pool);
+  }
+  serveWaiting();
+  stats_.errors += failedAll.size();
+  for (auto& pending : failedAll) pending.callback(error, HttpResponse());
+}
+
+void HttpClient::close(Connection* conn) {
+  if (conn->fd < 0) return;
+  if (conn->idle) takeIdle(conn);
+  loop_->remove(conn->fd);
+  ::close(conn->fd);
+  conn->fd = -1;
+  auto& conns = conn->pool->connections;
+  conns.erase(std::find(conns.begin(), conns.end(), conn));
+  --connectionCount_;
+  loop_->deleteLater(conn);
+}
+
+void HttpClient::makeIdle(Connection* conn) {
+  conn->idle = true;
+  conn->deadlineMs = loop_->nowMs() + options_.idleTimeoutMs;
+  conn->idlePos = idle_.insert(idle_.end(), conn);
+}
+
+void HttpClient::takeIdle(Connection* conn) {
+  conn->idle = false;
+  idle_.erase(conn->idlePos);
+}
+
+void HttpClient::serveWaiting() {
+  if (servingWaiting_) return;
+  servingWaiting_ = true;
+  while (!waiting_.empty() &&
+         (connectionCount_ < options_.maxConnections || !idle_.empty())) {
+    Pool* pool = waiting_.front();
+    waiting_.pop_front();
+    pool->waiting = false;
+    dispatch(pool);
+    if (pool->waiting) break;
+  }
+  servingWaiting_ = false;
+}
+
+void HttpClient::tick() {
+  uint64_t now = loop_->nowMs();
+  std::vector<Connection*> expired;
+  for (auto it = pools_.begin(); it != pools_.end();) {
+    Pool& pool = it->second;
+    if (pool.connections.empty() && pool.queue.empty() && !pool.waiting) {
+      it = pools_.erase(it);
+      continue;
+    }
+    for (Connection* conn : pool.connections) {
+      if (now >= conn->deadlineMs) expired.push_back(conn);
+    }
+    ++it;
+  }
+  // Closed connections stay allocated until the next loop iteration, so
+  // the ones closed while handling an earlier entry are safe to skip.
+  for (Connection* conn : expired) {
+    if (conn->fd < 0) continue;
+    if (conn->busy) {
+      fail(conn, -ETIMEDOUT);
+    } else {
+      close(conn);
+    }
+  }
+  serveWaiting();
+}
+
+}  // namespace nvr
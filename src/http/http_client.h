@@ -0,0 +1,128 @@
+// Non-blocking HTTP/1.1 client with per-host keep-alive connection pools.
+//
+// Used for device management calls (ONVIF SOAP, PSIA REST), where a
+// provisioning run talks to thousands of devices a few requests each.
+// Requests to one server share up to maxConnectionsPerHost persistent
+// connections; requests beyond that wait in the host's queue instead of
+// opening more sockets. Connections left idle are kept for reuse until
+// idleTimeoutMs, or closed oldest-first when the client hits its global
+// connection limit.
+//
+// A client lives on one EventLoop and is only touched from that loop's
+// thread. Callbacks run on the loop thread and may issue new requests.
+
+#ifndef NVR_HTTP_HTTP_CLIENT_H
+#define NVR_HTTP_HTTP_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/event_loop.h"
+#include "base/socket_util.h"
+#include "http/http_message.h"
+
+namespace nvr {
+
+struct HttpClientOptions {
+  uint32_t maxConnectionsPerHost = 2;
+  uint32_t maxConnections = 1024;
+  uint32_t connectTimeoutMs = 5000;
+  // From the request being written until the whole response has arrived.
+  uint32_t requestTimeoutMs = 10000;
+  uint32_t idleTimeoutMs = 30000;
+  size_t maxResponseBytes = 4 * 1024 * 1024;
+};
+
+class HttpClient {
+ public:
+  // error is 0 or -errno; response is only meaningful when error is 0.
+  // HTTP error statuses are not errors here.
+  using Callback = std::function<void(int error, const HttpResponse& response)>;
+
+  struct Stats {
+    uint64_t requests = 0;
+    uint64_t responses = 0;
+    uint64_t errors = 0;
+    uint64_t connectionsOpened = 0;
+    // Requests sent on a connection that already carried a response.
+    uint64_t reused = 0;
+    // Requests resent on a fresh connection after a kept-alive one turned
+    // out to be closed by the server.
+    uint64_t retries = 0;
+    uint32_t peakConnections = 0;
+  };
+
+  HttpClient(EventLoop* loop, const HttpClientOptions& options = HttpClientOptions());
+  // Closes every connection; callbacks of outstanding requests are dropped.
+  ~HttpClient();
+
+  HttpClient(const HttpClient&) = delete;
+  HttpClient& operator=(const HttpClient&) = delete;
+
+  // Sends request to server. host is the Host header value. The request
+  // is always sent keep-alive.
+  void request(const SocketAddress& server, const std::string& host,
+               const HttpRequest& request, Callback callback);
+
+  EventLoop* loop() const { return loop_; }
+  size_t connections() const { return connectionCount_; }
+  size_t idleConnections() const { return idle_.size(); }
+  const Stats& stats() const { return stats_; }
+
+ private:
+  class Connection;
+
+  struct Pending {
+    std::string wire;
+    bool head = false;
+    bool retried = false;
+    uint32_t timeoutMs = 0;
+    Callback callback;
+  };
+
+  struct Pool {
+    std::string key;
+    SocketAddress server;
+    std::vector<Connection*> connections;
+    std::deque<Pending> queue;
+    bool waiting = false;  // listed in waiting_
+  };
+
+  void dispatch(Pool* pool);
+  bool openConnection(Pool* pool);
+  void send(Connection* conn, Pending pending);
+  void onConnectionEvents(Connection* conn, uint32_t events);
+  void handleReadable(Connection* conn);
+  void handleWritable(Connection* conn);
+  void complete(Connection* conn);
+  void fail(Connection* conn, int error);
+  void close(Connection* conn);
+  void makeIdle(Connection* conn);
+  void takeIdle(Connection* conn);
+  void serveWaiting();
+  void tick();
+
+  EventLoop* loop_;
+  HttpClientOptions options_;
+  std::unordered_map<std::string, Pool> pools_;
+  // Idle connections, least recently used first.
+  std::list<Connection*> idle_;
+  // Pools with queued requests that hit the global connection limit.
+  std::deque<Pool*> waiting_;
+  bool servingWaiting_ = false;
+  size_t connectionCount_ = 0;
+  EventLoop::TimerId tickTimer_ = 0;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_HTTP_HTTP_CLIENT_H
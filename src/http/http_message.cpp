@@ -0,0 +1,291 @@
+#include "http/http_message.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+namespace nvr {
+
+namespace {
+
+constexpr size_t kMaxLine = 8 * 1024;
+constexpr size_t kMaxHeaderBytes = 64 * 1024;
+constexpr size_t kMaxHeaders = 128;
+
+std::string trim(const char* b, const char* e) {
+  while (b < e && isspace(static_cast<unsigned char>(*b))) ++b;
+  while (e > b && isspace(static_cast<unsigned char>(e[-1]))) --e;
+  return std::string(b, e - b);
+}
+
+const std::string* findHeader(const HeaderList& headers, const char* name) {
+  for (const auto& h : headers)
+    if (equalsIgnoreCase(h.first, name)) return &h.second;
+  return nullptr;
+}
+
+bool addHeaderLine(const std::string& line, HeaderList* headers) {
+  size_t colon = line.find(':');
+  if (colon == std::string::npos || colon == 0) return false;
+  headers->emplace_back(trim(line.data(), line.data() + colon),
+                        trim(line.data() + colon + 1, line.data() + line.size()));
+  return true;
+}
+
+bool hasToken(const std::string* value, const char* token) {
+  if (!value) return false;
+  size_t n = strlen(token);
+  for (size_t i = 0; i + n <= value->size(); ++i) {
+    if (strncasecmp(value->data() + i, token, n) == 0) return true;
+  }
+  return false;
+}
+
+// Appends to *line up to and including the next '\n'. Returns true once
+// the line is complete (CR/LF stripped).
+bool takeLine(const char* data, size_t len, size_t* pos, std::string* line) {
+  const char* start = data + *pos;
+  const char* nl = static_cast<const char*>(memchr(start, '\n', len - *pos));
+  if (!nl) {
+    line->append(start, data + len - start);
+    *pos = len;
+    return false;
+  }
+  line->append(start, nl - start);
+  *pos = static_cast<size_t>(nl - data) + 1;
+  if (!line->empty() && line->back() == '\r') line->pop_back();
+  return true;
+}
+
+}  // namespace
+
+const std::string* HttpResponse::header(const char* name) const {
+  return findHeader(headers, name);
+}
+
+const std::string* HttpRequest::header(const char* name) const {
+  return findHeader(headers, name);
+}
+
+HttpResponseParser::HttpResponseParser(size_t maxBodyBytes) : maxBodyBytes_(maxBodyBytes) {}
+
+void HttpResponseParser::reset(bool headRequest) {
+  state_ = State::StatusLine;
+  head_ = headRequest;
+  line_.clear();
+  remaining_ = 0;
+  response_.status = 0;
+  response_.reason.clear();
+  response_.headers.clear();
+  response_.body.clear();
+  response_.keepAlive = true;
+}
+
+bool HttpResponseParser::headersDone() {
+  const std::string* connection = response_.header("Connection");
+  if (hasToken(connection, "close")) response_.keepAlive = false;
+  // 1xx, 204 and 304 never carry a body.
+  if (head_ || response_.status < 200 || response_.status == 204 || response_.status == 304) {
+    state_ = State::Done;
+    return true;
+  }
+  if (hasToken(response_.header("Transfer-Encoding"), "chunked")) {
+    state_ = State::ChunkSize;
+    return true;
+  }
+  if (const std::string* length = response_.header("Content-Length")) {
+    char* end = nullptr;
+    unsigned long long n = strtoull(length->c_str(), &end, 10);
+    if (end == length->c_str() || n > maxBodyBytes_) return false;
+    remaining_ = static_cast<size_t>(n);
+    response_.body.reserve(remaining_);
+    state_ = remaining_ ? State::Body : State::Done;
+    return true;
+  }
+  response_.keepAlive = false;
+  state_ = State::UntilClose;
+  return true;
+}
+
+HttpResponseParser::Result HttpResponseParser::feed(const char* data, size_t len, size_t* used) {
+  size_t pos = 0;
+  Result result = Result::NeedMore;
+  while (result == Result::NeedMore && (pos < len || state_ == State::Done)) {
+    switch (state_) {
+      case State::StatusLine:
+      case State::Headers:
+      case State::ChunkSize:
+      case State::ChunkEnd:
+      case State::Trailers: {
+        if (!takeLine(data, len, &pos, &line_)) {
+          if (line_.size() > kMaxLine) result = Result::Error;
+          break;
+        }
+        std::string line;
+        line.swap(line_);
+        if (state_ == State::StatusLine) {
+          // HTTP/1.1 200 OK
+          if (line.compare(0, 5, "HTTP/") != 0) {
+            result = Result::Error;
+            break;
+          }
+          size_t sp = line.find(' ');
+          if (sp == std::string::npos) {
+            result = Result::Error;
+            break;
+          }
+          response_.status = atoi(line.c_str() + sp + 1);
+          size_t sp2 = line.find(' ', sp + 1);
+          response_.reason = sp2 == std::string::npos ? "" : line.substr(sp2 + 1);
+          if (line.compare(0, 8, "HTTP/1.0") == 0) response_.keepAlive = false;
+          if (response_.status < 100) result = Result::Error;
+          state_ = State::Headers;
+        } else if (state_ == State::Headers) {
+          if (!line.empty()) {
+            if (!addHeaderLine(line, &response_.headers) ||
+                response_.headers.size() > kMaxHeaders)
+              result = Result::Error;
+          } else if (!headersDone()) {
+            result = Result::Error;
+          }
+        } else if (state_ == State::ChunkSize) {
+          char* end = nullptr;
+          unsigned long n = strtoul(line.c_str(), &end, 16);
+          if (end == line.c_str() || response_.body.size() + n > maxBodyBytes_) {
+            result = Result::Error;
+            break;
+          }
+          remaining_ = n;
+          state_ = n ? State::ChunkData : State::Trailers;
+        } else if (state_ == State::ChunkEnd) {
+          state_ = State::ChunkSize;
+        } else if (line.empty()) {
+          state_ = State::Done;
+        }
+        break;
+      }
+      case State::Body:
+      case State::ChunkData: {
+        size_t take = len - pos < remaining_ ? len - pos : remaining_;
+        response_.body.append(data + pos, take);
+        pos += take;
+        remaining_ -= take;
+        if (remaining_ == 0) state_ = state_ == State::Body ? State::Done : State::ChunkEnd;
+        break;
+      }
+      case State::UntilClose:
+        if (response_.body.size() + (len - pos) > maxBodyBytes_) {
+          result = Result::Error;
+          break;
+        }
+        response_.body.append(data + pos, len - pos);
+        pos = len;
+        break;
+      case State::Done:
+        result = Result::Done;
+        break;
+    }
+  }
+  *used = pos;
+  return result;
+}
+
+HttpResponseParser::Result HttpResponseParser::finish() {
+  if (state_ == State::UntilClose || state_ == State::Done) {
+    state_ = State::Done;
+    return Result::Done;
+  }
+  return Result::Error;
+}
+
+int parseHttpRequest(const char* data, size_t len, HttpRequest* out) {
+  const char* end = static_cast<const char*>(memmem(data, len, "\r\n\r\n", 4));
+  if (end == nullptr) return len > kMaxHeaderBytes ? -1 : 0;
+  size_t headerLen = end - data + 4;
+  const char* lineEnd = static_cast<const char*>(memmem(data, headerLen, "\r\n", 2));
+  std::string startLine(data, lineEnd - data);
+  // POST /onvif/device_service HTTP/1.1
+  size_t sp = startLine.find(' ');
+  size_t sp2 = startLine.rfind(' ');
+  if (sp == std::string::npos || sp2 == sp || startLine.compare(sp2 + 1, 5, "HTTP/") != 0)
+    return -1;
+  out->method = startLine.substr(0, sp);
+  out->target = startLine.substr(sp + 1, sp2 - sp - 1);
+  out->keepAlive = startLine.compare(sp2 + 1, 8, "HTTP/1.0") != 0;
+  out->headers.clear();
+  const char* p = lineEnd + 2;
+  size_t contentLength = 0;
+  while (p < end) {
+    lineEnd = static_cast<const char*>(memmem(p, end + 2 - p, "\r\n", 2));
+    std::string line(p, lineEnd - p);
+    p = lineEnd + 2;
+    if (!addHeaderLine(line, &out->headers)) continue;
+    if (equalsIgnoreCase(out->headers.back().first, "Content-Length"))
+      contentLength = strtoul(out->headers.back().second.c_str(), nullptr, 10);
+  }
+  if (hasToken(out->header("Connection"), "close")) out->keepAlive = false;
+  if (contentLength > 16 * 1024 * 1024) return -1;
+  if (len < headerLen + contentLength) return 0;
+  out->body.assign(data + headerLen, contentLength);
+  return static_cast<int>(headerLen + contentLength);
+}
+
+std::string buildHttpRequest(const std::string& method, const std::string& target,
+                             const std::string& host, const HeaderList& headers,
+                             const std::string& body) {
+  std::string out;
+  out.reserve(256 + body.size());
+  out += method;
+  out += ' ';
+  out += target;
+  out += " HTTP/1.1\r\nHost: ";
+  out += host;
+  out += "\r\n";
+  for (const auto& h : headers) {
+    out += h.first;
+    out += ": ";
+    out += h.second;
+    out += "\r\n";
+  }
+  if (!body.empty() || method == "POST" || method == "PUT") {
+    out += "Content-Length: ";
+    out += std::to_string(body.size());
+    out += "\r\n";
+  }
+  out += "\r\n";
+  out += body;
+  return out;
+}
+
+std::string buildHttpResponseHead(int status, const char* reason, const HeaderList& headers,
+                                  size_t contentLength, bool keepAlive) {
+  std::string out;
+  out.reserve(256);
+  out += "HTTP/1.1 ";
+  out += std::to_string(status);
+  out += ' ';
+  out += reason;
+  out += "\r\n";
+  for (const auto& h : headers) {
+    out += h.first;
+    out += ": ";
+    out += h.second;
+    out += "\r\n";
+  }
+  out += "Content-Length: ";
+  out += std::to_string(contentLength);
+  out += "\r\n";
+  if (!keepAlive) out += "Connection: close\r\n";
+  out += "\r\n";
+  return out;
+}
+
+std::string buildHttpResponse(int status, const char* reason, const HeaderList& headers,
+                              const std::string& body, bool keepAlive) {
+  std::string out = buildHttpResponseHead(status, reason, headers, body.size(), keepAlive);
+  out += body;
+  return out;
+}
+
+}  // namespace nvr
@@ -0,0 +1,96 @@
+// HTTP/1.1 message framing for the management plane: ONVIF and PSIA
+// device calls, and the small servers that mock devices in benchmarks.
+//
+// Responses are parsed incrementally, so a body arriving over many reads
+// is framed without rescanning: Content-Length, chunked, and bodies
+// delimited by the connection closing. Requests are small and parsed in
+// one go, like RTSP requests.
+
+#ifndef NVR_HTTP_HTTP_MESSAGE_H
+#define NVR_HTTP_HTTP_MESSAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "rtsp/rtsp_message.h"
+
+namespace nvr {
+
+struct HttpResponse {
+  int status = 0;
+  std::string reason;
+  HeaderList headers;
+  std::string body;
+  bool keepAlive = true;  // the connection may carry another request
+
+  // Case-insensitive header lookup; nullptr when absent.
+  const std::string* header(const char* name) const;
+};
+
+struct HttpRequest {
+  std::string method;
+  std::string target;  // origin-form: path and query
+  HeaderList headers;
+  std::string body;
+  bool keepAlive = true;
+  // Client side: overrides HttpClientOptions::requestTimeoutMs when
+  // non-zero, e.g. for long polls.
+  uint32_t timeoutMs = 0;
+
+  const std::string* header(const char* name) const;
+};
+
+class HttpResponseParser {
+ public:
+  enum class Result { NeedMore, Done, Error };
+
+  explicit HttpResponseParser(size_t maxBodyBytes = 16 * 1024 * 1024);
+
+  // Starts a new response. A response to HEAD has no body whatever its
+  // headers say.
+  void reset(bool headRequest = false);
+  // Consumes bytes from data and sets *used. Done leaves any bytes after
+  // the response unconsumed.
+  Result feed(const char* data, size_t len, size_t* used);
+  // The connection closed: completes a close-delimited body.
+  Result finish();
+  // True once a status line has been seen.
+  bool started() const { return state_ != State::StatusLine; }
+
+  HttpResponse& response() { return response_; }
+
+ private:
+  enum class State { StatusLine, Headers, Body, ChunkSize, ChunkData, ChunkEnd, Trailers,
+                     UntilClose, Done };
+
+  bool headersDone();
+
+  const size_t maxBodyBytes_;
+  State state_ = State::StatusLine;
+  bool head_ = false;
+  std::string line_;
+  size_t remaining_ = 0;
+  HttpResponse response_;
+};
+
+// Parses one request from the front of data. Returns the bytes consumed, 0
+// when more data is needed, or -1 for a malformed request. Bodies must
+// come with Content-Length.
+int parseHttpRequest(const char* data, size_t len, HttpRequest* out);
+
+// Host is always sent; Content-Length whenever there is a body.
+std::string buildHttpRequest(const std::string& method, const std::string& target,
+                             const std::string& host, const HeaderList& headers,
+                             const std::string& body = "");
+std::string buildHttpResponse(int status, const char* reason, const HeaderList& headers,
+                              const std::string& body, bool keepAlive = true);
+// Status line and headers only, for a body sent separately (or not at all,
+// for HEAD).
+std::string buildHttpResponseHead(int status, const char* reason, const HeaderList& headers,
+                                  size_t contentLength, bool keepAlive = true);
+
+}  // namespace nvr
+
+#endif  // NVR_HTTP_HTTP_MESSAGE_H
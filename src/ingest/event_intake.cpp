@@ -0,0 +1,92 @@
+#include "ingest/event_intake.h"
+
+#include <future>
+
+#include "base/log.h"
+
+namespace nvr {
+
+// Everything that lives on the intake's loop; made and destroyed there.
+struct EventIntake::State {
+  std::unique_ptr<EventTrigger> trigger;
+  std::unique_ptr<EventChannel> channel;
+  std::unique_ptr<HttpClient> http;
+  std::unique_ptr<OnvifEventMultiplexer> mux;
+};
+
+EventIntake::EventIntake(IngestEngine* ingest, const EventIntakeOptions& options)
+    : ingest_(ingest), options_(options), loop_(1, false) {}
+
+EventIntake::~EventIntake() { stop(); }
+
+void EventIntake::addCamera(const std::string& cameraId, const std::string& deviceUrl) {
+  cameras_.emplace_back(cameraId, deviceUrl);
+}
+
+void EventIntake::start() {
+  if (running_) return;
+  loop_.start();
+  EventLoop* loop = loop_.loop(0);
+  state_ = std::make_shared<State>();
+  std::shared_ptr<State> state = state_;
+  IngestEngine* ingest = ingest_;
+  EventIntakeOptions options = options_;
+  std::vector<std::pair<std::string, std::string>> cameras = cameras_;
+  loop->post([loop, state, ingest, options, cameras] {
+    state->trigger.reset(new EventTrigger(loop, ingest, options.trigger));
+    EventTrigger* trigger = state->trigger.get();
+    state->channel.reset(new EventChannel(
+        loop, options.channelCapacity, [trigger](const EventRecord& r) { trigger->onEvent(r); }));
+    // A parked long poll per camera, and room for its renewals.
+    HttpClientOptions http;
+    http.maxConnections = static_cast<uint32_t>(cameras.size()) * 2 + 16;
+    state->http.reset(new HttpClient(loop, http));
+    state->mux.reset(new OnvifEventMultiplexer(state->http.get(), state->channel.get(),
+                                               options.onvif));
+    for (size_t i = 0; i < cameras.size(); ++i) {
+      uint32_t key = static_cast<uint32_t>(i);
+      trigger->addCamera(key, cameras[i].first);
+      state->mux->addCamera(key, cameras[i].second);
+    }
+  });
+  running_ = true;
+  NVR_INFO("event intake: %zu camera(s)", cameras_.size());
+}
+
+void EventIntake::stop() {
+  if (!running_) return;
+  running_ = false;
+  auto promise = std::make_shared<std::promise<void>>();
+  std::future<void> done = promise->get_future();
+  std::shared_ptr<State> state = state_;
+  loop_.loop(0)->post([state, promise] {
+    // Calls in flight refer to the multiplexer, so the client goes first.
+    state->http.reset();
+    state->mux.reset();
+    state->channel.reset();
+    state->trigger.reset();
+    promise->set_value();
+  });
+  done.wait();
+  state_.reset();
+  loop_.stop();
+}
+
+EventIntake::Stats EventIntake::stats() {
+  if (!running_) return Stats();
+  auto promise = std::make_shared<std::promise<Stats>>();
+  std::future<Stats> part = promise->get_future();
+  std::shared_ptr<State> state = state_;
+  size_t cameras = cameras_.size();
+  loop_.loop(0)->post([state, promise, cameras] {
+    Stats stats;
+    stats.cameras = cameras;
+    stats.onvif = state->mux->stats();
+    stats.channel = state->channel->stats();
+    stats.trigger = state->trigger->stats();
+    promise->set_value(stats);
+  });
+  return part.get();
+}
+
+}  // namespace nvr
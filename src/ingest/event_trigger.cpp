@@ -0,0 +1,96 @@
+#include "ingest/event_trigger.h"
+
+#include <vector>
+
+#include "base/clock.h"
+#include "base/log.h"
+
+namespace nvr {
+
+EventTrigger::EventTrigger(EventLoop* loop, IngestEngine* ingest,
+                           const EventTriggerOptions& options)
+    : loop_(loop), ingest_(ingest), options_(options) {
+  if (options_.refreshMs == 0) options_.refreshMs = 1000;
+  timer_ = loop_->runEvery(options_.refreshMs, [this] { refresh(); });
+}
+
+EventTrigger::~EventTrigger() { loop_->cancel(timer_); }
+
+void EventTrigger::addCamera(uint32_t key, const std::string& cameraId) {
+  cameras_[key].id = cameraId;
+}
+
+void EventTrigger::removeCamera(uint32_t key) {
+  cameras_.erase(key);
+  active_.erase(key);
+}
+
+bool EventTrigger::onEvent(const EventRecord& record) {
+  ++stats_.events;
+  auto it = cameras_.find(record.camera);
+  if (it == cameras_.end()) {
+    ++stats_.unknown;
+    return false;
+  }
+  if ((options_.topics & eventTopicBit(record.topic)) == 0) {
+    ++stats_.ignored;
+    return false;
+  }
+  Camera& camera = it->second;
+  int64_t nowUs = wallClockUs();
+  auto source = std::make_pair(static_cast<uint8_t>(record.topic), record.source);
+  if (!record.active) {
+    if (camera.on.erase(source) == 0 || !camera.on.empty()) return false;
+    active_.erase(record.camera);
+    // The snapshot on subscribe says what is off; it ends nothing.
+    if (!(record.flags & EventRecord::kInitial))
+      trigger(camera, nowUs + static_cast<int64_t>(options_.postRollMs) * 1000);
+    return false;
+  }
+  bool started = camera.on.empty();
+  camera.on.insert(source);
+  if (!started) return false;
+  camera.sinceUs = nowUs;
+  active_.insert(record.camera);
+  ++stats_.starts;
+  trigger(camera, nowUs + static_cast<int64_t>(options_.postRollMs + options_.refreshMs) * 1000);
+  return true;
+}
+
+void EventTrigger::refresh() {
+  if (active_.empty()) return;
+  int64_t nowUs = wallClockUs();
+  int64_t untilUs = nowUs + static_cast<int64_t>(options_.postRollMs + options_.refreshMs) * 1000;
+  std::vector<uint32_t> expired;
+  for (uint32_t key : active_) {
+    Camera& camera = cameras_[key];
+    if (nowUs - camera.sinceUs > static_cast<int64_t>(options_.maxActiveMs) * 1000) {
+      expired.push_back(key);
+      continue;
+    }
+    trigger(camera, untilUs);
+  }
+  for (uint32_t key : expired) {
+    Camera& camera = cameras_[key];
+    NVR_WARN("event: %s on for over %u s, no longer extending its recording",
+             camera.id.c_str(), options_.maxActiveMs / 1000);
+    stats_.expired += camera.on.size();
+    // The recording runs out postRollMs after the last refresh; a fresh
+    // event starts it again.
+    camera.on.clear();
+    active_.erase(key);
+  }
+}
+
+void EventTrigger::trigger(const Camera& camera, int64_t untilUs) {
+  ++stats_.triggers;
+  ingest_->triggerRecording(camera.id, untilUs);
+}
+
+EventTrigger::Stats EventTrigger::stats() const {
+  Stats stats = stats_;
+  stats.active = active_.size();
+  return stats;
+}
+
+}  // namespace nvr
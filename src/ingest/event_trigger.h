@@ -0,0 +1,93 @@
+// Camera events to event-only recording: the consumer of an EventChannel.
+//
+// Every EventRecord carries the key its camera was registered with at the
+// device intake (OnvifEventMultiplexer::addCamera()); the trigger maps it
+// to the camera id and calls IngestEngine::triggerRecording(). An event
+// that turns on (motion seen, input closed) starts the recording with its
+// pre-roll. While anything on the camera stays on, the recording is
+// extended every refreshMs, and once everything is off it runs postRollMs
+// longer. A source that never reports off stops being extended after
+// maxActiveMs.
+//
+// Lives on the channel's loop: construct it there and hand onEvent() to
+// the channel as its handler.
+
+#ifndef NVR_INGEST_EVENT_TRIGGER_H
+#define NVR_INGEST_EVENT_TRIGGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "base/event_loop.h"
+#include "event/event_channel.h"
+#include "ingest/ingest_engine.h"
+
+namespace nvr {
+
+constexpr uint32_t eventTopicBit(EventTopic topic) { return 1u << static_cast<uint8_t>(topic); }
+
+struct EventTriggerOptions {
+  // Topics that start a recording.
+  uint32_t topics = eventTopicBit(EventTopic::Motion) | eventTopicBit(EventTopic::Tamper) |
+                    eventTopicBit(EventTopic::DigitalInput);
+  uint32_t postRollMs = 10000;
+  uint32_t refreshMs = 1000;
+  uint32_t maxActiveMs = 10 * 60 * 1000;
+};
+
+class EventTrigger {
+ public:
+  struct Stats {
+    uint64_t events = 0;
+    uint64_t unknown = 0;    // key of no registered camera
+    uint64_t ignored = 0;    // topic not in options.topics
+    uint64_t starts = 0;     // a camera went from nothing on to something on
+    uint64_t triggers = 0;   // triggerRecording() calls, refreshes included
+    uint64_t expired = 0;    // sources still on after maxActiveMs
+    size_t active = 0;       // cameras with something on
+  };
+
+  EventTrigger(EventLoop* loop, IngestEngine* ingest,
+               const EventTriggerOptions& options = EventTriggerOptions());
+  ~EventTrigger();
+
+  EventTrigger(const EventTrigger&) = delete;
+  EventTrigger& operator=(const EventTrigger&) = delete;
+
+  // Re-adding a key renames the camera.
+  void addCamera(uint32_t key, const std::string& cameraId);
+  void removeCamera(uint32_t key);
+
+  // The channel's handler. True when the record started a recording.
+  bool onEvent(const EventRecord& record);
+
+  Stats stats() const;
+
+ private:
+  struct Camera {
+    std::string id;
+    // (topic, source) pairs that are on, and since when (wall clock).
+    std::set<std::pair<uint8_t, uint32_t>> on;
+    int64_t sinceUs = 0;
+  };
+
+  void refresh();
+  void trigger(const Camera& camera, int64_t untilUs);
+
+  EventLoop* loop_;
+  IngestEngine* ingest_;
+  EventTriggerOptions options_;
+  std::unordered_map<uint32_t, Camera> cameras_;
+  std::set<uint32_t> active_;
+  EventLoop::TimerId timer_ = 0;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_INGEST_EVENT_TRIGGER_H
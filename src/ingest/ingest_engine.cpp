@@ -0,0 +1,650 @@
+#include "ingest/ingest_engine.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include <future>
+#include <iterator>
+
+#include "base/clock.h"
+#include "base/hash.h"
+#include "base/log.h"
+#include "rtp/rtcp_packet.h"
+#include "rtp/rtp_jitter_buffer.h"
+#include "rtp/rtp_packet.h"
+#include "rtp/rtp_receive_stats.h"
+#include "rtp/shared_udp_port.h"
+#include "storage/camera_recorder.h"
+#include "storage/recording_store.h"
+
+namespace nvr {
+
+namespace {
+
+// RTCP receiver reports go out at the RFC 3550 minimum interval. Besides
+// loss and jitter they keep some cameras' UDP sessions alive.
+constexpr uint64_t kReceiverReportIntervalMs = 5000;
+const char kRtcpCname[] = "openNVR";
+
+}  // namespace
+
+class IngestEngine::CameraSession : public RtspClientListener, public RtpJitterBufferHandler {
+ public:
+  CameraSession(EventLoop* loop, PacketPools* pools, SharedUdpPort* sharedUdp,
+                SegmentWriter* writer, const CameraConfig& config,
+                const IngestOptions& options)
+      : loop_(loop),
+        config_(config),
+        client_(loop, pools, config.url, withTransport(options.rtsp, config.transport), this),
+        relay_(loop),
+        writer_(writer),
+        eventOnly_(options.eventOnly),
+        preEvent_(options.preEvent),
+        preEventMs_(options.preEventMs),
+        gopCacheBytes_(options.gopCacheBytes),
+        jitterOptions_(options.jitterBuffer),
+        rtcpSsrc_(static_cast<uint32_t>(mix64(fnv1a64(config.id) ^ wallClockUs()))) {
+    client_.setSharedUdpPort(sharedUdp);
+    if (config.transport == RtspTransport::Tcp) jitterOptions_.maxDelayMs = 0;
+  }
+  ~CameraSession() override { cancelReorderTimer(); }
+
+  void start() { client_.start(); }
+  void stop() {
+    client_.stop();
+    cancelReorderTimer();
+  }
+
+  const CameraConfig& config() const { return config_; }
+  const RtspClient& client() const { return client_; }
+  StreamRelay* relay() { return &relay_; }
+  const std::vector<SdpMedia>& media() const { return media_; }
+  const CameraRecorder* recorder() const { return recorder_.get(); }
+
+  void trigger(int64_t untilUs) {
+    // Before the first PLAY there is nothing buffered to write yet.
+    if (recorder_) recorder_->trigger(untilUs);
+  }
+
+  void onRtspPlaying(RtspClient* client) override {
+    const auto& tracks = client_.tracks();
+    media_.clear();
+    for (const auto& track : tracks) media_.push_back(track.media);
+    // A new session is a new source for every track; counts carry on.
+    for (auto& rtp : rtp_) rtp.restart();
+    if (rtp_.size() < tracks.size()) rtp_.resize(tracks.size());
+    for (auto& reorder : reorder_) reorder.reset();
+    while (reorder_.size() < tracks.size())
+      reorder_.emplace_back(static_cast<int>(reorder_.size()), this, jitterOptions_);
+    nextReportMs_ = loop_->nowMs() + kReceiverReportIntervalMs;
+    videoTrack_ = -1;
+    videoCodec_ = VideoCodec::Unknown;
+    for (size_t i = 0; i < tracks.size() && videoTrack_ < 0; ++i) {
+      if (tracks[i].media.type != "video") continue;
+      videoTrack_ = static_cast<int>(i);
+      videoCodec_ = videoCodecFromEncoding(tracks[i].media.encoding);
+    }
+    if (gopCacheBytes_ > 0) {
+      for (size_t i = 0; i < tracks.size(); ++i) {
+        VideoCodec codec = videoCodecFromEncoding(tracks[i].media.encoding);
+        if (tracks[i].media.type != "video" || codec == VideoCodec::Unknown) continue;
+        relay_.enableGopCache(static_cast<int>(i), codec, gopCacheBytes_);
+        break;
+      }
+    }
+    if (writer_ == nullptr) return;
+    for (size_t i = 0; i < tracks.size(); ++i) {
+      if (!CameraRecorder::canRecord(tracks[i].media)) continue;
+      // Keep the recorder (and its stream id) across reconnects unless the
+      // camera now announces a different video format.
+      if (recorder_ && (static_cast<int>(i) != recordTrack_ ||
+                        tracks[i].media.encoding != recordEncoding_))
+        recorder_.reset();
+      if (!recorder_) {
+        recorder_.reset(new CameraRecorder(writer_, config_.id, tracks[i].media));
+        if (eventOnly_) {
+          std::unique_ptr<PreEventRing> ring;
+          if (preEvent_) ring = preEvent_->acquire(preEventMs_ * 1000LL);
+          if (preEvent_ && !ring)
+            NVR_WARN("camera %s: no pre-event slot left, recording without pre-roll",
+                     config_.id.c_str());
+          recorder_->setEventOnly(std::move(ring));
+        }
+      }
+      recordTrack_ = static_cast<int>(i);
+      recordEncoding_ = tracks[i].media.encoding;
+      return;
+    }
+    NVR_WARN("camera %s: no recordable video track", config_.id.c_str());
+  }
+  void onRtspDisconnected(RtspClient* client, int error) override {
+    // Whatever waited on a gap is from a session that is gone.
+    for (auto& reorder : reorder_) reorder.reset();
+    cancelReorderTimer();
+    relay_.resetGopCache();
+    if (recorder_) recorder_->reset();
+  }
+
+  void onRtpPacket(RtspClient* client, int track, const PacketRef& packet) override {
+    RtpHeader header;
+    if (track < 0 || static_cast<size_t>(track) >= media_.size() ||
+        !parseRtpHeader(packet.data(), packet.size(), &header)) {
+      onOrderedRtp(track, packet, 0);
+      return;
+    }
+    count(track, header);
+    reorder_[track].push(packet, header, arrivalUs_, rtp_[track].jitterUs());
+  }
+  void onOrderedRtp(int track, const PacketRef& packet, uint32_t lost) override {
+    if (lost > 0 && track == videoTrack_ && videoCodec_ != VideoCodec::Unknown)
+      relay_.skipToKeyframe(track, videoCodec_);
+    relay_.publish(track, false, packet);
+    if (recorder_ && track == recordTrack_) recorder_->onRtpPacket(packet);
+  }
+  void onRtcpPacket(RtspClient* client, int track, const PacketRef& packet) override {
+    relay_.publish(track, true, packet);
+    RtcpSenderReport report;
+    if (track < 0 || static_cast<size_t>(track) >= media_.size() ||
+        !findRtcpSenderReport(packet.data(), packet.size(), &report))
+      return;
+    rtp_[track].onSenderReport(report, monotonicUs());
+    // Only a report on the source being recorded times its frames.
+    if (recorder_ && track == recordTrack_ && rtp_[track].received() > 0 &&
+        report.ssrc == rtp_[track].ssrc())
+      recorder_->onSenderReport(report.rtpTimestamp, ntpToUnixUs(report.ntp));
+  }
+  void onReceiveBatchDone(RtspClient* client) override {
+    relay_.flush();
+    if (loop_->nowMs() >= nextReportMs_) sendReceiverReports();
+    armReorderTimer();
+    arrivalUs_ = 0;
+    rate_.update(loop_->nowMs(), client_.stats().rtpBytes, frames_);
+  }
+
+  // Loop thread; wallNowUs for the recorder's lag.
+  CameraMetrics metrics(int64_t wallNowUs) const {
+    CameraMetrics m;
+    m.id = config_.id;
+    m.playing = client_.state() == RtspClient::State::Playing;
+    m.reconnects = client_.stats().reconnects;
+    m.receiverReports = client_.stats().rtcpSent;
+    m.rtpPackets = client_.stats().rtpPackets;
+    m.rtpBytes = client_.stats().rtpBytes;
+    m.frames = frames_;
+    // A camera gone quiet has no rate, whatever its last second was.
+    if (loop_->nowMs() - rate_.startMs < 2 * RateWindow::kWindowMs) {
+      m.bitsPerSecond = rate_.bitsPerSecond;
+      m.framesPerSecondMilli = rate_.framesPerSecondMilli;
+    }
+    for (const auto& rtp : rtp_) {
+      m.packetsLost += rtp.lost();
+      m.packetsReordered += rtp.reordered();
+    }
+    for (const auto& reorder : reorder_) m.latePackets += reorder.stats().late;
+    if (videoTrack_ >= 0 && static_cast<size_t>(videoTrack_) < rtp_.size()) {
+      m.jitterUs = rtp_[videoTrack_].jitterUs();
+      m.reorderDelayUs = reorder_[videoTrack_].delayUs();
+    }
+    if (recorder_) {
+      m.recording = true;
+      m.recordedFrames = recorder_->stats().frames;
+      m.skippedFrames = recorder_->stats().skipped;
+      m.corruptFrames = recorder_->stats().corrupt;
+      if (recorder_->senderTimed()) {
+        m.senderTimed = true;
+        m.clockDriftPpb = recorder_->clockSync().driftPpb();
+        m.clockResidualUs = recorder_->clockSync().residualUs();
+      }
+      SegmentStreamStats disk = recorder_->writeStats();
+      m.diskQueueChunks = disk.chunksInFlight;
+      m.diskQueueBytes = disk.bytesInFlight + disk.fillingBytes;
+      bool writing = !recorder_->eventOnly() || recorder_->triggered();
+      if (writing && disk.writtenUs != 0) m.recorderLagUs = wallNowUs - disk.writtenUs;
+    }
+    return m;
+  }
+
+ private:
+  // RTP bytes and video frames per second, rolled over by the receive
+  // batches themselves rather than by a timer per camera.
+  struct RateWindow {
+    static constexpr uint64_t kWindowMs = 1000;
+    uint64_t startMs = 0;
+    uint64_t bytes = 0;   // totals at startMs
+    uint64_t frames = 0;
+    uint64_t bitsPerSecond = 0;
+    uint32_t framesPerSecondMilli = 0;
+
+    void update(uint64_t nowMs, uint64_t totalBytes, uint64_t totalFrames) {
+      uint64_t elapsed = nowMs - startMs;
+      if (startMs != 0 && elapsed < kWindowMs) return;
+      // After a silence the window restarts rather than averaging over it.
+      if (startMs != 0 && elapsed < 2 * kWindowMs) {
+        bitsPerSecond = (totalBytes - bytes) * 8000 / elapsed;
+        framesPerSecondMilli = static_cast<uint32_t>((totalFrames - frames) * 1000000 / elapsed);
+      } else {
+        bitsPerSecond = 0;
+        framesPerSecondMilli = 0;
+      }
+      startMs = nowMs;
+      bytes = totalBytes;
+      frames = totalFrames;
+    }
+  };
+
+  static RtspClientOptions withTransport(RtspClientOptions options, RtspTransport transport) {
+    options.transport = transport;
+    return options;
+  }
+
+  void count(int track, const RtpHeader& header) {
+    // One clock read per receive batch: packets read together arrived
+    // together as far as jitter can tell.
+    if (arrivalUs_ == 0) arrivalUs_ = monotonicUs();
+    rtp_[track].onPacket(header, arrivalUs_, static_cast<uint32_t>(media_[track].clockRate));
+    if (track == videoTrack_ && header.marker) ++frames_;
+  }
+
+  void sendReceiverReports() {
+    nextReportMs_ = loop_->nowMs() + kReceiverReportIntervalMs;
+    int64_t now = monotonicUs();
+    for (size_t i = 0; i < rtp_.size() && i < media_.size(); ++i) {
+      RtcpReportBlock block;
+      if (!rtp_[i].reportBlock(now, &block)) continue;
+      client_.sendRtcp(static_cast<int>(i), buildRtcpReceiverReport(rtcpSsrc_, block, kRtcpCname));
+    }
+  }
+
+  // One timer per camera, for the earliest gap any track waits on; it is
+  // only armed while one does.
+  void armReorderTimer() {
+    int64_t due = 0;
+    for (const auto& reorder : reorder_) {
+      int64_t deadline = reorder.deadlineUs();
+      if (deadline != 0 && (due == 0 || deadline < due)) due = deadline;
+    }
+    if (due == 0 || (reorderTimer_ != 0 && reorderTimerUs_ <= due)) return;
+    cancelReorderTimer();
+    reorderTimerUs_ = due;
+    reorderTimer_ = loop_->runAt(static_cast<uint64_t>((due + 999) / 1000), [this] {
+      reorderTimer_ = 0;
+      int64_t now = monotonicUs();
+      for (auto& reorder : reorder_) reorder.poll(now);
+      relay_.flush();
+      armReorderTimer();
+    });
+  }
+  void cancelReorderTimer() {
+    if (reorderTimer_ == 0) return;
+    loop_->cancel(reorderTimer_);
+    reorderTimer_ = 0;
+  }
+
+  EventLoop* loop_;
+  CameraConfig config_;
+  RtspClient client_;
+  StreamRelay relay_;
+  std::vector<SdpMedia> media_;  // as of the latest PLAY
+  SegmentWriter* writer_;
+  bool eventOnly_;
+  PreEventArena* preEvent_;
+  uint32_t preEventMs_;
+  size_t gopCacheBytes_;
+  RtpJitterBufferOptions jitterOptions_;
+  std::unique_ptr<CameraRecorder> recorder_;
+  int recordTrack_ = -1;
+  std::string recordEncoding_;
+
+  std::vector<RtpReceiveStats> rtp_;  // per track
+  std::vector<RtpJitterBuffer> reorder_;  // per track
+  EventLoop::TimerId reorderTimer_ = 0;
+  int64_t reorderTimerUs_ = 0;
+  int videoTrack_ = -1;
+  VideoCodec videoCodec_ = VideoCodec::Unknown;
+  uint64_t frames_ = 0;
+  int64_t arrivalUs_ = 0;  // of the current receive batch, 0 between batches
+  uint32_t rtcpSsrc_;  // ours, in receiver reports
+  uint64_t nextReportMs_ = 0;
+  RateWindow rate_;
+};
+
+namespace {
+
+std::string cameraGroupName(const std::string& cameraId) {
+  std::string name = "camera-";
+  for (char c : cameraId) {
+    bool safe = isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_' || c == '.';
+    name += safe ? c : '_';
+  }
+  return name;
+}
+
+}  // namespace
+
+// Per-loop camera table. Only touched from its loop's thread.
+struct IngestEngine::Shard {
+  EventLoop* loop = nullptr;
+  PacketPools pools;
+  std::unique_ptr<SharedUdpPort> sharedUdp;
+  RecordingStore* store = nullptr;
+  RecordingLayout layout = RecordingLayout::Striped;
+  std::unique_ptr<SegmentWriter> writer;  // this loop's recording group (striped)
+  std::unordered_map<std::string, std::unique_ptr<SegmentWriter>> cameraWriters;  // per-camera
+  std::unordered_map<std::string, std::unique_ptr<CameraSession>> cameras;
+
+  // The writer a camera records into, or null when not recording.
+  SegmentWriter* writerFor(const std::string& cameraId) {
+    if (store == nullptr || layout == RecordingLayout::Striped) return writer.get();
+    auto& slot = cameraWriters[cameraId];
+    if (!slot) {
+      slot = store->createWriter(loop, cameraGroupName(cameraId));
+      if (slot->open() < 0) {
+        cameraWriters.erase(cameraId);
+        return nullptr;
+      }
+    }
+    return slot.get();
+  }
+
+  // Seals a removed camera's group. Its session must already be queued for
+  // deletion, so the writer outlives the recorder.
+  void closeWriter(const std::string& cameraId) {
+    auto it = cameraWriters.find(cameraId);
+    if (it == cameraWriters.end()) return;
+    SegmentWriter* writer = it->second.release();
+    cameraWriters.erase(it);
+    EventLoop* l = loop;
+    writer->close([l, writer] { l->deleteLater(writer); });
+  }
+};
+
+IngestEngine::IngestEngine(const IngestOptions& options)
+    : options_(options), loops_(options.loops) {
+  for (int i = 0; i < loops_.size(); ++i) {
+    shards_.emplace_back(new Shard);
+    shards_.back()->loop = loops_.loop(i);
+    shards_.back()->store = options.recording;
+    shards_.back()->layout = options.recordingLayout;
+  }
+}
+
+IngestEngine::~IngestEngine() { stop(); }
+
+int IngestEngine::start() {
+  if (options_.sharedUdpPort != 0) {
+    UdpPortGroup group;
+    int rc = group.open(options_.sharedUdpPort, loops_.size());
+    if (rc < 0) {
+      NVR_ERROR("ingest: cannot open shared udp port %u: %s", options_.sharedUdpPort,
+                strerror(-rc));
+      return rc;
+    }
+    for (int i = 0; i < loops_.size(); ++i) {
+      int rtpFd, rtcpFd;
+      group.takeSockets(i, &rtpFd, &rtcpFd);
+      Shard* s = shards_[i].get();
+      uint16_t port = options_.sharedUdpPort;
+      // Receivers take their ring buffers from the loop's pool, so they are
+      // created on the loop thread.
+      s->loop->post([s, port, rtpFd, rtcpFd] {
+        s->sharedUdp.reset(new SharedUdpPort(s->loop, &s->pools.datagram, port, rtpFd, rtcpFd));
+      });
+    }
+  }
+  if (options_.recording && options_.recordingLayout == RecordingLayout::Striped) {
+    RecordingStore* store = options_.recording;
+    for (int i = 0; i < loops_.size(); ++i) {
+      Shard* s = shards_[i].get();
+      std::string group = "loop-" + std::to_string(i);
+      s->loop->post([s, store, group] {
+        s->writer = store->createWriter(s->loop, group);
+        if (s->writer->open() < 0) s->writer.reset();
+      });
+    }
+  }
+  loops_.start();
+  running_ = true;
+  return 0;
+}
+
+void IngestEngine::stop() {
+  if (!running_) return;
+  running_ = false;
+  std::vector<std::future<void>> closed;
+  for (auto& shard : shards_) {
+    Shard* s = shard.get();
+    auto promise = std::make_shared<std::promise<void>>();
+    closed.push_back(promise->get_future());
+    s->loop->post([s, promise] {
+      for (auto& kv : s->cameras) {
+        kv.second->stop();
+        s->loop->deleteLater(kv.second.release());
+      }
+      s->cameras.clear();
+      if (s->sharedUdp) s->loop->deleteLater(s->sharedUdp.release());
+      std::vector<SegmentWriter*> writers;
+      if (s->writer) writers.push_back(s->writer.get());
+      for (auto& kv : s->cameraWriters) writers.push_back(kv.second.get());
+      auto pending = std::make_shared<size_t>(writers.size() + 1);
+      auto closed = [pending, promise] {
+        if (--*pending == 0) promise->set_value();
+      };
+      for (SegmentWriter* writer : writers) writer->close(closed);
+      closed();
+    });
+  }
+  // The loops keep running until the recorders' last blocks are on disk.
+  for (auto& f : closed) f.wait();
+  loops_.stop();
+}
+
+int IngestEngine::shardFor(const CameraConfig& camera, bool* sharedUdp) const {
+  if (sharedUdp) *sharedUdp = false;
+  if (options_.sharedUdpPort != 0 && camera.transport == RtspTransport::Udp) {
+    Url url;
+    SocketAddress addr;
+    if (parseUrl(camera.url, &url) && resolveAddress(url.host, url.port, &addr) == 0) {
+      int loop = UdpPortGroup::loopForSource(addr, loops_.size());
+      if (loop >= 0) {
+        if (sharedUdp) *sharedUdp = true;
+        return loop;
+      }
+    }
+  }
+  return static_cast<int>(mix64(fnv1a64(camera.id)) % shards_.size());
+}
+
+IngestEngine::Shard* IngestEngine::shardOf(const std::string& cameraId) {
+  std::lock_guard<std::mutex> lock(placementMutex_);
+  auto it = placement_.find(cameraId);
+  return it == placement_.end() ? nullptr : shards_[it->second].get();
+}
+
+void IngestEngine::addCamera(const CameraConfig& camera) {
+  bool useShared = false;
+  int index = shardFor(camera, &useShared);
+  Shard* previous;
+  {
+    std::lock_guard<std::mutex> lock(placementMutex_);
+    auto it = placement_.find(camera.id);
+    previous = it == placement_.end() || it->second == index ? nullptr : shards_[it->second].get();
+    placement_[camera.id] = index;
+  }
+  // A changed URL can move a shared-port camera to another loop.
+  if (previous) {
+    std::string id = camera.id;
+    previous->loop->post([previous, id] {
+      auto it = previous->cameras.find(id);
+      if (it == previous->cameras.end()) return;
+      it->second->stop();
+      previous->loop->deleteLater(it->second.release());
+      previous->cameras.erase(it);
+      previous->closeWriter(id);
+    });
+  }
+
+  Shard* shard = shards_[index].get();
+  IngestOptions options = options_;
+  shard->loop->post([shard, camera, options, useShared] {
+    auto& slot = shard->cameras[camera.id];
+    if (slot) {
+      slot->stop();
+      shard->loop->deleteLater(slot.release());
+    }
+    slot.reset(new CameraSession(shard->loop, &shard->pools,
+                                 useShared ? shard->sharedUdp.get() : nullptr,
+                                 shard->writerFor(camera.id), camera, options));
+    slot->start();
+  });
+}
+
+void IngestEngine::removeCamera(const std::string& cameraId) {
+  Shard* shard;
+  {
+    std::lock_guard<std::mutex> lock(placementMutex_);
+    auto it = placement_.find(cameraId);
+    if (it == placement_.end()) return;
+    shard = shards_[it->second].get();
+    placement_.erase(it);
+  }
+  shard->loop->post([shard, cameraId] {
+    auto it = shard->cameras.find(cameraId);
+    if (it == shard->cameras.end()) return;
+    it->second->stop();
+    shard->loop->deleteLater(it->second.release());
+    shard->cameras.erase(it);
+    shard->closeWriter(cameraId);
+  });
+}
+
+void IngestEngine::triggerRecording(const std::string& cameraId, int64_t untilUs) {
+  Shard* shard = shardOf(cameraId);
+  if (shard == nullptr) return;
+  shard->loop->post([shard, cameraId, untilUs] {
+    auto it = shard->cameras.find(cameraId);
+    if (it != shard->cameras.end()) it->second->trigger(untilUs);
+  });
+}
+
+void IngestEngine::withRelay(const std::string& cameraId,
+                             std::function<void(EventLoop*, StreamRelay*)> fn) {
+  Shard* shard = shardOf(cameraId);
+  if (shard == nullptr) {
+    fn(nullptr, nullptr);
+    return;
+  }
+  shard->loop->post([shard, cameraId, fn] {
+    auto it = shard->cameras.find(cameraId);
+    fn(shard->loop, it == shard->cameras.end() ? nullptr : it->second->relay());
+  });
+}
+
+void IngestEngine::withStream(
+    const std::string& cameraId,
+    std::function<void(EventLoop*, StreamRelay*, const std::vector<SdpMedia>&)> fn) {
+  Shard* shard = shardOf(cameraId);
+  if (shard == nullptr) {
+    fn(nullptr, nullptr, std::vector<SdpMedia>());
+    return;
+  }
+  shard->loop->post([shard, cameraId, fn] {
+    auto it = shard->cameras.find(cameraId);
+    if (it == shard->cameras.end()) {
+      fn(shard->loop, nullptr, std::vector<SdpMedia>());
+      return;
+    }
+    fn(shard->loop, it->second->relay(), it->second->media());
+  });
+}
+
+IngestStats IngestEngine::stats() {
+  std::vector<std::future<IngestStats>> parts;
+  for (auto& shard : shards_) {
+    auto promise = std::make_shared<std::promise<IngestStats>>();
+    parts.push_back(promise->get_future());
+    Shard* s = shard.get();
+    s->loop->post([s, promise] {
+      IngestStats part;
+      for (const auto& kv : s->cameras) {
+        const RtspClient& client = kv.second->client();
+        ++part.cameras;
+        if (client.state() == RtspClient::State::Playing) ++part.playing;
+        part.rtpPackets += client.stats().rtpPackets;
+        part.rtpBytes += client.stats().rtpBytes;
+        part.rtcpPackets += client.stats().rtcpPackets;
+        part.reconnects += client.stats().reconnects;
+        part.bytesCarried += client.stats().bytesCarried;
+        part.udp.add(client.udpStats());
+        const RelayStats& relay = kv.second->relay()->stats();
+        part.relaySubscribers += kv.second->relay()->subscriberCount();
+        part.relayBytesOut += relay.bytesOut;
+        part.relayDrops += relay.drops;
+        part.gopCacheBytes += relay.gopCacheBytes;
+        part.gopCachePinnedBytes += relay.gopCachePinnedBytes;
+        if (const CameraRecorder* recorder = kv.second->recorder()) {
+          part.recordedFrames += recorder->stats().frames;
+          part.recordingTriggers += recorder->stats().triggers;
+        }
+      }
+      if (s->sharedUdp) part.udp.add(s->sharedUdp->stats());
+      if (s->writer) part.recording.add(s->writer->stats());
+      for (const auto& kv : s->cameraWriters) part.recording.add(kv.second->stats());
+      promise->set_value(part);
+    });
+  }
+  IngestStats total;
+  for (auto& f : parts) {
+    IngestStats part = f.get();
+    total.cameras += part.cameras;
+    total.playing += part.playing;
+    total.rtpPackets += part.rtpPackets;
+    total.rtpBytes += part.rtpBytes;
+    total.rtcpPackets += part.rtcpPackets;
+    total.reconnects += part.reconnects;
+    total.bytesCarried += part.bytesCarried;
+    total.relaySubscribers += part.relaySubscribers;
+    total.relayBytesOut += part.relayBytesOut;
+    total.relayDrops += part.relayDrops;
+    total.gopCacheBytes += part.gopCacheBytes;
+    total.gopCachePinnedBytes += part.gopCachePinnedBytes;
+    total.udp.add(part.udp);
+    total.recordedFrames += part.recordedFrames;
+    total.recordingTriggers += part.recordingTriggers;
+    total.recording.add(part.recording);
+  }
+  return total;
+}
+
+IngestMetrics IngestEngine::metrics() {
+  std::vector<std::future<IngestMetrics>> parts;
+  for (auto& shard : shards_) {
+    auto promise = std::make_shared<std::promise<IngestMetrics>>();
+    parts.push_back(promise->get_future());
+    Shard* s = shard.get();
+    s->loop->post([s, promise] {
+      IngestMetrics part;
+      int64_t now = wallClockUs();
+      part.cameras.reserve(s->cameras.size());
+      for (const auto& kv : s->cameras) part.cameras.push_back(kv.second->metrics(now));
+      if (s->writer) part.groups.push_back({s->writer->group(), s->writer->stats()});
+      for (const auto& kv : s->cameraWriters)
+        part.groups.push_back({kv.second->group(), kv.second->stats()});
+      promise->set_value(std::move(part));
+    });
+  }
+  IngestMetrics total;
+  for (auto& f : parts) {
+    IngestMetrics part = f.get();
+    if (total.cameras.empty()) {
+      total.cameras = std::move(part.cameras);
+    } else {
+      total.cameras.insert(total.cameras.end(), std::make_move_iterator(part.cameras.begin()),
+                           std::make_move_iterator(part.cameras.end()));
+    }
+    total.groups.insert(total.groups.end(), std::make_move_iterator(part.groups.begin()),
+                        std::make_move_iterator(part.groups.end()));
+  }
+  return total;
+}
+
+}  // namespace nvr
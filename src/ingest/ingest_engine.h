@@ -0,0 +1,198 @@
+// Camera ingest engine: terminates RTSP sessions for many cameras on a fixed
+// pool of per-core event loops.
+//
+// Each camera is sharded onto one loop by a stable hash of its id and lives
+// there for its whole lifetime. Shards share nothing, so adding cameras or
+// receiving media never takes a lock shared between loops.
+
+#ifndef NVR_INGEST_INGEST_ENGINE_H
+#define NVR_INGEST_INGEST_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "base/event_loop_pool.h"
+#include "relay/stream_relay.h"
+#include "rtp/rtp_jitter_buffer.h"
+#include "rtsp/rtsp_client.h"
+#include "storage/pre_event_buffer.h"
+#include "storage/recording_store.h"
+#include "storage/segment_writer.h"
+
+namespace nvr {
+
+struct CameraConfig {
+  std::string id;
+  std::string url;
+  RtspTransport transport = RtspTransport::Tcp;
+};
+
+struct IngestOptions {
+  int loops = 0;  // <= 0: one loop per CPU
+  RtspClientOptions rtsp;
+  // Non-zero (and even): UDP cameras send to this RTP port (and the next
+  // one for RTCP) on every loop instead of a port pair per session. The
+  // ports are opened with SO_REUSEPORT and steered per core by source
+  // address; see rtp/shared_udp_port.h.
+  uint16_t sharedUdpPort = 0;
+  // Every track's RTP goes through a reorder buffer before the relay and
+  // the recorder (see rtp/rtp_jitter_buffer.h). RTP over TCP cannot arrive
+  // out of order, so there a gap is loss at once whatever this says.
+  RtpJitterBufferOptions jitterBuffer;
+  // Each camera's relay keeps its latest GOP, up to this many bytes, so
+  // new viewers start at once (see StreamRelay::enableGopCache()). 0 turns
+  // the cache off.
+  size_t gopCacheBytes = StreamRelay::kDefaultGopCacheBytes;
+  // When set, every camera's video is recorded. With the striped layout
+  // each loop writes the cameras it owns into one recording group
+  // ("loop-<n>"), so a node's recorders produce one sequential write stream
+  // per core; per-camera gives every camera its own group ("camera-<id>").
+  RecordingStore* recording = nullptr;
+  RecordingLayout recordingLayout = RecordingLayout::Striped;
+  // Event-only recording: cameras write video only when triggered (see
+  // triggerRecording()). Until then each keeps preEventMs of video in a
+  // slot of preEvent, which may be shared with other engines; without an
+  // arena, or once its slots are gone, triggers record without pre-roll.
+  bool eventOnly = false;
+  PreEventArena* preEvent = nullptr;
+  uint32_t preEventMs = 10000;
+};
+
+struct IngestStats {
+  size_t cameras = 0;
+  size_t playing = 0;
+  uint64_t rtpPackets = 0;
+  uint64_t rtpBytes = 0;
+  uint64_t rtcpPackets = 0;
+  uint64_t reconnects = 0;
+  uint64_t bytesCarried = 0;
+  uint64_t relaySubscribers = 0;
+  uint64_t relayBytesOut = 0;
+  uint64_t relayDrops = 0;
+  uint64_t gopCacheBytes = 0;
+  uint64_t gopCachePinnedBytes = 0;
+  UdpReceiverStats udp;
+  uint64_t recordedFrames = 0;
+  uint64_t recordingTriggers = 0;
+  SegmentWriterStats recording;
+};
+
+// One camera as of a metrics scrape (IngestEngine::metrics()). Counters
+// run from the camera's creation; rates cover the last whole second.
+struct CameraMetrics {
+  std::string id;
+  bool playing = false;
+  uint64_t reconnects = 0;
+  uint64_t receiverReports = 0;   // RTCP RRs sent
+  uint64_t rtpPackets = 0;
+  uint64_t rtpBytes = 0;
+  uint64_t frames = 0;            // video frames received (RTP marker bit)
+  uint64_t bitsPerSecond = 0;     // RTP, all tracks
+  uint32_t framesPerSecondMilli = 0;
+  // RTP reception over all tracks (RFC 3550 A.1); jitter of the video track.
+  uint64_t packetsLost = 0;
+  uint64_t packetsReordered = 0;
+  uint32_t jitterUs = 0;
+  // The reorder buffers: the video track's current delay, and packets that
+  // came after they were given up on, all tracks.
+  uint32_t reorderDelayUs = 0;
+  uint64_t latePackets = 0;
+  bool recording = false;         // a recorder exists (after the first PLAY)
+  uint64_t recordedFrames = 0;
+  uint64_t skippedFrames = 0;
+  uint64_t corruptFrames = 0;     // of the skipped: broken by packet loss
+  // Frames are timed by the camera's clock through its RTCP sender reports,
+  // with this drift of its RTP clock and RMS error of the reports' fit.
+  bool senderTimed = false;
+  int32_t clockDriftPpb = 0;
+  uint32_t clockResidualUs = 0;
+  // Age of the newest frame on disk, while recording; -1 when not writing
+  // (event-only between triggers) or before the first write completed.
+  int64_t recorderLagUs = -1;
+  // The camera's part of its recording group's disk queue.
+  uint32_t diskQueueChunks = 0;
+  uint64_t diskQueueBytes = 0;    // written but not completed, plus filling
+};
+
+struct RecordingGroupMetrics {
+  std::string group;
+  SegmentWriterStats stats;
+};
+
+struct IngestMetrics {
+  std::vector<CameraMetrics> cameras;
+  std::vector<RecordingGroupMetrics> groups;
+};
+
+class IngestEngine {
+ public:
+  explicit IngestEngine(const IngestOptions& options = IngestOptions());
+  ~IngestEngine();
+
+  IngestEngine(const IngestEngine&) = delete;
+  IngestEngine& operator=(const IngestEngine&) = delete;
+
+  // Returns 0, or -errno when the shared UDP ports cannot be opened.
+  int start();
+  // Stops every camera and waits until recordings are sealed on disk.
+  void stop();
+
+  // Thread-safe. The camera is created on its shard's loop; re-adding an id
+  // replaces the previous session.
+  void addCamera(const CameraConfig& camera);
+  void removeCamera(const std::string& cameraId);
+
+  // Thread-safe. In event-only mode, writes the camera's pre-roll and
+  // records until untilUs (wall clock); ignored otherwise.
+  void triggerRecording(const std::string& cameraId, int64_t untilUs);
+
+  // Runs fn on the camera's loop with its live relay (nullptr when the camera
+  // is unknown). This is how viewers attach to a stream.
+  void withRelay(const std::string& cameraId, std::function<void(EventLoop*, StreamRelay*)> fn);
+  // Same, along with the tracks the camera announced at its latest PLAY
+  // (empty before the first one).
+  void withStream(
+      const std::string& cameraId,
+      std::function<void(EventLoop*, StreamRelay*, const std::vector<SdpMedia>&)> fn);
+
+  // Collects counters from every shard. Blocks until all loops answered, so
+  // it must not be called from a loop thread.
+  IngestStats stats();
+  // Every camera and recording group, in no particular order. Blocks like
+  // stats(); the loops only copy counters, formatting is up to the caller.
+  IngestMetrics metrics();
+
+  // Shard a camera runs on. Cameras on the shared UDP port must live where
+  // the kernel steers their datagrams (by source address); all others go by
+  // a stable hash of the id. May resolve the camera host name.
+  int shardFor(const CameraConfig& camera, bool* sharedUdp = nullptr) const;
+  EventLoopPool& loops() { return loops_; }
+
+ private:
+  class CameraSession;
+  struct Shard;
+
+  Shard* shardOf(const std::string& cameraId);
+
+  IngestOptions options_;
+  bool running_ = false;
+  // Camera id -> shard index. Control plane only (add/remove/lookup); the
+  // media path never touches it.
+  std::mutex placementMutex_;
+  std::unordered_map<std::string, int> placement_;
+  // Shards (and their buffer pools) are declared before the loops so that
+  // they outlive sessions destroyed while the loops shut down.
+  std::vector<std::unique_ptr<Shard>> shards_;
+  EventLoopPool loops_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_INGEST_INGEST_ENGINE_H
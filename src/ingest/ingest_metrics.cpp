@@ -0,0 +1,218 @@
+#include "ingest/ingest_metrics.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace nvr {
+
+namespace {
+
+// One family over every camera. get returns the sample, or false to leave
+// the camera out of this family.
+template <typename Get>
+void cameraFamily(MetricsWriter* out, const IngestMetrics& metrics,
+                  const std::vector<std::string_view>& labels, const char* name, const char* type,
+                  const char* help, Get get) {
+  out->family(name, type, help);
+  for (size_t i = 0; i < metrics.cameras.size(); ++i) {
+    uint64_t value;
+    if (get(metrics.cameras[i], &value)) out->sample(labels[i], value);
+  }
+}
+
+// Same for fixed point values with the given decimals.
+template <typename Get>
+void cameraFixedFamily(MetricsWriter* out, const IngestMetrics& metrics,
+                       const std::vector<std::string_view>& labels, const char* name,
+                       const char* help, int decimals, Get get) {
+  out->family(name, "gauge", help);
+  for (size_t i = 0; i < metrics.cameras.size(); ++i) {
+    int64_t value;
+    if (get(metrics.cameras[i], &value)) out->sampleFixed(labels[i], value, decimals);
+  }
+}
+
+template <typename Get>
+void groupFamily(MetricsWriter* out, const IngestMetrics& metrics,
+                 const std::vector<std::string_view>& labels, const char* name, const char* type,
+                 const char* help, Get get) {
+  out->family(name, type, help);
+  for (size_t i = 0; i < metrics.groups.size(); ++i)
+    out->sample(labels[i], get(metrics.groups[i].stats));
+}
+
+}  // namespace
+
+void writeIngestMetrics(const IngestMetrics& metrics, MetricsWriter* out) {
+  using C = CameraMetrics;
+  // Every camera's labels escaped once, back to back in one buffer, so that
+  // each family's pass over them reads memory in order.
+  std::string labelText;
+  std::vector<size_t> labelEnds;
+  labelEnds.reserve(metrics.cameras.size());
+  for (const auto& camera : metrics.cameras) {
+    labelText += MetricsWriter::label("camera", camera.id);
+    labelEnds.push_back(labelText.size());
+  }
+  std::vector<std::string_view> labels;
+  labels.reserve(labelEnds.size());
+  size_t begin = 0;
+  for (size_t end : labelEnds) {
+    labels.emplace_back(labelText.data() + begin, end - begin);
+    begin = end;
+  }
+  // Grow the output once: some 22 samples of about 48 bytes plus labels
+  // per camera.
+  size_t perCamera = 22 * (48 + (labels.empty() ? 0 : labels[0].size()));
+  out->out()->reserve(out->out()->size() + metrics.cameras.size() * perCamera);
+
+  cameraFamily(out, metrics, labels, "nvr_camera_up", "gauge",
+               "1 while the camera's RTSP session is playing.", [](const C& c, uint64_t* v) {
+                 *v = c.playing ? 1 : 0;
+                 return true;
+               });
+  cameraFamily(out, metrics, labels, "nvr_camera_reconnects_total", "counter",
+               "RTSP sessions re-established.", [](const C& c, uint64_t* v) {
+                 *v = c.reconnects;
+                 return true;
+               });
+  cameraFamily(out, metrics, labels, "nvr_camera_rtcp_receiver_reports_total", "counter",
+               "RTCP receiver reports sent to the camera.", [](const C& c, uint64_t* v) {
+                 *v = c.receiverReports;
+                 return true;
+               });
+  cameraFamily(out, metrics, labels, "nvr_camera_rtp_packets_total", "counter",
+               "RTP packets received, all tracks.", [](const C& c, uint64_t* v) {
+                 *v = c.rtpPackets;
+                 return true;
+               });
+  cameraFamily(out, metrics, labels, "nvr_camera_rtp_bytes_total", "counter",
+               "RTP bytes received, all tracks.", [](const C& c, uint64_t* v) {
+                 *v = c.rtpBytes;
+                 return true;
+               });
+  cameraFamily(out, metrics, labels, "nvr_camera_receive_bits_per_second", "gauge",
+               "RTP bitrate over the last second.", [](const C& c, uint64_t* v) {
+                 *v = c.bitsPerSecond;
+                 return true;
+               });
+  cameraFamily(out, metrics, labels, "nvr_camera_frames_total", "counter",
+               "Video frames received.", [](const C& c, uint64_t* v) {
+                 *v = c.frames;
+                 return true;
+               });
+  cameraFixedFamily(out, metrics, labels, "nvr_camera_frames_per_second",
+                    "Video frame rate over the last second.", 3, [](const C& c, int64_t* v) {
+                      *v = c.framesPerSecondMilli;
+                      return true;
+                    });
+  cameraFamily(out, metrics, labels, "nvr_camera_rtp_packets_lost", "gauge",
+               "RTP packets expected but not received (RFC 3550 cumulative loss).",
+               [](const C& c, uint64_t* v) {
+                 *v = c.packetsLost;
+                 return true;
+               });
+  cameraFamily(out, metrics, labels, "nvr_camera_rtp_packets_reordered_total", "counter",
+               "RTP packets that arrived after a later one.", [](const C& c, uint64_t* v) {
+                 *v = c.packetsReordered;
+                 return true;
+               });
+  cameraFixedFamily(out, metrics, labels, "nvr_camera_rtp_jitter_seconds",
+                    "Interarrival jitter of the video track (RFC 3550).", 6,
+                    [](const C& c, int64_t* v) {
+                      *v = c.jitterUs;
+                      return true;
+                    });
+  cameraFixedFamily(out, metrics, labels, "nvr_camera_reorder_delay_seconds",
+                    "How long the video track's reorder buffer waits on a gap.", 6,
+                    [](const C& c, int64_t* v) {
+                      *v = c.reorderDelayUs;
+                      return true;
+                    });
+  cameraFamily(out, metrics, labels, "nvr_camera_rtp_packets_late_total", "counter",
+               "RTP packets that arrived after the reorder buffer gave up on them.",
+               [](const C& c, uint64_t* v) {
+                 *v = c.latePackets;
+                 return true;
+               });
+
+  cameraFamily(out, metrics, labels, "nvr_camera_recorded_frames_total", "counter",
+               "Video frames written to the recording.", [](const C& c, uint64_t* v) {
+                 *v = c.recordedFrames;
+                 return c.recording;
+               });
+  cameraFamily(out, metrics, labels, "nvr_camera_record_skipped_frames_total", "counter",
+               "Video frames not recorded: waiting for a keyframe, broken by packet loss, or "
+               "dropped by the writer.",
+               [](const C& c, uint64_t* v) {
+                 *v = c.skippedFrames;
+                 return c.recording;
+               });
+  cameraFamily(out, metrics, labels, "nvr_camera_corrupt_frames_total", "counter",
+               "Video frames that lost packets, not recorded.", [](const C& c, uint64_t* v) {
+                 *v = c.corruptFrames;
+                 return c.recording;
+               });
+  cameraFamily(out, metrics, labels, "nvr_camera_sender_timed", "gauge",
+               "1 while recorded frames are timed by the camera's clock (RTCP sender "
+               "reports), 0 while by their arrival.",
+               [](const C& c, uint64_t* v) {
+                 *v = c.senderTimed ? 1 : 0;
+                 return c.recording;
+               });
+  cameraFixedFamily(out, metrics, labels, "nvr_camera_clock_drift_ppm",
+                    "Rate of the camera's RTP clock against nominal, from its sender reports.", 3,
+                    [](const C& c, int64_t* v) {
+                      *v = c.clockDriftPpb;
+                      return c.senderTimed;
+                    });
+  cameraFixedFamily(out, metrics, labels, "nvr_camera_clock_fit_error_seconds",
+                    "RMS distance of the camera's sender reports from the fitted clock.", 6,
+                    [](const C& c, int64_t* v) {
+                      *v = c.clockResidualUs;
+                      return c.senderTimed;
+                    });
+  cameraFixedFamily(out, metrics, labels, "nvr_camera_recorder_lag_seconds",
+                    "Age of the camera's newest frame on disk, while recording.", 6,
+                    [](const C& c, int64_t* v) {
+                      *v = c.recorderLagUs;
+                      return c.recorderLagUs >= 0;
+                    });
+  cameraFamily(out, metrics, labels, "nvr_camera_disk_queue_chunks", "gauge",
+               "The camera's chunks written to disk but not completed.",
+               [](const C& c, uint64_t* v) {
+                 *v = c.diskQueueChunks;
+                 return c.recording;
+               });
+  cameraFamily(out, metrics, labels, "nvr_camera_disk_queue_bytes", "gauge",
+               "The camera's recorded bytes not on disk yet, filling or in flight.",
+               [](const C& c, uint64_t* v) {
+                 *v = c.diskQueueBytes;
+                 return c.recording;
+               });
+
+  if (metrics.groups.empty()) return;
+  using G = SegmentWriterStats;
+  std::vector<std::string> groupLabels;
+  for (const auto& group : metrics.groups)
+    groupLabels.push_back(MetricsWriter::label("group", group.group));
+  std::vector<std::string_view> groups(groupLabels.begin(), groupLabels.end());
+  groupFamily(out, metrics, groups, "nvr_recording_records_total", "counter",
+              "Records appended to the group.", [](const G& g) { return g.records; });
+  groupFamily(out, metrics, groups, "nvr_recording_dropped_records_total", "counter",
+              "Records dropped: no chunk buffer free, or a failed segment roll.",
+              [](const G& g) { return g.droppedRecords; });
+  groupFamily(out, metrics, groups, "nvr_recording_written_bytes_total", "counter",
+              "Bytes written, headers and padding included.",
+              [](const G& g) { return g.bytesWritten; });
+  groupFamily(out, metrics, groups, "nvr_recording_write_errors_total", "counter",
+              "Failed or short block writes.", [](const G& g) { return g.writeErrors; });
+  groupFamily(out, metrics, groups, "nvr_recording_segments_total", "counter",
+              "Segments opened.", [](const G& g) { return g.segments; });
+  groupFamily(out, metrics, groups, "nvr_recording_buffers_in_flight", "gauge",
+              "Chunks written to disk but not completed.",
+              [](const G& g) { return static_cast<uint64_t>(g.buffersInFlight); });
+}
+
+}  // namespace nvr
@@ -0,0 +1,21 @@
+// Ingest metrics in Prometheus text format, for MetricsServer.
+//
+// Per camera (label camera="<id>"): session state and reconnects, RTP
+// packets, bytes, bitrate, frames and frame rate, loss, reordering and
+// jitter; for recorded cameras also frames recorded and skipped, recorder
+// lag and the camera's part of the disk queue. Per recording group (label
+// group="<name>"): the SegmentWriter's counters.
+
+#ifndef NVR_INGEST_INGEST_METRICS_H
+#define NVR_INGEST_INGEST_METRICS_H
+
+#include "ingest/ingest_engine.h"
+#include "metrics/metrics_writer.h"
+
+namespace nvr {
+
+void writeIngestMetrics(const IngestMetrics& metrics, MetricsWriter* out);
+
+}  // namespace nvr
+
+#endif  // NVR_INGEST_INGEST_METRICS_H
@@ -0,0 +1,47 @@
+#include "ingest/live_media_provider.h"
+
+#include <future>
+
+namespace nvr {
+
+LiveMediaProvider::LiveMediaProvider(IngestEngine* ingest, const RtspSessionOptions& options)
+    : ingest_(ingest), options_(options) {
+  for (int i = 0; i < ingest_->loops().size(); ++i) stats_.emplace_back(new RtspSessionStats);
+}
+
+void LiveMediaProvider::describe(const std::string& path, const std::string& query,
+                                 DescribeCallback done) {
+  ingest_->withStream(path, [done](EventLoop*, StreamRelay* relay,
+                                   const std::vector<SdpMedia>& media) {
+    // Not playing yet, or not at all: nothing to announce.
+    done(relay && !media.empty() ? 200 : 404, media);
+  });
+}
+
+void LiveMediaProvider::play(RtspPlayRequest request) {
+  ingest_->withStream(request.path, [this, request](EventLoop* loop, StreamRelay* relay,
+                                                    const std::vector<SdpMedia>& media) mutable {
+    if (relay == nullptr || media.size() != request.tracks.size()) {
+      // Gone, or reconnected with other tracks since DESCRIBE.
+      rejectRtspPlay(&request, 454);
+      return;
+    }
+    auto* session = new RtspServerSession(loop, &request, options_, stats_[loop->index()].get());
+    relay->addSubscriber(std::unique_ptr<RelaySubscriber>(session));
+  });
+}
+
+RtspSessionStats LiveMediaProvider::stats() {
+  std::vector<std::future<RtspSessionStats>> parts;
+  for (int i = 0; i < ingest_->loops().size(); ++i) {
+    auto promise = std::make_shared<std::promise<RtspSessionStats>>();
+    parts.push_back(promise->get_future());
+    RtspSessionStats* part = stats_[i].get();
+    ingest_->loops().loop(i)->post([part, promise] { promise->set_value(*part); });
+  }
+  RtspSessionStats total;
+  for (auto& f : parts) total.add(f.get());
+  return total;
+}
+
+}  // namespace nvr
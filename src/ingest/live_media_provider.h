@@ -0,0 +1,42 @@
+// Live video for the RTSP server: "/live/<camera id>".
+//
+// DESCRIBE announces the tracks the camera itself announced, unchanged, so
+// its RTP can be relayed as it is. At PLAY the viewer's session is created
+// on the camera's loop and added to its StreamRelay, which sends it the
+// cached GOP first and then fans the camera's packets out to it by
+// reference like to every other viewer.
+
+#ifndef NVR_INGEST_LIVE_MEDIA_PROVIDER_H
+#define NVR_INGEST_LIVE_MEDIA_PROVIDER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ingest/ingest_engine.h"
+#include "rtsp/rtsp_server.h"
+
+namespace nvr {
+
+class LiveMediaProvider : public RtspMediaProvider {
+ public:
+  // Sessions live as long as their camera's relay, so the provider must
+  // outlive ingest->stop().
+  LiveMediaProvider(IngestEngine* ingest, const RtspSessionOptions& options);
+
+  void describe(const std::string& path, const std::string& query,
+                DescribeCallback done) override;
+  void play(RtspPlayRequest request) override;
+
+  // Totals over the ingest loops. Blocks; not from a loop thread.
+  RtspSessionStats stats();
+
+ private:
+  IngestEngine* ingest_;
+  RtspSessionOptions options_;
+  std::vector<std::unique_ptr<RtspSessionStats>> stats_;  // by loop index
+};
+
+}  // namespace nvr
+
+#endif  // NVR_INGEST_LIVE_MEDIA_PROVIDER_H
@@ -0,0 +1,95 @@
+#include "media/frame_assembler.h"
+
+namespace nvr {
+
+namespace {
+
+const uint8_t kStartCode[4] = {0, 0, 0, 1};
+
+}  // namespace
+
+FrameAssembler::FrameAssembler(VideoCodec codec, FrameHandler* handler)
+    : codec_(codec), handler_(handler) {
+  frame_.reserve(256 * 1024);
+}
+
+void FrameAssembler::reset() {
+  clearFrame();
+  nextCorrupt_ = false;
+}
+
+void FrameAssembler::clearFrame() {
+  frame_.clear();
+  inFrame_ = false;
+  keyframe_ = false;
+  hasVcl_ = false;
+  reference_ = false;
+  corrupt_ = false;
+  hasParameterSets_ = false;
+}
+
+bool FrameAssembler::takeParameterSetsChanged() {
+  bool changed = parameterSetsChanged_;
+  parameterSetsChanged_ = false;
+  return changed;
+}
+
+void FrameAssembler::appendNal(const uint8_t* data, size_t size) {
+  frame_.insert(frame_.end(), kStartCode, kStartCode + 4);
+  frame_.insert(frame_.end(), data, data + size);
+}
+
+void FrameAssembler::onNal(const NalUnit& nal) {
+  if (inFrame_ && nal.timestamp != timestamp_) emit();
+  if (!inFrame_) {
+    inFrame_ = true;
+    timestamp_ = nal.timestamp;
+    corrupt_ = nextCorrupt_;
+    nextCorrupt_ = false;
+  }
+  if (isParameterSetNal(codec_, nal.type)) {
+    hasParameterSets_ = true;
+    if (parameterSets_.update(codec_, nal)) parameterSetsChanged_ = true;
+  } else if (isVclNal(codec_, nal.type)) {
+    hasVcl_ = true;
+    if (isKeyframeNal(codec_, nal.type)) keyframe_ = true;
+    if (isReferenceNal(codec_, nal.data)) reference_ = true;
+  }
+  appendNal(nal.data, nal.size);
+  if (nal.endOfAccessUnit) emit();
+}
+
+void FrameAssembler::onLoss(uint32_t timestamp) {
+  // A gap within the current frame's timestamp broke only that frame. One
+  // before a new timestamp may have taken the current frame's tail, the
+  // next frame's head or both, so both are marked.
+  if (inFrame_) {
+    corrupt_ = true;
+    if (timestamp == timestamp_) return;
+  }
+  nextCorrupt_ = true;
+}
+
+void FrameAssembler::emit() {
+  if (hasVcl_) {
+    if (keyframe_ && !hasParameterSets_ && parameterSets_.complete(codec_)) {
+      std::vector<uint8_t>::iterator at = frame_.begin();
+      for (const std::string* ps : {&parameterSets_.vps, &parameterSets_.sps, &parameterSets_.pps}) {
+        if (ps->empty()) continue;
+        at = frame_.insert(at, kStartCode, kStartCode + 4) + 4;
+        at = frame_.insert(at, ps->begin(), ps->end()) + ps->size();
+      }
+    }
+    Frame frame;
+    frame.data = frame_.data();
+    frame.size = frame_.size();
+    frame.rtpTimestamp = timestamp_;
+    frame.keyframe = keyframe_;
+    frame.reference = reference_;
+    frame.corrupt = corrupt_;
+    handler_->onFrame(frame);
+  }
+  clearFrame();
+}
+
+}  // namespace nvr
@@ -0,0 +1,81 @@
+// Groups NAL units into access units (video frames) in Annex-B form.
+//
+// A frame ends at the RTP marker bit or when the timestamp changes. The
+// assembled frame lives in a buffer that is reused for every frame, and is
+// only valid during the callback. Keyframes that arrive without in-band
+// parameter sets get the latest ones prepended, so every recorded or cached
+// keyframe can be decoded on its own.
+//
+// Packet loss (NalHandler::onLoss()) marks the frame it fell into as
+// corrupt: the one being assembled, or the next one when the loss lies
+// between frames or past the current frame's timestamp. A corrupt frame is
+// still delivered; what follows it references a broken picture, so a
+// consumer that wants a clean stream skips to the next keyframe.
+
+#ifndef NVR_MEDIA_FRAME_ASSEMBLER_H
+#define NVR_MEDIA_FRAME_ASSEMBLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "media/nal.h"
+
+namespace nvr {
+
+struct Frame {
+  const uint8_t* data = nullptr;  // Annex-B, 4-byte start codes
+  size_t size = 0;
+  uint32_t rtpTimestamp = 0;
+  bool keyframe = false;
+  // False when every slice is a non-reference one (droppable).
+  bool reference = true;
+  // Packets of it were lost.
+  bool corrupt = false;
+};
+
+class FrameHandler {
+ public:
+  virtual ~FrameHandler() = default;
+  virtual void onFrame(const Frame& frame) = 0;
+};
+
+class FrameAssembler : public NalHandler {
+ public:
+  FrameAssembler(VideoCodec codec, FrameHandler* handler);
+
+  void onNal(const NalUnit& nal) override;
+  void onLoss(uint32_t timestamp) override;
+  // Drops a partially assembled frame (after a reconnect).
+  void reset();
+
+  const ParameterSets& parameterSets() const { return parameterSets_; }
+  // Seeds the parameter sets announced out of band (SDP sprop-*).
+  void setParameterSets(const ParameterSets& sets) { parameterSets_ = sets; }
+  // True once after the parameter sets changed.
+  bool takeParameterSetsChanged();
+
+ private:
+  void emit();
+  void clearFrame();
+  void appendNal(const uint8_t* data, size_t size);
+
+  const VideoCodec codec_;
+  FrameHandler* handler_;
+  std::vector<uint8_t> frame_;
+  bool inFrame_ = false;
+  uint32_t timestamp_ = 0;
+  bool keyframe_ = false;
+  bool hasVcl_ = false;
+  bool reference_ = false;
+  bool corrupt_ = false;
+  bool nextCorrupt_ = false;  // a loss before the next frame's first unit
+  bool hasParameterSets_ = false;
+  ParameterSets parameterSets_;
+  bool parameterSetsChanged_ = false;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_MEDIA_FRAME_ASSEMBLER_H
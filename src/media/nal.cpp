@@ -0,0 +1,212 @@
+#include "media/nal.h"
+
+#include <stdio.h>
+
+#include "base/base64.h"
+#include "media/start_code.h"
+#include "rtsp/rtsp_message.h"
+
+namespace nvr {
+
+namespace {
+
+void deliverUnit(VideoCodec codec, NalHandler* handler, const uint8_t* data, size_t size) {
+  // Zero bytes before the next start code are trailing_zero_8bits or the
+  // first byte of a four-byte start code, not part of the unit.
+  while (size > 0 && data[size - 1] == 0) --size;
+  if (size < nalHeaderSize(codec)) return;
+  NalUnit nal;
+  nal.data = data;
+  nal.size = size;
+  nal.type = nalType(codec, data);
+  handler->onNal(nal);
+}
+
+}  // namespace
+
+VideoCodec videoCodecFromEncoding(const std::string& encoding) {
+  if (equalsIgnoreCase(encoding, "H264")) return VideoCodec::H264;
+  if (equalsIgnoreCase(encoding, "H265") || equalsIgnoreCase(encoding, "HEVC"))
+    return VideoCodec::H265;
+  return VideoCodec::Unknown;
+}
+
+bool isKeyframeNal(VideoCodec codec, int type) {
+  if (codec == VideoCodec::H265) return type >= h265::kBlaWLp && type <= h265::kCraNut;
+  return type == h264::kIdr;
+}
+
+bool isParameterSetNal(VideoCodec codec, int type) {
+  if (codec == VideoCodec::H265) return type >= h265::kVps && type <= h265::kPps;
+  return type == h264::kSps || type == h264::kPps;
+}
+
+bool isVclNal(VideoCodec codec, int type) {
+  if (codec == VideoCodec::H265) return type < 32;
+  return type >= h264::kSlice && type <= h264::kIdr;
+}
+
+bool isReferenceNal(VideoCodec codec, const uint8_t* nal) {
+  if (codec == VideoCodec::H265) {
+    // TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N and the reserved RSV_VCL_N10/12/14.
+    int type = nalType(codec, nal);
+    return !(type < 16 && type % 2 == 0);
+  }
+  return (nal[0] & 0x60) != 0;
+}
+
+bool ParameterSets::update(VideoCodec codec, const NalUnit& nal) {
+  std::string* slot = nullptr;
+  if (codec == VideoCodec::H265) {
+    if (nal.type == h265::kVps) slot = &vps;
+    if (nal.type == h265::kSps) slot = &sps;
+    if (nal.type == h265::kPps) slot = &pps;
+  } else {
+    if (nal.type == h264::kSps) slot = &sps;
+    if (nal.type == h264::kPps) slot = &pps;
+  }
+  if (slot == nullptr) return false;
+  if (slot->size() == nal.size && slot->compare(0, nal.size, reinterpret_cast<const char*>(nal.data),
+                                                nal.size) == 0)
+    return false;
+  slot->assign(reinterpret_cast<const char*>(nal.data), nal.size);
+  return true;
+}
+
+bool ParameterSets::complete(VideoCodec codec) const {
+  if (sps.empty() || pps.empty()) return false;
+  return codec != VideoCodec::H265 || !vps.empty();
+}
+
+bool parseSpropParameterSets(VideoCodec codec, const std::string& fmtp, ParameterSets* out) {
+  bool found = false;
+  for (const auto& param : splitParameters(fmtp)) {
+    bool wanted = codec == VideoCodec::H265
+                      ? param.first == "sprop-vps" || param.first == "sprop-sps" ||
+                            param.first == "sprop-pps"
+                      : param.first == "sprop-parameter-sets";
+    if (!wanted) continue;
+    size_t start = 0;
+    while (start <= param.second.size()) {
+      size_t comma = param.second.find(',', start);
+      if (comma == std::string::npos) comma = param.second.size();
+      std::string decoded;
+      if (base64Decode(param.second.substr(start, comma - start), &decoded) &&
+          decoded.size() >= nalHeaderSize(codec)) {
+        NalUnit nal;
+        nal.data = reinterpret_cast<const uint8_t*>(decoded.data());
+        nal.size = decoded.size();
+        nal.type = nalType(codec, nal.data);
+        out->update(codec, nal);
+        found = true;
+      }
+      start = comma + 1;
+    }
+  }
+  return found;
+}
+
+std::string formatSdpFmtp(VideoCodec codec, const ParameterSets& sets) {
+  if (codec == VideoCodec::H265) {
+    std::string out;
+    if (!sets.vps.empty()) out += "sprop-vps=" + base64Encode(sets.vps) + ";";
+    if (!sets.sps.empty()) out += "sprop-sps=" + base64Encode(sets.sps) + ";";
+    if (!sets.pps.empty()) out += "sprop-pps=" + base64Encode(sets.pps) + ";";
+    if (!out.empty()) out.pop_back();
+    return out;
+  }
+  std::string out = "packetization-mode=1";
+  if (sets.sps.size() >= 4) {
+    char level[32];
+    snprintf(level, sizeof(level), ";profile-level-id=%02x%02x%02x",
+             static_cast<uint8_t>(sets.sps[1]), static_cast<uint8_t>(sets.sps[2]),
+             static_cast<uint8_t>(sets.sps[3]));
+    out += level;
+  }
+  if (!sets.sps.empty() && !sets.pps.empty())
+    out += ";sprop-parameter-sets=" + base64Encode(sets.sps) + "," + base64Encode(sets.pps);
+  return out;
+}
+
+AnnexBParser::AnnexBParser(VideoCodec codec, NalHandler* handler)
+    : codec_(codec), handler_(handler) {}
+
+void AnnexBParser::reset() {
+  inUnit_ = false;
+  pending_.clear();
+}
+
+void AnnexBParser::deliver(const uint8_t* data, size_t size) {
+  deliverUnit(codec_, handler_, data, size);
+}
+
+void AnnexBParser::push(const uint8_t* data, size_t size) {
+  const uint8_t* p = data;
+  const uint8_t* end = data + size;
+  if (size == 0) return;
+
+  if (!pending_.empty()) {
+    // The start code ending the pending unit may straddle the boundary.
+    size_t n = pending_.size();
+    const uint8_t* tail = pending_.data() + n;
+    size_t straddle = 0;
+    if (n >= 2 && tail[-2] == 0 && tail[-1] == 0 && p[0] == 1) {
+      straddle = 1;
+    } else if (tail[-1] == 0 && size >= 2 && p[0] == 0 && p[1] == 1) {
+      straddle = 2;
+    }
+    if (straddle) {
+      pending_.resize(n - (3 - straddle));
+      p += straddle;
+    } else {
+      const uint8_t* q = findStartCode(p, end);
+      if (q == end) {
+        pending_.insert(pending_.end(), p, end);
+        if (!inUnit_ && pending_.size() > 2) pending_.erase(pending_.begin(), pending_.end() - 2);
+        return;
+      }
+      pending_.insert(pending_.end(), p, q);
+      p = q + 3;
+    }
+    if (inUnit_) deliver(pending_.data(), pending_.size());
+    pending_.clear();
+    inUnit_ = true;
+  }
+
+  if (!inUnit_) {
+    const uint8_t* q = findStartCode(p, end);
+    if (q == end) {
+      pending_.assign(end - p > 2 ? end - 2 : p, end);
+      return;
+    }
+    inUnit_ = true;
+    p = q + 3;
+  }
+
+  for (;;) {
+    const uint8_t* q = findStartCode(p, end);
+    if (q == end) {
+      pending_.assign(p, end);
+      return;
+    }
+    deliver(p, q - p);
+    p = q + 3;
+  }
+}
+
+void AnnexBParser::flush() {
+  if (inUnit_ && !pending_.empty()) deliver(pending_.data(), pending_.size());
+  reset();
+}
+
+void AnnexBParser::split(VideoCodec codec, const uint8_t* data, size_t size, NalHandler* handler) {
+  const uint8_t* end = data + size;
+  const uint8_t* p = findStartCode(data, end);
+  while (p != end) {
+    const uint8_t* unit = p + 3;
+    p = findStartCode(unit, end);
+    deliverUnit(codec, handler, unit, (p == end ? end : p) - unit);
+  }
+}
+
+}  // namespace nvr
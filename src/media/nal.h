@@ -0,0 +1,117 @@
+// H.264 / H.265 NAL units and Annex-B byte stream splitting.
+//
+// NalUnit is a view: its bytes belong to the input buffer (or to the
+// parser's reassembly buffer) and are only valid during the callback.
+// Parsers keep their scratch buffers across units, so after warm-up no heap
+// allocation happens per frame.
+
+#ifndef NVR_MEDIA_NAL_H
+#define NVR_MEDIA_NAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace nvr {
+
+enum class VideoCodec { Unknown, H264, H265 };
+
+// From an SDP rtpmap encoding name ("H264", "H265", "HEVC").
+VideoCodec videoCodecFromEncoding(const std::string& encoding);
+
+namespace h264 {
+enum NalType : int { kSlice = 1, kIdr = 5, kSei = 6, kSps = 7, kPps = 8, kAud = 9 };
+}  // namespace h264
+
+namespace h265 {
+enum NalType : int {
+  kBlaWLp = 16,
+  kCraNut = 21,
+  kVps = 32,
+  kSps = 33,
+  kPps = 34,
+  kAud = 35,
+  kPrefixSei = 39,
+};
+}  // namespace h265
+
+struct NalUnit {
+  const uint8_t* data = nullptr;  // NAL header onwards, no start code
+  size_t size = 0;
+  int type = 0;
+  // From RTP input; zero / false for Annex-B input.
+  uint32_t timestamp = 0;
+  bool endOfAccessUnit = false;  // last unit of an RTP packet with the marker bit
+};
+
+// NAL header size in bytes (1 for H.264, 2 for H.265).
+inline size_t nalHeaderSize(VideoCodec codec) { return codec == VideoCodec::H265 ? 2 : 1; }
+inline int nalType(VideoCodec codec, const uint8_t* nal) {
+  return codec == VideoCodec::H265 ? (nal[0] >> 1) & 0x3f : nal[0] & 0x1f;
+}
+// IDR (H.264) or IRAP (H.265) slices: decoding can start here.
+bool isKeyframeNal(VideoCodec codec, int type);
+bool isParameterSetNal(VideoCodec codec, int type);
+bool isVclNal(VideoCodec codec, int type);
+// False for slices no other picture predicts from (nal_ref_idc == 0 in
+// H.264, sub-layer non-reference types in H.265); those can be dropped
+// without breaking decoding of the rest of the GOP.
+bool isReferenceNal(VideoCodec codec, const uint8_t* nal);
+
+// Latest VPS/SPS/PPS of a stream, without start codes.
+struct ParameterSets {
+  std::string vps;  // H.265 only
+  std::string sps;
+  std::string pps;
+
+  // Stores nal if it is a parameter set; returns true if one changed.
+  bool update(VideoCodec codec, const NalUnit& nal);
+  bool complete(VideoCodec codec) const;
+};
+
+// Reads sprop-parameter-sets (H.264) or sprop-vps/sps/pps (H.265) from an
+// SDP fmtp line. Returns true if any parameter set was found.
+bool parseSpropParameterSets(VideoCodec codec, const std::string& fmtp, ParameterSets* out);
+// The inverse: fmtp parameters announcing sets (packetization mode 1 for
+// H.264), for serving a stream whose parameter sets are known.
+std::string formatSdpFmtp(VideoCodec codec, const ParameterSets& sets);
+
+class NalHandler {
+ public:
+  virtual ~NalHandler() = default;
+  virtual void onNal(const NalUnit& nal) = 0;
+  // Packets were lost before the unit (or fragment) with this RTP
+  // timestamp; whatever they held is gone.
+  virtual void onLoss(uint32_t timestamp) {}
+};
+
+// Splits an Annex-B byte stream fed in arbitrary chunks. Units that lie
+// entirely inside one chunk are delivered straight from it; only a unit
+// spanning chunks is gathered into the parser's buffer. Bytes before the
+// first start code are discarded.
+class AnnexBParser {
+ public:
+  AnnexBParser(VideoCodec codec, NalHandler* handler);
+
+  void push(const uint8_t* data, size_t size);
+  // Delivers the last unit, which has no start code after it.
+  void flush();
+  void reset();
+
+  // One-shot split of a complete buffer; nothing is copied.
+  static void split(VideoCodec codec, const uint8_t* data, size_t size, NalHandler* handler);
+
+ private:
+  void deliver(const uint8_t* data, size_t size);
+
+  const VideoCodec codec_;
+  NalHandler* handler_;
+  bool inUnit_ = false;           // a start code has been seen
+  std::vector<uint8_t> pending_;  // unfinished unit, or up to 2 bytes before the first start code
+};
+
+}  // namespace nvr
+
+#endif  // NVR_MEDIA_NAL_H
@@ -0,0 +1,205 @@
+#include "media/rtp_depacketizer.h"
+
+namespace nvr {
+
+namespace {
+
+constexpr int kH264StapA = 24;
+constexpr int kH264FuA = 28;
+constexpr int kH265Ap = 48;
+constexpr int kH265Fu = 49;
+
+void addUnit(VideoCodec codec, const uint8_t* nal, int type, RtpPayloadInfo* info) {
+  if (isParameterSetNal(codec, type)) info->parameterSets = true;
+  if (!isVclNal(codec, type)) return;
+  // Any reference slice makes the packet a reference one.
+  info->reference = (info->vcl && info->reference) || isReferenceNal(codec, nal);
+  info->vcl = true;
+}
+
+}  // namespace
+
+RtpPayloadInfo inspectRtpPayload(VideoCodec codec, const uint8_t* payload, size_t size) {
+  RtpPayloadInfo info;
+  size_t header = nalHeaderSize(codec);
+  if (size < header + 1) return info;
+  int type = nalType(codec, payload);
+  bool h265 = codec == VideoCodec::H265;
+  if (type == (h265 ? kH265Fu : kH264FuA)) {
+    // Rebuild the fragmented unit's header from the payload and FU headers.
+    uint8_t fu = payload[header];
+    int fuType = h265 ? fu & 0x3f : fu & 0x1f;
+    uint8_t unit[2];
+    if (h265) {
+      unit[0] = static_cast<uint8_t>((payload[0] & 0x81) | (fuType << 1));
+      unit[1] = payload[1];
+    } else {
+      unit[0] = static_cast<uint8_t>((payload[0] & 0xe0) | fuType);
+    }
+    addUnit(codec, unit, fuType, &info);
+    info.keyframeStart = (fu & 0x80) && isKeyframeNal(codec, fuType);
+    return info;
+  }
+  if (type == (h265 ? kH265Ap : kH264StapA)) {
+    for (size_t off = header; off + 2 + header <= size;) {
+      size_t len = static_cast<size_t>(payload[off] << 8 | payload[off + 1]);
+      if (len < header || off + 2 + len > size) break;
+      const uint8_t* nal = payload + off + 2;
+      int unitType = nalType(codec, nal);
+      addUnit(codec, nal, unitType, &info);
+      if (isKeyframeNal(codec, unitType)) info.keyframeStart = true;
+      off += 2 + len;
+    }
+    return info;
+  }
+  addUnit(codec, payload, type, &info);
+  info.keyframeStart = isKeyframeNal(codec, type);
+  return info;
+}
+
+RtpDepacketizer::RtpDepacketizer(VideoCodec codec, NalHandler* handler)
+    : codec_(codec), handler_(handler) {
+  fragment_.reserve(256 * 1024);
+}
+
+void RtpDepacketizer::reset() {
+  fragment_.clear();
+  inFragment_ = false;
+  haveSequence_ = false;
+}
+
+void RtpDepacketizer::push(const uint8_t* data, size_t size) {
+  RtpHeader header;
+  if (!parseRtpHeader(data, size, &header)) {
+    ++stats_.packets;
+    ++stats_.malformed;
+    return;
+  }
+  push(header, data + header.payloadOffset, header.payloadSize);
+}
+
+void RtpDepacketizer::push(const RtpHeader& header, const uint8_t* payload, size_t size) {
+  ++stats_.packets;
+  bool gap = haveSequence_ && header.sequence != static_cast<uint16_t>(lastSequence_ + 1);
+  lastSequence_ = header.sequence;
+  haveSequence_ = true;
+  if (gap) {
+    ++stats_.gaps;
+    if (inFragment_) dropFragment();
+    handler_->onLoss(header.timestamp);
+  }
+
+  size_t headerSize = nalHeaderSize(codec_);
+  if (size < headerSize) {
+    ++stats_.malformed;
+    return;
+  }
+  int type = nalType(codec_, payload);
+  bool fragment = type == (codec_ == VideoCodec::H265 ? kH265Fu : kH264FuA);
+  // A fragmented unit that never saw its end bit is incomplete.
+  if (!fragment && inFragment_) dropFragment();
+
+  if (codec_ == VideoCodec::H265) {
+    if (type < kH265Ap) {
+      deliver(header, payload, size, true);
+    } else if (type == kH265Ap) {
+      pushAggregate(header, payload, size);
+    } else if (type == kH265Fu) {
+      pushFragment(header, payload, size);
+    } else {
+      ++stats_.unsupported;
+    }
+  } else {
+    if (type >= 1 && type < kH264StapA) {
+      deliver(header, payload, size, true);
+    } else if (type == kH264StapA) {
+      pushAggregate(header, payload, size);
+    } else if (type == kH264FuA) {
+      pushFragment(header, payload, size);
+    } else {
+      ++stats_.unsupported;
+    }
+  }
+}
+
+void RtpDepacketizer::deliver(const RtpHeader& header, const uint8_t* data, size_t size,
+                              bool last) {
+  if (size < nalHeaderSize(codec_)) {
+    ++stats_.malformed;
+    return;
+  }
+  NalUnit nal;
+  nal.data = data;
+  nal.size = size;
+  nal.type = nalType(codec_, data);
+  nal.timestamp = header.timestamp;
+  nal.endOfAccessUnit = header.marker && last;
+  ++stats_.nals;
+  handler_->onNal(nal);
+}
+
+// STAP-A / AP: payload header, then (16-bit size, unit) pairs.
+void RtpDepacketizer::pushAggregate(const RtpHeader& header, const uint8_t* payload,
+                                    size_t size) {
+  const uint8_t* p = payload + nalHeaderSize(codec_);
+  const uint8_t* end = payload + size;
+  while (end - p >= 2) {
+    size_t len = (p[0] << 8) | p[1];
+    p += 2;
+    if (len == 0 || len > static_cast<size_t>(end - p)) {
+      ++stats_.malformed;
+      return;
+    }
+    deliver(header, p, len, end - (p + len) < 2);
+    p += len;
+  }
+}
+
+// FU-A / FU: payload header, FU header (start, end, original type), then a
+// piece of the unit. The unit's own header is rebuilt from the two.
+void RtpDepacketizer::pushFragment(const RtpHeader& header, const uint8_t* payload,
+                                   size_t size) {
+  size_t prefix = nalHeaderSize(codec_) + 1;
+  if (size <= prefix) {
+    ++stats_.malformed;
+    return;
+  }
+  uint8_t fu = payload[prefix - 1];
+  bool start = (fu & 0x80) != 0;
+  bool end = (fu & 0x40) != 0;
+
+  if (start) {
+    if (inFragment_) dropFragment();
+    fragment_.clear();
+    if (codec_ == VideoCodec::H265) {
+      fragment_.push_back(static_cast<uint8_t>((payload[0] & 0x81) | ((fu & 0x3f) << 1)));
+      fragment_.push_back(payload[1]);
+    } else {
+      fragment_.push_back(static_cast<uint8_t>((payload[0] & 0xe0) | (fu & 0x1f)));
+    }
+    inFragment_ = true;
+  } else if (!inFragment_) {
+    // Middle or end of a unit whose start was lost.
+    ++stats_.droppedFragments;
+    return;
+  }
+
+  if (fragment_.size() + size - prefix > kMaxNalSize) {
+    dropFragment();
+    return;
+  }
+  fragment_.insert(fragment_.end(), payload + prefix, payload + size);
+  if (end) {
+    inFragment_ = false;
+    ++stats_.fragmentedNals;
+    deliver(header, fragment_.data(), fragment_.size(), true);
+  }
+}
+
+void RtpDepacketizer::dropFragment() {
+  ++stats_.droppedFragments;
+  inFragment_ = false;
+  fragment_.clear();
+}
+
+}  // namespace nvr
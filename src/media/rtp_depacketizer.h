@@ -0,0 +1,87 @@
+// RTP payload formats for H.264 (RFC 6184) and H.265 (RFC 7798).
+//
+// Turns RTP packets into NAL units: single units and the units of an
+// aggregation packet (STAP-A / AP) are delivered as views into the packet;
+// fragmentation units (FU-A / FU) are reassembled into one buffer that is
+// reused for every fragmented unit. A sequence gap inside a fragmented unit
+// discards that unit rather than delivering a corrupt one, and every gap is
+// reported to the handler (NalHandler::onLoss()), so that the frames it
+// broke are known.
+//
+// Interleaved mode (STAP-B, MTAP, FU-B, DONL) and H.265 PACI packets are
+// not supported and are counted as unsupported.
+
+#ifndef NVR_MEDIA_RTP_DEPACKETIZER_H
+#define NVR_MEDIA_RTP_DEPACKETIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "media/nal.h"
+#include "rtp/rtp_packet.h"
+
+namespace nvr {
+
+// What the payload headers of one RTP packet tell about the units in it,
+// for a fragment about the unit it is part of. Nothing is depacketized.
+struct RtpPayloadInfo {
+  bool vcl = false;            // carries slice data
+  bool reference = true;       // false when all its slices are non-reference ones
+  bool keyframeStart = false;  // an IDR/IRAP unit, or the first fragment of one
+  bool parameterSets = false;  // carries a VPS, SPS or PPS
+};
+
+RtpPayloadInfo inspectRtpPayload(VideoCodec codec, const uint8_t* payload, size_t size);
+
+// True if an RTP payload begins a keyframe: an IDR/IRAP unit on its own,
+// inside an aggregation packet, or as the first fragment of one.
+inline bool rtpPayloadStartsKeyframe(VideoCodec codec, const uint8_t* payload, size_t size) {
+  return inspectRtpPayload(codec, payload, size).keyframeStart;
+}
+
+class RtpDepacketizer {
+ public:
+  struct Stats {
+    uint64_t packets = 0;
+    uint64_t nals = 0;
+    uint64_t fragmentedNals = 0;
+    uint64_t droppedFragments = 0;  // fragments of units lost to a gap
+    uint64_t gaps = 0;              // sequence gaps
+    uint64_t malformed = 0;
+    uint64_t unsupported = 0;
+  };
+
+  // Fragmented units larger than this are dropped.
+  static constexpr size_t kMaxNalSize = 8 * 1024 * 1024;
+
+  RtpDepacketizer(VideoCodec codec, NalHandler* handler);
+
+  VideoCodec codec() const { return codec_; }
+
+  // data is one complete RTP packet.
+  void push(const uint8_t* data, size_t size);
+  void push(const RtpHeader& header, const uint8_t* payload, size_t size);
+  void reset();
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  void deliver(const RtpHeader& header, const uint8_t* data, size_t size, bool last);
+  void pushAggregate(const RtpHeader& header, const uint8_t* payload, size_t size);
+  void pushFragment(const RtpHeader& header, const uint8_t* payload, size_t size);
+  void dropFragment();
+
+  const VideoCodec codec_;
+  NalHandler* handler_;
+  std::vector<uint8_t> fragment_;  // unit being reassembled; capacity kept
+  bool inFragment_ = false;
+  uint16_t lastSequence_ = 0;
+  bool haveSequence_ = false;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_MEDIA_RTP_DEPACKETIZER_H
@@ -0,0 +1,102 @@
+#include "media/rtp_packetizer.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace nvr {
+
+namespace {
+
+constexpr size_t kRtpHeaderSize = 12;
+constexpr int kH264FuA = 28;
+constexpr int kH265Fu = 49;
+
+}  // namespace
+
+RtpPacketizer::RtpPacketizer(PacketPool* pool, VideoCodec codec, uint8_t payloadType,
+                             uint32_t ssrc, size_t maxPacketSize)
+    : pool_(pool),
+      codec_(codec),
+      payloadType_(payloadType),
+      ssrc_(ssrc),
+      maxPacketSize_(std::min(std::max<size_t>(maxPacketSize, kRtpHeaderSize + 64),
+                              std::min<size_t>(pool->bufferSize(), 65535))),
+      // Random-looking but reproducible first sequence number (RFC 3550 5.1).
+      sequence_(static_cast<uint16_t>(ssrc * 2654435761u >> 16)) {}
+
+void RtpPacketizer::packetize(const uint8_t* frame, size_t size, uint32_t timestamp,
+                              std::vector<PacketRef>* out) {
+  units_.clear();
+  AnnexBParser::split(codec_, frame, size, this);
+  timestamp_ = timestamp;
+  out_ = out;
+  for (size_t i = 0; i < units_.size(); ++i)
+    sendUnit(units_[i].data, units_[i].size, i + 1 == units_.size());
+  out_ = nullptr;
+}
+
+void RtpPacketizer::onNal(const NalUnit& nal) {
+  // split() hands out views into the frame, valid until it returns.
+  if (nal.size >= nalHeaderSize(codec_)) units_.push_back(Unit{nal.data, nal.size});
+}
+
+void RtpPacketizer::sendUnit(const uint8_t* nal, size_t size, bool last) {
+  size_t maxPayload = maxPacketSize_ - kRtpHeaderSize;
+  if (size <= maxPayload) {
+    sendPacket(nullptr, 0, nal, size, last);
+    return;
+  }
+  // Payload header and FU header replace the unit's own header.
+  uint8_t head[3];
+  size_t headSize;
+  size_t offset = nalHeaderSize(codec_);
+  if (codec_ == VideoCodec::H265) {
+    head[0] = static_cast<uint8_t>((nal[0] & 0x81) | (kH265Fu << 1));
+    head[1] = nal[1];
+    head[2] = static_cast<uint8_t>(nalType(codec_, nal));
+    headSize = 3;
+  } else {
+    head[0] = static_cast<uint8_t>((nal[0] & 0xe0) | kH264FuA);
+    head[1] = static_cast<uint8_t>(nal[0] & 0x1f);
+    headSize = 2;
+  }
+  uint8_t& fu = head[headSize - 1];
+  const uint8_t type = fu;
+  bool first = true;
+  while (offset < size) {
+    size_t n = std::min(maxPayload - headSize, size - offset);
+    bool end = offset + n == size;
+    fu = static_cast<uint8_t>(type | (first ? 0x80 : 0) | (end ? 0x40 : 0));
+    sendPacket(head, headSize, nal + offset, n, last && end);
+    offset += n;
+    first = false;
+  }
+}
+
+void RtpPacketizer::sendPacket(const uint8_t* head, size_t headSize, const uint8_t* body,
+                               size_t bodySize, bool marker) {
+  size_t size = kRtpHeaderSize + headSize + bodySize;
+  if (!chunk_ || chunkUsed_ + size > chunk_.size()) {
+    PacketBuffer* buffer = pool_->acquire();
+    chunk_ = PacketRef::adopt(buffer, 0, static_cast<uint32_t>(buffer->capacity()));
+    chunkUsed_ = 0;
+  }
+  uint8_t* p = chunk_.mutableData() + chunkUsed_;
+  p[0] = 0x80;
+  p[1] = static_cast<uint8_t>(payloadType_ | (marker ? 0x80 : 0));
+  p[2] = static_cast<uint8_t>(sequence_ >> 8);
+  p[3] = static_cast<uint8_t>(sequence_);
+  for (int i = 0; i < 4; ++i) {
+    p[4 + i] = static_cast<uint8_t>(timestamp_ >> (24 - 8 * i));
+    p[8 + i] = static_cast<uint8_t>(ssrc_ >> (24 - 8 * i));
+  }
+  if (headSize) memcpy(p + kRtpHeaderSize, head, headSize);
+  memcpy(p + kRtpHeaderSize + headSize, body, bodySize);
+  out_->push_back(chunk_.slice(static_cast<uint32_t>(chunkUsed_), static_cast<uint32_t>(size)));
+  chunkUsed_ += size;
+  ++sequence_;
+  ++packets_;
+}
+
+}  // namespace nvr
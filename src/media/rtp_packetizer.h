@@ -0,0 +1,69 @@
+// RTP packetization of H.264 (RFC 6184) and H.265 (RFC 7798) frames.
+//
+// The inverse of RtpDepacketizer, for serving recorded video: an Annex-B
+// access unit is split into its NAL units, each sent as a single-unit
+// packet or, when larger than a packet, as FU-A / FU fragments; the last
+// packet of the frame carries the marker bit. Packets are written back to
+// back into pooled stream chunks and handed out as PacketRefs, so a frame
+// costs one copy into the chunk and no allocation once the pool is warm.
+//
+// A packetizer belongs to the thread that owns its pool.
+
+#ifndef NVR_MEDIA_RTP_PACKETIZER_H
+#define NVR_MEDIA_RTP_PACKETIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "base/packet_buffer.h"
+#include "media/nal.h"
+
+namespace nvr {
+
+class RtpPacketizer : private NalHandler {
+ public:
+  // Including the 12-byte RTP header; fits the usual 1500-byte MTU.
+  static constexpr size_t kDefaultMaxPacketSize = 1400;
+
+  // pool must outlive the packetizer and every packet it hands out.
+  RtpPacketizer(PacketPool* pool, VideoCodec codec, uint8_t payloadType, uint32_t ssrc,
+                size_t maxPacketSize = kDefaultMaxPacketSize);
+
+  VideoCodec codec() const { return codec_; }
+  uint16_t sequence() const { return sequence_; }
+  uint64_t packets() const { return packets_; }
+
+  // Appends the packets of one Annex-B access unit to out.
+  void packetize(const uint8_t* frame, size_t size, uint32_t timestamp,
+                 std::vector<PacketRef>* out);
+
+ private:
+  struct Unit {
+    const uint8_t* data;
+    size_t size;
+  };
+
+  void onNal(const NalUnit& nal) override;
+  void sendUnit(const uint8_t* nal, size_t size, bool last);
+  void sendPacket(const uint8_t* head, size_t headSize, const uint8_t* body, size_t bodySize,
+                  bool marker);
+
+  PacketPool* pool_;
+  const VideoCodec codec_;
+  const uint8_t payloadType_;
+  const uint32_t ssrc_;
+  const size_t maxPacketSize_;
+  uint16_t sequence_;
+  uint32_t timestamp_ = 0;
+  uint64_t packets_ = 0;
+  std::vector<Unit> units_;  // of the frame being packetized
+  std::vector<PacketRef>* out_ = nullptr;
+  PacketRef chunk_;          // being filled; packets are slices of it
+  size_t chunkUsed_ = 0;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_MEDIA_RTP_PACKETIZER_H
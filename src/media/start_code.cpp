@@ -0,0 +1,117 @@
+#include "media/start_code.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NVR_X86 1
+#endif
+
+namespace nvr {
+
+namespace {
+
+const uint8_t* scanNaive(const uint8_t* p, const uint8_t* end) {
+  for (; p + 2 < end; ++p) {
+    if (p[0] == 0 && p[1] == 0 && p[2] == 1) return p;
+  }
+  return end;
+}
+
+// p[2] decides how far to skip: above 1 no start code can begin at p, p+1
+// or p+2; 0 only rules out p; 1 is a match at p or rules out all three.
+const uint8_t* scanScalar(const uint8_t* p, const uint8_t* end) {
+  while (p + 2 < end) {
+    if (p[2] > 1) {
+      p += 3;
+    } else if (p[2] == 0) {
+      ++p;
+    } else {
+      if (p[0] == 0 && p[1] == 0) return p;
+      p += 3;
+    }
+  }
+  return end;
+}
+
+#ifdef NVR_X86
+
+// Compares the block at p, p+1 and p+2 against 0, 0 and 1, so bit i of the
+// mask is set exactly when a start code begins at p+i.
+const uint8_t* scanSse2(const uint8_t* p, const uint8_t* end) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  while (end - p >= 18) {
+    __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1));
+    __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2));
+    __m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+                                _mm_cmpeq_epi8(b2, one));
+    int mask = _mm_movemask_epi8(hit);
+    if (mask != 0) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return scanScalar(p, end);
+}
+
+__attribute__((target("avx2"))) const uint8_t* scanAvx2(const uint8_t* p, const uint8_t* end) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+  while (end - p >= 34) {
+    __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 1));
+    __m256i b2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 2));
+    __m256i hit = _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)),
+        _mm256_cmpeq_epi8(b2, one));
+    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+    if (mask != 0) return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return scanSse2(p, end);
+}
+
+#endif  // NVR_X86
+
+StartCodeScan pickScan() {
+#ifdef NVR_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return StartCodeScan::Avx2;
+  return StartCodeScan::Sse2;
+#else
+  return StartCodeScan::Scalar;
+#endif
+}
+
+const StartCodeScan g_activeScan = pickScan();
+const StartCodeScanFn g_scanFn = startCodeScanFn(g_activeScan);
+
+}  // namespace
+
+const uint8_t* findStartCode(const uint8_t* p, const uint8_t* end) { return g_scanFn(p, end); }
+
+StartCodeScanFn startCodeScanFn(StartCodeScan scan) {
+  switch (scan) {
+    case StartCodeScan::Naive: return scanNaive;
+    case StartCodeScan::Scalar: return scanScalar;
+#ifdef NVR_X86
+    case StartCodeScan::Sse2: return scanSse2;
+    case StartCodeScan::Avx2: return __builtin_cpu_supports("avx2") ? scanAvx2 : nullptr;
+#else
+    default: return nullptr;
+#endif
+  }
+  return nullptr;
+}
+
+const char* startCodeScanName(StartCodeScan scan) {
+  switch (scan) {
+    case StartCodeScan::Naive: return "naive";
+    case StartCodeScan::Scalar: return "scalar";
+    case StartCodeScan::Sse2: return "sse2";
+    case StartCodeScan::Avx2: return "avx2";
+  }
+  return "?";
+}
+
+StartCodeScan activeStartCodeScan() { return g_activeScan; }
+
+}  // namespace nvr
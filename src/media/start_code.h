@@ -0,0 +1,35 @@
+// Annex-B start code (00 00 01) scanning.
+//
+// Every NAL boundary in an H.264/H.265 byte stream is found by this scan, so
+// it runs over every byte recorded or replayed. On x86 the scan compares 16
+// (SSE2) or 32 (AVX2) positions per step; the implementation is picked once
+// at startup from the CPU's features. Elsewhere a scalar loop that skips
+// ahead by up to three bytes per step is used.
+
+#ifndef NVR_MEDIA_START_CODE_H
+#define NVR_MEDIA_START_CODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace nvr {
+
+// Returns the first byte of the first 00 00 01 sequence lying entirely in
+// [p, end), or end if there is none. A four-byte start code 00 00 00 01 is
+// found at its second byte.
+const uint8_t* findStartCode(const uint8_t* p, const uint8_t* end);
+
+enum class StartCodeScan { Naive, Scalar, Sse2, Avx2 };
+
+using StartCodeScanFn = const uint8_t* (*)(const uint8_t* p, const uint8_t* end);
+
+// A specific implementation, for benchmarks; nullptr if this CPU or build
+// does not support it.
+StartCodeScanFn startCodeScanFn(StartCodeScan scan);
+const char* startCodeScanName(StartCodeScan scan);
+// The implementation findStartCode() uses.
+StartCodeScan activeStartCodeScan();
+
+}  // namespace nvr
+
+#endif  // NVR_MEDIA_START_CODE_H
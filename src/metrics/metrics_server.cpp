@@ -0,0 +1,367 @@
+#include "metrics/metrics_server.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <future>
+#include <unordered_map>
+
+#include "base/byte_buffer.h"
+#include "base/clock.h"
+#include "base/log.h"
+#include "base/socket_util.h"
+#include "http/http_message.h"
+
+namespace nvr {
+
+namespace {
+
+constexpr size_t kMaxRequestBytes = 16 * 1024;
+constexpr const char* kContentType = "text/plain; version=0.0.4; charset=utf-8";
+
+}  // namespace
+
+// Accepts on the server's loop and owns its connections.
+class MetricsServer::Listener : public EventHandler,
+                                public std::enable_shared_from_this<Listener> {
+ public:
+  Listener(MetricsServer* server, EventLoop* loop, int fd)
+      : server_(server), loop_(loop), fd_(fd) {}
+  ~Listener() override;
+
+  void start();
+  void shutdown();
+  void onEvents(uint32_t events) override;
+
+  void drop(uint64_t id);
+  // Renders a scrape into *body and accounts for it.
+  void scrape(std::string* body);
+
+  EventLoop* loop() const { return loop_; }
+  MetricsServerStats& stats() { return stats_; }
+
+ private:
+  void sweep();
+
+  MetricsServer* server_;
+  EventLoop* loop_;
+  int fd_;
+  uint64_t nextId_ = 1;
+  std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections_;
+  EventLoop::TimerId sweepTimer_ = 0;
+  MetricsServerStats stats_;
+};
+
+class MetricsServer::Connection : public EventHandler {
+ public:
+  Connection(Listener* listener, int fd, uint64_t id)
+      : listener_(listener), fd_(fd), id_(id), activeMs_(listener->loop()->nowMs()) {}
+  ~Connection() override { closeFd(); }
+
+  bool open() { return listener_->loop()->add(fd_, EPOLLIN, this) == 0; }
+  uint64_t activeMs() const { return activeMs_; }
+  void closeFd();
+
+  void onEvents(uint32_t events) override;
+
+ private:
+  void parseInput();
+  void handle(const HttpRequest& request);
+  void flushOutput();
+  void updateInterest();
+
+  Listener* listener_;
+  int fd_;
+  const uint64_t id_;
+  uint64_t activeMs_;
+  ByteBuffer input_{4096};
+  // The response: head_, then body_ unless it was HEAD. body_ keeps its
+  // capacity from one scrape to the next.
+  std::string head_;
+  std::string body_;
+  size_t bodySize_ = 0;
+  size_t sent_ = 0;  // of head_ and the body together
+  bool wantWrite_ = false;
+  bool closing_ = false;     // once the response is out
+  bool peerClosed_ = false;  // read to the end: answer what came, then close
+  uint32_t interest_ = EPOLLIN;
+};
+
+void MetricsServer::Connection::closeFd() {
+  if (fd_ < 0) return;
+  listener_->loop()->remove(fd_);
+  ::close(fd_);
+  fd_ = -1;
+}
+
+void MetricsServer::Connection::onEvents(uint32_t events) {
+  if (fd_ < 0) return;
+  activeMs_ = listener_->loop()->nowMs();
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    listener_->drop(id_);
+    return;
+  }
+  if (events & EPOLLOUT) {
+    flushOutput();
+    if (fd_ < 0) return;
+  }
+  if (events & EPOLLIN) {
+    // At most a little over one request's worth: parseInput() turns down
+    // a request that long, and requests behind an unsent response wait in
+    // the socket.
+    while (!peerClosed_ && input_.size() <= kMaxRequestBytes) {
+      ssize_t n = input_.readFd(fd_, 16 * 1024);
+      if (n > 0) continue;
+      if (n == 0) {
+        // A client that half-closes after its request still gets the
+        // answer.
+        peerClosed_ = true;
+        break;
+      }
+      if (n != -EAGAIN && n != -EINTR) {
+        listener_->drop(id_);
+        return;
+      }
+      break;
+    }
+  }
+  parseInput();
+  if (fd_ < 0) return;
+  if (peerClosed_ && head_.empty()) {
+    // Answered all of it; anything left is a request cut short.
+    listener_->drop(id_);
+    return;
+  }
+  updateInterest();
+}
+
+void MetricsServer::Connection::updateInterest() {
+  uint32_t events = 0;
+  if (!peerClosed_ && input_.size() <= kMaxRequestBytes) events |= EPOLLIN;
+  if (wantWrite_) events |= EPOLLOUT;
+  if (events == interest_) return;
+  interest_ = events;
+  listener_->loop()->modify(fd_, events, this);
+}
+
+void MetricsServer::Connection::parseInput() {
+  // The next request waits until the previous response is out.
+  while (fd_ >= 0 && !closing_ && head_.empty() && !input_.empty()) {
+    HttpRequest request;
+    int n = parseHttpRequest(reinterpret_cast<const char*>(input_.data()), input_.size(),
+                             &request);
+    if (n < 0 || (n == 0 && input_.size() > kMaxRequestBytes)) {
+      ++listener_->stats().badRequests;
+      listener_->drop(id_);
+      return;
+    }
+    if (n == 0) return;
+    input_.consume(static_cast<size_t>(n));
+    handle(request);
+  }
+}
+
+void MetricsServer::Connection::handle(const HttpRequest& request) {
+  std::string path = request.target.substr(0, request.target.find('?'));
+  bool head = request.method == "HEAD";
+  closing_ = !request.keepAlive;
+  bodySize_ = 0;
+  if (request.method != "GET" && !head) {
+    ++listener_->stats().badRequests;
+    head_ = buildHttpResponseHead(405, "Method Not Allowed", {{"Allow", "GET, HEAD"}}, 0,
+                                  request.keepAlive);
+  } else if (path != "/metrics") {
+    head_ = buildHttpResponseHead(404, "Not Found", HeaderList(), 0, request.keepAlive);
+  } else {
+    listener_->scrape(&body_);
+    head_ = buildHttpResponseHead(200, "OK", {{"Content-Type", kContentType}}, body_.size(),
+                                  request.keepAlive);
+    if (!head) bodySize_ = body_.size();
+  }
+  sent_ = 0;
+  flushOutput();
+}
+
+void MetricsServer::Connection::flushOutput() {
+  size_t total = head_.size() + bodySize_;
+  while (fd_ >= 0 && sent_ < total) {
+    struct iovec iov[2];
+    int count = 0;
+    if (sent_ < head_.size()) {
+      iov[count].iov_base = &head_[sent_];
+      iov[count++].iov_len = head_.size() - sent_;
+    }
+    size_t bodySent = sent_ > head_.size() ? sent_ - head_.size() : 0;
+    if (bodySent < bodySize_) {
+      iov[count].iov_base = &body_[bodySent];
+      iov[count++].iov_len = bodySize_ - bodySent;
+    }
+    ssize_t n = ::writev(fd_, iov, count);
+    if (n >= 0) {
+      sent_ += static_cast<size_t>(n);
+      continue;
+    }
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      wantWrite_ = true;
+      updateInterest();
+      return;
+    }
+    listener_->drop(id_);
+    return;
+  }
+  if (fd_ < 0) return;
+  head_.clear();
+  bodySize_ = 0;
+  sent_ = 0;
+  if (closing_) {
+    listener_->drop(id_);
+    return;
+  }
+  if (wantWrite_) {
+    wantWrite_ = false;
+    updateInterest();
+  }
+}
+
+MetricsServer::Listener::~Listener() {
+  if (fd_ >= 0) ::close(fd_);
+}
+
+void MetricsServer::Listener::start() {
+  loop_->add(fd_, EPOLLIN, this);
+  sweepTimer_ = loop_->runEvery(1000, [this] { sweep(); });
+}
+
+void MetricsServer::Listener::shutdown() {
+  if (fd_ >= 0) {
+    loop_->remove(fd_);
+    ::close(fd_);
+    fd_ = -1;
+  }
+  if (sweepTimer_) {
+    loop_->cancel(sweepTimer_);
+    sweepTimer_ = 0;
+  }
+  for (auto& kv : connections_) kv.second->closeFd();
+  connections_.clear();
+}
+
+void MetricsServer::Listener::onEvents(uint32_t events) {
+  if (fd_ < 0) return;
+  for (;;) {
+    int fd = ::accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        NVR_DEBUG("metrics server: accept: %s", strerror(errno));
+      return;
+    }
+    if (connections_.size() >= server_->options_.maxConnections) {
+      ::close(fd);
+      continue;
+    }
+    setNoDelay(fd);
+    uint64_t id = nextId_++;
+    std::unique_ptr<Connection> connection(new Connection(this, fd, id));
+    if (!connection->open()) continue;
+    connections_.emplace(id, std::move(connection));
+  }
+}
+
+void MetricsServer::Listener::drop(uint64_t id) {
+  auto it = connections_.find(id);
+  if (it == connections_.end()) return;
+  Connection* connection = it->second.release();
+  connections_.erase(it);
+  connection->closeFd();
+  loop_->deleteLater(connection);
+}
+
+void MetricsServer::Listener::scrape(std::string* body) {
+  int64_t start = monotonicUs();
+  server_->render(body);
+  // The previous scrape's cost, so that the endpoint reports on itself.
+  MetricsWriter out(body);
+  out.family("nvr_metrics_scrape_duration_seconds", "gauge",
+             "Time the previous scrape took to collect and render.");
+  out.sampleFixed("", static_cast<int64_t>(stats_.lastScrapeUs), 6);
+  out.family("nvr_metrics_scrape_bytes", "gauge", "Size of the previous scrape.");
+  out.sample("", stats_.lastScrapeBytes);
+  ++stats_.scrapes;
+  stats_.lastScrapeUs = static_cast<uint64_t>(monotonicUs() - start);
+  stats_.lastScrapeBytes = body->size();
+}
+
+void MetricsServer::Listener::sweep() {
+  uint64_t now = loop_->nowMs();
+  std::vector<uint64_t> idle;
+  for (const auto& kv : connections_)
+    if (now - kv.second->activeMs() > server_->options_.idleTimeoutMs) idle.push_back(kv.first);
+  for (uint64_t id : idle) drop(id);
+}
+
+MetricsServer::MetricsServer(const MetricsServerOptions& options)
+    : options_(options), loop_(1, false) {}
+
+MetricsServer::~MetricsServer() { stop(); }
+
+void MetricsServer::addCollector(Collector collector) {
+  collectors_.push_back(std::move(collector));
+}
+
+void MetricsServer::render(std::string* body) {
+  body->clear();
+  MetricsWriter out(body);
+  for (const auto& collector : collectors_) collector(&out);
+}
+
+int MetricsServer::start() {
+  if (running_) return 0;
+  SocketAddress addr;
+  int rc = resolveAddress(options_.host, options_.port, &addr);
+  if (rc < 0) return rc;
+  int fd = tcpListen(addr, 64);
+  if (fd < 0) {
+    NVR_ERROR("metrics server: cannot listen on %s: %s", addr.toString().c_str(), strerror(-fd));
+    return fd;
+  }
+  SocketAddress local;
+  port_ = localAddress(fd, &local) == 0 ? local.port() : options_.port;
+  loop_.start();
+  listener_.reset(new Listener(this, loop_.loop(0), fd));
+  std::shared_ptr<Listener> listener = listener_;
+  loop_.loop(0)->post([listener] { listener->start(); });
+  running_ = true;
+  NVR_INFO("metrics server: http://%s:%u/metrics", options_.host.c_str(), port_);
+  return 0;
+}
+
+void MetricsServer::stop() {
+  if (!running_) return;
+  running_ = false;
+  auto promise = std::make_shared<std::promise<void>>();
+  std::future<void> done = promise->get_future();
+  std::shared_ptr<Listener> listener = listener_;
+  loop_.loop(0)->post([listener, promise] {
+    listener->shutdown();
+    promise->set_value();
+  });
+  done.wait();
+  listener_.reset();
+  loop_.stop();
+}
+
+MetricsServerStats MetricsServer::stats() {
+  if (!running_) return MetricsServerStats();
+  auto promise = std::make_shared<std::promise<MetricsServerStats>>();
+  std::future<MetricsServerStats> part = promise->get_future();
+  std::shared_ptr<Listener> listener = listener_;
+  loop_.loop(0)->post([listener, promise] { promise->set_value(listener->stats()); });
+  return part.get();
+}
+
+}  // namespace nvr
@@ -0,0 +1,86 @@
+// Local HTTP endpoint for Prometheus-style scrapes: GET /metrics.
+//
+// The server runs on a loop thread of its own, away from the media loops.
+// Counters stay where they are updated, as plain fields owned by one loop
+// each, so the hot path takes no lock and touches no shared cache line. A
+// scrape calls every collector in turn on the server's thread; a collector
+// gathers its counters by posting to the loops that own them and waiting
+// for the answers (see IngestEngine::metrics()), then writes them out.
+// Blocking there holds up nothing but the scrape itself.
+//
+// Only GET and HEAD of /metrics are served, over HTTP/1.1 with keep-alive,
+// one request at a time per connection. A node's scrape is megabytes, so a
+// connection renders into the same buffer every time and sends it as is,
+// after the headers.
+
+#ifndef NVR_METRICS_METRICS_SERVER_H
+#define NVR_METRICS_METRICS_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/event_loop_pool.h"
+#include "metrics/metrics_writer.h"
+
+namespace nvr {
+
+struct MetricsServerOptions {
+  std::string host = "127.0.0.1";  // local by default: the metrics are not authenticated
+  uint16_t port = 9554;            // 0: any free port, see MetricsServer::port()
+  uint32_t idleTimeoutMs = 60000;
+  size_t maxConnections = 16;
+};
+
+struct MetricsServerStats {
+  uint64_t scrapes = 0;
+  uint64_t lastScrapeUs = 0;     // collecting and rendering, on the server's thread
+  uint64_t lastScrapeBytes = 0;
+  uint64_t badRequests = 0;
+};
+
+class MetricsServer {
+ public:
+  using Collector = std::function<void(MetricsWriter*)>;
+
+  explicit MetricsServer(const MetricsServerOptions& options = MetricsServerOptions());
+  ~MetricsServer();
+
+  MetricsServer(const MetricsServer&) = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+
+  // Before start(). Collectors run in the order they were added.
+  void addCollector(Collector collector);
+
+  // 0 or -errno.
+  int start();
+  void stop();
+
+  uint16_t port() const { return port_; }
+
+  // Replaces *body with a scrape's. Any thread but a loop thread a
+  // collector waits on.
+  void render(std::string* body);
+
+  // Blocks until the server's loop answered.
+  MetricsServerStats stats();
+
+ private:
+  class Connection;
+  class Listener;
+
+  MetricsServerOptions options_;
+  std::vector<Collector> collectors_;
+  EventLoopPool loop_;
+  std::shared_ptr<Listener> listener_;
+  uint16_t port_ = 0;
+  bool running_ = false;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_METRICS_METRICS_SERVER_H
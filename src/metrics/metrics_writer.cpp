@@ -0,0 +1,133 @@
+#include "metrics/metrics_writer.h"
+
+#include <string.h>
+
+namespace nvr {
+
+namespace {
+
+// "00" to "99", for two digits per division.
+constexpr char kDigitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Writes value's digits to end backwards; returns where they start. Each
+// division waits on the one before, so there are half as many as digits,
+// and in 32 bits once the value fits.
+char* formatUnsigned(uint64_t value, char* end) {
+  char* p = end;
+  while (value >= 1ull << 32) {
+    uint64_t pair = value % 100;
+    value /= 100;
+    p -= 2;
+    memcpy(p, kDigitPairs + 2 * pair, 2);
+  }
+  uint32_t small = static_cast<uint32_t>(value);
+  while (small >= 100) {
+    uint32_t pair = small % 100;
+    small /= 100;
+    p -= 2;
+    memcpy(p, kDigitPairs + 2 * pair, 2);
+  }
+  if (small >= 10) {
+    p -= 2;
+    memcpy(p, kDigitPairs + 2 * small, 2);
+  } else {
+    *--p = static_cast<char>('0' + small);
+  }
+  return p;
+}
+
+void appendEscaped(std::string* out, const std::string& value) {
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c == '\n') {
+      out->append("\\n");
+    } else {
+      out->push_back(c);
+    }
+  }
+}
+
+}  // namespace
+
+void MetricsWriter::family(const char* name, const char* type, const char* help) {
+  name_ = name;
+  out_->append("# HELP ").append(name).push_back(' ');
+  out_->append(help).push_back('\n');
+  out_->append("# TYPE ").append(name).push_back(' ');
+  out_->append(type).push_back('\n');
+}
+
+void MetricsWriter::line(std::string_view labels, bool negative, uint64_t magnitude,
+                         uint64_t fraction, int fractionDigits) {
+  // The line is put together backwards in a local buffer, value first, so
+  // that a sample is one append; labels too long for it are appended apart.
+  char buf[256];
+  char* end = buf + sizeof(buf);
+  *--end = '\n';
+  char* p = end;
+  if (fractionDigits > 0) {
+    p = formatUnsigned(fraction, p);
+    while (end - p < fractionDigits) *--p = '0';
+    *--p = '.';
+  }
+  p = formatUnsigned(magnitude, p);
+  if (negative) *--p = '-';
+  *--p = ' ';
+  size_t prefix = name_.size() + labels.size();
+  if (prefix <= static_cast<size_t>(p - buf)) {
+    p -= labels.size();
+    memcpy(p, labels.data(), labels.size());
+    p -= name_.size();
+    memcpy(p, name_.data(), name_.size());
+  } else {
+    out_->append(name_);
+    out_->append(labels);
+  }
+  out_->append(p, static_cast<size_t>(end + 1 - p));
+}
+
+void MetricsWriter::sample(std::string_view labels, uint64_t value) {
+  line(labels, false, value, 0, 0);
+}
+
+void MetricsWriter::sampleSigned(std::string_view labels, int64_t value) {
+  line(labels, value < 0, value < 0 ? 0 - static_cast<uint64_t>(value) : value, 0, 0);
+}
+
+void MetricsWriter::sampleFixed(std::string_view labels, int64_t value, int decimals) {
+  uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : value;
+  uint64_t scale = 1;
+  for (int i = 0; i < decimals; ++i) scale *= 10;
+  uint64_t fraction = magnitude % scale;
+  // Trailing zeros of the fraction are dropped: 0.5, not 0.500000.
+  int digits = fraction == 0 ? 0 : decimals;
+  while (digits > 0 && fraction % 10 == 0) {
+    fraction /= 10;
+    --digits;
+  }
+  line(labels, value < 0, magnitude / scale, fraction, digits);
+}
+
+std::string MetricsWriter::label(const char* name, const std::string& value) {
+  std::string labels;
+  addLabel(&labels, name, value);
+  return labels;
+}
+
+void MetricsWriter::addLabel(std::string* labels, const char* name, const std::string& value) {
+  if (labels->empty()) {
+    labels->push_back('{');
+  } else {
+    labels->back() = ',';  // was the closing brace
+  }
+  labels->append(name).append("=\"");
+  appendEscaped(labels, value);
+  labels->append("\"}");
+}
+
+}  // namespace nvr
@@ -0,0 +1,55 @@
+// Prometheus text exposition format (version 0.0.4), written straight into
+// a string.
+//
+// A scrape of a full node is hundreds of thousands of samples, so numbers
+// are formatted by hand rather than through printf, a sample is a single
+// append, and labels are escaped once per series owner (label()) rather
+// than once per sample. Samples take labels as a string_view, so neither a
+// literal nor a slice of one buffer of labels makes a string per sample.
+// Fractional values are passed as fixed point: sampleFixed(labels, 1234, 6)
+// writes 0.001234, which keeps seconds and rates exact without floating
+// point.
+
+#ifndef NVR_METRICS_METRICS_WRITER_H
+#define NVR_METRICS_METRICS_WRITER_H
+
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+
+namespace nvr {
+
+class MetricsWriter {
+ public:
+  explicit MetricsWriter(std::string* out) : out_(out) {}
+
+  // Starts a metric family; its samples follow. type is "counter" or
+  // "gauge"; help is written as is, so it must not hold a newline.
+  void family(const char* name, const char* type, const char* help);
+
+  // labels is "" or what label() returns, for the current family.
+  void sample(std::string_view labels, uint64_t value);
+  void sampleSigned(std::string_view labels, int64_t value);
+  // value / 10^decimals.
+  void sampleFixed(std::string_view labels, int64_t value, int decimals);
+
+  // {name="value"}, escaped. Append more with addLabel().
+  static std::string label(const char* name, const std::string& value);
+  static void addLabel(std::string* labels, const char* name, const std::string& value);
+
+  std::string* out() { return out_; }
+
+ private:
+  // name_, labels, then " <magnitude>[.<fraction>]\n", the fraction
+  // zero-padded to fractionDigits (none when 0).
+  void line(std::string_view labels, bool negative, uint64_t magnitude, uint64_t fraction,
+            int fractionDigits);
+
+  std::string* out_;
+  std::string name_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_METRICS_METRICS_WRITER_H
@@ -0,0 +1,252 @@
+#include "onvif/event_multiplexer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "base/clock.h"
+#include "base/hash.h"
+#include "base/log.h"
+
+namespace nvr {
+
+struct OnvifEventMultiplexer::Camera {
+  uint32_t key = 0;
+  std::unique_ptr<OnvifClient> client;
+  std::string pullPoint;  // empty while not subscribed
+  bool busy = false;      // a call is in flight
+  bool removed = false;
+  bool queued = false;
+  bool clockSynced = false;
+  uint64_t renewAtMs = 0;
+  uint32_t backoffMs = 0;
+  EventLoop::TimerId retryTimer = 0;
+};
+
+namespace {
+
+bool contains(const std::string& s, const char* needle) {
+  return s.find(needle) != std::string::npos;
+}
+
+bool isActive(const std::string& value) {
+  return strcasecmp(value.c_str(), "true") == 0 || value == "1" ||
+         strcasecmp(value.c_str(), "active") == 0 || strcasecmp(value.c_str(), "on") == 0;
+}
+
+}  // namespace
+
+EventTopic onvifEventTopic(const std::string& topic) {
+  if (contains(topic, "Tamper") || contains(topic, "GlobalSceneChange"))
+    return EventTopic::Tamper;
+  if (contains(topic, "Motion")) return EventTopic::Motion;
+  if (contains(topic, "DigitalInput")) return EventTopic::DigitalInput;
+  if (contains(topic, "SignalLoss") || contains(topic, "VideoLoss"))
+    return EventTopic::VideoLoss;
+  return EventTopic::Other;
+}
+
+OnvifEventMultiplexer::OnvifEventMultiplexer(HttpClient* http, EventChannel* channel,
+                                             const OnvifEventOptions& options)
+    : http_(http), loop_(http->loop()), channel_(channel), options_(options) {
+  if (options_.maxSubscribing == 0) options_.maxSubscribing = 1;
+  if (options_.subscriptionSec < 10) options_.subscriptionSec = 10;
+}
+
+OnvifEventMultiplexer::~OnvifEventMultiplexer() {
+  for (auto& entry : cameras_) {
+    if (entry.second->retryTimer) loop_->cancel(entry.second->retryTimer);
+    delete entry.second;
+  }
+  for (Camera* camera : retired_) delete camera;
+}
+
+void OnvifEventMultiplexer::addCamera(uint32_t key, const std::string& url) {
+  removeCamera(key);
+  auto* camera = new Camera;
+  camera->key = key;
+  camera->client.reset(new OnvifClient(http_, url, options_.tokenReuseMs));
+  cameras_[key] = camera;
+  // Kept so removeCamera() works, but never polled.
+  if (!camera->client->valid()) return;
+  camera->queued = true;
+  queue_.push_back(camera);
+  startNext();
+}
+
+void OnvifEventMultiplexer::removeCamera(uint32_t key) {
+  auto it = cameras_.find(key);
+  if (it == cameras_.end()) return;
+  Camera* camera = it->second;
+  cameras_.erase(it);
+  camera->removed = true;
+  if (camera->queued) queue_.erase(std::find(queue_.begin(), queue_.end(), camera));
+  if (camera->busy) {
+    retired_.insert(camera);
+    return;
+  }
+  release(camera);
+}
+
+void OnvifEventMultiplexer::release(Camera* camera) {
+  if (camera->retryTimer) loop_->cancel(camera->retryTimer);
+  camera->retryTimer = 0;
+  if (camera->pullPoint.empty()) {
+    loop_->deleteLater(camera);
+    return;
+  }
+  --stats_.subscribed;
+  std::string pullPoint = std::move(camera->pullPoint);
+  camera->pullPoint.clear();
+  camera->busy = true;
+  retired_.insert(camera);
+  // Frees the device's subscription now rather than at its termination time.
+  camera->client->unsubscribe(pullPoint, [this, camera](int) {
+    retired_.erase(camera);
+    loop_->deleteLater(camera);
+  });
+}
+
+bool OnvifEventMultiplexer::settle(Camera* camera) {
+  camera->busy = false;
+  if (!camera->removed) return true;
+  retired_.erase(camera);
+  release(camera);
+  return false;
+}
+
+void OnvifEventMultiplexer::startNext() {
+  // A subscribe that fails synchronously calls back in here.
+  if (starting_) return;
+  starting_ = true;
+  while (subscribing_ < options_.maxSubscribing && !queue_.empty()) {
+    Camera* camera = queue_.front();
+    queue_.pop_front();
+    camera->queued = false;
+    ++subscribing_;
+    subscribe(camera);
+  }
+  starting_ = false;
+}
+
+void OnvifEventMultiplexer::subscribe(Camera* camera) {
+  camera->busy = true;
+  auto create = [this, camera] {
+    camera->client->createPullPointSubscription(
+        options_.subscriptionSec, [this, camera](int error, std::string pullPoint) {
+          subscribed(camera, error, std::move(pullPoint));
+        });
+  };
+  if (!options_.syncClock || camera->clockSynced) {
+    create();
+    return;
+  }
+  camera->client->getSystemDateAndTime([this, camera, create](int error) {
+    // A device that cannot tell the time still reports events.
+    if (error != 0 && error != -EPROTO && error != -EBADMSG && error != -EACCES) {
+      subscribed(camera, error, std::string());
+      return;
+    }
+    camera->clockSynced = true;
+    if (camera->removed) {
+      subscribed(camera, -ECANCELED, std::string());
+      return;
+    }
+    create();
+  });
+}
+
+void OnvifEventMultiplexer::subscribed(Camera* camera, int error, std::string pullPoint) {
+  --subscribing_;
+  if (settle(camera)) {
+    if (error) {
+      ++stats_.subscribeErrors;
+      retry(camera, error, "CreatePullPointSubscription");
+    } else {
+      camera->pullPoint = std::move(pullPoint);
+      camera->backoffMs = 0;
+      camera->renewAtMs = loop_->nowMs() + options_.subscriptionSec * 500ULL;
+      ++stats_.subscriptions;
+      ++stats_.subscribed;
+      pull(camera);
+    }
+  }
+  startNext();
+}
+
+void OnvifEventMultiplexer::pull(Camera* camera) {
+  camera->busy = true;
+  camera->client->pullMessages(
+      camera->pullPoint, options_.pullTimeoutSec, options_.messageLimit,
+      [this, camera](int error, std::vector<OnvifNotification> notifications) {
+        if (!settle(camera)) return;
+        if (error) {
+          ++stats_.pullErrors;
+          retry(camera, error, "PullMessages");
+          return;
+        }
+        ++stats_.pulls;
+        deliver(camera, notifications);
+        if (loop_->nowMs() >= camera->renewAtMs) {
+          renew(camera);
+        } else {
+          pull(camera);
+        }
+      });
+}
+
+void OnvifEventMultiplexer::renew(Camera* camera) {
+  camera->busy = true;
+  camera->client->renewSubscription(
+      camera->pullPoint, options_.subscriptionSec, [this, camera](int error) {
+        if (!settle(camera)) return;
+        if (error) {
+          retry(camera, error, "Renew");
+          return;
+        }
+        ++stats_.renewals;
+        camera->renewAtMs = loop_->nowMs() + options_.subscriptionSec * 500ULL;
+        pull(camera);
+      });
+}
+
+void OnvifEventMultiplexer::retry(Camera* camera, int error, const char* step) {
+  NVR_DEBUG("onvif events %u: %s failed (%s)", camera->key, step, strerror(-error));
+  if (!camera->pullPoint.empty()) {
+    camera->pullPoint.clear();
+    --stats_.subscribed;
+  }
+  camera->backoffMs = camera->backoffMs == 0
+                          ? options_.retryMinMs
+                          : std::min(camera->backoffMs * 2, options_.retryMaxMs);
+  camera->retryTimer = loop_->runAfter(camera->backoffMs, [this, camera] {
+    camera->retryTimer = 0;
+    camera->queued = true;
+    queue_.push_back(camera);
+    startNext();
+  });
+}
+
+void OnvifEventMultiplexer::deliver(Camera* camera,
+                                    const std::vector<OnvifNotification>& notifications) {
+  if (notifications.empty()) return;
+  int64_t receivedUs = wallClockUs();
+  int64_t offsetUs = camera->client->security().clockOffsetUs();
+  for (const auto& n : notifications) {
+    EventRecord record;
+    record.timeUs = n.utcTimeUs ? n.utcTimeUs - offsetUs : receivedUs;
+    record.receivedUs = receivedUs;
+    record.camera = camera->key;
+    record.source = static_cast<uint32_t>(fnv1a64(n.source));
+    record.topic = onvifEventTopic(n.topic);
+    record.active = isActive(n.dataValue) ? 1 : 0;
+    if (n.operation == "Initialized") record.flags |= EventRecord::kInitial;
+    ++stats_.events;
+    if (!channel_->publish(record)) ++stats_.dropped;
+  }
+}
+
+}  // namespace nvr
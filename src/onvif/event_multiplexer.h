@@ -0,0 +1,113 @@
+// ONVIF event intake for many cameras on one event loop.
+//
+// Every camera gets a PullPoint subscription and one outstanding
+// PullMessages long poll: the device answers as soon as it has an event,
+// so delivery latency is one HTTP round trip, and an idle camera costs one
+// parked connection rather than a polling thread. Subscriptions are
+// renewed between polls and re-created with backoff when a device drops
+// them. Notifications are normalized into EventRecords and published to
+// an EventChannel for the recorder.
+//
+// Long polls hold a connection each, so the HttpClient needs
+// maxConnections above the number of cameras and maxConnectionsPerHost of
+// at least 2 if other calls go to the same devices.
+//
+// A multiplexer lives on its HttpClient's loop and is only touched from
+// that thread.
+
+#ifndef NVR_ONVIF_EVENT_MULTIPLEXER_H
+#define NVR_ONVIF_EVENT_MULTIPLEXER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "event/event_channel.h"
+#include "http/http_client.h"
+#include "onvif/onvif_client.h"
+
+namespace nvr {
+
+struct OnvifEventOptions {
+  uint32_t subscriptionSec = 60;  // renewed at half-life
+  uint32_t pullTimeoutSec = 10;
+  uint32_t messageLimit = 64;
+  // Subscriptions being created at once, so that a restart with thousands
+  // of cameras does not open thousands of connections in one go.
+  uint32_t maxSubscribing = 256;
+  uint32_t retryMinMs = 1000;
+  uint32_t retryMaxMs = 30000;
+  uint32_t tokenReuseMs = 10000;
+  // Measure each device's clock first so event times are in local time.
+  bool syncClock = true;
+};
+
+// Event kind of an ONVIF topic, e.g. tns1:RuleEngine/CellMotionDetector/Motion.
+EventTopic onvifEventTopic(const std::string& topic);
+
+class OnvifEventMultiplexer {
+ public:
+  struct Stats {
+    uint64_t subscriptions = 0;  // pull points created
+    uint64_t subscribeErrors = 0;
+    uint64_t pulls = 0;
+    uint64_t pullErrors = 0;  // each one re-subscribes
+    uint64_t renewals = 0;
+    uint64_t events = 0;
+    uint64_t dropped = 0;  // channel full
+    size_t subscribed = 0; // cameras with a live pull point
+  };
+
+  OnvifEventMultiplexer(HttpClient* http, EventChannel* channel,
+                        const OnvifEventOptions& options = OnvifEventOptions());
+  // Destroy after the HttpClient, or once every camera was removed and its
+  // unsubscribe completed: calls in flight refer to the multiplexer.
+  ~OnvifEventMultiplexer();
+
+  OnvifEventMultiplexer(const OnvifEventMultiplexer&) = delete;
+  OnvifEventMultiplexer& operator=(const OnvifEventMultiplexer&) = delete;
+
+  // key is copied into every record of the camera; re-adding a key
+  // replaces the camera. url is the device service URL with credentials.
+  void addCamera(uint32_t key, const std::string& url);
+  void removeCamera(uint32_t key);
+
+  size_t cameras() const { return cameras_.size(); }
+  const Stats& stats() const { return stats_; }
+
+ private:
+  struct Camera;
+
+  void startNext();
+  void subscribe(Camera* camera);
+  void subscribed(Camera* camera, int error, std::string pullPoint);
+  void pull(Camera* camera);
+  void renew(Camera* camera);
+  void retry(Camera* camera, int error, const char* step);
+  void deliver(Camera* camera, const std::vector<OnvifNotification>& notifications);
+  // Ends a call; false when the camera was removed meanwhile (and is gone).
+  bool settle(Camera* camera);
+  void release(Camera* camera);
+
+  HttpClient* http_;
+  EventLoop* loop_;  // the client's, kept for the destructor
+  EventChannel* channel_;
+  OnvifEventOptions options_;
+  std::unordered_map<uint32_t, Camera*> cameras_;
+  // Removed while a call was in flight; freed when it returns.
+  std::unordered_set<Camera*> retired_;
+  std::deque<Camera*> queue_;  // waiting to subscribe
+  uint32_t subscribing_ = 0;
+  bool starting_ = false;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_ONVIF_EVENT_MULTIPLEXER_H
@@ -0,0 +1,429 @@
+#include "onvif/onvif_client.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <utility>
+
+#include "base/clock.h"
+#include "base/log.h"
+#include "onvif/xml_reader.h"
+
+namespace nvr {
+
+namespace {
+
+const char kEnvelopeHead[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+    "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\""
+    " xmlns:tds=\"http://www.onvif.org/ver10/device/wsdl\""
+    " xmlns:trt=\"http://www.onvif.org/ver10/media/wsdl\""
+    " xmlns:tptz=\"http://www.onvif.org/ver20/ptz/wsdl\""
+    " xmlns:tev=\"http://www.onvif.org/ver10/events/wsdl\""
+    " xmlns:wsnt=\"http://docs.oasis-open.org/wsn/b-2\""
+    " xmlns:wsa=\"http://www.w3.org/2005/08/addressing\""
+    " xmlns:tt=\"http://www.onvif.org/ver10/schema\">";
+
+std::string pathOf(const std::string& xaddr, const std::string& fallback) {
+  Url url;
+  if (!parseUrl(xaddr, &url) || url.path.empty()) return fallback;
+  return url.path;
+}
+
+// xsd:dateTime in UTC, e.g. 2026-10-16T08:30:00.125Z; 0 when malformed.
+int64_t parseUtcTime(const std::string& text) {
+  struct tm tm = {};
+  int consumed = 0;
+  if (sscanf(text.c_str(), "%d-%d-%dT%d:%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+             &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) != 6 ||
+      tm.tm_year < 1970) {
+    return 0;
+  }
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  int64_t us = static_cast<int64_t>(timegm(&tm)) * 1000000;
+  const char* p = text.c_str() + consumed;
+  if (*p == '.') {
+    int64_t scale = 100000;
+    for (++p; *p >= '0' && *p <= '9'; ++p, scale /= 10) us += (*p - '0') * scale;
+  }
+  return us;
+}
+
+}  // namespace
+
+OnvifClient::OnvifClient(HttpClient* http, const std::string& url, uint32_t tokenReuseMs)
+    : http_(http) {
+  if (!parseUrl(url, &url_) || url_.scheme != "http") {
+    NVR_ERROR("onvif: bad url %s", url.c_str());
+    return;
+  }
+  int rc = resolveAddress(url_.host, url_.port, &server_);
+  if (rc < 0) {
+    NVR_ERROR("onvif: cannot resolve %s", url_.host.c_str());
+    return;
+  }
+  host_ = url_.host;
+  if (url_.port != 80) host_ += ":" + std::to_string(url_.port);
+  if (!url_.path.empty() && url_.path != "/") services_.device = url_.path;
+  security_ = WsSecurity(percentDecode(url_.user), percentDecode(url_.password), tokenReuseMs);
+  valid_ = true;
+}
+
+void OnvifClient::call(const std::string& path, const char* action, const std::string& body,
+                       bool authenticate, ResponseCallback done, const std::string& to,
+                       uint32_t timeoutMs, bool retried) {
+  if (!valid_) {
+    done(-EINVAL, HttpResponse());
+    return;
+  }
+  HttpRequest request;
+  request.method = "POST";
+  request.target = path;
+  request.timeoutMs = timeoutMs;
+  request.headers.emplace_back("Content-Type", std::string("application/soap+xml; "
+                                                           "charset=utf-8; action=\"") +
+                                                   action + "\"");
+  request.body.reserve(sizeof(kEnvelopeHead) + 1024 + body.size());
+  request.body += kEnvelopeHead;
+  bool reusedToken = false;
+  bool secure = authenticate && security_.hasCredentials();
+  if (secure || !to.empty()) {
+    request.body += "<s:Header>";
+    if (secure) {
+      request.body += security_.header(http_->loop()->nowMs());
+      reusedToken = security_.lastReused();
+    }
+    if (!to.empty()) {
+      // Pull points are told apart by address on some devices.
+      request.body += "<wsa:Action>";
+      request.body += action;
+      request.body += "</wsa:Action><wsa:To>";
+      request.body += xmlEscape(to);
+      request.body += "</wsa:To>";
+    }
+    request.body += "</s:Header>";
+  }
+  request.body += "<s:Body>";
+  request.body += body;
+  request.body += "</s:Body></s:Envelope>";
+  http_->request(server_, host_, request,
+                 [this, path, action, body, authenticate, to, timeoutMs, reusedToken, retried,
+                  done = std::move(done)](int error, const HttpResponse& response) {
+                   if (error == 0) error = checkResponse(response);
+                   if (error == -EACCES && reusedToken && !retried) {
+                     // The cached token may have aged out of the device's
+                     // window; one fresh token settles it.
+                     security_.invalidate();
+                     call(path, action, body, authenticate, done, to, timeoutMs, true);
+                     return;
+                   }
+                   done(error, response);
+                 });
+}
+
+int OnvifClient::checkResponse(const HttpResponse& response) {
+  if (response.status == 200) return 0;
+  lastFault_ = "HTTP " + std::to_string(response.status);
+  bool notAuthorized = response.status == 401;
+  XmlReader xml(response.body);
+  if (xml.findElement("Fault")) {
+    int depth = xml.depth();
+    for (;;) {
+      XmlReader::Token t = xml.next();
+      if (t == XmlReader::Token::End || t == XmlReader::Token::Error) break;
+      if (t == XmlReader::Token::EndElement && xml.depth() == depth) break;
+      if (t != XmlReader::Token::StartElement) continue;
+      if (xml.localName() == "Value") {
+        std::string value = xml.readText();
+        if (value.find("NotAuthorized") != std::string::npos) notAuthorized = true;
+      } else if (xml.localName() == "Text") {
+        lastFault_ = xml.readText();
+      }
+    }
+  }
+  return notAuthorized ? -EACCES : -EPROTO;
+}
+
+void OnvifClient::getSystemDateAndTime(DoneCallback done) {
+  call(services_.device, "http://www.onvif.org/ver10/device/wsdl/GetSystemDateAndTime",
+       "<tds:GetSystemDateAndTime/>", false,
+       [this, done = std::move(done)](int error, const HttpResponse& response) {
+         if (error) {
+           done(error);
+           return;
+         }
+         XmlReader xml(response.body);
+         if (!xml.findElement("UTCDateTime")) {
+           done(-EBADMSG);
+           return;
+         }
+         struct tm tm = {};
+         int depth = xml.depth();
+         for (;;) {
+           XmlReader::Token t = xml.next();
+           if (t == XmlReader::Token::End || t == XmlReader::Token::Error) break;
+           if (t == XmlReader::Token::EndElement && xml.depth() == depth) break;
+           if (t != XmlReader::Token::StartElement) continue;
+           std::string_view name = xml.localName();
+           int* field = name == "Year"     ? &tm.tm_year
+                        : name == "Month"  ? &tm.tm_mon
+                        : name == "Day"    ? &tm.tm_mday
+                        : name == "Hour"   ? &tm.tm_hour
+                        : name == "Minute" ? &tm.tm_min
+                        : name == "Second" ? &tm.tm_sec
+                                           : nullptr;
+           if (field) *field = atoi(xml.readText().c_str());
+         }
+         if (tm.tm_year < 1970 || tm.tm_mon < 1) {
+           done(-EBADMSG);
+           return;
+         }
+         tm.tm_year -= 1900;
+         tm.tm_mon -= 1;
+         int64_t deviceUs = static_cast<int64_t>(timegm(&tm)) * 1000000;
+         int64_t offsetUs = deviceUs - wallClockUs();
+         // The device reports whole seconds; a smaller offset is rounding.
+         if (offsetUs > -1000000 && offsetUs < 1000000) offsetUs = 0;
+         security_.setClockOffsetUs(offsetUs);
+         done(0);
+       });
+}
+
+void OnvifClient::getCapabilities(DoneCallback done) {
+  call(services_.device, "http://www.onvif.org/ver10/device/wsdl/GetCapabilities",
+       "<tds:GetCapabilities><tds:Category>All</tds:Category></tds:GetCapabilities>", true,
+       [this, done = std::move(done)](int error, const HttpResponse& response) {
+         if (error) {
+           done(error);
+           return;
+         }
+         XmlReader xml(response.body);
+         if (!xml.findElement("Capabilities")) {
+           done(-EBADMSG);
+           return;
+         }
+         std::string* section = nullptr;
+         int sectionDepth = 0;
+         for (;;) {
+           XmlReader::Token t = xml.next();
+           if (t == XmlReader::Token::End || t == XmlReader::Token::Error) break;
+           if (t != XmlReader::Token::StartElement) continue;
+           std::string_view name = xml.localName();
+           if (name == "XAddr" && section && xml.depth() == sectionDepth + 1) {
+             *section = pathOf(xml.readText(), *section);
+             if (section == &services_.ptz) services_.hasPtz = true;
+             if (section == &services_.events) services_.hasEvents = true;
+             continue;
+           }
+           std::string* next = name == "Device"   ? &services_.device
+                               : name == "Media"  ? &services_.media
+                               : name == "PTZ"    ? &services_.ptz
+                               : name == "Events" ? &services_.events
+                                                  : nullptr;
+           if (next) {
+             section = next;
+             sectionDepth = xml.depth();
+           } else if (section && xml.depth() <= sectionDepth) {
+             section = nullptr;  // a service we do not use, e.g. Imaging
+           }
+         }
+         done(0);
+       });
+}
+
+void OnvifClient::getProfiles(ProfilesCallback done) {
+  call(services_.media, "http://www.onvif.org/ver10/media/wsdl/GetProfiles",
+       "<trt:GetProfiles/>", true,
+       [done = std::move(done)](int error, const HttpResponse& response) {
+         std::vector<OnvifProfile> profiles;
+         if (error) {
+           done(error, std::move(profiles));
+           return;
+         }
+         XmlReader xml(response.body);
+         while (xml.findElement("Profiles")) {
+           OnvifProfile profile;
+           xml.attribute("token", &profile.token);
+           int depth = xml.depth();
+           int videoDepth = 0;  // inside VideoEncoderConfiguration when non-zero
+           for (;;) {
+             XmlReader::Token t = xml.next();
+             if (t == XmlReader::Token::End || t == XmlReader::Token::Error) break;
+             if (t == XmlReader::Token::EndElement) {
+               if (xml.depth() == depth) break;
+               if (xml.depth() == videoDepth) videoDepth = 0;
+               continue;
+             }
+             if (t != XmlReader::Token::StartElement) continue;
+             std::string_view name = xml.localName();
+             if (name == "Name" && xml.depth() == depth + 1) {
+               profile.name = xml.readText();
+             } else if (name == "VideoEncoderConfiguration") {
+               videoDepth = xml.depth();
+             } else if (name == "PTZConfiguration") {
+               profile.ptz = true;
+               xml.skipElement();
+             } else if (videoDepth == 0) {
+               // Sources, audio, analytics and metadata are not needed.
+               xml.skipElement();
+             } else if (name == "Encoding") {
+               profile.encoding = xml.readText();
+             } else if (name == "Width") {
+               profile.width = atoi(xml.readText().c_str());
+             } else if (name == "Height") {
+               profile.height = atoi(xml.readText().c_str());
+             } else if (name == "FrameRateLimit") {
+               profile.frameRate = atoi(xml.readText().c_str());
+             }
+           }
+           if (!profile.token.empty()) profiles.push_back(std::move(profile));
+         }
+         int rc = profiles.empty() ? -EBADMSG : 0;
+         done(rc, std::move(profiles));
+       });
+}
+
+void OnvifClient::getStreamUri(const std::string& profileToken, UriCallback done) {
+  std::string body =
+      "<trt:GetStreamUri><trt:StreamSetup><tt:Stream>RTP-Unicast</tt:Stream><tt:Transport>"
+      "<tt:Protocol>RTSP</tt:Protocol></tt:Transport></trt:StreamSetup><trt:ProfileToken>" +
+      xmlEscape(profileToken) + "</trt:ProfileToken></trt:GetStreamUri>";
+  call(services_.media, "http://www.onvif.org/ver10/media/wsdl/GetStreamUri", body, true,
+       [done = std::move(done)](int error, const HttpResponse& response) {
+         if (error) {
+           done(error, std::string());
+           return;
+         }
+         XmlReader xml(response.body);
+         if (!xml.findElement("Uri")) {
+           done(-EBADMSG, std::string());
+           return;
+         }
+         std::string uri = xml.readText();
+         int rc = uri.empty() ? -EBADMSG : 0;
+         done(rc, std::move(uri));
+       });
+}
+
+void OnvifClient::continuousMove(const std::string& profileToken, float pan, float tilt,
+                                 float zoom, uint32_t timeoutMs, DoneCallback done) {
+  char velocity[160];
+  snprintf(velocity, sizeof(velocity),
+           "<tptz:Velocity><tt:PanTilt x=\"%.3f\" y=\"%.3f\"/><tt:Zoom x=\"%.3f\"/>"
+           "</tptz:Velocity><tptz:Timeout>PT%.3fS</tptz:Timeout>",
+           pan, tilt, zoom, timeoutMs / 1000.0);
+  std::string body = "<tptz:ContinuousMove><tptz:ProfileToken>" + xmlEscape(profileToken) +
+                     "</tptz:ProfileToken>" + velocity + "</tptz:ContinuousMove>";
+  call(services_.ptz, "http://www.onvif.org/ver20/ptz/wsdl/ContinuousMove", body, true,
+       [done = std::move(done)](int error, const HttpResponse&) { done(error); });
+}
+
+void OnvifClient::stopMove(const std::string& profileToken, DoneCallback done) {
+  std::string body = "<tptz:Stop><tptz:ProfileToken>" + xmlEscape(profileToken) +
+                     "</tptz:ProfileToken><tptz:PanTilt>true</tptz:PanTilt>"
+                     "<tptz:Zoom>true</tptz:Zoom></tptz:Stop>";
+  call(services_.ptz, "http://www.onvif.org/ver20/ptz/wsdl/Stop", body, true,
+       [done = std::move(done)](int error, const HttpResponse&) { done(error); });
+}
+
+void OnvifClient::createPullPointSubscription(uint32_t terminationSec, UriCallback done) {
+  std::string body = "<tev:CreatePullPointSubscription><tev:InitialTerminationTime>PT" +
+                     std::to_string(terminationSec) +
+                     "S</tev:InitialTerminationTime></tev:CreatePullPointSubscription>";
+  call(services_.events,
+       "http://www.onvif.org/ver10/events/wsdl/EventPortType/CreatePullPointSubscriptionRequest",
+       body, true, [done = std::move(done)](int error, const HttpResponse& response) {
+         if (error) {
+           done(error, std::string());
+           return;
+         }
+         XmlReader xml(response.body);
+         if (!xml.findElement("SubscriptionReference") || !xml.findElement("Address")) {
+           done(-EBADMSG, std::string());
+           return;
+         }
+         std::string address = xml.readText();
+         int rc = address.empty() ? -EBADMSG : 0;
+         done(rc, std::move(address));
+       });
+}
+
+void OnvifClient::pullMessages(const std::string& pullPoint, uint32_t timeoutSec,
+                               uint32_t limit, NotificationsCallback done) {
+  std::string body = "<tev:PullMessages><tev:Timeout>PT" + std::to_string(timeoutSec) +
+                     "S</tev:Timeout><tev:MessageLimit>" + std::to_string(limit) +
+                     "</tev:MessageLimit></tev:PullMessages>";
+  // The device holds the request for up to timeoutSec.
+  uint32_t timeoutMs = timeoutSec * 1000 + 5000;
+  call(pathOf(pullPoint, services_.events),
+       "http://www.onvif.org/ver10/events/wsdl/PullPointSubscription/PullMessagesRequest", body,
+       true,
+       [done = std::move(done)](int error, const HttpResponse& response) {
+         std::vector<OnvifNotification> notifications;
+         if (error) {
+           done(error, std::move(notifications));
+           return;
+         }
+         XmlReader xml(response.body);
+         while (xml.findElement("NotificationMessage")) {
+           OnvifNotification n;
+           int depth = xml.depth();
+           int itemsDepth = 0;  // inside Source or Data when non-zero
+           bool inData = false;
+           for (;;) {
+             XmlReader::Token t = xml.next();
+             if (t == XmlReader::Token::End || t == XmlReader::Token::Error) break;
+             if (t == XmlReader::Token::EndElement) {
+               if (xml.depth() == depth) break;
+               if (xml.depth() == itemsDepth) itemsDepth = 0;
+               continue;
+             }
+             if (t != XmlReader::Token::StartElement) continue;
+             std::string_view name = xml.localName();
+             if (name == "Topic") {
+               n.topic = xml.readText();
+             } else if (name == "Message") {
+               // wsnt:Message wraps tt:Message, which carries the attributes.
+               std::string time;
+               if (xml.attribute("UtcTime", &time)) n.utcTimeUs = parseUtcTime(time);
+               xml.attribute("PropertyOperation", &n.operation);
+             } else if (name == "Source" || name == "Data") {
+               itemsDepth = xml.depth();
+               inData = name == "Data";
+             } else if (name == "SimpleItem" && itemsDepth) {
+               std::string* value = inData ? &n.dataValue : &n.source;
+               if (!value->empty()) continue;
+               xml.attribute("Value", value);
+               if (inData) xml.attribute("Name", &n.dataName);
+             } else if (itemsDepth) {
+               // ElementItem payloads, e.g. analytics shapes, are not routed on.
+               xml.skipElement();
+             }
+           }
+           notifications.push_back(std::move(n));
+         }
+         done(0, std::move(notifications));
+       },
+       pullPoint, timeoutMs);
+}
+
+void OnvifClient::renewSubscription(const std::string& pullPoint, uint32_t terminationSec,
+                                    DoneCallback done) {
+  std::string body = "<wsnt:Renew><wsnt:TerminationTime>PT" + std::to_string(terminationSec) +
+                     "S</wsnt:TerminationTime></wsnt:Renew>";
+  call(pathOf(pullPoint, services_.events),
+       "http://docs.oasis-open.org/wsn/bw-2/SubscriptionManager/RenewRequest", body, true,
+       [done = std::move(done)](int error, const HttpResponse&) { done(error); }, pullPoint);
+}
+
+void OnvifClient::unsubscribe(const std::string& pullPoint, DoneCallback done) {
+  call(pathOf(pullPoint, services_.events),
+       "http://docs.oasis-open.org/wsn/bw-2/SubscriptionManager/UnsubscribeRequest",
+       "<wsnt:Unsubscribe/>", true,
+       [done = std::move(done)](int error, const HttpResponse&) { done(error); }, pullPoint);
+}
+
+}  // namespace nvr
@@ -0,0 +1,128 @@
+// Asynchronous ONVIF SOAP client for one device.
+//
+// Calls go through a shared HttpClient, so every device keeps a kept-alive
+// connection across a call sequence and thousands of devices can be in
+// flight on one loop. Responses are read with XmlReader and only the
+// fields the NVR uses are extracted.
+//
+// Service addresses come from GetCapabilities. Only their paths are used:
+// requests always go to the address the device was configured with, since
+// devices behind NAT or port forwarding routinely report internal
+// addresses. Until GetCapabilities succeeds the standard paths are assumed.
+//
+// A client is only touched from its HttpClient's loop thread and must
+// outlive its outstanding calls.
+
+#ifndef NVR_ONVIF_ONVIF_CLIENT_H
+#define NVR_ONVIF_ONVIF_CLIENT_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "base/socket_util.h"
+#include "base/url.h"
+#include "http/http_client.h"
+#include "onvif/ws_security.h"
+
+namespace nvr {
+
+struct OnvifProfile {
+  std::string token;
+  std::string name;
+  std::string encoding;  // H264, H265, JPEG, ...
+  int width = 0;
+  int height = 0;
+  int frameRate = 0;
+  bool ptz = false;  // has a PTZ configuration
+};
+
+// One wsnt:NotificationMessage, as much of it as event routing needs.
+struct OnvifNotification {
+  std::string topic;       // e.g. tns1:RuleEngine/CellMotionDetector/Motion
+  int64_t utcTimeUs = 0;   // UtcTime, device clock; 0 when absent
+  std::string operation;   // Initialized, Changed or Deleted
+  std::string source;      // first Source item value, e.g. a video source token
+  std::string dataName;    // first Data item, e.g. IsMotion
+  std::string dataValue;
+};
+
+struct OnvifServices {
+  std::string device = "/onvif/device_service";
+  std::string media = "/onvif/media_service";
+  std::string ptz = "/onvif/ptz_service";
+  std::string events = "/onvif/event_service";
+  bool hasPtz = false;
+  bool hasEvents = false;
+};
+
+class OnvifClient {
+ public:
+  // error is 0 or -errno: -EACCES when the device refused the credentials,
+  // -EPROTO for other SOAP faults and HTTP errors (see lastFault()),
+  // -EBADMSG for responses missing what was asked for.
+  using DoneCallback = std::function<void(int error)>;
+  using ProfilesCallback = std::function<void(int error, std::vector<OnvifProfile> profiles)>;
+  using UriCallback = std::function<void(int error, std::string uri)>;
+  using NotificationsCallback =
+      std::function<void(int error, std::vector<OnvifNotification> notifications)>;
+
+  // url is the device service, e.g. http://admin:pw@10.0.0.5/onvif/device_service.
+  // Symbolic host names are resolved here, blocking.
+  OnvifClient(HttpClient* http, const std::string& url, uint32_t tokenReuseMs = 10000);
+
+  OnvifClient(const OnvifClient&) = delete;
+  OnvifClient& operator=(const OnvifClient&) = delete;
+
+  bool valid() const { return valid_; }
+  const Url& url() const { return url_; }
+  const OnvifServices& services() const { return services_; }
+  const std::string& lastFault() const { return lastFault_; }
+  WsSecurity& security() { return security_; }
+
+  // Unauthenticated; measures the device clock offset used for tokens.
+  void getSystemDateAndTime(DoneCallback done);
+  // Fills services().
+  void getCapabilities(DoneCallback done);
+  void getProfiles(ProfilesCallback done);
+  // RTSP over TCP-or-UDP unicast URI of a media profile.
+  void getStreamUri(const std::string& profileToken, UriCallback done);
+  // Velocities in [-1, 1]; the device stops on its own after timeoutMs.
+  void continuousMove(const std::string& profileToken, float pan, float tilt, float zoom,
+                      uint32_t timeoutMs, DoneCallback done);
+  void stopMove(const std::string& profileToken, DoneCallback done);
+  // Creates an event pull point; yields its address for PullMessages.
+  void createPullPointSubscription(uint32_t terminationSec, UriCallback done);
+  // Long poll: the device answers as soon as it has messages, or with none
+  // after timeoutSec.
+  void pullMessages(const std::string& pullPoint, uint32_t timeoutSec, uint32_t limit,
+                    NotificationsCallback done);
+  void renewSubscription(const std::string& pullPoint, uint32_t terminationSec,
+                         DoneCallback done);
+  void unsubscribe(const std::string& pullPoint, DoneCallback done);
+
+ private:
+  using ResponseCallback = std::function<void(int error, const HttpResponse& response)>;
+
+  // to, when set, is sent as the WS-Addressing destination; timeoutMs
+  // overrides the HttpClient's request timeout.
+  void call(const std::string& path, const char* action, const std::string& body,
+            bool authenticate, ResponseCallback done, const std::string& to = std::string(),
+            uint32_t timeoutMs = 0, bool retried = false);
+  int checkResponse(const HttpResponse& response);
+
+  HttpClient* http_;
+  Url url_;
+  std::string host_;  // Host header
+  SocketAddress server_;
+  bool valid_ = false;
+  OnvifServices services_;
+  WsSecurity security_;
+  std::string lastFault_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_ONVIF_ONVIF_CLIENT_H
@@ -0,0 +1,145 @@
+#include "onvif/onvif_provisioner.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "base/log.h"
+
+namespace nvr {
+
+struct OnvifProvisioner::Job {
+  OnvifDevice device;
+  std::unique_ptr<OnvifClient> client;
+  OnvifProvisionResult result;
+  uint64_t startMs = 0;
+  size_t nextStream = 0;
+};
+
+OnvifProvisioner::OnvifProvisioner(HttpClient* http, const OnvifProvisionerOptions& options)
+    : http_(http), options_(options) {
+  if (options_.concurrency == 0) options_.concurrency = 1;
+}
+
+OnvifProvisioner::~OnvifProvisioner() {
+  for (Job* job : jobs_) delete job;
+}
+
+void OnvifProvisioner::provision(std::vector<OnvifDevice> devices, ResultCallback onResult,
+                                 DoneCallback done) {
+  onResult_ = std::move(onResult);
+  done_ = std::move(done);
+  for (auto& device : devices) queue_.push_back(std::move(device));
+  startNext();
+}
+
+void OnvifProvisioner::startNext() {
+  // finish() of a device that fails synchronously calls back in here.
+  if (starting_) return;
+  starting_ = true;
+  while (active_ < options_.concurrency && !queue_.empty()) {
+    auto* job = new Job;
+    job->device = std::move(queue_.front());
+    queue_.pop_front();
+    job->result.id = job->device.id;
+    job->startMs = http_->loop()->nowMs();
+    job->client.reset(new OnvifClient(http_, job->device.url, options_.tokenReuseMs));
+    jobs_.insert(job);
+    ++active_;
+    ++stats_.devices;
+    start(job);
+  }
+  starting_ = false;
+  if (active_ == 0 && queue_.empty() && done_) {
+    DoneCallback done = std::move(done_);
+    done_ = nullptr;
+    done();
+  }
+}
+
+void OnvifProvisioner::start(Job* job) {
+  if (!job->client->valid()) {
+    finish(job, -EINVAL, "Url");
+    return;
+  }
+  if (!options_.syncClock) {
+    getCapabilities(job);
+    return;
+  }
+  job->client->getSystemDateAndTime([this, job](int error) {
+    // A device that answers but cannot tell the time is still usable;
+    // one that cannot be reached is not.
+    if (error != 0 && error != -EPROTO && error != -EBADMSG && error != -EACCES) {
+      finish(job, error, "GetSystemDateAndTime");
+      return;
+    }
+    getCapabilities(job);
+  });
+}
+
+void OnvifProvisioner::getCapabilities(Job* job) {
+  job->client->getCapabilities([this, job](int error) {
+    if (error) {
+      finish(job, error, "GetCapabilities");
+      return;
+    }
+    job->result.services = job->client->services();
+    getProfiles(job);
+  });
+}
+
+void OnvifProvisioner::getProfiles(Job* job) {
+  job->client->getProfiles([this, job](int error, std::vector<OnvifProfile> profiles) {
+    if (error) {
+      finish(job, error, "GetProfiles");
+      return;
+    }
+    job->result.profiles = std::move(profiles);
+    getStreamUri(job);
+  });
+}
+
+void OnvifProvisioner::getStreamUri(Job* job) {
+  size_t wanted = std::min<size_t>(job->result.profiles.size(), options_.streamsPerDevice);
+  if (job->nextStream >= wanted) {
+    finish(job, 0, "");
+    return;
+  }
+  const std::string& token = job->result.profiles[job->nextStream].token;
+  job->client->getStreamUri(token, [this, job](int error, std::string uri) {
+    if (error) {
+      finish(job, error, "GetStreamUri");
+      return;
+    }
+    const Url& url = job->client->url();
+    job->result.streamUris.push_back(withCredentials(uri, url.user, url.password));
+    ++job->nextStream;
+    getStreamUri(job);
+  });
+}
+
+void OnvifProvisioner::finish(Job* job, int error, const char* step) {
+  job->result.error = error;
+  job->result.step = step;
+  if (error) job->result.fault = job->client->lastFault();
+  job->result.elapsedMs = http_->loop()->nowMs() - job->startMs;
+  const WsSecurity::Stats& security = job->client->security().stats();
+  stats_.digests += security.digests;
+  stats_.digestReuses += security.reused;
+  if (error) {
+    ++stats_.failed;
+    NVR_DEBUG("onvif %s: %s failed (%s)", job->device.id.c_str(), step, strerror(-error));
+  } else {
+    ++stats_.succeeded;
+  }
+  jobs_.erase(job);
+  --active_;
+  if (onResult_) onResult_(job->result);
+  // Called from inside the client's completion; free it once that returns.
+  http_->loop()->deleteLater(job);
+  startNext();
+}
+
+}  // namespace nvr
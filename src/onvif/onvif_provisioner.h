@@ -0,0 +1,105 @@
+// Bulk ONVIF provisioning: discovers the RTSP streams of many devices.
+//
+// Each device runs GetSystemDateAndTime, GetCapabilities, GetProfiles and
+// GetStreamUri for its first profiles, all on one kept-alive connection
+// and one cached WS-Security token. Up to `concurrency` devices are in
+// flight at once; the rest wait their turn, so a run over thousands of
+// devices holds a bounded number of sockets and pending calls.
+
+#ifndef NVR_ONVIF_ONVIF_PROVISIONER_H
+#define NVR_ONVIF_ONVIF_PROVISIONER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "http/http_client.h"
+#include "onvif/onvif_client.h"
+
+namespace nvr {
+
+struct OnvifDevice {
+  std::string id;
+  std::string url;  // device service URL with credentials
+};
+
+struct OnvifProvisionResult {
+  std::string id;
+  int error = 0;               // 0 or -errno from the failing step
+  const char* step = "";       // the failing step, e.g. "GetProfiles"
+  std::string fault;           // SOAP fault reason, if any
+  std::vector<OnvifProfile> profiles;
+  // RTSP URIs for the first profiles, with the device credentials added
+  // so they can be used as camera URLs directly.
+  std::vector<std::string> streamUris;
+  OnvifServices services;
+  uint64_t elapsedMs = 0;
+};
+
+struct OnvifProvisionerOptions {
+  uint32_t concurrency = 256;
+  // Main and sub stream.
+  uint32_t streamsPerDevice = 2;
+  uint32_t tokenReuseMs = 10000;
+  // Skip GetSystemDateAndTime when device clocks are known to be synced.
+  bool syncClock = true;
+};
+
+class OnvifProvisioner {
+ public:
+  using ResultCallback = std::function<void(const OnvifProvisionResult& result)>;
+  using DoneCallback = std::function<void()>;
+
+  struct Stats {
+    uint64_t devices = 0;
+    uint64_t succeeded = 0;
+    uint64_t failed = 0;
+    uint64_t digests = 0;      // WS-Security tokens computed
+    uint64_t digestReuses = 0; // requests that reused a cached token
+  };
+
+  OnvifProvisioner(HttpClient* http, const OnvifProvisionerOptions& options);
+  // Destroy after done has run, or after the HttpClient: calls still in
+  // flight refer to the provisioner.
+  ~OnvifProvisioner();
+
+  OnvifProvisioner(const OnvifProvisioner&) = delete;
+  OnvifProvisioner& operator=(const OnvifProvisioner&) = delete;
+
+  // Queues devices; results arrive in completion order. done runs once
+  // the queue has drained. Loop thread only.
+  void provision(std::vector<OnvifDevice> devices, ResultCallback onResult, DoneCallback done);
+
+  size_t inFlight() const { return active_; }
+  const Stats& stats() const { return stats_; }
+
+ private:
+  struct Job;
+
+  void startNext();
+  void start(Job* job);
+  void getCapabilities(Job* job);
+  void getProfiles(Job* job);
+  void getStreamUri(Job* job);
+  void finish(Job* job, int error, const char* step);
+
+  HttpClient* http_;
+  OnvifProvisionerOptions options_;
+  std::deque<OnvifDevice> queue_;
+  std::unordered_set<Job*> jobs_;
+  size_t active_ = 0;
+  bool starting_ = false;
+  ResultCallback onResult_;
+  DoneCallback done_;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_ONVIF_ONVIF_PROVISIONER_H
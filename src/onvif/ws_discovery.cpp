@@ -0,0 +1,351 @@
+#include "onvif/ws_discovery.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "base/clock.h"
+#include "base/hash.h"
+#include "base/log.h"
+#include "base/url.h"
+#include "onvif/xml_reader.h"
+
+namespace nvr {
+
+namespace {
+
+// ProbeMatches with a dozen scopes and several XAddrs fit easily.
+constexpr size_t kDatagramSize = 8192;
+constexpr size_t kRingSlots = 128;
+constexpr const char* kMulticastGroup = "239.255.255.250";
+constexpr size_t kMaxBatch = 256;
+
+std::string makeUuid(uint64_t seed) {
+  uint64_t hi = mix64(seed);
+  uint64_t lo = mix64(hi ^ 0x9e3779b97f4a7c15ULL);
+  // Version 4, RFC 4122 variant.
+  hi = (hi & ~0xf000ULL) | 0x4000ULL;
+  lo = (lo & ~(3ULL << 62)) | (2ULL << 62);
+  char buf[40];
+  snprintf(buf, sizeof(buf), "%08x-%04x-%04x-%04x-%012llx", static_cast<unsigned>(hi >> 32),
+           static_cast<unsigned>((hi >> 16) & 0xffff), static_cast<unsigned>(hi & 0xffff),
+           static_cast<unsigned>(lo >> 48),
+           static_cast<unsigned long long>(lo & 0xffffffffffffULL));
+  return buf;
+}
+
+void splitWords(const std::string& text, std::vector<std::string>* out) {
+  size_t i = 0;
+  while (i < text.size()) {
+    while (i < text.size() && isspace(static_cast<unsigned char>(text[i]))) ++i;
+    size_t start = i;
+    while (i < text.size() && !isspace(static_cast<unsigned char>(text[i]))) ++i;
+    if (i > start) out->push_back(text.substr(start, i - start));
+  }
+}
+
+bool startsWithIgnoreCase(const std::string& s, const char* prefix) {
+  size_t n = strlen(prefix);
+  return s.size() >= n && strncasecmp(s.data(), prefix, n) == 0;
+}
+
+}  // namespace
+
+std::string DiscoveredDevice::scope(const char* key) const {
+  std::string prefix = std::string("onvif://www.onvif.org/") + key + "/";
+  for (const auto& s : scopes) {
+    if (startsWithIgnoreCase(s, prefix.c_str())) return percentDecode(s.substr(prefix.size()));
+  }
+  return "";
+}
+
+size_t WsDiscovery::KeyHash::operator()(const Key& key) const {
+  return static_cast<size_t>(mix64(key.hi ^ (key.lo * 0x9e3779b97f4a7c15ULL)));
+}
+
+WsDiscovery::Key WsDiscovery::keyFor(const std::string& endpoint) {
+  // urn:uuid:6f1a... and uuid:6F1A... name the same device.
+  size_t start = 0;
+  if (startsWithIgnoreCase(endpoint, "urn:uuid:")) {
+    start = 9;
+  } else if (startsWithIgnoreCase(endpoint, "uuid:")) {
+    start = 5;
+  }
+  Key key{0, 0};
+  int digits = 0;
+  for (size_t i = start; i < endpoint.size(); ++i) {
+    char c = endpoint[i];
+    if (c == '-') continue;
+    int v;
+    if (c >= '0' && c <= '9') {
+      v = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      v = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      v = c - 'A' + 10;
+    } else {
+      digits = -1;
+      break;
+    }
+    if (digits < 16) {
+      key.hi = (key.hi << 4) | v;
+    } else if (digits < 32) {
+      key.lo = (key.lo << 4) | v;
+    }
+    ++digits;
+  }
+  if (digits == 32) return key;
+  // Not a UUID; any stable URI still identifies the device.
+  std::string lower = endpoint;
+  for (char& c : lower) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+  return Key{fnv1a64(lower), fnv1a64(lower.data(), lower.size(), 0x84222325cbf29ce4ULL)};
+}
+
+WsDiscovery::WsDiscovery(EventLoop* loop, const WsDiscoveryOptions& options)
+    : loop_(loop), options_(options), pool_(new PacketPool(kDatagramSize)) {
+  if (options_.batchSize == 0) options_.batchSize = 1;
+  if (options_.batchSize > kMaxBatch) options_.batchSize = kMaxBatch;
+  if (options_.repeats == 0) options_.repeats = 1;
+  if (options_.batchIntervalMs == 0) options_.batchIntervalMs = 1;
+}
+
+WsDiscovery::~WsDiscovery() {
+  stop();
+  // Deleted after any receiver queued by stop().
+  loop_->deleteLater(pool_.release());
+}
+
+UdpReceiverStats WsDiscovery::receiveStats() const {
+  UdpReceiverStats total = retiredStats_;
+  if (receiver_) total.add(receiver_->stats());
+  return total;
+}
+
+int WsDiscovery::start(std::vector<SocketAddress> targets, DeviceCallback onDevice,
+                       DoneCallback done) {
+  stop();
+  int fd = udpBind(AF_INET, 0);
+  if (fd < 0) return fd;
+  // A sweep answers in bursts of thousands of datagrams.
+  setRecvBufferSize(fd, 4 << 20);
+  setSendBufferSize(fd, 1 << 20);
+
+  targets_.clear();
+  if (options_.multicast) {
+    SocketAddress group;
+    int rc = resolveAddress(kMulticastGroup, options_.port, &group);
+    if (rc < 0) {
+      ::close(fd);
+      return rc;
+    }
+    targets_.push_back(group);
+  }
+  for (auto& target : targets) targets_.push_back(target);
+
+  seen_.clear();
+  stats_ = Stats();
+  retiredStats_ = UdpReceiverStats();
+  onDevice_ = std::move(onDevice);
+  done_ = std::move(done);
+  messageId_ = "urn:uuid:" + makeUuid(static_cast<uint64_t>(wallClockUs()) ^
+                                      reinterpret_cast<uintptr_t>(this));
+  probe_ =
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+      "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\""
+      " xmlns:a=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\""
+      " xmlns:d=\"http://schemas.xmlsoap.org/ws/2005/04/discovery\""
+      " xmlns:dn=\"http://www.onvif.org/ver10/network/wsdl\"><s:Header><a:MessageID>" +
+      messageId_ +
+      "</a:MessageID><a:To s:mustUnderstand=\"1\">urn:schemas-xmlsoap-org:ws:2005:04:discovery"
+      "</a:To><a:Action s:mustUnderstand=\"1\">http://schemas.xmlsoap.org/ws/2005/04/discovery"
+      "/Probe</a:Action></s:Header><s:Body><d:Probe><d:Types>" +
+      xmlEscape(options_.types) + "</d:Types></d:Probe></s:Body></s:Envelope>";
+
+  receiver_.reset(new UdpReceiver(loop_, pool_.get(), fd, this, kRingSlots,
+                                  UdpReceiver::kMaxBatch));
+  cursor_ = 0;
+  round_ = 0;
+  roundStartMs_ = loop_->nowMs();
+  sendBatch();
+  if (receiver_ && round_ < options_.repeats)
+    sendTimer_ = loop_->runEvery(options_.batchIntervalMs, [this] { sendBatch(); });
+  return 0;
+}
+
+void WsDiscovery::stop() {
+  if (sendTimer_) loop_->cancel(sendTimer_);
+  if (doneTimer_) loop_->cancel(doneTimer_);
+  sendTimer_ = doneTimer_ = 0;
+  if (receiver_) {
+    retiredStats_.add(receiver_->stats());
+    retiredStats_.ringBytes = 0;
+    receiver_->close();
+    // May be inside its own onEvents.
+    loop_->deleteLater(receiver_.release());
+  }
+  onDevice_ = nullptr;
+  done_ = nullptr;
+}
+
+void WsDiscovery::sendBatch() {
+  if (!receiver_ || round_ >= options_.repeats) return;
+  uint64_t now = loop_->nowMs();
+  if (cursor_ == 0 && round_ > 0 && now < roundStartMs_ + options_.repeatIntervalMs) return;
+  if (cursor_ == 0) roundStartMs_ = now;
+
+  struct mmsghdr msgs[kMaxBatch];
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(probe_.data());
+  iov.iov_len = probe_.size();
+  size_t count = std::min<size_t>(options_.batchSize, targets_.size() - cursor_);
+  for (size_t i = 0; i < count; ++i) {
+    const SocketAddress& to = targets_[cursor_ + i];
+    struct msghdr& hdr = msgs[i].msg_hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = const_cast<struct sockaddr*>(to.get());
+    hdr.msg_namelen = to.length;
+    // Every probe carries the same bytes.
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+  }
+  size_t sent = 0;
+  while (sent < count) {
+    int n = sendmmsg(receiver_->fd(), msgs + sent, static_cast<unsigned>(count - sent), 0);
+    ++stats_.sendBatches;
+    if (n < 0) {
+      // A full socket buffer: resume on the next tick. Anything else is
+      // about this one destination (unreachable, no route); skip it.
+      if (errno == EAGAIN || errno == ENOBUFS) break;
+      ++stats_.sendDrops;
+      ++sent;
+      continue;
+    }
+    sent += static_cast<size_t>(n);
+    stats_.probesSent += static_cast<uint64_t>(n);
+  }
+  cursor_ += sent;
+  if (cursor_ < targets_.size()) return;
+  cursor_ = 0;
+  if (++round_ < options_.repeats) return;
+  if (sendTimer_) loop_->cancel(sendTimer_);
+  sendTimer_ = 0;
+  doneTimer_ = loop_->runAfter(options_.listenMs, [this] { finish(); });
+}
+
+void WsDiscovery::finish() {
+  doneTimer_ = 0;
+  DoneCallback done = std::move(done_);
+  stop();
+  if (done) done();
+}
+
+void WsDiscovery::onDatagram(UdpReceiver* /*receiver*/, const PacketRef& packet,
+                             const SocketAddress& from) {
+  XmlReader xml(reinterpret_cast<const char*>(packet.data()), packet.size());
+  bool relates = false;
+  bool any = false;
+  for (;;) {
+    XmlReader::Token t = xml.next();
+    if (t == XmlReader::Token::End || t == XmlReader::Token::Error) break;
+    if (t != XmlReader::Token::StartElement) continue;
+    std::string_view name = xml.localName();
+    if (name == "RelatesTo") {
+      relates = xml.readText() == messageId_;
+      continue;
+    }
+    if (name != "ProbeMatch") continue;
+    // Replies to someone else's probe, or Hello/Bye traffic.
+    if (!relates) break;
+    any = true;
+    ++stats_.matches;
+    DiscoveredDevice device;
+    int depth = xml.depth();
+    for (;;) {
+      t = xml.next();
+      if (t == XmlReader::Token::End || t == XmlReader::Token::Error) break;
+      if (t == XmlReader::Token::EndElement && xml.depth() == depth) break;
+      if (t != XmlReader::Token::StartElement) continue;
+      std::string_view field = xml.localName();
+      if (field == "Address") {
+        device.endpoint = xml.readText();
+      } else if (field == "Types") {
+        device.types = xml.readText();
+      } else if (field == "Scopes") {
+        splitWords(xml.readText(), &device.scopes);
+      } else if (field == "XAddrs") {
+        splitWords(xml.readText(), &device.xaddrs);
+      } else if (field == "MetadataVersion") {
+        device.metadataVersion = static_cast<uint32_t>(strtoul(xml.readText().c_str(),
+                                                               nullptr, 10));
+      }
+    }
+    if (device.endpoint.empty()) {
+      ++stats_.ignored;
+      continue;
+    }
+    if (!seen_.insert(keyFor(device.endpoint)).second) {
+      ++stats_.duplicates;
+      continue;
+    }
+    ++stats_.devices;
+    device.from = from;
+    if (onDevice_) onDevice_(device);
+    // The callback may have stopped the scan.
+    if (!receiver_) return;
+  }
+  if (!any) ++stats_.ignored;
+}
+
+int subnetTargets(const std::string& cidr, uint16_t port, std::vector<SocketAddress>* out) {
+  size_t slash = cidr.find('/');
+  std::string host = cidr.substr(0, slash);
+  int prefix = slash == std::string::npos ? 32 : atoi(cidr.c_str() + slash + 1);
+  struct in_addr addr;
+  // Anything wider than a /12 (a million hosts) is a typo, not a network.
+  if (inet_pton(AF_INET, host.c_str(), &addr) != 1 || prefix < 12 || prefix > 32)
+    return -EINVAL;
+  uint32_t mask = prefix == 32 ? 0xffffffffu : ~(0xffffffffu >> prefix);
+  uint32_t network = ntohl(addr.s_addr) & mask;
+  uint32_t size = ~mask + 1u;
+  uint32_t first = network, last = network + size - 1;
+  if (prefix < 31) {
+    ++first;
+    --last;
+  }
+  out->reserve(out->size() + (last - first + 1));
+  for (uint32_t ip = first;; ++ip) {
+    SocketAddress target;
+    memset(&target.storage, 0, sizeof(target.storage));
+    auto* sin = reinterpret_cast<struct sockaddr_in*>(&target.storage);
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(ip);
+    sin->sin_port = htons(port);
+    target.length = sizeof(*sin);
+    out->push_back(target);
+    if (ip == last) break;
+  }
+  return 0;
+}
+
+bool onvifDeviceFor(const DiscoveredDevice& device, const std::string& user,
+                    const std::string& password, OnvifDevice* out) {
+  for (const auto& xaddr : device.xaddrs) {
+    if (!startsWithIgnoreCase(xaddr, "http://")) continue;
+    out->id = device.endpoint;
+    if (startsWithIgnoreCase(out->id, "urn:uuid:")) out->id.erase(0, 9);
+    out->url = withCredentials(xaddr, user, password);
+    return true;
+  }
+  return false;
+}
+
+}  // namespace nvr
@@ -0,0 +1,141 @@
+// ONVIF WS-Discovery scanner (WS-Discovery 2005/04, SOAP over UDP).
+//
+// One scan sends the same Probe to the multicast group and to any number of
+// unicast targets, e.g. every address of a flat /16 that multicast does not
+// reach. Probes go out in sendmmsg() batches paced by a timer, each target
+// is probed `repeats` times to ride out UDP loss, and ProbeMatches are
+// drained with recvmmsg() through a UdpReceiver. Devices answer each probe
+// they see, often from several interfaces, so replies are deduplicated by
+// endpoint reference (the device's stable UUID) in a hash set and every
+// device is reported once.
+//
+// A scanner lives on one EventLoop and is only touched from its thread.
+
+#ifndef NVR_ONVIF_WS_DISCOVERY_H
+#define NVR_ONVIF_WS_DISCOVERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "base/packet_buffer.h"
+#include "base/socket_util.h"
+#include "onvif/onvif_provisioner.h"
+#include "rtp/udp_receiver.h"
+
+namespace nvr {
+
+struct WsDiscoveryOptions {
+  std::string types = "dn:NetworkVideoTransmitter";
+  bool multicast = true;
+  uint16_t port = 3702;  // destination port, multicast and unicast
+  uint32_t batchSize = 64;       // probes per sendmmsg
+  uint32_t batchIntervalMs = 2;  // pacing between batches
+  // Each target is probed this many times, rounds at least
+  // repeatIntervalMs apart.
+  uint32_t repeats = 2;
+  uint32_t repeatIntervalMs = 500;
+  // Keep listening this long after the last probe.
+  uint32_t listenMs = 2000;
+};
+
+struct DiscoveredDevice {
+  std::string endpoint;  // EPR address, usually urn:uuid:...
+  std::vector<std::string> xaddrs;
+  std::vector<std::string> scopes;
+  std::string types;
+  uint32_t metadataVersion = 0;
+  SocketAddress from;
+
+  // Value of an ONVIF scope, e.g. scope("name") for
+  // onvif://www.onvif.org/name/<value>; "" when absent.
+  std::string scope(const char* key) const;
+};
+
+class WsDiscovery : public UdpPacketHandler {
+ public:
+  using DeviceCallback = std::function<void(const DiscoveredDevice& device)>;
+  using DoneCallback = std::function<void()>;
+
+  struct Stats {
+    uint64_t probesSent = 0;
+    uint64_t sendBatches = 0;  // sendmmsg calls
+    uint64_t sendDrops = 0;    // probes the socket would not take
+    uint64_t matches = 0;      // ProbeMatch entries received
+    uint64_t devices = 0;      // distinct endpoints reported
+    uint64_t duplicates = 0;   // matches for endpoints already reported
+    uint64_t ignored = 0;      // unparsable or not answering our probe
+  };
+
+  WsDiscovery(EventLoop* loop, const WsDiscoveryOptions& options = WsDiscoveryOptions());
+  ~WsDiscovery() override;
+
+  WsDiscovery(const WsDiscovery&) = delete;
+  WsDiscovery& operator=(const WsDiscovery&) = delete;
+
+  // Starts a scan of the multicast group (if enabled) and the unicast
+  // targets. done runs after the listen window. Returns 0 or -errno.
+  int start(std::vector<SocketAddress> targets, DeviceCallback onDevice, DoneCallback done);
+  // Ends the scan early; no callbacks after this.
+  void stop();
+  bool running() const { return receiver_ != nullptr; }
+
+  const Stats& stats() const { return stats_; }
+  // recvmmsg counters of the scan socket.
+  UdpReceiverStats receiveStats() const;
+
+  void onDatagram(UdpReceiver* receiver, const PacketRef& packet,
+                  const SocketAddress& from) override;
+
+ private:
+  struct Key {
+    uint64_t hi;
+    uint64_t lo;
+    bool operator==(const Key& other) const { return hi == other.hi && lo == other.lo; }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& key) const;
+  };
+
+  void sendBatch();
+  void finish();
+  static Key keyFor(const std::string& endpoint);
+
+  EventLoop* loop_;
+  WsDiscoveryOptions options_;
+  // Outlives receivers retired by stop(); freed after them.
+  std::unique_ptr<PacketPool> pool_;
+  std::unique_ptr<UdpReceiver> receiver_;
+  std::string probe_;
+  std::string messageId_;
+  std::vector<SocketAddress> targets_;
+  size_t cursor_ = 0;  // next target in the current round
+  uint32_t round_ = 0;
+  uint64_t roundStartMs_ = 0;
+  EventLoop::TimerId sendTimer_ = 0;
+  EventLoop::TimerId doneTimer_ = 0;
+  std::unordered_set<Key, KeyHash> seen_;
+  DeviceCallback onDevice_;
+  DoneCallback done_;
+  UdpReceiverStats retiredStats_;
+  Stats stats_;
+};
+
+// Appends every host address of an IPv4 CIDR block (e.g. "10.1.0.0/16"),
+// excluding network and broadcast addresses. Returns 0 or -EINVAL.
+int subnetTargets(const std::string& cidr, uint16_t port, std::vector<SocketAddress>* out);
+
+// Management entry for a discovered device: the first http XAddr with the
+// given (percent-encoded) credentials; the id is the endpoint UUID.
+bool onvifDeviceFor(const DiscoveredDevice& device, const std::string& user,
+                    const std::string& password, OnvifDevice* out);
+
+}  // namespace nvr
+
+#endif  // NVR_ONVIF_WS_DISCOVERY_H
@@ -0,0 +1,93 @@
+#include "onvif/ws_security.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <utility>
+
+#include "base/base64.h"
+#include "base/clock.h"
+#include "base/hash.h"
+#include "base/sha1.h"
+#include "onvif/xml_reader.h"
+
+namespace nvr {
+
+WsSecurity::WsSecurity(std::string user, std::string password, uint32_t reuseMs)
+    : user_(std::move(user)), password_(std::move(password)), reuseMs_(reuseMs) {
+  nonceState_ = mix64(fnv1a64(user_) ^ static_cast<uint64_t>(wallClockUs()) ^
+                      reinterpret_cast<uintptr_t>(this));
+}
+
+void WsSecurity::invalidate() { valid_ = false; }
+
+void WsSecurity::setClockOffsetUs(int64_t offsetUs) {
+  // A token created on the old clock would now look stale or early.
+  if (offsetUs != clockOffsetUs_) valid_ = false;
+  clockOffsetUs_ = offsetUs;
+}
+
+std::string WsSecurity::passwordDigest(const std::string& nonce, const std::string& created,
+                                       const std::string& password) {
+  Sha1 sha1;
+  sha1.update(nonce);
+  sha1.update(created);
+  sha1.update(password);
+  uint8_t digest[20];
+  sha1.final(digest);
+  return base64Encode(digest, sizeof(digest));
+}
+
+std::string WsSecurity::formatCreated(int64_t wallUs) {
+  time_t sec = static_cast<time_t>(wallUs / 1000000);
+  struct tm tm;
+  gmtime_r(&sec, &tm);
+  char buf[80];
+  snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", tm.tm_year + 1900,
+           tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+           static_cast<int>(wallUs / 1000 % 1000));
+  return buf;
+}
+
+const std::string& WsSecurity::header(uint64_t nowMs) {
+  if (user_.empty()) {
+    header_.clear();
+    return header_;
+  }
+  if (valid_ && nowMs - createdMs_ < reuseMs_) {
+    ++stats_.reused;
+    lastReused_ = true;
+    return header_;
+  }
+  std::string nonce(16, '\0');
+  for (size_t i = 0; i < nonce.size(); i += 8) {
+    nonceState_ = mix64(nonceState_ + 0x9e3779b97f4a7c15ULL);
+    for (size_t j = 0; j < 8; ++j) nonce[i + j] = static_cast<char>(nonceState_ >> (8 * j));
+  }
+  std::string created = formatCreated(wallClockUs() + clockOffsetUs_);
+  header_.clear();
+  header_ +=
+      "<wsse:Security s:mustUnderstand=\"1\" xmlns:wsse=\"http://docs.oasis-open.org/wss/2004/"
+      "01/oasis-200401-wss-wssecurity-secext-1.0.xsd\" xmlns:wsu=\"http://docs.oasis-open.org/"
+      "wss/2004/01/oasis-200401-wss-wssecurity-utility-1.0.xsd\"><wsse:UsernameToken>"
+      "<wsse:Username>";
+  header_ += xmlEscape(user_);
+  header_ +=
+      "</wsse:Username><wsse:Password Type=\"http://docs.oasis-open.org/wss/2004/01/"
+      "oasis-200401-wss-username-token-profile-1.0#PasswordDigest\">";
+  header_ += passwordDigest(nonce, created, password_);
+  header_ +=
+      "</wsse:Password><wsse:Nonce EncodingType=\"http://docs.oasis-open.org/wss/2004/01/"
+      "oasis-200401-wss-soap-message-security-1.0#Base64Binary\">";
+  header_ += base64Encode(nonce);
+  header_ += "</wsse:Nonce><wsu:Created>";
+  header_ += created;
+  header_ += "</wsu:Created></wsse:UsernameToken></wsse:Security>";
+  valid_ = true;
+  lastReused_ = false;
+  createdMs_ = nowMs;
+  ++stats_.digests;
+  return header_;
+}
+
+}  // namespace nvr
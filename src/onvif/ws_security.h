@@ -0,0 +1,69 @@
+// WS-Security UsernameToken (OASIS UsernameToken Profile 1.0) for ONVIF
+// SOAP calls.
+//
+// PasswordDigest = Base64(SHA-1(nonce + created + password)), where created
+// is the device's notion of now. Computing it per request is cheap but not
+// free across thousands of devices, so a token is reused for reuseMs: every
+// call in a provisioning sequence carries the same header. ONVIF devices
+// accept a token until its Created time falls out of their freshness window
+// (typically minutes); devices that enforce one-time nonces need reuseMs 0.
+
+#ifndef NVR_ONVIF_WS_SECURITY_H
+#define NVR_ONVIF_WS_SECURITY_H
+
+#include <stdint.h>
+
+#include <string>
+
+namespace nvr {
+
+class WsSecurity {
+ public:
+  struct Stats {
+    uint64_t digests = 0;  // tokens computed
+    uint64_t reused = 0;   // headers served from the cached token
+  };
+
+  WsSecurity() = default;
+  WsSecurity(std::string user, std::string password, uint32_t reuseMs = 10000);
+
+  bool hasCredentials() const { return !user_.empty(); }
+
+  // Device clock minus local clock, from GetSystemDateAndTime. Devices
+  // reject tokens created too far from their own time.
+  void setClockOffsetUs(int64_t offsetUs);
+  int64_t clockOffsetUs() const { return clockOffsetUs_; }
+
+  // <wsse:Security> element for a request sent at nowMs (monotonic), or ""
+  // without credentials.
+  const std::string& header(uint64_t nowMs);
+  // Forces a fresh token on the next header(), e.g. after the device
+  // rejected the cached one.
+  void invalidate();
+  // True when the last header() came from the cache.
+  bool lastReused() const { return lastReused_; }
+
+  const Stats& stats() const { return stats_; }
+
+  // Token digest per the profile; exposed for servers that verify it.
+  static std::string passwordDigest(const std::string& nonce, const std::string& created,
+                                    const std::string& password);
+  // xsd:dateTime in UTC, e.g. "2024-05-01T12:00:00.123Z".
+  static std::string formatCreated(int64_t wallUs);
+
+ private:
+  std::string user_;
+  std::string password_;
+  uint32_t reuseMs_ = 10000;
+  int64_t clockOffsetUs_ = 0;
+  uint64_t nonceState_ = 0;
+  bool valid_ = false;
+  bool lastReused_ = false;
+  uint64_t createdMs_ = 0;
+  std::string header_;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_ONVIF_WS_SECURITY_H
@@ -0,0 +1,301 @@
+#include "onvif/xml_reader.h"
+
+#include <stdint.h>
+#include <string.h>
+
+namespace nvr {
+
+namespace {
+
+inline bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+inline bool isNameEnd(char c) { return isSpace(c) || c == '/' || c == '>' || c == '='; }
+
+const char* find(const char* p, const char* end, const char* pattern) {
+  size_t n = strlen(pattern);
+  while (p + n <= end) {
+    const char* hit = static_cast<const char*>(memchr(p, pattern[0], end - p));
+    if (hit == nullptr || hit + n > end) return nullptr;
+    if (memcmp(hit, pattern, n) == 0) return hit;
+    p = hit + 1;
+  }
+  return nullptr;
+}
+
+void appendUtf8(uint32_t cp, std::string* out) {
+  if (cp < 0x80) {
+    out->push_back(static_cast<char>(cp));
+  } else if (cp < 0x800) {
+    out->push_back(static_cast<char>(0xc0 | (cp >> 6)));
+    out->push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+  } else if (cp < 0x10000) {
+    out->push_back(static_cast<char>(0xe0 | (cp >> 12)));
+    out->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+    out->push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+  } else if (cp < 0x110000) {
+    out->push_back(static_cast<char>(0xf0 | (cp >> 18)));
+    out->push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+    out->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+    out->push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+  }
+}
+
+}  // namespace
+
+std::string_view xmlLocalName(std::string_view name) {
+  size_t colon = name.rfind(':');
+  return colon == std::string_view::npos ? name : name.substr(colon + 1);
+}
+
+std::string xmlEscape(std::string_view text) {
+  std::string out;
+  out.reserve(text.size());
+  for (char c : text) {
+    switch (c) {
+      case '<': out += "&lt;"; break;
+      case '>': out += "&gt;"; break;
+      case '&': out += "&amp;"; break;
+      case '"': out += "&quot;"; break;
+      case '\'': out += "&apos;"; break;
+      default: out.push_back(c); break;
+    }
+  }
+  return out;
+}
+
+XmlReader::XmlReader(const char* data, size_t len) : p_(data), end_(data + len) {}
+
+std::string_view XmlReader::localName() const { return xmlLocalName(name_); }
+
+XmlReader::Token XmlReader::fail() {
+  token_ = Token::Error;
+  return token_;
+}
+
+XmlReader::Token XmlReader::next() {
+  if (token_ == Token::End || token_ == Token::Error) return token_;
+  if (token_ == Token::EndElement) --depth_;
+  if (selfClosing_) {
+    selfClosing_ = false;
+    token_ = Token::EndElement;
+    return token_;
+  }
+  for (;;) {
+    if (p_ >= end_) {
+      token_ = depth_ == 0 ? Token::End : Token::Error;
+      return token_;
+    }
+    if (*p_ == '<') {
+      Token t = parseMarkup();
+      // Comments, processing instructions and DOCTYPE come back as End
+      // with the cursor moved past them.
+      if (t != Token::End) return t;
+      continue;
+    }
+    const char* lt = static_cast<const char*>(memchr(p_, '<', end_ - p_));
+    const char* textEnd = lt ? lt : end_;
+    const char* begin = p_;
+    p_ = textEnd;
+    bool blank = true;
+    for (const char* q = begin; q < textEnd; ++q) {
+      if (!isSpace(*q)) {
+        blank = false;
+        break;
+      }
+    }
+    if (blank) continue;
+    if (!decodeInto(begin, textEnd, &text_)) return fail();
+    token_ = Token::Text;
+    return token_;
+  }
+}
+
+XmlReader::Token XmlReader::parseMarkup() {
+  const char* p = p_ + 1;
+  if (p >= end_) return fail();
+  if (*p == '?') {
+    const char* close = find(p, end_, "?>");
+    if (!close) return fail();
+    p_ = close + 2;
+    return Token::End;
+  }
+  if (*p == '!') {
+    if (end_ - p >= 3 && memcmp(p, "!--", 3) == 0) {
+      const char* close = find(p + 3, end_, "-->");
+      if (!close) return fail();
+      p_ = close + 3;
+      return Token::End;
+    }
+    if (end_ - p >= 8 && memcmp(p, "![CDATA[", 8) == 0) {
+      const char* close = find(p + 8, end_, "]]>");
+      if (!close) return fail();
+      text_.assign(p + 8, close - (p + 8));
+      p_ = close + 3;
+      token_ = Token::Text;
+      return token_;
+    }
+    // DOCTYPE, possibly with an internal subset in brackets.
+    int brackets = 0;
+    for (; p < end_; ++p) {
+      if (*p == '[') ++brackets;
+      if (*p == ']') --brackets;
+      if (*p == '>' && brackets <= 0) break;
+    }
+    if (p >= end_) return fail();
+    p_ = p + 1;
+    return Token::End;
+  }
+  if (*p == '/') {
+    const char* begin = ++p;
+    while (p < end_ && !isNameEnd(*p)) ++p;
+    name_ = std::string_view(begin, p - begin);
+    while (p < end_ && isSpace(*p)) ++p;
+    if (p >= end_ || *p != '>' || name_.empty() || depth_ <= 0) return fail();
+    p_ = p + 1;
+    token_ = Token::EndElement;
+    return token_;
+  }
+  p_ = p;
+  return parseStartElement();
+}
+
+XmlReader::Token XmlReader::parseStartElement() {
+  const char* p = p_;
+  const char* begin = p;
+  while (p < end_ && !isNameEnd(*p)) ++p;
+  if (p == begin) return fail();
+  name_ = std::string_view(begin, p - begin);
+  attributes_.clear();
+  for (;;) {
+    while (p < end_ && isSpace(*p)) ++p;
+    if (p >= end_) return fail();
+    if (*p == '>') {
+      ++p;
+      break;
+    }
+    if (*p == '/') {
+      if (p + 1 >= end_ || p[1] != '>') return fail();
+      p += 2;
+      selfClosing_ = true;
+      break;
+    }
+    const char* nameBegin = p;
+    while (p < end_ && !isNameEnd(*p)) ++p;
+    std::string_view attrName(nameBegin, p - nameBegin);
+    while (p < end_ && isSpace(*p)) ++p;
+    if (attrName.empty() || p >= end_ || *p != '=') return fail();
+    ++p;
+    while (p < end_ && isSpace(*p)) ++p;
+    if (p >= end_ || (*p != '"' && *p != '\'')) return fail();
+    char quote = *p++;
+    const char* close = static_cast<const char*>(memchr(p, quote, end_ - p));
+    if (!close) return fail();
+    attributes_.emplace_back(attrName, std::string_view(p, close - p));
+    p = close + 1;
+  }
+  p_ = p;
+  ++depth_;
+  token_ = Token::StartElement;
+  return token_;
+}
+
+bool XmlReader::decodeInto(const char* begin, const char* end, std::string* out) const {
+  out->clear();
+  const char* p = begin;
+  while (p < end) {
+    const char* amp = static_cast<const char*>(memchr(p, '&', end - p));
+    if (!amp) {
+      out->append(p, end - p);
+      break;
+    }
+    out->append(p, amp - p);
+    const char* semi = static_cast<const char*>(memchr(amp, ';', end - amp));
+    if (!semi || semi - amp > 10) return false;
+    std::string_view entity(amp + 1, semi - amp - 1);
+    if (entity == "lt") {
+      out->push_back('<');
+    } else if (entity == "gt") {
+      out->push_back('>');
+    } else if (entity == "amp") {
+      out->push_back('&');
+    } else if (entity == "quot") {
+      out->push_back('"');
+    } else if (entity == "apos") {
+      out->push_back('\'');
+    } else if (entity.size() > 1 && entity[0] == '#') {
+      bool hex = entity[1] == 'x' || entity[1] == 'X';
+      uint32_t cp = 0;
+      for (size_t i = hex ? 2 : 1; i < entity.size(); ++i) {
+        char c = entity[i];
+        int digit;
+        if (c >= '0' && c <= '9') {
+          digit = c - '0';
+        } else if (hex && c >= 'a' && c <= 'f') {
+          digit = c - 'a' + 10;
+        } else if (hex && c >= 'A' && c <= 'F') {
+          digit = c - 'A' + 10;
+        } else {
+          return false;
+        }
+        cp = cp * (hex ? 16 : 10) + digit;
+      }
+      appendUtf8(cp, out);
+    } else {
+      return false;
+    }
+    p = semi + 1;
+  }
+  return true;
+}
+
+bool XmlReader::attribute(std::string_view localName, std::string* value) const {
+  if (token_ != Token::StartElement) return false;
+  for (const auto& attr : attributes_) {
+    if (xmlLocalName(attr.first) == localName)
+      return decodeInto(attr.second.data(), attr.second.data() + attr.second.size(), value);
+  }
+  return false;
+}
+
+bool XmlReader::skipElement() {
+  int depth = depth_;
+  for (;;) {
+    Token t = next();
+    if (t == Token::EndElement && depth_ == depth) return true;
+    if (t == Token::End || t == Token::Error) return false;
+  }
+}
+
+std::string XmlReader::readText() {
+  std::string out;
+  int depth = depth_;
+  for (;;) {
+    Token t = next();
+    if (t == Token::Text && depth_ == depth) out += text_;
+    if (t == Token::EndElement && depth_ == depth) break;
+    if (t == Token::End || t == Token::Error) break;
+  }
+  size_t b = 0, e = out.size();
+  while (b < e && isSpace(out[b])) ++b;
+  while (e > b && isSpace(out[e - 1])) --e;
+  return out.substr(b, e - b);
+}
+
+bool XmlReader::findElement(std::string_view localName) {
+  for (;;) {
+    Token t = next();
+    if (t == Token::StartElement && this->localName() == localName) return true;
+    if (t == Token::End || t == Token::Error) return false;
+  }
+}
+
+bool XmlReader::findChild(std::string_view localName, int within) {
+  for (;;) {
+    Token t = next();
+    if (t == Token::StartElement && this->localName() == localName) return true;
+    if (t == Token::EndElement && depth_ == within) return false;
+    if (t == Token::End || t == Token::Error) return false;
+  }
+}
+
+}  // namespace nvr
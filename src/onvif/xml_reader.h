@@ -0,0 +1,88 @@
+// Streaming pull parser for the XML in SOAP and REST device responses.
+//
+// The reader walks a buffer token by token and builds no tree: element
+// names and attribute values are views into the buffer, and text is
+// decoded into one scratch string that is reused across tokens. Callers
+// pick out the few fields they need and skip the rest, so a 40 KB
+// GetProfiles response costs one pass and no per-element allocation.
+//
+// It is not a validating parser. Namespaces are handled by matching local
+// names (the part after the prefix), which is how device responses are
+// read in practice: vendors disagree on prefixes but not on local names.
+// Comments, processing instructions and DOCTYPE are skipped; CDATA is
+// returned as text.
+
+#ifndef NVR_ONVIF_XML_READER_H
+#define NVR_ONVIF_XML_READER_H
+
+#include <stddef.h>
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace nvr {
+
+class XmlReader {
+ public:
+  enum class Token { StartElement, EndElement, Text, End, Error };
+
+  // The buffer must outlive the reader and every view it returns.
+  XmlReader(const char* data, size_t len);
+  explicit XmlReader(std::string_view data) : XmlReader(data.data(), data.size()) {}
+
+  // Advances to the next token. Self-closing elements yield StartElement
+  // then EndElement. Whitespace-only text is skipped. End and Error are
+  // sticky.
+  Token next();
+
+  // Qualified and local name of the current start or end element.
+  std::string_view name() const { return name_; }
+  std::string_view localName() const;
+  // Decoded text of the current Text token.
+  const std::string& text() const { return text_; }
+  // Elements open around the current token; a StartElement counts itself.
+  int depth() const { return depth_; }
+
+  // Looks up an attribute of the current StartElement by local name and
+  // decodes its value into *value.
+  bool attribute(std::string_view localName, std::string* value) const;
+
+  // Called on a StartElement: consumes through its matching EndElement.
+  // Returns false on malformed input.
+  bool skipElement();
+  // Called on a StartElement: consumes through its matching EndElement
+  // and returns the concatenated text directly inside it, trimmed.
+  std::string readText();
+  // Advances to the next StartElement with this local name, at any depth.
+  bool findElement(std::string_view localName);
+  // Like findElement, but stops (returning false) at the EndElement that
+  // closes the element open at depth `within`.
+  bool findChild(std::string_view localName, int within);
+
+ private:
+  Token fail();
+  Token parseMarkup();
+  Token parseStartElement();
+  bool decodeInto(const char* begin, const char* end, std::string* out) const;
+
+  const char* p_;
+  const char* end_;
+  Token token_ = Token::Text;
+  std::string_view name_;
+  std::string text_;
+  std::vector<std::pair<std::string_view, std::string_view>> attributes_;
+  int depth_ = 0;
+  bool selfClosing_ = false;
+};
+
+// Local name of a qualified name: "tt:Profile" -> "Profile".
+std::string_view xmlLocalName(std::string_view name);
+
+// Escapes text for use in element content or a quoted attribute.
+std::string xmlEscape(std::string_view text);
+
+}  // namespace nvr
+
+#endif  // NVR_ONVIF_XML_READER_H
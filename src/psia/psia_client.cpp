@@ -0,0 +1,241 @@
+#include "psia/psia_client.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include <utility>
+
+#include "base/log.h"
+#include "onvif/xml_reader.h"
+#include "rtsp/rtsp_message.h"
+
+namespace nvr {
+
+namespace {
+
+// H.264 -> H264, MJPEG -> JPEG: the names OnvifProfile uses.
+std::string normalizeCodec(const std::string& codec) {
+  std::string out;
+  for (char c : codec) {
+    if (c != '.' && c != '-' && c != ' ') out += static_cast<char>(toupper(c));
+  }
+  if (out == "MJPEG") out = "JPEG";
+  return out;
+}
+
+bool isTrue(const std::string& text) { return text == "true" || text == "1"; }
+
+}  // namespace
+
+PsiaClient::PsiaClient(HttpClient* http, const std::string& url) : http_(http) {
+  if (!parseUrl(url, &url_) || url_.scheme != "http") {
+    NVR_ERROR("psia: bad url %s", url.c_str());
+    return;
+  }
+  int rc = resolveAddress(url_.host, url_.port, &server_);
+  if (rc < 0) {
+    NVR_ERROR("psia: cannot resolve %s", url_.host.c_str());
+    return;
+  }
+  host_ = url_.host;
+  if (url_.port != 80) host_ += ":" + std::to_string(url_.port);
+  auth_ = RtspAuth(percentDecode(url_.user), percentDecode(url_.password));
+  valid_ = true;
+}
+
+void PsiaClient::call(const char* method, const std::string& path, const std::string& body,
+                      ResponseCallback done, bool retried) {
+  if (!valid_) {
+    done(-EINVAL, HttpResponse());
+    return;
+  }
+  HttpRequest request;
+  request.method = method;
+  request.target = path;
+  if (auth_.active()) request.headers.emplace_back("Authorization",
+                                                   auth_.authorization(method, path));
+  if (!body.empty()) {
+    request.headers.emplace_back("Content-Type", "application/xml; charset=UTF-8");
+    request.body = body;
+  }
+  ++stats_.requests;
+  http_->request(server_, host_, request,
+                 [this, method, path, body, retried,
+                  done = std::move(done)](int error, const HttpResponse& response) {
+                   if (error == 0 && response.status == 401 && !retried) {
+                     // Prefer Digest when the device offers Basic as well.
+                     const std::string* challenge = nullptr;
+                     for (const auto& h : response.headers) {
+                       if (!equalsIgnoreCase(h.first, "WWW-Authenticate")) continue;
+                       if (!challenge || h.second.compare(0, 6, "Digest") == 0)
+                         challenge = &h.second;
+                     }
+                     if (challenge && auth_.onChallenge(*challenge)) {
+                       ++stats_.challenges;
+                       call(method, path, body, done, true);
+                       return;
+                     }
+                   }
+                   if (error == 0) error = checkResponse(response);
+                   done(error, response);
+                 });
+}
+
+int PsiaClient::checkResponse(const HttpResponse& response) {
+  if (response.status == 401) {
+    lastFault_ = "HTTP 401";
+    return -EACCES;
+  }
+  bool ok = response.status == 200;
+  if (ok && response.body.find("ResponseStatus") == std::string::npos) return 0;
+  lastFault_ = "HTTP " + std::to_string(response.status);
+  XmlReader xml(response.body);
+  if (xml.findElement("ResponseStatus")) {
+    int depth = xml.depth();
+    int code = 0;
+    for (;;) {
+      XmlReader::Token t = xml.next();
+      if (t == XmlReader::Token::End || t == XmlReader::Token::Error) break;
+      if (t == XmlReader::Token::EndElement && xml.depth() == depth) break;
+      if (t != XmlReader::Token::StartElement) continue;
+      if (xml.localName() == "statusCode") {
+        code = atoi(xml.readText().c_str());
+      } else if (xml.localName() == "statusString") {
+        lastFault_ = xml.readText();
+      }
+    }
+    // 1 is OK, 7 is "Reboot Required": the change was accepted.
+    if (ok && (code == 1 || code == 7)) return 0;
+    if (code == 4 && lastFault_.find("uthoriz") != std::string::npos) return -EACCES;
+  }
+  return -EPROTO;
+}
+
+void PsiaClient::getDeviceInfo(DeviceInfoCallback done) {
+  call("GET", "/PSIA/System/deviceInfo", std::string(),
+       [done = std::move(done)](int error, const HttpResponse& response) {
+         PsiaDeviceInfo info;
+         if (error) {
+           done(error, std::move(info));
+           return;
+         }
+         XmlReader xml(response.body);
+         if (!xml.findElement("DeviceInfo")) {
+           done(-EBADMSG, std::move(info));
+           return;
+         }
+         int depth = xml.depth();
+         for (;;) {
+           XmlReader::Token t = xml.next();
+           if (t == XmlReader::Token::End || t == XmlReader::Token::Error) break;
+           if (t == XmlReader::Token::EndElement && xml.depth() == depth) break;
+           if (t != XmlReader::Token::StartElement) continue;
+           std::string_view name = xml.localName();
+           std::string* field = name == "deviceName"        ? &info.deviceName
+                                : name == "deviceID"        ? &info.deviceId
+                                : name == "model"           ? &info.model
+                                : name == "serialNumber"    ? &info.serialNumber
+                                : name == "firmwareVersion" ? &info.firmwareVersion
+                                : name == "macAddress"      ? &info.macAddress
+                                                            : nullptr;
+           if (field) *field = xml.readText();
+         }
+         done(0, std::move(info));
+       });
+}
+
+void PsiaClient::getChannels(ChannelsCallback done) {
+  call("GET", "/PSIA/Streaming/channels", std::string(),
+       [done = std::move(done)](int error, const HttpResponse& response) {
+         std::vector<PsiaChannel> channels;
+         if (error) {
+           done(error, std::move(channels));
+           return;
+         }
+         XmlReader xml(response.body);
+         while (xml.findElement("StreamingChannel")) {
+           PsiaChannel channel;
+           int depth = xml.depth();
+           for (;;) {
+             XmlReader::Token t = xml.next();
+             if (t == XmlReader::Token::End || t == XmlReader::Token::Error) break;
+             if (t == XmlReader::Token::EndElement && xml.depth() == depth) break;
+             if (t != XmlReader::Token::StartElement) continue;
+             std::string_view name = xml.localName();
+             bool top = xml.depth() == depth + 1;
+             if (name == "Audio" || name == "Multicast" || name == "Security") {
+               xml.skipElement();
+             } else if (name == "id" && top) {
+               channel.id = xml.readText();
+             } else if (name == "channelName") {
+               channel.name = xml.readText();
+             } else if (name == "enabled" && top) {
+               channel.enabled = isTrue(xml.readText());
+             } else if (name == "rtspPortNo") {
+               channel.rtspPort = static_cast<uint16_t>(atoi(xml.readText().c_str()));
+             } else if (name == "videoCodecType") {
+               channel.codec = normalizeCodec(xml.readText());
+             } else if (name == "videoResolutionWidth") {
+               channel.width = atoi(xml.readText().c_str());
+             } else if (name == "videoResolutionHeight") {
+               channel.height = atoi(xml.readText().c_str());
+             } else if (name == "maxFrameRate") {
+               // Hundredths of a frame per second.
+               channel.frameRate = atoi(xml.readText().c_str()) / 100;
+             }
+           }
+           if (!channel.id.empty()) channels.push_back(std::move(channel));
+         }
+         int rc = channels.empty() ? -EBADMSG : 0;
+         done(rc, std::move(channels));
+       });
+}
+
+void PsiaClient::getEventTriggers(TriggersCallback done) {
+  call("GET", "/PSIA/Custom/Event/triggers", std::string(),
+       [done = std::move(done)](int error, const HttpResponse& response) {
+         std::vector<PsiaTrigger> triggers;
+         if (error) {
+           done(error, std::move(triggers));
+           return;
+         }
+         XmlReader xml(response.body);
+         while (xml.findElement("EventTrigger")) {
+           PsiaTrigger trigger;
+           int depth = xml.depth();
+           for (;;) {
+             XmlReader::Token t = xml.next();
+             if (t == XmlReader::Token::End || t == XmlReader::Token::Error) break;
+             if (t == XmlReader::Token::EndElement && xml.depth() == depth) break;
+             if (t != XmlReader::Token::StartElement) continue;
+             std::string_view name = xml.localName();
+             if (name == "id" && xml.depth() == depth + 1) {
+               trigger.id = xml.readText();
+             } else if (name == "eventType") {
+               trigger.eventType = xml.readText();
+             } else if (name == "videoInputChannelID" || name == "inputIOPortID") {
+               trigger.inputId = xml.readText();
+             } else if (name == "notificationMethod") {
+               if (xml.readText() == "record") trigger.records = true;
+             }
+           }
+           if (!trigger.id.empty()) triggers.push_back(std::move(trigger));
+         }
+         done(0, std::move(triggers));
+       });
+}
+
+void PsiaClient::putResource(const std::string& path, const std::string& xml,
+                             DoneCallback done) {
+  call("PUT", path, xml,
+       [done = std::move(done)](int error, const HttpResponse&) { done(error); });
+}
+
+std::string PsiaClient::streamUri(const PsiaChannel& channel) const {
+  std::string uri = "rtsp://" + url_.host;
+  if (channel.rtspPort != 554) uri += ":" + std::to_string(channel.rtspPort);
+  return uri + "/PSIA/Streaming/channels/" + channel.id;
+}
+
+}  // namespace nvr
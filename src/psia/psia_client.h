@@ -0,0 +1,119 @@
+// Asynchronous PSIA client for one device.
+//
+// PSIA is REST over HTTP with XML bodies: GET a resource such as
+// /PSIA/Streaming/channels and read the document. Calls go through the same
+// shared HttpClient and XmlReader as ONVIF, so a device keeps one
+// kept-alive connection across a call sequence and thousands of devices
+// can be in flight on one loop.
+//
+// Devices authenticate with HTTP Digest (or Basic). The first request
+// collects the challenge; later ones answer it up front with an
+// incremented nonce count, so only the first call costs a 401 round trip,
+// much like ONVIF's cached WS-Security token.
+//
+// A client is only touched from its HttpClient's loop thread and must
+// outlive its outstanding calls.
+
+#ifndef NVR_PSIA_PSIA_CLIENT_H
+#define NVR_PSIA_PSIA_CLIENT_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "base/socket_util.h"
+#include "base/url.h"
+#include "http/http_client.h"
+#include "rtsp/rtsp_auth.h"
+
+namespace nvr {
+
+struct PsiaDeviceInfo {
+  std::string deviceName;
+  std::string deviceId;
+  std::string model;
+  std::string serialNumber;
+  std::string firmwareVersion;
+  std::string macAddress;
+};
+
+struct PsiaChannel {
+  std::string id;  // e.g. 101: input 1, main stream
+  std::string name;
+  bool enabled = true;
+  std::string codec;  // H264, H265, JPEG, ... (same spelling as ONVIF)
+  int width = 0;
+  int height = 0;
+  int frameRate = 0;  // frames per second
+  uint16_t rtspPort = 554;
+};
+
+struct PsiaTrigger {
+  std::string id;
+  std::string eventType;  // VMD, IO, videoloss, tamperdetection, ...
+  std::string inputId;    // video input channel or alarm input
+  bool records = false;   // has a "record" notification
+};
+
+class PsiaClient {
+ public:
+  // error is 0 or -errno: -EACCES when the device refused the credentials,
+  // -EPROTO for other HTTP errors (see lastFault()), -EBADMSG for
+  // responses missing what was asked for.
+  using DoneCallback = std::function<void(int error)>;
+  using DeviceInfoCallback = std::function<void(int error, PsiaDeviceInfo info)>;
+  using ChannelsCallback = std::function<void(int error, std::vector<PsiaChannel> channels)>;
+  using TriggersCallback = std::function<void(int error, std::vector<PsiaTrigger> triggers)>;
+
+  struct Stats {
+    uint64_t requests = 0;
+    uint64_t challenges = 0;  // 401s answered by resending
+  };
+
+  // url is the device root, e.g. http://admin:pw@10.0.0.5/. Symbolic host
+  // names are resolved here, blocking.
+  PsiaClient(HttpClient* http, const std::string& url);
+
+  PsiaClient(const PsiaClient&) = delete;
+  PsiaClient& operator=(const PsiaClient&) = delete;
+
+  bool valid() const { return valid_; }
+  const Url& url() const { return url_; }
+  const std::string& lastFault() const { return lastFault_; }
+  const Stats& stats() const { return stats_; }
+
+  // GET /PSIA/System/deviceInfo
+  void getDeviceInfo(DeviceInfoCallback done);
+  // GET /PSIA/Streaming/channels
+  void getChannels(ChannelsCallback done);
+  // GET /PSIA/Custom/Event/triggers
+  void getEventTriggers(TriggersCallback done);
+  // Media and event configuration is written with PUT, e.g.
+  // putResource("/PSIA/Streaming/channels/102", xml, done).
+  void putResource(const std::string& path, const std::string& xml, DoneCallback done);
+
+  // RTSP URI of a channel, without credentials.
+  std::string streamUri(const PsiaChannel& channel) const;
+
+ private:
+  using ResponseCallback = std::function<void(int error, const HttpResponse& response)>;
+
+  void call(const char* method, const std::string& path, const std::string& body,
+            ResponseCallback done, bool retried = false);
+  int checkResponse(const HttpResponse& response);
+
+  HttpClient* http_;
+  Url url_;
+  std::string host_;  // Host header
+  SocketAddress server_;
+  bool valid_ = false;
+  RtspAuth auth_;
+  std::string lastFault_;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_PSIA_PSIA_CLIENT_H
@@ -0,0 +1,129 @@
+#include "psia/psia_provisioner.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <utility>
+
+#include "base/log.h"
+
+namespace nvr {
+
+struct PsiaProvisioner::Job {
+  PsiaDevice device;
+  std::unique_ptr<PsiaClient> client;
+  PsiaProvisionResult result;
+  uint64_t startMs = 0;
+};
+
+PsiaProvisioner::PsiaProvisioner(HttpClient* http, const PsiaProvisionerOptions& options)
+    : http_(http), options_(options) {
+  if (options_.concurrency == 0) options_.concurrency = 1;
+}
+
+PsiaProvisioner::~PsiaProvisioner() {
+  for (Job* job : jobs_) delete job;
+}
+
+void PsiaProvisioner::provision(std::vector<PsiaDevice> devices, ResultCallback onResult,
+                                DoneCallback done) {
+  onResult_ = std::move(onResult);
+  done_ = std::move(done);
+  for (auto& device : devices) queue_.push_back(std::move(device));
+  startNext();
+}
+
+void PsiaProvisioner::startNext() {
+  // finish() of a device that fails synchronously calls back in here.
+  if (starting_) return;
+  starting_ = true;
+  while (active_ < options_.concurrency && !queue_.empty()) {
+    auto* job = new Job;
+    job->device = std::move(queue_.front());
+    queue_.pop_front();
+    job->result.id = job->device.id;
+    job->startMs = http_->loop()->nowMs();
+    job->client.reset(new PsiaClient(http_, job->device.url));
+    jobs_.insert(job);
+    ++active_;
+    ++stats_.devices;
+    start(job);
+  }
+  starting_ = false;
+  if (active_ == 0 && queue_.empty() && done_) {
+    DoneCallback done = std::move(done_);
+    done_ = nullptr;
+    done();
+  }
+}
+
+void PsiaProvisioner::start(Job* job) {
+  if (!job->client->valid()) {
+    finish(job, -EINVAL, "url");
+    return;
+  }
+  job->client->getDeviceInfo([this, job](int error, PsiaDeviceInfo info) {
+    if (error) {
+      finish(job, error, "deviceInfo");
+      return;
+    }
+    job->result.info = std::move(info);
+    getChannels(job);
+  });
+}
+
+void PsiaProvisioner::getChannels(Job* job) {
+  job->client->getChannels([this, job](int error, std::vector<PsiaChannel> channels) {
+    if (error) {
+      finish(job, error, "channels");
+      return;
+    }
+    const Url& url = job->client->url();
+    for (const auto& channel : channels) {
+      if (job->result.streamUris.size() >= options_.streamsPerDevice) break;
+      if (!channel.enabled) continue;
+      job->result.streamUris.push_back(
+          withCredentials(job->client->streamUri(channel), url.user, url.password));
+    }
+    job->result.channels = std::move(channels);
+    if (options_.readTriggers) {
+      getTriggers(job);
+    } else {
+      finish(job, 0, "");
+    }
+  });
+}
+
+void PsiaProvisioner::getTriggers(Job* job) {
+  job->client->getEventTriggers([this, job](int error, std::vector<PsiaTrigger> triggers) {
+    if (error) {
+      finish(job, error, "triggers");
+      return;
+    }
+    job->result.triggers = std::move(triggers);
+    finish(job, 0, "");
+  });
+}
+
+void PsiaProvisioner::finish(Job* job, int error, const char* step) {
+  job->result.error = error;
+  job->result.step = step;
+  if (error) job->result.fault = job->client->lastFault();
+  job->result.elapsedMs = http_->loop()->nowMs() - job->startMs;
+  stats_.requests += job->client->stats().requests;
+  stats_.challenges += job->client->stats().challenges;
+  if (error) {
+    ++stats_.failed;
+    NVR_DEBUG("psia %s: %s failed (%s)", job->device.id.c_str(), step, strerror(-error));
+  } else {
+    ++stats_.succeeded;
+  }
+  jobs_.erase(job);
+  --active_;
+  if (onResult_) onResult_(job->result);
+  // Called from inside the client's completion; free it once that returns.
+  http_->loop()->deleteLater(job);
+  startNext();
+}
+
+}  // namespace nvr
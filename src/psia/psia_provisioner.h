@@ -0,0 +1,100 @@
+// Bulk PSIA provisioning: reads the streams and event triggers of many
+// devices.
+//
+// The PSIA counterpart of OnvifProvisioner, on the same HttpClient: each
+// device runs deviceInfo, Streaming/channels and Custom/Event/triggers on
+// one kept-alive connection, answering the Digest challenge once. Up to
+// `concurrency` devices are in flight at once.
+
+#ifndef NVR_PSIA_PSIA_PROVISIONER_H
+#define NVR_PSIA_PSIA_PROVISIONER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "http/http_client.h"
+#include "psia/psia_client.h"
+
+namespace nvr {
+
+struct PsiaDevice {
+  std::string id;
+  std::string url;  // device root URL with credentials
+};
+
+struct PsiaProvisionResult {
+  std::string id;
+  int error = 0;          // 0 or -errno from the failing step
+  const char* step = "";  // the failing step, e.g. "channels"
+  std::string fault;      // PSIA statusString, if any
+  PsiaDeviceInfo info;
+  std::vector<PsiaChannel> channels;
+  // RTSP URIs of the first enabled channels, with the device credentials.
+  std::vector<std::string> streamUris;
+  std::vector<PsiaTrigger> triggers;
+  uint64_t elapsedMs = 0;
+};
+
+struct PsiaProvisionerOptions {
+  uint32_t concurrency = 256;
+  uint32_t streamsPerDevice = 2;
+  bool readTriggers = true;
+};
+
+class PsiaProvisioner {
+ public:
+  using ResultCallback = std::function<void(const PsiaProvisionResult& result)>;
+  using DoneCallback = std::function<void()>;
+
+  struct Stats {
+    uint64_t devices = 0;
+    uint64_t succeeded = 0;
+    uint64_t failed = 0;
+    uint64_t requests = 0;
+    uint64_t challenges = 0;  // 401 round trips
+  };
+
+  PsiaProvisioner(HttpClient* http, const PsiaProvisionerOptions& options);
+  // Destroy after done has run, or after the HttpClient.
+  ~PsiaProvisioner();
+
+  PsiaProvisioner(const PsiaProvisioner&) = delete;
+  PsiaProvisioner& operator=(const PsiaProvisioner&) = delete;
+
+  // Queues devices; results arrive in completion order. done runs once
+  // the queue has drained. Loop thread only.
+  void provision(std::vector<PsiaDevice> devices, ResultCallback onResult, DoneCallback done);
+
+  size_t inFlight() const { return active_; }
+  const Stats& stats() const { return stats_; }
+
+ private:
+  struct Job;
+
+  void startNext();
+  void start(Job* job);
+  void getChannels(Job* job);
+  void getTriggers(Job* job);
+  void finish(Job* job, int error, const char* step);
+
+  HttpClient* http_;
+  PsiaProvisionerOptions options_;
+  std::deque<PsiaDevice> queue_;
+  std::unordered_set<Job*> jobs_;
+  size_t active_ = 0;
+  bool starting_ = false;
+  ResultCallback onResult_;
+  DoneCallback done_;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_PSIA_PSIA_PROVISIONER_H
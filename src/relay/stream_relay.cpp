@@ -0,0 +1,370 @@
+#include "relay/stream_relay.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/log.h"
+#include "media/rtp_depacketizer.h"
+#include "rtp/rtp_packet.h"
+
+namespace nvr {
+
+namespace {
+
+constexpr int kMaxIov = 512;
+constexpr int kMaxMmsg = 256;
+
+}  // namespace
+
+TcpRelaySubscriber::TcpRelaySubscriber(EventLoop* loop, int fd, RelayStats* stats,
+                                       size_t maxQueuedBytes)
+    : loop_(loop), fd_(fd), stats_(stats), maxQueuedBytes_(maxQueuedBytes) {
+  for (int i = 0; i < 16; ++i) channels_[i] = static_cast<uint8_t>(i * 2);
+  setNonBlocking(fd_);
+  loop_->add(fd_, EPOLLIN, this);
+}
+
+TcpRelaySubscriber::~TcpRelaySubscriber() { close(); }
+
+void TcpRelaySubscriber::setChannel(int track, int rtpChannel) {
+  if (track >= 0 && track < 16) channels_[track] = static_cast<uint8_t>(rtpChannel);
+}
+
+void TcpRelaySubscriber::enqueue(int track, bool rtcp, const PacketRef& packet) {
+  if (fd_ < 0 || track < 0 || track >= 16) return;
+  size_t bytes = 4 + packet.size();
+  if (queuedBytes_ + bytes > maxQueuedBytes_) {
+    ++stats_->drops;
+    return;
+  }
+  queue_.emplace_back();
+  Entry& entry = queue_.back();
+  entry.header[0] = '$';
+  entry.header[1] = static_cast<uint8_t>(channels_[track] + (rtcp ? 1 : 0));
+  entry.header[2] = static_cast<uint8_t>(packet.size() >> 8);
+  entry.header[3] = static_cast<uint8_t>(packet.size());
+  entry.packet = packet;
+  queuedBytes_ += bytes;
+  ++stats_->packetsOut;
+}
+
+void TcpRelaySubscriber::flush() {
+  if (fd_ < 0 || wantWrite_) return;
+  struct iovec iov[kMaxIov];
+  while (!queue_.empty()) {
+    int count = 0;
+    size_t skip = frontWritten_;
+    for (auto it = queue_.begin(); it != queue_.end() && count + 2 <= kMaxIov; ++it) {
+      if (skip < 4) {
+        iov[count].iov_base = it->header + skip;
+        iov[count].iov_len = 4 - skip;
+        ++count;
+        skip = 0;
+      } else {
+        skip -= 4;
+      }
+      iov[count].iov_base = const_cast<uint8_t*>(it->packet.data()) + skip;
+      iov[count].iov_len = it->packet.size() - skip;
+      ++count;
+      skip = 0;
+    }
+    ssize_t n = ::writev(fd_, iov, count);
+    ++stats_->writevCalls;
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR) break;
+      close();
+      return;
+    }
+    stats_->bytesOut += n;
+    size_t left = static_cast<size_t>(n);
+    size_t attempted = 0;
+    for (int i = 0; i < count; ++i) attempted += iov[i].iov_len;
+    while (left > 0) {
+      Entry& front = queue_.front();
+      size_t remaining = 4 + front.packet.size() - frontWritten_;
+      if (left < remaining) {
+        frontWritten_ += left;
+        break;
+      }
+      left -= remaining;
+      queuedBytes_ -= 4 + front.packet.size();
+      frontWritten_ = 0;
+      queue_.pop_front();
+    }
+    if (static_cast<size_t>(n) < attempted) break;  // socket buffer full
+  }
+  if (!queue_.empty()) {
+    wantWrite_ = true;
+    loop_->modify(fd_, EPOLLIN | EPOLLOUT, this);
+  }
+}
+
+void TcpRelaySubscriber::onEvents(uint32_t events) {
+  if (fd_ < 0) return;
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    close();
+    return;
+  }
+  if (events & EPOLLIN) {
+    // Viewers have nothing to say on this socket; drain and watch for EOF.
+    char scratch[1024];
+    ssize_t n = ::read(fd_, scratch, sizeof(scratch));
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      close();
+      return;
+    }
+  }
+  if ((events & EPOLLOUT) && wantWrite_) {
+    wantWrite_ = false;
+    loop_->modify(fd_, EPOLLIN, this);
+    flush();
+  }
+}
+
+void TcpRelaySubscriber::close() {
+  if (fd_ < 0) return;
+  loop_->remove(fd_);
+  ::close(fd_);
+  fd_ = -1;
+  queue_.clear();
+  queuedBytes_ = 0;
+  frontWritten_ = 0;
+}
+
+StreamRelay::StreamRelay(EventLoop* loop) : loop_(loop) {}
+
+StreamRelay::~StreamRelay() {
+  if (udpFd_ >= 0) ::close(udpFd_);
+}
+
+RelaySubscriber* StreamRelay::addSubscriber(std::unique_ptr<RelaySubscriber> subscriber) {
+  RelaySubscriber* added = subscriber.get();
+  subscribers_.push_back(std::move(subscriber));
+  if (gopValid_ && !gop_.empty()) {
+    for (const CachedPacket& cached : gop_) added->enqueue(cached.track, false, cached.packet);
+    added->flush();
+    ++stats_.instantStarts;
+  }
+  return added;
+}
+
+void StreamRelay::removeSubscriber(RelaySubscriber* subscriber) {
+  for (auto it = subscribers_.begin(); it != subscribers_.end(); ++it) {
+    if (it->get() != subscriber) continue;
+    loop_->deleteLater(it->release());
+    subscribers_.erase(it);
+    return;
+  }
+}
+
+int StreamRelay::addUdpViewer(int track, const SocketAddress& rtp, const SocketAddress& rtcp) {
+  if (udpFd_ < 0) {
+    int fd = udpBind(rtp.family(), 0);
+    if (fd < 0) return fd;
+    setSendBufferSize(fd, 4 * 1024 * 1024);
+    udpFd_ = fd;
+  }
+  udpViewers_.push_back(UdpViewer{nextUdpViewerId_, track, rtp, rtcp});
+  if (gopValid_ && !gop_.empty()) sendCached(udpViewers_.back());
+  return nextUdpViewerId_++;
+}
+
+void StreamRelay::removeUdpViewer(int id) {
+  udpViewers_.erase(std::remove_if(udpViewers_.begin(), udpViewers_.end(),
+                                   [id](const UdpViewer& v) { return v.id == id; }),
+                    udpViewers_.end());
+}
+
+void StreamRelay::enableGopCache(int track, VideoCodec codec, size_t maxBytes) {
+  if (track != gopTrack_ || codec != gopCodec_) resetGopCache();
+  gopTrack_ = track;
+  gopCodec_ = codec;
+  gopMaxBytes_ = maxBytes;
+}
+
+void StreamRelay::resetGopCache() {
+  gop_.clear();
+  gopValid_ = false;
+  accessUnitStart_ = 0;
+  stats_.gopCacheBytes = 0;
+  stats_.gopCachePinnedBytes = 0;
+  stats_.gopCachePackets = 0;
+}
+
+void StreamRelay::skipToKeyframe(int track, VideoCodec codec) {
+  skipTrack_ = track;
+  skipCodec_ = codec;
+  // The cached GOP is broken from here on; it starts over at the keyframe.
+  if (track == gopTrack_) resetGopCache();
+}
+
+bool StreamRelay::skipping(const PacketRef& packet) {
+  RtpHeader header;
+  if (!parseRtpHeader(packet.data(), packet.size(), &header)) return true;
+  RtpPayloadInfo info =
+      inspectRtpPayload(skipCodec_, packet.data() + header.payloadOffset, header.payloadSize);
+  if (info.keyframeStart) {
+    skipTrack_ = -1;
+    return false;
+  }
+  // Parameter sets sent ahead of the keyframe belong to it.
+  return info.vcl || !info.parameterSets;
+}
+
+void StreamRelay::cache(int track, const PacketRef& packet) {
+  if (track == gopTrack_) {
+    RtpHeader header;
+    if (!parseRtpHeader(packet.data(), packet.size(), &header)) return;
+    if (gop_.empty() || header.timestamp != lastTimestamp_) {
+      // A new access unit. Without a keyframe yet, only it is kept.
+      if (!gopValid_) dropCachedPrefix(gop_.size());
+      accessUnitStart_ = gop_.size();
+      lastTimestamp_ = header.timestamp;
+    }
+    if (rtpPayloadStartsKeyframe(gopCodec_, packet.data() + header.payloadOffset,
+                                 header.payloadSize)) {
+      // The new GOP starts with its access unit, parameter sets included.
+      dropCachedPrefix(accessUnitStart_);
+      gopValid_ = true;
+    }
+  } else if (!gopValid_) {
+    return;
+  }
+  PacketBuffer* previous = gop_.empty() ? nullptr : gop_.back().packet.buffer();
+  gop_.push_back(CachedPacket{track, packet});
+  stats_.gopCacheBytes += packet.size();
+  ++stats_.gopCachePackets;
+  if (packet.buffer() != previous) stats_.gopCachePinnedBytes += packet.buffer()->capacity();
+  if (stats_.gopCacheBytes > gopMaxBytes_) {
+    // Rather no cache than half a GOP: try again at the next keyframe.
+    ++stats_.gopCacheOverflows;
+    resetGopCache();
+  }
+}
+
+void StreamRelay::dropCachedPrefix(size_t count) {
+  if (count == 0) return;
+  gop_.erase(gop_.begin(), gop_.begin() + static_cast<ptrdiff_t>(count));
+  accessUnitStart_ -= std::min(accessUnitStart_, count);
+  stats_.gopCacheBytes = 0;
+  stats_.gopCachePinnedBytes = 0;
+  stats_.gopCachePackets = gop_.size();
+  PacketBuffer* previous = nullptr;
+  for (const CachedPacket& cached : gop_) {
+    stats_.gopCacheBytes += cached.packet.size();
+    if (cached.packet.buffer() != previous)
+      stats_.gopCachePinnedBytes += cached.packet.buffer()->capacity();
+    previous = cached.packet.buffer();
+  }
+}
+
+void StreamRelay::sendCached(const UdpViewer& viewer) {
+  struct mmsghdr msgs[kMaxMmsg];
+  struct iovec iovs[kMaxMmsg];
+  int count = 0;
+  auto send = [&]() {
+    int n = sendmmsg(udpFd_, msgs, count, 0);
+    ++stats_.sendmmsgCalls;
+    if (n < count) stats_.drops += count - std::max(n, 0);
+    for (int i = 0; i < n; ++i) stats_.bytesOut += msgs[i].msg_len;
+    if (n > 0) stats_.packetsOut += n;
+    count = 0;
+  };
+  for (const CachedPacket& cached : gop_) {
+    if (cached.track != viewer.track) continue;
+    iovs[count].iov_base = const_cast<uint8_t*>(cached.packet.data());
+    iovs[count].iov_len = cached.packet.size();
+    struct msghdr& hdr = msgs[count].msg_hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = const_cast<struct sockaddr*>(viewer.rtp.get());
+    hdr.msg_namelen = viewer.rtp.length;
+    hdr.msg_iov = &iovs[count];
+    hdr.msg_iovlen = 1;
+    if (++count == kMaxMmsg) send();
+  }
+  if (count > 0) send();
+  ++stats_.instantStarts;
+}
+
+void StreamRelay::publish(int track, bool rtcp, const PacketRef& packet) {
+  ++stats_.packetsIn;
+  stats_.bytesIn += packet.size();
+  if (track == skipTrack_ && !rtcp && skipping(packet)) {
+    ++stats_.lossSkips;
+    return;
+  }
+  if (gopTrack_ >= 0 && !rtcp) cache(track, packet);
+  for (auto& subscriber : subscribers_) subscriber->enqueue(track, rtcp, packet);
+  if (!udpViewers_.empty()) pendingUdp_.push_back(PendingDatagram{track, rtcp, packet});
+}
+
+void StreamRelay::flush() {
+  bool pruned = false;
+  for (auto& subscriber : subscribers_) {
+    subscriber->flush();
+    if (subscriber->closed()) {
+      // The subscriber may still have events queued in this epoll batch.
+      loop_->deleteLater(subscriber.release());
+      pruned = true;
+    }
+  }
+  if (pruned) {
+    subscribers_.erase(std::remove(subscribers_.begin(), subscribers_.end(), nullptr),
+                       subscribers_.end());
+  }
+  flushUdp();
+}
+
+void StreamRelay::flushUdp() {
+  if (pendingUdp_.empty()) return;
+  if (udpViewers_.empty() || udpFd_ < 0) {
+    pendingUdp_.clear();
+    return;
+  }
+  struct mmsghdr msgs[kMaxMmsg];
+  std::vector<struct iovec> iovs(pendingUdp_.size());
+  int count = 0;
+
+  auto send = [&]() {
+    int sent = 0;
+    while (sent < count) {
+      int n = sendmmsg(udpFd_, msgs + sent, count - sent, 0);
+      ++stats_.sendmmsgCalls;
+      if (n <= 0) {
+        // UDP has no backpressure; a full socket buffer means loss.
+        stats_.drops += count - sent;
+        break;
+      }
+      for (int i = sent; i < sent + n; ++i) stats_.bytesOut += msgs[i].msg_len;
+      stats_.packetsOut += n;
+      sent += n;
+    }
+    count = 0;
+  };
+
+  for (size_t p = 0; p < pendingUdp_.size(); ++p) {
+    const PendingDatagram& pending = pendingUdp_[p];
+    iovs[p].iov_base = const_cast<uint8_t*>(pending.packet.data());
+    iovs[p].iov_len = pending.packet.size();
+    for (const UdpViewer& viewer : udpViewers_) {
+      if (viewer.track != pending.track) continue;
+      const SocketAddress& to = pending.rtcp ? viewer.rtcp : viewer.rtp;
+      struct msghdr& hdr = msgs[count].msg_hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.msg_name = const_cast<struct sockaddr*>(to.get());
+      hdr.msg_namelen = to.length;
+      hdr.msg_iov = &iovs[p];
+      hdr.msg_iovlen = 1;
+      if (++count == kMaxMmsg) send();
+    }
+  }
+  if (count > 0) send();
+  pendingUdp_.clear();
+}
+
+}  // namespace nvr
@@ -0,0 +1,197 @@
+// Live relay: fans one camera's RTP out to many viewers without copying.
+//
+// Each received packet is a PacketRef into the ingest receive buffer. The
+// relay hands the same ref to every subscriber; TCP subscribers queue refs
+// and send them with writev() (a 4-byte interleave header of their own plus
+// the shared payload), UDP viewers of a stream are served with one
+// sendmmsg() whose messages all point at the shared payload. Payload bytes
+// are never copied per viewer.
+//
+// With the GOP cache enabled, the relay also keeps references to every
+// packet since the latest keyframe. A new viewer is sent those first and
+// can start decoding at once rather than at the next keyframe, up to a GOP
+// later. The cache shares the receive buffers like the viewers do; what it
+// holds, and the buffers it keeps alive, are in RelayStats.
+//
+// After packet loss on the video track (skipToKeyframe()), its RTP is held
+// back from viewers and the cache until the next keyframe: a decoder fed
+// the frames that follow a broken one smears and blocks until then anyway,
+// and a clean freeze is the better picture.
+//
+// A relay belongs to the event loop of its camera and is loop-thread only.
+
+#ifndef NVR_RELAY_STREAM_RELAY_H
+#define NVR_RELAY_STREAM_RELAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "base/packet_buffer.h"
+#include "base/socket_util.h"
+#include "media/nal.h"
+
+namespace nvr {
+
+struct RelayStats {
+  uint64_t packetsIn = 0;
+  uint64_t bytesIn = 0;
+  uint64_t packetsOut = 0;   // per-subscriber deliveries
+  uint64_t bytesOut = 0;
+  uint64_t bytesCopied = 0;  // payload bytes memcpy'd on the relay path
+  uint64_t writevCalls = 0;
+  uint64_t sendmmsgCalls = 0;
+  uint64_t drops = 0;        // deliveries dropped for slow subscribers
+  // GOP cache. Bytes and packets are what it holds right now.
+  uint64_t gopCacheBytes = 0;
+  uint64_t gopCachePinnedBytes = 0;  // receive buffers kept alive by the cache
+  uint64_t gopCachePackets = 0;
+  uint64_t gopCacheOverflows = 0;    // GOPs too large to cache
+  uint64_t instantStarts = 0;        // viewers started from the cache
+  uint64_t lossSkips = 0;            // video packets held back after loss
+};
+
+class RelaySubscriber {
+ public:
+  virtual ~RelaySubscriber() = default;
+
+  // Queues a packet; nothing is sent until flush().
+  virtual void enqueue(int track, bool rtcp, const PacketRef& packet) = 0;
+  virtual void flush() = 0;
+  // Closed subscribers are dropped by the relay on its next flush().
+  virtual bool closed() const = 0;
+};
+
+// RTSP-interleaved ($ channel length payload) output on a stream socket.
+class TcpRelaySubscriber : public RelaySubscriber, public EventHandler {
+ public:
+  static constexpr size_t kDefaultMaxQueuedBytes = 4 * 1024 * 1024;
+
+  // Takes ownership of fd. stats may be shared with the relay.
+  TcpRelaySubscriber(EventLoop* loop, int fd, RelayStats* stats,
+                     size_t maxQueuedBytes = kDefaultMaxQueuedBytes);
+  ~TcpRelaySubscriber() override;
+
+  // RTP channel for a track; RTCP uses channel + 1. Defaults to 2 * track.
+  void setChannel(int track, int rtpChannel);
+
+  void enqueue(int track, bool rtcp, const PacketRef& packet) override;
+  void flush() override;
+  bool closed() const override { return fd_ < 0; }
+
+  size_t queuedBytes() const { return queuedBytes_; }
+
+  void onEvents(uint32_t events) override;
+
+ private:
+  struct Entry {
+    uint8_t header[4];
+    PacketRef packet;
+  };
+
+  void close();
+
+  EventLoop* loop_;
+  int fd_;
+  RelayStats* stats_;
+  size_t maxQueuedBytes_;
+  std::deque<Entry> queue_;
+  size_t queuedBytes_ = 0;
+  size_t frontWritten_ = 0;  // bytes of queue_.front() already sent
+  bool wantWrite_ = false;
+  uint8_t channels_[16];
+};
+
+class StreamRelay {
+ public:
+  // Below TcpRelaySubscriber's default queue limit, so a cached GOP always
+  // fits into a new subscriber's queue.
+  static constexpr size_t kDefaultGopCacheBytes = 2 * 1024 * 1024;
+
+  explicit StreamRelay(EventLoop* loop);
+  ~StreamRelay();
+
+  StreamRelay(const StreamRelay&) = delete;
+  StreamRelay& operator=(const StreamRelay&) = delete;
+
+  RelaySubscriber* addSubscriber(std::unique_ptr<RelaySubscriber> subscriber);
+  void removeSubscriber(RelaySubscriber* subscriber);
+
+  // UDP viewers receive RTP on rtp and RTCP on rtcp. Returns a viewer id,
+  // or -errno when the relay socket cannot be created.
+  int addUdpViewer(int track, const SocketAddress& rtp, const SocketAddress& rtcp);
+  void removeUdpViewer(int id);
+
+  // Caches the RTP of every track from the latest keyframe of track (whose
+  // payload is codec), starting with the parameter sets sent along with
+  // it. While a GOP is larger than maxBytes nothing is cached.
+  void enableGopCache(int track, VideoCodec codec, size_t maxBytes = kDefaultGopCacheBytes);
+  // Drops the cached GOP, e.g. when the source reconnects and its RTP
+  // sequence starts over.
+  void resetGopCache();
+
+  // Packets of track (whose payload is codec) were lost: its RTP is not
+  // passed on until the next keyframe, parameter sets excepted.
+  void skipToKeyframe(int track, VideoCodec codec);
+
+  void publish(int track, bool rtcp, const PacketRef& packet);
+  // Sends everything published since the last flush.
+  void flush();
+
+  size_t subscriberCount() const { return subscribers_.size() + udpViewers_.size(); }
+  const RelayStats& stats() const { return stats_; }
+  RelayStats* mutableStats() { return &stats_; }
+
+ private:
+  struct UdpViewer {
+    int id;
+    int track;
+    SocketAddress rtp;
+    SocketAddress rtcp;
+  };
+  struct PendingDatagram {
+    int track;
+    bool rtcp;
+    PacketRef packet;
+  };
+
+  struct CachedPacket {
+    int track;
+    PacketRef packet;
+  };
+
+  bool skipping(const PacketRef& packet);
+  void cache(int track, const PacketRef& packet);
+  void dropCachedPrefix(size_t count);
+  void sendCached(const UdpViewer& viewer);
+  void flushUdp();
+
+  EventLoop* loop_;
+  RelayStats stats_;
+  std::vector<std::unique_ptr<RelaySubscriber>> subscribers_;
+  std::vector<UdpViewer> udpViewers_;
+  std::vector<PendingDatagram> pendingUdp_;
+  int udpFd_ = -1;
+  int nextUdpViewerId_ = 1;
+
+  int gopTrack_ = -1;
+  VideoCodec gopCodec_ = VideoCodec::Unknown;
+  size_t gopMaxBytes_ = 0;
+  // From a keyframe's first packet on once gopValid_; before that only the
+  // current access unit, which may hold parameter sets for the next one.
+  std::vector<CachedPacket> gop_;
+  bool gopValid_ = false;
+  size_t accessUnitStart_ = 0;  // index in gop_ of the current video access unit
+  uint32_t lastTimestamp_ = 0;
+
+  int skipTrack_ = -1;  // skipping to a keyframe of this track
+  VideoCodec skipCodec_ = VideoCodec::Unknown;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_RELAY_STREAM_RELAY_H
@@ -0,0 +1,349 @@
+#include "replay/gop_prefetcher.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "storage/file_util.h"
+#include "storage/segment_format.h"
+#include "storage/segment_reader.h"
+
+namespace nvr {
+
+namespace {
+
+bool chunkBefore(const ChunkEntry& c, uint64_t offset) { return c.offset < offset; }
+
+}  // namespace
+
+GopPrefetcher::Segment::~Segment() {
+  if (fd >= 0) ::close(fd);
+}
+
+GopPrefetcher::GopPrefetcher(EventLoop* loop, IoBackend* io, const ArchiveIndex* archive,
+                             const std::string& cameraId, const GopPrefetcherOptions& options,
+                             std::function<void()> ready)
+    : loop_(loop),
+      io_(io),
+      archive_(archive),
+      cameraId_(cameraId),
+      options_(options),
+      ready_(std::move(ready)),
+      self_(std::make_shared<GopPrefetcher*>(this)) {}
+
+GopPrefetcher::~GopPrefetcher() {
+  *self_ = nullptr;
+  if (options_.budget) options_.budget->release(readingBytes_);
+}
+
+bool GopPrefetcher::start(int64_t startUs, bool keyframesOnly) {
+  ArchiveSeekResult where;
+  if (!archive_->seek(cameraId_, startUs, &where) || !open(where)) return false;
+  keyframesOnly_ = keyframesOnly;
+  targetUs_ = startUs;
+  // where is the latest keyframe of one of the camera's streams; another
+  // one in the segment may have a later one.
+  auto later = [](int64_t ts, const KeyframeEntry& k) { return ts < k.timestampUs; };
+  auto it = std::upper_bound(keyframes_.begin(), keyframes_.end(), startUs, later);
+  if (it != keyframes_.begin()) --it;
+  nextChunk_ = static_cast<size_t>(
+      std::lower_bound(chunks_.begin(), chunks_.end(), it->blockOffset, chunkBefore) -
+      chunks_.begin());
+  pendingSyncUs_ = it->timestampUs;
+  pump();
+  return true;
+}
+
+bool GopPrefetcher::open(const ArchiveSeekResult& where) {
+  auto segment = std::make_shared<Segment>();
+  SegmentIndex index;
+  // The file first: its index is its own if it is still the one at the path
+  // after (see CameraReader::open()).
+  for (int attempt = 0;; ++attempt) {
+    if (attempt == 3) return false;
+    if (segment->fd >= 0) ::close(segment->fd);
+    segment->fd = ::open(where.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (segment->fd < 0) return false;
+    if (index.open(segmentIndexPath(where.path)) < 0 || index.segmentId() != where.segmentId)
+      return false;
+    if (isSameFile(segment->fd, where.path)) break;
+  }
+  std::vector<ChunkEntry> chunks;
+  std::vector<KeyframeEntry> keyframes;
+  for (size_t i = 0; i < index.streamCount(); ++i) {
+    const IndexStream& s = index.stream(i);
+    if (strncmp(s.cameraId, cameraId_.c_str(), sizeof(s.cameraId)) != 0) continue;
+    segment->streamIds.push_back(s.streamId);
+    index.chunks(i, &chunks);
+    index.entries(i, &keyframes);
+  }
+  if (keyframes.empty() || chunks.empty()) return false;
+  posix_fadvise(segment->fd, 0, 0, POSIX_FADV_RANDOM);
+  segment->id = where.segmentId;
+
+  std::sort(chunks.begin(), chunks.end(),
+            [](const ChunkEntry& a, const ChunkEntry& b) { return a.offset < b.offset; });
+  chunks.erase(std::unique(chunks.begin(), chunks.end(),
+                           [](const ChunkEntry& a, const ChunkEntry& b) {
+                             return a.offset == b.offset;
+                           }),
+               chunks.end());
+  if (segment->streamIds.size() > 1)
+    std::stable_sort(keyframes.begin(), keyframes.end(),
+                     [](const KeyframeEntry& a, const KeyframeEntry& b) {
+                       return a.timestampUs < b.timestampUs;
+                     });
+  segment_ = std::move(segment);
+  chunks_.swap(chunks);
+  keyframes_.swap(keyframes);
+  ++stats_.segments;
+  // Whole GOPs: from where's keyframe, which the segment's first chunks
+  // may trail the previous GOP ahead of.
+  nextChunk_ = static_cast<size_t>(
+      std::lower_bound(chunks_.begin(), chunks_.end(), where.keyframe.blockOffset, chunkBefore) -
+      chunks_.begin());
+  pendingSyncUs_ = where.keyframe.timestampUs;
+  return true;
+}
+
+bool GopPrefetcher::nextSegment(int64_t afterUs) {
+  ArchiveSeekResult where;
+  while (archive_->seekAfter(cameraId_, afterUs, &where)) {
+    if (open(where)) return true;
+    afterUs = where.keyframe.timestampUs;
+  }
+  atEnd_ = true;
+  return false;
+}
+
+bool GopPrefetcher::full() const {
+  if (queuedBytes_ + readingBytes_ >= options_.maxQueuedBytes) return true;
+  // The keyframe playing and options.gops after it.
+  if (keyframesOnly_) return queuedKeyframes_ + reads_.size() > options_.gops;
+  return queuedKeyframes_ > options_.gops;
+}
+
+bool GopPrefetcher::ahead() const {
+  size_t keyframes = 0;
+  for (auto it = queue_.rbegin(); it != queue_.rend() && it->timestampUs > targetUs_; ++it)
+    keyframes += it->keyframe;
+  return keyframes >= options_.gops;
+}
+
+void GopPrefetcher::pump() {
+  // One read until the first frame is in: every camera's first GOP comes
+  // off a busy disk before any camera's next ones, and the clock starts.
+  // Keyframes-only, one at a time too: a keyframe queued behind others on
+  // a disk that fell behind would only be later.
+  size_t inFlight = stats_.frames == 0 || keyframesOnly_ ? 1 : options_.readsInFlight;
+  while (!atEnd_ && reads_.size() < inFlight && !full()) {
+    if (options_.budget && options_.budget->exhausted() && !(reads_.empty() && queue_.empty())) {
+      ++stats_.budgetStalls;
+      break;
+    }
+    if (!(keyframesOnly_ ? issueKeyframe() : issueChunk())) break;
+  }
+  if (ended() && !notified_) {
+    notified_ = true;
+    auto self = self_;
+    loop_->post([self] {
+      if (*self) (*self)->ready_();
+    });
+  }
+}
+
+bool GopPrefetcher::issueChunk() {
+  // On to the camera's next segment once this one is read; it starts
+  // after the last keyframe here. In step, reading goes on at its first
+  // chunk: the GOP open when the segment rolled ends there.
+  while (nextChunk_ >= chunks_.size()) {
+    bool inStep = pendingSyncUs_ == INT64_MIN;
+    if (!nextSegment(keyframes_.back().timestampUs)) return false;
+    if (inStep) {
+      nextChunk_ = 0;
+      pendingSyncUs_ = INT64_MIN;
+    }
+  }
+  const ChunkEntry& chunk = chunks_[nextChunk_++];
+  auto read = std::make_shared<Read>();
+  read->offset = chunk.offset;
+  read->size = chunk.size;
+  read->syncUs = pendingSyncUs_;
+  pendingSyncUs_ = INT64_MIN;
+  submit(std::move(read));
+  return true;
+}
+
+bool GopPrefetcher::issueKeyframe() {
+  auto later = [](int64_t ts, const KeyframeEntry& k) { return ts < k.timestampUs; };
+  for (;;) {
+    // A target past this segment may be closer to a keyframe of a later
+    // one: jump there rather than walk the keyframes in between.
+    ArchiveSeekResult where;
+    if (targetUs_ > keyframes_.back().timestampUs &&
+        archive_->seek(cameraId_, targetUs_, &where) && where.segmentId != segment_->id &&
+        where.keyframe.timestampUs > requestedUs_ && open(where))
+      continue;
+    // The latest keyframe at or before the target that is newer than the
+    // last one read, else the next one.
+    auto it = std::upper_bound(keyframes_.begin(), keyframes_.end(),
+                               std::max(targetUs_, requestedUs_), later);
+    const KeyframeEntry* entry = nullptr;
+    if (it != keyframes_.begin() && (it - 1)->timestampUs > requestedUs_) {
+      entry = &*(it - 1);
+    } else if (it != keyframes_.end()) {
+      entry = &*it;
+    } else {
+      if (!nextSegment(std::max(requestedUs_, keyframes_.back().timestampUs))) return false;
+      continue;
+    }
+    requestedUs_ = entry->timestampUs;
+    auto chunk =
+        std::lower_bound(chunks_.begin(), chunks_.end(), entry->blockOffset, chunkBefore);
+    if (chunk == chunks_.end() || chunk->offset != entry->blockOffset) {
+      ++stats_.readErrors;
+      continue;
+    }
+    auto read = std::make_shared<Read>();
+    read->offset = chunk->offset;
+    read->size = chunk->size;
+    read->keyframeOnly = true;
+    read->keyframeUs = entry->timestampUs;
+    submit(std::move(read));
+    return true;
+  }
+}
+
+void GopPrefetcher::submit(std::shared_ptr<Read> read) {
+  read->segment = segment_;
+  read->generation = generation_;
+  read->buffer = std::make_shared<AlignedBuffer>(read->size);
+  read->buffer->resize(read->size);
+  readingBytes_ += read->size;
+  if (options_.budget) options_.budget->charge(read->size);
+  reads_.push_back(read);
+  ++stats_.reads;
+  // The read holds its buffer and file until it completes, even if the
+  // prefetcher is gone by then.
+  auto self = self_;
+  io_->read(read->segment->fd, read->buffer->data(), read->size, read->offset, loop_,
+            [self, read](int64_t result) {
+              read->done = true;
+              read->result = result;
+              if (*self) (*self)->onRead();
+            });
+}
+
+void GopPrefetcher::onRead() {
+  bool wasEmpty = queue_.empty();
+  while (!reads_.empty() && reads_.front()->done) {
+    std::shared_ptr<Read> read = std::move(reads_.front());
+    reads_.pop_front();
+    readingBytes_ -= read->size;
+    if (options_.budget) options_.budget->release(read->size);
+    if (read->generation != generation_) continue;
+    if (read->result < static_cast<int64_t>(read->size)) {
+      ++stats_.readErrors;
+      continue;
+    }
+    stats_.bytesRead += read->size;
+    parse(*read);
+  }
+  pump();
+  if (wasEmpty && !queue_.empty()) ready_();
+}
+
+void GopPrefetcher::parse(const Read& read) {
+  const uint8_t* data = read.buffer->data();
+  if (checkBlock(read.segment->id, data, read.size) == 0) {
+    ++stats_.readErrors;
+    return;
+  }
+  BlockHeader block;
+  memcpy(&block, data, sizeof(block));
+  if (read.syncUs != INT64_MIN) syncUs_ = read.syncUs;
+  const std::vector<uint32_t>& streams = read.segment->streamIds;
+  const uint8_t* p = data + sizeof(BlockHeader);
+  const uint8_t* end = p + block.payloadSize;
+  while (static_cast<size_t>(end - p) >= sizeof(RecordHeader)) {
+    RecordHeader record;
+    memcpy(&record, p, sizeof(record));
+    p += sizeof(record);
+    if (record.size > static_cast<size_t>(end - p)) break;
+    const uint8_t* payload = p;
+    p += record.size;
+    if (record.type != static_cast<uint8_t>(RecordType::Video) ||
+        std::find(streams.begin(), streams.end(), record.streamId) == streams.end())
+      continue;
+    bool keyframe = (record.flags & kRecordKeyframe) != 0;
+    if (read.keyframeOnly) {
+      if (!keyframe || record.timestampUs != read.keyframeUs) continue;
+    } else if (syncUs_ != INT64_MIN) {
+      if (!keyframe || record.timestampUs < syncUs_) continue;
+      syncUs_ = INT64_MIN;
+    }
+    Frame frame;
+    frame.timestampUs = record.timestampUs;
+    frame.keyframe = keyframe;
+    frame.data = payload;
+    frame.size = record.size;
+    frame.chunk = read.buffer;
+    queue_.push_back(std::move(frame));
+    queuedBytes_ += record.size;
+    if (keyframe) ++queuedKeyframes_;
+    lastUs_ = record.timestampUs;
+    ++stats_.frames;
+    if (read.keyframeOnly) return;
+  }
+  if (read.keyframeOnly) ++stats_.readErrors;
+}
+
+void GopPrefetcher::pop() {
+  const Frame& frame = queue_.front();
+  queuedBytes_ -= frame.size;
+  if (frame.keyframe) --queuedKeyframes_;
+  queue_.pop_front();
+  pump();
+}
+
+void GopPrefetcher::setTarget(int64_t timestampUs) {
+  targetUs_ = timestampUs;
+  if (keyframesOnly_) pump();
+}
+
+void GopPrefetcher::setKeyframesOnly(bool on) {
+  if (on == keyframesOnly_) return;
+  keyframesOnly_ = on;
+  ++generation_;
+  if (on) {
+    std::deque<Frame> kept;
+    for (Frame& frame : queue_) {
+      if (frame.keyframe) {
+        kept.push_back(std::move(frame));
+      } else {
+        queuedBytes_ -= frame.size;
+        ++stats_.dropped;
+      }
+    }
+    queue_.swap(kept);
+    requestedUs_ = lastUs_;
+  } else {
+    // Whole GOPs again from the first keyframe after the last frame
+    // queued, which may start in the chunk of one already read.
+    auto later = [](int64_t ts, const KeyframeEntry& k) { return ts < k.timestampUs; };
+    auto it = std::upper_bound(keyframes_.begin(), keyframes_.end(), lastUs_, later);
+    nextChunk_ = chunks_.size();
+    pendingSyncUs_ = lastUs_ + 1;
+    if (it != keyframes_.end()) {
+      nextChunk_ = static_cast<size_t>(
+          std::lower_bound(chunks_.begin(), chunks_.end(), it->blockOffset, chunkBefore) -
+          chunks_.begin());
+      pendingSyncUs_ = it->timestampUs;
+    }
+  }
+  pump();
+}
+
+}  // namespace nvr
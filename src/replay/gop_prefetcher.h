@@ -0,0 +1,182 @@
+// Reads one camera's recording ahead of a synchronized replay, whole GOPs
+// at a time, with asynchronous chunk reads on the store's IoBackend.
+//
+// The camera's chunks (segment_index.h) are read in file order, up to
+// readsInFlight at once, and their video frames queued until the queue
+// holds the next options.gops GOPs after the one playing, or
+// maxQueuedBytes. Reading runs on into the next segment at its first chunk,
+// where the GOP open when the segment rolled ends. Reads complete in any
+// order and are parsed in order. The
+// loop never waits for the disk, so the prefetchers of many cameras have
+// their reads outstanding together and their GOPs come off the disk in
+// parallel rather than one camera after another.
+//
+// In keyframes-only mode, for a disk that fell behind or a fast scale,
+// only the chunk of each keyframe is read, one at a time: the latest
+// keyframe at or before the playback target, so that a camera that fell
+// behind catches up in one step, else the next one after the last read.
+//
+// Segments are opened on the loop (open() and the index's mmap); no media
+// is read there, and the kernel's read-ahead by file position, which would
+// fetch other cameras' chunks, is turned off for them. Loop-thread only.
+
+#ifndef NVR_REPLAY_GOP_PREFETCHER_H
+#define NVR_REPLAY_GOP_PREFETCHER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "storage/aligned_buffer.h"
+#include "storage/archive_index.h"
+#include "storage/io_backend.h"
+#include "storage/read_ahead.h"
+#include "storage/segment_index.h"
+
+namespace nvr {
+
+struct GopPrefetcherOptions {
+  size_t gops = 2;                       // whole GOPs queued beyond the one playing
+  size_t maxQueuedBytes = 4 << 20;       // queued and being read
+  size_t readsInFlight = 4;
+  // Reads in flight count against it, if set; past its limit no more are
+  // issued while anything is queued or being read.
+  ReadAheadBudget* budget = nullptr;
+};
+
+class GopPrefetcher {
+ public:
+  struct Frame {
+    int64_t timestampUs = 0;
+    bool keyframe = false;
+    const uint8_t* data = nullptr;
+    uint32_t size = 0;
+    std::shared_ptr<const AlignedBuffer> chunk;  // holds data
+  };
+
+  struct Stats {
+    uint64_t reads = 0;
+    uint64_t bytesRead = 0;
+    uint64_t readErrors = 0;  // chunks unreadable or invalid, skipped
+    uint64_t frames = 0;      // queued
+    uint64_t dropped = 0;     // queued delta frames dropped going keyframes-only
+    uint64_t segments = 0;
+    uint64_t budgetStalls = 0;  // reading held back by the node's budget
+  };
+
+  // io and archive must outlive the prefetcher. ready is called from the
+  // loop when the queue stops being empty, and once at the end of the
+  // archive; never from within a call to the prefetcher.
+  GopPrefetcher(EventLoop* loop, IoBackend* io, const ArchiveIndex* archive,
+                const std::string& cameraId, const GopPrefetcherOptions& options,
+                std::function<void()> ready);
+  // Reads still in flight complete into nothing.
+  ~GopPrefetcher();
+
+  GopPrefetcher(const GopPrefetcher&) = delete;
+  GopPrefetcher& operator=(const GopPrefetcher&) = delete;
+
+  // Starts reading at the camera's latest keyframe at or before startUs
+  // (its first if later). False if the camera has no recordings.
+  bool start(int64_t startUs, bool keyframesOnly);
+
+  // Into keyframes-only mode, queued delta frames are dropped along with
+  // the reads in flight. Back out of it, reading goes on at the next GOP.
+  void setKeyframesOnly(bool on);
+  bool keyframesOnly() const { return keyframesOnly_; }
+  // The recorded time playing now, which keyframes-only reads catch up to.
+  void setTarget(int64_t timestampUs);
+
+  bool empty() const { return queue_.empty(); }
+  size_t size() const { return queue_.size(); }
+  const Frame& front() const { return queue_.front(); }
+  const Frame& at(size_t i) const { return queue_[i]; }
+  // Removes the front frame and reads on if there is room.
+  void pop();
+  // Neither frames nor anything left to read.
+  bool ended() const { return atEnd_ && queue_.empty() && reads_.empty(); }
+  // The queue holds options.gops keyframes past the target: the disk is
+  // ahead of playback.
+  bool ahead() const;
+  size_t queuedBytes() const { return queuedBytes_; }
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  // An open segment file; reads in flight share it.
+  struct Segment {
+    ~Segment();
+    int fd = -1;
+    uint64_t id = 0;
+    std::vector<uint32_t> streamIds;  // of the camera
+  };
+  struct Read {
+    std::shared_ptr<Segment> segment;
+    std::shared_ptr<AlignedBuffer> buffer;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    int64_t syncUs = INT64_MIN;  // sets syncUs_ when parsed
+    bool keyframeOnly = false;
+    int64_t keyframeUs = 0;  // the keyframe wanted, keyframes-only
+    uint64_t generation = 0;
+    bool done = false;
+    int64_t result = 0;
+  };
+
+  bool open(const ArchiveSeekResult& where);
+  // Opens the camera's first segment starting after afterUs; at the end
+  // of the archive, false.
+  bool nextSegment(int64_t afterUs);
+  // No room to read more.
+  bool full() const;
+  // Issues reads while there is room.
+  void pump();
+  bool issueChunk();
+  bool issueKeyframe();
+  void submit(std::shared_ptr<Read> read);
+  void onRead();
+  void parse(const Read& read);
+
+  EventLoop* loop_;
+  IoBackend* io_;
+  const ArchiveIndex* archive_;
+  std::string cameraId_;
+  GopPrefetcherOptions options_;
+  std::function<void()> ready_;
+  // Completions check it: null once the prefetcher is gone.
+  std::shared_ptr<GopPrefetcher*> self_;
+
+  std::shared_ptr<Segment> segment_;
+  std::vector<ChunkEntry> chunks_;   // merged over the camera's streams, in file order
+  std::vector<KeyframeEntry> keyframes_;
+  size_t nextChunk_ = 0;
+
+  bool keyframesOnly_ = false;
+  uint64_t generation_ = 0;  // reads of an earlier mode are dropped
+  int64_t targetUs_ = 0;
+  // Parsing skips frames up to the first keyframe at or after syncUs_;
+  // the next chunk read sets it to pendingSyncUs_, if any.
+  int64_t syncUs_ = INT64_MIN;
+  int64_t pendingSyncUs_ = INT64_MIN;
+  int64_t lastUs_ = INT64_MIN;       // stamp of the last frame queued
+  int64_t requestedUs_ = INT64_MIN;  // keyframes-only: the last keyframe read
+  bool atEnd_ = false;
+  bool notified_ = false;            // of the end
+
+  std::deque<std::shared_ptr<Read>> reads_;  // in issue order
+  uint64_t readingBytes_ = 0;
+  std::deque<Frame> queue_;
+  size_t queuedBytes_ = 0;
+  size_t queuedKeyframes_ = 0;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_REPLAY_GOP_PREFETCHER_H
@@ -0,0 +1,294 @@
+#include "replay/replay_provider.h"
+
+#include <stdlib.h>
+
+#include <future>
+
+#include "base/log.h"
+#include "media/nal.h"
+#include "storage/camera_reader.h"
+
+namespace nvr {
+
+namespace {
+
+class ParameterSetCollector : public NalHandler {
+ public:
+  ParameterSetCollector(VideoCodec codec, ParameterSets* sets) : codec_(codec), sets_(sets) {}
+  void onNal(const NalUnit& nal) override { sets_->update(codec_, nal); }
+
+ private:
+  VideoCodec codec_;
+  ParameterSets* sets_;
+};
+
+void addReads(const ReplayStream& stream, ReplayMediaProvider::Stats* to) {
+  ReplayStream::Stats s = stream.stats();
+  to->bytesRead += s.bytesRead;
+  to->cacheHits += s.cacheHits;
+  to->cacheMisses += s.cacheMisses;
+  to->fetches += s.fetches;
+  if (stream.readAhead()) to->hintedBytes += stream.readAhead()->stats().hintedBytes;
+}
+
+}  // namespace
+
+ReplayMediaProvider::ReplayMediaProvider(EventLoopPool* loops, const ArchiveIndex* archive,
+                                         const RtspSessionOptions& options, IoBackend* io,
+                                         const GopPrefetcherOptions& prefetch,
+                                         const ReadAheadOptions& readAhead)
+    : loops_(loops),
+      archive_(archive),
+      options_(options),
+      io_(io),
+      prefetch_(prefetch),
+      readAhead_(readAhead),
+      budget_(readAhead.maxBytes) {
+  prefetch_.budget = &budget_;
+  for (int i = 0; i < loops_->size(); ++i) shards_.emplace_back(new Shard);
+}
+
+ReplayMediaProvider::~ReplayMediaProvider() = default;
+
+int64_t ReplayMediaProvider::startOf(const std::string& query) {
+  size_t pos = 0;
+  while (pos < query.size()) {
+    size_t end = query.find('&', pos);
+    if (end == std::string::npos) end = query.size();
+    if (query.compare(pos, 6, "start=") == 0) {
+      std::string value = query.substr(pos + 6, end - pos - 6);
+      char* stop = nullptr;
+      double seconds = strtod(value.c_str(), &stop);
+      if (stop == value.c_str() || *stop != '\0' || !(seconds > 0)) return 0;
+      return static_cast<int64_t>(seconds * 1e6);
+    }
+    pos = end + 1;
+  }
+  return 0;
+}
+
+std::vector<std::string> ReplayMediaProvider::camerasOf(const std::string& path) {
+  std::vector<std::string> cameras;
+  size_t pos = 0;
+  for (;;) {
+    size_t end = path.find(',', pos);
+    if (end == std::string::npos) end = path.size();
+    if (end == pos || cameras.size() == SyncReplay::kMaxCameras) return {};
+    cameras.push_back(path.substr(pos, end - pos));
+    if (end == path.size()) return cameras;
+    pos = end + 1;
+  }
+}
+
+int ReplayMediaProvider::describeCamera(const std::string& cameraId, int64_t startUs,
+                                        SdpMedia* media) const {
+  // A look at the segment the replay would start in; only its index and
+  // StreamInfo are read.
+  ArchiveSeekResult where;
+  CameraReader reader;
+  if (!archive_->seek(cameraId, startUs, &where) || reader.open(where.path, cameraId) < 0 ||
+      !reader.seek(where.keyframe.timestampUs) || reader.streamInfo() == nullptr)
+    return 404;
+  const StreamInfo& info = *reader.streamInfo();
+  VideoCodec codec = videoCodecFromEncoding(info.codec);
+  if (codec == VideoCodec::Unknown) return 415;
+  ParameterSets sets;
+  ParameterSetCollector collector(codec, &sets);
+  AnnexBParser::split(codec, reinterpret_cast<const uint8_t*>(info.extradata.data()),
+                      info.extradata.size(), &collector);
+  media->type = "video";
+  media->payloadType = ReplayStream::kPayloadType;
+  media->encoding = info.codec;
+  media->clockRate = 90000;
+  media->fmtp = formatSdpFmtp(codec, sets);
+  return 200;
+}
+
+void ReplayMediaProvider::describe(const std::string& path, const std::string& query,
+                                   DescribeCallback done) {
+  std::vector<SdpMedia> media;
+  std::vector<std::string> cameras = camerasOf(path);
+  if (cameras.empty() || (cameras.size() > 1 && io_ == nullptr)) {
+    done(404, media);
+    return;
+  }
+  int64_t startUs = startOf(query);
+  for (const std::string& camera : cameras) {
+    SdpMedia video;
+    int status = describeCamera(camera, startUs, &video);
+    if (status != 200) {
+      done(status, std::vector<SdpMedia>());
+      return;
+    }
+    media.push_back(video);
+  }
+  done(200, media);
+}
+
+void ReplayMediaProvider::play(RtspPlayRequest request) {
+  int index = static_cast<int>(next_.fetch_add(1, std::memory_order_relaxed) % shards_.size());
+  loops_->loop(index)->post([this, index, request]() mutable { start(index, &request); });
+}
+
+void ReplayMediaProvider::Shard::add(const SyncReplay& sync) {
+  SyncReplay::Stats s = sync.stats();
+  stats.frames += s.frames;
+  stats.waits += s.waits;
+  stats.syncFallbacks += s.fallbacks;
+  stats.syncLateFrames += s.late;
+  stats.syncBytesRead += s.bytesRead;
+}
+
+void ReplayMediaProvider::start(int index, RtspPlayRequest* request) {
+  EventLoop* loop = loops_->loop(index);
+  Shard* shard = shards_[index].get();
+  std::vector<std::string> cameras = camerasOf(request->path);
+  if (cameras.size() > 1) {
+    startSync(index, cameras, request);
+    return;
+  }
+  if (request->tracks.size() != 1 || request->tracks[0].channel < 0) {
+    rejectRtspPlay(request, 454);
+    return;
+  }
+  std::string cameraId = request->path;
+  int64_t startUs = startOf(request->query);
+  std::unique_ptr<RtspServerSession> session(
+      new RtspServerSession(loop, request, options_, &shard->stats.sessions));
+  std::unique_ptr<ReadAhead> readAhead;
+  if (io_) readAhead.reset(new ReadAhead(loop, io_, &budget_, readAhead_));
+  ReplayStream* stream = new ReplayStream(
+      loop, &shard->pool, archive_, std::move(session), cameraId, startUs, request->scale,
+      [loop, shard](ReplayStream* finished) {
+        // Not from inside the stream's own call.
+        loop->post([shard, finished] {
+          auto it = shard->streams.find(finished);
+          if (it == shard->streams.end()) return;
+          shard->stats.frames += finished->stats().frames;
+          shard->stats.waits += finished->stats().waits;
+          addReads(*finished, &shard->stats);
+          --shard->stats.streams;
+          shard->streams.erase(it);
+        });
+      },
+      std::move(readAhead));
+  shard->streams[stream].reset(stream);
+  ++shard->stats.streams;
+  ++shard->stats.started;
+  if (!stream->start()) {
+    // Recorded at DESCRIBE, gone since.
+    NVR_WARN("replay: nothing of %s to play from %lld", cameraId.c_str(),
+             static_cast<long long>(startUs));
+    stream->stop();
+    --shard->stats.streams;
+    shard->streams.erase(stream);
+  }
+}
+
+void ReplayMediaProvider::startSync(int index, const std::vector<std::string>& cameras,
+                                    RtspPlayRequest* request) {
+  EventLoop* loop = loops_->loop(index);
+  Shard* shard = shards_[index].get();
+  size_t setUp = 0;
+  for (const RtspSessionTrack& track : request->tracks) setUp += track.channel >= 0;
+  if (io_ == nullptr || request->tracks.size() != cameras.size() || setUp == 0) {
+    rejectRtspPlay(request, 454);
+    return;
+  }
+  if (request->scale < 0) {
+    // Played forward only.
+    rejectRtspPlay(request, 551);
+    return;
+  }
+  int64_t startUs = startOf(request->query);
+  RtspSessionOptions options = options_;
+  options.softQueueBytes *= setUp;
+  options.hardQueueBytes *= setUp;
+  std::unique_ptr<RtspServerSession> session(
+      new RtspServerSession(loop, request, options, &shard->stats.sessions));
+  SyncReplay* sync = new SyncReplay(
+      loop, &shard->pool, io_, archive_, std::move(session), cameras, request->tracks, startUs,
+      request->scale, prefetch_, [loop, shard](SyncReplay* finished) {
+        // Not from inside the replay's own call.
+        loop->post([shard, finished] {
+          auto it = shard->syncs.find(finished);
+          if (it == shard->syncs.end()) return;
+          shard->add(*finished);
+          --shard->stats.streams;
+          shard->stats.syncCameras -= finished->cameras();
+          shard->syncs.erase(it);
+        });
+      });
+  shard->syncs[sync].reset(sync);
+  ++shard->stats.started;
+  if (!sync->start()) {
+    NVR_WARN("replay: nothing of %s to play from %lld", request->path.c_str(),
+             static_cast<long long>(startUs));
+    sync->stop();
+    shard->syncs.erase(sync);
+    return;
+  }
+  ++shard->stats.streams;
+  shard->stats.syncCameras += sync->cameras();
+}
+
+void ReplayMediaProvider::stop() {
+  std::vector<std::future<void>> done;
+  for (int i = 0; i < loops_->size(); ++i) {
+    auto promise = std::make_shared<std::promise<void>>();
+    done.push_back(promise->get_future());
+    Shard* shard = shards_[i].get();
+    loops_->loop(i)->post([shard, promise] {
+      for (auto& entry : shard->streams) {
+        shard->stats.frames += entry.second->stats().frames;
+        shard->stats.waits += entry.second->stats().waits;
+        addReads(*entry.second, &shard->stats);
+      }
+      for (auto& entry : shard->syncs) shard->add(*entry.second);
+      shard->stats.streams = 0;
+      shard->stats.syncCameras = 0;
+      shard->streams.clear();
+      shard->syncs.clear();
+      promise->set_value();
+    });
+  }
+  for (auto& f : done) f.wait();
+}
+
+ReplayMediaProvider::Stats ReplayMediaProvider::stats() {
+  std::vector<std::future<Stats>> parts;
+  for (int i = 0; i < loops_->size(); ++i) {
+    auto promise = std::make_shared<std::promise<Stats>>();
+    parts.push_back(promise->get_future());
+    Shard* shard = shards_[i].get();
+    loops_->loop(i)->post([shard, promise] {
+      Stats part = shard->stats;
+      for (auto& entry : shard->streams) addReads(*entry.second, &part);
+      promise->set_value(part);
+    });
+  }
+  Stats total;
+  for (auto& f : parts) {
+    Stats part = f.get();
+    total.streams += part.streams;
+    total.started += part.started;
+    total.frames += part.frames;
+    total.waits += part.waits;
+    total.syncCameras += part.syncCameras;
+    total.syncFallbacks += part.syncFallbacks;
+    total.syncLateFrames += part.syncLateFrames;
+    total.syncBytesRead += part.syncBytesRead;
+    total.bytesRead += part.bytesRead;
+    total.cacheHits += part.cacheHits;
+    total.cacheMisses += part.cacheMisses;
+    total.fetches += part.fetches;
+    total.hintedBytes += part.hintedBytes;
+    total.sessions.add(part.sessions);
+  }
+  total.readAheadBytes = budget_.used();
+  total.readAheadPeak = budget_.peak();
+  total.readAheadDenied = budget_.denied();
+  return total;
+}
+
+}  // namespace nvr
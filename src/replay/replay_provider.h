@@ -0,0 +1,126 @@
+// Recorded video for the RTSP server: "/replay/<camera id>?start=<t>",
+// with t in Unix seconds (fractions allowed; the start of the archive if
+// absent).
+//
+// DESCRIBE looks the start up in the archive and announces the stream as
+// recorded there, with its parameter sets from the segment's StreamInfo.
+// At PLAY the viewer gets a ReplayStream of its own on one of the pool's
+// loops, picked round robin; the stream reads, packetizes and paces the
+// frames there, at the Scale the viewer asked for (up to kMaxScale either
+// way).
+//
+// "/replay/<id>,<id>,...?start=<t>" replays up to SyncReplay::kMaxCameras
+// cameras side by side, one track each in the order named, as a
+// SyncReplay that reads them ahead through the store's IoBackend and
+// paces them from one clock; forward only. Its session gets the queue
+// limits of one viewer per camera.
+//
+// Given io, single-camera replays read only from the page cache and read
+// ahead through it (read_ahead.h); their hints, and the multi-camera
+// replays' reads in flight, share one ReadAheadBudget per provider.
+
+#ifndef NVR_REPLAY_REPLAY_PROVIDER_H
+#define NVR_REPLAY_REPLAY_PROVIDER_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/event_loop_pool.h"
+#include "base/packet_buffer.h"
+#include "replay/gop_prefetcher.h"
+#include "replay/replay_stream.h"
+#include "replay/sync_replay.h"
+#include "rtsp/rtsp_server.h"
+#include "storage/archive_index.h"
+#include "storage/io_backend.h"
+#include "storage/read_ahead.h"
+
+namespace nvr {
+
+class ReplayMediaProvider : public RtspMediaProvider {
+ public:
+  static constexpr double kMaxScale = 32;
+
+  // loops, archive and io must outlive the provider; archive may be
+  // refresh()ed from another thread while it serves. Without io, only
+  // single cameras play.
+  ReplayMediaProvider(EventLoopPool* loops, const ArchiveIndex* archive,
+                      const RtspSessionOptions& options, IoBackend* io = nullptr,
+                      const GopPrefetcherOptions& prefetch = GopPrefetcherOptions(),
+                      const ReadAheadOptions& readAhead = ReadAheadOptions());
+  // stop() first, while the loops run.
+  ~ReplayMediaProvider() override;
+
+  void describe(const std::string& path, const std::string& query,
+                DescribeCallback done) override;
+  void play(RtspPlayRequest request) override;
+  double maxScale() const override { return kMaxScale; }
+
+  // Ends every replay and closes its viewer. Blocks; not from a loop
+  // thread.
+  void stop();
+
+  struct Stats {
+    uint64_t streams = 0;  // playing right now
+    uint64_t started = 0;
+    uint64_t frames = 0;   // of finished streams
+    uint64_t waits = 0;    // of finished streams
+    // Multi-camera replays, one stream each above.
+    uint64_t syncCameras = 0;     // playing right now
+    uint64_t syncFallbacks = 0;   // cameras dropped to keyframes for the disk, finished
+    uint64_t syncLateFrames = 0;  // of finished replays
+    uint64_t syncBytesRead = 0;   // of finished replays
+    // Single-camera replays, finished and playing.
+    uint64_t bytesRead = 0;
+    uint64_t cacheHits = 0;    // chunk reads the page cache served
+    uint64_t cacheMisses = 0;  // and those it did not
+    uint64_t fetches = 0;      // chunks read through io after a miss
+    uint64_t hintedBytes = 0;  // read-ahead
+    // The node's read-ahead budget.
+    uint64_t readAheadBytes = 0;  // now
+    uint64_t readAheadPeak = 0;
+    uint64_t readAheadDenied = 0;
+    RtspSessionStats sessions;
+  };
+  // Blocks until every loop answered; not from a loop thread.
+  Stats stats();
+
+ private:
+  // Per loop; loop-thread only.
+  struct Shard {
+    PacketPool pool{PacketPools::kStreamChunkSize, 16};
+    std::map<ReplayStream*, std::unique_ptr<ReplayStream>> streams;  // after pool
+    std::map<SyncReplay*, std::unique_ptr<SyncReplay>> syncs;
+    Stats stats;
+
+    void add(const SyncReplay& sync);
+  };
+
+  // Start time of a query, in microseconds; 0 if absent or malformed.
+  static int64_t startOf(const std::string& query);
+  // The cameras of a path; empty if there are none or too many.
+  static std::vector<std::string> camerasOf(const std::string& path);
+  // A camera's track as recorded at startUs, or an RTSP status.
+  int describeCamera(const std::string& cameraId, int64_t startUs, SdpMedia* media) const;
+  void start(int index, RtspPlayRequest* request);
+  void startSync(int index, const std::vector<std::string>& cameras, RtspPlayRequest* request);
+
+  EventLoopPool* loops_;
+  const ArchiveIndex* archive_;
+  RtspSessionOptions options_;
+  IoBackend* io_;
+  GopPrefetcherOptions prefetch_;
+  ReadAheadOptions readAhead_;
+  ReadAheadBudget budget_;
+  std::vector<std::unique_ptr<Shard>> shards_;  // by loop index
+  std::atomic<uint32_t> next_{0};
+};
+
+}  // namespace nvr
+
+#endif  // NVR_REPLAY_REPLAY_PROVIDER_H
@@ -0,0 +1,268 @@
+#include "replay/replay_stream.h"
+
+#include <algorithm>
+
+#include "base/clock.h"
+#include "base/log.h"
+#include "storage/segment_format.h"
+
+namespace nvr {
+
+namespace {
+
+// How often a held-back stream looks at its viewer's queue again.
+constexpr int64_t kWaitPollUs = 20000;
+// Frames due within this much are sent in the same tick.
+constexpr int64_t kSlackUs = 2000;
+// RTP time across a skipped gap: one frame at 25 fps.
+constexpr int64_t kGapStepUs = 40000;
+// Keyframe chunks named to the read-ahead at a time, in trick play.
+constexpr size_t kMaxUpcomingKeyframes = 64;
+
+}  // namespace
+
+ReplayStream::ReplayStream(EventLoop* loop, PacketPool* pool, const ArchiveIndex* archive,
+                           std::unique_ptr<RtspServerSession> session,
+                           const std::string& cameraId, int64_t startUs, double scale,
+                           std::function<void(ReplayStream*)> finished,
+                           std::unique_ptr<ReadAhead> readAhead)
+    : loop_(loop),
+      pool_(pool),
+      archive_(archive),
+      session_(std::move(session)),
+      cameraId_(cameraId),
+      startUs_(startUs),
+      scale_(scale),
+      keyframesOnly_(scale < 0 || scale >= kMaxAllFramesScale),
+      finished_(std::move(finished)),
+      readAhead_(std::move(readAhead)) {}
+
+ReplayStream::~ReplayStream() { stop(); }
+
+bool ReplayStream::start() {
+  ArchiveSeekResult where;
+  if (!archive_->seek(cameraId_, startUs_, &where) || !open(where)) return false;
+  const StreamInfo* info = reader_.streamInfo();
+  VideoCodec codec = info ? videoCodecFromEncoding(info->codec) : VideoCodec::Unknown;
+  if (codec == VideoCodec::Unknown) return false;
+  uint32_t ssrc = static_cast<uint32_t>(std::hash<std::string>()(session_->sessionId()));
+  packetizer_.reset(new RtpPacketizer(pool_, codec, kPayloadType, ssrc));
+  rtpBase_ = ssrc * 2246822519u;
+  // The codec is known: from here on the disk is never waited for.
+  reader_.setNoWait(readAhead_ != nullptr);
+  tick();
+  return true;
+}
+
+void ReplayStream::stop() {
+  done_ = true;
+  if (timer_) loop_->cancel(timer_);
+  timer_ = 0;
+  if (session_) session_->close();
+}
+
+ReplayStream::Stats ReplayStream::stats() const {
+  Stats total = stats_;
+  total.bytesRead += reader_.bytesRead();
+  total.cacheHits += reader_.cacheHits();
+  total.cacheMisses += reader_.cacheMisses();
+  return total;
+}
+
+bool ReplayStream::open(const ArchiveSeekResult& where) {
+  // The reader counts per segment.
+  stats_ = stats();
+  if (reader_.open(where.path, cameraId_) < 0) return false;
+  ++stats_.segments;
+  lastChunk_ = UINT64_MAX;
+  if (readAhead_) readAhead_->open(reader_.fd());
+  // Playing on from an earlier segment: its first keyframe. Else the one
+  // at or before the start.
+  int64_t target = stats_.segments == 1 ? std::max(startUs_, where.keyframe.timestampUs)
+                                        : where.keyframe.timestampUs;
+  if (!reader_.seek(target)) return false;
+  if (keyframesOnly_) {
+    // Walked from where's keyframe: forward, the first at or after it;
+    // backward, it is the first one before.
+    reader_.keyframes(&keyframes_);
+    auto earlier = [](const KeyframeEntry& k, int64_t ts) { return k.timestampUs < ts; };
+    auto later = [](int64_t ts, const KeyframeEntry& k) { return ts < k.timestampUs; };
+    int64_t ts = where.keyframe.timestampUs;
+    auto it = scale_ < 0 ? std::upper_bound(keyframes_.begin(), keyframes_.end(), ts, later)
+                         : std::lower_bound(keyframes_.begin(), keyframes_.end(), ts, earlier);
+    nextKeyframe_ = static_cast<size_t>(it - keyframes_.begin());
+  }
+  return true;
+}
+
+bool ReplayStream::readNext() {
+  for (;;) {
+    if (keyframesOnly_) {
+      if (readKeyframe()) return true;
+    } else if (reader_.next(&pending_)) {
+      if (pending_.header.type != static_cast<uint8_t>(RecordType::Video)) continue;
+      lastUs_ = pending_.header.timestampUs;
+      havePending_ = true;
+      hintAhead();
+      return true;
+    }
+    if (reader_.wouldBlock()) {
+      // Tried again once the chunk is in the page cache.
+      fetching_ = true;
+      ++stats_.fetches;
+      readAhead_->fetch(reader_.blockedChunk(), [this] {
+        fetching_ = false;
+        tick();
+      });
+      return false;
+    }
+    // lastUs_ only ever moves in the direction of play, past every segment
+    // left behind.
+    ArchiveSeekResult where;
+    bool more = scale_ < 0 ? archive_->seekBefore(cameraId_, lastUs_, &where)
+                           : archive_->seekAfter(cameraId_, lastUs_, &where);
+    if (!more) return false;
+    if (open(where)) continue;
+    // Deleted or moved by retention since the archive index was loaded: on
+    // to the next one, as GopPrefetcher does.
+    reader_.close();
+    lastUs_ = where.keyframe.timestampUs;
+  }
+}
+
+bool ReplayStream::readKeyframe() {
+  for (;;) {
+    if (scale_ < 0 ? nextKeyframe_ == 0 : nextKeyframe_ >= keyframes_.size()) return false;
+    const KeyframeEntry& entry =
+        scale_ < 0 ? keyframes_[--nextKeyframe_] : keyframes_[nextKeyframe_++];
+    // Passed even if unreadable, so that the segment is left behind.
+    lastUs_ = entry.timestampUs;
+    if (reader_.readKeyframe(entry, &pending_)) {
+      havePending_ = true;
+      hintAhead();
+      return true;
+    }
+    if (reader_.wouldBlock()) {
+      // The same keyframe again once it is fetched.
+      nextKeyframe_ += scale_ < 0 ? 1 : -1;
+      return false;
+    }
+  }
+}
+
+void ReplayStream::hintAhead() {
+  if (!readAhead_ || pending_.blockOffset == lastChunk_) return;
+  lastChunk_ = pending_.blockOffset;
+  ChunkEntry chunk;
+  chunk.offset = pending_.blockOffset;
+  chunk.size = pending_.blockSize;
+  if (!keyframesOnly_) {
+    size_t count = 0;
+    const ChunkEntry* upcoming = reader_.nextChunks(&count);
+    readAhead_->advance(chunk, upcoming, count);
+    return;
+  }
+  // The chunks of the keyframes still to walk, in the order walked.
+  upcoming_.clear();
+  size_t i = nextKeyframe_;
+  while (upcoming_.size() < kMaxUpcomingKeyframes &&
+         (scale_ < 0 ? i > 0 : i < keyframes_.size())) {
+    const KeyframeEntry& entry = scale_ < 0 ? keyframes_[--i] : keyframes_[i++];
+    ChunkEntry next;
+    if (entry.blockOffset == lastChunk_ ||
+        (!upcoming_.empty() && upcoming_.back().offset == entry.blockOffset) ||
+        !reader_.chunkAt(entry.blockOffset, &next))
+      continue;
+    upcoming_.push_back(next);
+  }
+  readAhead_->advance(chunk, upcoming_.data(), upcoming_.size());
+}
+
+void ReplayStream::sendPending() {
+  havePending_ = false;
+  int64_t stamp = pending_.header.timestampUs;
+  // The RTP clock follows the recorded stamps at viewing speed, except
+  // across a skipped gap (or a clock step against the direction of play),
+  // which it passes as one frame interval.
+  if (stats_.frames > 0) {
+    int64_t step = static_cast<int64_t>((stamp - lastSentUs_) / scale_);
+    mediaUs_ += step >= 0 && step <= kMaxGapUs ? step : kGapStepUs;
+  }
+  lastSentUs_ = stamp;
+  uint32_t timestamp = rtpBase_ + static_cast<uint32_t>(mediaUs_ * 9 / 100);
+  packetizer_->packetize(pending_.data, pending_.header.size, timestamp, &packets_);
+  for (const PacketRef& packet : packets_) session_->enqueue(0, false, packet);
+  packets_.clear();
+  ++stats_.frames;
+  stats_.bytes += pending_.header.size;
+}
+
+void ReplayStream::schedule(int64_t delayUs) {
+  // Rounded up to the loop's next millisecond; kSlackUs covers the rest.
+  int64_t dueMs = (monotonicUs() + std::max<int64_t>(1000, delayUs) + 999) / 1000;
+  timer_ = loop_->runAt(static_cast<uint64_t>(dueMs), [this] {
+    timer_ = 0;
+    tick();
+  });
+}
+
+void ReplayStream::tick() {
+  if (done_) return;
+  session_->flush();
+  if (session_->closed()) {
+    finish();
+    return;
+  }
+  if (session_->congested()) {
+    if (!waiting_) ++stats_.waits;
+    waiting_ = true;
+    schedule(kWaitPollUs);
+    return;
+  }
+  int64_t now = monotonicUs();
+  for (;;) {
+    if (!havePending_ && !readNext()) {
+      // Waiting for the disk: the fetch ticks again.
+      if (fetching_) {
+        session_->flush();
+        return;
+      }
+      // The end of the archive: hang up once the viewer has it all.
+      if (session_->queuedBytes() == 0) {
+        session_->close();
+        finish();
+      } else {
+        schedule(kWaitPollUs);
+      }
+      return;
+    }
+    int64_t stamp = pending_.header.timestampUs;
+    int64_t due = anchorMonoUs_ + static_cast<int64_t>((stamp - anchorWallUs_) / scale_);
+    if (!anchored_ || waiting_ || due - now > kMaxGapUs || due < now - kMaxGapUs) {
+      // Start, resume after a wait, or a gap in the recording: restart the
+      // clock at this frame.
+      anchorMonoUs_ = now;
+      anchorWallUs_ = stamp;
+      anchored_ = true;
+      waiting_ = false;
+      due = now;
+    }
+    if (due > now + kSlackUs) {
+      session_->flush();
+      schedule(due - now);
+      return;
+    }
+    sendPending();
+    if (session_->congested()) break;
+  }
+  session_->flush();
+  schedule(kWaitPollUs);
+}
+
+void ReplayStream::finish() {
+  if (done_) return;
+  done_ = true;
+  if (finished_) finished_(this);
+}
+
+}  // namespace nvr
@@ -0,0 +1,142 @@
+// Plays one camera's recordings to one RTSP viewer, timestamp-accurately,
+// at the viewer's Scale.
+//
+// Frames are read with a CameraReader from the keyframe at or before the
+// start time, across segments in archive order, packetized and paced by
+// their recorded wall clock stamps: a frame goes out when as much time has
+// passed since the first one as between their stamps, divided by the
+// scale. Gaps in the recording longer than kMaxGapUs (of viewing time) are
+// skipped rather than waited out.
+//
+// Below kMaxAllFramesScale every frame is sent (slow motion below 1).
+// From there up, and backward at any scale, only keyframes are: they are walked
+// through the segments' keyframe indexes, one chunk read each, so 32x
+// costs no more disk and bandwidth than a few keyframes a second, and
+// playing backward needs no decoding of whole GOPs on either side. The
+// RTP clock runs at viewing speed, so a viewer shows frames as they come.
+//
+// Unlike live video, replay can wait for a slow viewer: while the
+// session's queue is above its soft limit nothing more is read, and the
+// clock restarts from the next frame once it drains, so a slow viewer sees
+// every frame, late, and costs no drops.
+//
+// A stream is paced by one loop timer at a time (EventLoop::runAt(), a
+// timing wheel slot), never a sleep, so thousands of streams share one
+// thread. Chunks are read on the stream's loop with pread(). Given a
+// ReadAhead, only out of the page cache: the chunks ahead are hinted to
+// the disk as the stream plays (read_ahead.h), and a chunk that still
+// missed is fetched through the store's IoBackend while the stream waits,
+// the loop never blocking on the disk. A stream belongs to one loop and is
+// loop-thread only.
+
+#ifndef NVR_REPLAY_REPLAY_STREAM_H
+#define NVR_REPLAY_REPLAY_STREAM_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "base/packet_buffer.h"
+#include "media/rtp_packetizer.h"
+#include "rtsp/rtsp_server_session.h"
+#include "storage/archive_index.h"
+#include "storage/camera_reader.h"
+#include "storage/read_ahead.h"
+
+namespace nvr {
+
+class ReplayStream {
+ public:
+  static constexpr int64_t kMaxGapUs = 2000000;
+  static constexpr uint8_t kPayloadType = 96;
+  static constexpr double kMaxAllFramesScale = 2;
+
+  struct Stats {
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t segments = 0;
+    uint64_t waits = 0;  // times the viewer's queue held the stream back
+    uint64_t bytesRead = 0;    // off segment files
+    uint64_t cacheHits = 0;    // chunk reads the page cache served
+    uint64_t cacheMisses = 0;  // and those it did not
+    uint64_t fetches = 0;      // waits for the disk, with a read-ahead
+  };
+
+  // pool must outlive the stream and the viewer's queued packets. finished
+  // is called once, from the loop, when the viewer left or the archive
+  // ended; the stream may be deleted then (later, not inside the call).
+  // scale is not 0; below 0 plays backward from startUs. readAhead is
+  // optional, for the loop.
+  ReplayStream(EventLoop* loop, PacketPool* pool, const ArchiveIndex* archive,
+               std::unique_ptr<RtspServerSession> session, const std::string& cameraId,
+               int64_t startUs, double scale, std::function<void(ReplayStream*)> finished,
+               std::unique_ptr<ReadAhead> readAhead = nullptr);
+  ~ReplayStream();
+
+  ReplayStream(const ReplayStream&) = delete;
+  ReplayStream& operator=(const ReplayStream&) = delete;
+
+  // False when nothing is recorded to play from startUs.
+  bool start();
+  // Closes the viewer's connection and stops, without calling finished.
+  void stop();
+
+  Stats stats() const;
+  const ReadAhead* readAhead() const { return readAhead_.get(); }
+
+ private:
+  bool open(const ArchiveSeekResult& where);
+  // Reads the next video frame (keyframe in trick play) into pending_;
+  // false at the end (start) of the archive.
+  bool readNext();
+  bool readKeyframe();
+  // Tells the read-ahead where the frame just read is and what comes next.
+  void hintAhead();
+  void sendPending();
+  void schedule(int64_t delayUs);
+  void tick();
+  void finish();
+
+  EventLoop* loop_;
+  PacketPool* pool_;
+  const ArchiveIndex* archive_;
+  std::unique_ptr<RtspServerSession> session_;
+  std::string cameraId_;
+  int64_t startUs_;
+  double scale_;
+  bool keyframesOnly_;
+  std::function<void(ReplayStream*)> finished_;
+  std::unique_ptr<ReadAhead> readAhead_;
+
+  CameraReader reader_;
+  std::vector<KeyframeEntry> keyframes_;  // of the open segment, in trick play
+  size_t nextKeyframe_ = 0;  // backward: the one before this is next
+  std::unique_ptr<RtpPacketizer> packetizer_;
+  std::vector<PacketRef> packets_;
+  SegmentReader::Record pending_;  // valid until the next reader_.next()
+  bool havePending_ = false;
+  int64_t lastUs_ = 0;             // stamp of the last frame read (or tried)
+  uint64_t lastChunk_ = UINT64_MAX;  // offset of the chunk pending_ came from
+  std::vector<ChunkEntry> upcoming_;
+  bool fetching_ = false;
+
+  uint32_t rtpBase_ = 0;
+  int64_t mediaUs_ = 0;     // RTP clock: viewing time since the first frame, in us
+  int64_t lastSentUs_ = 0;  // stamp of the last frame sent
+
+  bool anchored_ = false;
+  int64_t anchorWallUs_ = 0;  // recorded stamp played at anchorMonoUs_
+  int64_t anchorMonoUs_ = 0;
+  bool waiting_ = false;
+  EventLoop::TimerId timer_ = 0;
+  bool done_ = false;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_REPLAY_REPLAY_STREAM_H
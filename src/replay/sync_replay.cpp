@@ -0,0 +1,255 @@
+#include "replay/sync_replay.h"
+
+#include <algorithm>
+
+#include "base/clock.h"
+#include "replay/replay_stream.h"
+
+namespace nvr {
+
+namespace {
+
+// How often a held-back replay looks at its viewer's queue again.
+constexpr int64_t kWaitPollUs = 20000;
+// Frames due within this much are sent in the same tick.
+constexpr int64_t kSlackUs = 2000;
+// RTP time across a skipped gap: one frame at 25 fps.
+constexpr int64_t kGapStepUs = 40000;
+
+}  // namespace
+
+SyncReplay::SyncReplay(EventLoop* loop, PacketPool* pool, IoBackend* io,
+                       const ArchiveIndex* archive, std::unique_ptr<RtspServerSession> session,
+                       const std::vector<std::string>& cameraIds,
+                       const std::vector<RtspSessionTrack>& tracks, int64_t startUs, double scale,
+                       const GopPrefetcherOptions& prefetch,
+                       std::function<void(SyncReplay*)> finished)
+    : loop_(loop),
+      pool_(pool),
+      io_(io),
+      archive_(archive),
+      session_(std::move(session)),
+      startUs_(startUs),
+      scale_(scale),
+      keyframesOnly_(scale >= ReplayStream::kMaxAllFramesScale),
+      prefetchOptions_(prefetch),
+      finished_(std::move(finished)) {
+  for (size_t i = 0; i < cameraIds.size() && i < tracks.size(); ++i) {
+    if (tracks[i].channel < 0 || tracks[i].codec == VideoCodec::Unknown) continue;
+    Track track;
+    track.index = static_cast<int>(i);
+    track.cameraId = cameraIds[i];
+    track.codec = tracks[i].codec;
+    tracks_.push_back(std::move(track));
+  }
+}
+
+SyncReplay::~SyncReplay() { stop(); }
+
+bool SyncReplay::start() {
+  uint32_t ssrc = static_cast<uint32_t>(std::hash<std::string>()(session_->sessionId()));
+  rtpBase_ = ssrc * 2246822519u;
+  for (size_t i = 0; i < tracks_.size(); ++i) {
+    Track& track = tracks_[i];
+    track.prefetch.reset(new GopPrefetcher(loop_, io_, archive_, track.cameraId,
+                                           prefetchOptions_, [this] { tick(); }));
+    if (!track.prefetch->start(startUs_, keyframesOnly_)) {
+      track.prefetch.reset();
+      continue;
+    }
+    track.packetizer.reset(new RtpPacketizer(pool_, track.codec, ReplayStream::kPayloadType,
+                                             ssrc + static_cast<uint32_t>(track.index)));
+    ++playing_;
+  }
+  if (playing_ == 0) return false;
+  tick();
+  return true;
+}
+
+void SyncReplay::stop() {
+  done_ = true;
+  if (timer_) loop_->cancel(timer_);
+  timer_ = 0;
+  for (Track& track : tracks_) track.prefetch.reset();
+  if (session_) session_->close();
+}
+
+SyncReplay::Stats SyncReplay::stats() const {
+  Stats total = stats_;
+  for (const Track& track : tracks_) {
+    if (!track.prefetch) continue;
+    const GopPrefetcher::Stats& p = track.prefetch->stats();
+    total.reads += p.reads;
+    total.bytesRead += p.bytesRead;
+    total.skipped += p.dropped;
+  }
+  return total;
+}
+
+void SyncReplay::fallBack(Track* track) {
+  track->fellBack = true;
+  track->aheadSinceUs = 0;
+  track->prefetch->setKeyframesOnly(true);
+  ++stats_.fallbacks;
+}
+
+bool SyncReplay::play(Track* track, int64_t now, int64_t* next) {
+  GopPrefetcher* prefetch = track->prefetch.get();
+  // Back to whole GOPs once the disk has kept ahead for a while. Looked
+  // at before playing, which takes the queue below that for a moment.
+  if (track->fellBack) {
+    if (!prefetch->ahead()) {
+      track->aheadSinceUs = 0;
+    } else if (track->aheadSinceUs == 0) {
+      track->aheadSinceUs = now;
+    } else if (now - track->aheadSinceUs >= kRecoverUs) {
+      track->fellBack = false;
+      prefetch->setKeyframesOnly(keyframesOnly_);
+      ++stats_.recoveries;
+    }
+  }
+  while (!prefetch->empty()) {
+    const GopPrefetcher::Frame* frame = &prefetch->front();
+    int64_t due = dueUs(frame->timestampUs);
+    if (due > now + kSlackUs) {
+      *next = std::min(*next, due);
+      break;
+    }
+    // Late off the disk, past the lead-up to the start: this camera only
+    // keeps up at keyframes for now.
+    if (!prefetch->keyframesOnly() && due < now - kMaxLateUs &&
+        frame->timestampUs >= originUs_) {
+      fallBack(track);
+      continue;
+    }
+    // Of the keyframes due, only the latest is worth showing, and not even
+    // that once it is too late to show in step with the other cameras.
+    if (prefetch->keyframesOnly() &&
+        ((prefetch->size() > 1 && dueUs(prefetch->at(1).timestampUs) <= now + kSlackUs) ||
+         (due < now - kMaxLateUs && frame->timestampUs >= originUs_))) {
+      prefetch->pop();
+      ++stats_.skipped;
+      continue;
+    }
+    send(track, *frame, due, now);
+    prefetch->pop();
+    if (session_->congested()) return false;
+  }
+  return true;
+}
+
+void SyncReplay::send(Track* track, const GopPrefetcher::Frame& frame, int64_t due, int64_t now) {
+  // Every frame keeps its recorded time on the shared timeline, late or
+  // not: a camera behind on the disk plays the latest keyframe due (see
+  // play()) rather than move its own clock.
+  if (due < now - kMaxLateUs && frame.timestampUs >= originUs_) ++stats_.late;
+  uint32_t timestamp = rtpBase_ + static_cast<uint32_t>(mediaUs(due) * 9 / 100);
+  track->packetizer->packetize(frame.data, frame.size, timestamp, &packets_);
+  for (const PacketRef& packet : packets_) session_->enqueue(track->index, false, packet);
+  packets_.clear();
+  ++stats_.frames;
+  stats_.bytes += frame.size;
+}
+
+void SyncReplay::schedule(int64_t delayUs) {
+  if (timer_) loop_->cancel(timer_);
+  // Rounded up to the loop's next millisecond; kSlackUs covers the rest.
+  int64_t dueMs = (monotonicUs() + std::max<int64_t>(1000, delayUs) + 999) / 1000;
+  timer_ = loop_->runAt(static_cast<uint64_t>(dueMs), [this] {
+    timer_ = 0;
+    tick();
+  });
+}
+
+void SyncReplay::tick() {
+  if (done_) return;
+  session_->flush();
+  if (session_->closed()) {
+    finish();
+    return;
+  }
+  int64_t now = monotonicUs();
+  if (session_->congested()) {
+    if (!waiting_) {
+      ++stats_.waits;
+      waiting_ = true;
+      pausedWallUs_ = positionUs(now);
+      pausedMediaUs_ = mediaUs(now);
+    }
+    schedule(kWaitPollUs);
+    return;
+  }
+
+  bool playing = false;
+  int64_t firstUs = INT64_MAX;
+  for (Track& track : tracks_) {
+    if (!track.prefetch || track.prefetch->ended()) continue;
+    playing = true;
+    // The clock starts with every camera's first GOP at hand; ready()
+    // ticks again for the others.
+    if (track.prefetch->empty()) {
+      if (!anchored_) return;
+      continue;
+    }
+    firstUs = std::min(firstUs, track.prefetch->front().timestampUs);
+  }
+  if (!playing) {
+    // Every recording ended: hang up once the viewer has it all.
+    if (session_->queuedBytes() == 0) {
+      session_->close();
+      finish();
+    } else {
+      schedule(kWaitPollUs);
+    }
+    return;
+  }
+  if (!anchored_) {
+    originUs_ = startUs_ > 0 ? startUs_ : firstUs;
+    anchorWallUs_ = originUs_;
+    anchorMonoUs_ = now;
+    anchorMediaUs_ = 0;
+    anchored_ = true;
+  } else if (waiting_) {
+    anchorWallUs_ = pausedWallUs_;
+    anchorMediaUs_ = pausedMediaUs_;
+    anchorMonoUs_ = now;
+  }
+  waiting_ = false;
+
+  // A gap in every recording at once: the clock moves on to the next
+  // frame, which the RTP time passes as one frame interval.
+  if (firstUs != INT64_MAX && dueUs(firstUs) > now + ReplayStream::kMaxGapUs) {
+    bool starving = false;
+    for (const Track& track : tracks_)
+      starving = starving || (track.prefetch && !track.prefetch->ended() &&
+                              track.prefetch->empty());
+    if (!starving) {
+      anchorMediaUs_ = mediaUs(now) + kGapStepUs;
+      anchorWallUs_ = firstUs;
+      anchorMonoUs_ = now;
+    }
+  }
+
+  int64_t position = positionUs(now);
+  int64_t next = INT64_MAX;
+  for (Track& track : tracks_) {
+    if (!track.prefetch) continue;
+    track.prefetch->setTarget(position);
+    if (!play(&track, now, &next)) {
+      session_->flush();
+      schedule(kWaitPollUs);
+      return;
+    }
+  }
+  session_->flush();
+  // With nothing queued, the next frame's ready() ticks.
+  if (next != INT64_MAX) schedule(next - now);
+}
+
+void SyncReplay::finish() {
+  if (done_) return;
+  done_ = true;
+  if (finished_) finished_(this);
+}
+
+}  // namespace nvr
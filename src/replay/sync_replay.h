@@ -0,0 +1,152 @@
+// Plays several cameras' recordings to one RTSP viewer, in step, from one
+// shared playback clock.
+//
+// Every camera is a track of the viewer's session, read ahead by a
+// GopPrefetcher of its own, so the disk serves all of them at once. A
+// frame goes out when the shared clock reaches its recorded stamp, so
+// recordings timed by their cameras' sender reports (camera_recorder.h)
+// play to the frame together. The tracks share one RTP timeline and base:
+// equal timestamps are the same recorded instant on every track. The clock
+// starts once every camera has its first GOP (or turned out to have none),
+// at the requested time; the GOP leading up to it goes out at once. It
+// runs forward at the viewer's scale; from
+// ReplayStream::kMaxAllFramesScale up only keyframes are played.
+//
+// A camera whose frames come off the disk more than kMaxLateUs after their
+// time drops to keyframes only: its queued delta frames are dropped, and
+// it plays the keyframe closest to the clock as each one is read, on its
+// recorded time like every other frame, while the other cameras play on.
+// A keyframe read more than kMaxLateUs after its time is dropped too, as
+// it could no longer be shown in step; no frame is restamped. It goes back to whole
+// GOPs once its prefetcher has kept ahead for kRecoverUs. A slow disk so
+// costs the lagging cameras their motion, not the group its pace.
+//
+// As with a single camera, a slow viewer holds the replay back: the clock
+// stops while the session's queue is above its soft limit and resumes
+// where it stopped, for every camera at once. A gap longer than
+// ReplayStream::kMaxGapUs in all recordings at once is skipped. One loop
+// timer paces the whole group; loop-thread only.
+
+#ifndef NVR_REPLAY_SYNC_REPLAY_H
+#define NVR_REPLAY_SYNC_REPLAY_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "base/packet_buffer.h"
+#include "media/rtp_packetizer.h"
+#include "replay/gop_prefetcher.h"
+#include "rtsp/rtsp_server_session.h"
+#include "storage/archive_index.h"
+#include "storage/io_backend.h"
+
+namespace nvr {
+
+class SyncReplay {
+ public:
+  static constexpr size_t kMaxCameras = 64;
+  static constexpr int64_t kMaxLateUs = 200000;
+  static constexpr int64_t kRecoverUs = 10000000;
+
+  struct Stats {
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t waits = 0;       // times the viewer's queue held the replay back
+    uint64_t late = 0;        // frames sent more than kMaxLateUs after their time
+    uint64_t fallbacks = 0;   // a camera dropped to keyframes only
+    uint64_t recoveries = 0;  // and went back to whole GOPs
+    uint64_t skipped = 0;     // delta frames dropped then, and keyframes overtaken
+    uint64_t reads = 0;       // chunk reads of the prefetchers
+    uint64_t bytesRead = 0;
+  };
+
+  // cameraIds are the session's tracks, in order; tracks the viewer did
+  // not set up are not read. pool and io must outlive the replay and the
+  // viewer's queued packets; archive must outlive the replay. finished is
+  // called once, from the loop, when the viewer left or every recording
+  // ended; the replay may be deleted then (later, not inside the call).
+  // scale is above 0.
+  SyncReplay(EventLoop* loop, PacketPool* pool, IoBackend* io, const ArchiveIndex* archive,
+             std::unique_ptr<RtspServerSession> session, const std::vector<std::string>& cameraIds,
+             const std::vector<RtspSessionTrack>& tracks, int64_t startUs, double scale,
+             const GopPrefetcherOptions& prefetch, std::function<void(SyncReplay*)> finished);
+  ~SyncReplay();
+
+  SyncReplay(const SyncReplay&) = delete;
+  SyncReplay& operator=(const SyncReplay&) = delete;
+
+  // False when none of the cameras has anything recorded to play.
+  bool start();
+  // Closes the viewer's connection and stops, without calling finished.
+  void stop();
+
+  // Cameras playing, of those set up.
+  size_t cameras() const { return playing_; }
+  Stats stats() const;
+
+ private:
+  struct Track {
+    int index = 0;  // in the session
+    std::string cameraId;
+    VideoCodec codec = VideoCodec::Unknown;
+    std::unique_ptr<GopPrefetcher> prefetch;  // null if it does not play
+    std::unique_ptr<RtpPacketizer> packetizer;
+    bool fellBack = false;    // to keyframes only, for the disk
+    int64_t aheadSinceUs = 0;  // since when its prefetcher was full, falling back
+  };
+
+  int64_t dueUs(int64_t stamp) const {
+    return anchorMonoUs_ + static_cast<int64_t>((stamp - anchorWallUs_) / scale_);
+  }
+  int64_t positionUs(int64_t now) const {
+    return anchorWallUs_ + static_cast<int64_t>((now - anchorMonoUs_) * scale_);
+  }
+  int64_t mediaUs(int64_t mono) const { return anchorMediaUs_ + (mono - anchorMonoUs_); }
+
+  // Sends what is due of one track; false if the viewer's queue filled up.
+  bool play(Track* track, int64_t now, int64_t* next);
+  void send(Track* track, const GopPrefetcher::Frame& frame, int64_t due, int64_t now);
+  void fallBack(Track* track);
+  void schedule(int64_t delayUs);
+  void tick();
+  void finish();
+
+  EventLoop* loop_;
+  PacketPool* pool_;
+  IoBackend* io_;
+  const ArchiveIndex* archive_;
+  std::unique_ptr<RtspServerSession> session_;
+  int64_t startUs_;
+  double scale_;
+  bool keyframesOnly_;  // for the scale
+  GopPrefetcherOptions prefetchOptions_;
+  std::function<void(SyncReplay*)> finished_;
+
+  std::vector<Track> tracks_;
+  size_t playing_ = 0;
+  std::vector<PacketRef> packets_;
+  uint32_t rtpBase_ = 0;
+
+  // The shared clock: recorded time anchorWallUs_ plays at monotonic
+  // anchorMonoUs_, which is anchorMediaUs_ into the RTP timeline.
+  bool anchored_ = false;
+  int64_t originUs_ = 0;  // where it started; earlier frames lead up to it
+  int64_t anchorWallUs_ = 0;
+  int64_t anchorMonoUs_ = 0;
+  int64_t anchorMediaUs_ = 0;
+  bool waiting_ = false;
+  int64_t pausedWallUs_ = 0;  // where the clock stopped, while waiting_
+  int64_t pausedMediaUs_ = 0;
+  EventLoop::TimerId timer_ = 0;
+  bool done_ = false;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_REPLAY_SYNC_REPLAY_H
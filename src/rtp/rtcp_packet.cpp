@@ -0,0 +1,91 @@
+#include "rtp/rtcp_packet.h"
+
+namespace nvr {
+
+namespace {
+
+constexpr uint8_t kRtcpSenderReport = 200;
+constexpr uint8_t kRtcpReceiverReport = 201;
+constexpr uint8_t kRtcpSdes = 202;
+constexpr uint8_t kSdesCname = 1;
+// Seconds from the NTP epoch (1900) to the Unix epoch.
+constexpr int64_t kNtpUnixOffset = 2208988800LL;
+
+uint32_t getU32(const uint8_t* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+void putU32(std::string* out, uint32_t v) {
+  out->push_back(static_cast<char>(v >> 24));
+  out->push_back(static_cast<char>(v >> 16));
+  out->push_back(static_cast<char>(v >> 8));
+  out->push_back(static_cast<char>(v));
+}
+
+// Common header: version 2, count, type and length in words minus one.
+void putHeader(std::string* out, uint8_t count, uint8_t type, size_t bytes) {
+  out->push_back(static_cast<char>(0x80 | count));
+  out->push_back(static_cast<char>(type));
+  size_t words = bytes / 4 - 1;
+  out->push_back(static_cast<char>(words >> 8));
+  out->push_back(static_cast<char>(words));
+}
+
+}  // namespace
+
+bool findRtcpSenderReport(const uint8_t* data, size_t size, RtcpSenderReport* out) {
+  size_t offset = 0;
+  while (size - offset >= 4) {
+    const uint8_t* p = data + offset;
+    if ((p[0] >> 6) != 2) return false;
+    size_t length = (((p[2] << 8) | p[3]) + 1) * 4;
+    if (length > size - offset) return false;
+    if (p[1] == kRtcpSenderReport && length >= 28) {
+      out->ssrc = getU32(p + 4);
+      out->ntp = (static_cast<uint64_t>(getU32(p + 8)) << 32) | getU32(p + 12);
+      out->rtpTimestamp = getU32(p + 16);
+      out->packets = getU32(p + 20);
+      out->octets = getU32(p + 24);
+      return true;
+    }
+    offset += length;
+  }
+  return false;
+}
+
+std::string buildRtcpReceiverReport(uint32_t ssrc, const RtcpReportBlock& block,
+                                    const std::string& cname) {
+  std::string out;
+  out.reserve(32 + 12 + cname.size() + 4);
+  putHeader(&out, 1, kRtcpReceiverReport, 32);
+  putU32(&out, ssrc);
+  putU32(&out, block.ssrc);
+  int32_t lost = block.cumulativeLost;
+  if (lost > 0x7fffff) lost = 0x7fffff;
+  if (lost < -0x800000) lost = -0x800000;
+  putU32(&out, (static_cast<uint32_t>(block.fractionLost) << 24) |
+                   (static_cast<uint32_t>(lost) & 0xffffff));
+  putU32(&out, block.highestSequence);
+  putU32(&out, block.jitter);
+  putU32(&out, block.lastSr);
+  putU32(&out, block.delaySinceLastSr);
+
+  // The item list ends with at least one zero octet, padding to a word.
+  size_t nameSize = cname.size() < 255 ? cname.size() : 255;
+  size_t chunk = (4 + 2 + nameSize + 1 + 3) / 4 * 4;
+  putHeader(&out, 1, kRtcpSdes, 4 + chunk);
+  putU32(&out, ssrc);
+  out.push_back(static_cast<char>(kSdesCname));
+  out.push_back(static_cast<char>(nameSize));
+  out.append(cname, 0, nameSize);
+  out.resize(out.size() + chunk - 6 - nameSize, '\0');
+  return out;
+}
+
+int64_t ntpToUnixUs(uint64_t ntp) {
+  int64_t seconds = static_cast<int64_t>(ntp >> 32) - kNtpUnixOffset;
+  int64_t fraction = static_cast<int64_t>(((ntp & 0xffffffffu) * 1000000) >> 32);
+  return seconds * 1000000 + fraction;
+}
+
+}  // namespace nvr
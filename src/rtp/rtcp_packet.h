@@ -0,0 +1,55 @@
+// RTCP (RFC 3550 section 6): the sender report a camera sends for each
+// stream, and the receiver report sent back.
+//
+// A sender report pairs an RTP timestamp with the sender's NTP wall clock
+// at the same instant, which is what maps a stream's media clock onto wall
+// time. Only what the ingest path needs is handled: finding the SR in a
+// compound packet, and building a compound RR + SDES CNAME with one report
+// block.
+
+#ifndef NVR_RTP_RTCP_PACKET_H
+#define NVR_RTP_RTCP_PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace nvr {
+
+struct RtcpSenderReport {
+  uint32_t ssrc = 0;
+  uint64_t ntp = 0;  // 32.32 fixed point seconds since 1900
+  uint32_t rtpTimestamp = 0;
+  uint32_t packets = 0;
+  uint32_t octets = 0;
+};
+
+// One reception report block (RFC 3550 6.4.1).
+struct RtcpReportBlock {
+  uint32_t ssrc = 0;              // of the source reported on
+  uint8_t fractionLost = 0;       // since the previous report, out of 256
+  int32_t cumulativeLost = 0;     // 24 bits on the wire, clamped
+  uint32_t highestSequence = 0;   // extended: cycles << 16 | sequence
+  uint32_t jitter = 0;            // RTP clock units
+  uint32_t lastSr = 0;            // middle 32 bits of the last SR's NTP time, 0 for none
+  uint32_t delaySinceLastSr = 0;  // since it arrived, 1/65536 s
+};
+
+// Finds the sender report in a (possibly compound) RTCP packet. False if
+// there is none or the packet is malformed.
+bool findRtcpSenderReport(const uint8_t* data, size_t size, RtcpSenderReport* out);
+
+// A compound receiver report from ssrc with one block, followed by the
+// SDES CNAME item every compound packet must carry.
+std::string buildRtcpReceiverReport(uint32_t ssrc, const RtcpReportBlock& block,
+                                    const std::string& cname);
+
+// NTP time to UTC microseconds since the epoch, and the middle 32 bits used
+// as the LSR field of report blocks.
+int64_t ntpToUnixUs(uint64_t ntp);
+inline uint32_t ntpMiddle(uint64_t ntp) { return static_cast<uint32_t>(ntp >> 16); }
+
+}  // namespace nvr
+
+#endif  // NVR_RTP_RTCP_PACKET_H
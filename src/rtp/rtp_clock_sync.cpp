@@ -0,0 +1,104 @@
+#include "rtp/rtp_clock_sync.h"
+
+#include <math.h>
+
+namespace nvr {
+
+namespace {
+
+// A report this far off the line is a step of the sender's clock rather
+// than jitter: half a frame at 25 fps.
+constexpr int64_t kMaxStepUs = 20000;
+// The rate is only estimated over at least this much media time; before
+// that the nominal rate is closer than a slope through a few jittered
+// points.
+constexpr int64_t kMinSpanSeconds = 60;
+// Crystals are within 100 ppm; a steeper line has an undetected step in it.
+constexpr double kMaxDrift = 500e-6;
+
+}  // namespace
+
+RtpClockSync::RtpClockSync(uint32_t clockRate)
+    : clockRate_(clockRate),
+      nominalUsPerTick_(clockRate > 0 ? 1e6 / clockRate : 0),
+      usPerTick_(nominalUsPerTick_) {}
+
+void RtpClockSync::reset() {
+  count_ = 0;
+  next_ = 0;
+  usPerTick_ = nominalUsPerTick_;
+  driftPpb_ = 0;
+  residualUs_ = 0;
+}
+
+void RtpClockSync::addReport(uint32_t rtpTimestamp, int64_t senderUs) {
+  if (clockRate_ == 0) return;
+  ++stats_.reports;
+  int64_t rtp = rtpTimestamp;
+  if (count_ > 0) {
+    rtp = lastRtp_ + static_cast<int32_t>(rtpTimestamp - lastRaw_);
+    // A repeated report adds nothing; one that goes back in RTP time, or
+    // lands off the line, is a new timeline.
+    if (rtp == lastRtp_ && senderUs == points_[(next_ + kWindow - 1) % kWindow].senderUs) return;
+    int64_t error = senderUs - this->senderUs(rtpTimestamp);
+    if (rtp <= lastRtp_ || error > kMaxStepUs || error < -kMaxStepUs) {
+      ++stats_.steps;
+      reset();
+      rtp = rtpTimestamp;
+    }
+  }
+  points_[next_] = Point{rtp, senderUs};
+  next_ = (next_ + 1) % kWindow;
+  if (count_ < kWindow) ++count_;
+  lastRaw_ = rtpTimestamp;
+  lastRtp_ = rtp;
+  fit();
+}
+
+int64_t RtpClockSync::senderUs(uint32_t rtpTimestamp) const {
+  int64_t ticks = static_cast<int32_t>(rtpTimestamp - lastRaw_);
+  return anchorUs_ + static_cast<int64_t>(llround(ticks * usPerTick_));
+}
+
+void RtpClockSync::fit() {
+  // Relative to the newest report, which keeps the sums small enough for
+  // doubles to hold them exactly.
+  const Point& newest = points_[(next_ + kWindow - 1) % kWindow];
+  double meanX = 0, meanY = 0;
+  int64_t oldest = 0;
+  for (size_t i = 0; i < count_; ++i) {
+    int64_t x = points_[i].rtp - newest.rtp;
+    if (x < oldest) oldest = x;
+    meanX += x;
+    meanY += points_[i].senderUs - newest.senderUs;
+  }
+  meanX /= count_;
+  meanY /= count_;
+
+  double slope = nominalUsPerTick_;
+  if (-oldest >= kMinSpanSeconds * static_cast<int64_t>(clockRate_)) {
+    double sxx = 0, sxy = 0;
+    for (size_t i = 0; i < count_; ++i) {
+      double dx = (points_[i].rtp - newest.rtp) - meanX;
+      double dy = (points_[i].senderUs - newest.senderUs) - meanY;
+      sxx += dx * dx;
+      sxy += dx * dy;
+    }
+    double fitted = sxy / sxx;
+    if (fabs(fitted / nominalUsPerTick_ - 1) <= kMaxDrift) slope = fitted;
+  }
+  double intercept = meanY - slope * meanX;
+
+  double squares = 0;
+  for (size_t i = 0; i < count_; ++i) {
+    double x = static_cast<double>(points_[i].rtp - newest.rtp);
+    double error = (points_[i].senderUs - newest.senderUs) - (intercept + slope * x);
+    squares += error * error;
+  }
+  usPerTick_ = slope;
+  anchorUs_ = newest.senderUs + llround(intercept);
+  driftPpb_ = static_cast<int32_t>(lround((nominalUsPerTick_ / slope - 1) * 1e9));
+  residualUs_ = static_cast<uint32_t>(lround(sqrt(squares / count_)));
+}
+
+}  // namespace nvr
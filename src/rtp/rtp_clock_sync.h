@@ -0,0 +1,84 @@
+// Maps one RTP stream's timestamps onto its sender's wall clock, from the
+// (RTP timestamp, NTP time) pairs of its RTCP sender reports.
+//
+// A single report gives an anchor, but a camera's RTP clock comes from its
+// own crystal, tens of ppm off nominal, while its NTP time is disciplined:
+// extrapolating at the nominal rate drifts by milliseconds a minute, and
+// each report steps the timeline. Instead a least-squares line is fitted
+// through the last reports, so the rate follows the crystal and the jitter
+// of individual reports (coarse NTP sampling in the camera) averages out.
+// A report far off the line (the camera's NTP clock stepped, or a new
+// source) starts the fit over.
+//
+// The mapping gives the capture time on the camera's clock; cameras that
+// take time from the same NTP server line up with each other without
+// looking at the media. Not thread-safe; one per stream.
+
+#ifndef NVR_RTP_RTP_CLOCK_SYNC_H
+#define NVR_RTP_RTP_CLOCK_SYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace nvr {
+
+class RtpClockSync {
+ public:
+  struct Stats {
+    uint64_t reports = 0;
+    uint64_t steps = 0;  // reports that started the fit over
+  };
+
+  explicit RtpClockSync(uint32_t clockRate);
+
+  // senderUs is the report's NTP time in UTC microseconds.
+  void addReport(uint32_t rtpTimestamp, int64_t senderUs);
+  // A new source: forgets the reports, keeps the stats.
+  void reset();
+
+  bool synced() const { return count_ > 0; }
+  // The sender's wall clock at rtpTimestamp, which should be within a few
+  // hours of the latest report. Only when synced().
+  int64_t senderUs(uint32_t rtpTimestamp) const;
+
+  // The fitted line: the newest report's timestamp and its time on the
+  // line, the RTP clock's rate against nominal, and the RMS distance of the
+  // reports from the line.
+  uint32_t anchorRtp() const { return lastRaw_; }
+  int64_t anchorSenderUs() const { return anchorUs_; }
+  int32_t driftPpb() const { return driftPpb_; }
+  uint32_t residualUs() const { return residualUs_; }
+  size_t reports() const { return count_; }
+  const Stats& stats() const { return stats_; }
+
+ private:
+  // Some five minutes at the usual 5 s interval: the rate of a line
+  // through reports jittered by milliseconds is only good to a ppm or so
+  // over minutes.
+  static constexpr size_t kWindow = 64;
+
+  struct Point {
+    int64_t rtp;  // extended
+    int64_t senderUs;
+  };
+
+  void fit();
+
+  const uint32_t clockRate_;
+  const double nominalUsPerTick_;
+  Point points_[kWindow];
+  size_t count_ = 0;
+  size_t next_ = 0;  // slot of the next report
+  uint32_t lastRaw_ = 0;
+  int64_t lastRtp_ = 0;  // extended timestamp of the newest report
+
+  int64_t anchorUs_ = 0;
+  double usPerTick_;
+  int32_t driftPpb_ = 0;
+  uint32_t residualUs_ = 0;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_RTP_RTP_CLOCK_SYNC_H
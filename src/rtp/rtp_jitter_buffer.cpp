@@ -0,0 +1,210 @@
+#include "rtp/rtp_jitter_buffer.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace nvr {
+
+namespace {
+
+// The delay covers this many times the interarrival jitter...
+constexpr int64_t kJitterMultiple = 4;
+// ...and half again the longest recent gap fill time, which loses a 64th
+// of itself per second: a half-life of some 45 s, long enough to remember
+// spikes that come every few seconds.
+constexpr int64_t kDecayIntervalUs = 1000000;
+constexpr int64_t kDecayShare = 64;
+
+// A power of two from 16 up, and below kMaxDropout so that a packet the
+// ring cannot place is never mistaken for a restarted source.
+size_t ringSize(size_t capacity) {
+  size_t size = 16;
+  while (size < capacity && size < 2048) size *= 2;
+  return size;
+}
+
+}  // namespace
+
+RtpJitterBuffer::RtpJitterBuffer(int track, RtpJitterBufferHandler* handler,
+                                 const RtpJitterBufferOptions& options)
+    : track_(track),
+      handler_(handler),
+      options_(options),
+      capacity_(ringSize(options.capacity)),
+      delayUs_(std::min(options.minDelayMs, options.maxDelayMs) * 1000LL) {}
+
+void RtpJitterBuffer::push(const PacketRef& packet, const RtpHeader& header, int64_t nowUs,
+                           uint32_t jitterUs) {
+  ++stats_.packets;
+  adapt(nowUs, jitterUs);
+  uint16_t sequence = header.sequence;
+  if (!started_) {
+    started_ = true;
+    next_ = sequence;
+  }
+  int delta = sequenceDelta(sequence, next_);
+  if (delta >= kMaxDropout || delta <= -kMaxDropout) {
+    if (!haveStray_ || sequence != strayNext_) {
+      haveStray_ = true;
+      strayNext_ = static_cast<uint16_t>(sequence + 1);
+      ++stats_.late;
+      return;
+    }
+    // The source restarted its sequence; what is held goes out first.
+    flush();
+    next_ = sequence;
+    delta = 0;
+  }
+  haveStray_ = false;
+  if (delta < 0) {
+    behind(sequence, nowUs);
+    return;
+  }
+  if (held_ == 0 && (delta == 0 || delayUs_ == 0)) {
+    // Nothing held back: in order, or a gap that is not waited on.
+    pendingLost_ += static_cast<uint32_t>(delta);
+    stats_.lost += static_cast<uint32_t>(delta);
+    next_ = static_cast<uint16_t>(sequence + 1);
+    deliver(packet);
+    return;
+  }
+  if (static_cast<size_t>(delta) >= capacity_) {
+    ++stats_.overflows;
+    skipTo(static_cast<uint16_t>(sequence - capacity_ + 1));
+    delta = sequenceDelta(sequence, next_);
+  }
+
+  if (slots_.empty()) slots_.resize(capacity_);
+  Slot& s = slot(sequence);
+  if (s.packet) {
+    ++stats_.duplicates;
+    return;
+  }
+  s.packet = packet;
+  s.sinceUs = nowUs;
+  s.sequence = sequence;
+  s.skipped = false;
+  if (held_++ == 0 && delta > 0) holeSinceUs_ = nowUs;
+  if (delta == 0) {
+    // It fills the gap that held the others back.
+    if (held_ > 1) {
+      ++stats_.reordered;
+      fillPeakUs_ = std::max(fillPeakUs_, nowUs - holeSinceUs_);
+    }
+    releaseReady();
+    findGap();
+  }
+  poll(nowUs);
+}
+
+void RtpJitterBuffer::poll(int64_t nowUs) {
+  while (held_ > 0 && nowUs >= holeSinceUs_ + delayUs_) skipGap();
+}
+
+void RtpJitterBuffer::flush() {
+  while (held_ > 0) skipGap();
+}
+
+void RtpJitterBuffer::reset() {
+  for (Slot& s : slots_) {
+    s.packet.reset();
+    s.skipped = false;
+  }
+  started_ = false;
+  held_ = 0;
+  pendingLost_ = 0;
+  haveStray_ = false;
+}
+
+void RtpJitterBuffer::adapt(int64_t nowUs, uint32_t jitterUs) {
+  if (nowUs - decayedUs_ >= kDecayIntervalUs) {
+    fillPeakUs_ -= fillPeakUs_ / kDecayShare;
+    decayedUs_ = nowUs;
+  }
+  int64_t target = std::max(fillPeakUs_ + fillPeakUs_ / 2, jitterUs * kJitterMultiple);
+  int64_t minUs = options_.minDelayMs * 1000LL;
+  int64_t maxUs = options_.maxDelayMs * 1000LL;
+  delayUs_ = std::min(std::max(target, minUs), maxUs);
+}
+
+void RtpJitterBuffer::behind(uint16_t sequence, int64_t nowUs) {
+  if (!slots_.empty() && static_cast<size_t>(sequenceDelta(next_, sequence)) <= capacity_) {
+    Slot& s = slot(sequence);
+    if (s.skipped && s.sequence == sequence) {
+      // Given up on too early: it took this long, so wait longer next time.
+      s.skipped = false;
+      ++stats_.late;
+      fillPeakUs_ = std::max(fillPeakUs_, nowUs - s.sinceUs);
+      return;
+    }
+  }
+  ++stats_.duplicates;
+}
+
+void RtpJitterBuffer::releaseReady() {
+  while (held_ > 0) {
+    Slot& s = slot(next_);
+    if (!s.packet) break;
+    PacketRef packet = std::move(s.packet);
+    --held_;
+    ++next_;
+    deliver(packet);
+  }
+}
+
+void RtpJitterBuffer::skipGap() {
+  uint16_t from = next_;
+  while (!slot(next_).packet) markSkipped(next_++);
+  uint32_t lost = static_cast<uint16_t>(next_ - from);
+  pendingLost_ += lost;
+  stats_.lost += lost;
+  releaseReady();
+  findGap();
+}
+
+void RtpJitterBuffer::skipTo(uint16_t sequence) {
+  while (held_ > 0 && sequenceBefore(next_, sequence)) {
+    if (slot(next_).packet) {
+      releaseReady();
+      continue;
+    }
+    markSkipped(next_++);
+    ++pendingLost_;
+    ++stats_.lost;
+  }
+  if (sequenceBefore(next_, sequence)) {
+    uint32_t lost = static_cast<uint16_t>(sequence - next_);
+    pendingLost_ += lost;
+    stats_.lost += lost;
+    next_ = sequence;
+  }
+  releaseReady();
+  findGap();
+}
+
+void RtpJitterBuffer::markSkipped(uint16_t sequence) {
+  Slot& s = slot(sequence);
+  s.sequence = sequence;
+  s.skipped = true;
+  s.sinceUs = holeSinceUs_;
+}
+
+void RtpJitterBuffer::findGap() {
+  if (held_ == 0) return;
+  // The first packet held after the gap has usually waited longest.
+  for (uint16_t sequence = next_;; ++sequence) {
+    const Slot& s = slot(sequence);
+    if (s.packet) {
+      holeSinceUs_ = s.sinceUs;
+      return;
+    }
+  }
+}
+
+void RtpJitterBuffer::deliver(const PacketRef& packet) {
+  uint32_t lost = pendingLost_;
+  pendingLost_ = 0;
+  handler_->onOrderedRtp(track_, packet, lost);
+}
+
+}  // namespace nvr
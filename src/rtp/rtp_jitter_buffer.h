@@ -0,0 +1,136 @@
+// Reorder buffer for one RTP stream received over a lossy network.
+//
+// Packets come out in sequence order. One that arrives after a gap is held
+// in a ring indexed by sequence number (a power of two of slots, allocated
+// once, the first time a packet is held) until the gap fills or has been
+// waited on for the buffer's delay; then the missing packets are given up
+// on and reported as lost with the next packet out. A packet in order with
+// nothing held goes straight through without touching the ring.
+//
+// The delay adapts. It covers a multiple of the interarrival jitter (RFC
+// 3550, measured by the caller) and half again the longest a gap recently
+// took to fill. A packet that arrives after its gap was given up on is
+// dropped, and raises the delay by how late it was, so that a few late
+// packets teach the buffer the network's reordering depth. The longest
+// fill time decays over tens of seconds, letting the delay come back down.
+// In-order streams pay nothing for the delay: it only applies while a gap
+// is open.
+//
+// Loop-thread only, like the session it belongs to. Nothing runs on its
+// own: the owner calls poll() when deadlineUs() passes.
+
+#ifndef NVR_RTP_RTP_JITTER_BUFFER_H
+#define NVR_RTP_RTP_JITTER_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "base/packet_buffer.h"
+#include "rtp/rtp_packet.h"
+
+namespace nvr {
+
+struct RtpJitterBufferOptions {
+  // Bounds of the adaptive delay. A maximum of 0 turns reordering off: a
+  // gap is loss at once, as on RTP over TCP.
+  uint32_t minDelayMs = 10;
+  uint32_t maxDelayMs = 200;
+  // Ring slots, rounded up to a power of two (16 to 2048): the most
+  // packets a gap can hold back before the oldest gap is given up on early.
+  size_t capacity = 512;
+};
+
+class RtpJitterBufferHandler {
+ public:
+  virtual ~RtpJitterBufferHandler() = default;
+  // Packets in sequence order. lost is how many were given up on right
+  // before this one.
+  virtual void onOrderedRtp(int track, const PacketRef& packet, uint32_t lost) = 0;
+};
+
+class RtpJitterBuffer {
+ public:
+  struct Stats {
+    uint64_t packets = 0;
+    uint64_t reordered = 0;   // filled a gap while later packets were held
+    uint64_t lost = 0;        // given up on
+    uint64_t late = 0;        // after being given up on, or far out of sequence; dropped
+    uint64_t duplicates = 0;  // dropped
+    uint64_t overflows = 0;   // gaps given up on early for want of ring slots
+  };
+
+  RtpJitterBuffer(int track, RtpJitterBufferHandler* handler,
+                  const RtpJitterBufferOptions& options = RtpJitterBufferOptions());
+
+  // nowUs is monotonic; jitterUs is the stream's current interarrival
+  // jitter. May call the handler any number of times.
+  void push(const PacketRef& packet, const RtpHeader& header, int64_t nowUs, uint32_t jitterUs);
+  // Gives up on gaps that have been waited on long enough by nowUs.
+  void poll(int64_t nowUs);
+  // When poll() has work next, monotonic microseconds; 0 when nothing is
+  // held.
+  int64_t deadlineUs() const { return held_ == 0 ? 0 : holeSinceUs_ + delayUs_; }
+
+  // Releases everything held, giving up on the gaps between.
+  void flush();
+  // Drops everything held and starts over with the next packet (a new
+  // session). The learnt delay is kept.
+  void reset();
+
+  int track() const { return track_; }
+  size_t held() const { return held_; }
+  uint32_t delayUs() const { return static_cast<uint32_t>(delayUs_); }
+  const Stats& stats() const { return stats_; }
+
+ private:
+  // A packet held, or the mark of a sequence number given up on (for
+  // telling late packets from duplicates).
+  struct Slot {
+    PacketRef packet;
+    int64_t sinceUs = 0;  // held: arrival; given up on: when its gap opened
+    uint16_t sequence = 0;
+    bool skipped = false;
+  };
+
+  // Beyond this many sequence numbers either way a packet is taken for a
+  // restarted source, once the packet after it confirms (RFC 3550 A.1).
+  static constexpr int kMaxDropout = 3000;
+
+  Slot& slot(uint16_t sequence) { return slots_[sequence & (capacity_ - 1)]; }
+  void adapt(int64_t nowUs, uint32_t jitterUs);
+  void behind(uint16_t sequence, int64_t nowUs);
+  // Releases the packets from next_ on, up to the next gap.
+  void releaseReady();
+  // Gives up on the gap at next_.
+  void skipGap();
+  // Gives up on everything before sequence.
+  void skipTo(uint16_t sequence);
+  void markSkipped(uint16_t sequence);
+  void findGap();
+  void deliver(const PacketRef& packet);
+
+  const int track_;
+  RtpJitterBufferHandler* handler_;
+  const RtpJitterBufferOptions options_;
+  const size_t capacity_;
+  std::vector<Slot> slots_;  // empty until a packet is first held
+
+  bool started_ = false;
+  uint16_t next_ = 0;  // the sequence number to release next
+  size_t held_ = 0;
+  int64_t holeSinceUs_ = 0;  // arrival of the first packet held behind the gap at next_
+  uint32_t pendingLost_ = 0;
+  bool haveStray_ = false;
+  uint16_t strayNext_ = 0;
+
+  int64_t delayUs_;
+  int64_t fillPeakUs_ = 0;  // longest recent wait for a gap to fill
+  int64_t decayedUs_ = 0;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_RTP_RTP_JITTER_BUFFER_H
@@ -0,0 +1,26 @@
+#include "rtp/rtp_packet.h"
+
+namespace nvr {
+
+bool parseRtpHeader(const uint8_t* data, size_t size, RtpHeader* out) {
+  if (size < 12 || (data[0] >> 6) != 2) return false;
+  size_t offset = 12 + 4 * (data[0] & 0x0f);
+  if (data[0] & 0x10) {
+    if (size < offset + 4) return false;
+    offset += 4 + 4 * ((data[offset + 2] << 8) | data[offset + 3]);
+  }
+  size_t padding = 0;
+  if (data[0] & 0x20) padding = data[size - 1];
+  if (size < offset + padding) return false;
+
+  out->marker = (data[1] & 0x80) != 0;
+  out->payloadType = data[1] & 0x7f;
+  out->sequence = static_cast<uint16_t>((data[2] << 8) | data[3]);
+  out->timestamp = (static_cast<uint32_t>(data[4]) << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+  out->ssrc = (static_cast<uint32_t>(data[8]) << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+  out->payloadOffset = static_cast<uint32_t>(offset);
+  out->payloadSize = static_cast<uint32_t>(size - offset - padding);
+  return true;
+}
+
+}  // namespace nvr
@@ -0,0 +1,31 @@
+// RTP fixed header parsing (RFC 3550 section 5.1).
+
+#ifndef NVR_RTP_RTP_PACKET_H
+#define NVR_RTP_RTP_PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace nvr {
+
+struct RtpHeader {
+  uint8_t payloadType = 0;
+  bool marker = false;
+  uint16_t sequence = 0;
+  uint32_t timestamp = 0;
+  uint32_t ssrc = 0;
+  // Payload window after CSRCs and the header extension, without padding.
+  uint32_t payloadOffset = 0;
+  uint32_t payloadSize = 0;
+};
+
+// Returns false for anything that is not a well-formed version 2 packet.
+bool parseRtpHeader(const uint8_t* data, size_t size, RtpHeader* out);
+
+// Sequence number arithmetic modulo 2^16.
+inline int16_t sequenceDelta(uint16_t a, uint16_t b) { return static_cast<int16_t>(a - b); }
+inline bool sequenceBefore(uint16_t a, uint16_t b) { return sequenceDelta(a, b) < 0; }
+
+}  // namespace nvr
+
+#endif  // NVR_RTP_RTP_PACKET_H
@@ -0,0 +1,116 @@
+#include "rtp/rtp_receive_stats.h"
+
+namespace nvr {
+
+void RtpReceiveStats::startSource(uint16_t sequence) {
+  started_ = true;
+  baseSequence_ = sequence;
+  maxSequence_ = sequence;
+  cycles_ = 0;
+  badSequence_ = UINT32_MAX;
+}
+
+void RtpReceiveStats::restart() {
+  priorExpected_ = expected();
+  priorReceived_ += received_;
+  received_ = 0;
+  started_ = false;
+  haveTransit_ = false;
+  jitter_ = 0;
+  reportExpected_ = 0;
+  reportReceived_ = 0;
+  lastSr_ = 0;
+}
+
+void RtpReceiveStats::onSenderReport(const RtcpSenderReport& report, int64_t arrivalUs) {
+  if (started_ && report.ssrc != ssrc_) return;
+  lastSr_ = ntpMiddle(report.ntp);
+  lastSrArrivalUs_ = arrivalUs;
+}
+
+bool RtpReceiveStats::reportBlock(int64_t nowUs, RtcpReportBlock* out) {
+  if (!started_) return false;
+  uint64_t expected = cycles_ + maxSequence_ - baseSequence_ + 1;
+  int64_t lost = static_cast<int64_t>(expected) - static_cast<int64_t>(received_);
+  uint64_t expectedInterval = expected - reportExpected_;
+  int64_t lostInterval =
+      static_cast<int64_t>(expectedInterval) - static_cast<int64_t>(received_ - reportReceived_);
+  reportExpected_ = expected;
+  reportReceived_ = received_;
+
+  out->ssrc = ssrc_;
+  int64_t fraction = expectedInterval == 0 || lostInterval <= 0
+                         ? 0
+                         : (lostInterval << 8) / static_cast<int64_t>(expectedInterval);
+  out->fractionLost = static_cast<uint8_t>(fraction > 255 ? 255 : fraction);
+  out->cumulativeLost = lost > INT32_MAX ? INT32_MAX : static_cast<int32_t>(lost);
+  out->highestSequence = cycles_ + maxSequence_;
+  out->jitter = static_cast<uint32_t>(jitter_ >> 4);
+  out->lastSr = lastSr_;
+  out->delaySinceLastSr =
+      lastSr_ == 0 ? 0 : static_cast<uint32_t>((nowUs - lastSrArrivalUs_) * 65536 / 1000000);
+  return true;
+}
+
+void RtpReceiveStats::onPacket(const RtpHeader& header, int64_t arrivalUs, uint32_t clockRate) {
+  if (!started_ || header.ssrc != ssrc_) {
+    if (started_) restart();
+    ssrc_ = header.ssrc;
+    startSource(header.sequence);
+  } else {
+    int delta = sequenceDelta(header.sequence, maxSequence_);
+    if (delta > 0 && delta < kMaxDropout) {
+      if (header.sequence < maxSequence_) cycles_ += 65536;
+      maxSequence_ = header.sequence;
+    } else if (delta == 0) {
+      ++duplicates_;
+      return;
+    } else if (delta < 0 && delta >= -kMaxMisorder) {
+      ++reordered_;
+    } else if (header.sequence == badSequence_) {
+      // Two in a row after the jump: the sender restarted its sequence.
+      restart();
+      startSource(header.sequence);
+    } else {
+      badSequence_ = static_cast<uint16_t>(header.sequence + 1);
+      return;
+    }
+  }
+  ++received_;
+
+  if (clockRate == 0) return;
+  if (clockRate != clockRate_) {
+    clockRate_ = clockRate;
+    haveTransit_ = false;
+    jitter_ = 0;
+  }
+  if (!haveTransit_) firstArrivalUs_ = arrivalUs;
+  int64_t arrival = (arrivalUs - firstArrivalUs_) * clockRate / 1000000;
+  uint32_t transit = static_cast<uint32_t>(arrival) - header.timestamp;
+  if (haveTransit_) {
+    int64_t d = static_cast<int32_t>(transit - static_cast<uint32_t>(transit_));
+    if (d < 0) d = -d;
+    // A timestamp jump (camera restart) is not jitter.
+    if (d <= static_cast<int64_t>(clockRate) * 10) jitter_ += d - ((jitter_ + 8) >> 4);
+  }
+  transit_ = transit;
+  haveTransit_ = true;
+}
+
+uint64_t RtpReceiveStats::expected() const {
+  if (!started_) return priorExpected_;
+  return priorExpected_ + cycles_ + maxSequence_ - baseSequence_ + 1;
+}
+
+uint64_t RtpReceiveStats::lost() const {
+  uint64_t e = expected();
+  uint64_t r = received();
+  return e > r ? e - r : 0;
+}
+
+uint32_t RtpReceiveStats::jitterUs() const {
+  if (clockRate_ == 0) return 0;
+  return static_cast<uint32_t>(jitter_ * 1000000 / (16 * static_cast<int64_t>(clockRate_)));
+}
+
+}  // namespace nvr
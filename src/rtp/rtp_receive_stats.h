@@ -0,0 +1,80 @@
+// Reception statistics of an RTP stream (RFC 3550 appendix A.1 and A.8):
+// packets expected from the sequence numbers, lost, arrived out of order,
+// and interarrival jitter. They also make up the stream's RTCP reception
+// report block, with the time of the sender's last report.
+//
+// One per track, updated on the loop that receives it; a packet costs a
+// few integer operations. A reconnect starts a new source (new SSRC and
+// sequence base) with restart(), and the counts carry on across it.
+
+#ifndef NVR_RTP_RTP_RECEIVE_STATS_H
+#define NVR_RTP_RTP_RECEIVE_STATS_H
+
+#include <stdint.h>
+
+#include "rtp/rtcp_packet.h"
+#include "rtp/rtp_packet.h"
+
+namespace nvr {
+
+class RtpReceiveStats {
+ public:
+  // arrivalUs is on any monotonic clock; clockRate is the payload's RTP
+  // clock (0 leaves jitter alone).
+  void onPacket(const RtpHeader& header, int64_t arrivalUs, uint32_t clockRate);
+  void restart();
+  // A sender report for the current source; arrivalUs on the same clock.
+  void onSenderReport(const RtcpSenderReport& report, int64_t arrivalUs);
+
+  // The report block for the current source as of nowUs; the fraction lost
+  // covers the time since the previous call (RFC 3550 A.3). False before
+  // the first packet.
+  bool reportBlock(int64_t nowUs, RtcpReportBlock* out);
+
+  uint64_t received() const { return priorReceived_ + received_; }
+  uint64_t expected() const;
+  // expected() - received(), never below 0 (duplicates can make it so).
+  uint64_t lost() const;
+  // Arrived after a packet with a later sequence number.
+  uint64_t reordered() const { return reordered_; }
+  uint64_t duplicates() const { return duplicates_; }
+  // Interarrival jitter of the current source.
+  uint32_t jitterUs() const;
+  uint32_t ssrc() const { return ssrc_; }
+
+ private:
+  // RFC 3550 A.1: a jump beyond these is a restarted source rather than
+  // loss or reordering, confirmed by the packet after it.
+  static constexpr int kMaxDropout = 3000;
+  static constexpr int kMaxMisorder = 100;
+
+  void startSource(uint16_t sequence);
+
+  bool started_ = false;
+  uint32_t ssrc_ = 0;
+  uint16_t maxSequence_ = 0;
+  uint32_t cycles_ = 0;  // sequence wraps, times 2^16
+  uint32_t baseSequence_ = 0;
+  uint32_t badSequence_ = UINT32_MAX;  // the packet that would confirm a jump
+  uint64_t received_ = 0;
+  uint64_t priorExpected_ = 0;  // of earlier sources
+  uint64_t priorReceived_ = 0;
+  uint64_t reordered_ = 0;
+  uint64_t duplicates_ = 0;
+
+  uint32_t clockRate_ = 0;
+  bool haveTransit_ = false;
+  int64_t firstArrivalUs_ = 0;
+  int64_t transit_ = 0;
+  int64_t jitter_ = 0;  // in RTP clock units, times 16
+
+  // At the previous report block, for its fraction lost.
+  uint64_t reportExpected_ = 0;
+  uint64_t reportReceived_ = 0;
+  uint32_t lastSr_ = 0;
+  int64_t lastSrArrivalUs_ = 0;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_RTP_RTP_RECEIVE_STATS_H
@@ -0,0 +1,138 @@
+#include "rtp/shared_udp_port.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/hash.h"
+#include "base/log.h"
+
+namespace nvr {
+
+namespace {
+
+// cBPF for SO_ATTACH_REUSEPORT_CBPF: return (IPv4 source address % n), which
+// the kernel uses as the index of the socket in the reuseport group.
+int attachSteering(int fd, uint32_t n) {
+  struct sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_NET_OFF + 12)},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, n},
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog prog;
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+    return -errno;
+  return 0;
+}
+
+}  // namespace
+
+UdpPortGroup::~UdpPortGroup() {
+  for (int fd : rtpFds_)
+    if (fd >= 0) close(fd);
+  for (int fd : rtcpFds_)
+    if (fd >= 0) close(fd);
+}
+
+int UdpPortGroup::open(uint16_t rtpPort, int loops) {
+  if (rtpPort % 2 != 0) return -EINVAL;
+  rtpPort_ = rtpPort;
+  // Group membership order defines the socket index the BPF program
+  // returns, so socket i must belong to loop i.
+  for (int i = 0; i < loops; ++i) {
+    int rtp = udpBind(AF_INET, rtpPort, true);
+    if (rtp < 0) return rtp;
+    rtpFds_.push_back(rtp);
+    int rtcp = udpBind(AF_INET, rtpPort + 1, true);
+    if (rtcp < 0) return rtcp;
+    rtcpFds_.push_back(rtcp);
+    setRecvBufferSize(rtp, 8 * 1024 * 1024);
+  }
+  if (loops > 1) {
+    int rc = attachSteering(rtpFds_[0], loops);
+    if (rc == 0) rc = attachSteering(rtcpFds_[0], loops);
+    if (rc < 0) return rc;
+  }
+  return 0;
+}
+
+void UdpPortGroup::takeSockets(int loop, int* rtpFd, int* rtcpFd) {
+  *rtpFd = rtpFds_[loop];
+  *rtcpFd = rtcpFds_[loop];
+  rtpFds_[loop] = -1;
+  rtcpFds_[loop] = -1;
+}
+
+int UdpPortGroup::loopForSource(const SocketAddress& source, int loops) {
+  if (source.family() != AF_INET || loops <= 0) return -1;
+  uint32_t ip = ntohl(reinterpret_cast<const sockaddr_in*>(&source.storage)->sin_addr.s_addr);
+  return static_cast<int>(ip % static_cast<uint32_t>(loops));
+}
+
+SharedUdpPort::SharedUdpPort(EventLoop* loop, PacketPool* pool, uint16_t rtpPort, int rtpFd,
+                             int rtcpFd, size_t ringSlots)
+    : rtpPort_(rtpPort),
+      rtp_(new UdpReceiver(loop, pool, rtpFd, this, ringSlots, UdpReceiver::kMaxBatch)),
+      rtcp_(new UdpReceiver(loop, pool, rtcpFd, this, ringSlots / 16 + 1, 16)) {}
+
+SharedUdpPort::~SharedUdpPort() = default;
+
+uint64_t SharedUdpPort::key(const SocketAddress& addr, bool withPort) {
+  uint16_t port = withPort ? addr.port() : 0;
+  if (addr.family() == AF_INET) {
+    uint64_t ip = reinterpret_cast<const sockaddr_in*>(&addr.storage)->sin_addr.s_addr;
+    return (ip << 16) | port;
+  }
+  const auto* sin6 = reinterpret_cast<const sockaddr_in6*>(&addr.storage);
+  return mix64(fnv1a64(&sin6->sin6_addr, sizeof(sin6->sin6_addr)) ^ port);
+}
+
+void SharedUdpPort::subscribe(const SocketAddress& source, bool rtcp, UdpPacketHandler* handler) {
+  routes_[rtcp][key(source, source.port() != 0)] = handler;
+}
+
+void SharedUdpPort::unsubscribe(const SocketAddress& source, bool rtcp) {
+  routes_[rtcp].erase(key(source, source.port() != 0));
+}
+
+int SharedUdpPort::send(bool rtcp, const SocketAddress& to, const void* data, size_t size) {
+  const UdpReceiver* receiver = rtcp ? rtcp_.get() : rtp_.get();
+  if (sendto(receiver->fd(), data, size, 0, to.get(), to.length) < 0) return -errno;
+  return 0;
+}
+
+UdpReceiverStats SharedUdpPort::stats() const {
+  UdpReceiverStats s = rtp_->stats();
+  s.add(rtcp_->stats());
+  return s;
+}
+
+void SharedUdpPort::onDatagram(UdpReceiver* receiver, const PacketRef& packet,
+                               const SocketAddress& from) {
+  auto& routes = routes_[receiver == rtcp_.get()];
+  auto it = routes.find(key(from, true));
+  if (it == routes.end()) it = routes.find(key(from, false));
+  if (it == routes.end()) {
+    ++unknownSources_;
+    return;
+  }
+  UdpPacketHandler* handler = it->second;
+  if (std::find(touched_.begin(), touched_.end(), handler) == touched_.end())
+    touched_.push_back(handler);
+  handler->onDatagram(receiver, packet, from);
+}
+
+void SharedUdpPort::onDatagramBatchDone(UdpReceiver* receiver) {
+  // Handlers are destroyed with deleteLater(), so one that unsubscribed
+  // during the batch is still safe to call; it ignores the call once closed.
+  for (UdpPacketHandler* handler : touched_) handler->onDatagramBatchDone(receiver);
+  touched_.clear();
+}
+
+}  // namespace nvr
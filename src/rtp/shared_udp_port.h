@@ -0,0 +1,91 @@
+// Shared UDP ingest ports: every camera of a node sends RTP/RTCP to the same
+// port pair instead of a pair per session.
+//
+// UdpPortGroup opens the pair once per event loop with SO_REUSEPORT and
+// attaches a classic BPF program that steers each datagram to the socket of
+// loop (source IPv4 address % loops). Cameras using the shared port are
+// sharded onto loops with the same formula (loopForSource), so every
+// datagram arrives on the loop that owns its session and no packet crosses
+// threads. Each loop's SharedUdpPort drains its sockets with UdpReceiver and
+// demultiplexes by source address.
+
+#ifndef NVR_RTP_SHARED_UDP_PORT_H
+#define NVR_RTP_SHARED_UDP_PORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "base/packet_buffer.h"
+#include "base/socket_util.h"
+#include "rtp/udp_receiver.h"
+
+namespace nvr {
+
+class UdpPortGroup {
+ public:
+  UdpPortGroup() = default;
+  ~UdpPortGroup();
+
+  UdpPortGroup(const UdpPortGroup&) = delete;
+  UdpPortGroup& operator=(const UdpPortGroup&) = delete;
+
+  // Binds rtpPort and rtpPort + 1 (IPv4) once per loop. Returns 0 or -errno.
+  int open(uint16_t rtpPort, int loops);
+
+  // Hands the sockets of one loop to the caller.
+  void takeSockets(int loop, int* rtpFd, int* rtcpFd);
+
+  uint16_t rtpPort() const { return rtpPort_; }
+
+  // Loop that receives datagrams from this source; -1 for non-IPv4.
+  static int loopForSource(const SocketAddress& source, int loops);
+
+ private:
+  uint16_t rtpPort_ = 0;
+  std::vector<int> rtpFds_;
+  std::vector<int> rtcpFds_;
+};
+
+// One loop's end of a UdpPortGroup. Loop-thread only.
+class SharedUdpPort : public UdpPacketHandler {
+ public:
+  SharedUdpPort(EventLoop* loop, PacketPool* pool, uint16_t rtpPort, int rtpFd, int rtcpFd,
+                size_t ringSlots = 4096);
+  ~SharedUdpPort() override;
+
+  uint16_t rtpPort() const { return rtpPort_; }
+
+  // Routes datagrams from source to handler. A source with port 0 matches
+  // any port of that host (cameras that omit server_port in SETUP).
+  void subscribe(const SocketAddress& source, bool rtcp, UdpPacketHandler* handler);
+  void unsubscribe(const SocketAddress& source, bool rtcp);
+  // Sends from the RTP or RTCP port, so that replies pass the same NAT and
+  // firewall state as the camera's packets. 0 or -errno.
+  int send(bool rtcp, const SocketAddress& to, const void* data, size_t size);
+
+  UdpReceiverStats stats() const;
+  uint64_t unknownSources() const { return unknownSources_; }
+
+  void onDatagram(UdpReceiver* receiver, const PacketRef& packet,
+                  const SocketAddress& from) override;
+  void onDatagramBatchDone(UdpReceiver* receiver) override;
+
+ private:
+  static uint64_t key(const SocketAddress& addr, bool withPort);
+
+  uint16_t rtpPort_;
+  std::unique_ptr<UdpReceiver> rtp_;
+  std::unique_ptr<UdpReceiver> rtcp_;
+  std::unordered_map<uint64_t, UdpPacketHandler*> routes_[2];
+  std::vector<UdpPacketHandler*> touched_;
+  uint64_t unknownSources_ = 0;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_RTP_SHARED_UDP_PORT_H
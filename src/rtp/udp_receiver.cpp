@@ -0,0 +1,142 @@
+#include "rtp/udp_receiver.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace nvr {
+
+namespace {
+
+// Bounds the work done per readiness event so one busy socket cannot starve
+// the rest of the loop.
+constexpr int kMaxBatchesPerEvent = 8;
+
+}  // namespace
+
+void UdpReceiverStats::add(const UdpReceiverStats& other) {
+  syscalls += other.syscalls;
+  packets += other.packets;
+  bytes += other.bytes;
+  ringOverruns += other.ringOverruns;
+  kernelDrops += other.kernelDrops;
+  truncated += other.truncated;
+  ringBytes += other.ringBytes;
+}
+
+UdpReceiver::UdpReceiver(EventLoop* loop, PacketPool* pool, int fd, UdpPacketHandler* handler,
+                         size_t ringSlots, int batch)
+    : loop_(loop),
+      pool_(pool),
+      fd_(fd),
+      handler_(handler),
+      batch_(batch < 1 ? 1 : (batch > kMaxBatch ? kMaxBatch : batch)) {
+  ring_.reserve(ringSlots);
+  for (size_t i = 0; i < ringSlots; ++i) ring_.push_back(pool_->acquire());
+  stats_.ringBytes = ringSlots * pool_->bufferSize();
+  memset(msgs_, 0, sizeof(msgs_));
+  int one = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+  loop_->add(fd_, EPOLLIN, this);
+}
+
+UdpReceiver::~UdpReceiver() {
+  close();
+  for (PacketBuffer* buffer : ring_) buffer->unref();
+  for (Slot& slot : slots_) {
+    // Spare spill buffers are ours alone; ring buffers were released above.
+    if (slot.spilled && slot.buffer) slot.buffer->unref();
+  }
+}
+
+void UdpReceiver::close() {
+  if (fd_ < 0) return;
+  loop_->remove(fd_);
+  ::close(fd_);
+  fd_ = -1;
+}
+
+size_t UdpReceiver::prepareBatch() {
+  size_t fromRing = 0;
+  for (int i = 0; i < batch_; ++i) {
+    Slot& slot = slots_[i];
+    PacketBuffer* ringBuffer = nullptr;
+    // Ring slots must be consecutive from head_; the first busy one ends
+    // the ring part of the batch.
+    if (fromRing == static_cast<size_t>(i) && fromRing < ring_.size()) {
+      PacketBuffer* candidate = ring_[(head_ + i) % ring_.size()];
+      if (candidate->refCount() == 1) ringBuffer = candidate;
+    }
+    if (ringBuffer) {
+      if (slot.spilled && slot.buffer) slot.buffer->unref();
+      slot.buffer = ringBuffer;
+      slot.spilled = false;
+      ++fromRing;
+    } else if (!slot.spilled || slot.buffer == nullptr) {
+      slot.buffer = pool_->acquire();
+      slot.spilled = true;
+    }
+
+    slot.iov.iov_base = slot.buffer->data();
+    slot.iov.iov_len = slot.buffer->capacity();
+    struct msghdr& hdr = msgs_[i].msg_hdr;
+    hdr.msg_name = &slot.from;
+    hdr.msg_namelen = sizeof(slot.from);
+    hdr.msg_iov = &slot.iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = slot.control;
+    hdr.msg_controllen = sizeof(slot.control);
+    hdr.msg_flags = 0;
+    msgs_[i].msg_len = 0;
+  }
+  return fromRing;
+}
+
+void UdpReceiver::onEvents(uint32_t events) {
+  bool received = false;
+  for (int round = 0; round < kMaxBatchesPerEvent && fd_ >= 0; ++round) {
+    size_t fromRing = prepareBatch();
+    int n = recvmmsg(fd_, msgs_, batch_, MSG_DONTWAIT, nullptr);
+    if (n <= 0) break;
+    ++stats_.syscalls;
+    received = true;
+    if (!ring_.empty())
+      head_ = (head_ + (static_cast<size_t>(n) < fromRing ? n : fromRing)) % ring_.size();
+
+    for (int i = 0; i < n; ++i) {
+      Slot& slot = slots_[i];
+      struct msghdr& hdr = msgs_[i].msg_hdr;
+      for (struct cmsghdr* cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_RXQ_OVFL) continue;
+        uint32_t drops;
+        memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+        // Cumulative for the socket, and only attached once it is non-zero.
+        stats_.kernelDrops = drops;
+      }
+      if (hdr.msg_flags & MSG_TRUNC) {
+        ++stats_.truncated;
+        continue;
+      }
+      uint32_t len = msgs_[i].msg_len;
+      PacketRef packet;
+      if (slot.spilled) {
+        packet = PacketRef::adopt(slot.buffer, 0, len);
+        slot.buffer = nullptr;
+        ++stats_.ringOverruns;
+      } else {
+        packet = PacketRef(slot.buffer, 0, len);
+      }
+      ++stats_.packets;
+      stats_.bytes += len;
+      SocketAddress from;
+      memcpy(&from.storage, &slot.from, hdr.msg_namelen);
+      from.length = hdr.msg_namelen;
+      handler_->onDatagram(this, packet, from);
+      if (fd_ < 0) break;
+    }
+    if (n < batch_) break;
+  }
+  if (received && fd_ >= 0) handler_->onDatagramBatchDone(this);
+}
+
+}  // namespace nvr
@@ -0,0 +1,99 @@
+// Batched UDP receive: recvmmsg() into a per-socket ring of pooled buffers.
+//
+// The ring holds a fixed set of datagram buffers with their mmsghdr/iovec
+// already set up, so a readable socket is drained with one syscall per batch
+// instead of one per packet. Received packets are handed out as PacketRefs
+// into the ring slot; a slot is reused once every downstream reference is
+// gone. When the ring wraps onto a slot that is still held (a slow consumer
+// or a ring too small for the stream) the packet is received into a spill
+// buffer from the pool instead and counted as a ring overrun. Datagrams the
+// kernel dropped because the socket queue was full are reported through
+// SO_RXQ_OVFL.
+
+#ifndef NVR_RTP_UDP_RECEIVER_H
+#define NVR_RTP_UDP_RECEIVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+#include "base/event_loop.h"
+#include "base/packet_buffer.h"
+#include "base/socket_util.h"
+
+namespace nvr {
+
+class UdpReceiver;
+
+struct UdpReceiverStats {
+  uint64_t syscalls = 0;      // recvmmsg calls that returned data
+  uint64_t packets = 0;
+  uint64_t bytes = 0;
+  uint64_t ringOverruns = 0;  // packets received into spill buffers
+  uint64_t kernelDrops = 0;   // socket queue overflows (SO_RXQ_OVFL)
+  uint64_t truncated = 0;     // datagrams larger than a buffer
+  size_t ringBytes = 0;       // memory pinned by the ring
+
+  double packetsPerSyscall() const { return syscalls ? static_cast<double>(packets) / syscalls : 0; }
+  void add(const UdpReceiverStats& other);
+};
+
+class UdpPacketHandler {
+ public:
+  virtual ~UdpPacketHandler() = default;
+  virtual void onDatagram(UdpReceiver* receiver, const PacketRef& packet,
+                          const SocketAddress& from) = 0;
+  // After each drained batch; flush batched output here.
+  virtual void onDatagramBatchDone(UdpReceiver* receiver) {}
+};
+
+class UdpReceiver : public EventHandler {
+ public:
+  static constexpr int kMaxBatch = 64;
+
+  // Takes ownership of fd and registers it with loop. pool must be owned by
+  // loop's thread and outlive the receiver.
+  UdpReceiver(EventLoop* loop, PacketPool* pool, int fd, UdpPacketHandler* handler,
+              size_t ringSlots = 64, int batch = 32);
+  ~UdpReceiver() override;
+
+  UdpReceiver(const UdpReceiver&) = delete;
+  UdpReceiver& operator=(const UdpReceiver&) = delete;
+
+  int fd() const { return fd_; }
+  void close();
+  const UdpReceiverStats& stats() const { return stats_; }
+
+  void onEvents(uint32_t events) override;
+
+ private:
+  // Sets up one batch of receive slots; returns how many come from the ring.
+  size_t prepareBatch();
+
+  EventLoop* loop_;
+  PacketPool* pool_;
+  int fd_;
+  UdpPacketHandler* handler_;
+  const int batch_;
+
+  std::vector<PacketBuffer*> ring_;
+  size_t head_ = 0;
+
+  struct Slot {
+    PacketBuffer* buffer = nullptr;
+    bool spilled = false;
+    struct sockaddr_storage from;
+    struct iovec iov;
+    alignas(struct cmsghdr) uint8_t control[CMSG_SPACE(sizeof(uint32_t))];
+  };
+  Slot slots_[kMaxBatch];
+  struct mmsghdr msgs_[kMaxBatch];
+
+  UdpReceiverStats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_RTP_UDP_RECEIVER_H
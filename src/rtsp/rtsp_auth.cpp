@@ -0,0 +1,67 @@
+#include "rtsp/rtsp_auth.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "base/base64.h"
+#include "base/md5.h"
+#include "rtsp/rtsp_message.h"
+
+namespace nvr {
+
+bool RtspAuth::onChallenge(const std::string& wwwAuthenticate) {
+  if (!hasCredentials()) return false;
+  size_t sp = wwwAuthenticate.find(' ');
+  std::string scheme = wwwAuthenticate.substr(0, sp);
+  if (equalsIgnoreCase(scheme, "Basic")) {
+    if (scheme_ == Scheme::Basic) return false;  // credentials were rejected
+    scheme_ = Scheme::Basic;
+    return true;
+  }
+  if (!equalsIgnoreCase(scheme, "Digest") || sp == std::string::npos) return false;
+
+  std::string realm, nonce, opaque;
+  bool qopAuth = false, stale = false;
+  for (const auto& kv : splitParameters(wwwAuthenticate.substr(sp + 1), ',')) {
+    if (kv.first == "realm") realm = kv.second;
+    else if (kv.first == "nonce") nonce = kv.second;
+    else if (kv.first == "opaque") opaque = kv.second;
+    else if (kv.first == "qop") qopAuth = kv.second.find("auth") != std::string::npos;
+    else if (kv.first == "stale") stale = equalsIgnoreCase(kv.second, "true");
+  }
+  // A repeated nonce without stale=true means our answer was wrong.
+  if (scheme_ == Scheme::Digest && nonce == nonce_ && !stale) return false;
+  scheme_ = Scheme::Digest;
+  realm_ = realm;
+  nonce_ = nonce;
+  opaque_ = opaque;
+  qopAuth_ = qopAuth;
+  nonceCount_ = 0;
+  return true;
+}
+
+std::string RtspAuth::authorization(const std::string& method, const std::string& uri) {
+  if (scheme_ == Scheme::Basic) return "Basic " + base64Encode(user_ + ":" + password_);
+  if (scheme_ != Scheme::Digest) return "";
+
+  std::string ha1 = Md5::hex(user_ + ":" + realm_ + ":" + password_);
+  std::string ha2 = Md5::hex(method + ":" + uri);
+  std::string out = "Digest username=\"" + user_ + "\", realm=\"" + realm_ + "\", nonce=\"" +
+                    nonce_ + "\", uri=\"" + uri + "\"";
+  if (qopAuth_) {
+    char nc[16];
+    snprintf(nc, sizeof(nc), "%08x", ++nonceCount_);
+    char cnonce[17];
+    snprintf(cnonce, sizeof(cnonce), "%08x%08x", static_cast<unsigned>(random()),
+             static_cast<unsigned>(random()));
+    std::string response = Md5::hex(ha1 + ":" + nonce_ + ":" + nc + ":" + cnonce + ":auth:" + ha2);
+    out += ", qop=auth, nc=" + std::string(nc) + ", cnonce=\"" + cnonce + "\", response=\"" +
+           response + "\"";
+  } else {
+    out += ", response=\"" + Md5::hex(ha1 + ":" + nonce_ + ":" + ha2) + "\"";
+  }
+  if (!opaque_.empty()) out += ", opaque=\"" + opaque_ + "\"";
+  return out;
+}
+
+}  // namespace nvr
@@ -0,0 +1,42 @@
+// RTSP Basic and Digest (RFC 2617) client authentication.
+
+#ifndef NVR_RTSP_RTSP_AUTH_H
+#define NVR_RTSP_RTSP_AUTH_H
+
+#include <string>
+
+namespace nvr {
+
+class RtspAuth {
+ public:
+  RtspAuth() = default;
+  RtspAuth(std::string user, std::string password)
+      : user_(std::move(user)), password_(std::move(password)) {}
+
+  bool hasCredentials() const { return !user_.empty(); }
+  bool active() const { return scheme_ != Scheme::None; }
+
+  // Consumes a WWW-Authenticate challenge. Returns false when the challenge
+  // cannot be answered (no credentials, unknown scheme, or the same nonce
+  // already failed).
+  bool onChallenge(const std::string& wwwAuthenticate);
+
+  // Authorization header value for a request, or "" when not authenticating.
+  std::string authorization(const std::string& method, const std::string& uri);
+
+ private:
+  enum class Scheme { None, Basic, Digest };
+
+  std::string user_;
+  std::string password_;
+  Scheme scheme_ = Scheme::None;
+  std::string realm_;
+  std::string nonce_;
+  std::string opaque_;
+  bool qopAuth_ = false;
+  unsigned nonceCount_ = 0;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_RTSP_RTSP_AUTH_H
@@ -0,0 +1,607 @@
+#include "rtsp/rtsp_client.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "base/log.h"
+
+namespace nvr {
+
+namespace {
+
+constexpr size_t kMaxReadPerEvent = 256 * 1024;
+// Below this much tail room a fresh stream chunk is started.
+constexpr size_t kMinChunkRead = 4096;
+constexpr size_t kRtpRingSlots = 64;
+constexpr size_t kRtcpRingSlots = 4;
+constexpr uint32_t kTickMs = 500;
+const char kUserAgent[] = "openNVR";
+
+}  // namespace
+
+// One UDP socket of a track's RTP/RTCP pair, either owned by the session or
+// a route on the loop's shared port.
+class RtspClient::UdpChannel : public UdpPacketHandler {
+ public:
+  UdpChannel(RtspClient* client, int track, bool rtcp)
+      : client_(client), track_(track), rtcp_(rtcp) {}
+  ~UdpChannel() override { close(); }
+
+  void open(int fd, size_t ringSlots) {
+    receiver_.reset(new UdpReceiver(client_->loop_, &client_->pools_->datagram, fd, this,
+                                    ringSlots));
+  }
+
+  void attach(SharedUdpPort* port, const SocketAddress& source) {
+    shared_ = port;
+    source_ = source;
+    shared_->subscribe(source_, rtcp_, this);
+  }
+
+  void close() {
+    closed_ = true;
+    if (receiver_) receiver_->close();
+    if (shared_) shared_->unsubscribe(source_, rtcp_);
+    shared_ = nullptr;
+  }
+
+  const UdpReceiver* receiver() const { return receiver_.get(); }
+
+  int send(const SocketAddress& to, const std::string& data) {
+    if (shared_) return shared_->send(rtcp_, to, data.data(), data.size());
+    if (!receiver_ || receiver_->fd() < 0) return -ENOTCONN;
+    if (sendto(receiver_->fd(), data.data(), data.size(), 0, to.get(), to.length) < 0)
+      return -errno;
+    return 0;
+  }
+
+  void onDatagram(UdpReceiver* receiver, const PacketRef& packet,
+                  const SocketAddress& from) override {
+    // Drop datagrams that do not come from the camera.
+    if (closed_ || !from.sameHost(client_->server_)) return;
+    client_->deliverPacket(track_, rtcp_, packet);
+  }
+
+  void onDatagramBatchDone(UdpReceiver* receiver) override {
+    if (!closed_ && client_->listener_) client_->listener_->onReceiveBatchDone(client_);
+  }
+
+ private:
+  RtspClient* client_;
+  int track_;
+  bool rtcp_;
+  bool closed_ = false;
+  std::unique_ptr<UdpReceiver> receiver_;
+  SharedUdpPort* shared_ = nullptr;
+  SocketAddress source_;
+};
+
+RtspClient::Track::Track() = default;
+RtspClient::Track::Track(Track&&) noexcept = default;
+RtspClient::Track::~Track() = default;
+
+RtspClient::RtspClient(EventLoop* loop, PacketPools* pools, const std::string& url,
+                       const RtspClientOptions& options, RtspClientListener* listener)
+    : loop_(loop), pools_(pools), options_(options), listener_(listener), urlText_(url) {
+  memset(channelToTrack_, -1, sizeof(channelToTrack_));
+  if (parseUrl(url, &url_)) {
+    requestUrl_ = url_.withoutCredentials();
+    auth_ = RtspAuth(url_.user, url_.password);
+  }
+}
+
+RtspClient::~RtspClient() {
+  if (tickTimer_) loop_->cancel(tickTimer_);
+  closeTransport();
+}
+
+UdpReceiverStats RtspClient::udpStats() const {
+  UdpReceiverStats total = retiredUdpStats_;
+  for (const auto& track : tracks_) {
+    for (const auto* channel : {track.rtp.get(), track.rtcp.get()}) {
+      if (channel && channel->receiver()) total.add(channel->receiver()->stats());
+    }
+  }
+  return total;
+}
+
+void RtspClient::start() {
+  if (state_ != State::Idle && state_ != State::Stopped) return;
+  if (url_.host.empty() || url_.scheme != "rtsp") {
+    NVR_ERROR("rtsp: bad url %s", requestUrl_.empty() ? "?" : requestUrl_.c_str());
+    state_ = State::Stopped;
+    return;
+  }
+  backoffMs_ = options_.reconnectMinMs;
+  tickTimer_ = loop_->runEvery(kTickMs, [this] { tick(); });
+  connect();
+}
+
+void RtspClient::stop() {
+  if (state_ == State::Stopped) return;
+  if (state_ == State::Playing && fd_ >= 0) {
+    // Best effort; the socket is non-blocking and closed right after.
+    std::string req = buildRtspRequest("TEARDOWN", baseUrl_, ++cseq_,
+                                       {{"Session", session_}, {"User-Agent", kUserAgent}});
+    ssize_t n = ::send(fd_, req.data(), req.size(), MSG_NOSIGNAL);
+    (void)n;
+  }
+  if (tickTimer_) loop_->cancel(tickTimer_);
+  tickTimer_ = 0;
+  closeTransport();
+  state_ = State::Stopped;
+}
+
+int RtspClient::sendRtcp(int track, const std::string& packet) {
+  if (state_ != State::Playing || track < 0 || static_cast<size_t>(track) >= tracks_.size() ||
+      packet.size() > 0xffff)
+    return -EINVAL;
+  Track& t = tracks_[track];
+  int rc;
+  if (options_.transport == RtspTransport::Tcp) {
+    if (t.rtcpChannel < 0 || t.rtcpChannel > 255) return -EDESTADDRREQ;
+    std::string frame = {'$', static_cast<char>(t.rtcpChannel),
+                         static_cast<char>(packet.size() >> 8), static_cast<char>(packet.size())};
+    frame += packet;
+    queueOutput(frame);
+    rc = 0;
+  } else {
+    if (!t.rtcp || t.serverRtcpPort == 0) return -EDESTADDRREQ;
+    SocketAddress to = server_;
+    to.setPort(t.serverRtcpPort);
+    rc = t.rtcp->send(to, packet);
+  }
+  if (rc == 0) ++stats_.rtcpSent;
+  return rc;
+}
+
+void RtspClient::connect() {
+  if (server_.length == 0) {
+    int rc = resolveAddress(url_.host, url_.port, &server_);
+    if (rc < 0) {
+      fail(rc);
+      return;
+    }
+  }
+  int fd = tcpConnect(server_);
+  if (fd < 0) {
+    fail(fd);
+    return;
+  }
+  fd_ = fd;
+  wantWrite_ = true;
+  loop_->add(fd_, EPOLLIN | EPOLLOUT, this);
+  state_ = State::Connecting;
+  pendingDeadlineMs_ = loop_->nowMs() + options_.connectTimeoutMs;
+}
+
+void RtspClient::closeTransport() {
+  if (fd_ >= 0) {
+    loop_->remove(fd_);
+    ::close(fd_);
+    fd_ = -1;
+  }
+  // UDP channels may be mid-callback or still queued in this epoll batch.
+  for (auto& track : tracks_) {
+    for (auto* channel : {&track.rtp, &track.rtcp}) {
+      if (!*channel) continue;
+      if ((*channel)->receiver()) retiredUdpStats_.add((*channel)->receiver()->stats());
+      (*channel)->close();
+      loop_->deleteLater(channel->release());
+    }
+  }
+  retiredUdpStats_.ringBytes = 0;
+  tracks_.clear();
+  memset(channelToTrack_, -1, sizeof(channelToTrack_));
+  releaseChunk();
+  output_.clear();
+  session_.clear();
+  pendingCseq_ = -1;
+  wantWrite_ = false;
+}
+
+void RtspClient::fail(int error) {
+  NVR_WARN("rtsp %s: session failed (%s), retry in %u ms", requestUrl_.c_str(), strerror(-error),
+           backoffMs_);
+  closeTransport();
+  state_ = State::Waiting;
+  reconnectAtMs_ = loop_->nowMs() + backoffMs_;
+  backoffMs_ = backoffMs_ * 2 > options_.reconnectMaxMs ? options_.reconnectMaxMs : backoffMs_ * 2;
+  ++stats_.reconnects;
+  if (listener_) listener_->onRtspDisconnected(this, error);
+}
+
+void RtspClient::tick() {
+  uint64_t now = loop_->nowMs();
+  switch (state_) {
+    case State::Connecting:
+    case State::Handshaking:
+      if (now >= pendingDeadlineMs_) fail(-ETIMEDOUT);
+      break;
+    case State::Playing:
+      if (now - lastMediaMs_ >= options_.receiveTimeoutMs) {
+        fail(-ETIMEDOUT);
+      } else if (pendingCseq_ >= 0 && now >= pendingDeadlineMs_) {
+        fail(-ETIMEDOUT);
+      } else if (now >= nextKeepaliveMs_) {
+        sendKeepalive();
+      }
+      break;
+    case State::Waiting:
+      if (now >= reconnectAtMs_) connect();
+      break;
+    default:
+      break;
+  }
+}
+
+void RtspClient::onEvents(uint32_t events) {
+  if (fd_ < 0) return;
+  if (state_ == State::Connecting) {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+    int err = socketError(fd_);
+    if (err != 0) {
+      fail(err);
+      return;
+    }
+    state_ = State::Handshaking;
+    wantWrite_ = false;
+    loop_->modify(fd_, EPOLLIN, this);
+    sendRequest("OPTIONS", requestUrl_);
+    return;
+  }
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) handleReadable();
+  if (fd_ >= 0 && (events & EPOLLOUT)) handleWritable();
+}
+
+void RtspClient::handleReadable() {
+  size_t total = 0;
+  while (total < kMaxReadPerEvent) {
+    if (!ensureChunkSpace()) {
+      fail(-EMSGSIZE);
+      return;
+    }
+    ssize_t n = ::read(fd_, chunk_->data() + chunkEnd_, chunk_->capacity() - chunkEnd_);
+    if (n == 0) {
+      fail(-ECONNRESET);
+      return;
+    }
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR) break;
+      fail(-errno);
+      return;
+    }
+    chunkEnd_ += n;
+    total += n;
+    parseInput();
+    if (fd_ < 0) return;
+  }
+  if (listener_) listener_->onReceiveBatchDone(this);
+}
+
+bool RtspClient::ensureChunkSpace() {
+  if (chunk_ == nullptr) {
+    chunk_ = pools_->stream.acquire();
+    chunkStart_ = chunkEnd_ = 0;
+    return true;
+  }
+  size_t pending = chunkEnd_ - chunkStart_;
+  if (pending == 0 && chunk_->refCount() == 1) {
+    // Nobody holds slices of this chunk any more; rewind and reuse it.
+    chunkStart_ = chunkEnd_ = 0;
+    return true;
+  }
+  size_t room = chunk_->capacity() - chunkEnd_;
+  if (room >= kMinChunkRead) return true;
+  // A message that starts at the front of the chunk gains nothing by moving.
+  if (chunkStart_ == 0) return room > 0;
+  // Move the incomplete tail to a fresh chunk; packets already handed out
+  // keep the old one alive.
+  PacketBuffer* next = pools_->stream.acquire();
+  memcpy(next->data(), chunk_->data() + chunkStart_, pending);
+  stats_.bytesCarried += pending;
+  chunk_->unref();
+  chunk_ = next;
+  chunkStart_ = 0;
+  chunkEnd_ = pending;
+  return true;
+}
+
+void RtspClient::releaseChunk() {
+  if (chunk_) chunk_->unref();
+  chunk_ = nullptr;
+  chunkStart_ = chunkEnd_ = 0;
+}
+
+void RtspClient::handleWritable() {
+  while (!output_.empty()) {
+    ssize_t n = output_.writeFd(fd_);
+    if (n < 0) {
+      if (n == -EAGAIN) return;
+      fail(static_cast<int>(n));
+      return;
+    }
+  }
+  if (wantWrite_) {
+    wantWrite_ = false;
+    loop_->modify(fd_, EPOLLIN, this);
+  }
+}
+
+void RtspClient::parseInput() {
+  while (fd_ >= 0 && chunkStart_ < chunkEnd_) {
+    const uint8_t* p = chunk_->data() + chunkStart_;
+    size_t len = chunkEnd_ - chunkStart_;
+    if (p[0] == '$') {
+      if (len < 4) return;
+      size_t frameLen = (p[2] << 8) | p[3];
+      if (len < 4 + frameLen) return;
+      int8_t mapped = channelToTrack_[p[1]];
+      PacketRef packet(chunk_, static_cast<uint32_t>(chunkStart_ + 4),
+                       static_cast<uint32_t>(frameLen));
+      chunkStart_ += 4 + frameLen;
+      if (mapped >= 0) deliverPacket(mapped >> 1, mapped & 1, packet);
+      continue;
+    }
+    if (len >= 5 && memcmp(p, "RTSP/", 5) == 0) {
+      RtspResponse response;
+      int n = parseRtspResponse(reinterpret_cast<const char*>(p), len, &response);
+      if (n == 0) return;
+      if (n < 0) {
+        fail(-EPROTO);
+        return;
+      }
+      chunkStart_ += n;
+      handleResponse(response);
+      continue;
+    }
+    if (len < 5) return;
+    // Server-initiated request (ANNOUNCE, SET_PARAMETER...) or garbage:
+    // skip a complete request if we can parse one, otherwise resync on '$'.
+    RtspRequest request;
+    int n = parseRtspRequest(reinterpret_cast<const char*>(p), len, &request);
+    if (n > 0) {
+      chunkStart_ += n;
+      continue;
+    }
+    const void* dollar = memchr(p + 1, '$', len - 1);
+    if (n == 0 && dollar == nullptr) return;
+    chunkStart_ += dollar ? static_cast<const uint8_t*>(dollar) - p : len;
+  }
+}
+
+void RtspClient::deliverPacket(int track, bool rtcp, const PacketRef& packet) {
+  if (state_ != State::Playing) return;
+  lastMediaMs_ = loop_->nowMs();
+  if (rtcp) {
+    ++stats_.rtcpPackets;
+    if (listener_) listener_->onRtcpPacket(this, track, packet);
+  } else {
+    ++stats_.rtpPackets;
+    stats_.rtpBytes += packet.size();
+    if (listener_) listener_->onRtpPacket(this, track, packet);
+  }
+}
+
+void RtspClient::handleResponse(const RtspResponse& response) {
+  if (response.cseq() != pendingCseq_) return;
+  pendingCseq_ = -1;
+  std::string method = pendingMethod_;
+
+  if (response.status == 401) {
+    bool answered = false;
+    // Prefer Digest when the camera offers several schemes.
+    for (const auto& h : response.headers) {
+      if (equalsIgnoreCase(h.first, "WWW-Authenticate") && h.second.compare(0, 6, "Digest") == 0)
+        answered = auth_.onChallenge(h.second);
+    }
+    if (!answered) {
+      const std::string* challenge = response.header("WWW-Authenticate");
+      answered = challenge && auth_.onChallenge(*challenge);
+    }
+    if (answered) {
+      resendWithAuth();
+    } else {
+      NVR_WARN("rtsp %s: authentication rejected", requestUrl_.c_str());
+      fail(-EACCES);
+    }
+    return;
+  }
+
+  if (state_ == State::Playing) {
+    // Keepalive answer. Cameras that reject GET_PARAMETER get OPTIONS.
+    if (response.status != 200 && method == "GET_PARAMETER") supportsGetParameter_ = false;
+    return;
+  }
+
+  if (response.status != 200) {
+    NVR_WARN("rtsp %s: %s returned %d %s", requestUrl_.c_str(), method.c_str(), response.status,
+             response.reason.c_str());
+    fail(-EPROTO);
+    return;
+  }
+
+  if (method == "OPTIONS") {
+    const std::string* pub = response.header("Public");
+    supportsGetParameter_ = pub && pub->find("GET_PARAMETER") != std::string::npos;
+    sendRequest("DESCRIBE", requestUrl_, {{"Accept", "application/sdp"}});
+  } else if (method == "DESCRIBE") {
+    handleDescribe(response);
+  } else if (method == "SETUP") {
+    handleSetup(response);
+  } else if (method == "PLAY") {
+    state_ = State::Playing;
+    backoffMs_ = options_.reconnectMinMs;
+    lastMediaMs_ = loop_->nowMs();
+    nextKeepaliveMs_ = lastMediaMs_ + sessionTimeoutSec_ * 1000 / 2;
+    NVR_INFO("rtsp %s: playing %zu track(s)", requestUrl_.c_str(), tracks_.size());
+    if (listener_) listener_->onRtspPlaying(this);
+  }
+}
+
+void RtspClient::handleDescribe(const RtspResponse& response) {
+  if (!parseSdp(response.body, &sdp_)) {
+    fail(-EPROTO);
+    return;
+  }
+  const std::string* base = response.header("Content-Base");
+  if (!base) base = response.header("Content-Location");
+  baseUrl_ = base ? *base : requestUrl_;
+
+  tracks_.clear();
+  for (const auto& media : sdp_.media) {
+    if (media.type != "video" && !(options_.setupAudio && media.type == "audio")) continue;
+    if (tracks_.size() >= 64) break;
+    Track track;
+    track.media = media;
+    track.controlUrl = resolveControlUrl(baseUrl_, media.control);
+    tracks_.push_back(std::move(track));
+  }
+  if (tracks_.empty()) {
+    NVR_WARN("rtsp %s: no usable media in SDP", requestUrl_.c_str());
+    fail(-EPROTO);
+    return;
+  }
+  if (!sdp_.control.empty()) baseUrl_ = resolveControlUrl(baseUrl_, sdp_.control);
+  setupIndex_ = 0;
+  sendSetup();
+}
+
+void RtspClient::sendSetup() {
+  Track& track = tracks_[setupIndex_];
+  int index = static_cast<int>(setupIndex_);
+  std::string transport;
+  if (options_.transport == RtspTransport::Tcp) {
+    track.rtpChannel = index * 2;
+    track.rtcpChannel = index * 2 + 1;
+    transport = "RTP/AVP/TCP;unicast;interleaved=" + std::to_string(track.rtpChannel) + "-" +
+                std::to_string(track.rtcpChannel);
+  } else if (sharedUdp_) {
+    // Routes are added once the camera names its server ports in the reply.
+    int port = sharedUdp_->rtpPort();
+    transport = "RTP/AVP;unicast;client_port=" + std::to_string(port) + "-" +
+                std::to_string(port + 1);
+  } else {
+    int rtpFd = -1, rtcpFd = -1;
+    int port = udpBindPair(server_.family(), &rtpFd, &rtcpFd);
+    if (port < 0) {
+      fail(port);
+      return;
+    }
+    setRecvBufferSize(rtpFd, 1024 * 1024);
+    track.rtp.reset(new UdpChannel(this, index, false));
+    track.rtcp.reset(new UdpChannel(this, index, true));
+    track.rtp->open(rtpFd, kRtpRingSlots);
+    track.rtcp->open(rtcpFd, kRtcpRingSlots);
+    transport = "RTP/AVP;unicast;client_port=" + std::to_string(port) + "-" +
+                std::to_string(port + 1);
+  }
+  sendRequest("SETUP", track.controlUrl, {{"Transport", transport}});
+}
+
+void RtspClient::handleSetup(const RtspResponse& response) {
+  const std::string* session = response.header("Session");
+  if (session) {
+    // "id;timeout=60"; the id is case-sensitive so it is not taken from
+    // splitParameters(), which lowercases keys.
+    session_ = session->substr(0, session->find(';'));
+    for (const auto& kv : splitParameters(*session)) {
+      int timeout = kv.first == "timeout" ? atoi(kv.second.c_str()) : 0;
+      if (timeout > 0) sessionTimeoutSec_ = timeout;
+    }
+  }
+
+  Track& track = tracks_[setupIndex_];
+  const std::string* transport = response.header("Transport");
+  if (transport && options_.transport == RtspTransport::Tcp) {
+    // The server may pick different channels than we asked for.
+    for (const auto& kv : splitParameters(*transport)) {
+      if (kv.first == "interleaved") {
+        track.rtpChannel = atoi(kv.second.c_str());
+        size_t dash = kv.second.find('-');
+        track.rtcpChannel = dash == std::string::npos ? track.rtpChannel + 1
+                                                      : atoi(kv.second.c_str() + dash + 1);
+      }
+    }
+  }
+  if (options_.transport == RtspTransport::Udp) {
+    // Without server_port only the camera's address can be matched, and
+    // RTCP cannot be sent back.
+    uint16_t rtpPort = 0, rtcpPort = 0;
+    for (const auto& kv : splitParameters(transport ? *transport : std::string())) {
+      if (kv.first != "server_port") continue;
+      int port = atoi(kv.second.c_str());
+      size_t dash = kv.second.find('-');
+      rtpPort = static_cast<uint16_t>(port);
+      rtcpPort = static_cast<uint16_t>(
+          dash == std::string::npos ? port + 1 : atoi(kv.second.c_str() + dash + 1));
+    }
+    track.serverRtcpPort = rtcpPort;
+    if (sharedUdp_) {
+      SocketAddress rtpSource = server_, rtcpSource = server_;
+      rtpSource.setPort(rtpPort);
+      rtcpSource.setPort(rtcpPort);
+      track.rtp.reset(new UdpChannel(this, static_cast<int>(setupIndex_), false));
+      track.rtcp.reset(new UdpChannel(this, static_cast<int>(setupIndex_), true));
+      track.rtp->attach(sharedUdp_, rtpSource);
+      track.rtcp->attach(sharedUdp_, rtcpSource);
+    }
+  }
+  if (options_.transport == RtspTransport::Tcp) {
+    if (track.rtpChannel >= 0 && track.rtpChannel < 256)
+      channelToTrack_[track.rtpChannel] = static_cast<int8_t>(setupIndex_ << 1);
+    if (track.rtcpChannel >= 0 && track.rtcpChannel < 256)
+      channelToTrack_[track.rtcpChannel] = static_cast<int8_t>((setupIndex_ << 1) | 1);
+  }
+
+  if (++setupIndex_ < tracks_.size()) {
+    sendSetup();
+    return;
+  }
+  sendRequest("PLAY", baseUrl_, {{"Range", "npt=0.000-"}});
+}
+
+void RtspClient::sendKeepalive() {
+  nextKeepaliveMs_ = loop_->nowMs() + sessionTimeoutSec_ * 1000 / 2;
+  sendRequest(supportsGetParameter_ ? "GET_PARAMETER" : "OPTIONS", baseUrl_);
+}
+
+void RtspClient::sendRequest(const std::string& method, const std::string& uri,
+                             HeaderList headers) {
+  pendingMethod_ = method;
+  pendingUri_ = uri;
+  pendingHeaders_ = headers;
+  pendingCseq_ = ++cseq_;
+  pendingDeadlineMs_ = loop_->nowMs() + options_.requestTimeoutMs;
+  headers.emplace_back("User-Agent", kUserAgent);
+  if (!session_.empty()) headers.emplace_back("Session", session_);
+  if (auth_.active()) headers.emplace_back("Authorization", auth_.authorization(method, uri));
+  queueOutput(buildRtspRequest(method, uri, pendingCseq_, headers));
+}
+
+void RtspClient::resendWithAuth() { sendRequest(pendingMethod_, pendingUri_, pendingHeaders_); }
+
+void RtspClient::queueOutput(const std::string& data) {
+  if (fd_ < 0) return;
+  if (output_.empty()) {
+    ssize_t n = ::send(fd_, data.data(), data.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno != EAGAIN) {
+      fail(-errno);
+      return;
+    }
+    if (n < 0) n = 0;
+    if (static_cast<size_t>(n) == data.size()) return;
+    output_.append(data.data() + n, data.size() - n);
+  } else {
+    output_.append(data);
+  }
+  if (!wantWrite_) {
+    wantWrite_ = true;
+    loop_->modify(fd_, EPOLLIN | EPOLLOUT, this);
+  }
+}
+
+}  // namespace nvr
@@ -0,0 +1,197 @@
+// Non-blocking RTSP client session (RFC 2326) pulling one camera stream.
+//
+// A client lives on one EventLoop and is only touched from that loop's
+// thread. It runs OPTIONS/DESCRIBE/SETUP/PLAY, keeps the session alive with
+// GET_PARAMETER (or OPTIONS), watches for media timeouts and reconnects with
+// exponential backoff. RTP is received interleaved on the RTSP connection
+// or on a UDP port pair per track; RTCP goes back the same way.
+
+#ifndef NVR_RTSP_RTSP_CLIENT_H
+#define NVR_RTSP_RTSP_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/event_loop.h"
+#include "base/packet_buffer.h"
+#include "base/socket_util.h"
+#include "base/url.h"
+#include "rtp/shared_udp_port.h"
+#include "rtp/udp_receiver.h"
+#include "rtsp/rtsp_auth.h"
+#include "rtsp/rtsp_message.h"
+#include "rtsp/sdp.h"
+
+namespace nvr {
+
+class RtspClient;
+
+enum class RtspTransport { Tcp, Udp };
+
+struct RtspClientOptions {
+  RtspTransport transport = RtspTransport::Tcp;
+  bool setupAudio = true;
+  uint32_t connectTimeoutMs = 5000;
+  uint32_t requestTimeoutMs = 5000;
+  // No media for this long tears the session down and reconnects.
+  uint32_t receiveTimeoutMs = 10000;
+  uint32_t reconnectMinMs = 1000;
+  uint32_t reconnectMaxMs = 30000;
+};
+
+class RtspClientListener {
+ public:
+  virtual ~RtspClientListener() = default;
+
+  virtual void onRtspPlaying(RtspClient* client) {}
+  // packet references the receive buffer; keep a copy of the ref (not of the
+  // bytes) to hold on to it.
+  virtual void onRtpPacket(RtspClient* client, int track, const PacketRef& packet) = 0;
+  virtual void onRtcpPacket(RtspClient* client, int track, const PacketRef& packet) {}
+  // Called after each batch of packets taken from one socket read, so that
+  // listeners can flush batched output once per read instead of per packet.
+  virtual void onReceiveBatchDone(RtspClient* client) {}
+  // error is -errno style; the client retries on its own unless stopped.
+  virtual void onRtspDisconnected(RtspClient* client, int error) {}
+};
+
+class RtspClient : public EventHandler {
+ public:
+  enum class State { Idle, Connecting, Handshaking, Playing, Waiting, Stopped };
+
+  struct Stats {
+    uint64_t rtpPackets = 0;
+    uint64_t rtpBytes = 0;
+    uint64_t rtcpPackets = 0;
+    uint64_t rtcpSent = 0;
+    uint32_t reconnects = 0;
+    // Bytes of partial packets moved when a stream chunk fills up; the only
+    // copy on the receive path.
+    uint64_t bytesCarried = 0;
+  };
+
+  class UdpChannel;
+
+  struct Track {
+    SdpMedia media;
+    std::string controlUrl;
+    int rtpChannel = -1;
+    int rtcpChannel = -1;
+    uint16_t serverRtcpPort = 0;  // UDP, if the camera named it in SETUP
+    std::unique_ptr<UdpChannel> rtp;
+    std::unique_ptr<UdpChannel> rtcp;
+
+    Track();
+    Track(Track&&) noexcept;
+    ~Track();
+  };
+
+  // pools must belong to loop and outlive the client and every PacketRef
+  // it hands out.
+  RtspClient(EventLoop* loop, PacketPools* pools, const std::string& url,
+             const RtspClientOptions& options, RtspClientListener* listener);
+  ~RtspClient() override;
+
+  RtspClient(const RtspClient&) = delete;
+  RtspClient& operator=(const RtspClient&) = delete;
+
+  // UDP sessions then receive on the loop's shared port pair instead of
+  // binding their own. Call before start().
+  void setSharedUdpPort(SharedUdpPort* port) { sharedUdp_ = port; }
+
+  // Starts connecting. Symbolic host names are resolved here, blocking.
+  void start();
+  // Sends a best-effort TEARDOWN and closes. No callbacks after this.
+  void stop();
+  // Sends an RTCP packet for a track to the camera while playing: on the
+  // track's interleaved channel, or to its UDP RTCP port. 0 or -errno.
+  int sendRtcp(int track, const std::string& packet);
+
+  State state() const { return state_; }
+  const std::string& url() const { return urlText_; }
+  const SessionDescription& sdp() const { return sdp_; }
+  const std::vector<Track>& tracks() const { return tracks_; }
+  const Stats& stats() const { return stats_; }
+  // Receive counters of per-session UDP sockets, including closed ones.
+  UdpReceiverStats udpStats() const;
+  EventLoop* loop() const { return loop_; }
+
+  void onEvents(uint32_t events) override;
+
+ private:
+  void connect();
+  void fail(int error);
+  void closeTransport();
+  void tick();
+
+  void handleReadable();
+  void handleWritable();
+  bool ensureChunkSpace();
+  void releaseChunk();
+  void parseInput();
+  void handleResponse(const RtspResponse& response);
+  void handleDescribe(const RtspResponse& response);
+  void handleSetup(const RtspResponse& response);
+  void deliverPacket(int track, bool rtcp, const PacketRef& packet);
+
+  void sendRequest(const std::string& method, const std::string& uri,
+                   HeaderList headers = HeaderList());
+  void resendWithAuth();
+  void sendSetup();
+  void sendKeepalive();
+  void queueOutput(const std::string& data);
+
+  EventLoop* loop_;
+  PacketPools* pools_;
+  RtspClientOptions options_;
+  RtspClientListener* listener_;
+  std::string urlText_;
+  Url url_;
+  std::string requestUrl_;  // url_ without credentials
+  SocketAddress server_;
+  RtspAuth auth_;
+  SharedUdpPort* sharedUdp_ = nullptr;
+  UdpReceiverStats retiredUdpStats_;
+
+  State state_ = State::Idle;
+  int fd_ = -1;
+  bool wantWrite_ = false;
+  // Stream input is read straight into a pooled chunk; interleaved packets
+  // are handed out as slices of it.
+  PacketBuffer* chunk_ = nullptr;
+  size_t chunkStart_ = 0;  // first unparsed byte
+  size_t chunkEnd_ = 0;    // end of received data
+  ByteBuffer output_;
+
+  int cseq_ = 0;
+  int pendingCseq_ = -1;
+  std::string pendingMethod_;
+  std::string pendingUri_;
+  HeaderList pendingHeaders_;
+  uint64_t pendingDeadlineMs_ = 0;
+
+  SessionDescription sdp_;
+  std::string baseUrl_;
+  std::vector<Track> tracks_;
+  size_t setupIndex_ = 0;
+  int8_t channelToTrack_[256];
+  std::string session_;
+  uint32_t sessionTimeoutSec_ = 60;
+  bool supportsGetParameter_ = false;
+
+  EventLoop::TimerId tickTimer_ = 0;
+  uint64_t lastMediaMs_ = 0;
+  uint64_t nextKeepaliveMs_ = 0;
+  uint64_t reconnectAtMs_ = 0;
+  uint32_t backoffMs_ = 0;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_RTSP_RTSP_CLIENT_H
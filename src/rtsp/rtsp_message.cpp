@@ -0,0 +1,197 @@
+#include "rtsp/rtsp_message.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace nvr {
+
+namespace {
+
+// Upper bound on header block size; anything larger is treated as garbage.
+constexpr size_t kMaxHeaderBytes = 64 * 1024;
+
+std::string trim(const std::string& s) {
+  size_t b = 0, e = s.size();
+  while (b < e && isspace(static_cast<unsigned char>(s[b]))) ++b;
+  while (e > b && isspace(static_cast<unsigned char>(s[e - 1]))) --e;
+  return s.substr(b, e - b);
+}
+
+const std::string* findHeader(const HeaderList& headers, const char* name) {
+  for (const auto& h : headers)
+    if (equalsIgnoreCase(h.first, name)) return &h.second;
+  return nullptr;
+}
+
+// Parses the header lines after the start line. Returns total message length
+// (including body), 0 if incomplete, -1 if malformed.
+int parseMessage(const char* data, size_t len, std::string* startLine, HeaderList* headers,
+                 std::string* body) {
+  const char* end = static_cast<const char*>(memmem(data, len, "\r\n\r\n", 4));
+  if (end == nullptr) return len > kMaxHeaderBytes ? -1 : 0;
+  size_t headerLen = end - data + 4;
+  // Whether or not it arrived in one read.
+  if (headerLen > kMaxHeaderBytes) return -1;
+
+  headers->clear();
+  const char* p = data;
+  const char* lineEnd = static_cast<const char*>(memmem(p, headerLen, "\r\n", 2));
+  startLine->assign(p, lineEnd - p);
+  p = lineEnd + 2;
+  size_t contentLength = 0;
+  while (p < end) {
+    lineEnd = static_cast<const char*>(memmem(p, end + 2 - p, "\r\n", 2));
+    std::string line(p, lineEnd - p);
+    p = lineEnd + 2;
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) continue;
+    headers->emplace_back(trim(line.substr(0, colon)), trim(line.substr(colon + 1)));
+    if (equalsIgnoreCase(headers->back().first, "Content-Length"))
+      contentLength = strtoul(headers->back().second.c_str(), nullptr, 10);
+  }
+  if (contentLength > 16 * 1024 * 1024) return -1;
+  if (len < headerLen + contentLength) return 0;
+  body->assign(data + headerLen, contentLength);
+  return static_cast<int>(headerLen + contentLength);
+}
+
+}  // namespace
+
+bool equalsIgnoreCase(const std::string& a, const char* b) { return strcasecmp(a.c_str(), b) == 0; }
+
+const std::string* RtspResponse::header(const char* name) const { return findHeader(headers, name); }
+
+int RtspResponse::cseq() const {
+  const std::string* v = header("CSeq");
+  return v ? atoi(v->c_str()) : -1;
+}
+
+const std::string* RtspRequest::header(const char* name) const { return findHeader(headers, name); }
+
+int RtspRequest::cseq() const {
+  const std::string* v = header("CSeq");
+  return v ? atoi(v->c_str()) : -1;
+}
+
+int parseRtspResponse(const char* data, size_t len, RtspResponse* out) {
+  std::string startLine;
+  int n = parseMessage(data, len, &startLine, &out->headers, &out->body);
+  if (n <= 0) return n;
+  // RTSP/1.0 200 OK
+  if (startLine.compare(0, 5, "RTSP/") != 0) return -1;
+  size_t sp = startLine.find(' ');
+  if (sp == std::string::npos) return -1;
+  out->status = atoi(startLine.c_str() + sp + 1);
+  size_t sp2 = startLine.find(' ', sp + 1);
+  out->reason = sp2 == std::string::npos ? "" : startLine.substr(sp2 + 1);
+  return out->status > 0 ? n : -1;
+}
+
+int parseRtspRequest(const char* data, size_t len, RtspRequest* out) {
+  std::string startLine;
+  int n = parseMessage(data, len, &startLine, &out->headers, &out->body);
+  if (n <= 0) return n;
+  // DESCRIBE rtsp://host/path RTSP/1.0
+  size_t sp = startLine.find(' ');
+  size_t sp2 = startLine.rfind(' ');
+  if (sp == std::string::npos || sp2 == sp) return -1;
+  out->method = startLine.substr(0, sp);
+  out->uri = startLine.substr(sp + 1, sp2 - sp - 1);
+  if (startLine.compare(sp2 + 1, 5, "RTSP/") != 0) return -1;
+  return n;
+}
+
+std::string buildRtspRequest(const std::string& method, const std::string& uri, int cseq,
+                             const HeaderList& headers, const std::string& body) {
+  std::string out;
+  out.reserve(256 + body.size());
+  out += method;
+  out += ' ';
+  out += uri;
+  out += " RTSP/1.0\r\nCSeq: ";
+  out += std::to_string(cseq);
+  out += "\r\n";
+  for (const auto& h : headers) {
+    out += h.first;
+    out += ": ";
+    out += h.second;
+    out += "\r\n";
+  }
+  if (!body.empty()) {
+    out += "Content-Length: ";
+    out += std::to_string(body.size());
+    out += "\r\n";
+  }
+  out += "\r\n";
+  out += body;
+  return out;
+}
+
+std::string buildRtspResponse(int status, int cseq, const HeaderList& headers,
+                              const std::string& body) {
+  const char* reason;
+  switch (status) {
+    case 200: reason = "OK"; break;
+    case 400: reason = "Bad Request"; break;
+    case 404: reason = "Not Found"; break;
+    case 405: reason = "Method Not Allowed"; break;
+    case 454: reason = "Session Not Found"; break;
+    case 455: reason = "Method Not Valid in This State"; break;
+    case 459: reason = "Aggregate Operation Not Allowed"; break;
+    case 461: reason = "Unsupported Transport"; break;
+    case 501: reason = "Not Implemented"; break;
+    case 503: reason = "Service Unavailable"; break;
+    default: reason = status < 300 ? "OK" : status < 500 ? "Client Error" : "Server Error";
+  }
+  std::string out;
+  out.reserve(128 + body.size());
+  out += "RTSP/1.0 ";
+  out += std::to_string(status);
+  out += ' ';
+  out += reason;
+  out += "\r\nCSeq: ";
+  out += std::to_string(cseq);
+  out += "\r\n";
+  for (const auto& h : headers) {
+    out += h.first;
+    out += ": ";
+    out += h.second;
+    out += "\r\n";
+  }
+  if (!body.empty()) {
+    out += "Content-Length: ";
+    out += std::to_string(body.size());
+    out += "\r\n";
+  }
+  out += "\r\n";
+  out += body;
+  return out;
+}
+
+HeaderList splitParameters(const std::string& value, char separator) {
+  HeaderList out;
+  size_t start = 0;
+  while (start <= value.size()) {
+    // A separator inside a quoted value, e.g. realm="Camera, Inc", is part
+    // of the value.
+    size_t end = start;
+    bool quoted = false;
+    for (; end < value.size() && (quoted || value[end] != separator); ++end)
+      if (value[end] == '"') quoted = !quoted;
+    std::string item = trim(value.substr(start, end - start));
+    if (!item.empty()) {
+      size_t eq = item.find('=');
+      std::string key = trim(item.substr(0, eq));
+      for (auto& c : key) c = tolower(c);
+      std::string val = eq == std::string::npos ? "" : trim(item.substr(eq + 1));
+      if (val.size() >= 2 && val.front() == '"' && val.back() == '"')
+        val = val.substr(1, val.size() - 2);
+      out.emplace_back(key, val);
+    }
+    start = end + 1;
+  }
+  return out;
+}
+
+}  // namespace nvr
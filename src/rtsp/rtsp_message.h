@@ -0,0 +1,59 @@
+// RTSP/1.0 message framing (RFC 2326).
+
+#ifndef NVR_RTSP_RTSP_MESSAGE_H
+#define NVR_RTSP_RTSP_MESSAGE_H
+
+#include <stddef.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace nvr {
+
+using HeaderList = std::vector<std::pair<std::string, std::string>>;
+
+struct RtspResponse {
+  int status = 0;
+  std::string reason;
+  HeaderList headers;
+  std::string body;
+
+  // Case-insensitive header lookup; nullptr when absent.
+  const std::string* header(const char* name) const;
+  int cseq() const;
+};
+
+struct RtspRequest {
+  std::string method;
+  std::string uri;
+  HeaderList headers;
+  std::string body;
+
+  const std::string* header(const char* name) const;
+  int cseq() const;
+};
+
+// Parse one message from the front of data. Returns the number of bytes
+// consumed, 0 when more data is needed, or -1 for a malformed message.
+int parseRtspResponse(const char* data, size_t len, RtspResponse* out);
+int parseRtspRequest(const char* data, size_t len, RtspRequest* out);
+
+std::string buildRtspRequest(const std::string& method, const std::string& uri, int cseq,
+                             const HeaderList& headers, const std::string& body = "");
+
+// Status line "RTSP/1.0 <status> <reason>", CSeq, headers, Content-Length
+// when there is a body. The reason phrase is the standard one for status.
+std::string buildRtspResponse(int status, int cseq, const HeaderList& headers,
+                              const std::string& body = "");
+
+bool equalsIgnoreCase(const std::string& a, const char* b);
+
+// Splits "a;b=c;d" style parameter lists (Transport, Session headers). Keys
+// are lowercased; values keep their case and lose surrounding quotes, and a
+// separator inside quotes does not split.
+HeaderList splitParameters(const std::string& value, char separator = ';');
+
+}  // namespace nvr
+
+#endif  // NVR_RTSP_RTSP_MESSAGE_H
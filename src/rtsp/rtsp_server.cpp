@@ -0,0 +1,560 @@
+#include "rtsp/rtsp_server.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <random>
+#include <unordered_map>
+
+#include "base/byte_buffer.h"
+#include "base/log.h"
+#include "base/socket_util.h"
+#include "media/nal.h"
+#include "rtsp/rtsp_message.h"
+
+namespace nvr {
+
+namespace {
+
+constexpr size_t kMaxRequestBytes = 64 * 1024;
+constexpr const char* kTrackPrefix = "trackID=";
+constexpr const char* kPublic = "OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER";
+
+// "rtsp://host:port/live/cam?x=1" -> "/live/cam?x=1".
+std::string uriPath(const std::string& uri) {
+  size_t scheme = uri.find("://");
+  if (scheme == std::string::npos) return uri;
+  size_t slash = uri.find('/', scheme + 3);
+  return slash == std::string::npos ? "/" : uri.substr(slash);
+}
+
+// Splits ".../trackID=<n>" off a SETUP path; -1 when there is none.
+int splitTrack(std::string* path) {
+  size_t slash = path->rfind('/');
+  if (slash == std::string::npos || path->compare(slash + 1, strlen(kTrackPrefix), kTrackPrefix))
+    return -1;
+  int track = atoi(path->c_str() + slash + 1 + strlen(kTrackPrefix));
+  path->resize(slash);
+  return track;
+}
+
+// Scale or Speed of a PLAY, limited to what the provider plays at; 1 when
+// absent or unusable.
+double playScale(const RtspRequest& request, double maxScale) {
+  const std::string* value = request.header("Scale");
+  if (value == nullptr) value = request.header("Speed");
+  if (value == nullptr) return 1;
+  char* stop = nullptr;
+  double scale = strtod(value->c_str(), &stop);
+  if (stop == value->c_str() || !std::isfinite(scale) || scale == 0) return 1;
+  scale = std::max(-maxScale, std::min(maxScale, scale));
+  // Slower than 1/32 is as good as paused.
+  if (std::fabs(scale) < 1.0 / 32) scale = scale < 0 ? -1.0 / 32 : 1.0 / 32;
+  return scale;
+}
+
+}  // namespace
+
+void RtspServerStats::add(const RtspServerStats& other) {
+  accepted += other.accepted;
+  connections += other.connections;
+  described += other.described;
+  played += other.played;
+  notFound += other.notFound;
+  badRequests += other.badRequests;
+  timeouts += other.timeouts;
+  acceptErrors += other.acceptErrors;
+}
+
+// Accepts on one loop and owns that loop's connections until PLAY.
+class RtspServer::Listener : public EventHandler,
+                             public std::enable_shared_from_this<Listener> {
+ public:
+  Listener(RtspServer* server, EventLoop* loop, int fd)
+      : server_(server), loop_(loop), fd_(fd), rng_(std::random_device()() + loop->index()) {}
+  ~Listener() override;
+
+  void start();
+  void shutdown();
+  void onEvents(uint32_t events) override;
+
+  Connection* find(uint64_t id);
+  void drop(uint64_t id);
+  std::string newSessionId();
+
+  RtspServer* server() const { return server_; }
+  EventLoop* loop() const { return loop_; }
+  RtspServerStats& stats() { return stats_; }
+
+ private:
+  void sweep();
+
+  RtspServer* server_;
+  EventLoop* loop_;
+  int fd_;
+  std::mt19937_64 rng_;
+  uint64_t nextId_ = 1;
+  std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections_;
+  EventLoop::TimerId sweepTimer_ = 0;
+  RtspServerStats stats_;
+};
+
+// One viewer connection from accept to PLAY.
+class RtspServer::Connection : public EventHandler {
+ public:
+  Connection(Listener* listener, int fd, uint64_t id)
+      : listener_(listener), fd_(fd), id_(id), createdMs_(listener->loop()->nowMs()) {}
+  ~Connection() override { closeFd(); }
+
+  bool open() { return listener_->loop()->add(fd_, EPOLLIN, this) == 0; }
+  uint64_t createdMs() const { return createdMs_; }
+  bool describing() const { return describing_; }
+  void closeFd();
+
+  void onEvents(uint32_t events) override;
+  void onDescribed(int status, const std::vector<SdpMedia>& media);
+
+ private:
+  void parseInput();
+  void handle(const RtspRequest& request);
+  void describe(const RtspRequest& request);
+  void setup(const RtspRequest& request);
+  void play(const RtspRequest& request);
+  void respond(int status, int cseq, HeaderList headers = HeaderList(),
+               const std::string& body = "");
+  void flushOutput();
+
+  Listener* listener_;
+  int fd_;
+  const uint64_t id_;
+  const uint64_t createdMs_;
+  ByteBuffer input_{4096};
+  ByteBuffer output_{4096};
+  bool wantWrite_ = false;
+  bool closing_ = false;  // after TEARDOWN, once the reply is out
+
+  bool describing_ = false;
+  int describeCseq_ = 0;
+  std::string describeUri_;
+  RtspMediaProvider* provider_ = nullptr;
+  std::string path_;   // described path, with its query
+  std::string rest_;   // after the provider's prefix, without the query
+  std::string query_;
+  std::vector<SdpMedia> media_;
+  std::vector<RtspSessionTrack> tracks_;
+  std::string sessionId_;
+};
+
+void RtspServer::Connection::closeFd() {
+  if (fd_ < 0) return;
+  listener_->loop()->remove(fd_);
+  ::close(fd_);
+  fd_ = -1;
+}
+
+void RtspServer::Connection::onEvents(uint32_t events) {
+  if (fd_ < 0) return;
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    listener_->drop(id_);
+    return;
+  }
+  if (events & EPOLLOUT) {
+    flushOutput();
+    if (fd_ < 0) return;
+  }
+  if (events & EPOLLIN) {
+    for (;;) {
+      ssize_t n = input_.readFd(fd_, 16 * 1024);
+      if (n > 0) continue;
+      if (n == 0 || (n != -EAGAIN && n != -EINTR)) {
+        listener_->drop(id_);
+        return;
+      }
+      break;
+    }
+    parseInput();
+  }
+}
+
+void RtspServer::Connection::parseInput() {
+  // One request at a time: the next waits while a DESCRIBE is answered.
+  while (fd_ >= 0 && !describing_ && !closing_ && !input_.empty()) {
+    if (input_.data()[0] == '$') {
+      // Interleaved data before PLAY; nothing to do with it.
+      if (input_.size() < 4) return;
+      size_t length = static_cast<size_t>(input_.data()[2] << 8 | input_.data()[3]);
+      if (input_.size() < 4 + length) return;
+      input_.consume(4 + length);
+      continue;
+    }
+    RtspRequest request;
+    int n = parseRtspRequest(reinterpret_cast<const char*>(input_.data()), input_.size(),
+                             &request);
+    if (n < 0 || (n == 0 && input_.size() > kMaxRequestBytes)) {
+      ++listener_->stats().badRequests;
+      listener_->drop(id_);
+      return;
+    }
+    if (n == 0) return;
+    input_.consume(static_cast<size_t>(n));
+    handle(request);
+  }
+}
+
+void RtspServer::Connection::handle(const RtspRequest& request) {
+  const std::string& method = request.method;
+  int cseq = request.cseq();
+  if (method == "OPTIONS") {
+    respond(200, cseq, {{"Public", kPublic}});
+  } else if (method == "DESCRIBE") {
+    describe(request);
+  } else if (method == "SETUP") {
+    setup(request);
+  } else if (method == "PLAY") {
+    play(request);
+  } else if (method == "TEARDOWN") {
+    respond(200, cseq);
+    closing_ = true;
+    flushOutput();
+  } else if (method == "GET_PARAMETER" || method == "SET_PARAMETER") {
+    respond(200, cseq);
+  } else {
+    ++listener_->stats().badRequests;
+    respond(method == "ANNOUNCE" || method == "RECORD" ? 405 : 501, cseq, {{"Public", kPublic}});
+  }
+}
+
+void RtspServer::Connection::describe(const RtspRequest& request) {
+  std::string path = uriPath(request.uri);
+  std::string rest;
+  RtspMediaProvider* provider = listener_->server()->route(path, &rest);
+  if (provider == nullptr) {
+    ++listener_->stats().notFound;
+    respond(404, request.cseq());
+    return;
+  }
+  std::string query;
+  size_t mark = rest.find('?');
+  if (mark != std::string::npos) {
+    query = rest.substr(mark + 1);
+    rest.resize(mark);
+  }
+  describing_ = true;
+  describeCseq_ = request.cseq();
+  describeUri_ = request.uri;
+  provider_ = provider;
+  path_ = path;
+  rest_ = rest;
+  query_ = query;
+  // The answer may come from another loop, after this connection is gone.
+  std::weak_ptr<Listener> weak = listener_->shared_from_this();
+  EventLoop* loop = listener_->loop();
+  uint64_t id = id_;
+  provider->describe(rest, query, [weak, loop, id](int status, const std::vector<SdpMedia>& m) {
+    loop->post([weak, id, status, m] {
+      std::shared_ptr<Listener> listener = weak.lock();
+      if (!listener) return;
+      if (Connection* c = listener->find(id)) c->onDescribed(status, m);
+    });
+  });
+}
+
+void RtspServer::Connection::onDescribed(int status, const std::vector<SdpMedia>& media) {
+  describing_ = false;
+  if (status != 200 || media.empty()) {
+    ++listener_->stats().notFound;
+    respond(status == 200 ? 404 : status, describeCseq_);
+  } else {
+    ++listener_->stats().described;
+    media_ = media;
+    tracks_.assign(media_.size(), RtspSessionTrack());
+    for (size_t i = 0; i < media_.size(); ++i) {
+      media_[i].control = kTrackPrefix + std::to_string(i);
+      if (media_[i].type == "video") tracks_[i].codec = videoCodecFromEncoding(media_[i].encoding);
+    }
+    std::string base = describeUri_;
+    if (base.empty() || base.back() != '/') base += '/';
+    respond(200, describeCseq_,
+            {{"Content-Base", base}, {"Content-Type", "application/sdp"}},
+            buildSdp("openNVR " + rest_, media_));
+  }
+  parseInput();
+}
+
+void RtspServer::Connection::setup(const RtspRequest& request) {
+  int cseq = request.cseq();
+  std::string path = uriPath(request.uri);
+  int track = splitTrack(&path);
+  if (media_.empty() || track < 0 || static_cast<size_t>(track) >= media_.size() ||
+      path != path_) {
+    // Only tracks of the stream described on this connection.
+    ++listener_->stats().notFound;
+    respond(media_.empty() ? 455 : 404, cseq);
+    return;
+  }
+  const std::string* session = request.header("Session");
+  if (session && !sessionId_.empty() &&
+      session->compare(0, sessionId_.size(), sessionId_) != 0) {
+    respond(454, cseq);
+    return;
+  }
+  const std::string* transport = request.header("Transport");
+  int channel = -1;
+  bool tcp = false;
+  if (transport) {
+    // The first transport the client offers that is interleaved RTP.
+    for (const auto& option : splitParameters(*transport, ',')) {
+      std::string spec = option.first + (option.second.empty() ? "" : "=" + option.second);
+      HeaderList params = splitParameters(spec);
+      if (params.empty() || !equalsIgnoreCase(params[0].first, "rtp/avp/tcp")) continue;
+      tcp = true;
+      for (const auto& p : params)
+        if (p.first == "interleaved") channel = atoi(p.second.c_str());
+      break;
+    }
+  }
+  if (!tcp) {
+    // UDP would need its own pacing and loss handling; viewers use TCP.
+    ++listener_->stats().badRequests;
+    respond(461, cseq);
+    return;
+  }
+  if (channel < 0 || channel > 254) channel = track * 2;
+  tracks_[track].channel = channel;
+  if (sessionId_.empty()) sessionId_ = listener_->newSessionId();
+  char spec[96];
+  snprintf(spec, sizeof(spec), "RTP/AVP/TCP;unicast;interleaved=%d-%d", channel, channel + 1);
+  respond(200, cseq, {{"Transport", spec}, {"Session", sessionId_ + ";timeout=60"}});
+}
+
+void RtspServer::Connection::play(const RtspRequest& request) {
+  int cseq = request.cseq();
+  bool ready = false;
+  for (const auto& t : tracks_) ready = ready || t.channel >= 0;
+  if (!ready) {
+    respond(455, cseq);
+    return;
+  }
+  RtspPlayRequest handoff;
+  handoff.path = rest_;
+  handoff.query = query_;
+  handoff.sessionId = sessionId_;
+  handoff.cseq = cseq;
+  handoff.tracks = tracks_;
+  handoff.scale = playScale(request, provider_->maxScale());
+  HeaderList headers = {{"Session", sessionId_}, {"Range", "npt=0.000-"}};
+  if (request.header("Scale") || request.header("Speed")) {
+    char scale[32];
+    snprintf(scale, sizeof(scale), "%g", handoff.scale);
+    headers.emplace_back(request.header("Scale") ? "Scale" : "Speed", scale);
+  }
+  // Replies not written yet go first, then the PLAY reply, then media.
+  handoff.response.assign(reinterpret_cast<const char*>(output_.data()), output_.size());
+  handoff.response += buildRtspResponse(200, cseq, headers);
+  handoff.input.assign(reinterpret_cast<const char*>(input_.data()), input_.size());
+  listener_->loop()->remove(fd_);
+  handoff.fd = fd_;
+  fd_ = -1;
+  ++listener_->stats().played;
+  RtspMediaProvider* provider = provider_;
+  listener_->drop(id_);
+  provider->play(std::move(handoff));
+}
+
+void RtspServer::Connection::respond(int status, int cseq, HeaderList headers,
+                                     const std::string& body) {
+  if (fd_ < 0) return;
+  output_.append(buildRtspResponse(status, cseq, headers, body));
+  flushOutput();
+}
+
+void RtspServer::Connection::flushOutput() {
+  while (fd_ >= 0 && !output_.empty()) {
+    ssize_t n = output_.writeFd(fd_);
+    if (n >= 0) continue;
+    if (n == -EAGAIN || n == -EINTR) {
+      if (!wantWrite_) {
+        wantWrite_ = true;
+        listener_->loop()->modify(fd_, EPOLLIN | EPOLLOUT, this);
+      }
+      return;
+    }
+    listener_->drop(id_);
+    return;
+  }
+  if (fd_ < 0) return;
+  if (closing_) {
+    listener_->drop(id_);
+    return;
+  }
+  if (wantWrite_) {
+    wantWrite_ = false;
+    listener_->loop()->modify(fd_, EPOLLIN, this);
+  }
+}
+
+RtspServer::Listener::~Listener() {
+  if (fd_ >= 0) ::close(fd_);
+}
+
+void RtspServer::Listener::start() {
+  loop_->add(fd_, EPOLLIN, this);
+  sweepTimer_ = loop_->runEvery(1000, [this] { sweep(); });
+}
+
+void RtspServer::Listener::shutdown() {
+  if (fd_ >= 0) {
+    loop_->remove(fd_);
+    ::close(fd_);
+    fd_ = -1;
+  }
+  loop_->cancel(sweepTimer_);
+  for (auto& kv : connections_) loop_->deleteLater(kv.second.release());
+  connections_.clear();
+  stats_.connections = 0;
+}
+
+void RtspServer::Listener::onEvents(uint32_t events) {
+  if (fd_ < 0) return;
+  for (;;) {
+    int fd = ::accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // Typically EMFILE; the connection stays in the backlog for now.
+        ++stats_.acceptErrors;
+        NVR_DEBUG("rtsp server: accept: %s", strerror(errno));
+      }
+      return;
+    }
+    setNoDelay(fd);
+    uint64_t id = nextId_++;
+    std::unique_ptr<Connection> connection(new Connection(this, fd, id));
+    if (!connection->open()) continue;
+    connections_.emplace(id, std::move(connection));
+    ++stats_.accepted;
+    ++stats_.connections;
+  }
+}
+
+RtspServer::Connection* RtspServer::Listener::find(uint64_t id) {
+  auto it = connections_.find(id);
+  return it == connections_.end() ? nullptr : it->second.get();
+}
+
+void RtspServer::Listener::drop(uint64_t id) {
+  auto it = connections_.find(id);
+  if (it == connections_.end()) return;
+  Connection* connection = it->second.release();
+  connections_.erase(it);
+  --stats_.connections;
+  // It may be dropping itself, or have events left in this batch.
+  connection->closeFd();
+  loop_->deleteLater(connection);
+}
+
+std::string RtspServer::Listener::newSessionId() {
+  char id[17];
+  snprintf(id, sizeof(id), "%016llx", static_cast<unsigned long long>(rng_()));
+  return id;
+}
+
+void RtspServer::Listener::sweep() {
+  uint64_t now = loop_->nowMs();
+  uint32_t timeout = server_->options_.handshakeTimeoutMs;
+  std::vector<uint64_t> expired;
+  for (const auto& kv : connections_)
+    if (now - kv.second->createdMs() > timeout) expired.push_back(kv.first);
+  for (uint64_t id : expired) {
+    ++stats_.timeouts;
+    drop(id);
+  }
+}
+
+RtspServer::RtspServer(EventLoopPool* loops, const RtspServerOptions& options)
+    : loops_(loops), options_(options) {}
+
+RtspServer::~RtspServer() { stop(); }
+
+void RtspServer::addProvider(const std::string& prefix, RtspMediaProvider* provider) {
+  providers_.emplace_back(prefix, provider);
+}
+
+RtspMediaProvider* RtspServer::route(const std::string& path, std::string* rest) const {
+  for (const auto& p : providers_) {
+    if (path.compare(0, p.first.size(), p.first) != 0) continue;
+    *rest = path.substr(p.first.size());
+    return rest->empty() ? nullptr : p.second;
+  }
+  return nullptr;
+}
+
+int RtspServer::start() {
+  if (running_) return 0;
+  SocketAddress addr;
+  int rc = resolveAddress(options_.host, options_.port, &addr);
+  if (rc < 0) return rc;
+  std::vector<int> fds;
+  for (int i = 0; i < loops_->size(); ++i) {
+    // With port 0 the first listener picks the port and the others join it.
+    if (i > 0) addr.setPort(port_);
+    int fd = tcpListen(addr, 1024, true);
+    if (fd < 0) {
+      NVR_ERROR("rtsp server: cannot listen on %s: %s", addr.toString().c_str(), strerror(-fd));
+      for (int open : fds) ::close(open);
+      return fd;
+    }
+    if (i == 0) {
+      SocketAddress local;
+      port_ = localAddress(fd, &local) == 0 ? local.port() : options_.port;
+    }
+    fds.push_back(fd);
+  }
+  for (int i = 0; i < loops_->size(); ++i) {
+    std::shared_ptr<Listener> listener(new Listener(this, loops_->loop(i), fds[i]));
+    listeners_.push_back(listener);
+    loops_->loop(i)->post([listener] { listener->start(); });
+  }
+  running_ = true;
+  NVR_INFO("rtsp server: listening on port %u, %d loop(s)", port_, loops_->size());
+  return 0;
+}
+
+void RtspServer::stop() {
+  if (!running_) return;
+  running_ = false;
+  std::vector<std::future<void>> done;
+  for (auto& listener : listeners_) {
+    auto promise = std::make_shared<std::promise<void>>();
+    done.push_back(promise->get_future());
+    std::shared_ptr<Listener> l = listener;
+    l->loop()->post([l, promise] {
+      l->shutdown();
+      promise->set_value();
+    });
+  }
+  for (auto& f : done) f.wait();
+  listeners_.clear();
+}
+
+RtspServerStats RtspServer::stats() {
+  std::vector<std::future<RtspServerStats>> parts;
+  for (auto& listener : listeners_) {
+    auto promise = std::make_shared<std::promise<RtspServerStats>>();
+    parts.push_back(promise->get_future());
+    std::shared_ptr<Listener> l = listener;
+    l->loop()->post([l, promise] { promise->set_value(l->stats()); });
+  }
+  RtspServerStats total;
+  for (auto& f : parts) total.add(f.get());
+  return total;
+}
+
+}  // namespace nvr
@@ -0,0 +1,119 @@
+// RTSP server (RFC 2326) for viewers of live and recorded video.
+//
+// Every loop of a pool accepts on its own SO_REUSEPORT listener, so the
+// kernel spreads connections over the cores. A connection runs OPTIONS,
+// DESCRIBE, SETUP and PLAY on the loop that accepted it; RTP goes
+// interleaved on the same connection (RTP/AVP/TCP), which is what keeps
+// one viewer's backlog in one bounded queue of its own (see
+// rtsp_server_session.h). At PLAY the connection leaves the server: it is
+// handed, with its session state, to the media provider owning the path,
+// which streams to it from the loop the media lives on (the camera's loop
+// for live video).
+//
+// Paths are routed by prefix, e.g. "/live/" to the live relays and
+// "/replay/" to the archive; a provider sees the rest of the path. Track
+// controls are "trackID=<n>" relative to the DESCRIBE URL.
+
+#ifndef NVR_RTSP_RTSP_SERVER_H
+#define NVR_RTSP_RTSP_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/event_loop_pool.h"
+#include "rtsp/rtsp_server_session.h"
+#include "rtsp/sdp.h"
+
+namespace nvr {
+
+class RtspMediaProvider {
+ public:
+  using DescribeCallback = std::function<void(int status, const std::vector<SdpMedia>& media)>;
+
+  virtual ~RtspMediaProvider() = default;
+
+  // The tracks of path, or an RTSP status (404 for an unknown stream).
+  // media controls are ignored; done may be called on any thread.
+  virtual void describe(const std::string& path, const std::string& query,
+                        DescribeCallback done) = 0;
+  // Starts streaming to a viewer that sent PLAY, on whichever loop the
+  // media lives on (RtspServerSession). Owns request.fd from here on: a
+  // request it cannot serve goes to rejectRtspPlay().
+  virtual void play(RtspPlayRequest request) = 0;
+  // Largest Scale (RFC 2326 12.34) the provider plays at, either way; a
+  // PLAY asking for more is granted this much. 1 for media that only
+  // plays forward in real time.
+  virtual double maxScale() const { return 1; }
+};
+
+struct RtspServerOptions {
+  std::string host = "0.0.0.0";
+  uint16_t port = 554;  // 0: any free port, see RtspServer::port()
+  // A connection that has not reached PLAY by then is closed.
+  uint32_t handshakeTimeoutMs = 30000;
+  RtspSessionOptions session;
+};
+
+// Handshake counters; streaming is counted by the providers' sessions.
+struct RtspServerStats {
+  uint64_t accepted = 0;
+  uint64_t connections = 0;  // in handshake right now
+  uint64_t described = 0;
+  uint64_t played = 0;       // handed to a provider
+  uint64_t notFound = 0;
+  uint64_t badRequests = 0;  // malformed, unsupported transport or method
+  uint64_t timeouts = 0;
+  uint64_t acceptErrors = 0;
+
+  void add(const RtspServerStats& other);
+};
+
+class RtspServer {
+ public:
+  // loops must outlive the server and be running while start(), stop()
+  // and stats() are called.
+  RtspServer(EventLoopPool* loops, const RtspServerOptions& options);
+  ~RtspServer();
+
+  RtspServer(const RtspServer&) = delete;
+  RtspServer& operator=(const RtspServer&) = delete;
+
+  // prefix like "/live/". Before start(); provider must outlive the server.
+  void addProvider(const std::string& prefix, RtspMediaProvider* provider);
+
+  // Opens a listener per loop. 0 or -errno.
+  int start();
+  // Closes the listeners and every connection still in handshake; playing
+  // sessions belong to their providers. Blocks; not from a loop thread.
+  void stop();
+
+  uint16_t port() const { return port_; }
+  const RtspSessionOptions& sessionOptions() const { return options_.session; }
+
+  // Blocks until every loop answered; not from a loop thread.
+  RtspServerStats stats();
+
+ private:
+  class Connection;
+  class Listener;
+
+  // Provider for a request path, and the path with the prefix stripped.
+  RtspMediaProvider* route(const std::string& path, std::string* rest) const;
+
+  EventLoopPool* loops_;
+  RtspServerOptions options_;
+  std::vector<std::pair<std::string, RtspMediaProvider*>> providers_;
+  std::vector<std::shared_ptr<Listener>> listeners_;  // shared with their loops
+  uint16_t port_ = 0;
+  bool running_ = false;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_RTSP_RTSP_SERVER_H
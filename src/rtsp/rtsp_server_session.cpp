@@ -0,0 +1,340 @@
+#include "rtsp/rtsp_server_session.h"
+
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/log.h"
+#include "base/socket_util.h"
+#include "media/rtp_depacketizer.h"
+#include "rtp/rtp_packet.h"
+#include "rtsp/rtsp_message.h"
+
+namespace nvr {
+
+namespace {
+
+constexpr int kMaxIov = 512;
+// As many as there are interleaved channel pairs: a synchronized replay
+// carries a track per camera.
+constexpr size_t kMaxTracks = 127;
+constexpr size_t kMaxInputBytes = 64 * 1024;
+// Responses not yet sent. A viewer has a keepalive or two outstanding and
+// a PLAY answer naming every track; far past that it sends requests and
+// does not read the answers.
+constexpr size_t kMaxControlBytes = 64 * 1024;
+
+}  // namespace
+
+void RtspSessionStats::add(const RtspSessionStats& other) {
+  open += other.open;
+  opened += other.opened;
+  packetsOut += other.packetsOut;
+  bytesOut += other.bytesOut;
+  writevCalls += other.writevCalls;
+  droppedNonReference += other.droppedNonReference;
+  droppedReference += other.droppedReference;
+  droppedOther += other.droppedOther;
+  stalled += other.stalled;
+  maxQueuedBytes = std::max(maxQueuedBytes, other.maxQueuedBytes);
+}
+
+void rejectRtspPlay(RtspPlayRequest* request, int status) {
+  if (request->fd < 0) return;
+  HeaderList headers;
+  headers.emplace_back("Session", request->sessionId);
+  std::string response = buildRtspResponse(status, request->cseq, headers);
+  ssize_t n = ::write(request->fd, response.data(), response.size());
+  (void)n;
+  ::close(request->fd);
+  request->fd = -1;
+}
+
+RtspServerSession::RtspServerSession(EventLoop* loop, RtspPlayRequest* request,
+                                     const RtspSessionOptions& options, RtspSessionStats* stats)
+    : loop_(loop),
+      fd_(request->fd),
+      options_(options),
+      stats_(stats),
+      sessionId_(request->sessionId),
+      tracks_(request->tracks),
+      control_(std::move(request->response)) {
+  request->fd = -1;
+  if (tracks_.size() > kMaxTracks) tracks_.resize(kMaxTracks);
+  video_.resize(tracks_.size());
+  input_.append(request->input);
+  ++stats_->open;
+  ++stats_->opened;
+  setNonBlocking(fd_);
+  if (options_.sendBufferBytes > 0) setSendBufferSize(fd_, options_.sendBufferBytes);
+  if (loop_->add(fd_, EPOLLIN, this) < 0) {
+    close();
+    return;
+  }
+  flush();
+  if (fd_ >= 0 && !input_.empty()) handleInput();
+}
+
+RtspServerSession::~RtspServerSession() {
+  close();
+  --stats_->open;
+}
+
+bool RtspServerSession::admitVideo(VideoState* state, VideoCodec codec, const PacketRef& packet,
+                                   size_t bytes) {
+  RtpHeader header;
+  if (!parseRtpHeader(packet.data(), packet.size(), &header)) return false;
+  if (!state->inUnit || header.timestamp != state->timestamp) {
+    state->inUnit = true;
+    state->timestamp = header.timestamp;
+    state->decided = false;
+    state->dropUnit = false;
+  }
+  RtpPayloadInfo info =
+      inspectRtpPayload(codec, packet.data() + header.payloadOffset, header.payloadSize);
+  if (state->waitForKeyframe) {
+    // Parameter sets are small and precede the keyframe; let them through.
+    if (!info.keyframeStart && !info.parameterSets) {
+      // Before the first keyframe there is nothing to decode yet; later it
+      // is a drop.
+      if (state->started) ++stats_->droppedReference;
+      return false;
+    }
+    if (info.keyframeStart) {
+      state->waitForKeyframe = false;
+      state->started = true;
+    }
+  }
+  if (info.vcl && !state->decided) {
+    // A frame is kept or dropped as a whole, on its first slice.
+    state->decided = true;
+    state->dropUnit = !info.reference && queuedBytes_ > options_.softQueueBytes;
+  }
+  if (state->dropUnit) {
+    ++stats_->droppedNonReference;
+    return false;
+  }
+  if (queuedBytes_ + bytes > options_.hardQueueBytes) {
+    // Whatever follows depends on this frame: resume at a keyframe.
+    state->waitForKeyframe = true;
+    ++stats_->droppedReference;
+    return false;
+  }
+  return true;
+}
+
+void RtspServerSession::enqueue(int track, bool rtcp, const PacketRef& packet) {
+  if (fd_ < 0 || track < 0 || static_cast<size_t>(track) >= tracks_.size()) return;
+  const RtspSessionTrack& t = tracks_[track];
+  if (t.channel < 0) return;
+  size_t bytes = 4 + packet.size();
+  if (!rtcp && t.codec != VideoCodec::Unknown) {
+    if (!admitVideo(&video_[track], t.codec, packet, bytes)) return;
+  } else if (queuedBytes_ + bytes > options_.hardQueueBytes) {
+    ++stats_->droppedOther;
+    return;
+  }
+  queue_.emplace_back();
+  Entry& entry = queue_.back();
+  entry.header[0] = '$';
+  entry.header[1] = static_cast<uint8_t>(t.channel + (rtcp ? 1 : 0));
+  entry.header[2] = static_cast<uint8_t>(packet.size() >> 8);
+  entry.header[3] = static_cast<uint8_t>(packet.size());
+  entry.packet = packet;
+  queuedBytes_ += bytes;
+  ++stats_->packetsOut;
+  if (queuedBytes_ > stats_->maxQueuedBytes) stats_->maxQueuedBytes = queuedBytes_;
+}
+
+bool RtspServerSession::writeControl() {
+  while (controlWritten_ < control_.size()) {
+    ssize_t n = ::write(fd_, control_.data() + controlWritten_, control_.size() - controlWritten_);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR) return false;
+      close();
+      return false;
+    }
+    controlWritten_ += static_cast<size_t>(n);
+    stats_->bytesOut += n;
+  }
+  control_.clear();
+  controlWritten_ = 0;
+  return true;
+}
+
+void RtspServerSession::flush() {
+  if (fd_ < 0) return;
+  // Written even while waiting for EPOLLOUT: that only comes once a third
+  // of the socket buffer is free, which a viewer reading slowly but
+  // steadily may take longer than the stall timeout to free.
+  struct iovec iov[kMaxIov];
+  bool blocked = false;
+  bool progress = false;
+  for (;;) {
+    // Responses go out only between two packets.
+    if (!control_.empty() && frontWritten_ == 0) {
+      size_t before = controlWritten_;
+      if (!writeControl()) {
+        if (fd_ < 0) return;
+        progress = progress || controlWritten_ > before;
+        blocked = true;
+        break;
+      }
+      progress = true;
+    }
+    if (queue_.empty()) break;
+    int count = 0;
+    size_t skip = frontWritten_;
+    for (auto it = queue_.begin(); it != queue_.end() && count + 2 <= kMaxIov; ++it) {
+      if (skip < 4) {
+        iov[count].iov_base = it->header + skip;
+        iov[count].iov_len = 4 - skip;
+        ++count;
+        skip = 0;
+      } else {
+        skip -= 4;
+      }
+      iov[count].iov_base = const_cast<uint8_t*>(it->packet.data()) + skip;
+      iov[count].iov_len = it->packet.size() - skip;
+      ++count;
+      skip = 0;
+    }
+    ssize_t n = ::writev(fd_, iov, count);
+    ++stats_->writevCalls;
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        blocked = true;
+        break;
+      }
+      close();
+      return;
+    }
+    progress = true;
+    stats_->bytesOut += n;
+    size_t left = static_cast<size_t>(n);
+    size_t attempted = 0;
+    for (int i = 0; i < count; ++i) attempted += iov[i].iov_len;
+    while (left > 0) {
+      Entry& front = queue_.front();
+      size_t remaining = 4 + front.packet.size() - frontWritten_;
+      if (left < remaining) {
+        frontWritten_ += left;
+        break;
+      }
+      left -= remaining;
+      queuedBytes_ -= 4 + front.packet.size();
+      frontWritten_ = 0;
+      queue_.pop_front();
+    }
+    if (static_cast<size_t>(n) < attempted) {
+      blocked = true;  // socket buffer full
+      break;
+    }
+  }
+  if (progress || !blocked) {
+    stalledSinceMs_ = 0;
+  } else if (stalledSinceMs_ == 0) {
+    stalledSinceMs_ = loop_->nowMs();
+  } else if (loop_->nowMs() - stalledSinceMs_ > options_.stallTimeoutMs) {
+    // The viewer stopped reading.
+    NVR_DEBUG("rtsp session %s: no progress for %u ms, closing", sessionId_.c_str(),
+              options_.stallTimeoutMs);
+    ++stats_->stalled;
+    close();
+    return;
+  }
+  if (blocked && !wantWrite_) {
+    wantWrite_ = true;
+    loop_->modify(fd_, EPOLLIN | EPOLLOUT, this);
+  }
+}
+
+void RtspServerSession::onEvents(uint32_t events) {
+  if (fd_ < 0) return;
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    close();
+    return;
+  }
+  if (events & EPOLLIN) {
+    ssize_t n = input_.readFd(fd_, 16 * 1024);
+    if (n == 0 || (n < 0 && n != -EAGAIN && n != -EINTR)) {
+      close();
+      return;
+    }
+    handleInput();
+    if (fd_ < 0) return;
+  }
+  if ((events & EPOLLOUT) && wantWrite_) {
+    wantWrite_ = false;
+    loop_->modify(fd_, EPOLLIN, this);
+    flush();
+  }
+}
+
+void RtspServerSession::handleInput() {
+  while (fd_ >= 0 && !input_.empty()) {
+    const uint8_t* p = input_.data();
+    if (p[0] == '$') {
+      // Receiver reports on the interleaved RTCP channels; not used.
+      if (input_.size() < 4) break;
+      size_t length = static_cast<size_t>(p[2] << 8 | p[3]);
+      if (input_.size() < 4 + length) break;
+      input_.consume(4 + length);
+      continue;
+    }
+    RtspRequest request;
+    int n = parseRtspRequest(reinterpret_cast<const char*>(p), input_.size(), &request);
+    if (n < 0 || (n == 0 && input_.size() > kMaxInputBytes)) {
+      close();
+      return;
+    }
+    if (n == 0) break;
+    input_.consume(static_cast<size_t>(n));
+    handleRequest(request.method, request.cseq());
+  }
+}
+
+void RtspServerSession::handleRequest(const std::string& method, int cseq) {
+  HeaderList headers;
+  headers.emplace_back("Session", sessionId_);
+  int status = 200;
+  if (method == "OPTIONS") {
+    headers.emplace_back("Public", "OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER");
+  } else if (method == "PAUSE") {
+    status = 455;
+  } else if (method != "GET_PARAMETER" && method != "SET_PARAMETER" && method != "PLAY" &&
+             method != "TEARDOWN") {
+    status = 501;
+  }
+  control_ += buildRtspResponse(status, cseq, headers);
+  if (control_.size() - controlWritten_ > kMaxControlBytes) {
+    NVR_DEBUG("rtsp session %s: %zu bytes of responses unread, closing", sessionId_.c_str(),
+              control_.size() - controlWritten_);
+    ++stats_->stalled;
+    close();
+    return;
+  }
+  if (method == "TEARDOWN") {
+    // Best effort: the reply goes out if the socket takes it right away.
+    if (frontWritten_ == 0) writeControl();
+    close();
+    return;
+  }
+  if (!wantWrite_) flush();
+}
+
+void RtspServerSession::close() {
+  if (fd_ < 0) return;
+  loop_->remove(fd_);
+  ::close(fd_);
+  fd_ = -1;
+  queue_.clear();
+  queuedBytes_ = 0;
+  frontWritten_ = 0;
+  control_.clear();
+  controlWritten_ = 0;
+}
+
+}  // namespace nvr
@@ -0,0 +1,152 @@
+// Server side of one RTSP viewer after PLAY: RTP interleaved on the
+// connection, with a bounded send queue and a per-client drop policy.
+//
+// The session is a RelaySubscriber, so a live relay feeds it directly, and
+// replay drives it the same way. Packets are queued by reference and sent
+// with non-blocking writev(); a viewer that reads slower than the stream
+// only ever grows its own queue, which is capped:
+//
+//  - Above the soft limit, video frames that are not used as a reference
+//    (nal_ref_idc 0 in H.264, sub-layer non-reference pictures in H.265)
+//    are dropped whole. The rest of the GOP still decodes.
+//  - Above the hard limit nothing more fits: video is dropped up to the
+//    next keyframe, where the viewer can start over cleanly, and other
+//    tracks and RTCP are dropped packet by packet.
+//  - A viewer that accepts no bytes at all for stallTimeoutMs is closed.
+//
+// RTSP responses (keep-alives, TEARDOWN) are never dropped; they go out
+// between two packets. A session belongs to one loop and is loop-thread
+// only.
+
+#ifndef NVR_RTSP_RTSP_SERVER_SESSION_H
+#define NVR_RTSP_RTSP_SERVER_SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/event_loop.h"
+#include "base/packet_buffer.h"
+#include "media/nal.h"
+#include "relay/stream_relay.h"
+
+namespace nvr {
+
+struct RtspSessionOptions {
+  size_t softQueueBytes = 1024 * 1024;
+  // Matches TcpRelaySubscriber, so a cached GOP always fits.
+  size_t hardQueueBytes = TcpRelaySubscriber::kDefaultMaxQueuedBytes;
+  uint32_t stallTimeoutMs = 20000;
+  // SO_SNDBUF of the connection; 0 keeps the system's. Small enough that a
+  // backlog builds up in the queue, where the drop policy sees it, rather
+  // than in the kernel.
+  int sendBufferBytes = 256 * 1024;
+};
+
+// Counters of the sessions on one loop. Sessions add to a shared instance
+// owned by whoever serves that loop.
+struct RtspSessionStats {
+  uint64_t open = 0;  // sessions right now
+  uint64_t opened = 0;
+  uint64_t packetsOut = 0;
+  uint64_t bytesOut = 0;
+  uint64_t writevCalls = 0;
+  uint64_t droppedNonReference = 0;  // packets of non-reference frames, above the soft limit
+  uint64_t droppedReference = 0;     // video packets above the hard limit, up to a keyframe
+  uint64_t droppedOther = 0;         // audio, data and RTCP above the hard limit
+  uint64_t stalled = 0;              // closed for not reading
+  uint64_t maxQueuedBytes = 0;
+
+  void add(const RtspSessionStats& other);
+};
+
+struct RtspSessionTrack {
+  int channel = -1;  // interleaved RTP channel (RTCP on the next), -1 if not set up
+  VideoCodec codec = VideoCodec::Unknown;  // Unknown for anything but H.264/H.265
+};
+
+// A connection that reached PLAY, on its way from the RTSP server to the
+// loop that will stream to it.
+struct RtspPlayRequest {
+  int fd = -1;               // owned by whoever holds the request
+  std::string path;          // after the provider's prefix
+  std::string query;         // after '?', if any
+  std::string sessionId;
+  int cseq = 0;              // of the PLAY request
+  double scale = 1;          // Scale (or Speed) granted: < 0 plays backward
+  std::vector<RtspSessionTrack> tracks;  // by track index, as described
+  std::string response;      // PLAY response; sent before any media
+  std::string input;         // bytes read after the PLAY request
+};
+
+// Answers a PLAY the media side cannot serve (best effort, the socket is
+// not waited on) and closes the connection.
+void rejectRtspPlay(RtspPlayRequest* request, int status);
+
+class RtspServerSession : public RelaySubscriber, public EventHandler {
+ public:
+  // Takes over request->fd. Must be created on loop's thread.
+  RtspServerSession(EventLoop* loop, RtspPlayRequest* request,
+                    const RtspSessionOptions& options, RtspSessionStats* stats);
+  ~RtspServerSession() override;
+
+  RtspServerSession(const RtspServerSession&) = delete;
+  RtspServerSession& operator=(const RtspServerSession&) = delete;
+
+  void enqueue(int track, bool rtcp, const PacketRef& packet) override;
+  void flush() override;
+  bool closed() const override { return fd_ < 0; }
+  void close();
+
+  const std::string& sessionId() const { return sessionId_; }
+  size_t queuedBytes() const { return queuedBytes_; }
+  // Above the soft limit: a source that can wait (replay) should.
+  bool congested() const { return queuedBytes_ > options_.softQueueBytes; }
+
+  void onEvents(uint32_t events) override;
+
+ private:
+  struct Entry {
+    uint8_t header[4];
+    PacketRef packet;
+  };
+  // Drop state of one video track, decided per access unit.
+  struct VideoState {
+    bool inUnit = false;
+    uint32_t timestamp = 0;
+    bool decided = false;   // a slice of the unit was seen
+    bool dropUnit = false;  // non-reference unit dropped above the soft limit
+    bool waitForKeyframe = true;
+    bool started = false;   // a keyframe was queued
+  };
+
+  bool admitVideo(VideoState* state, VideoCodec codec, const PacketRef& packet, size_t bytes);
+  void handleInput();
+  void handleRequest(const std::string& method, int cseq);
+  bool writeControl();
+
+  EventLoop* loop_;
+  int fd_;
+  RtspSessionOptions options_;
+  RtspSessionStats* stats_;
+  std::string sessionId_;
+  std::vector<RtspSessionTrack> tracks_;
+  std::vector<VideoState> video_;  // by track
+
+  std::deque<Entry> queue_;
+  size_t queuedBytes_ = 0;
+  size_t frontWritten_ = 0;  // bytes of queue_.front() already sent
+  std::string control_;      // responses waiting for a packet boundary
+  size_t controlWritten_ = 0;
+  bool wantWrite_ = false;
+  uint64_t stalledSinceMs_ = 0;  // 0 while the socket takes data
+  ByteBuffer input_{4096};
+};
+
+}  // namespace nvr
+
+#endif  // NVR_RTSP_RTSP_SERVER_SESSION_H
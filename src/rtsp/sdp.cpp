@@ -0,0 +1,118 @@
+#include "rtsp/sdp.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+
+namespace nvr {
+
+namespace {
+
+void parseRtpmap(const std::string& value, SdpMedia* media) {
+  // a=rtpmap:96 H264/90000[/channels]
+  size_t sp = value.find(' ');
+  if (sp == std::string::npos) return;
+  if (atoi(value.c_str()) != media->payloadType) return;
+  std::string enc = value.substr(sp + 1);
+  size_t slash = enc.find('/');
+  std::string name = enc.substr(0, slash);
+  for (auto& c : name) c = toupper(c);
+  media->encoding = name;
+  if (slash != std::string::npos) {
+    media->clockRate = atoi(enc.c_str() + slash + 1);
+    size_t slash2 = enc.find('/', slash + 1);
+    if (slash2 != std::string::npos) media->channels = atoi(enc.c_str() + slash2 + 1);
+  }
+}
+
+}  // namespace
+
+bool parseSdp(const std::string& text, SessionDescription* out) {
+  out->control.clear();
+  out->media.clear();
+  out->raw = text;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t eol = text.find('\n', pos);
+    if (eol == std::string::npos) eol = text.size();
+    std::string line = text.substr(pos, eol - pos);
+    pos = eol + 1;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.size() < 2 || line[1] != '=') continue;
+    char kind = line[0];
+    std::string value = line.substr(2);
+
+    if (kind == 'm') {
+      // m=video 0 RTP/AVP 96
+      SdpMedia media;
+      size_t sp = value.find(' ');
+      media.type = value.substr(0, sp);
+      size_t fmtStart = value.rfind(' ');
+      if (fmtStart != std::string::npos) media.payloadType = atoi(value.c_str() + fmtStart + 1);
+      // Static payload types have implicit rtpmaps.
+      if (media.payloadType == 0) {
+        media.encoding = "PCMU";
+        media.clockRate = 8000;
+      } else if (media.payloadType == 8) {
+        media.encoding = "PCMA";
+        media.clockRate = 8000;
+      } else if (media.payloadType == 26) {
+        media.encoding = "JPEG";
+        media.clockRate = 90000;
+      }
+      out->media.push_back(media);
+      continue;
+    }
+    if (kind != 'a') continue;
+
+    size_t colon = value.find(':');
+    std::string attr = value.substr(0, colon);
+    std::string arg = colon == std::string::npos ? "" : value.substr(colon + 1);
+    if (out->media.empty()) {
+      if (attr == "control") out->control = arg;
+      continue;
+    }
+    SdpMedia& media = out->media.back();
+    if (attr == "control") {
+      media.control = arg;
+    } else if (attr == "rtpmap") {
+      parseRtpmap(arg, &media);
+    } else if (attr == "fmtp") {
+      size_t sp = arg.find(' ');
+      if (sp != std::string::npos && atoi(arg.c_str()) == media.payloadType)
+        media.fmtp = arg.substr(sp + 1);
+    }
+  }
+  return !out->media.empty();
+}
+
+std::string buildSdp(const std::string& sessionName, const std::vector<SdpMedia>& media) {
+  std::string out =
+      "v=0\r\n"
+      "o=- 0 0 IN IP4 0.0.0.0\r\n"
+      "s=" + sessionName + "\r\n"
+      "c=IN IP4 0.0.0.0\r\n"
+      "t=0 0\r\n"
+      "a=control:*\r\n";
+  for (const SdpMedia& m : media) {
+    std::string pt = std::to_string(m.payloadType);
+    out += "m=" + m.type + " 0 RTP/AVP " + pt + "\r\n";
+    if (!m.encoding.empty()) {
+      out += "a=rtpmap:" + pt + ' ' + m.encoding + '/' + std::to_string(m.clockRate);
+      if (m.channels > 0) out += '/' + std::to_string(m.channels);
+      out += "\r\n";
+    }
+    if (!m.fmtp.empty()) out += "a=fmtp:" + pt + ' ' + m.fmtp + "\r\n";
+    if (!m.control.empty()) out += "a=control:" + m.control + "\r\n";
+  }
+  return out;
+}
+
+std::string resolveControlUrl(const std::string& base, const std::string& control) {
+  if (control.empty() || control == "*") return base;
+  if (control.compare(0, 7, "rtsp://") == 0 || control.compare(0, 8, "rtsps://") == 0)
+    return control;
+  if (!base.empty() && base.back() == '/') return base + control;
+  return base + "/" + control;
+}
+
+}  // namespace nvr
@@ -0,0 +1,40 @@
+// Session Description Protocol parsing (RFC 4566), limited to what RTSP
+// cameras announce in DESCRIBE responses.
+
+#ifndef NVR_RTSP_SDP_H
+#define NVR_RTSP_SDP_H
+
+#include <string>
+#include <vector>
+
+namespace nvr {
+
+struct SdpMedia {
+  std::string type;       // "video", "audio", "application"
+  int payloadType = -1;
+  std::string encoding;   // "H264", "H265", "PCMA", ... (uppercase)
+  int clockRate = 0;
+  int channels = 0;
+  std::string control;    // a=control, possibly relative
+  std::string fmtp;       // a=fmtp parameters after the payload type
+};
+
+struct SessionDescription {
+  std::string control;    // session-level a=control
+  std::vector<SdpMedia> media;
+  std::string raw;
+};
+
+bool parseSdp(const std::string& text, SessionDescription* out);
+
+// Writes a session description announcing media (type, payload type,
+// rtpmap, fmtp and control of each) for a DESCRIBE response.
+std::string buildSdp(const std::string& sessionName, const std::vector<SdpMedia>& media);
+
+// Resolves a media or session control attribute against the base URL from
+// Content-Base / Content-Location / the request URL.
+std::string resolveControlUrl(const std::string& base, const std::string& control);
+
+}  // namespace nvr
+
+#endif  // NVR_RTSP_SDP_H
@@ -0,0 +1,65 @@
+// Heap buffer aligned for O_DIRECT I/O.
+
+#ifndef NVR_STORAGE_ALIGNED_BUFFER_H
+#define NVR_STORAGE_ALIGNED_BUFFER_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "storage/segment_format.h"
+
+namespace nvr {
+
+class AlignedBuffer {
+ public:
+  AlignedBuffer() = default;
+  explicit AlignedBuffer(size_t capacity) { reserve(capacity); }
+  ~AlignedBuffer() { free(data_); }
+
+  AlignedBuffer(const AlignedBuffer&) = delete;
+  AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+  uint8_t* data() { return data_; }
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+  size_t writable() const { return capacity_ - size_; }
+
+  // Grows to at least capacity (rounded up to kBlockAlign), keeping contents.
+  bool reserve(size_t capacity) {
+    capacity = alignUp(capacity);
+    if (capacity <= capacity_) return true;
+    void* p = nullptr;
+    if (posix_memalign(&p, kBlockAlign, capacity) != 0) return false;
+    if (size_ > 0) memcpy(p, data_, size_);
+    free(data_);
+    data_ = static_cast<uint8_t*>(p);
+    capacity_ = capacity;
+    return true;
+  }
+
+  void append(const void* p, size_t n) {
+    memcpy(data_ + size_, p, n);
+    size_ += n;
+  }
+  // Zero-fills up to the next multiple of kBlockAlign.
+  void padToAlignment() {
+    size_t aligned = alignUp(size_);
+    memset(data_ + size_, 0, aligned - size_);
+    size_ = aligned;
+  }
+  void resize(size_t size) { size_ = size; }
+  void clear() { size_ = 0; }
+
+ private:
+  uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_ALIGNED_BUFFER_H
@@ -0,0 +1,168 @@
+#include "storage/archive_index.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <set>
+
+#include "storage/file_util.h"
+#include "storage/segment_format.h"
+
+namespace nvr {
+
+ArchiveIndex::ArchiveIndex(const std::string& dir, const std::string& coldDir)
+    : dir_(dir), coldDir_(coldDir) {}
+
+int ArchiveIndex::load() {
+  std::shared_ptr<const Snapshot> previous = snapshot();
+  std::map<std::string, const Segment*> mapped;
+  if (previous) {
+    for (const Segment& segment : previous->segments) mapped[segment.path] = &segment;
+  }
+  auto next = std::make_shared<Snapshot>();
+  std::vector<std::string> groups;
+  int rc = listDirectory(dir_, &groups);
+  if (rc < 0) return rc;
+  size_t hotGroups = groups.size();
+  if (!coldDir_.empty()) listDirectory(coldDir_, &groups);
+  std::set<std::pair<std::string, uint64_t>> seen;
+  for (size_t g = 0; g < groups.size(); ++g) {
+    const std::string& group = groups[g];
+    std::string groupDir = joinPath(g < hotGroups ? dir_ : coldDir_, group);
+    std::vector<std::string> names;
+    if (listDirectory(groupDir, &names) < 0) continue;
+    for (const auto& name : names) {
+      uint64_t id;
+      if (!parseSegmentFileName(name, &id) || seen.count({group, id})) continue;
+      Segment segment;
+      segment.path = joinPath(groupDir, name);
+      std::string indexPath = segmentIndexPath(segment.path);
+      struct stat st;
+      if (stat(indexPath.c_str(), &st) < 0) continue;
+      segment.indexInode = st.st_ino;
+      auto known = mapped.find(segment.path);
+      if (known != mapped.end() && known->second->indexInode == segment.indexInode) {
+        segment.index = known->second->index;
+      } else {
+        auto index = std::make_shared<SegmentIndex>();
+        if (index->open(indexPath) < 0) continue;
+        segment.index = std::move(index);
+      }
+      seen.insert({group, id});
+      uint32_t segmentIndex = static_cast<uint32_t>(next->segments.size());
+      for (size_t i = 0; i < segment.index->streamCount(); ++i) {
+        const IndexStream& stream = segment.index->stream(i);
+        Range range;
+        range.firstUs = stream.firstTimestampUs;
+        range.lastUs = stream.lastTimestampUs;
+        range.segment = segmentIndex;
+        range.stream = static_cast<uint32_t>(i);
+        std::string cameraId(stream.cameraId, strnlen(stream.cameraId, sizeof(stream.cameraId)));
+        next->cameras[cameraId].push_back(range);
+      }
+      next->segments.push_back(std::move(segment));
+    }
+  }
+  for (auto& kv : next->cameras)
+    std::sort(kv.second.begin(), kv.second.end(),
+              [](const Range& a, const Range& b) { return a.firstUs < b.firstUs; });
+  int count = static_cast<int>(next->segments.size());
+  std::lock_guard<std::mutex> lock(mutex_);
+  snapshot_ = std::move(next);
+  return count;
+}
+
+int ArchiveIndex::refresh(uint64_t generation) {
+  if (refreshed_ && generation == generation_) return 0;
+  int rc = load();
+  if (rc < 0) return rc;
+  refreshed_ = true;
+  generation_ = generation;
+  return 1;
+}
+
+std::shared_ptr<const ArchiveIndex::Snapshot> ArchiveIndex::snapshot() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return snapshot_;
+}
+
+size_t ArchiveIndex::segments() const {
+  std::shared_ptr<const Snapshot> s = snapshot();
+  return s ? s->segments.size() : 0;
+}
+
+std::vector<std::string> ArchiveIndex::cameras() const {
+  std::vector<std::string> out;
+  std::shared_ptr<const Snapshot> s = snapshot();
+  if (!s) return out;
+  for (const auto& kv : s->cameras) out.push_back(kv.first);
+  return out;
+}
+
+bool ArchiveIndex::seek(const std::string& cameraId, int64_t timestampUs,
+                        ArchiveSeekResult* out) const {
+  std::shared_ptr<const Snapshot> s = snapshot();
+  if (!s) return false;
+  auto it = s->cameras.find(cameraId);
+  if (it == s->cameras.end() || it->second.empty()) return false;
+  const std::vector<Range>& ranges = it->second;
+  // The last segment starting at or before timestampUs; in a gap between
+  // segments that gives the last keyframe before the gap.
+  auto range = std::upper_bound(
+      ranges.begin(), ranges.end(), timestampUs,
+      [](int64_t ts, const Range& r) { return ts < r.firstUs; });
+  if (range != ranges.begin()) --range;
+  const Segment& segment = s->segments[range->segment];
+  if (!segment.index->seek(range->stream, timestampUs, &out->keyframe)) return false;
+  out->path = segment.path;
+  out->segmentId = segment.index->segmentId();
+  return true;
+}
+
+bool ArchiveIndex::seekAfter(const std::string& cameraId, int64_t timestampUs,
+                             ArchiveSeekResult* out) const {
+  std::shared_ptr<const Snapshot> s = snapshot();
+  if (!s) return false;
+  auto it = s->cameras.find(cameraId);
+  if (it == s->cameras.end()) return false;
+  const std::vector<Range>& ranges = it->second;
+  auto range = std::upper_bound(
+      ranges.begin(), ranges.end(), timestampUs,
+      [](int64_t ts, const Range& r) { return ts < r.firstUs; });
+  for (; range != ranges.end(); ++range) {
+    const Segment& segment = s->segments[range->segment];
+    if (!segment.index->seek(range->stream, range->firstUs, &out->keyframe)) continue;
+    out->path = segment.path;
+    out->segmentId = segment.index->segmentId();
+    return true;
+  }
+  return false;
+}
+
+bool ArchiveIndex::seekBefore(const std::string& cameraId, int64_t timestampUs,
+                              ArchiveSeekResult* out) const {
+  std::shared_ptr<const Snapshot> s = snapshot();
+  if (!s) return false;
+  auto it = s->cameras.find(cameraId);
+  if (it == s->cameras.end()) return false;
+  const std::vector<Range>& ranges = it->second;
+  // Back from the last segment starting before timestampUs; a camera's
+  // segments follow each other, so the first keyframe found is the one.
+  auto range = std::upper_bound(
+      ranges.begin(), ranges.end(), timestampUs - 1,
+      [](int64_t ts, const Range& r) { return ts < r.firstUs; });
+  while (range != ranges.begin()) {
+    --range;
+    const Segment& segment = s->segments[range->segment];
+    if (!segment.index->seek(range->stream, timestampUs - 1, &out->keyframe) ||
+        out->keyframe.timestampUs >= timestampUs)
+      continue;
+    out->path = segment.path;
+    out->segmentId = segment.index->segmentId();
+    return true;
+  }
+  return false;
+}
+
+}  // namespace nvr
@@ -0,0 +1,103 @@
+// Time lookups across a whole recording store.
+//
+// Maps every keyframe index file of the store and keeps, per camera, the
+// time ranges of the segments it appears in, sorted by start time. A seek
+// is a binary search over those ranges followed by one SegmentIndex::seek(),
+// so its cost does not grow with the length of the archive beyond log n.
+//
+// The index files are not watched. refresh() with the store's generation
+// (RecordingStore::generation()) loads again when it moved, which it does
+// whenever an index file is replaced: as an open segment syncs, when it is
+// sealed, and when retention rewrites, moves or deletes one. A load keeps
+// the mapping of every index file still in place and maps only new ones.
+// It builds a new snapshot and swaps it in, so seeks may run on any thread
+// meanwhile, each on the snapshot it started with; a replay that already
+// opened a segment file goes on reading it through its own descriptor.
+//
+// With a cold tier (retention_engine.h), segments are found in either
+// directory tree; one caught in both while being moved is taken from the
+// hot one.
+
+#ifndef NVR_STORAGE_ARCHIVE_INDEX_H
+#define NVR_STORAGE_ARCHIVE_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "storage/segment_index.h"
+
+namespace nvr {
+
+struct ArchiveSeekResult {
+  std::string path;  // segment file
+  uint64_t segmentId = 0;
+  KeyframeEntry keyframe;
+};
+
+class ArchiveIndex {
+ public:
+  explicit ArchiveIndex(const std::string& dir, const std::string& coldDir = std::string());
+
+  ArchiveIndex(const ArchiveIndex&) = delete;
+  ArchiveIndex& operator=(const ArchiveIndex&) = delete;
+
+  // Maps the index of every segment under dir and coldDir. Corrupt or
+  // missing index files are skipped. Returns the number of segments or
+  // -errno. load() and refresh() are called from one thread at a time.
+  int load();
+  // Loads again if generation differs from the last refresh()'s. Returns 1
+  // if it did, 0 if nothing changed, or -errno (retried on the next call).
+  int refresh(uint64_t generation);
+
+  size_t segments() const;
+  std::vector<std::string> cameras() const;
+
+  // Latest keyframe of cameraId at or before timestampUs; the camera's
+  // first keyframe if timestampUs precedes the archive. False if the
+  // camera has no recordings.
+  bool seek(const std::string& cameraId, int64_t timestampUs, ArchiveSeekResult* out) const;
+  // First keyframe of the camera's first segment starting after
+  // timestampUs, for playing on across segments. False at the end.
+  bool seekAfter(const std::string& cameraId, int64_t timestampUs, ArchiveSeekResult* out) const;
+  // Latest keyframe of the camera strictly before timestampUs, in whichever
+  // segment holds it, for playing backward. False at the start.
+  bool seekBefore(const std::string& cameraId, int64_t timestampUs,
+                  ArchiveSeekResult* out) const;
+
+ private:
+  struct Segment {
+    std::string path;
+    std::shared_ptr<const SegmentIndex> index;  // shared with later snapshots
+    uint64_t indexInode = 0;                    // replaced files get a new one
+  };
+  struct Range {
+    int64_t firstUs;
+    int64_t lastUs;
+    uint32_t segment;
+    uint32_t stream;
+  };
+  // One load's view of the store; immutable once published.
+  struct Snapshot {
+    std::vector<Segment> segments;
+    std::map<std::string, std::vector<Range>> cameras;  // ranges sorted by firstUs
+  };
+
+  std::shared_ptr<const Snapshot> snapshot() const;
+
+  std::string dir_;
+  std::string coldDir_;
+  mutable std::mutex mutex_;  // guards snapshot_ itself, not what it points to
+  std::shared_ptr<const Snapshot> snapshot_;
+  bool refreshed_ = false;
+  uint64_t generation_ = 0;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_ARCHIVE_INDEX_H
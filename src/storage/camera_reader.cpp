@@ -0,0 +1,209 @@
+#include "storage/camera_reader.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "storage/file_util.h"
+
+namespace nvr {
+
+int CameraReader::open(const std::string& segmentPath, const std::string& cameraId) {
+  close();
+  cameraId_ = cameraId;
+  for (int attempt = 0; attempt < 3; ++attempt) {
+    int rc = reader_.open(segmentPath);
+    if (rc < 0) return rc;
+    indexed_ = index_.open(segmentIndexPath(segmentPath)) == 0 &&
+               index_.segmentId() == reader_.header().segmentId;
+    // Retention writes a rewritten segment's index only once the new file
+    // has replaced the old one: if the segment is still the file open, the
+    // index is its own. Else it was rewritten in between; open again.
+    if (!indexed_ || isSameFile(reader_.fd(), segmentPath)) break;
+    indexed_ = false;
+  }
+  if (!indexed_) {
+    index_.close();
+    return 0;
+  }
+  for (size_t i = 0; i < index_.streamCount(); ++i) {
+    const IndexStream& s = index_.stream(i);
+    if (strncmp(s.cameraId, cameraId.c_str(), sizeof(s.cameraId)) != 0) continue;
+    streams_.push_back(i);
+    streamIds_.insert(s.streamId);
+    index_.chunks(i, &chunks_);
+  }
+  if (streams_.empty()) {
+    close();
+    return -ENOENT;
+  }
+  std::sort(chunks_.begin(), chunks_.end(),
+            [](const ChunkEntry& a, const ChunkEntry& b) { return a.offset < b.offset; });
+  chunks_.erase(std::unique(chunks_.begin(), chunks_.end(),
+                            [](const ChunkEntry& a, const ChunkEntry& b) {
+                              return a.offset == b.offset;
+                            }),
+                chunks_.end());
+  reader_.endIteration();
+  return 0;
+}
+
+void CameraReader::close() {
+  reader_.close();
+  index_.close();
+  indexed_ = false;
+  streams_.clear();
+  streamIds_.clear();
+  chunks_.clear();
+  nextChunk_ = 0;
+  chunksRead_ = 0;
+  skipBeforeUs_ = 0;
+  infoStream_ = 0;
+  wouldBlock_ = false;
+}
+
+const StreamInfo* CameraReader::streamInfo() const {
+  if (infoStream_ == 0) return nullptr;
+  auto it = reader_.streams().find(infoStream_);
+  return it == reader_.streams().end() ? nullptr : &it->second;
+}
+
+bool CameraReader::seek(int64_t timestampUs) {
+  if (!indexed_) return false;
+  bool found = false;
+  KeyframeEntry best;
+  for (size_t stream : streams_) {
+    KeyframeEntry entry;
+    if (!index_.seek(stream, timestampUs, &entry)) continue;
+    // The latest keyframe at or before timestampUs, else the earliest one.
+    if (!found) {
+      best = entry;
+    } else if (entry.timestampUs <= timestampUs) {
+      if (best.timestampUs > timestampUs || entry.timestampUs > best.timestampUs) best = entry;
+    } else if (best.timestampUs > timestampUs && entry.timestampUs < best.timestampUs) {
+      best = entry;
+    }
+    found = true;
+  }
+  if (!found) return false;
+  nextChunk_ = static_cast<size_t>(
+      std::lower_bound(chunks_.begin(), chunks_.end(), best.blockOffset,
+                       [](const ChunkEntry& c, uint64_t offset) { return c.offset < offset; }) -
+      chunks_.begin());
+  // The stream's announcement leads its first chunk; fetch it now, so that
+  // it is known before next() (and even when seeking skips that chunk).
+  // Not waiting for the disk, it is only looked for in the page cache.
+  if (streamInfo() == nullptr && !chunks_.empty() &&
+      reader_.readChunk(chunks_[0].offset, chunks_[0].size, noWait_) == 0) {
+    SegmentReader::Record record;
+    while (reader_.next(&record)) {
+      if (record.header.type == static_cast<uint8_t>(RecordType::StreamInfo) &&
+          streamIds_.count(record.header.streamId)) {
+        infoStream_ = record.header.streamId;
+        break;
+      }
+    }
+  }
+  reader_.endIteration();
+  skipBeforeUs_ = best.timestampUs;
+  return true;
+}
+
+bool CameraReader::ownStream(uint32_t streamId) {
+  if (streamIds_.count(streamId)) return true;
+  if (indexed_) return false;
+  auto it = reader_.streams().find(streamId);
+  if (it == reader_.streams().end() || it->second.cameraId != cameraId_) return false;
+  streamIds_.insert(streamId);
+  return true;
+}
+
+bool CameraReader::nextChunk() {
+  while (nextChunk_ < chunks_.size()) {
+    const ChunkEntry& chunk = chunks_[nextChunk_];
+    int rc = reader_.readChunk(chunk.offset, chunk.size, noWait_);
+    if (rc == -EAGAIN) {
+      wouldBlock_ = true;
+      blocked_ = chunk;
+      return false;
+    }
+    ++nextChunk_;
+    if (rc == 0) {
+      ++chunksRead_;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CameraReader::chunkAt(uint64_t offset, ChunkEntry* out) const {
+  auto chunk = std::lower_bound(
+      chunks_.begin(), chunks_.end(), offset,
+      [](const ChunkEntry& c, uint64_t offset) { return c.offset < offset; });
+  if (chunk == chunks_.end() || chunk->offset != offset) return false;
+  *out = *chunk;
+  return true;
+}
+
+bool CameraReader::next(SegmentReader::Record* record) {
+  wouldBlock_ = false;
+  for (;;) {
+    if (!reader_.next(record)) {
+      if (!indexed_ || !nextChunk()) return false;
+      continue;
+    }
+    if (!ownStream(record->header.streamId)) continue;
+    if (record->header.type == static_cast<uint8_t>(RecordType::StreamInfo)) {
+      infoStream_ = record->header.streamId;
+      return true;
+    }
+    if (skipBeforeUs_ != 0) {
+      if (record->header.timestampUs < skipBeforeUs_ || !(record->header.flags & kRecordKeyframe))
+        continue;
+      skipBeforeUs_ = 0;
+    }
+    return true;
+  }
+}
+
+void CameraReader::keyframes(std::vector<KeyframeEntry>* out) const {
+  out->clear();
+  if (!indexed_) return;
+  for (size_t stream : streams_) index_.entries(stream, out);
+  if (streams_.size() > 1)
+    std::stable_sort(out->begin(), out->end(), [](const KeyframeEntry& a, const KeyframeEntry& b) {
+      return a.timestampUs < b.timestampUs;
+    });
+}
+
+bool CameraReader::readKeyframe(const KeyframeEntry& entry, SegmentReader::Record* record) {
+  wouldBlock_ = false;
+  if (!indexed_) return false;
+  auto chunk = std::lower_bound(
+      chunks_.begin(), chunks_.end(), entry.blockOffset,
+      [](const ChunkEntry& c, uint64_t offset) { return c.offset < offset; });
+  if (chunk == chunks_.end() || chunk->offset != entry.blockOffset) return false;
+  int rc = reader_.readChunk(chunk->offset, chunk->size, noWait_);
+  if (rc == -EAGAIN) {
+    wouldBlock_ = true;
+    blocked_ = *chunk;
+  }
+  if (rc < 0) return false;
+  ++chunksRead_;
+  nextChunk_ = static_cast<size_t>(chunk - chunks_.begin()) + 1;
+  skipBeforeUs_ = 0;
+  while (reader_.next(record)) {
+    if (!ownStream(record->header.streamId)) continue;
+    if (record->header.type == static_cast<uint8_t>(RecordType::StreamInfo)) {
+      infoStream_ = record->header.streamId;
+      continue;
+    }
+    if (record->header.timestampUs == entry.timestampUs &&
+        (record->header.flags & kRecordKeyframe))
+      return true;
+  }
+  return false;
+}
+
+}  // namespace nvr
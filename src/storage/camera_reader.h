@@ -0,0 +1,102 @@
+// Reads one camera's records out of a segment.
+//
+// With the segment's index, only the blocks in the camera's chunk
+// directory are read, each with a single pread(), so replaying one camera
+// out of a segment shared by many costs about that camera's own bytes.
+// Without a usable index (not written yet, or damaged) every block is read
+// and filtered.
+//
+// With setNoWait(), a chunk that is not in the page cache stops next() and
+// readKeyframe() rather than wait for the disk: wouldBlock() says so, and
+// once the chunk has been fetched (ReadAhead::fetch()) the same call goes
+// on from it. seek() then finds the StreamInfo only in the page cache.
+
+#ifndef NVR_STORAGE_CAMERA_READER_H
+#define NVR_STORAGE_CAMERA_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "storage/segment_index.h"
+#include "storage/segment_reader.h"
+
+namespace nvr {
+
+class CameraReader {
+ public:
+  CameraReader() = default;
+
+  CameraReader(const CameraReader&) = delete;
+  CameraReader& operator=(const CameraReader&) = delete;
+
+  // 0, -ENOENT if the index shows no records of cameraId, or -errno.
+  int open(const std::string& segmentPath, const std::string& cameraId);
+  void close();
+
+  bool indexed() const { return indexed_; }
+  void setNoWait(bool on) { noWait_ = on; }
+  // The last next() or readKeyframe() stopped at blockedChunk(), which is
+  // not in the page cache.
+  bool wouldBlock() const { return wouldBlock_; }
+  const ChunkEntry& blockedChunk() const { return blocked_; }
+  // The open segment file.
+  int fd() const { return reader_.fd(); }
+  // Latest StreamInfo of the camera read so far: known after the first
+  // next(), or after seek(). Null before.
+  const StreamInfo* streamInfo() const;
+
+  // Continues at the camera's latest keyframe at or before timestampUs (its
+  // first keyframe if earlier). False if the index has no keyframes of it.
+  bool seek(int64_t timestampUs);
+  // The camera's records in write order, including its StreamInfo records.
+  bool next(SegmentReader::Record* record);
+
+  // Trick play, which walks keyframes rather than records. The camera's
+  // keyframes from the index, in time order; empty without an index.
+  void keyframes(std::vector<KeyframeEntry>* out) const;
+  // Reads the keyframe of one of those entries: a single chunk read, none
+  // if it shares the chunk of the one before. next() then continues after
+  // it. False if the chunk is unreadable or holds no such keyframe.
+  bool readKeyframe(const KeyframeEntry& entry, SegmentReader::Record* record);
+
+  // The chunks next() reads next, in order.
+  const ChunkEntry* nextChunks(size_t* count) const {
+    *count = chunks_.size() - nextChunk_;
+    return chunks_.data() + nextChunk_;
+  }
+  // The chunk starting at offset (a keyframe's blockOffset); false if none.
+  bool chunkAt(uint64_t offset, ChunkEntry* out) const;
+
+  uint64_t bytesRead() const { return reader_.bytesRead(); }
+  size_t chunksRead() const { return chunksRead_; }
+  uint64_t cacheHits() const { return reader_.cacheHits(); }
+  uint64_t cacheMisses() const { return reader_.cacheMisses(); }
+  uint64_t missedBytes() const { return reader_.missedBytes(); }
+
+ private:
+  bool ownStream(uint32_t streamId);
+  bool nextChunk();
+
+  SegmentReader reader_;
+  SegmentIndex index_;
+  std::string cameraId_;
+  bool indexed_ = false;
+  std::vector<size_t> streams_;     // index streams of the camera
+  std::set<uint32_t> streamIds_;
+  std::vector<ChunkEntry> chunks_;  // merged over streams_, in file order
+  size_t nextChunk_ = 0;
+  size_t chunksRead_ = 0;
+  int64_t skipBeforeUs_ = 0;        // after seek(): drop frames before the keyframe
+  uint32_t infoStream_ = 0;
+  bool noWait_ = false;
+  bool wouldBlock_ = false;
+  ChunkEntry blocked_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_CAMERA_READER_H
@@ -0,0 +1,214 @@
+#include "storage/camera_recorder.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "base/clock.h"
+
+namespace nvr {
+
+namespace {
+
+// Beyond this the RTP clock and the wall clock are considered out of step
+// (camera restarted its timestamps, or the RTP clock drifts) and the
+// mapping is re-anchored.
+constexpr int64_t kMaxClockSkewUs = 2000000;
+
+void appendAnnexB(std::string* out, const std::string& nal) {
+  if (nal.empty()) return;
+  out->append("\0\0\0\1", 4);
+  out->append(nal);
+}
+
+}  // namespace
+
+bool CameraRecorder::canRecord(const SdpMedia& media) {
+  return media.type == "video" && media.clockRate > 0 &&
+         videoCodecFromEncoding(media.encoding) != VideoCodec::Unknown;
+}
+
+CameraRecorder::CameraRecorder(SegmentWriter* writer, const std::string& cameraId,
+                               const SdpMedia& media)
+    : writer_(writer),
+      cameraId_(cameraId),
+      media_(media),
+      codec_(videoCodecFromEncoding(media.encoding)),
+      assembler_(codec_, this),
+      depacketizer_(codec_, &assembler_),
+      clock_(static_cast<uint32_t>(media.clockRate)) {
+  ParameterSets sets;
+  if (parseSpropParameterSets(codec_, media.fmtp, &sets)) assembler_.setParameterSets(sets);
+  streamId_ = writer_->addStream(streamInfo());
+}
+
+CameraRecorder::~CameraRecorder() { writer_->removeStream(streamId_); }
+
+StreamInfo CameraRecorder::streamInfo() const {
+  StreamInfo info;
+  info.cameraId = cameraId_;
+  info.codec = media_.encoding;
+  info.clockRate = static_cast<uint32_t>(media_.clockRate);
+  const ParameterSets& sets = assembler_.parameterSets();
+  appendAnnexB(&info.extradata, sets.vps);
+  appendAnnexB(&info.extradata, sets.sps);
+  appendAnnexB(&info.extradata, sets.pps);
+  return info;
+}
+
+void CameraRecorder::onRtpPacket(const PacketRef& packet) {
+  depacketizer_.push(packet.data(), packet.size());
+}
+
+void CameraRecorder::onSenderReport(uint32_t rtpTimestamp, int64_t senderUs) {
+  clock_.addReport(rtpTimestamp, senderUs);
+  clockChanged_ = true;
+}
+
+void CameraRecorder::reset() {
+  depacketizer_.reset();
+  assembler_.reset();
+  waitingForKeyframe_ = true;
+  anchored_ = false;
+  // A new session has a new RTP timeline; frames go by arrival again until
+  // its first sender report.
+  clock_.reset();
+  senderAnchored_ = false;
+  clockChanged_ = false;
+  writer_->setStreamClock(streamId_, StreamClock());
+  // The pre-roll would run up to the gap; a trigger now records from the
+  // first keyframe after it.
+  if (ring_) ring_->clear();
+}
+
+void CameraRecorder::setEventOnly(std::unique_ptr<PreEventRing> ring) {
+  eventOnly_ = true;
+  ring_ = std::move(ring);
+  recordUntilUs_ = 0;
+}
+
+void CameraRecorder::trigger(int64_t untilUs) {
+  if (!eventOnly_) return;
+  ++stats_.triggers;
+  if (recordUntilUs_ != 0) {
+    recordUntilUs_ = std::max(recordUntilUs_, untilUs);
+    return;
+  }
+  recordUntilUs_ = untilUs;
+  if (!ring_ || ring_->frames() == 0) {
+    // Whatever came before was dropped.
+    waitingForKeyframe_ = true;
+    return;
+  }
+  bool skipping = false;
+  ring_->flush([this, &skipping](const PreEventFrame& frame) {
+    if (skipping && !frame.keyframe) {
+      ++stats_.skipped;
+      return;
+    }
+    skipping = !writer_->append(streamId_, RecordType::Video,
+                                kRecordEvent | (frame.keyframe ? kRecordKeyframe : 0),
+                                frame.timestampUs, frame.data, frame.size);
+    if (skipping) {
+      ++stats_.skipped;
+      return;
+    }
+    ++stats_.frames;
+    ++stats_.preEventFrames;
+    if (frame.keyframe) ++stats_.keyframes;
+    stats_.bytes += frame.size;
+  });
+  // Live frames continue the pre-roll's GOP unless its tail was dropped,
+  // or the stream broke after it and is still waiting for a keyframe.
+  waitingForKeyframe_ = waitingForKeyframe_ || skipping;
+}
+
+StreamClock CameraRecorder::streamClock() const {
+  StreamClock clock;
+  clock.rtpTimestamp = clock_.anchorRtp();
+  clock.clockRate = static_cast<uint32_t>(media_.clockRate);
+  clock.senderUs = clock_.anchorSenderUs();
+  clock.offsetUs = senderOffsetUs_;
+  clock.driftPpb = clock_.driftPpb();
+  clock.residualUs = clock_.residualUs();
+  clock.reports = static_cast<uint32_t>(clock_.reports());
+  return clock;
+}
+
+int64_t CameraRecorder::senderClock(uint32_t rtpTimestamp, int64_t nowUs) {
+  int64_t sender = clock_.senderUs(rtpTimestamp);
+  int64_t us = sender + senderOffsetUs_;
+  if (!senderAnchored_ || us - nowUs > kMaxClockSkewUs || nowUs - us > kMaxClockSkewUs) {
+    if (senderAnchored_) ++stats_.clockResets;
+    senderAnchored_ = true;
+    // A camera clock that agrees with ours is taken as is, so that cameras
+    // on the same NTP server line up exactly; one that is off is moved onto
+    // ours by the frame's arrival.
+    bool agrees = sender - nowUs <= kMaxClockSkewUs && nowUs - sender <= kMaxClockSkewUs;
+    senderOffsetUs_ = agrees ? 0 : nowUs - sender;
+    us = sender + senderOffsetUs_;
+    clockChanged_ = true;
+  }
+  if (clockChanged_) {
+    clockChanged_ = false;
+    writer_->setStreamClock(streamId_, streamClock());
+  }
+  return us;
+}
+
+int64_t CameraRecorder::wallClock(uint32_t rtpTimestamp) {
+  int64_t now = wallClockUs();
+  if (clock_.synced()) return senderClock(rtpTimestamp, now);
+  if (anchored_) {
+    lastRtp_ += static_cast<int32_t>(rtpTimestamp - lastRtpRaw_);
+  } else {
+    lastRtp_ = rtpTimestamp;
+  }
+  lastRtpRaw_ = rtpTimestamp;
+  int64_t us = anchorWallUs_ + (lastRtp_ - anchorRtp_) * 1000000 / media_.clockRate;
+  if (!anchored_ || us - now > kMaxClockSkewUs || now - us > kMaxClockSkewUs) {
+    if (anchored_) ++stats_.clockResets;
+    anchored_ = true;
+    anchorWallUs_ = now;
+    anchorRtp_ = lastRtp_;
+    us = now;
+  }
+  return us;
+}
+
+void CameraRecorder::onFrame(const Frame& frame) {
+  if (assembler_.takeParameterSetsChanged()) writer_->updateStream(streamId_, streamInfo());
+  if (frame.corrupt) {
+    ++stats_.corrupt;
+    ++stats_.skipped;
+    waitingForKeyframe_ = true;
+    if (ring_) ring_->skipToKeyframe();
+    return;
+  }
+  if (waitingForKeyframe_ && !frame.keyframe) {
+    ++stats_.skipped;
+    return;
+  }
+  waitingForKeyframe_ = false;
+  int64_t timestampUs = wallClock(frame.rtpTimestamp);
+  if (eventOnly_) {
+    // Recording ends at a GOP boundary so the ring starts at a keyframe.
+    if (recordUntilUs_ != 0 && frame.keyframe && timestampUs > recordUntilUs_)
+      recordUntilUs_ = 0;
+    if (recordUntilUs_ == 0) {
+      if (ring_) ring_->push(timestampUs, frame.keyframe, frame.data, frame.size);
+      return;
+    }
+  }
+  uint8_t flags = (frame.keyframe ? kRecordKeyframe : 0) | (eventOnly_ ? kRecordEvent : 0);
+  if (!writer_->append(streamId_, RecordType::Video, flags, timestampUs, frame.data, frame.size)) {
+    ++stats_.skipped;
+    // The decoder needs the reference chain; resume at the next keyframe.
+    waitingForKeyframe_ = true;
+    return;
+  }
+  ++stats_.frames;
+  if (frame.keyframe) ++stats_.keyframes;
+  stats_.bytes += frame.size;
+}
+
+}  // namespace nvr
@@ -0,0 +1,123 @@
+// Records one camera's video track into a recording group.
+//
+// RTP packets are depacketized into NAL units, grouped into frames and
+// appended to the group's SegmentWriter with a wall clock timestamp derived
+// from the RTP clock. Once the camera's RTCP sender reports arrive that is
+// the camera's own clock, fitted over the reports (rtp_clock_sync.h) and
+// written to the recording as the stream's clock mapping; until then, and
+// for cameras that send none, the RTP clock is anchored at the arrival time
+// of the first frame. Recording starts at the first keyframe; parameter set
+// changes are written as a new StreamInfo record. A frame broken by packet
+// loss is not written, and neither is anything after it up to the next
+// keyframe, since those frames reference it.
+//
+// In event-only mode frames go to a pre-event ring instead (see
+// pre_event_buffer.h). A trigger writes the ring's pre-roll and then records
+// live until the trigger's end time, stopping at the next keyframe after
+// it; later frames go back to the ring.
+
+#ifndef NVR_STORAGE_CAMERA_RECORDER_H
+#define NVR_STORAGE_CAMERA_RECORDER_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "base/packet_buffer.h"
+#include "media/frame_assembler.h"
+#include "media/rtp_depacketizer.h"
+#include "rtp/rtp_clock_sync.h"
+#include "rtsp/sdp.h"
+#include "storage/pre_event_buffer.h"
+#include "storage/segment_writer.h"
+
+namespace nvr {
+
+class CameraRecorder : public FrameHandler {
+ public:
+  struct Stats {
+    uint64_t frames = 0;
+    uint64_t keyframes = 0;
+    uint64_t bytes = 0;
+    uint64_t skipped = 0;  // before the first keyframe, broken by loss, or dropped by the writer
+    uint64_t corrupt = 0;  // of the skipped: frames that lost packets
+    uint64_t clockResets = 0;
+    uint64_t triggers = 0;
+    uint64_t preEventFrames = 0;  // written from the pre-event ring
+  };
+
+  // media must be a video track with a known codec (see canRecord()).
+  CameraRecorder(SegmentWriter* writer, const std::string& cameraId, const SdpMedia& media);
+  ~CameraRecorder() override;
+
+  CameraRecorder(const CameraRecorder&) = delete;
+  CameraRecorder& operator=(const CameraRecorder&) = delete;
+
+  static bool canRecord(const SdpMedia& media);
+
+  void onRtpPacket(const PacketRef& packet);
+  // An RTCP sender report of the recorded track; senderUs is its NTP time.
+  void onSenderReport(uint32_t rtpTimestamp, int64_t senderUs);
+  // After a reconnect: drops partial frames and waits for a keyframe.
+  void reset();
+
+  // Switches to event-only recording. ring may be null (no slot left), in
+  // which case triggers record without pre-roll.
+  void setEventOnly(std::unique_ptr<PreEventRing> ring);
+  // Records until untilUs (wall clock), starting with the buffered pre-roll.
+  // A trigger while recording extends the end time.
+  void trigger(int64_t untilUs);
+  bool eventOnly() const { return eventOnly_; }
+  bool triggered() const { return recordUntilUs_ != 0; }
+  const PreEventRing* preEventRing() const { return ring_.get(); }
+
+  void onFrame(const Frame& frame) override;
+
+  const Stats& stats() const { return stats_; }
+  // Whether frames are timed by the camera's clock, and its mapping.
+  bool senderTimed() const { return senderAnchored_; }
+  const RtpClockSync& clockSync() const { return clock_; }
+  // This camera's part of its group's disk queue.
+  SegmentStreamStats writeStats() const { return writer_->streamStats(streamId_); }
+
+ private:
+  int64_t wallClock(uint32_t rtpTimestamp);
+  int64_t senderClock(uint32_t rtpTimestamp, int64_t nowUs);
+  StreamInfo streamInfo() const;
+  StreamClock streamClock() const;
+
+  SegmentWriter* writer_;
+  std::string cameraId_;
+  SdpMedia media_;
+  VideoCodec codec_;
+  FrameAssembler assembler_;
+  RtpDepacketizer depacketizer_;
+  uint32_t streamId_;
+  bool waitingForKeyframe_ = true;
+
+  bool eventOnly_ = false;
+  std::unique_ptr<PreEventRing> ring_;
+  int64_t recordUntilUs_ = 0;  // 0: not triggered
+
+  // RTP timestamp -> wall clock. Anchored at the first frame and re-anchored
+  // when the two drift apart.
+  bool anchored_ = false;
+  int64_t anchorWallUs_ = 0;
+  int64_t anchorRtp_ = 0;
+  int64_t lastRtp_ = 0;  // extended (unwrapped) timestamp
+  uint32_t lastRtpRaw_ = 0;
+
+  // RTP timestamp -> the camera's clock, from its sender reports, shifted
+  // onto ours only if the two are too far apart.
+  RtpClockSync clock_;
+  bool senderAnchored_ = false;
+  int64_t senderOffsetUs_ = 0;
+  bool clockChanged_ = false;  // not yet passed to the writer
+
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_CAMERA_RECORDER_H
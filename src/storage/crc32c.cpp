@@ -0,0 +1,67 @@
+#include "storage/crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define NVR_CRC_SSE42 1
+#endif
+
+namespace nvr {
+
+namespace {
+
+constexpr uint32_t kPolynomial = 0x82f63b78;  // reflected Castagnoli
+
+struct Table {
+  uint32_t entries[256];
+  Table() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) c = c & 1 ? (c >> 1) ^ kPolynomial : c >> 1;
+      entries[i] = c;
+    }
+  }
+};
+
+uint32_t crcTable(uint32_t crc, const uint8_t* p, size_t size) {
+  static const Table table;
+  for (size_t i = 0; i < size; ++i) crc = table.entries[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef NVR_CRC_SSE42
+__attribute__((target("sse4.2"))) uint32_t crcSse42(uint32_t crc, const uint8_t* p, size_t size) {
+  uint64_t c = crc;
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    c = _mm_crc32_u64(c, word);
+    p += 8;
+    size -= 8;
+  }
+  uint32_t c32 = static_cast<uint32_t>(c);
+  while (size-- > 0) c32 = _mm_crc32_u8(c32, *p++);
+  return c32;
+}
+#endif
+
+using CrcFn = uint32_t (*)(uint32_t, const uint8_t*, size_t);
+
+CrcFn pickCrc() {
+#ifdef NVR_CRC_SSE42
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) return crcSse42;
+#endif
+  return crcTable;
+}
+
+const CrcFn g_crc = pickCrc();
+
+}  // namespace
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size) {
+  return ~g_crc(~crc, static_cast<const uint8_t*>(data), size);
+}
+
+}  // namespace nvr
@@ -0,0 +1,18 @@
+// CRC-32C (Castagnoli), the checksum of every block written to a segment.
+// Uses the SSE4.2 crc32 instruction when the CPU has it, a table otherwise.
+
+#ifndef NVR_STORAGE_CRC32C_H
+#define NVR_STORAGE_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace nvr {
+
+// crc is the value returned for the preceding data (0 to start).
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+inline uint32_t crc32c(const void* data, size_t size) { return crc32c(0, data, size); }
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_CRC32C_H
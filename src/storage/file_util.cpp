@@ -0,0 +1,61 @@
+#include "storage/file_util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nvr {
+
+int makeDirectories(const std::string& path) {
+  for (size_t pos = 1; pos <= path.size(); ++pos) {
+    if (pos != path.size() && path[pos] != '/') continue;
+    std::string prefix = path.substr(0, pos);
+    if (mkdir(prefix.c_str(), 0755) < 0 && errno != EEXIST) return -errno;
+  }
+  return 0;
+}
+
+int listDirectory(const std::string& dir, std::vector<std::string>* names) {
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) return -errno;
+  while (struct dirent* entry = readdir(d)) {
+    std::string name = entry->d_name;
+    if (name != "." && name != "..") names->push_back(name);
+  }
+  closedir(d);
+  return 0;
+}
+
+int writeFileAtomic(const std::string& path, const std::string& data) {
+  std::string tmp = path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return -errno;
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      int rc = -errno;
+      ::close(fd);
+      unlink(tmp.c_str());
+      return rc;
+    }
+    done += static_cast<size_t>(n);
+  }
+  int rc = fdatasync(fd) < 0 ? -errno : 0;
+  ::close(fd);
+  if (rc == 0 && rename(tmp.c_str(), path.c_str()) < 0) rc = -errno;
+  if (rc < 0) unlink(tmp.c_str());
+  return rc;
+}
+
+bool isSameFile(int fd, const std::string& path) {
+  struct stat opened, named;
+  if (fstat(fd, &opened) < 0 || stat(path.c_str(), &named) < 0) return false;
+  return opened.st_dev == named.st_dev && opened.st_ino == named.st_ino;
+}
+
+}  // namespace nvr
@@ -0,0 +1,32 @@
+// Small filesystem helpers for the storage layer.
+
+#ifndef NVR_STORAGE_FILE_UTIL_H
+#define NVR_STORAGE_FILE_UTIL_H
+
+#include <string>
+#include <vector>
+
+namespace nvr {
+
+// mkdir -p. Returns 0 or -errno.
+int makeDirectories(const std::string& path);
+
+// Names of the entries in dir, without "." and "..". Returns 0 or -errno.
+int listDirectory(const std::string& dir, std::vector<std::string>* names);
+
+// Replaces path with data through a synced temporary file and rename(), so
+// readers see either the old or the new contents. Returns 0 or -errno.
+int writeFileAtomic(const std::string& path, const std::string& data);
+
+// True if path still names the file open on fd: false once it has been
+// renamed over or unlinked.
+bool isSameFile(int fd, const std::string& path);
+
+inline std::string joinPath(const std::string& dir, const std::string& name) {
+  if (dir.empty() || dir.back() == '/') return dir + name;
+  return dir + "/" + name;
+}
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_FILE_UTIL_H
@@ -0,0 +1,75 @@
+#include "storage/io_backend.h"
+
+#include "storage/thread_pool_io.h"
+#include "storage/uring_io.h"
+
+namespace nvr {
+
+const char* ioBackendKindName(IoBackendKind kind) {
+  switch (kind) {
+    case IoBackendKind::Uring: return "uring";
+    case IoBackendKind::Threads: return "threads";
+    default: return "auto";
+  }
+}
+
+bool parseIoBackendKind(const std::string& name, IoBackendKind* kind) {
+  if (name == "auto") {
+    *kind = IoBackendKind::Auto;
+  } else if (name == "uring") {
+    *kind = IoBackendKind::Uring;
+  } else if (name == "threads") {
+    *kind = IoBackendKind::Threads;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+IoStats IoBackend::stats() const {
+  std::lock_guard<std::mutex> lock(statsMutex_);
+  return stats_;
+}
+
+void IoBackend::complete(EventLoop* loop, Completion done, int64_t result) {
+  if (!done) return;
+  if (loop) {
+    loop->post([done, result] { done(result); });
+  } else {
+    done(result);
+  }
+}
+
+void IoBackend::countWrite(int fd, uint64_t offset, size_t size, bool fixed) {
+  std::lock_guard<std::mutex> lock(statsMutex_);
+  ++stats_.ops;
+  ++stats_.writes;
+  stats_.bytesWritten += size;
+  if (fixed) ++stats_.fixedOps;
+  if (fd != lastFd_ || offset != lastEnd_) ++stats_.seeks;
+  lastFd_ = fd;
+  lastEnd_ = offset + size;
+}
+
+void IoBackend::countRead(size_t size, bool fixed) {
+  std::lock_guard<std::mutex> lock(statsMutex_);
+  ++stats_.ops;
+  ++stats_.reads;
+  stats_.bytesRead += size;
+  if (fixed) ++stats_.fixedOps;
+}
+
+void IoBackend::countOp(bool sync) {
+  std::lock_guard<std::mutex> lock(statsMutex_);
+  ++stats_.ops;
+  if (sync) ++stats_.syncs;
+}
+
+std::unique_ptr<IoBackend> createIoBackend(const IoBackendOptions& options) {
+  if (options.kind != IoBackendKind::Threads && UringIoBackend::supported())
+    return std::unique_ptr<IoBackend>(new UringIoBackend(options));
+  if (options.kind == IoBackendKind::Uring) return nullptr;
+  return std::unique_ptr<IoBackend>(new ThreadPoolIoBackend(options.threads));
+}
+
+}  // namespace nvr
@@ -0,0 +1,129 @@
+// Asynchronous file I/O for recording and replay.
+//
+// Event loops never wait on the disk: writers and readers submit writes,
+// reads, syncs and other file operations to an IoBackend and get each
+// result back as a task posted to their loop. Operations may run
+// concurrently and complete in any order; a caller that needs one to follow
+// another issues the second from the first one's completion. writeSync()
+// is the one ordered pair: the fdatasync() starts once the write is done.
+//
+// Two backends:
+//   uring    io_uring driven by one reaper thread. Segment files and chunk
+//            buffers are registered with the ring, so writes skip the
+//            per-operation file lookup and page pinning, and a block write
+//            and its sync go down as one linked submission.
+//   threads  a pool of threads running pwrite()/pread(), for kernels
+//            without io_uring or where it is disabled.
+// Both let replay reads overtake queued recording writes.
+
+#ifndef NVR_STORAGE_IO_BACKEND_H
+#define NVR_STORAGE_IO_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "base/event_loop.h"
+
+namespace nvr {
+
+enum class IoBackendKind {
+  Auto,  // io_uring when the kernel supports it, else threads
+  Uring,
+  Threads,
+};
+
+const char* ioBackendKindName(IoBackendKind kind);
+bool parseIoBackendKind(const std::string& name, IoBackendKind* kind);
+
+struct IoBackendOptions {
+  IoBackendKind kind = IoBackendKind::Auto;
+  int threads = 4;                         // thread pool workers
+  unsigned queueDepth = 256;               // io_uring submission queue entries
+  unsigned maxWritesInFlight = 16;         // io_uring writes and syncs in the ring
+  unsigned maxFiles = 4096;                // io_uring registered file slots
+  unsigned maxBuffers = 1024;              // io_uring registered buffer slots
+  size_t maxRegisteredBytes = 64 << 20;    // pinned by registered buffers
+};
+
+struct IoStats {
+  uint64_t ops = 0;
+  uint64_t writes = 0;
+  uint64_t bytesWritten = 0;
+  // Writes that do not continue where the previously submitted write
+  // ended (another file or offset): on a spinning disk, each is a head
+  // seek.
+  uint64_t seeks = 0;
+  uint64_t reads = 0;
+  uint64_t bytesRead = 0;
+  uint64_t syncs = 0;
+  // Writes and reads on a registered file from a registered buffer.
+  uint64_t fixedOps = 0;
+};
+
+class IoBackend {
+ public:
+  // result is bytes transferred (reads, writes), the op's return value
+  // (call) or 0, or -errno. Reads and writes are retried until complete;
+  // a read short of size means end of file.
+  using Completion = std::function<void(int64_t result)>;
+
+  virtual ~IoBackend() = default;
+
+  virtual const char* name() const = 0;
+  // 0 or -errno.
+  virtual int start() = 0;
+  // Completes everything already submitted, then stops. Idempotent.
+  virtual void stop() = 0;
+
+  // Buffers must stay valid until done runs. done is posted to loop, or
+  // runs on a backend thread when loop is null.
+  virtual void write(int fd, const void* data, size_t size, uint64_t offset, EventLoop* loop,
+                     Completion done) = 0;
+  // write() followed by fdatasync(fd); the result is the write's, or the
+  // sync's error.
+  virtual void writeSync(int fd, const void* data, size_t size, uint64_t offset,
+                         EventLoop* loop, Completion done) = 0;
+  virtual void read(int fd, void* data, size_t size, uint64_t offset, EventLoop* loop,
+                    Completion done) = 0;
+  virtual void sync(int fd, EventLoop* loop, Completion done) = 0;
+  // Any other blocking file operation (fallocate, close, rename, ...).
+  virtual void call(std::function<int64_t()> op, EventLoop* loop, Completion done) = 0;
+
+  // Registration only makes I/O cheaper; a backend may ignore it, and
+  // I/O on unregistered files and buffers works the same. Unregister a
+  // file or buffer once the operations using it have completed, before
+  // closing or freeing it. Thread-safe.
+  virtual void registerFile(int fd) { (void)fd; }
+  virtual void unregisterFile(int fd) { (void)fd; }
+  virtual void registerBuffer(const void* data, size_t size) { (void)data, (void)size; }
+  virtual void unregisterBuffer(const void* data) { (void)data; }
+
+  // Operations submitted and not yet completed.
+  virtual size_t pending() const = 0;
+  IoStats stats() const;
+
+ protected:
+  static void complete(EventLoop* loop, Completion done, int64_t result);
+  void countWrite(int fd, uint64_t offset, size_t size, bool fixed);
+  void countRead(size_t size, bool fixed);
+  void countOp(bool sync);
+
+ private:
+  mutable std::mutex statsMutex_;
+  IoStats stats_;
+  int lastFd_ = -1;
+  uint64_t lastEnd_ = 0;
+};
+
+// Creates an unstarted backend; for Auto, io_uring if the kernel supports
+// it. Null if kind is Uring and it does not.
+std::unique_ptr<IoBackend> createIoBackend(const IoBackendOptions& options);
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_IO_BACKEND_H
@@ -0,0 +1,255 @@
+#include "storage/pre_event_buffer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/log.h"
+
+namespace nvr {
+
+namespace {
+
+// Record header in the slot; frame bytes follow, padded to kRecordAlign.
+struct RecordHeader {
+  int64_t timestampUs;
+  uint32_t size;
+  uint32_t flags;
+};
+
+constexpr uint32_t kKeyframe = 1;
+constexpr uint32_t kSkipToStart = 2;  // nothing more before the end of the slot
+constexpr size_t kRecordAlign = sizeof(RecordHeader);
+constexpr size_t kNoSpace = static_cast<size_t>(-1);
+// Keyframes a ring can track: all-intra video at 25 fps for 10 s, or one
+// per 16 KB of slot if that is more. Beyond that the oldest GOP goes.
+constexpr size_t kMinKeyframes = 256;
+
+size_t recordBytes(size_t frameSize) {
+  return (sizeof(RecordHeader) + frameSize + kRecordAlign - 1) & ~(kRecordAlign - 1);
+}
+
+size_t pageSize() {
+  long page = sysconf(_SC_PAGESIZE);
+  return page > 0 ? static_cast<size_t>(page) : 4096;
+}
+
+}  // namespace
+
+size_t preEventSlotBytes(uint32_t bitrateKbps, uint32_t preRollMs, uint32_t gopMs) {
+  uint64_t bytes = static_cast<uint64_t>(bitrateKbps) * (preRollMs + gopMs) / 8;
+  bytes += bytes / 4;
+  size_t page = pageSize();
+  return static_cast<size_t>((bytes + page - 1) / page * page);
+}
+
+PreEventArena::PreEventArena(size_t slots, size_t slotBytes, bool populate)
+    : slots_(slots) {
+  size_t page = pageSize();
+  slotBytes_ = std::max(page, (slotBytes + page - 1) / page * page);
+  mappedBytes_ = slots_ * slotBytes_;
+  if (mappedBytes_ == 0) return;
+  void* p = mmap(nullptr, mappedBytes_, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | (populate ? MAP_POPULATE : 0), -1, 0);
+  if (p == MAP_FAILED) {
+    NVR_ERROR("pre-event arena: cannot map %zu bytes: %s", mappedBytes_, strerror(errno));
+    mappedBytes_ = 0;
+    return;
+  }
+  base_ = static_cast<uint8_t*>(p);
+  rings_.assign(slots_, nullptr);
+  free_.reserve(slots_);
+  for (size_t i = slots_; i > 0; --i) free_.push_back(i - 1);
+}
+
+PreEventArena::~PreEventArena() {
+  if (base_) munmap(base_, mappedBytes_);
+}
+
+std::unique_ptr<PreEventRing> PreEventArena::acquire(int64_t preRollUs) {
+  size_t slot;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.empty()) {
+      ++exhausted_;
+      return nullptr;
+    }
+    slot = free_.back();
+    free_.pop_back();
+  }
+  std::unique_ptr<PreEventRing> ring(
+      new PreEventRing(this, slot, base_ + slot * slotBytes_, slotBytes_, preRollUs));
+  std::lock_guard<std::mutex> lock(mutex_);
+  rings_[slot] = ring.get();
+  return ring;
+}
+
+void PreEventArena::release(size_t slot) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  rings_[slot] = nullptr;
+  free_.push_back(slot);
+}
+
+PreEventArena::Stats PreEventArena::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats;
+  stats.slots = slots_;
+  stats.slotBytes = slotBytes_;
+  stats.reservedBytes = mappedBytes_;
+  stats.inUse = slots_ - free_.size();
+  stats.exhausted = exhausted_;
+  for (const PreEventRing* ring : rings_) {
+    if (ring) stats.bufferedBytes += ring->reportedBytes_.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+PreEventRing::PreEventRing(PreEventArena* arena, size_t slot, uint8_t* base, size_t capacity,
+                           int64_t preRollUs)
+    : arena_(arena), slot_(slot), base_(base), capacity_(capacity), preRollUs_(preRollUs) {
+  keys_.resize(std::max(kMinKeyframes, capacity / (16 * 1024)));
+}
+
+PreEventRing::~PreEventRing() { arena_->release(slot_); }
+
+int64_t PreEventRing::durationUs() const {
+  if (frames_ == 0) return 0;
+  return newestUs_ - reinterpret_cast<const RecordHeader*>(base_ + tail_)->timestampUs;
+}
+
+size_t PreEventRing::nextOffset(size_t offset) const {
+  auto* header = reinterpret_cast<const RecordHeader*>(base_ + offset);
+  offset += recordBytes(header->size);
+  if (offset == head_) return offset;
+  if (capacity_ - offset < sizeof(RecordHeader)) return 0;
+  header = reinterpret_cast<const RecordHeader*>(base_ + offset);
+  return header->flags & kSkipToStart ? 0 : offset;
+}
+
+void PreEventRing::evictFrame() {
+  size_t next = nextOffset(tail_);
+  --frames_;
+  ++stats_.evictedFrames;
+  if (frames_ == 0) {
+    clear();
+    return;
+  }
+  // Going back to the start frees the skipped end as well.
+  used_ -= next > tail_ ? next - tail_ : capacity_ - tail_;
+  tail_ = next;
+}
+
+void PreEventRing::evictGop() {
+  if (frames_ == 0) return;
+  bool wait = waitingForKeyframe_;
+  do {
+    evictFrame();
+  } while (frames_ > 0 &&
+           !(reinterpret_cast<const RecordHeader*>(base_ + tail_)->flags & kKeyframe));
+  // clear() starts over at a keyframe; the frames still coming belong to
+  // the GOP being written and must keep going in.
+  waitingForKeyframe_ = wait;
+  if (keyCount_ > 0) {
+    keyFirst_ = (keyFirst_ + 1) % keys_.size();
+    --keyCount_;
+  }
+  ++stats_.evictedGops;
+}
+
+size_t PreEventRing::allocate(size_t bytes, bool keyframe) {
+  if (bytes > capacity_) return kNoSpace;
+  for (;;) {
+    if (frames_ == 0) {
+      // Only a keyframe may start the ring.
+      if (!keyframe) return kNoSpace;
+      head_ = tail_ = used_ = 0;
+      return 0;
+    }
+    if (head_ > tail_) {
+      // Free: [head_, capacity_) and [0, tail_).
+      if (capacity_ - head_ >= bytes) return head_;
+      if (tail_ >= bytes) {
+        if (capacity_ - head_ >= sizeof(RecordHeader)) {
+          auto* skip = reinterpret_cast<RecordHeader*>(base_ + head_);
+          skip->size = 0;
+          skip->flags = kSkipToStart;
+        }
+        used_ += capacity_ - head_;
+        head_ = 0;
+        return 0;
+      }
+    } else if (head_ < tail_ && tail_ - head_ >= bytes) {
+      return head_;
+    }
+    evictGop();
+  }
+}
+
+bool PreEventRing::push(int64_t timestampUs, bool keyframe, const uint8_t* data,
+                        size_t size) {
+  if (keyframe) waitingForKeyframe_ = false;
+  if (waitingForKeyframe_) {
+    ++stats_.skipped;
+    return false;
+  }
+  if (keyframe && keyCount_ == keys_.size()) evictGop();
+  size_t bytes = recordBytes(size);
+  size_t offset = allocate(bytes, keyframe);
+  if (offset == kNoSpace) {
+    // Too large, or its GOP had to go to make room: start over.
+    clear();
+    ++stats_.skipped;
+    return false;
+  }
+  auto* header = reinterpret_cast<RecordHeader*>(base_ + offset);
+  header->timestampUs = timestampUs;
+  header->size = static_cast<uint32_t>(size);
+  header->flags = keyframe ? kKeyframe : 0;
+  memcpy(header + 1, data, size);
+  head_ = offset + bytes;
+  used_ += bytes;
+  ++frames_;
+  ++stats_.frames;
+  newestUs_ = timestampUs;
+  if (keyframe) {
+    keys_[(keyFirst_ + keyCount_) % keys_.size()] = timestampUs;
+    ++keyCount_;
+  }
+  // Keep the fewest GOPs that still cover the pre-roll.
+  while (keyCount_ >= 2 &&
+         keys_[(keyFirst_ + 1) % keys_.size()] <= timestampUs - preRollUs_)
+    evictGop();
+  highWater_ = std::max(highWater_, used_);
+  reportedBytes_.store(used_, std::memory_order_relaxed);
+  return true;
+}
+
+void PreEventRing::flush(const std::function<void(const PreEventFrame& frame)>& fn) {
+  size_t offset = tail_;
+  for (size_t i = 0; i < frames_; ++i) {
+    auto* header = reinterpret_cast<const RecordHeader*>(base_ + offset);
+    PreEventFrame frame;
+    frame.timestampUs = header->timestampUs;
+    frame.data = reinterpret_cast<const uint8_t*>(header + 1);
+    frame.size = header->size;
+    frame.keyframe = header->flags & kKeyframe;
+    fn(frame);
+    offset = nextOffset(offset);
+  }
+  ++stats_.flushes;
+  stats_.flushedFrames += frames_;
+  clear();
+}
+
+void PreEventRing::clear() {
+  head_ = tail_ = used_ = 0;
+  frames_ = 0;
+  keyFirst_ = keyCount_ = 0;
+  waitingForKeyframe_ = true;
+  reportedBytes_.store(0, std::memory_order_relaxed);
+}
+
+}  // namespace nvr
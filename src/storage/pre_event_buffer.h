@@ -0,0 +1,174 @@
+// Pre-event ring buffers for event-triggered recording.
+//
+// A camera that records only on events keeps its last few seconds of video
+// in memory, so that a motion or alarm trigger can write what led up to
+// it. Every camera's ring is a fixed slot of one PreEventArena: a single
+// mapping of slots x slotBytes made when the node starts, so the RAM spent
+// on pre-roll is known up front (2000 cameras x 10 s at 4 Mbit/s is one
+// 14 GiB arena; see preEventSlotBytes()) and never grows with load or
+// fragments the heap.
+//
+// A ring stores whole frames back to back, each contiguous, and always
+// starts at a keyframe: when a new frame does not fit, or the ring holds
+// more than the pre-roll, the oldest GOP is dropped as a unit. Flushing
+// hands each buffered frame to the caller in place and then empties the
+// ring; nothing is copied or allocated on the way in or out.
+//
+// The arena may be shared by the loops of a node: acquire and release are
+// locked (control plane), and a ring is then used from one loop only.
+
+#ifndef NVR_STORAGE_PRE_EVENT_BUFFER_H
+#define NVR_STORAGE_PRE_EVENT_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace nvr {
+
+class PreEventRing;
+
+// Slot size for a stream of bitrateKbps keeping preRollMs with keyframes
+// every gopMs: the pre-roll plus the GOP it may start in, and a quarter
+// on top for bitrate peaks, rounded to whole pages.
+size_t preEventSlotBytes(uint32_t bitrateKbps, uint32_t preRollMs, uint32_t gopMs);
+
+class PreEventArena {
+ public:
+  struct Stats {
+    size_t slots = 0;
+    size_t slotBytes = 0;
+    size_t reservedBytes = 0;  // slots x slotBytes, all mapped at start
+    size_t inUse = 0;
+    size_t bufferedBytes = 0;  // held by rings right now, as of their last push
+    uint64_t exhausted = 0;    // acquire() found no free slot
+  };
+
+  // With populate, every page is faulted in now, so the whole budget is
+  // committed at startup rather than as cameras fill their rings.
+  PreEventArena(size_t slots, size_t slotBytes, bool populate = false);
+  ~PreEventArena();
+
+  PreEventArena(const PreEventArena&) = delete;
+  PreEventArena& operator=(const PreEventArena&) = delete;
+
+  bool valid() const { return base_ != nullptr; }
+  size_t slotBytes() const { return slotBytes_; }
+
+  // Any thread. A ring keeping preRollUs of video, or null when every slot
+  // is taken. The ring returns its slot when destroyed and must not outlive
+  // the arena.
+  std::unique_ptr<PreEventRing> acquire(int64_t preRollUs);
+
+  Stats stats() const;
+
+ private:
+  friend class PreEventRing;
+
+  void release(size_t slot);
+
+  uint8_t* base_ = nullptr;
+  size_t slots_;
+  size_t slotBytes_;
+  size_t mappedBytes_ = 0;
+  mutable std::mutex mutex_;
+  std::vector<size_t> free_;
+  std::vector<PreEventRing*> rings_;  // by slot, for stats
+  uint64_t exhausted_ = 0;
+};
+
+struct PreEventFrame {
+  int64_t timestampUs = 0;
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+  bool keyframe = false;
+};
+
+class PreEventRing {
+ public:
+  struct Stats {
+    uint64_t frames = 0;         // pushed
+    uint64_t evictedFrames = 0;  // dropped from the old end
+    uint64_t evictedGops = 0;
+    uint64_t skipped = 0;        // before the first keyframe, or too large for the slot
+    uint64_t flushes = 0;
+    uint64_t flushedFrames = 0;
+  };
+
+  ~PreEventRing();
+
+  PreEventRing(const PreEventRing&) = delete;
+  PreEventRing& operator=(const PreEventRing&) = delete;
+
+  // Appends a frame, evicting whole GOPs from the old end as needed. Frames
+  // before the first keyframe are skipped, as is a frame larger than the
+  // slot (the ring then waits for the next keyframe). Returns false when
+  // the frame was skipped.
+  bool push(int64_t timestampUs, bool keyframe, const uint8_t* data, size_t size);
+
+  // Visits the buffered frames oldest first, starting at a keyframe, then
+  // empties the ring. The frames point into the slot and are valid only
+  // during the call.
+  void flush(const std::function<void(const PreEventFrame& frame)>& fn);
+  // Empties the ring, e.g. after a reconnect.
+  void clear();
+  // The stream broke (a frame lost packets): frames up to the next
+  // keyframe are skipped, while what is buffered stays and still ends at a
+  // decodable frame.
+  void skipToKeyframe() { waitingForKeyframe_ = true; }
+
+  size_t capacity() const { return capacity_; }
+  size_t bufferedBytes() const { return used_; }
+  size_t highWaterBytes() const { return highWater_; }
+  size_t frames() const { return frames_; }
+  size_t gops() const { return keyCount_; }
+  // Span from the oldest buffered frame to the newest.
+  int64_t durationUs() const;
+  const Stats& stats() const { return stats_; }
+
+ private:
+  friend class PreEventArena;
+
+  PreEventRing(PreEventArena* arena, size_t slot, uint8_t* base, size_t capacity,
+               int64_t preRollUs);
+
+  // Offset for a record of bytes, evicting GOPs to make room, or npos when
+  // it cannot be placed without losing the GOP a non-keyframe belongs to.
+  size_t allocate(size_t bytes, bool keyframe);
+  void evictFrame();
+  void evictGop();
+  // Offset of the record after the one at offset, past a skipped end.
+  size_t nextOffset(size_t offset) const;
+
+  PreEventArena* arena_;
+  size_t slot_;
+  uint8_t* base_;
+  size_t capacity_;
+  int64_t preRollUs_;
+
+  size_t head_ = 0;  // where the next frame goes
+  size_t tail_ = 0;  // oldest frame
+  size_t used_ = 0;  // bytes between tail and head, counting a skipped end
+  size_t frames_ = 0;
+  size_t highWater_ = 0;
+  std::atomic<size_t> reportedBytes_{0};  // used_, for the arena's stats
+  int64_t newestUs_ = 0;
+  bool waitingForKeyframe_ = true;
+
+  // Timestamps of the buffered keyframes, oldest first in a circular array
+  // sized at construction.
+  std::vector<int64_t> keys_;
+  size_t keyFirst_ = 0;
+  size_t keyCount_ = 0;
+
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_PRE_EVENT_BUFFER_H
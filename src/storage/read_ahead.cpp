@@ -0,0 +1,165 @@
+#include "storage/read_ahead.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/clock.h"
+#include "storage/aligned_buffer.h"
+
+namespace nvr {
+
+bool ReadAheadBudget::acquire(uint64_t bytes) {
+  uint64_t used = used_.load(std::memory_order_relaxed);
+  do {
+    if (used + bytes > maxBytes_) {
+      denied_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  } while (!used_.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+  notePeak(used + bytes);
+  return true;
+}
+
+void ReadAheadBudget::charge(uint64_t bytes) {
+  notePeak(used_.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+}
+
+void ReadAheadBudget::notePeak(uint64_t used) {
+  uint64_t peak = peak_.load(std::memory_order_relaxed);
+  while (used > peak && !peak_.compare_exchange_weak(peak, used, std::memory_order_relaxed)) {
+  }
+}
+
+ReadAhead::ReadAhead(EventLoop* loop, IoBackend* io, ReadAheadBudget* budget,
+                     const ReadAheadOptions& options)
+    : loop_(loop),
+      io_(io),
+      budget_(budget),
+      options_(options),
+      self_(std::make_shared<ReadAhead*>(this)),
+      window_(options.minWindow) {}
+
+ReadAhead::~ReadAhead() {
+  *self_ = nullptr;
+  clear();
+}
+
+void ReadAhead::open(int fd) {
+  clear();
+  fd_ = fd;
+  // Only sets how the file is read ahead: no I/O.
+  if (fd >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+}
+
+void ReadAhead::clear() {
+  budget_->release(hinted_);
+  hinted_ = 0;
+  ranges_.clear();
+}
+
+bool ReadAhead::covered(const ChunkEntry& chunk) const {
+  for (const Range& r : ranges_)
+    if (chunk.offset >= r.offset && chunk.offset + chunk.size <= r.offset + r.size) return true;
+  return false;
+}
+
+void ReadAhead::advance(const ChunkEntry& chunk, const ChunkEntry* upcoming, size_t count) {
+  if (fd_ < 0) return;
+  int64_t now = monotonicUs();
+  if (sampleStartUs_ == 0) sampleStartUs_ = now;
+  sampleBytes_ += chunk.size;
+  if (now - sampleStartUs_ >= 1000000) {
+    double rate = sampleBytes_ * 1e6 / (now - sampleStartUs_);
+    bytesPerSecond_ = bytesPerSecond_ == 0 ? rate : (bytesPerSecond_ + rate) / 2;
+    sampleBytes_ = 0;
+    sampleStartUs_ = now;
+  }
+  window_ = std::min(options_.maxWindow,
+                     std::max(options_.minWindow, static_cast<uint64_t>(
+                                                      bytesPerSecond_ * options_.leadMs / 1000)));
+
+  // Ranges read past are done with; a chunk outside the window is a seek,
+  // and the window starts over from it.
+  if (!ranges_.empty() && !covered(chunk)) {
+    ++stats_.restarts;
+    clear();
+  }
+  while (!ranges_.empty()) {
+    const Range& r = ranges_.front();
+    if (chunk.offset >= r.offset && chunk.offset + chunk.size <= r.offset + r.size) break;
+    budget_->release(r.size);
+    hinted_ -= r.size;
+    ranges_.pop_front();
+  }
+
+  size_t i = 0;
+  while (i < count && covered(upcoming[i])) ++i;
+  while (i < count && hinted_ < window_) {
+    // Chunks close together in the file, either way, make one range.
+    uint64_t lo = upcoming[i].offset;
+    uint64_t hi = lo + upcoming[i].size;
+    for (++i; i < count; ++i) {
+      const ChunkEntry& c = upcoming[i];
+      uint64_t end = c.offset + c.size;
+      uint64_t gap = c.offset >= hi ? c.offset - hi : (end <= lo ? lo - end : 0);
+      if (gap > options_.maxGap || std::max(hi, end) - std::min(lo, c.offset) > options_.maxRead)
+        break;
+      lo = std::min(lo, c.offset);
+      hi = std::max(hi, end);
+    }
+    Range range;
+    range.offset = lo;
+    range.size = hi - lo;
+    if (!budget_->acquire(range.size)) {
+      ++stats_.denied;
+      break;
+    }
+    hint(range);
+  }
+}
+
+void ReadAhead::hint(const Range& range) {
+  // The backend may get to it after the file was closed; its own
+  // descriptor keeps the hint on this file.
+  int fd = ::dup(fd_);
+  if (fd < 0) {
+    budget_->release(range.size);
+    return;
+  }
+  ranges_.push_back(range);
+  hinted_ += range.size;
+  ++stats_.hints;
+  stats_.hintedBytes += range.size;
+  io_->call(
+      [fd, range]() -> int64_t {
+        int rc = posix_fadvise(fd, static_cast<off_t>(range.offset),
+                               static_cast<off_t>(range.size), POSIX_FADV_WILLNEED);
+        ::close(fd);
+        return -rc;
+      },
+      nullptr, nullptr);
+}
+
+void ReadAhead::fetch(const ChunkEntry& chunk, std::function<void()> done) {
+  ++stats_.fetches;
+  stats_.fetchedBytes += chunk.size;
+  int fd = fd_ >= 0 ? ::dup(fd_) : -1;
+  auto self = self_;
+  if (fd < 0) {
+    // Read on the loop after all.
+    loop_->post([self, done] {
+      if (*self) done();
+    });
+    return;
+  }
+  auto buffer = std::make_shared<AlignedBuffer>(chunk.size);
+  io_->read(fd, buffer->data(), chunk.size, chunk.offset, loop_,
+            [self, fd, buffer, done](int64_t result) {
+              ::close(fd);
+              if (*self) done();
+            });
+}
+
+}  // namespace nvr
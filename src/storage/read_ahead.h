@@ -0,0 +1,146 @@
+// Read-ahead for replay: the chunks a replay reads next are asked of the
+// disk before it gets to them, so that its own reads come from the page
+// cache.
+//
+// Each replay reads its camera's chunks in order, but the replays of many
+// cameras interleave on the disk, and in a group shared by several cameras
+// (recording_store.h) one camera's chunks lie between the others'. Left to
+// itself the kernel reads ahead by file position, which fetches the other
+// cameras' chunks, so segment files are marked POSIX_FADV_RANDOM and a
+// ReadAhead per replay names the ranges instead: POSIX_FADV_WILLNEED on the
+// store's IoBackend, the loop never waiting for it. Chunks close together
+// are hinted as one range of up to maxRead, so the disk sees large reads.
+//
+// The window adapts to the replay: it covers leadMs of what the replay has
+// been reading, between minWindow and maxWindow, so a keyframe walk at 32x
+// reads further ahead than 1x, and a seek starts it over. What was hinted
+// and not yet read counts against a ReadAheadBudget shared by every replay
+// on the node; past it hints stop until reads catch up.
+//
+// fetch() reads a chunk that missed the page cache through the backend,
+// for a reader that would otherwise wait for the disk on the loop
+// (CameraReader::setNoWait()). Loop-thread only; the budget is
+// thread-safe.
+
+#ifndef NVR_STORAGE_READ_AHEAD_H
+#define NVR_STORAGE_READ_AHEAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+
+#include "base/event_loop.h"
+#include "storage/io_backend.h"
+#include "storage/segment_index.h"
+
+namespace nvr {
+
+struct ReadAheadOptions {
+  uint64_t maxBytes = 256 << 20;   // hinted and not yet read, per node
+  uint64_t minWindow = 256 << 10;  // per replay
+  uint64_t maxWindow = 8 << 20;
+  int leadMs = 2000;               // of the replay's reading, ahead
+  uint64_t maxRead = 2 << 20;      // one hint
+  uint64_t maxGap = 64 << 10;      // of other chunks, inside one hint
+};
+
+// Bytes hinted and not yet read, or being read ahead, across the node.
+class ReadAheadBudget {
+ public:
+  explicit ReadAheadBudget(uint64_t maxBytes) : maxBytes_(maxBytes) {}
+
+  ReadAheadBudget(const ReadAheadBudget&) = delete;
+  ReadAheadBudget& operator=(const ReadAheadBudget&) = delete;
+
+  // False, and nothing taken, past maxBytes.
+  bool acquire(uint64_t bytes);
+  // Taken even past maxBytes, for a read that goes ahead regardless.
+  void charge(uint64_t bytes);
+  bool exhausted() const { return used() >= maxBytes_; }
+  void release(uint64_t bytes) { used_.fetch_sub(bytes, std::memory_order_relaxed); }
+
+  uint64_t maxBytes() const { return maxBytes_; }
+  uint64_t used() const { return used_.load(std::memory_order_relaxed); }
+  uint64_t peak() const { return peak_.load(std::memory_order_relaxed); }
+  // Hints turned down.
+  uint64_t denied() const { return denied_.load(std::memory_order_relaxed); }
+
+ private:
+  void notePeak(uint64_t used);
+
+  const uint64_t maxBytes_;
+  std::atomic<uint64_t> used_{0};
+  std::atomic<uint64_t> peak_{0};
+  std::atomic<uint64_t> denied_{0};
+};
+
+class ReadAhead {
+ public:
+  struct Stats {
+    uint64_t hints = 0;
+    uint64_t hintedBytes = 0;
+    uint64_t denied = 0;    // hints held back by the budget
+    uint64_t restarts = 0;  // reads outside the window: a seek
+    uint64_t fetches = 0;
+    uint64_t fetchedBytes = 0;
+  };
+
+  // io and budget must outlive the read-ahead.
+  ReadAhead(EventLoop* loop, IoBackend* io, ReadAheadBudget* budget,
+            const ReadAheadOptions& options);
+  // Fetches in flight complete into nothing.
+  ~ReadAhead();
+
+  ReadAhead(const ReadAhead&) = delete;
+  ReadAhead& operator=(const ReadAhead&) = delete;
+
+  // A segment file was opened: what was hinted in the last one is
+  // released, and the kernel's own read-ahead is turned off for fd.
+  void open(int fd);
+  // The replay reads chunk now; upcoming are the chunks it reads after it,
+  // in order (backward for a backward walk). Hints what the window lacks.
+  void advance(const ChunkEntry& chunk, const ChunkEntry* upcoming, size_t count);
+  // Reads chunk of the open file through the backend, then calls done from
+  // the loop; it is in the page cache then. Not called if the read-ahead is
+  // gone by then.
+  void fetch(const ChunkEntry& chunk, std::function<void()> done);
+
+  uint64_t windowBytes() const { return window_; }
+  uint64_t hintedBytes() const { return hinted_; }
+  const Stats& stats() const { return stats_; }
+
+ private:
+  struct Range {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+  };
+
+  bool covered(const ChunkEntry& chunk) const;
+  void hint(const Range& range);
+  void clear();
+
+  EventLoop* loop_;
+  IoBackend* io_;
+  ReadAheadBudget* budget_;
+  ReadAheadOptions options_;
+  // Completions check it: null once the read-ahead is gone.
+  std::shared_ptr<ReadAhead*> self_;
+
+  int fd_ = -1;
+  std::deque<Range> ranges_;  // hinted, in the order they will be read
+  uint64_t hinted_ = 0;       // their bytes, held in the budget
+  uint64_t window_ = 0;
+  // The replay's reading rate, sampled about once a second.
+  uint64_t sampleBytes_ = 0;
+  int64_t sampleStartUs_ = 0;
+  double bytesPerSecond_ = 0;
+  Stats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_READ_AHEAD_H
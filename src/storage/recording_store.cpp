@@ -0,0 +1,110 @@
+#include "storage/recording_store.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "base/log.h"
+#include "storage/file_util.h"
+#include "storage/segment_index.h"
+#include "storage/segment_reader.h"
+
+namespace nvr {
+
+const char* recordingLayoutName(RecordingLayout layout) {
+  return layout == RecordingLayout::PerCamera ? "per-camera" : "striped";
+}
+
+bool parseRecordingLayout(const std::string& name, RecordingLayout* layout) {
+  if (name == "striped") {
+    *layout = RecordingLayout::Striped;
+  } else if (name == "per-camera") {
+    *layout = RecordingLayout::PerCamera;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+RecordingStore::RecordingStore(const SegmentWriterOptions& defaults, const IoBackendOptions& io)
+    : defaults_(defaults), ioOptions_(io) {}
+
+RecordingStore::~RecordingStore() { stop(); }
+
+int RecordingStore::start() {
+  int rc = makeDirectories(defaults_.dir);
+  if (rc < 0) {
+    NVR_ERROR("recording: cannot create %s: %s", defaults_.dir.c_str(), strerror(-rc));
+    return rc;
+  }
+  rc = recover();
+  if (rc < 0) return rc;
+  io_ = createIoBackend(ioOptions_);
+  if (!io_) {
+    NVR_ERROR("recording: io_uring is not supported by this kernel");
+    return -ENOSYS;
+  }
+  rc = io_->start();
+  if (rc < 0 && ioOptions_.kind == IoBackendKind::Auto && strcmp(io_->name(), "uring") == 0) {
+    NVR_WARN("recording: io_uring unavailable, using the thread pool");
+    IoBackendOptions fallback = ioOptions_;
+    fallback.kind = IoBackendKind::Threads;
+    io_ = createIoBackend(fallback);
+    rc = io_->start();
+  }
+  if (rc < 0) {
+    io_.reset();
+    return rc;
+  }
+  NVR_INFO("recording: %s I/O backend", io_->name());
+  return 0;
+}
+
+void RecordingStore::stop() {
+  if (io_) io_->stop();
+}
+
+int RecordingStore::recover() {
+  std::vector<std::string> groups;
+  int rc = listDirectory(defaults_.dir, &groups);
+  if (rc < 0) return rc;
+  int recovered = 0;
+  for (const auto& group : groups) {
+    std::string groupDir = joinPath(defaults_.dir, group);
+    std::vector<std::string> names;
+    if (listDirectory(groupDir, &names) < 0) continue;
+    for (const auto& name : names) {
+      uint64_t id;
+      if (!parseSegmentFileName(name, &id)) continue;
+      std::string path = joinPath(groupDir, name);
+      SegmentScan scan;
+      rc = recoverSegment(path, &scan);
+      if (rc < 0) {
+        NVR_WARN("recording: cannot recover %s: %s", path.c_str(), strerror(-rc));
+      } else if (rc > 0) {
+        ++recovered;
+        NVR_INFO("recording: recovered %s: %u blocks, %llu records, %llu bytes", path.c_str(),
+                 scan.blocks, static_cast<unsigned long long>(scan.records),
+                 static_cast<unsigned long long>(scan.dataEnd));
+      }
+      if (rc < 0) continue;
+      SegmentIndex index;
+      if (rc == 0 && index.open(segmentIndexPath(path)) == 0 && index.sealed()) continue;
+      index.close();
+      int indexRc = rebuildSegmentIndex(path);
+      if (indexRc < 0)
+        NVR_WARN("recording: cannot index %s: %s", path.c_str(), strerror(-indexRc));
+    }
+  }
+  if (recovered > 0) NVR_INFO("recording: recovered %d unsealed segment(s)", recovered);
+  return 0;
+}
+
+std::unique_ptr<SegmentWriter> RecordingStore::createWriter(EventLoop* loop,
+                                                            const std::string& group) {
+  SegmentWriterOptions options = defaults_;
+  options.group = group;
+  options.indexWritten = [this] { bumpGeneration(); };
+  return std::unique_ptr<SegmentWriter>(new SegmentWriter(loop, io_.get(), options));
+}
+
+}  // namespace nvr
@@ -0,0 +1,84 @@
+// Recording store: the directory tree of recording groups and the I/O
+// backend their writers share.
+//
+//   <dir>/<group>/<segment id>.seg
+//   <dir>/<group>/<segment id>.idx   keyframe index
+//
+// start() seals every segment left unsealed by a crash, and rebuilds its
+// keyframe index, before any writer opens, so readers and new writers only
+// ever see sealed history.
+//
+// The store's generation moves every time one of its index files is
+// replaced, so that an ArchiveIndex over it knows when to load again: by
+// its own writers, and through bumpGeneration() by whatever else changes
+// the tree (the RetentionEngine).
+
+#ifndef NVR_STORAGE_RECORDING_STORE_H
+#define NVR_STORAGE_RECORDING_STORE_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "storage/io_backend.h"
+#include "storage/segment_writer.h"
+
+namespace nvr {
+
+// How a node spreads its cameras over recording groups.
+enum class RecordingLayout {
+  // One group per event loop: the loop's cameras are interleaved into
+  // shared blocks (stripes), so the disk sees a few sequential writers
+  // however many cameras there are. Replay reads a camera's blocks through
+  // the segment index's chunk directory.
+  Striped,
+  // One group per camera: every camera has its own segment files, so each
+  // adds a write position of its own and flushes partial blocks.
+  PerCamera,
+};
+
+const char* recordingLayoutName(RecordingLayout layout);
+bool parseRecordingLayout(const std::string& name, RecordingLayout* layout);
+
+class RecordingStore {
+ public:
+  // defaults.dir is the store root; defaults.group is ignored.
+  explicit RecordingStore(const SegmentWriterOptions& defaults,
+                          const IoBackendOptions& io = IoBackendOptions());
+  ~RecordingStore();
+
+  RecordingStore(const RecordingStore&) = delete;
+  RecordingStore& operator=(const RecordingStore&) = delete;
+
+  // Creates the root, recovers unsealed segments and starts the I/O
+  // backend; with IoBackendKind::Auto, falls back to the thread pool if
+  // io_uring cannot start. Returns 0 or -errno.
+  int start();
+  // Call after every writer has been closed.
+  void stop();
+
+  const std::string& dir() const { return defaults_.dir; }
+  // Null until started.
+  IoBackend* io() { return io_.get(); }
+  // Any thread.
+  uint64_t generation() const { return generation_.load(std::memory_order_acquire); }
+  // After a segment or index was written, replaced or removed. Any thread.
+  void bumpGeneration() { generation_.fetch_add(1, std::memory_order_release); }
+
+  // The writer still has to be open()ed on loop's thread.
+  std::unique_ptr<SegmentWriter> createWriter(EventLoop* loop, const std::string& group);
+
+ private:
+  int recover();
+
+  SegmentWriterOptions defaults_;
+  IoBackendOptions ioOptions_;
+  std::unique_ptr<IoBackend> io_;
+  std::atomic<uint64_t> generation_{0};
+};
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_RECORDING_STORE_H
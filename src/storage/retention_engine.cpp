@@ -0,0 +1,683 @@
+#include "storage/retention_engine.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+
+#include "base/clock.h"
+#include "base/log.h"
+#include "storage/crc32c.h"
+#include "storage/file_util.h"
+#include "storage/segment_reader.h"
+
+namespace nvr {
+
+namespace {
+
+constexpr int kYieldMs = 10;
+constexpr char kTmpSuffix[] = ".tmp";
+
+// linux/ioprio.h.
+constexpr int kIoprioWhoProcess = 1;
+constexpr int kIoprioClassIdle = 3;
+constexpr int kIoprioClassShift = 13;
+
+int64_t readFull(int fd, void* buf, size_t size, uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pread(fd, static_cast<char*>(buf) + done, size - done,
+                      static_cast<off_t>(offset + done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -errno;
+    if (n == 0) break;
+    done += static_cast<size_t>(n);
+  }
+  return static_cast<int64_t>(done);
+}
+
+int writeFull(int fd, const void* buf, size_t size, uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pwrite(fd, static_cast<const char*>(buf) + done, size - done,
+                       static_cast<off_t>(offset + done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -errno;
+    done += static_cast<size_t>(n);
+  }
+  return 0;
+}
+
+int readFile(const std::string& path, std::string* out) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -errno;
+  struct stat st;
+  int rc = fstat(fd, &st) < 0 ? -errno : 0;
+  if (rc == 0) {
+    out->resize(static_cast<size_t>(st.st_size));
+    int64_t n = readFull(fd, &(*out)[0], out->size(), 0);
+    if (n < 0) rc = static_cast<int>(n);
+    else if (static_cast<size_t>(n) != out->size()) rc = -EIO;
+  }
+  ::close(fd);
+  return rc;
+}
+
+// Disk space of a file, preallocation included.
+uint64_t diskBytes(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) return 0;
+  return static_cast<uint64_t>(st.st_blocks) * 512;
+}
+
+// The source is opened buffered for readSegmentHeader() and then read with
+// O_DIRECT where the filesystem allows it.
+void setDirect(int fd) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT); }
+
+int createDirect(const std::string& path) {
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  int fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+  if (fd < 0 && errno == EINVAL) fd = ::open(path.c_str(), flags, 0644);
+  return fd < 0 ? -errno : fd;
+}
+
+// Whatever a buffered fallback left in the page cache is not kept.
+void closeUncached(int fd) {
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  ::close(fd);
+}
+
+bool endsWith(const std::string& s, const char* suffix) {
+  size_t n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+void removeSegment(const std::string& path) {
+  unlink(segmentIndexPath(path).c_str());
+  unlink(path.c_str());
+}
+
+}  // namespace
+
+bool parseRetentionAge(const std::string& text, int64_t* us) {
+  if (text == "0" || text == "forever") {
+    *us = 0;
+    return true;
+  }
+  char* end = nullptr;
+  long long value = strtoll(text.c_str(), &end, 10);
+  if (end == text.c_str() || value < 0 || end + 1 != text.c_str() + text.size()) return false;
+  int64_t unit;
+  switch (*end) {
+    case 's': unit = 1; break;
+    case 'm': unit = 60; break;
+    case 'h': unit = 3600; break;
+    case 'd': unit = 86400; break;
+    default: return false;
+  }
+  *us = value * unit * 1000000;
+  return true;
+}
+
+bool parseRetentionPolicy(const std::string& spec, RetentionPolicy* policy) {
+  RetentionPolicy out = *policy;
+  size_t start = 0;
+  while (start <= spec.size()) {
+    size_t comma = spec.find(',', start);
+    if (comma == std::string::npos) comma = spec.size();
+    std::string item = spec.substr(start, comma - start);
+    start = comma + 1;
+    size_t eq = item.find('=');
+    if (eq == std::string::npos) return false;
+    std::string key = item.substr(0, eq);
+    int64_t* field = key == "keep"        ? &out.keepUs
+                     : key == "events"    ? &out.keepEventsUs
+                     : key == "keyframes" ? &out.keyframesOnlyAfterUs
+                                          : nullptr;
+    if (field == nullptr || !parseRetentionAge(item.substr(eq + 1), field)) return false;
+  }
+  *policy = out;
+  return true;
+}
+
+RetentionEngine::RetentionEngine(const RetentionOptions& options) : options_(options) {
+  options_.ioSize = alignUp(std::max<size_t>(options_.ioSize, kBlockAlign));
+  options_.blockSize = alignUp(std::max<size_t>(options_.blockSize, kBlockAlign));
+}
+
+RetentionEngine::~RetentionEngine() { stop(); }
+
+int RetentionEngine::start() {
+  if (thread_.joinable()) return -EALREADY;
+  stopping_ = false;
+  thread_ = std::thread([this] { run(); });
+  return 0;
+}
+
+void RetentionEngine::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  if (thread_.joinable()) thread_.join();
+}
+
+bool RetentionEngine::stopping() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stopping_;
+}
+
+void RetentionEngine::changed() {
+  if (options_.changed) options_.changed();
+}
+
+bool RetentionEngine::sleepMs(int64_t ms) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return !wake_.wait_for(lock, std::chrono::milliseconds(ms), [this] { return stopping_; });
+}
+
+RetentionEngine::Stats RetentionEngine::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+const RetentionPolicy& RetentionEngine::policy(const std::string& cameraId) const {
+  auto it = options_.cameras.find(cameraId);
+  return it == options_.cameras.end() ? options_.defaults : it->second;
+}
+
+void RetentionEngine::run() {
+  // Only schedulers with I/O classes (BFQ, CFQ) honor it; elsewhere the
+  // byte rate and the foreground check still apply.
+  if (options_.idlePriority &&
+      syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, kIoprioClassIdle << kIoprioClassShift) < 0)
+    NVR_DEBUG("retention: cannot set idle I/O priority: %s", strerror(errno));
+  do {
+    int rc = pass();
+    if (rc < 0) NVR_WARN("retention: cannot list %s: %s", options_.dir.c_str(), strerror(-rc));
+  } while (sleepMs(options_.intervalMs));
+}
+
+int RetentionEngine::pass() {
+  int64_t startUs = monotonicUs();
+  nowUs_ = wallClockUs();
+  std::vector<std::string> groups;
+  int rc = listDirectory(options_.dir, &groups);
+  if (rc < 0) return rc;
+  std::vector<Segment> segments;
+  auto listTier = [this, &segments](const std::string& root, const std::string& group,
+                                    bool cold) {
+    std::string groupDir = joinPath(root, group);
+    std::vector<std::string> names;
+    if (listDirectory(groupDir, &names) < 0) return;
+    size_t first = segments.size();
+    for (const auto& name : names) {
+      uint64_t id;
+      if (endsWith(name, ".seg.tmp")) {
+        // A rewrite or move that did not finish; the segment it was made
+        // from is still in place.
+        if (unlink(joinPath(groupDir, name).c_str()) == 0) count([](Stats* s) { ++s->recovered; });
+        continue;
+      }
+      if (!parseSegmentFileName(name, &id)) continue;
+      Segment segment;
+      segment.group = group;
+      segment.id = id;
+      segment.path = joinPath(groupDir, name);
+      segment.cold = cold;
+      segments.push_back(segment);
+    }
+    std::sort(segments.begin() + first, segments.end(),
+              [](const Segment& a, const Segment& b) { return a.id < b.id; });
+    if (!cold && segments.size() > first) segments.back().newest = true;
+  };
+  for (const auto& group : groups) listTier(options_.dir, group, false);
+  if (!options_.coldDir.empty()) {
+    std::vector<std::string> coldGroups;
+    listDirectory(options_.coldDir, &coldGroups);
+    for (const auto& group : coldGroups) listTier(options_.coldDir, group, true);
+  }
+  recoverGroups(&segments);
+
+  for (const Segment& segment : segments) {
+    if (stopping()) break;
+    rc = processSegment(segment);
+    if (rc < 0 && rc != -ECANCELED) {
+      count([](Stats* s) { ++s->errors; });
+      NVR_WARN("retention: %s: %s", segment.path.c_str(), strerror(-rc));
+    }
+  }
+  int64_t busyMs = (monotonicUs() - startUs) / 1000;
+  count([busyMs](Stats* s) {
+    ++s->passes;
+    s->busyMs += static_cast<uint64_t>(busyMs);
+  });
+  return 0;
+}
+
+void RetentionEngine::recoverGroups(std::vector<Segment>* segments) {
+  if (options_.coldDir.empty()) return;
+  // A segment in both tiers was being moved: the cold copy is complete
+  // once its index is there.
+  std::map<std::pair<std::string, uint64_t>, size_t> hot;
+  for (size_t i = 0; i < segments->size(); ++i)
+    if (!(*segments)[i].cold) hot[{(*segments)[i].group, (*segments)[i].id}] = i;
+  std::set<size_t> drop;
+  for (size_t i = 0; i < segments->size(); ++i) {
+    const Segment& segment = (*segments)[i];
+    if (!segment.cold) continue;
+    auto it = hot.find({segment.group, segment.id});
+    if (it == hot.end()) continue;
+    if (access(segmentIndexPath(segment.path).c_str(), F_OK) == 0) {
+      removeSegment((*segments)[it->second].path);
+      drop.insert(it->second);
+    } else {
+      removeSegment(segment.path);
+      drop.insert(i);
+    }
+    count([](Stats* s) { ++s->recovered; });
+  }
+  if (!drop.empty()) changed();
+  std::vector<Segment> kept;
+  for (size_t i = 0; i < segments->size(); ++i)
+    if (!drop.count(i)) kept.push_back((*segments)[i]);
+  segments->swap(kept);
+}
+
+int RetentionEngine::processSegment(const Segment& segment) {
+  int fd = ::open(segment.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return errno == ENOENT ? 0 : -errno;
+  SegmentHeader header;
+  int rc = readSegmentHeader(fd, &header);
+  ::close(fd);
+  // Open (or crashed, left to recovery) segments are not the engine's.
+  if (rc == -EBADMSG || (rc == 0 && !header.sealed)) return 0;
+  if (rc < 0) return rc;
+  count([](Stats* s) { ++s->scanned; });
+
+  std::string indexPath = segmentIndexPath(segment.path);
+  SegmentIndex index;
+  rc = index.open(indexPath);
+  if (rc == -ENOENT) {
+    // Rewritten, and the new index not written yet.
+    rc = rebuildSegmentIndex(segment.path);
+    if (rc == 0) {
+      count([](Stats* s) { ++s->recovered; });
+      changed();
+      rc = index.open(indexPath);
+    }
+  }
+  if (rc < 0) return rc;
+  if (index.segmentId() != header.segmentId) return -EBADMSG;
+
+  int64_t age = nowUs_ - header.lastTimestampUs;
+  auto expired = [age](int64_t keepUs) { return keepUs > 0 && age >= keepUs; };
+  std::vector<StreamPlan> plans;
+  bool filter = false;
+  for (size_t i = 0; i < index.streamCount(); ++i) {
+    const IndexStream& stream = index.stream(i);
+    StreamPlan plan;
+    plan.streamId = stream.streamId;
+    plan.cameraId.assign(stream.cameraId, strnlen(stream.cameraId, sizeof(stream.cameraId)));
+    const RetentionPolicy& p = policy(plan.cameraId);
+    uint32_t flags = stream.flags ? stream.flags : kIndexStreamContinuous;
+    bool continuous = (flags & kIndexStreamContinuous) != 0;
+    bool events = (flags & kIndexStreamEvents) != 0;
+    plan.reduced = (flags & kIndexStreamReduced) != 0;
+    plan.keepContinuous = !expired(p.keepUs);
+    plan.keyframesOnly = plan.keepContinuous && expired(p.keyframesOnlyAfterUs);
+    plan.keepEvents = p.keepUs == 0 || p.keepEventsUs == 0 ||
+                      !expired(std::max(p.keepUs, p.keepEventsUs));
+    if ((continuous && (!plan.keepContinuous || (plan.keyframesOnly && !plan.reduced))) ||
+        (events && !plan.keepEvents))
+      filter = true;
+    if ((continuous && plan.keepContinuous) || (events && plan.keepEvents))
+      plans.push_back(plan);
+  }
+  index.close();
+
+  if (plans.empty()) {
+    if (segment.newest) return 0;
+    uint64_t bytes = diskBytes(segment.path);
+    removeSegment(segment.path);
+    changed();
+    NVR_DEBUG("retention: deleted %s", segment.path.c_str());
+    count([bytes](Stats* s) {
+      ++s->deleted;
+      s->deletedBytes += bytes;
+    });
+    return 0;
+  }
+  bool migrate = !segment.cold && !segment.newest && !options_.coldDir.empty() &&
+                 options_.coldAfterUs > 0 && age >= options_.coldAfterUs;
+  if (!filter && !migrate) return 0;
+  std::string target = segment.path;
+  if (migrate) {
+    std::string coldGroup = joinPath(options_.coldDir, segment.group);
+    rc = makeDirectories(coldGroup);
+    if (rc < 0) return rc;
+    target = joinPath(coldGroup, segmentFileName(segment.id));
+  }
+  return filter ? rewrite(segment, header, plans, target) : copy(segment, header, target);
+}
+
+int RetentionEngine::readAt(int fd, uint64_t offset, uint64_t minSize, uint64_t end) {
+  if (offset >= inOffset_ && offset + minSize <= inOffset_ + in_.size()) return 0;
+  // Block offsets and the data end are aligned, so every read is.
+  uint64_t size = std::min<uint64_t>(std::max<uint64_t>(options_.ioSize, alignUp(minSize)),
+                                     end - offset);
+  if (size < minSize) return -EBADMSG;
+  if (!in_.reserve(size)) return -ENOMEM;
+  in_.clear();
+  if (!throttle(size)) return -ECANCELED;
+  int64_t n = readFull(fd, in_.data(), size, offset);
+  if (n < 0) return static_cast<int>(n);
+  if (static_cast<uint64_t>(n) < size) return -EBADMSG;
+  in_.resize(size);
+  inOffset_ = offset;
+  count([size](Stats* s) { s->bytesRead += size; });
+  return 0;
+}
+
+int RetentionEngine::rewrite(const Segment& segment, const SegmentHeader& header,
+                             const std::vector<StreamPlan>& plans, const std::string& target) {
+  int in = ::open(segment.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) return -errno;
+  setDirect(in);
+  std::string tmp = target + kTmpSuffix;
+  int fd = createDirect(tmp);
+  if (fd < 0) {
+    ::close(in);
+    return fd;
+  }
+
+  Output out;
+  out.fd = fd;
+  out.segmentId = header.segmentId;
+  out.index.reset(header.segmentId);
+  std::map<uint32_t, const StreamPlan*> byStream;
+  for (const StreamPlan& plan : plans) {
+    byStream[plan.streamId] = &plan;
+    out.index.addStream(plan.streamId, plan.cameraId);
+  }
+  int rc = out_.reserve(options_.ioSize + options_.blockSize) ? 0 : -ENOMEM;
+  // The header goes in last, over this placeholder.
+  out_.clear();
+  if (rc == 0) {
+    memset(out_.data(), 0, kBlockAlign);
+    out_.resize(kBlockAlign);
+  }
+  in_.clear();
+  inOffset_ = 0;
+
+  uint64_t offset = kBlockAlign;
+  while (rc == 0 && offset < header.dataEnd) {
+    rc = readAt(in, offset, sizeof(BlockHeader), header.dataEnd);
+    if (rc < 0) break;
+    BlockHeader block;
+    memcpy(&block, in_.data() + (offset - inOffset_), sizeof(block));
+    if (block.magic != kBlockMagic || block.segmentId != header.segmentId) {
+      rc = -EBADMSG;
+      break;
+    }
+    uint64_t size = alignUp(sizeof(BlockHeader) + block.payloadSize);
+    rc = readAt(in, offset, size, header.dataEnd);
+    if (rc < 0) break;
+    const uint8_t* data = in_.data() + (offset - inOffset_);
+    if (checkBlock(header.segmentId, data, size) != size) {
+      rc = -EBADMSG;
+      break;
+    }
+    size_t pos = sizeof(BlockHeader);
+    size_t payloadEnd = sizeof(BlockHeader) + block.payloadSize;
+    for (uint32_t i = 0; rc == 0 && i < block.records; ++i) {
+      RecordHeader record;
+      if (pos + sizeof(record) > payloadEnd) break;
+      memcpy(&record, data + pos, sizeof(record));
+      pos += sizeof(record);
+      if (pos + record.size > payloadEnd) {
+        rc = -EBADMSG;
+        break;
+      }
+      auto plan = byStream.find(record.streamId);
+      if (plan != byStream.end()) rc = addRecord(&out, *plan->second, record, data + pos);
+      pos += record.size;
+    }
+    offset += size;
+  }
+  for (auto& kv : out.pending)
+    if (rc == 0) rc = emitBlock(&out, kv.first);
+  if (rc == 0) rc = flushOutput(&out);
+
+  uint64_t dataEnd = out.offset;
+  if (rc == 0) {
+    SegmentHeader sealed = header;
+    sealed.segmentSize = dataEnd;
+    sealed.dataEnd = dataEnd;
+    sealed.firstTimestampUs = out.firstUs;
+    sealed.lastTimestampUs = out.lastUs;
+    sealed.blocks = out.blocks;
+    sealed.sealed = 1;
+    sealed.crc = segmentHeaderCrc(sealed);
+    memset(out_.data(), 0, kBlockAlign);
+    memcpy(out_.data(), &sealed, sizeof(sealed));
+    if (!throttle(kBlockAlign)) rc = -ECANCELED;
+    if (rc == 0) rc = writeFull(fd, out_.data(), kBlockAlign, 0);
+    if (rc == 0 && fdatasync(fd) < 0) rc = -errno;
+    if (rc == 0) count([](Stats* s) { s->bytesWritten += kBlockAlign; });
+  }
+  closeUncached(in);
+  closeUncached(fd);
+  if (rc < 0) {
+    unlink(tmp.c_str());
+    return rc;
+  }
+
+  for (const StreamPlan& plan : plans) {
+    // A stream left with no media is marked too: 0 would read as continuous.
+    uint32_t flags = out.flags[plan.streamId];
+    if (flags == 0 || ((flags & kIndexStreamContinuous) && (plan.keyframesOnly || plan.reduced)))
+      flags |= kIndexStreamReduced;
+    out.index.setFlags(plan.streamId, flags);
+  }
+  uint64_t before = diskBytes(segment.path);
+  rc = finish(segment, tmp, target, out.index.build(true));
+  if (rc < 0) return rc;
+  uint64_t after = diskBytes(target);
+  bool moved = target != segment.path;
+  NVR_DEBUG("retention: rewrote %s%s%s, %llu -> %llu bytes", segment.path.c_str(),
+            moved ? " to " : "", moved ? target.c_str() : "",
+            static_cast<unsigned long long>(before), static_cast<unsigned long long>(after));
+  count([before, after, moved](Stats* s) {
+    ++s->rewritten;
+    s->bytesBefore += before;
+    s->bytesAfter += after;
+    if (moved) {
+      ++s->migrated;
+      s->migratedBytes += after;
+    }
+  });
+  return 0;
+}
+
+int RetentionEngine::addRecord(Output* out, const StreamPlan& plan, const RecordHeader& record,
+                               const uint8_t* payload) {
+  // StreamInfo and ClockSync records stay with every stream kept, so its
+  // first block still opens with its announcement.
+  bool media = record.type == static_cast<uint8_t>(RecordType::Video) ||
+               record.type == static_cast<uint8_t>(RecordType::Audio);
+  bool keyframe = (record.flags & kRecordKeyframe) != 0;
+  if (media) {
+    bool event = (record.flags & kRecordEvent) != 0;
+    if (event ? !plan.keepEvents : !plan.keepContinuous) return 0;
+    if (!event && plan.keyframesOnly && !keyframe) return 0;
+    out->flags[plan.streamId] |= event ? kIndexStreamEvents : kIndexStreamContinuous;
+  } else if (record.type == static_cast<uint8_t>(RecordType::ClockSync)) {
+    StreamClock clock;
+    if (clock.parse(payload, record.size)) out->index.setClock(plan.streamId, clock);
+  }
+
+  size_t recordSize = sizeof(record) + record.size;
+  Pending& pending = out->pending[plan.streamId];
+  if (pending.count > 0 &&
+      sizeof(BlockHeader) + pending.records.size() + recordSize > options_.blockSize) {
+    int rc = emitBlock(out, plan.streamId);
+    if (rc < 0) return rc;
+  }
+  pending.records.append(reinterpret_cast<const char*>(&record), sizeof(record));
+  pending.records.append(reinterpret_cast<const char*>(payload), record.size);
+  ++pending.count;
+  if (media) {
+    if (pending.firstUs == 0) pending.firstUs = record.timestampUs;
+    pending.lastUs = record.timestampUs;
+    if (keyframe) pending.keyframes.push_back(record.timestampUs);
+  }
+  return 0;
+}
+
+int RetentionEngine::emitBlock(Output* out, uint32_t streamId) {
+  Pending& pending = out->pending[streamId];
+  if (pending.count == 0) return 0;
+  size_t size = alignUp(sizeof(BlockHeader) + pending.records.size());
+  if (out_.size() + size > out_.capacity()) {
+    int rc = flushOutput(out);
+    if (rc < 0) return rc;
+    if (!out_.reserve(size)) return -ENOMEM;
+  }
+
+  BlockHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kBlockMagic;
+  header.segmentId = out->segmentId;
+  header.sequence = out->blocks++;
+  header.records = pending.count;
+  header.payloadSize = static_cast<uint32_t>(pending.records.size());
+  header.payloadCrc = crc32c(pending.records.data(), header.payloadSize);
+  header.firstTimestampUs = pending.firstUs;
+  header.lastTimestampUs = pending.lastUs;
+  header.headerCrc = blockHeaderCrc(header);
+  uint64_t offset = out->offset + out_.size();
+  out_.append(&header, sizeof(header));
+  out_.append(pending.records.data(), pending.records.size());
+  out_.padToAlignment();
+
+  out->index.addChunk(streamId, offset, size);
+  for (int64_t ts : pending.keyframes) out->index.add(streamId, ts, offset);
+  if (pending.firstUs != 0) {
+    if (out->firstUs == 0 || pending.firstUs < out->firstUs) out->firstUs = pending.firstUs;
+    out->lastUs = std::max(out->lastUs, pending.lastUs);
+  }
+  pending = Pending();
+  return out_.size() >= options_.ioSize ? flushOutput(out) : 0;
+}
+
+int RetentionEngine::flushOutput(Output* out) {
+  size_t size = out_.size();
+  if (size == 0) return 0;
+  if (!throttle(size)) return -ECANCELED;
+  int rc = writeFull(out->fd, out_.data(), size, out->offset);
+  if (rc < 0) return rc;
+  out->offset += size;
+  out_.clear();
+  count([size](Stats* s) { s->bytesWritten += size; });
+  return 0;
+}
+
+int RetentionEngine::copy(const Segment& segment, const SegmentHeader& header,
+                          const std::string& target) {
+  std::string index;
+  int rc = readFile(segmentIndexPath(segment.path), &index);
+  if (rc < 0) return rc;
+  int in = ::open(segment.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) return -errno;
+  setDirect(in);
+  std::string tmp = target + kTmpSuffix;
+  int fd = createDirect(tmp);
+  if (fd < 0) {
+    ::close(in);
+    return fd;
+  }
+  in_.clear();
+  inOffset_ = 0;
+  // The preallocated space past the data stays behind.
+  for (uint64_t offset = 0; rc == 0 && offset < header.dataEnd; offset += options_.ioSize) {
+    uint64_t size = std::min<uint64_t>(options_.ioSize, header.dataEnd - offset);
+    rc = readAt(in, offset, size, header.dataEnd);
+    if (rc == 0 && !throttle(size)) rc = -ECANCELED;
+    if (rc == 0) rc = writeFull(fd, in_.data() + (offset - inOffset_), size, offset);
+    if (rc == 0) count([size](Stats* s) { s->bytesWritten += size; });
+  }
+  if (rc == 0 && fdatasync(fd) < 0) rc = -errno;
+  closeUncached(in);
+  closeUncached(fd);
+  if (rc < 0) {
+    unlink(tmp.c_str());
+    return rc;
+  }
+  rc = finish(segment, tmp, target, index);
+  if (rc < 0) return rc;
+  uint64_t bytes = diskBytes(target);
+  NVR_DEBUG("retention: moved %s to %s", segment.path.c_str(), target.c_str());
+  count([bytes](Stats* s) {
+    ++s->migrated;
+    s->migratedBytes += bytes;
+  });
+  return 0;
+}
+
+int RetentionEngine::finish(const Segment& segment, const std::string& tmp,
+                            const std::string& target, const std::string& index) {
+  bool moved = target != segment.path;
+  // In place, the old index goes first: a segment found without one has
+  // its index rebuilt from the new records.
+  if (!moved && unlink(segmentIndexPath(segment.path).c_str()) < 0 && errno != ENOENT) {
+    int rc = -errno;
+    unlink(tmp.c_str());
+    return rc;
+  }
+  if (rename(tmp.c_str(), target.c_str()) < 0) {
+    int rc = -errno;
+    unlink(tmp.c_str());
+    return rc;
+  }
+  // A moved segment counts as complete in the cold tier once its index is
+  // there; only then does the hot one go.
+  int rc = writeFileAtomic(segmentIndexPath(target), index);
+  if (rc == 0 && moved) removeSegment(segment.path);
+  changed();
+  return rc;
+}
+
+bool RetentionEngine::throttle(uint64_t bytes) {
+  if (options_.foreground) {
+    uint64_t waited = 0;
+    while (options_.foreground->pending() > options_.maxForegroundPending) {
+      if (!sleepMs(kYieldMs)) return false;
+      waited += kYieldMs;
+    }
+    if (waited) count([waited](Stats* s) { s->yieldedMs += waited; });
+  }
+  if (stopping()) return false;
+  if (options_.maxBytesPerSecond == 0) return true;
+  double rate = static_cast<double>(options_.maxBytesPerSecond);
+  int64_t now = monotonicUs();
+  double burst = static_cast<double>(std::max<uint64_t>(options_.ioSize, bytes));
+  tokens_ = std::min(burst, tokens_ + static_cast<double>(now - refilledUs_) * rate / 1e6);
+  refilledUs_ = now;
+  tokens_ -= static_cast<double>(bytes);
+  if (tokens_ >= 0) return true;
+  // In debt: wait until the rate has paid for these bytes.
+  int64_t ms = static_cast<int64_t>(-tokens_ * 1000 / rate) + 1;
+  count([ms](Stats* s) { s->throttledMs += static_cast<uint64_t>(ms); });
+  return sleepMs(ms);
+}
+
+}  // namespace nvr
@@ -0,0 +1,208 @@
+// Retention: a background engine that ages out recordings by whole
+// segments, and moves old ones to a slower local tier.
+//
+// Each camera has a RetentionPolicy: how long its continuous footage is
+// kept, how long its event clips are (records with kRecordEvent, pre-roll
+// included), and after how long continuous footage is reduced to its
+// keyframes. A pass decides every sealed segment's fate from its index
+// alone (the stream flags of segment_index.h) and acts on the whole file:
+//
+//   delete    every stream in it has aged out: the index, then the segment
+//   rewrite   some stream loses records: the kept ones are re-packed into
+//             a new segment file, written next to it and renamed over it
+//   migrate   older than coldAfterUs: the segment and its index move from
+//             dir/<group>/ to coldDir/<group>/, rewritten on the way if due
+//
+// Every step leaves a segment readable from one place or the other: the new
+// file is synced before it replaces the old one, and a moved segment is
+// removed from the hot tier only once it is complete in the cold one. A
+// pass first finishes what a crash interrupted (a segment in both tiers, a
+// rewritten one without its index, leftover temporary files). The newest
+// segment of each hot group is never deleted or moved, so a writer opening
+// the group again does not reuse an id.
+//
+// Readers are handed over through options.changed, called on the engine's
+// thread after every step that changes which files there are. Wired to
+// RecordingStore::bumpGeneration(), it makes an ArchiveIndex refreshed from
+// the store's generation load again. Until then its seeks may name a file
+// that is gone (replay goes on with the next segment) or was rewritten in
+// place (CameraReader and GopPrefetcher check that the index they read is
+// the file's own). A reader with a segment open keeps reading the file it
+// opened: deletes and renames leave an open descriptor, and the index it
+// maps, as they were.
+//
+// The engine runs on a thread of its own at the idle I/O priority and
+// reads and writes with O_DIRECT in ioSize pieces, so it neither fills the
+// page cache nor competes with recording for the disk: its bytes are
+// limited to maxBytesPerSecond, and it waits while the recording store's
+// IoBackend has more than maxForegroundPending operations queued.
+
+#ifndef NVR_STORAGE_RETENTION_ENGINE_H
+#define NVR_STORAGE_RETENTION_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "storage/aligned_buffer.h"
+#include "storage/io_backend.h"
+#include "storage/segment_format.h"
+#include "storage/segment_index.h"
+
+namespace nvr {
+
+// 0 for any age: forever, or never reduced.
+struct RetentionPolicy {
+  int64_t keepUs = 30ll * 86400 * 1000000;        // continuous footage
+  int64_t keepEventsUs = 90ll * 86400 * 1000000;  // event clips, at least keepUs
+  int64_t keyframesOnlyAfterUs = 0;               // continuous footage, reduced
+};
+
+// "keep=30d,events=90d,keyframes=7d"; ages in s, m, h or d. Keys left out
+// keep their value in policy.
+bool parseRetentionPolicy(const std::string& spec, RetentionPolicy* policy);
+// "30d", "12h", ... 0 for "0" or "forever". False if malformed.
+bool parseRetentionAge(const std::string& text, int64_t* us);
+
+struct RetentionOptions {
+  std::string dir;                              // the recording store
+  std::string coldDir;                          // empty: no cold tier
+  int64_t coldAfterUs = 7ll * 86400 * 1000000;   // 0: never
+  RetentionPolicy defaults;
+  std::map<std::string, RetentionPolicy> cameras;  // by camera id
+  uint64_t maxBytesPerSecond = 32 << 20;        // read plus written; 0 unlimited
+  size_t ioSize = 1 << 20;
+  size_t blockSize = 1 << 20;                   // target of a re-packed block
+  IoBackend* foreground = nullptr;              // recording's backend
+  size_t maxForegroundPending = 4;
+  int intervalMs = 60000;                       // between passes
+  bool idlePriority = true;                     // IOPRIO_CLASS_IDLE for the thread
+  std::function<void()> changed;                // a segment deleted, rewritten or moved
+};
+
+class RetentionEngine {
+ public:
+  struct Stats {
+    uint64_t passes = 0;
+    uint64_t scanned = 0;          // sealed segments looked at
+    uint64_t deleted = 0;
+    uint64_t deletedBytes = 0;     // disk space freed by deletes
+    uint64_t rewritten = 0;
+    uint64_t bytesBefore = 0;      // disk space of rewritten segments
+    uint64_t bytesAfter = 0;
+    uint64_t migrated = 0;
+    uint64_t migratedBytes = 0;
+    uint64_t recovered = 0;        // crash leftovers cleaned up
+    uint64_t bytesRead = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t throttledMs = 0;      // waiting for the byte rate
+    uint64_t yieldedMs = 0;        // waiting for the foreground
+    uint64_t busyMs = 0;           // in passes, waits included
+    uint64_t errors = 0;
+  };
+
+  explicit RetentionEngine(const RetentionOptions& options);
+  ~RetentionEngine();
+
+  RetentionEngine(const RetentionEngine&) = delete;
+  RetentionEngine& operator=(const RetentionEngine&) = delete;
+
+  // Runs a pass every intervalMs on the engine's thread, the first one now.
+  int start();
+  // Interrupts the pass in progress, leaving the segment at hand as it was.
+  void stop();
+  // One pass on the calling thread, when the engine is not started.
+  // 0, or -errno if dir cannot be listed.
+  int pass();
+
+  const RetentionPolicy& policy(const std::string& cameraId) const;
+  Stats stats() const;
+
+ private:
+  // What happens to one stream's records.
+  struct StreamPlan {
+    uint32_t streamId = 0;
+    std::string cameraId;
+    bool keepContinuous = true;
+    bool keyframesOnly = false;   // of the continuous footage
+    bool keepEvents = true;
+    bool reduced = false;         // already keyframes only
+  };
+  struct Segment {
+    std::string group;
+    uint64_t id = 0;
+    std::string path;
+    bool cold = false;
+    bool newest = false;          // in its hot group
+  };
+  // A stream's next block of the rewritten segment.
+  struct Pending {
+    std::string records;
+    uint32_t count = 0;
+    int64_t firstUs = 0;
+    int64_t lastUs = 0;
+    std::vector<int64_t> keyframes;
+  };
+  // The rewritten segment being assembled.
+  struct Output {
+    int fd = -1;
+    uint64_t segmentId = 0;
+    uint64_t offset = 0;          // of out_'s first byte in the file
+    uint32_t blocks = 0;
+    int64_t firstUs = 0;
+    int64_t lastUs = 0;
+    SegmentIndexBuilder index;
+    std::map<uint32_t, Pending> pending;
+    std::map<uint32_t, uint32_t> flags;  // kIndexStream* of the kept media
+  };
+
+  void run();
+  void recoverGroups(std::vector<Segment>* segments);
+  int processSegment(const Segment& segment);
+  int rewrite(const Segment& segment, const SegmentHeader& header,
+              const std::vector<StreamPlan>& plans, const std::string& target);
+  int copy(const Segment& segment, const SegmentHeader& header, const std::string& target);
+  int addRecord(Output* out, const StreamPlan& plan, const RecordHeader& record,
+                const uint8_t* payload);
+  int emitBlock(Output* out, uint32_t streamId);
+  int flushOutput(Output* out);
+  int finish(const Segment& segment, const std::string& tmp, const std::string& target,
+             const std::string& index);
+  int readAt(int fd, uint64_t offset, uint64_t minSize, uint64_t end);
+
+  // Waits until bytes may go to the disk. False once stopping.
+  bool throttle(uint64_t bytes);
+  bool sleepMs(int64_t ms);
+  bool stopping() const;
+  void changed();
+  template <typename F>
+  void count(F update) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    update(&stats_);
+  }
+
+  RetentionOptions options_;
+  std::thread thread_;
+  mutable std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+  Stats stats_;
+
+  double tokens_ = 0;
+  int64_t refilledUs_ = 0;
+  int64_t nowUs_ = 0;             // of the pass
+  AlignedBuffer in_;
+  uint64_t inOffset_ = 0;         // of in_'s first byte in the source
+  AlignedBuffer out_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_RETENTION_ENGINE_H
@@ -0,0 +1,115 @@
+#include "storage/segment_format.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "storage/crc32c.h"
+
+namespace nvr {
+
+namespace {
+
+void putU32(std::string* out, uint32_t v) { out->append(reinterpret_cast<const char*>(&v), 4); }
+
+void putU64(std::string* out, uint64_t v) { out->append(reinterpret_cast<const char*>(&v), 8); }
+
+void putString(std::string* out, const std::string& s) {
+  putU32(out, static_cast<uint32_t>(s.size()));
+  out->append(s);
+}
+
+bool getU32(const uint8_t** p, const uint8_t* end, uint32_t* v) {
+  if (end - *p < 4) return false;
+  memcpy(v, *p, 4);
+  *p += 4;
+  return true;
+}
+
+bool getU64(const uint8_t** p, const uint8_t* end, uint64_t* v) {
+  if (end - *p < 8) return false;
+  memcpy(v, *p, 8);
+  *p += 8;
+  return true;
+}
+
+bool getString(const uint8_t** p, const uint8_t* end, std::string* s) {
+  uint32_t len;
+  if (!getU32(p, end, &len) || static_cast<size_t>(end - *p) < len) return false;
+  s->assign(reinterpret_cast<const char*>(*p), len);
+  *p += len;
+  return true;
+}
+
+}  // namespace
+
+std::string StreamInfo::serialize() const {
+  std::string out;
+  putString(&out, cameraId);
+  putString(&out, codec);
+  putU32(&out, clockRate);
+  putString(&out, extradata);
+  return out;
+}
+
+bool StreamInfo::parse(const uint8_t* data, size_t size) {
+  const uint8_t* p = data;
+  const uint8_t* end = data + size;
+  return getString(&p, end, &cameraId) && getString(&p, end, &codec) &&
+         getU32(&p, end, &clockRate) && getString(&p, end, &extradata);
+}
+
+std::string StreamClock::serialize() const {
+  std::string out;
+  putU32(&out, rtpTimestamp);
+  putU32(&out, clockRate);
+  putU64(&out, static_cast<uint64_t>(senderUs));
+  putU64(&out, static_cast<uint64_t>(offsetUs));
+  putU32(&out, static_cast<uint32_t>(driftPpb));
+  putU32(&out, residualUs);
+  putU32(&out, reports);
+  return out;
+}
+
+bool StreamClock::parse(const uint8_t* data, size_t size) {
+  const uint8_t* p = data;
+  const uint8_t* end = data + size;
+  uint64_t sender, offset;
+  uint32_t drift;
+  if (!getU32(&p, end, &rtpTimestamp) || !getU32(&p, end, &clockRate) ||
+      !getU64(&p, end, &sender) || !getU64(&p, end, &offset) || !getU32(&p, end, &drift) ||
+      !getU32(&p, end, &residualUs) || !getU32(&p, end, &reports))
+    return false;
+  senderUs = static_cast<int64_t>(sender);
+  offsetUs = static_cast<int64_t>(offset);
+  driftPpb = static_cast<int32_t>(drift);
+  return true;
+}
+
+std::string segmentFileName(uint64_t segmentId) {
+  char name[32];
+  snprintf(name, sizeof(name), "%010llu.seg", static_cast<unsigned long long>(segmentId));
+  return name;
+}
+
+bool parseSegmentFileName(const std::string& name, uint64_t* segmentId) {
+  if (name.size() < 5 || name.compare(name.size() - 4, 4, ".seg") != 0) return false;
+  char* end = nullptr;
+  unsigned long long id = strtoull(name.c_str(), &end, 10);
+  if (end != name.c_str() + name.size() - 4 || end == name.c_str()) return false;
+  *segmentId = id;
+  return true;
+}
+
+uint32_t segmentHeaderCrc(const SegmentHeader& header) {
+  return crc32c(&header, offsetof(SegmentHeader, crc));
+}
+
+uint32_t blockHeaderCrc(const BlockHeader& header) {
+  BlockHeader copy = header;
+  copy.headerCrc = 0;
+  return crc32c(&copy, sizeof(copy));
+}
+
+}  // namespace nvr
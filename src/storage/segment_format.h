@@ -0,0 +1,134 @@
+// On-disk recording format.
+//
+// A recording group (one camera, or all cameras of an ingest shard) writes
+// a sequence of segment files, each preallocated to a fixed size:
+//
+//   [SegmentHeader, padded to kBlockAlign]
+//   [block][block]...[unused preallocated space]
+//
+// A block is a BlockHeader followed by packed records (RecordHeader +
+// payload), zero-padded to a multiple of kBlockAlign so it can be written
+// with O_DIRECT. The writer fills one block per stream (a chunk, tagged by
+// its records' stream id), and the chunks of every stream in the group
+// follow each other in the file, so the disk sees one sequential write
+// stream while a single camera can still be read without its neighbours.
+// Blocks carry the segment id, their sequence number and CRC-32C checksums
+// of header and payload, so after a crash the valid tail of an unsealed
+// segment is found by scanning blocks until the first one that does not
+// check out; stale bytes from an earlier use of the disk space never pass
+// for data.
+//
+// A stream's first chunk in every segment starts with its StreamInfo record,
+// so a segment can be read on its own; streams timed from RTCP sender
+// reports follow it with a ClockSync record, repeated whenever the mapping
+// moves. All integers are little-endian.
+
+#ifndef NVR_STORAGE_SEGMENT_FORMAT_H
+#define NVR_STORAGE_SEGMENT_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace nvr {
+
+constexpr size_t kBlockAlign = 4096;
+constexpr uint32_t kSegmentVersion = 1;
+constexpr char kSegmentMagic[8] = {'N', 'V', 'R', 'S', 'E', 'G', '1', 0};
+constexpr uint32_t kBlockMagic = 0x424b564e;  // "NVKB"
+
+inline uint64_t alignUp(uint64_t value, uint64_t align = kBlockAlign) {
+  return (value + align - 1) / align * align;
+}
+
+struct SegmentHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t blockAlign;
+  uint64_t segmentId;
+  uint64_t segmentSize;
+  int64_t createdUs;
+  // Set when the segment is sealed (closed cleanly or recovered).
+  uint64_t dataEnd;
+  int64_t firstTimestampUs;
+  int64_t lastTimestampUs;
+  uint32_t blocks;
+  uint32_t sealed;
+  char group[64];
+  uint32_t crc;  // of everything above
+  uint32_t reserved;
+};
+static_assert(sizeof(SegmentHeader) == 144, "SegmentHeader layout");
+
+struct BlockHeader {
+  uint32_t magic;
+  uint32_t headerCrc;  // of this header with headerCrc = 0
+  uint64_t segmentId;
+  uint32_t sequence;   // 0, 1, 2, ... within the segment
+  uint32_t records;
+  uint32_t payloadSize;
+  uint32_t payloadCrc;
+  int64_t firstTimestampUs;
+  int64_t lastTimestampUs;
+};
+static_assert(sizeof(BlockHeader) == 48, "BlockHeader layout");
+
+enum class RecordType : uint8_t { StreamInfo = 1, Video = 2, Audio = 3, ClockSync = 4 };
+
+constexpr uint8_t kRecordKeyframe = 0x01;
+// Recorded for an event trigger, pre-roll included, rather than
+// continuously; retention keeps it longer (retention_engine.h).
+constexpr uint8_t kRecordEvent = 0x02;
+
+struct RecordHeader {
+  uint32_t streamId;
+  uint8_t type;
+  uint8_t flags;
+  uint16_t reserved;
+  uint32_t size;       // payload bytes following this header
+  uint32_t reserved2;
+  int64_t timestampUs;  // wall clock
+};
+static_assert(sizeof(RecordHeader) == 24, "RecordHeader layout");
+
+// Payload of a StreamInfo record.
+struct StreamInfo {
+  std::string cameraId;
+  std::string codec;      // SDP encoding name, e.g. "H264"
+  uint32_t clockRate = 0;
+  std::string extradata;  // parameter sets in Annex-B form
+
+  std::string serialize() const;
+  bool parse(const uint8_t* data, size_t size);
+};
+
+// Payload of a ClockSync record: how a stream's RTP timestamps became its
+// record timestamps. The sender's clock (RTCP SR NTP time) at an RTP
+// timestamp is senderUs + (rtp - rtpTimestamp) / (clockRate * (1 + drift)),
+// and the record timestamp adds offsetUs, which is 0 unless the sender's
+// clock was too far from ours to be used as is.
+struct StreamClock {
+  uint32_t rtpTimestamp = 0;
+  uint32_t clockRate = 0;
+  int64_t senderUs = 0;
+  int64_t offsetUs = 0;
+  int32_t driftPpb = 0;     // RTP clock against nominal; positive: fast
+  uint32_t residualUs = 0;  // RMS error of the sender reports' fit
+  uint32_t reports = 0;     // sender reports fitted, 0 for none
+
+  std::string serialize() const;
+  bool parse(const uint8_t* data, size_t size);
+};
+
+// Segment files are named by their id, zero-padded so that names sort in
+// write order: "0000000042.seg".
+std::string segmentFileName(uint64_t segmentId);
+bool parseSegmentFileName(const std::string& name, uint64_t* segmentId);
+
+uint32_t segmentHeaderCrc(const SegmentHeader& header);
+uint32_t blockHeaderCrc(const BlockHeader& header);
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_SEGMENT_FORMAT_H
@@ -0,0 +1,377 @@
+#include "storage/segment_index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "storage/crc32c.h"
+#include "storage/file_util.h"
+#include "storage/segment_format.h"
+#include "storage/segment_reader.h"
+
+namespace nvr {
+
+namespace {
+
+void putVarint(std::string* out, uint64_t v) {
+  while (v >= 0x80) {
+    out->push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out->push_back(static_cast<char>(v));
+}
+
+uint64_t getVarint(const uint8_t** p) {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t b = *(*p)++;
+    v |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if (!(b & 0x80)) break;
+  }
+  return v;
+}
+
+uint64_t zigzag(int64_t v) {
+  return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+int64_t unzigzag(uint64_t v) {
+  return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+template <typename T>
+void putRaw(std::string* out, const T& v) {
+  out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void padTo8(std::string* out) { out->resize((out->size() + 7) & ~size_t(7), '\0'); }
+
+// In-order walk of the implicit tree: fills keys/order so that keys[k] is
+// the k-th node in BFS order (1-based).
+void fillEytzinger(const std::vector<IndexGroup>& groups, size_t k, size_t* next,
+                   std::vector<int64_t>* keys, std::vector<uint32_t>* order) {
+  if (k > groups.size()) return;
+  fillEytzinger(groups, 2 * k, next, keys, order);
+  (*keys)[k] = groups[*next].firstTimestampUs;
+  (*order)[k] = static_cast<uint32_t>(*next);
+  ++*next;
+  fillEytzinger(groups, 2 * k + 1, next, keys, order);
+}
+
+}  // namespace
+
+std::string segmentIndexPath(const std::string& segmentPath) {
+  std::string path = segmentPath;
+  if (path.size() > 4 && path.compare(path.size() - 4, 4, ".seg") == 0)
+    path.resize(path.size() - 4);
+  return path + ".idx";
+}
+
+void SegmentIndexBuilder::reset(uint64_t segmentId) {
+  segmentId_ = segmentId;
+  streams_.clear();
+  entries_ = 0;
+  skipped_ = 0;
+  dirty_ = true;
+}
+
+void SegmentIndexBuilder::addStream(uint32_t streamId, const std::string& cameraId) {
+  streams_[streamId].cameraId = cameraId;
+}
+
+void SegmentIndexBuilder::add(uint32_t streamId, int64_t timestampUs, uint64_t blockOffset) {
+  std::vector<KeyframeEntry>& entries = streams_[streamId].entries;
+  if (!entries.empty() && timestampUs <= entries.back().timestampUs) {
+    ++skipped_;
+    return;
+  }
+  KeyframeEntry entry;
+  entry.timestampUs = timestampUs;
+  entry.blockOffset = blockOffset;
+  entries.push_back(entry);
+  ++entries_;
+  dirty_ = true;
+}
+
+void SegmentIndexBuilder::addChunk(uint32_t streamId, uint64_t offset, uint64_t size) {
+  std::vector<ChunkEntry>& chunks = streams_[streamId].chunks;
+  if (!chunks.empty() && offset < chunks.back().offset + chunks.back().size) return;
+  ChunkEntry chunk;
+  chunk.offset = offset;
+  chunk.size = size;
+  chunks.push_back(chunk);
+  dirty_ = true;
+}
+
+void SegmentIndexBuilder::setClock(uint32_t streamId, const StreamClock& clock) {
+  streams_[streamId].clock = clock;
+  dirty_ = true;
+}
+
+void SegmentIndexBuilder::setFlags(uint32_t streamId, uint32_t flags) {
+  Stream& stream = streams_[streamId];
+  if ((stream.flags | flags) == stream.flags) return;
+  stream.flags |= flags;
+  dirty_ = true;
+}
+
+std::string SegmentIndexBuilder::build(bool sealed) {
+  dirty_ = false;
+  std::vector<const std::pair<const uint32_t, Stream>*> streams;
+  for (const auto& kv : streams_)
+    if (!kv.second.entries.empty() || !kv.second.chunks.empty()) streams.push_back(&kv);
+
+  std::string out(sizeof(IndexHeader) + streams.size() * sizeof(IndexStream), '\0');
+  std::vector<IndexStream> table(streams.size());
+  for (size_t s = 0; s < streams.size(); ++s) {
+    const Stream& stream = streams[s]->second;
+    const std::vector<KeyframeEntry>& entries = stream.entries;
+    IndexStream& info = table[s];
+    memset(&info, 0, sizeof(info));
+    strncpy(info.cameraId, stream.cameraId.c_str(), sizeof(info.cameraId) - 1);
+    info.streamId = streams[s]->first;
+    info.entries = static_cast<uint32_t>(entries.size());
+    info.chunks = static_cast<uint32_t>(stream.chunks.size());
+    if (!entries.empty()) {
+      info.firstTimestampUs = entries.front().timestampUs;
+      info.lastTimestampUs = entries.back().timestampUs;
+    }
+    const StreamClock& clock = stream.clock;
+    info.clockSenderUs = clock.senderUs;
+    info.clockOffsetUs = clock.offsetUs;
+    info.clockRtp = clock.rtpTimestamp;
+    info.clockRate = clock.clockRate;
+    info.clockDriftPpb = clock.driftPpb;
+    info.clockResidualUs = clock.residualUs;
+    info.clockReports = clock.reports;
+    info.flags = stream.flags;
+
+    std::vector<IndexGroup> groups;
+    std::string deltas;
+    for (size_t i = 0; i < entries.size(); i += kIndexGroupSize) {
+      IndexGroup group;
+      group.firstTimestampUs = entries[i].timestampUs;
+      group.firstOffset = entries[i].blockOffset;
+      group.deltaOffset = static_cast<uint32_t>(deltas.size());
+      group.count = static_cast<uint32_t>(std::min(kIndexGroupSize, entries.size() - i));
+      for (size_t j = i + 1; j < i + group.count; ++j) {
+        putVarint(&deltas, zigzag(entries[j].timestampUs - entries[j - 1].timestampUs));
+        putVarint(&deltas, entries[j].blockOffset - entries[j - 1].blockOffset);
+      }
+      groups.push_back(group);
+    }
+    info.groups = static_cast<uint32_t>(groups.size());
+
+    std::vector<int64_t> keys(groups.size() + 1, INT64_MIN);
+    std::vector<uint32_t> order(groups.size() + 1, static_cast<uint32_t>(groups.size()));
+    size_t next = 0;
+    fillEytzinger(groups, 1, &next, &keys, &order);
+
+    info.keysOffset = out.size();
+    out.append(reinterpret_cast<const char*>(keys.data()), keys.size() * sizeof(int64_t));
+    info.orderOffset = out.size();
+    out.append(reinterpret_cast<const char*>(order.data()), order.size() * sizeof(uint32_t));
+    padTo8(&out);
+    info.groupsOffset = out.size();
+    for (const IndexGroup& group : groups) putRaw(&out, group);
+    info.deltasOffset = out.size();
+    out.append(deltas);
+    info.chunksOffset = out.size();
+    uint64_t end = 0;
+    for (const ChunkEntry& chunk : stream.chunks) {
+      putVarint(&out, (chunk.offset - end) / kBlockAlign);
+      putVarint(&out, chunk.size / kBlockAlign);
+      end = chunk.offset + chunk.size;
+    }
+    padTo8(&out);
+  }
+  if (!table.empty())
+    memcpy(&out[sizeof(IndexHeader)], table.data(), table.size() * sizeof(IndexStream));
+
+  IndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kIndexMagic, sizeof(header.magic));
+  header.version = kIndexVersion;
+  header.streams = static_cast<uint32_t>(streams.size());
+  header.segmentId = segmentId_;
+  header.fileSize = out.size();
+  header.sealed = sealed ? 1 : 0;
+  memcpy(&out[0], &header, sizeof(header));
+  header.crc = crc32c(out.data(), out.size());
+  memcpy(&out[0], &header, sizeof(header));
+  return out;
+}
+
+SegmentIndex::~SegmentIndex() { close(); }
+
+int SegmentIndex::open(const std::string& path) {
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -errno;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(IndexHeader))) {
+    ::close(fd);
+    return -EBADMSG;
+  }
+  void* map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) return -errno;
+  map_ = static_cast<const uint8_t*>(map);
+  size_ = static_cast<size_t>(st.st_size);
+
+  IndexHeader h = *header();
+  uint32_t crc = h.crc;
+  h.crc = 0;
+  uint32_t actual = crc32c(&h, sizeof(h));
+  actual = crc32c(actual, map_ + sizeof(h), size_ - sizeof(h));
+  bool valid = memcmp(h.magic, kIndexMagic, sizeof(h.magic)) == 0 &&
+               h.version == kIndexVersion && h.fileSize == size_ && crc == actual &&
+               sizeof(IndexHeader) + h.streams * sizeof(IndexStream) <= size_;
+  for (size_t i = 0; valid && i < h.streams; ++i) {
+    const IndexStream& s = stream(i);
+    valid = s.keysOffset + (s.groups + 1) * sizeof(int64_t) <= size_ &&
+            s.orderOffset + (s.groups + 1) * sizeof(uint32_t) <= size_ &&
+            s.groupsOffset + s.groups * sizeof(IndexGroup) <= s.deltasOffset &&
+            s.deltasOffset <= s.chunksOffset && s.chunksOffset <= size_;
+  }
+  if (!valid) {
+    close();
+    return -EBADMSG;
+  }
+  return 0;
+}
+
+void SegmentIndex::close() {
+  if (map_) munmap(const_cast<uint8_t*>(map_), size_);
+  map_ = nullptr;
+  size_ = 0;
+}
+
+const IndexStream& SegmentIndex::stream(size_t i) const {
+  return reinterpret_cast<const IndexStream*>(map_ + sizeof(IndexHeader))[i];
+}
+
+int SegmentIndex::findStream(const std::string& cameraId) const {
+  for (size_t i = 0; i < streamCount(); ++i) {
+    const IndexStream& s = stream(i);
+    if (strncmp(s.cameraId, cameraId.c_str(), sizeof(s.cameraId)) == 0)
+      return static_cast<int>(i);
+  }
+  return -1;
+}
+
+bool SegmentIndex::seek(size_t streamIndex, int64_t timestampUs, KeyframeEntry* out) const {
+  const IndexStream& s = stream(streamIndex);
+  if (s.groups == 0) return false;
+  const int64_t* keys = reinterpret_cast<const int64_t*>(map_ + s.keysOffset);
+  const uint32_t* order = reinterpret_cast<const uint32_t*>(map_ + s.orderOffset);
+  const IndexGroup* groups = reinterpret_cast<const IndexGroup*>(map_ + s.groupsOffset);
+
+  // Descend to the first group starting after timestampUs; the answer lies
+  // in the group before it.
+  size_t n = s.groups;
+  size_t k = 1;
+  while (k <= n) {
+    __builtin_prefetch(keys + 16 * k);
+    k = 2 * k + (keys[k] <= timestampUs);
+  }
+  k >>= __builtin_ffsll(~static_cast<long long>(k));
+  size_t after = k == 0 ? n : order[k];
+  const IndexGroup& group = groups[after == 0 ? 0 : after - 1];
+
+  KeyframeEntry entry;
+  entry.timestampUs = group.firstTimestampUs;
+  entry.blockOffset = group.firstOffset;
+  *out = entry;
+  const uint8_t* p = map_ + s.deltasOffset + group.deltaOffset;
+  for (uint32_t i = 1; i < group.count; ++i) {
+    entry.timestampUs += unzigzag(getVarint(&p));
+    entry.blockOffset += getVarint(&p);
+    if (entry.timestampUs > timestampUs) break;
+    *out = entry;
+  }
+  return true;
+}
+
+void SegmentIndex::entries(size_t streamIndex, std::vector<KeyframeEntry>* out) const {
+  const IndexStream& s = stream(streamIndex);
+  const IndexGroup* groups = reinterpret_cast<const IndexGroup*>(map_ + s.groupsOffset);
+  for (uint32_t g = 0; g < s.groups; ++g) {
+    KeyframeEntry entry;
+    entry.timestampUs = groups[g].firstTimestampUs;
+    entry.blockOffset = groups[g].firstOffset;
+    out->push_back(entry);
+    const uint8_t* p = map_ + s.deltasOffset + groups[g].deltaOffset;
+    for (uint32_t i = 1; i < groups[g].count; ++i) {
+      entry.timestampUs += unzigzag(getVarint(&p));
+      entry.blockOffset += getVarint(&p);
+      out->push_back(entry);
+    }
+  }
+}
+
+void SegmentIndex::chunks(size_t streamIndex, std::vector<ChunkEntry>* out) const {
+  const IndexStream& s = stream(streamIndex);
+  const uint8_t* p = map_ + s.chunksOffset;
+  uint64_t end = 0;
+  for (uint32_t i = 0; i < s.chunks; ++i) {
+    ChunkEntry chunk;
+    chunk.offset = end + getVarint(&p) * kBlockAlign;
+    chunk.size = getVarint(&p) * kBlockAlign;
+    end = chunk.offset + chunk.size;
+    out->push_back(chunk);
+  }
+}
+
+bool SegmentIndex::clock(size_t streamIndex, StreamClock* out) const {
+  const IndexStream& s = stream(streamIndex);
+  if (s.clockReports == 0) return false;
+  out->rtpTimestamp = s.clockRtp;
+  out->clockRate = s.clockRate;
+  out->senderUs = s.clockSenderUs;
+  out->offsetUs = s.clockOffsetUs;
+  out->driftPpb = s.clockDriftPpb;
+  out->residualUs = s.clockResidualUs;
+  out->reports = s.clockReports;
+  return true;
+}
+
+int rebuildSegmentIndex(const std::string& segmentPath) {
+  SegmentReader reader;
+  int rc = reader.open(segmentPath);
+  if (rc < 0) return rc;
+  SegmentIndexBuilder builder;
+  builder.reset(reader.header().segmentId);
+  // Continuous video without a delta frame is taken as reduced.
+  std::map<uint32_t, bool> deltas;
+  SegmentReader::Record record;
+  while (reader.next(&record)) {
+    builder.addChunk(record.header.streamId, record.blockOffset, record.blockSize);
+    if (record.header.type == static_cast<uint8_t>(RecordType::StreamInfo)) {
+      auto it = reader.streams().find(record.header.streamId);
+      if (it != reader.streams().end()) builder.addStream(it->first, it->second.cameraId);
+    } else if (record.header.type == static_cast<uint8_t>(RecordType::ClockSync)) {
+      StreamClock clock;
+      if (clock.parse(record.data, record.header.size))
+        builder.setClock(record.header.streamId, clock);
+    } else {
+      bool event = (record.header.flags & kRecordEvent) != 0;
+      builder.setFlags(record.header.streamId, event ? kIndexStreamEvents : kIndexStreamContinuous);
+      if (!event && record.header.type == static_cast<uint8_t>(RecordType::Video))
+        deltas[record.header.streamId] |= !(record.header.flags & kRecordKeyframe);
+      if (record.header.flags & kRecordKeyframe)
+        builder.add(record.header.streamId, record.header.timestampUs, record.blockOffset);
+    }
+  }
+  for (const auto& kv : deltas)
+    if (!kv.second) builder.setFlags(kv.first, kIndexStreamReduced);
+  return writeFileAtomic(segmentIndexPath(segmentPath),
+                         builder.build(reader.header().sealed || reader.recovered()));
+}
+
+}  // namespace nvr
@@ -0,0 +1,193 @@
+// Keyframe index of one segment: for every stream, the wall clock time and
+// block offset of each keyframe, and the chunk directory: every block that
+// holds records of the stream. In a segment shared by many cameras, replay
+// of one camera reads just its chunks.
+//
+// Stored next to the segment as "<id>.idx" and mmapped for lookups. Per
+// stream, keyframes are split into groups of kIndexGroupSize. Each group
+// stores its first entry in full and the rest as varint deltas. The group
+// start times are also stored in Eytzinger (BFS) order, so a lookup does a
+// cache-friendly, branch-free descent over them and then decodes at most one
+// group:
+//
+//   [IndexHeader][IndexStream x streams]
+//   per stream: [eytzinger keys: int64 x (groups + 1)]
+//               [eytzinger -> group: uint32 x (groups + 1)]
+//               [IndexGroup x groups][deltas][chunks]
+//
+// Chunks are stored as varint pairs: the gap since the end of the previous
+// chunk and the size, both in kBlockAlign units.
+//
+// A stream timed from RTCP sender reports also carries the last clock
+// mapping written for it in the segment (its ClockSync record), so that
+// replay can tell which cameras share a clock, and how closely, without
+// reading media. Its flags say what footage it holds, so that retention can
+// decide a segment's fate from the index alone: continuous recording, event
+// clips (kRecordEvent), or continuous footage already reduced to keyframes.
+// Indexes written before the flags have 0 there, read as continuous.
+//
+// The writer rewrites the file while the segment is open (sealed = 0) and
+// a final time when it seals the segment. Recovery rebuilds it from the
+// segment's records.
+
+#ifndef NVR_STORAGE_SEGMENT_INDEX_H
+#define NVR_STORAGE_SEGMENT_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "storage/segment_format.h"
+
+namespace nvr {
+
+constexpr size_t kIndexGroupSize = 32;
+constexpr char kIndexMagic[8] = {'N', 'V', 'R', 'I', 'D', 'X', '1', 0};
+constexpr uint32_t kIndexVersion = 3;
+
+struct IndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t streams;
+  uint64_t segmentId;
+  uint64_t fileSize;
+  uint32_t sealed;
+  uint32_t crc;  // of the whole file with this field zero
+};
+static_assert(sizeof(IndexHeader) == 40, "IndexHeader layout");
+
+struct IndexStream {
+  char cameraId[64];
+  uint32_t streamId;
+  uint32_t entries;
+  uint32_t groups;
+  uint32_t chunks;
+  int64_t firstTimestampUs;  // of the first and last keyframe
+  int64_t lastTimestampUs;
+  uint64_t keysOffset;    // file offsets of the stream's arrays
+  uint64_t orderOffset;
+  uint64_t groupsOffset;
+  uint64_t deltasOffset;
+  uint64_t chunksOffset;
+  // StreamClock; clockReports 0 when timed by arrival.
+  int64_t clockSenderUs;
+  int64_t clockOffsetUs;
+  uint32_t clockRtp;
+  uint32_t clockRate;
+  int32_t clockDriftPpb;
+  uint32_t clockResidualUs;
+  uint32_t clockReports;
+  uint32_t flags;  // kIndexStream*
+};
+static_assert(sizeof(IndexStream) == 176, "IndexStream layout");
+
+// IndexStream::flags.
+constexpr uint32_t kIndexStreamContinuous = 0x1;  // media recorded without kRecordEvent
+constexpr uint32_t kIndexStreamEvents = 0x2;      // media recorded with it
+constexpr uint32_t kIndexStreamReduced = 0x4;     // continuous media is keyframes only
+
+struct IndexGroup {
+  int64_t firstTimestampUs;
+  uint64_t firstOffset;
+  uint32_t deltaOffset;  // into the stream's deltas
+  uint32_t count;
+};
+static_assert(sizeof(IndexGroup) == 24, "IndexGroup layout");
+
+struct KeyframeEntry {
+  int64_t timestampUs = 0;
+  uint64_t blockOffset = 0;  // segment file offset of the block holding it
+};
+
+// A block holding records of a stream.
+struct ChunkEntry {
+  uint64_t offset = 0;
+  uint64_t size = 0;  // on disk, a multiple of kBlockAlign
+};
+
+std::string segmentIndexPath(const std::string& segmentPath);
+
+// Collects keyframes while a segment is written. Timestamps must increase
+// per stream; a keyframe at or before the previous one (the camera clock
+// stepped back) is left out of the index and only reachable by reading on
+// from an earlier keyframe.
+class SegmentIndexBuilder {
+ public:
+  void reset(uint64_t segmentId);
+  void addStream(uint32_t streamId, const std::string& cameraId);
+  void add(uint32_t streamId, int64_t timestampUs, uint64_t blockOffset);
+  // Blocks are added in file order; repeats of the last block are ignored.
+  void addChunk(uint32_t streamId, uint64_t offset, uint64_t size);
+  // The stream's clock mapping; the last one set is kept.
+  void setClock(uint32_t streamId, const StreamClock& clock);
+  // Adds kIndexStream* flags to the stream's.
+  void setFlags(uint32_t streamId, uint32_t flags);
+
+  bool dirty() const { return dirty_; }
+  size_t entries() const { return entries_; }
+  size_t skipped() const { return skipped_; }
+  // Serializes the index file and clears dirty().
+  std::string build(bool sealed);
+
+ private:
+  struct Stream {
+    std::string cameraId;
+    std::vector<KeyframeEntry> entries;
+    std::vector<ChunkEntry> chunks;
+    StreamClock clock;
+    uint32_t flags = 0;
+  };
+
+  uint64_t segmentId_ = 0;
+  std::map<uint32_t, Stream> streams_;
+  size_t entries_ = 0;
+  size_t skipped_ = 0;
+  bool dirty_ = false;
+};
+
+// Read-only, mmapped view of an index file.
+class SegmentIndex {
+ public:
+  SegmentIndex() = default;
+  ~SegmentIndex();
+
+  SegmentIndex(const SegmentIndex&) = delete;
+  SegmentIndex& operator=(const SegmentIndex&) = delete;
+
+  // 0 or -errno (-EBADMSG for a corrupt file).
+  int open(const std::string& path);
+  void close();
+
+  uint64_t segmentId() const { return header()->segmentId; }
+  bool sealed() const { return header()->sealed != 0; }
+  size_t streamCount() const { return header()->streams; }
+  const IndexStream& stream(size_t i) const;
+  // Stream index of cameraId, or -1.
+  int findStream(const std::string& cameraId) const;
+
+  // Latest keyframe of stream at or before timestampUs; the stream's first
+  // keyframe if timestampUs precedes it. False if the stream has none.
+  bool seek(size_t stream, int64_t timestampUs, KeyframeEntry* out) const;
+  // All keyframes of a stream in order.
+  void entries(size_t stream, std::vector<KeyframeEntry>* out) const;
+  // The stream's chunk directory in file order.
+  void chunks(size_t stream, std::vector<ChunkEntry>* out) const;
+  // The stream's clock mapping. False if it is timed by arrival.
+  bool clock(size_t stream, StreamClock* out) const;
+
+ private:
+  const IndexHeader* header() const { return reinterpret_cast<const IndexHeader*>(map_); }
+
+  const uint8_t* map_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Rebuilds the index of a sealed segment from its records.
+int rebuildSegmentIndex(const std::string& segmentPath);
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_SEGMENT_INDEX_H
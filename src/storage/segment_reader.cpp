@@ -0,0 +1,301 @@
+#include "storage/segment_reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "base/log.h"
+#include "storage/crc32c.h"
+
+namespace nvr {
+
+namespace {
+
+int64_t preadFull(int fd, void* buf, size_t size, uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pread(fd, static_cast<char*>(buf) + done, size - done,
+                      static_cast<off_t>(offset + done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -errno;
+    if (n == 0) break;
+    done += static_cast<size_t>(n);
+  }
+  return static_cast<int64_t>(done);
+}
+
+// Cleared once the kernel or filesystem turns RWF_NOWAIT down.
+std::atomic<bool> gCachedReads{true};
+
+// How a read met the page cache.
+struct CacheProbe {
+  bool noWait = false;  // a miss is not read
+  int hit = -1;         // 1 all there, 0 not, -1 unknown
+};
+
+// Reads the start of a range from the page cache alone, then the rest from
+// the disk unless probe->noWait. Returns bytes read, -EAGAIN for a miss
+// not read, or -errno.
+int64_t preadProbed(int fd, void* buf, size_t size, uint64_t offset, CacheProbe* probe) {
+  int64_t n = -EOPNOTSUPP;
+  if (gCachedReads.load(std::memory_order_relaxed)) {
+    struct iovec iov = {buf, size};
+    do {
+      n = preadv2(fd, &iov, 1, static_cast<off_t>(offset), RWF_NOWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) n = -errno;
+  }
+  if (n == -EOPNOTSUPP || n == -EINVAL || n == -ENOSYS) {
+    gCachedReads.store(false, std::memory_order_relaxed);
+    return preadFull(fd, buf, size, offset);
+  }
+  if (n < 0 && n != -EAGAIN) return n;
+  size_t have = n < 0 ? 0 : static_cast<size_t>(n);
+  probe->hit = have == size;
+  if (have == size) return n;
+  if (probe->noWait) return -EAGAIN;
+  int64_t rest = preadFull(fd, static_cast<char*>(buf) + have, size - have, offset + have);
+  return rest < 0 ? rest : static_cast<int64_t>(have) + rest;
+}
+
+// Reads the block at offset into buf. expectedSequence < 0 accepts any.
+// With the block's size known up front (sizeHint) it takes a single read,
+// tried from the page cache first if probe is given. Returns the block's
+// size on disk, 0 if it is not a valid block, or -errno.
+int64_t readBlock(int fd, const SegmentHeader& segment, uint64_t offset, int64_t expectedSequence,
+                  std::vector<uint8_t>* buf, BlockHeader* header, uint64_t sizeHint = 0,
+                  CacheProbe* probe = nullptr) {
+  if (offset + kBlockAlign > segment.segmentSize) return 0;
+  uint64_t first =
+      std::max<uint64_t>(kBlockAlign, std::min(sizeHint, segment.segmentSize - offset));
+  buf->resize(first);
+  int64_t n = probe ? preadProbed(fd, buf->data(), first, offset, probe)
+                    : preadFull(fd, buf->data(), first, offset);
+  if (n < 0) return n;
+  if (n < static_cast<int64_t>(sizeof(BlockHeader))) return 0;
+  memcpy(header, buf->data(), sizeof(*header));
+  if (header->magic != kBlockMagic || header->segmentId != segment.segmentId ||
+      header->headerCrc != blockHeaderCrc(*header))
+    return 0;
+  if (expectedSequence >= 0 && header->sequence != static_cast<uint64_t>(expectedSequence))
+    return 0;
+  uint64_t total = alignUp(sizeof(BlockHeader) + header->payloadSize);
+  if (offset + total > segment.segmentSize) return 0;
+  if (total > static_cast<uint64_t>(n)) {
+    uint64_t have = static_cast<uint64_t>(n);
+    buf->resize(total);
+    n = preadFull(fd, buf->data() + have, total - have, offset + have);
+    if (n < 0) return n;
+    if (n < static_cast<int64_t>(total - have)) return 0;
+  }
+  if (crc32c(buf->data() + sizeof(BlockHeader), header->payloadSize) != header->payloadCrc)
+    return 0;
+  return static_cast<int64_t>(total);
+}
+
+}  // namespace
+
+int readSegmentHeader(int fd, SegmentHeader* header) {
+  int64_t n = preadFull(fd, header, sizeof(*header), 0);
+  if (n < 0) return static_cast<int>(n);
+  if (n < static_cast<int64_t>(sizeof(*header))) return -EBADMSG;
+  if (memcmp(header->magic, kSegmentMagic, sizeof(header->magic)) != 0 ||
+      header->version != kSegmentVersion || header->blockAlign != kBlockAlign ||
+      header->crc != segmentHeaderCrc(*header))
+    return -EBADMSG;
+  return 0;
+}
+
+int scanSegment(int fd, const SegmentHeader& header, SegmentScan* scan) {
+  *scan = SegmentScan();
+  std::vector<uint8_t> buf;
+  uint64_t offset = kBlockAlign;
+  for (;;) {
+    BlockHeader block;
+    int64_t size = readBlock(fd, header, offset, scan->blocks, &buf, &block);
+    if (size < 0) return static_cast<int>(size);
+    if (size == 0) break;
+    ++scan->blocks;
+    scan->records += block.records;
+    if (block.firstTimestampUs != 0) {
+      if (scan->firstTimestampUs == 0) scan->firstTimestampUs = block.firstTimestampUs;
+      scan->lastTimestampUs = block.lastTimestampUs;
+    }
+    offset += static_cast<uint64_t>(size);
+  }
+  scan->dataEnd = offset;
+  return 0;
+}
+
+int recoverSegment(const std::string& path, SegmentScan* scan) {
+  int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) return -errno;
+  SegmentHeader header;
+  int rc = readSegmentHeader(fd, &header);
+  if (rc < 0 || header.sealed) {
+    ::close(fd);
+    if (rc == 0 && scan) {
+      scan->dataEnd = header.dataEnd;
+      scan->blocks = header.blocks;
+      scan->firstTimestampUs = header.firstTimestampUs;
+      scan->lastTimestampUs = header.lastTimestampUs;
+    }
+    return rc;
+  }
+  SegmentScan local;
+  rc = scanSegment(fd, header, &local);
+  if (rc == 0) {
+    header.dataEnd = local.dataEnd;
+    header.blocks = local.blocks;
+    header.firstTimestampUs = local.firstTimestampUs;
+    header.lastTimestampUs = local.lastTimestampUs;
+    header.sealed = 1;
+    header.crc = segmentHeaderCrc(header);
+    if (pwrite(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+        fdatasync(fd) < 0)
+      rc = -errno;
+  }
+  ::close(fd);
+  if (rc < 0) return rc;
+  if (scan) *scan = local;
+  return 1;
+}
+
+uint64_t checkBlock(uint64_t segmentId, const uint8_t* data, size_t size) {
+  if (size < sizeof(BlockHeader)) return 0;
+  BlockHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != kBlockMagic || header.segmentId != segmentId ||
+      header.headerCrc != blockHeaderCrc(header))
+    return 0;
+  uint64_t total = alignUp(sizeof(BlockHeader) + header.payloadSize);
+  if (total > size) return 0;
+  if (crc32c(data + sizeof(BlockHeader), header.payloadSize) != header.payloadCrc) return 0;
+  return total;
+}
+
+SegmentReader::~SegmentReader() { close(); }
+
+int SegmentReader::open(const std::string& path) {
+  close();
+  fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) return -errno;
+  int rc = readSegmentHeader(fd_, &header_);
+  if (rc == 0 && header_.sealed) {
+    dataEnd_ = header_.dataEnd;
+  } else if (rc == 0) {
+    SegmentScan scan;
+    rc = scanSegment(fd_, header_, &scan);
+    dataEnd_ = scan.dataEnd;
+    recovered_ = true;
+  }
+  if (rc < 0) {
+    close();
+    return rc;
+  }
+  nextBlockOffset_ = kBlockAlign;
+  limit_ = UINT64_MAX;
+  return 0;
+}
+
+void SegmentReader::close() {
+  if (fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+  dataEnd_ = 0;
+  recovered_ = false;
+  cursor_ = blockEnd_ = 0;
+  blockSize_ = 0;
+  streams_.clear();
+  bytesRead_ = 0;
+  cacheHits_ = cacheMisses_ = missedBytes_ = 0;
+  missedOffset_ = 0;
+}
+
+void SegmentReader::seekBlock(uint64_t offset) {
+  nextBlockOffset_ = offset;
+  limit_ = UINT64_MAX;
+  cursor_ = blockEnd_ = 0;
+}
+
+int SegmentReader::readChunk(uint64_t offset, uint64_t size, bool noWait) {
+  endIteration();
+  if (fd_ < 0 || offset + size > dataEnd_) return -EBADMSG;
+  if (blockSize_ != 0 && offset == blockOffset_) {
+    // The block in memory, again (keyframes walked one by one often share
+    // a chunk): no need to read it twice.
+    cursor_ = sizeof(BlockHeader);
+    blockEnd_ = loadedEnd_;
+    return 0;
+  }
+  int64_t loaded = loadBlock(offset, size, true, noWait);
+  if (loaded < 0) return static_cast<int>(loaded);
+  if (loaded == 0) return -EBADMSG;
+  return 0;
+}
+
+void SegmentReader::endIteration() {
+  cursor_ = blockEnd_ = 0;
+  limit_ = 0;
+}
+
+int64_t SegmentReader::loadBlock(uint64_t offset, uint64_t sizeHint, bool probe, bool noWait) {
+  BlockHeader header;
+  blockSize_ = 0;  // block_ no longer holds a valid block
+  CacheProbe cache;
+  cache.noWait = noWait;
+  int64_t size =
+      readBlock(fd_, header_, offset, -1, &block_, &header, sizeHint, probe ? &cache : nullptr);
+  // The read again of a chunk that missed with noWait, once fetched, is
+  // still the one miss.
+  if (cache.hit == 1 && offset != missedOffset_) {
+    ++cacheHits_;
+  } else if (cache.hit == 0) {
+    ++cacheMisses_;
+    missedBytes_ += std::max<uint64_t>(kBlockAlign, sizeHint);
+  }
+  missedOffset_ = cache.hit == 0 && noWait ? offset : 0;
+  if (size <= 0) return size;
+  bytesRead_ += block_.size();
+  blockOffset_ = offset;
+  blockSize_ = static_cast<uint64_t>(size);
+  cursor_ = sizeof(BlockHeader);
+  blockEnd_ = loadedEnd_ = sizeof(BlockHeader) + header.payloadSize;
+  return size;
+}
+
+bool SegmentReader::next(Record* record) {
+  if (fd_ < 0) return false;
+  while (cursor_ + sizeof(RecordHeader) > blockEnd_) {
+    if (nextBlockOffset_ >= std::min(dataEnd_, limit_)) return false;
+    int64_t size = loadBlock(nextBlockOffset_);
+    if (size <= 0) {
+      if (size < 0) NVR_WARN("segment %llu: read failed: %s",
+                             static_cast<unsigned long long>(header_.segmentId),
+                             strerror(static_cast<int>(-size)));
+      return false;
+    }
+    nextBlockOffset_ += static_cast<uint64_t>(size);
+  }
+  memcpy(&record->header, block_.data() + cursor_, sizeof(RecordHeader));
+  cursor_ += sizeof(RecordHeader);
+  if (record->header.size > blockEnd_ - cursor_) {
+    cursor_ = blockEnd_;
+    return false;
+  }
+  record->data = block_.data() + cursor_;
+  record->blockOffset = blockOffset_;
+  record->blockSize = blockSize_;
+  cursor_ += record->header.size;
+  if (record->header.type == static_cast<uint8_t>(RecordType::StreamInfo)) {
+    StreamInfo info;
+    if (info.parse(record->data, record->header.size)) streams_[record->header.streamId] = info;
+  }
+  return true;
+}
+
+}  // namespace nvr
@@ -0,0 +1,129 @@
+// Reading and crash recovery of segment files.
+//
+// A sealed segment records where its data ends. An unsealed one (the
+// writer crashed or the machine lost power) is recovered by walking its
+// blocks from the start and keeping every block whose header and payload
+// checksums, segment id and sequence number check out; the first block
+// that fails ends the data. recoverSegment() then writes a sealed header so
+// the scan happens only once.
+
+#ifndef NVR_STORAGE_SEGMENT_READER_H
+#define NVR_STORAGE_SEGMENT_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "storage/segment_format.h"
+
+namespace nvr {
+
+struct SegmentScan {
+  uint64_t dataEnd = 0;
+  uint32_t blocks = 0;
+  uint64_t records = 0;
+  int64_t firstTimestampUs = 0;
+  int64_t lastTimestampUs = 0;
+};
+
+// Reads and validates the header at offset 0. 0 or -errno (-EBADMSG for a
+// bad magic, version or checksum).
+int readSegmentHeader(int fd, SegmentHeader* header);
+
+// Walks the blocks of an open segment and reports where valid data ends.
+int scanSegment(int fd, const SegmentHeader& header, SegmentScan* scan);
+
+// Seals the segment at path if it is not sealed yet. Returns 1 if it was
+// recovered, 0 if it was already sealed, or -errno.
+int recoverSegment(const std::string& path, SegmentScan* scan = nullptr);
+
+// Checks a block read whole into data, e.g. a chunk read asynchronously:
+// its header, and its payload against the checksum. Returns the block's
+// size on disk, or 0 if data does not start with a valid block of the
+// segment.
+uint64_t checkBlock(uint64_t segmentId, const uint8_t* data, size_t size);
+
+class SegmentReader {
+ public:
+  struct Record {
+    RecordHeader header;
+    const uint8_t* data = nullptr;  // valid until the next call
+    uint64_t blockOffset = 0;       // file offset of the containing block
+    uint64_t blockSize = 0;         // its size on disk
+  };
+
+  SegmentReader() = default;
+  ~SegmentReader();
+
+  SegmentReader(const SegmentReader&) = delete;
+  SegmentReader& operator=(const SegmentReader&) = delete;
+
+  // Unsealed segments are scanned (read-only) to find their end.
+  int open(const std::string& path);
+  void close();
+
+  const SegmentHeader& header() const { return header_; }
+  uint64_t dataEnd() const { return dataEnd_; }
+  bool recovered() const { return recovered_; }
+
+  // Iterates records in write order. Returns false at the end of the data.
+  bool next(Record* record);
+  // Continues iteration at the block starting at offset (from an index).
+  void seekBlock(uint64_t offset);
+  // Reads just the block of a chunk directory entry (segment_index.h) in a
+  // single pread() (none if it is the block last loaded); next() then
+  // returns its records and stops at its end. The read is tried from the
+  // page cache first (preadv2() with RWF_NOWAIT), which costs nothing when
+  // it is there and tells hits from misses. With noWait, a chunk not all
+  // in the page cache is not read: -EAGAIN. Returns 0, -EBADMSG for an
+  // invalid block, or -errno.
+  int readChunk(uint64_t offset, uint64_t size, bool noWait = false);
+  // Ends iteration until the next seekBlock() or readChunk().
+  void endIteration();
+
+  int fd() const { return fd_; }
+  uint64_t bytesRead() const { return bytesRead_; }
+  // Chunk reads served whole by the page cache, and those that were not
+  // (or would not have been, with noWait); both 0 where the kernel cannot
+  // tell.
+  uint64_t cacheHits() const { return cacheHits_; }
+  uint64_t cacheMisses() const { return cacheMisses_; }
+  uint64_t missedBytes() const { return missedBytes_; }
+
+  // StreamInfo records seen so far, by stream id.
+  const std::map<uint32_t, StreamInfo>& streams() const { return streams_; }
+
+ private:
+  // Loads and validates the block at offset. Returns its size on disk, 0 for
+  // an invalid block, or -errno; -EAGAIN for a page cache miss, with
+  // noWait.
+  int64_t loadBlock(uint64_t offset, uint64_t sizeHint = 0, bool probe = false,
+                    bool noWait = false);
+
+  int fd_ = -1;
+  SegmentHeader header_;
+  uint64_t dataEnd_ = 0;
+  bool recovered_ = false;
+
+  std::vector<uint8_t> block_;
+  uint64_t blockOffset_ = 0;
+  uint64_t blockSize_ = 0;  // 0: nothing valid in block_
+  size_t loadedEnd_ = 0;    // header + payload of the block in block_
+  uint64_t nextBlockOffset_ = 0;
+  uint64_t limit_ = UINT64_MAX;  // iteration stops here (readChunk)
+  size_t cursor_ = 0;     // within block_
+  size_t blockEnd_ = 0;   // header + payload
+  std::map<uint32_t, StreamInfo> streams_;
+  uint64_t bytesRead_ = 0;
+  uint64_t cacheHits_ = 0;
+  uint64_t cacheMisses_ = 0;
+  uint64_t missedBytes_ = 0;
+  uint64_t missedOffset_ = 0;  // of the last chunk not read for noWait
+};
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_SEGMENT_READER_H
@@ -0,0 +1,540 @@
+#include "storage/segment_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/clock.h"
+#include "base/log.h"
+#include "storage/crc32c.h"
+#include "storage/file_util.h"
+
+namespace nvr {
+
+namespace {
+
+int64_t preallocate(int fd, uint64_t size) {
+  if (fallocate(fd, 0, 0, static_cast<off_t>(size)) == 0) return 0;
+  // Filesystems without fallocate still get the final size up front.
+  if (errno == EOPNOTSUPP && ftruncate(fd, static_cast<off_t>(size)) == 0) return 0;
+  return -errno;
+}
+
+}  // namespace
+
+void SegmentWriterStats::add(const SegmentWriterStats& other) {
+  records += other.records;
+  recordBytes += other.recordBytes;
+  droppedRecords += other.droppedRecords;
+  blocks += other.blocks;
+  bytesWritten += other.bytesWritten;
+  writeErrors += other.writeErrors;
+  segments += other.segments;
+  buffersInFlight += other.buffersInFlight;
+}
+
+SegmentWriter::SegmentWriter(EventLoop* loop, IoBackend* io, const SegmentWriterOptions& options)
+    : loop_(loop), io_(io), options_(options) {
+  options_.segmentSize = alignUp(options_.segmentSize);
+  options_.blockSize = alignUp(std::max<size_t>(options_.blockSize, kBlockAlign));
+  if (options_.maxBuffers < 2) options_.maxBuffers = 2;
+}
+
+SegmentWriter::~SegmentWriter() {
+  if (timer_) loop_->cancel(timer_);
+  if (segment_.fd >= 0) {
+    NVR_WARN("segment writer %s destroyed without close()", options_.group.c_str());
+    io_->unregisterFile(segment_.fd);
+    ::close(segment_.fd);
+  }
+  for (auto& buffer : free_) io_->unregisterBuffer(buffer->data());
+  for (auto& kv : streams_)
+    if (kv.second.chunk) io_->unregisterBuffer(kv.second.chunk->data());
+}
+
+std::string SegmentWriter::groupDir() const { return joinPath(options_.dir, options_.group); }
+
+std::string SegmentWriter::segmentPath(uint64_t id) const {
+  return joinPath(groupDir(), segmentFileName(id));
+}
+
+int SegmentWriter::open() {
+  std::string dir = groupDir();
+  int rc = makeDirectories(dir);
+  if (rc < 0) {
+    NVR_ERROR("recording: cannot create %s: %s", dir.c_str(), strerror(-rc));
+    return rc;
+  }
+  std::vector<std::string> names;
+  listDirectory(dir, &names);
+  for (const auto& name : names) {
+    uint64_t id;
+    if (parseSegmentFileName(name, &id) && id >= nextSegmentId_) nextSegmentId_ = id + 1;
+  }
+  rc = openSegment(nextSegmentId_++);
+  if (rc < 0) return rc;
+  uint64_t interval = static_cast<uint64_t>(std::max(50, options_.flushIntervalMs / 2));
+  timer_ = loop_->runEvery(interval, [this] { onTimer(); });
+  lastSyncMs_ = loop_->nowMs();
+  return 0;
+}
+
+int SegmentWriter::openSegment(uint64_t id) {
+  std::string path = segmentPath(id);
+  int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+  int fd = ::open(path.c_str(), flags | (options_.direct ? O_DIRECT : 0), 0644);
+  if (fd < 0 && errno == EINVAL && options_.direct) {
+    NVR_WARN("recording: %s does not support O_DIRECT, using buffered writes", groupDir().c_str());
+    options_.direct = false;
+    fd = ::open(path.c_str(), flags, 0644);
+  }
+  if (fd < 0) {
+    int rc = -errno;
+    NVR_ERROR("recording: cannot create %s: %s", path.c_str(), strerror(errno));
+    return rc;
+  }
+
+  segment_ = Segment();
+  segment_.fd = fd;
+  segment_.id = id;
+  segment_.offset = kBlockAlign;
+  segment_.createdUs = wallClockUs();
+  ++stats_.segments;
+  index_.reset(id);
+  for (const auto& kv : streams_) index_.addStream(kv.first, kv.second.info.cameraId);
+  io_->registerFile(fd);
+  files_[id];
+
+  // Runs alongside the header and block writes; the blocks land inside the
+  // preallocated range either way.
+  uint64_t size = options_.segmentSize;
+  startOp(id);
+  io_->call([fd, size] { return preallocate(fd, size); }, loop_,
+            [this, id, path](int64_t result) {
+              if (result < 0)
+                NVR_WARN("recording: cannot preallocate %s: %s", path.c_str(),
+                         strerror(static_cast<int>(-result)));
+              endOp(id);
+            });
+  std::shared_ptr<AlignedBuffer> header = buildHeader(false);
+  startOp(id);
+  io_->write(fd, header->data(), kBlockAlign, 0, loop_, [this, id, header](int64_t result) {
+    if (result != static_cast<int64_t>(kBlockAlign)) ++stats_.writeErrors;
+    endOp(id);
+  });
+  NVR_DEBUG("recording: opened %s", path.c_str());
+  return 0;
+}
+
+std::unique_ptr<AlignedBuffer> SegmentWriter::buildHeader(bool sealed) const {
+  std::unique_ptr<AlignedBuffer> buffer(new AlignedBuffer(kBlockAlign));
+  memset(buffer->data(), 0, kBlockAlign);
+  buffer->resize(kBlockAlign);
+
+  SegmentHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kSegmentMagic, sizeof(header.magic));
+  header.version = kSegmentVersion;
+  header.blockAlign = kBlockAlign;
+  header.segmentId = segment_.id;
+  header.segmentSize = options_.segmentSize;
+  header.createdUs = segment_.createdUs;
+  header.dataEnd = sealed ? segment_.offset : 0;
+  header.firstTimestampUs = segment_.firstUs;
+  header.lastTimestampUs = segment_.lastUs;
+  header.blocks = segment_.blocks;
+  header.sealed = sealed ? 1 : 0;
+  strncpy(header.group, options_.group.c_str(), sizeof(header.group) - 1);
+  header.crc = segmentHeaderCrc(header);
+  memcpy(buffer->data(), &header, sizeof(header));
+  return buffer;
+}
+
+void SegmentWriter::sealSegment() {
+  if (segment_.fd < 0) return;
+  auto seal = std::make_shared<Seal>();
+  seal->segmentId = segment_.id;
+  seal->fd = segment_.fd;
+  seal->path = segmentPath(segment_.id);
+  seal->header = buildHeader(true);
+  seal->index = index_.build(true);
+  segment_.fd = -1;
+  SegmentFile& file = files_[seal->segmentId];
+  if (file.ops == 0) {
+    continueSeal(seal, 0);
+  } else {
+    file.whenIdle = [this, seal] { continueSeal(seal, 0); };
+  }
+}
+
+void SegmentWriter::continueSeal(std::shared_ptr<Seal> seal, int64_t result) {
+  if (result < 0) {
+    ++stats_.writeErrors;
+    NVR_WARN("recording: sealing %s: step %d failed: %s", seal->path.c_str(), seal->step - 1,
+             strerror(static_cast<int>(-result)));
+  }
+  auto next = [this, seal](int64_t r) { continueSeal(seal, r); };
+  switch (seal->step++) {
+    case 0:
+      // The blocks are durable before the index and header point at them.
+      io_->sync(seal->fd, loop_, next);
+      break;
+    case 1: {
+      std::string path = segmentIndexPath(seal->path);
+      io_->call([seal, path] { return writeFileAtomic(path, seal->index); }, loop_,
+                [this, next](int64_t r) {
+                  if (r >= 0 && options_.indexWritten) options_.indexWritten();
+                  next(r);
+                });
+      break;
+    }
+    case 2:
+      io_->writeSync(seal->fd, seal->header->data(), kBlockAlign, 0, loop_,
+                     [next](int64_t r) {
+                       next(r == static_cast<int64_t>(kBlockAlign) ? 0 : r < 0 ? r : -EIO);
+                     });
+      break;
+    case 3: {
+      int fd = seal->fd;
+      io_->unregisterFile(fd);
+      io_->call([fd]() -> int64_t { return ::close(fd) < 0 ? -errno : 0; }, loop_, next);
+      break;
+    }
+    default:
+      files_.erase(seal->segmentId);
+      checkClosed();
+      break;
+  }
+}
+
+int SegmentWriter::rollSegment() {
+  sealSegment();
+  return openSegment(nextSegmentId_++);
+}
+
+void SegmentWriter::writeIndex() {
+  uint64_t id = segment_.id;
+  SegmentFile& file = files_[id];
+  // One write per segment at a time: they replace the same file.
+  if (file.indexWriting) return;
+  file.indexWriting = true;
+  std::string path = segmentIndexPath(segmentPath(id));
+  auto data = std::make_shared<std::string>(index_.build(false));
+  startOp(id);
+  io_->call([path, data] { return writeFileAtomic(path, *data); }, loop_,
+            [this, id, path](int64_t result) {
+              if (result < 0) {
+                NVR_WARN("recording: cannot write %s: %s", path.c_str(),
+                         strerror(static_cast<int>(-result)));
+              } else if (options_.indexWritten) {
+                options_.indexWritten();
+              }
+              files_[id].indexWriting = false;
+              endOp(id);
+            });
+}
+
+void SegmentWriter::startOp(uint64_t segmentId) { ++files_[segmentId].ops; }
+
+void SegmentWriter::endOp(uint64_t segmentId) {
+  SegmentFile& file = files_[segmentId];
+  if (--file.ops == 0 && file.whenIdle) {
+    auto seal = std::move(file.whenIdle);
+    file.whenIdle = nullptr;
+    seal();
+  }
+  checkClosed();
+}
+
+uint32_t SegmentWriter::addStream(const StreamInfo& info) {
+  uint32_t id = nextStreamId_++;
+  streams_[id].info = info;
+  index_.addStream(id, info.cameraId);
+  return id;
+}
+
+void SegmentWriter::updateStream(uint32_t streamId, const StreamInfo& info) {
+  auto it = streams_.find(streamId);
+  if (it == streams_.end()) return;
+  flushChunk(streamId, &it->second);
+  it->second.info = info;
+  it->second.announcedIn = 0;
+  index_.addStream(streamId, info.cameraId);
+}
+
+void SegmentWriter::setStreamClock(uint32_t streamId, const StreamClock& clock) {
+  auto it = streams_.find(streamId);
+  if (it == streams_.end()) return;
+  it->second.clock = clock;
+  it->second.clockChanged = true;
+}
+
+void SegmentWriter::removeStream(uint32_t streamId) {
+  auto it = streams_.find(streamId);
+  if (it == streams_.end()) return;
+  flushChunk(streamId, &it->second);
+  if (it->second.chunk) recycle(std::move(it->second.chunk));
+  streams_.erase(it);
+}
+
+bool SegmentWriter::startChunk(Stream* stream) {
+  if (stream->chunk) return true;
+  if (!free_.empty()) {
+    stream->chunk = std::move(free_.back());
+    free_.pop_back();
+  } else if (buffers_ < streams_.size() + options_.maxBuffers) {
+    stream->chunk.reset(new AlignedBuffer(options_.blockSize));
+    io_->registerBuffer(stream->chunk->data(), stream->chunk->capacity());
+    ++buffers_;
+  } else {
+    return false;
+  }
+  stream->chunk->clear();
+  stream->chunk->resize(sizeof(BlockHeader));
+  stream->records = 0;
+  stream->firstUs = 0;
+  stream->lastUs = 0;
+  stream->startedMs = loop_->nowMs();
+  stream->keyframes.clear();
+  return true;
+}
+
+bool SegmentWriter::reserveChunk(AlignedBuffer* chunk, size_t size) {
+  if (chunk->capacity() >= alignUp(size)) return true;
+  io_->unregisterBuffer(chunk->data());
+  bool grown = chunk->reserve(size);
+  io_->registerBuffer(chunk->data(), chunk->capacity());
+  return grown;
+}
+
+void SegmentWriter::recycle(std::unique_ptr<AlignedBuffer> buffer) {
+  // Buffers beyond the current need are released rather than hoarded.
+  if (free_.size() < options_.maxBuffers) {
+    free_.push_back(std::move(buffer));
+  } else {
+    io_->unregisterBuffer(buffer->data());
+    --buffers_;
+  }
+}
+
+bool SegmentWriter::append(uint32_t streamId, RecordType type, uint8_t flags, int64_t timestampUs,
+                           const uint8_t* data, size_t size) {
+  auto it = streams_.find(streamId);
+  size_t recordSize = sizeof(RecordHeader) + size;
+  if (it == streams_.end() || closing_ || segment_.fd < 0 ||
+      alignUp(sizeof(BlockHeader) + recordSize) + 2 * kBlockAlign > options_.segmentSize) {
+    ++stats_.droppedRecords;
+    return false;
+  }
+  Stream* stream = &it->second;
+  // Keep chunks near the target size; a single large record gets a chunk
+  // of its own.
+  if (stream->chunk && stream->records > 0 &&
+      stream->chunk->size() + recordSize > options_.blockSize)
+    flushChunk(streamId, stream);
+  if (!startChunk(stream)) {
+    ++stats_.droppedRecords;
+    return false;
+  }
+  AlignedBuffer* chunk = stream->chunk.get();
+  if (!reserveChunk(chunk, chunk->size() + recordSize)) {
+    ++stats_.droppedRecords;
+    return false;
+  }
+
+  RecordHeader header;
+  memset(&header, 0, sizeof(header));
+  header.streamId = streamId;
+  header.type = static_cast<uint8_t>(type);
+  header.flags = flags;
+  header.size = static_cast<uint32_t>(size);
+  header.timestampUs = timestampUs;
+  chunk->append(&header, sizeof(header));
+  chunk->append(data, size);
+  ++stream->records;
+  if (stream->firstUs == 0) stream->firstUs = timestampUs;
+  stream->lastUs = timestampUs;
+  if (flags & kRecordKeyframe) stream->keyframes.push_back(timestampUs);
+  if (type == RecordType::Video || type == RecordType::Audio)
+    stream->indexFlags |= flags & kRecordEvent ? kIndexStreamEvents : kIndexStreamContinuous;
+  ++stats_.records;
+  stats_.recordBytes += size;
+  if (chunk->size() >= options_.blockSize) flushChunk(streamId, stream);
+  return true;
+}
+
+void SegmentWriter::flush() {
+  for (auto& kv : streams_) flushChunk(kv.first, &kv.second);
+}
+
+void SegmentWriter::flushChunk(uint32_t streamId, Stream* stream) {
+  if (!stream->chunk || stream->records == 0) return;
+  // A stream's first chunk in a segment opens with its StreamInfo, and its
+  // clock mapping when it has one; a changed mapping opens the next chunk.
+  std::string info = stream->info.serialize();
+  std::string clock;
+  if (stream->clock.reports > 0) clock = stream->clock.serialize();
+  size_t infoSize = sizeof(RecordHeader) + info.size();
+  size_t clockSize = clock.empty() ? 0 : sizeof(RecordHeader) + clock.size();
+  if (segment_.fd >= 0 &&
+      segment_.offset + alignUp(stream->chunk->size() + infoSize + clockSize) >
+          options_.segmentSize &&
+      rollSegment() < 0) {
+    stats_.droppedRecords += stream->records;
+    stream->records = 0;
+    recycle(std::move(stream->chunk));
+    return;
+  }
+  if (segment_.fd < 0) return;
+  AlignedBuffer* chunk = stream->chunk.get();
+
+  std::string prefix;
+  uint32_t prefixRecords = 0;
+  auto addRecord = [&prefix, &prefixRecords, streamId](RecordType type, const std::string& data) {
+    RecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.streamId = streamId;
+    header.type = static_cast<uint8_t>(type);
+    header.size = static_cast<uint32_t>(data.size());
+    prefix.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    prefix.append(data);
+    ++prefixRecords;
+  };
+  bool announce = stream->announcedIn != segment_.id;
+  if (announce) addRecord(RecordType::StreamInfo, info);
+  bool clockDue = !clock.empty() && (announce || stream->clockChanged);
+  if (clockDue) addRecord(RecordType::ClockSync, clock);
+  if (!prefix.empty() && reserveChunk(chunk, chunk->size() + prefix.size())) {
+    uint8_t* body = chunk->data() + sizeof(BlockHeader);
+    memmove(body + prefix.size(), body, chunk->size() - sizeof(BlockHeader));
+    memcpy(body, prefix.data(), prefix.size());
+    chunk->resize(chunk->size() + prefix.size());
+    stream->records += prefixRecords;
+    stream->announcedIn = segment_.id;
+    if (clockDue) {
+      stream->clockChanged = false;
+      index_.setClock(streamId, stream->clock);
+    }
+  }
+
+  BlockHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kBlockMagic;
+  header.segmentId = segment_.id;
+  header.sequence = segment_.blocks++;
+  header.records = stream->records;
+  header.payloadSize = static_cast<uint32_t>(chunk->size() - sizeof(BlockHeader));
+  header.payloadCrc = crc32c(chunk->data() + sizeof(BlockHeader), header.payloadSize);
+  header.firstTimestampUs = stream->firstUs;
+  header.lastTimestampUs = stream->lastUs;
+  header.headerCrc = blockHeaderCrc(header);
+  memcpy(chunk->data(), &header, sizeof(header));
+  chunk->padToAlignment();
+
+  if (segment_.firstUs == 0 || stream->firstUs < segment_.firstUs)
+    segment_.firstUs = stream->firstUs;
+  segment_.lastUs = std::max(segment_.lastUs, stream->lastUs);
+  size_t size = chunk->size();
+  uint64_t offset = segment_.offset;
+  segment_.offset += size;
+  ++stats_.blocks;
+  index_.addChunk(streamId, offset, size);
+  for (int64_t ts : stream->keyframes) index_.add(streamId, ts, offset);
+  stream->keyframes.clear();
+  if (stream->indexFlags) index_.setFlags(streamId, stream->indexFlags);
+  stream->indexFlags = 0;
+  stream->records = 0;
+
+  inFlight_.push_back(std::move(stream->chunk));
+  stats_.buffersInFlight = inFlight_.size();
+  ++stream->chunksInFlight;
+  stream->bytesInFlight += size;
+  uint64_t id = segment_.id;
+  int64_t lastUs = stream->lastUs;
+  startOp(id);
+  io_->write(segment_.fd, chunk->data(), size, offset, loop_,
+             [this, id, streamId, lastUs, chunk, size](int64_t result) {
+               onWriteDone(id, streamId, lastUs, chunk, size, result);
+             });
+}
+
+void SegmentWriter::onWriteDone(uint64_t segmentId, uint32_t streamId, int64_t lastUs,
+                                AlignedBuffer* buffer, size_t size, int64_t result) {
+  auto stream = streams_.find(streamId);
+  if (stream != streams_.end()) {
+    --stream->second.chunksInFlight;
+    stream->second.bytesInFlight -= size;
+    if (result == static_cast<int64_t>(size))
+      stream->second.writtenUs = std::max(stream->second.writtenUs, lastUs);
+  }
+  auto it = std::find_if(
+      inFlight_.begin(), inFlight_.end(),
+      [buffer](const std::unique_ptr<AlignedBuffer>& b) { return b.get() == buffer; });
+  if (it != inFlight_.end()) {
+    recycle(std::move(*it));
+    inFlight_.erase(it);
+  }
+  stats_.buffersInFlight = inFlight_.size();
+  if (result == static_cast<int64_t>(size)) {
+    stats_.bytesWritten += size;
+  } else {
+    if (stats_.writeErrors++ == 0)
+      NVR_ERROR("recording: %s block write failed: %s", options_.group.c_str(),
+                result < 0 ? strerror(static_cast<int>(-result)) : "short write");
+  }
+  endOp(segmentId);
+}
+
+void SegmentWriter::onTimer() {
+  uint64_t now = loop_->nowMs();
+  for (auto& kv : streams_) {
+    Stream& stream = kv.second;
+    if (stream.records > 0 &&
+        now - stream.startedMs >= static_cast<uint64_t>(options_.flushIntervalMs))
+      flushChunk(kv.first, &stream);
+  }
+  if (segment_.fd >= 0 && now - lastSyncMs_ >= static_cast<uint64_t>(options_.syncIntervalMs)) {
+    lastSyncMs_ = now;
+    if (index_.dirty()) writeIndex();
+    uint64_t id = segment_.id;
+    startOp(id);
+    io_->sync(segment_.fd, loop_, [this, id](int64_t) { endOp(id); });
+  }
+}
+
+SegmentStreamStats SegmentWriter::streamStats(uint32_t streamId) const {
+  SegmentStreamStats out;
+  auto it = streams_.find(streamId);
+  if (it == streams_.end()) return out;
+  const Stream& stream = it->second;
+  if (stream.chunk && stream.records > 0)
+    out.fillingBytes = stream.chunk->size() - sizeof(BlockHeader);
+  out.chunksInFlight = stream.chunksInFlight;
+  out.bytesInFlight = stream.bytesInFlight;
+  out.writtenUs = stream.writtenUs;
+  return out;
+}
+
+void SegmentWriter::close(std::function<void()> done) {
+  if (timer_) {
+    loop_->cancel(timer_);
+    timer_ = 0;
+  }
+  flush();
+  sealSegment();
+  closing_ = true;
+  closeDone_ = std::move(done);
+  checkClosed();
+}
+
+void SegmentWriter::checkClosed() {
+  if (!closing_ || !closeDone_ || !inFlight_.empty() || !files_.empty()) return;
+  auto done = std::move(closeDone_);
+  closeDone_ = nullptr;
+  done();
+}
+
+}  // namespace nvr
@@ -0,0 +1,205 @@
+// Appends records of one recording group to a sequence of segment files.
+//
+// Each stream's records are packed into a chunk buffer of its own, which is
+// written as one aligned block (O_DIRECT where the filesystem allows it)
+// once it reaches the chunk size or the flush interval passes. Chunks are
+// placed back to back in the current segment in the order they complete,
+// so many cameras sharing a group turn into one sequential write stream
+// rather than one write position per camera, and replay of one camera
+// reads only its own chunks. Segments are preallocated with fallocate() and
+// rolled when full. Keyframes and each stream's chunks are collected into
+// the segment's index (segment_index.h), which is rewritten on every sync
+// and when the segment is sealed.
+//
+// Loop-thread only. The disk is never touched from the loop: writes go
+// through an IoBackend and a bounded set of chunk buffers; when all of them
+// are in use new records are dropped and counted, so a slow disk costs
+// recordings rather than stalling ingest. Chunk buffers and segment files
+// are registered with the backend. Its operations complete in any order,
+// so a segment is sealed only once everything written to it has completed:
+// sync, sealed index, then the sealed header, written and synced together.
+
+#ifndef NVR_STORAGE_SEGMENT_WRITER_H
+#define NVR_STORAGE_SEGMENT_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "storage/aligned_buffer.h"
+#include "storage/io_backend.h"
+#include "storage/segment_format.h"
+#include "storage/segment_index.h"
+
+namespace nvr {
+
+struct SegmentWriterOptions {
+  std::string dir;                         // segments go to dir/group/
+  std::string group;
+  uint64_t segmentSize = 256ull << 20;
+  size_t blockSize = 1 << 20;              // target size of a stream's chunk
+  size_t maxBuffers = 8;                   // chunks in flight, beyond one filling per stream
+  int flushIntervalMs = 1000;              // max age of a filling chunk
+  int syncIntervalMs = 5000;               // fdatasync cadence
+  bool direct = true;                      // O_DIRECT when supported
+  // Runs on the loop each time an index file has been replaced, open or
+  // sealed (RecordingStore::generation()).
+  std::function<void()> indexWritten;
+};
+
+struct SegmentWriterStats {
+  uint64_t records = 0;
+  uint64_t recordBytes = 0;
+  uint64_t droppedRecords = 0;
+  uint64_t blocks = 0;
+  uint64_t bytesWritten = 0;  // including headers and alignment padding
+  uint64_t writeErrors = 0;
+  uint64_t segments = 0;
+  size_t buffersInFlight = 0;
+
+  void add(const SegmentWriterStats& other);
+};
+
+// One stream's share of the disk queue.
+struct SegmentStreamStats {
+  uint64_t fillingBytes = 0;   // in its chunk, not written yet
+  uint32_t chunksInFlight = 0;
+  uint64_t bytesInFlight = 0;
+  int64_t writtenUs = 0;       // newest record whose chunk is on disk, 0 before the first
+};
+
+class SegmentWriter {
+ public:
+  SegmentWriter(EventLoop* loop, IoBackend* io, const SegmentWriterOptions& options);
+  // Call close() and wait for it first.
+  ~SegmentWriter();
+
+  SegmentWriter(const SegmentWriter&) = delete;
+  SegmentWriter& operator=(const SegmentWriter&) = delete;
+
+  // Creates the group directory and the first segment. 0 or -errno.
+  int open();
+
+  // Streams are announced in every segment with a StreamInfo record at the
+  // start of their first chunk there. An update ends the stream's chunk, so
+  // the new info precedes the records it describes. Removing a stream
+  // flushes its chunk.
+  uint32_t addStream(const StreamInfo& info);
+  void updateStream(uint32_t streamId, const StreamInfo& info);
+  void removeStream(uint32_t streamId);
+  // The stream's RTP-to-wall-clock mapping. Written as a ClockSync record
+  // at the start of its next chunk, and of its first chunk in every later
+  // segment, and kept in the segment's index.
+  void setStreamClock(uint32_t streamId, const StreamClock& clock);
+
+  // Returns false if the record was dropped (unknown stream, no buffer
+  // free, or larger than a segment).
+  bool append(uint32_t streamId, RecordType type, uint8_t flags, int64_t timestampUs,
+              const uint8_t* data, size_t size);
+  // Writes out every stream's chunk.
+  void flush();
+  // Flushes, seals the current segment and runs done once every write has
+  // completed. Nothing may be appended afterwards.
+  void close(std::function<void()> done);
+
+  const SegmentWriterStats& stats() const { return stats_; }
+  // Zeros for an unknown stream.
+  SegmentStreamStats streamStats(uint32_t streamId) const;
+  const std::string& group() const { return options_.group; }
+  uint64_t segmentId() const { return segment_.id; }
+
+ private:
+  struct Segment {
+    int fd = -1;
+    uint64_t id = 0;
+    uint64_t offset = 0;  // next block offset
+    int64_t createdUs = 0;
+    uint32_t blocks = 0;
+    int64_t firstUs = 0;
+    int64_t lastUs = 0;
+  };
+  struct Stream {
+    StreamInfo info;
+    uint64_t announcedIn = 0;  // segment that already has the StreamInfo
+    StreamClock clock;
+    bool clockChanged = false;  // since it was last written
+    // The filling chunk.
+    std::unique_ptr<AlignedBuffer> chunk;
+    uint32_t records = 0;
+    int64_t firstUs = 0;
+    int64_t lastUs = 0;
+    uint64_t startedMs = 0;
+    std::vector<int64_t> keyframes;  // indexed once the chunk has an offset
+    uint32_t indexFlags = 0;         // of the chunk's media, likewise
+    uint32_t chunksInFlight = 0;
+    uint64_t bytesInFlight = 0;
+    int64_t writtenUs = 0;
+  };
+  // A segment file with operations in flight.
+  struct SegmentFile {
+    size_t ops = 0;
+    bool indexWriting = false;
+    std::function<void()> whenIdle;  // the seal, once ops drain
+  };
+  struct Seal {
+    uint64_t segmentId = 0;
+    int fd = -1;
+    std::string path;
+    std::unique_ptr<AlignedBuffer> header;
+    std::string index;
+    int step = 0;
+  };
+
+  std::string groupDir() const;
+  std::string segmentPath(uint64_t id) const;
+  int openSegment(uint64_t id);
+  int rollSegment();
+  // Seals the current segment; chunks still filling go to the next one.
+  void sealSegment();
+  void continueSeal(std::shared_ptr<Seal> seal, int64_t result);
+  std::unique_ptr<AlignedBuffer> buildHeader(bool sealed) const;
+  void writeIndex();
+  void startOp(uint64_t segmentId);
+  void endOp(uint64_t segmentId);
+  bool startChunk(Stream* stream);
+  // Grows a filling chunk, keeping it registered with the backend.
+  bool reserveChunk(AlignedBuffer* chunk, size_t size);
+  void flushChunk(uint32_t streamId, Stream* stream);
+  void recycle(std::unique_ptr<AlignedBuffer> buffer);
+  void onWriteDone(uint64_t segmentId, uint32_t streamId, int64_t lastUs, AlignedBuffer* buffer,
+                   size_t size, int64_t result);
+  void onTimer();
+  void checkClosed();
+
+  EventLoop* loop_;
+  IoBackend* io_;
+  SegmentWriterOptions options_;
+
+  Segment segment_;
+  uint64_t nextSegmentId_ = 1;
+  SegmentIndexBuilder index_;
+
+  std::map<uint32_t, Stream> streams_;
+  uint32_t nextStreamId_ = 1;
+
+  std::vector<std::unique_ptr<AlignedBuffer>> free_;
+  std::vector<std::unique_ptr<AlignedBuffer>> inFlight_;
+  size_t buffers_ = 0;
+  std::map<uint64_t, SegmentFile> files_;  // current and sealing segments
+
+  EventLoop::TimerId timer_ = 0;
+  uint64_t lastSyncMs_ = 0;
+  bool closing_ = false;
+  std::function<void()> closeDone_;
+  SegmentWriterStats stats_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_SEGMENT_WRITER_H
@@ -0,0 +1,141 @@
+#include "storage/thread_pool_io.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace nvr {
+
+namespace {
+
+int64_t writeFully(int fd, const void* data, size_t size, uint64_t offset) {
+  size_t written = 0;
+  while (written < size) {
+    ssize_t n = pwrite(fd, static_cast<const char*>(data) + written, size - written,
+                       static_cast<off_t>(offset + written));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -errno;
+    if (n == 0) return -EIO;
+    written += static_cast<size_t>(n);
+  }
+  return static_cast<int64_t>(written);
+}
+
+int64_t readFully(int fd, void* data, size_t size, uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pread(fd, static_cast<char*>(data) + done, size - done,
+                      static_cast<off_t>(offset + done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -errno;
+    if (n == 0) break;
+    done += static_cast<size_t>(n);
+  }
+  return static_cast<int64_t>(done);
+}
+
+}  // namespace
+
+ThreadPoolIoBackend::ThreadPoolIoBackend(int threads, std::string name)
+    : threadCount_(threads > 0 ? threads : 1), name_(std::move(name)) {}
+
+ThreadPoolIoBackend::~ThreadPoolIoBackend() { stop(); }
+
+int ThreadPoolIoBackend::start() {
+  if (!threads_.empty()) return 0;
+  stopping_ = false;
+  for (int i = 0; i < threadCount_; ++i) {
+    // Half the workers take reads first, the rest writes: replay gets ahead
+    // of a write backlog without starving recording.
+    bool readsFirst = i % 2 == 0;
+    threads_.emplace_back([this, readsFirst] { threadMain(readsFirst); });
+    std::string name = name_.substr(0, 12) + "-" + std::to_string(i);
+    pthread_setname_np(threads_.back().native_handle(), name.substr(0, 15).c_str());
+  }
+  return 0;
+}
+
+void ThreadPoolIoBackend::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  for (auto& thread : threads_) thread.join();
+  threads_.clear();
+}
+
+void ThreadPoolIoBackend::write(int fd, const void* data, size_t size, uint64_t offset,
+                                EventLoop* loop, Completion done) {
+  countWrite(fd, offset, size, false);
+  submit({[fd, data, size, offset] { return writeFully(fd, data, size, offset); }, loop,
+          std::move(done)},
+         false);
+}
+
+void ThreadPoolIoBackend::writeSync(int fd, const void* data, size_t size, uint64_t offset,
+                                    EventLoop* loop, Completion done) {
+  countWrite(fd, offset, size, false);
+  countOp(true);
+  submit({[fd, data, size, offset]() -> int64_t {
+            int64_t result = writeFully(fd, data, size, offset);
+            if (result >= 0 && fdatasync(fd) < 0) return -errno;
+            return result;
+          },
+          loop, std::move(done)},
+         false);
+}
+
+void ThreadPoolIoBackend::read(int fd, void* data, size_t size, uint64_t offset,
+                               EventLoop* loop, Completion done) {
+  countRead(size, false);
+  submit({[fd, data, size, offset] { return readFully(fd, data, size, offset); }, loop,
+          std::move(done)},
+         true);
+}
+
+void ThreadPoolIoBackend::sync(int fd, EventLoop* loop, Completion done) {
+  countOp(true);
+  submit({[fd]() -> int64_t { return fdatasync(fd) < 0 ? -errno : 0; }, loop, std::move(done)},
+         false);
+}
+
+void ThreadPoolIoBackend::call(std::function<int64_t()> op, EventLoop* loop, Completion done) {
+  countOp(false);
+  submit({std::move(op), loop, std::move(done)}, false);
+}
+
+size_t ThreadPoolIoBackend::pending() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return reads_.size() + ops_.size() + running_;
+}
+
+void ThreadPoolIoBackend::submit(Op op, bool read) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    (read ? reads_ : ops_).push_back(std::move(op));
+  }
+  cond_.notify_one();
+}
+
+void ThreadPoolIoBackend::threadMain(bool readsFirst) {
+  for (;;) {
+    Op op;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return stopping_ || !reads_.empty() || !ops_.empty(); });
+      std::deque<Op>* queue = readsFirst ? &reads_ : &ops_;
+      if (queue->empty()) queue = readsFirst ? &ops_ : &reads_;
+      if (queue->empty()) return;
+      op = std::move(queue->front());
+      queue->pop_front();
+      ++running_;
+    }
+    int64_t result = op.run();
+    complete(op.loop, std::move(op.done), result);
+    std::lock_guard<std::mutex> lock(mutex_);
+    --running_;
+  }
+}
+
+}  // namespace nvr
@@ -0,0 +1,65 @@
+// IoBackend on a pool of threads running blocking pwrite()/pread().
+//
+// The fallback for kernels without io_uring. Reads have a queue of their
+// own that half the workers drain first, so replay is not stuck behind a
+// backlog of recording writes.
+
+#ifndef NVR_STORAGE_THREAD_POOL_IO_H
+#define NVR_STORAGE_THREAD_POOL_IO_H
+
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "storage/io_backend.h"
+
+namespace nvr {
+
+class ThreadPoolIoBackend : public IoBackend {
+ public:
+  explicit ThreadPoolIoBackend(int threads, std::string name = "nvr-disk");
+  ~ThreadPoolIoBackend() override;
+
+  ThreadPoolIoBackend(const ThreadPoolIoBackend&) = delete;
+  ThreadPoolIoBackend& operator=(const ThreadPoolIoBackend&) = delete;
+
+  const char* name() const override { return "threads"; }
+  int start() override;
+  void stop() override;
+
+  void write(int fd, const void* data, size_t size, uint64_t offset, EventLoop* loop,
+             Completion done) override;
+  void writeSync(int fd, const void* data, size_t size, uint64_t offset, EventLoop* loop,
+                 Completion done) override;
+  void read(int fd, void* data, size_t size, uint64_t offset, EventLoop* loop,
+            Completion done) override;
+  void sync(int fd, EventLoop* loop, Completion done) override;
+  void call(std::function<int64_t()> op, EventLoop* loop, Completion done) override;
+
+  size_t pending() const override;
+
+ private:
+  struct Op {
+    std::function<int64_t()> run;
+    EventLoop* loop;
+    Completion done;
+  };
+
+  void submit(Op op, bool read);
+  void threadMain(bool readsFirst);
+
+  const int threadCount_;
+  const std::string name_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<Op> reads_;
+  std::deque<Op> ops_;
+  size_t running_ = 0;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_THREAD_POOL_IO_H
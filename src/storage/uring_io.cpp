@@ -0,0 +1,523 @@
+#include "storage/uring_io.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/log.h"
+
+namespace nvr {
+
+namespace {
+
+// Set in the user_data of a linked sync's completion; ops are at least
+// 8-byte aligned.
+constexpr uint64_t kSyncTag = 1;
+// The kernel's limits on a registered buffer and on one read or write.
+constexpr size_t kMaxFixedBuffer = 1ull << 30;
+constexpr size_t kMaxTransfer = 0x7ffff000;
+constexpr unsigned kMaxBufferSlots = 1 << 14;
+
+int uringSetup(unsigned entries, io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+int uringRegister(int fd, unsigned opcode, const void* arg, unsigned args) {
+  return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, args));
+}
+
+unsigned loadAcquire(const unsigned* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+void storeRelease(unsigned* p, unsigned value) { __atomic_store_n(p, value, __ATOMIC_RELEASE); }
+
+template <typename T>
+T* ringField(void* map, uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<uint8_t*>(map) + offset);
+}
+
+}  // namespace
+
+bool UringIoBackend::supported() {
+  static const bool result = [] {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = uringSetup(4, &params);
+    if (fd < 0) return false;
+    constexpr unsigned kProbeOps = 256;
+    std::vector<uint8_t> buffer(sizeof(io_uring_probe) + kProbeOps * sizeof(io_uring_probe_op));
+    auto* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+    bool ok = uringRegister(fd, IORING_REGISTER_PROBE, probe, kProbeOps) == 0;
+    for (int op : {IORING_OP_NOP, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED,
+                   IORING_OP_WRITE_FIXED, IORING_OP_FSYNC})
+      ok = ok && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    ::close(fd);
+    return ok;
+  }();
+  return result;
+}
+
+UringIoBackend::UringIoBackend(const IoBackendOptions& options)
+    : options_(options), calls_(2, "nvr-io-call") {}
+
+UringIoBackend::~UringIoBackend() { stop(); }
+
+int UringIoBackend::start() {
+  if (ringFd_ >= 0) return 0;
+  int rc = setupRing();
+  if (rc < 0) {
+    NVR_ERROR("io_uring: setup failed: %s", strerror(-rc));
+    return rc;
+  }
+  registerTables();
+  stopping_ = false;
+  calls_.start();
+  reaper_ = std::thread([this] { reaperMain(); });
+  pthread_setname_np(reaper_.native_handle(), "nvr-uring");
+  NVR_INFO("io_uring: %u entries, registered files %s, registered buffers %s", sqEntries_,
+           filesRegistered_ ? "on" : "off", buffersRegistered_ ? "on" : "off");
+  return 0;
+}
+
+void UringIoBackend::stop() {
+  if (!reaper_.joinable()) return;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return ops_ == 0; });
+    stopping_ = true;
+    // Nothing is in flight, so there is room for the NOP the reaper exits on.
+    unsigned tail = *sqTail_;
+    io_uring_sqe* sqe = &sqes_[tail & sqMask_];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_NOP;
+    sqArray_[tail & sqMask_] = tail & sqMask_;
+    storeRelease(sqTail_, tail + 1);
+    ++toSubmit_;
+    ++inFlight_;
+    enterLocked();
+  }
+  reaper_.join();
+  calls_.stop();
+  teardownRing();
+}
+
+int UringIoBackend::setupRing() {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // Twice as many completions as submissions, as the kernel defaults to;
+  // prepareLocked() keeps what is in flight within it.
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = std::max(options_.queueDepth, 4u) * 2;
+  int fd = uringSetup(std::max(options_.queueDepth, 4u), &params);
+  if (fd < 0) return -errno;
+  ringFd_ = fd;
+
+  sqMapSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqMapSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) sqMapSize_ = cqMapSize_ = std::max(sqMapSize_, cqMapSize_);
+  sqMap_ = mmap(nullptr, sqMapSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                IORING_OFF_SQ_RING);
+  if (sqMap_ == MAP_FAILED) {
+    sqMap_ = nullptr;
+    int rc = -errno;
+    teardownRing();
+    return rc;
+  }
+  cqMap_ = single ? sqMap_
+                  : mmap(nullptr, cqMapSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_CQ_RING);
+  sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQES);
+  if (cqMap_ == MAP_FAILED || sqes == MAP_FAILED) {
+    int rc = -errno;
+    if (cqMap_ == MAP_FAILED) cqMap_ = nullptr;
+    if (sqes != MAP_FAILED) sqes_ = static_cast<io_uring_sqe*>(sqes);
+    teardownRing();
+    return rc;
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  sqHead_ = ringField<unsigned>(sqMap_, params.sq_off.head);
+  sqTail_ = ringField<unsigned>(sqMap_, params.sq_off.tail);
+  sqArray_ = ringField<unsigned>(sqMap_, params.sq_off.array);
+  sqMask_ = *ringField<unsigned>(sqMap_, params.sq_off.ring_mask);
+  sqEntries_ = params.sq_entries;
+  cqHead_ = ringField<unsigned>(cqMap_, params.cq_off.head);
+  cqTail_ = ringField<unsigned>(cqMap_, params.cq_off.tail);
+  cqes_ = ringField<io_uring_cqe>(cqMap_, params.cq_off.cqes);
+  cqMask_ = *ringField<unsigned>(cqMap_, params.cq_off.ring_mask);
+  cqEntries_ = params.cq_entries;
+  return 0;
+}
+
+void UringIoBackend::teardownRing() {
+  if (sqes_) munmap(sqes_, sqesSize_);
+  if (cqMap_ && cqMap_ != sqMap_) munmap(cqMap_, cqMapSize_);
+  if (sqMap_) munmap(sqMap_, sqMapSize_);
+  if (ringFd_ >= 0) ::close(ringFd_);
+  sqes_ = nullptr;
+  cqMap_ = nullptr;
+  sqMap_ = nullptr;
+  ringFd_ = -1;
+  toSubmit_ = 0;
+  inFlight_ = 0;
+  writesInFlight_ = 0;
+  filesRegistered_ = false;
+  files_.clear();
+  freeFileSlots_.clear();
+  buffersRegistered_ = false;
+  buffers_.clear();
+  freeBufferSlots_.clear();
+  registeredBytes_ = 0;
+}
+
+void UringIoBackend::registerTables() {
+  // Sparse tables (5.19+) start empty and are filled one slot at a time.
+  unsigned files = options_.maxFiles;
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < files)
+    files = static_cast<unsigned>(limit.rlim_cur);
+  io_uring_rsrc_register table;
+  memset(&table, 0, sizeof(table));
+  table.nr = files;
+  table.flags = IORING_RSRC_REGISTER_SPARSE;
+  if (files > 0 && uringRegister(ringFd_, IORING_REGISTER_FILES2, &table, sizeof(table)) == 0) {
+    filesRegistered_ = true;
+    for (unsigned slot = files; slot > 0; --slot) freeFileSlots_.push_back(slot - 1);
+  } else {
+    NVR_DEBUG("io_uring: no registered files: %s", strerror(errno));
+  }
+
+  unsigned buffers = std::min(options_.maxBuffers, kMaxBufferSlots);
+  table.nr = buffers;
+  if (buffers > 0 && options_.maxRegisteredBytes > 0 &&
+      uringRegister(ringFd_, IORING_REGISTER_BUFFERS2, &table, sizeof(table)) == 0) {
+    buffersRegistered_ = true;
+    for (unsigned slot = buffers; slot > 0; --slot) freeBufferSlots_.push_back(slot - 1);
+  } else {
+    NVR_DEBUG("io_uring: no registered buffers: %s", strerror(errno));
+  }
+}
+
+void UringIoBackend::write(int fd, const void* data, size_t size, uint64_t offset,
+                           EventLoop* loop, Completion done) {
+  submit(new Op{IORING_OP_WRITE, fd, static_cast<uint8_t*>(const_cast<void*>(data)), size,
+                offset, false, 0, 0, 0, 0, false, loop, std::move(done)});
+}
+
+void UringIoBackend::writeSync(int fd, const void* data, size_t size, uint64_t offset,
+                               EventLoop* loop, Completion done) {
+  submit(new Op{IORING_OP_WRITE, fd, static_cast<uint8_t*>(const_cast<void*>(data)), size,
+                offset, true, 0, 0, 0, 0, false, loop, std::move(done)});
+}
+
+void UringIoBackend::read(int fd, void* data, size_t size, uint64_t offset, EventLoop* loop,
+                          Completion done) {
+  submit(new Op{IORING_OP_READ, fd, static_cast<uint8_t*>(data), size, offset, false, 0, 0, 0,
+                0, false, loop, std::move(done)});
+}
+
+void UringIoBackend::sync(int fd, EventLoop* loop, Completion done) {
+  submit(new Op{IORING_OP_FSYNC, fd, nullptr, 0, 0, false, 0, 0, 0, 0, false, loop,
+                std::move(done)});
+}
+
+void UringIoBackend::call(std::function<int64_t()> op, EventLoop* loop, Completion done) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++ops_;
+  }
+  countOp(false);
+  calls_.call(std::move(op), nullptr, [this, loop, done](int64_t result) {
+    complete(loop, done, result);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--ops_ == 0) idle_.notify_all();
+  });
+}
+
+size_t UringIoBackend::pending() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return ops_;
+}
+
+void UringIoBackend::submit(Op* op) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ringFd_ >= 0 && !stopping_) {
+      ++ops_;
+      (op->opcode == IORING_OP_READ ? reads_ : writes_).push_back(op);
+      drainLocked();
+      enterLocked();
+      return;
+    }
+  }
+  complete(op->loop, std::move(op->done), -ESHUTDOWN);
+  delete op;
+}
+
+bool UringIoBackend::prepareLocked(Op* op) {
+  unsigned entries = op->syncAfter ? 2 : 1;
+  unsigned tail = *sqTail_;
+  if (inFlight_ + entries > cqEntries_ || tail - loadAcquire(sqHead_) + entries > sqEntries_)
+    return false;
+
+  int fileSlot = fileSlotLocked(op->fd);
+  uint8_t* data = op->data + op->transferred;
+  size_t size = std::min(op->size - op->transferred, kMaxTransfer);
+  int bufferSlot = op->opcode == IORING_OP_FSYNC ? -1 : bufferSlotLocked(data, size);
+  if (!op->admitted) {
+    op->admitted = true;
+    if (op->opcode != IORING_OP_READ) ++writesInFlight_;
+    bool fixed = fileSlot >= 0 && bufferSlot >= 0;
+    if (op->opcode == IORING_OP_WRITE) countWrite(op->fd, op->offset, op->size, fixed);
+    if (op->opcode == IORING_OP_READ) countRead(op->size, fixed);
+    if (op->opcode == IORING_OP_FSYNC || op->syncAfter) countOp(true);
+  }
+
+  for (unsigned i = 0; i < entries; ++i) {
+    io_uring_sqe* sqe = &sqes_[(tail + i) & sqMask_];
+    memset(sqe, 0, sizeof(*sqe));
+    bool sync = i > 0 || op->opcode == IORING_OP_FSYNC;
+    if (fileSlot >= 0) {
+      sqe->fd = fileSlot;
+      sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+      sqe->fd = op->fd;
+    }
+    if (sync) {
+      sqe->opcode = IORING_OP_FSYNC;
+      sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    } else {
+      sqe->opcode = op->opcode;
+      if (bufferSlot >= 0) {
+        sqe->opcode = op->opcode == IORING_OP_WRITE ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = static_cast<uint16_t>(bufferSlot);
+      }
+      sqe->addr = reinterpret_cast<uintptr_t>(data);
+      sqe->len = static_cast<uint32_t>(size);
+      sqe->off = op->offset + op->transferred;
+      if (op->syncAfter) sqe->flags |= IOSQE_IO_LINK;
+    }
+    sqe->user_data = reinterpret_cast<uintptr_t>(op) | (i > 0 ? kSyncTag : 0);
+    sqArray_[(tail + i) & sqMask_] = (tail + i) & sqMask_;
+  }
+  storeRelease(sqTail_, tail + entries);
+  op->cqes = static_cast<int>(entries);
+  op->rwResult = 0;
+  op->syncResult = 0;
+  toSubmit_ += entries;
+  inFlight_ += entries;
+  return true;
+}
+
+void UringIoBackend::drainLocked() {
+  while (!reads_.empty() && prepareLocked(reads_.front())) reads_.pop_front();
+  while (!writes_.empty()) {
+    Op* op = writes_.front();
+    if (!op->admitted && writesInFlight_ >= std::max(options_.maxWritesInFlight, 1u)) break;
+    if (!prepareLocked(op)) break;
+    writes_.pop_front();
+  }
+}
+
+void UringIoBackend::enterLocked() {
+  while (toSubmit_ > 0) {
+    int n = uringEnter(ringFd_, toSubmit_, 0, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      // The entries stay in the ring and go down with the next submission
+      // or completion.
+      NVR_WARN("io_uring: submit failed: %s", n < 0 ? strerror(errno) : "nothing consumed");
+      return;
+    }
+    toSubmit_ -= std::min(static_cast<unsigned>(n), toSubmit_);
+  }
+}
+
+void UringIoBackend::reaperMain() {
+  std::vector<Op*> done;
+  std::vector<Op*> resubmit;
+  std::vector<std::pair<Op*, int64_t>> finished;
+  for (;;) {
+    int rc = uringEnter(ringFd_, 0, 1, IORING_ENTER_GETEVENTS);
+    if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      NVR_ERROR("io_uring: wait failed: %s", strerror(errno));
+
+    bool quit = false;
+    unsigned reaped = 0;
+    unsigned head = *cqHead_;
+    unsigned tail = loadAcquire(cqTail_);
+    for (; head != tail; ++head) {
+      const io_uring_cqe& cqe = cqes_[head & cqMask_];
+      ++reaped;
+      if (cqe.user_data == 0) {
+        quit = true;
+        continue;
+      }
+      Op* op = reinterpret_cast<Op*>(cqe.user_data & ~kSyncTag);
+      (cqe.user_data & kSyncTag ? op->syncResult : op->rwResult) = cqe.res;
+      if (--op->cqes == 0) done.push_back(op);
+    }
+    storeRelease(cqHead_, head);
+
+    for (Op* op : done) {
+      int64_t result;
+      if (retire(op, &result)) {
+        finished.emplace_back(op, result);
+      } else {
+        resubmit.push_back(op);
+      }
+    }
+    done.clear();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      inFlight_ -= reaped;
+      for (auto& f : finished)
+        if (f.first->opcode != IORING_OP_READ) --writesInFlight_;
+      // Resubmissions keep their place ahead of anything new.
+      for (auto it = resubmit.rbegin(); it != resubmit.rend(); ++it)
+        ((*it)->opcode == IORING_OP_READ ? reads_ : writes_).push_front(*it);
+      drainLocked();
+      enterLocked();
+    }
+    resubmit.clear();
+    for (auto& f : finished) finish(f.first, f.second);
+    finished.clear();
+    if (quit) return;
+  }
+}
+
+bool UringIoBackend::retire(Op* op, int64_t* result) {
+  int32_t res = op->rwResult;
+  if (res == -EAGAIN || res == -EINTR) return false;
+  if (res < 0 || op->opcode == IORING_OP_FSYNC) {
+    *result = res;
+    return true;
+  }
+  op->transferred += static_cast<size_t>(res);
+  if (op->transferred < op->size) {
+    if (res > 0) return false;
+    // End of file; a write that makes no progress is an error.
+    *result = op->opcode == IORING_OP_READ ? static_cast<int64_t>(op->transferred) : -EIO;
+    return true;
+  }
+  // A sync linked to a failed or short write is cancelled; the write's
+  // error (or its resubmission) supersedes it.
+  *result = op->syncAfter && op->syncResult < 0 ? op->syncResult
+                                                : static_cast<int64_t>(op->transferred);
+  return true;
+}
+
+void UringIoBackend::finish(Op* op, int64_t result) {
+  complete(op->loop, std::move(op->done), result);
+  delete op;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--ops_ == 0) idle_.notify_all();
+}
+
+void UringIoBackend::registerFile(int fd) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!filesRegistered_ || freeFileSlots_.empty() || files_.count(fd)) return;
+  unsigned slot = freeFileSlots_.back();
+  int32_t value = fd;
+  io_uring_rsrc_update2 update;
+  memset(&update, 0, sizeof(update));
+  update.offset = slot;
+  update.data = reinterpret_cast<uintptr_t>(&value);
+  update.nr = 1;
+  if (uringRegister(ringFd_, IORING_REGISTER_FILES_UPDATE2, &update, sizeof(update)) < 0) {
+    NVR_DEBUG("io_uring: cannot register fd %d: %s", fd, strerror(errno));
+    return;
+  }
+  freeFileSlots_.pop_back();
+  files_[fd] = slot;
+}
+
+void UringIoBackend::unregisterFile(int fd) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = files_.find(fd);
+  if (it == files_.end()) return;
+  int32_t value = -1;
+  io_uring_rsrc_update2 update;
+  memset(&update, 0, sizeof(update));
+  update.offset = it->second;
+  update.data = reinterpret_cast<uintptr_t>(&value);
+  update.nr = 1;
+  if (uringRegister(ringFd_, IORING_REGISTER_FILES_UPDATE2, &update, sizeof(update)) < 0) {
+    // The slot keeps its reference to the file; leave it out of use.
+    NVR_WARN("io_uring: cannot unregister fd %d: %s", fd, strerror(errno));
+  } else {
+    freeFileSlots_.push_back(it->second);
+  }
+  files_.erase(it);
+}
+
+void UringIoBackend::registerBuffer(const void* data, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uintptr_t address = reinterpret_cast<uintptr_t>(data);
+  if (!buffersRegistered_ || freeBufferSlots_.empty() || size == 0 || size > kMaxFixedBuffer ||
+      registeredBytes_ + size > options_.maxRegisteredBytes || buffers_.count(address))
+    return;
+  unsigned slot = freeBufferSlots_.back();
+  iovec iov = {const_cast<void*>(data), size};
+  io_uring_rsrc_update2 update;
+  memset(&update, 0, sizeof(update));
+  update.offset = slot;
+  update.data = reinterpret_cast<uintptr_t>(&iov);
+  update.nr = 1;
+  if (uringRegister(ringFd_, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) < 0) {
+    NVR_DEBUG("io_uring: cannot register a %zu byte buffer: %s", size, strerror(errno));
+    return;
+  }
+  freeBufferSlots_.pop_back();
+  buffers_[address] = Buffer{size, slot};
+  registeredBytes_ += size;
+}
+
+void UringIoBackend::unregisterBuffer(const void* data) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = buffers_.find(reinterpret_cast<uintptr_t>(data));
+  if (it == buffers_.end()) return;
+  iovec iov = {nullptr, 0};
+  io_uring_rsrc_update2 update;
+  memset(&update, 0, sizeof(update));
+  update.offset = it->second.slot;
+  update.data = reinterpret_cast<uintptr_t>(&iov);
+  update.nr = 1;
+  if (uringRegister(ringFd_, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) < 0) {
+    NVR_WARN("io_uring: cannot unregister a buffer: %s", strerror(errno));
+  } else {
+    freeBufferSlots_.push_back(it->second.slot);
+    registeredBytes_ -= it->second.size;
+  }
+  buffers_.erase(it);
+}
+
+int UringIoBackend::fileSlotLocked(int fd) const {
+  auto it = files_.find(fd);
+  return it == files_.end() ? -1 : static_cast<int>(it->second);
+}
+
+int UringIoBackend::bufferSlotLocked(const void* data, size_t size) const {
+  uintptr_t address = reinterpret_cast<uintptr_t>(data);
+  auto it = buffers_.upper_bound(address);
+  if (it == buffers_.begin()) return -1;
+  --it;
+  if (address + size > it->first + it->second.size) return -1;
+  return static_cast<int>(it->second.slot);
+}
+
+}  // namespace nvr
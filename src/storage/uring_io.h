@@ -0,0 +1,151 @@
+// IoBackend on io_uring, through the raw system calls.
+//
+// Callers fill submission queue entries under a mutex and submit them
+// from their own thread; one reaper thread waits for completions and
+// posts them to the callers' loops. Operations that do not fit in the
+// ring (the completion queue is sized to never overflow) wait in a backlog
+// the reaper drains as completions free room. Reads and writes wait apart:
+// reads go first, and only maxWritesInFlight writes and syncs are in the
+// ring at once, so a burst of chunk flushes does not sit in the device
+// queue ahead of a replay read.
+//
+// Files and buffers are registered into sparse tables (one slot each,
+// updated in place), so registering a segment or a chunk buffer does not
+// quiesce the ring. A write on a registered file from a registered buffer
+// goes down as WRITE_FIXED with IOSQE_FIXED_FILE; writeSync() links it to
+// an FSYNC(DATASYNC) with IOSQE_IO_LINK. Short transfers and EAGAIN are
+// resubmitted for the remainder. call() has no io_uring equivalent for
+// most of what it runs (fallocate with fallback, atomic file replace) and
+// goes to a small thread pool.
+
+#ifndef NVR_STORAGE_URING_IO_H
+#define NVR_STORAGE_URING_IO_H
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "storage/io_backend.h"
+#include "storage/thread_pool_io.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace nvr {
+
+class UringIoBackend : public IoBackend {
+ public:
+  explicit UringIoBackend(const IoBackendOptions& options);
+  ~UringIoBackend() override;
+
+  UringIoBackend(const UringIoBackend&) = delete;
+  UringIoBackend& operator=(const UringIoBackend&) = delete;
+
+  // Whether the kernel has io_uring with the operations used here.
+  static bool supported();
+
+  const char* name() const override { return "uring"; }
+  int start() override;
+  void stop() override;
+
+  void write(int fd, const void* data, size_t size, uint64_t offset, EventLoop* loop,
+             Completion done) override;
+  void writeSync(int fd, const void* data, size_t size, uint64_t offset, EventLoop* loop,
+                 Completion done) override;
+  void read(int fd, void* data, size_t size, uint64_t offset, EventLoop* loop,
+            Completion done) override;
+  void sync(int fd, EventLoop* loop, Completion done) override;
+  void call(std::function<int64_t()> op, EventLoop* loop, Completion done) override;
+
+  void registerFile(int fd) override;
+  void unregisterFile(int fd) override;
+  void registerBuffer(const void* data, size_t size) override;
+  void unregisterBuffer(const void* data) override;
+
+  size_t pending() const override;
+
+ private:
+  struct Op {
+    uint8_t opcode;  // IORING_OP_WRITE, READ or FSYNC
+    int fd;
+    uint8_t* data;
+    size_t size;
+    uint64_t offset;
+    bool syncAfter;
+    size_t transferred;
+    int cqes;  // outstanding for the current submission
+    int32_t rwResult;
+    int32_t syncResult;
+    bool admitted;  // prepared once: counted, and held a write slot
+    EventLoop* loop;
+    Completion done;
+  };
+  struct Buffer {
+    size_t size;
+    unsigned slot;
+  };
+
+  int setupRing();
+  void teardownRing();
+  void registerTables();
+  void submit(Op* op);
+  // Fills the op's entries; false if the ring has no room for them.
+  bool prepareLocked(Op* op);
+  // Moves waiting ops into the ring, reads first.
+  void drainLocked();
+  void enterLocked();
+  void reaperMain();
+  // All of an op's entries for one submission completed: true and the
+  // op's result, or false if the rest has to be resubmitted.
+  bool retire(Op* op, int64_t* result);
+  void finish(Op* op, int64_t result);
+  int fileSlotLocked(int fd) const;
+  int bufferSlotLocked(const void* data, size_t size) const;
+
+  const IoBackendOptions options_;
+  int ringFd_ = -1;
+  void* sqMap_ = nullptr;
+  size_t sqMapSize_ = 0;
+  void* cqMap_ = nullptr;
+  size_t cqMapSize_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqesSize_ = 0;
+  unsigned* sqHead_ = nullptr;
+  unsigned* sqTail_ = nullptr;
+  unsigned* sqArray_ = nullptr;
+  unsigned sqMask_ = 0;
+  unsigned sqEntries_ = 0;
+  unsigned* cqHead_ = nullptr;
+  unsigned* cqTail_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+  unsigned cqMask_ = 0;
+  unsigned cqEntries_ = 0;
+
+  mutable std::mutex mutex_;
+  std::condition_variable idle_;
+  std::deque<Op*> reads_;
+  std::deque<Op*> writes_;
+  unsigned writesInFlight_ = 0;
+  unsigned toSubmit_ = 0;     // entries filled, not yet passed to the kernel
+  unsigned inFlight_ = 0;     // entries submitted, completions outstanding
+  size_t ops_ = 0;            // ops not yet finished
+  bool stopping_ = false;
+  std::thread reaper_;
+
+  bool filesRegistered_ = false;
+  std::unordered_map<int, unsigned> files_;
+  std::vector<unsigned> freeFileSlots_;
+  bool buffersRegistered_ = false;
+  std::map<uintptr_t, Buffer> buffers_;
+  std::vector<unsigned> freeBufferSlots_;
+  size_t registeredBytes_ = 0;
+
+  ThreadPoolIoBackend calls_;
+};
+
+}  // namespace nvr
+
+#endif  // NVR_STORAGE_URING_IO_H
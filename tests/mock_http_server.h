@@ -0,0 +1,156 @@
+// Loopback HTTP server that plays a device in the unit tests.
+//
+// Listens on 127.0.0.1 with an ephemeral port, on the test's own loop.
+// Every request is recorded and handed to the handler, which returns the
+// whole response (see buildHttpResponse). Connections are kept alive
+// unless the request or the response says otherwise. runLoop() drives the
+// loop for a test case.
+
+#ifndef NVR_TESTS_MOCK_HTTP_SERVER_H
+#define NVR_TESTS_MOCK_HTTP_SERVER_H
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/event_loop.h"
+#include "base/socket_util.h"
+#include "http/http_message.h"
+
+namespace nvr {
+namespace test {
+
+class MockHttpServer : public EventHandler {
+ public:
+  using Handler = std::function<std::string(const HttpRequest& request)>;
+
+  MockHttpServer(EventLoop* loop, Handler handler)
+      : loop_(loop), handler_(std::move(handler)) {
+    SocketAddress any;
+    resolveAddress("127.0.0.1", 0, &any);
+    fd_ = tcpListen(any);
+    if (fd_ < 0) return;
+    localAddress(fd_, &address_);
+    loop_->add(fd_, EPOLLIN, this);
+  }
+
+  ~MockHttpServer() override {
+    for (Connection* conn : connections_) delete conn;
+    if (fd_ >= 0) {
+      loop_->remove(fd_);
+      ::close(fd_);
+    }
+  }
+
+  MockHttpServer(const MockHttpServer&) = delete;
+  MockHttpServer& operator=(const MockHttpServer&) = delete;
+
+  bool valid() const { return fd_ >= 0; }
+  const SocketAddress& address() const { return address_; }
+  uint16_t port() const { return address_.port(); }
+  std::string url(const std::string& path, const std::string& userInfo = "") const {
+    return "http://" + (userInfo.empty() ? "" : userInfo + "@") + "127.0.0.1:" +
+           std::to_string(port()) + path;
+  }
+
+  const std::vector<HttpRequest>& requests() const { return requests_; }
+  size_t accepted() const { return accepted_; }
+
+  void onEvents(uint32_t) override {
+    for (;;) {
+      int fd = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) return;
+      ++accepted_;
+      auto* conn = new Connection(this, fd);
+      connections_.push_back(conn);
+      loop_->add(fd, EPOLLIN, conn);
+    }
+  }
+
+ private:
+  class Connection : public EventHandler {
+   public:
+    Connection(MockHttpServer* server, int fd) : server_(server), fd_(fd) {}
+    ~Connection() override { close(); }
+
+    void onEvents(uint32_t events) override {
+      if (fd_ < 0) return;
+      for (;;) {
+        ssize_t n = input_.readFd(fd_);
+        if (n == -EAGAIN) break;
+        if (n <= 0) {
+          close();
+          return;
+        }
+      }
+      for (;;) {
+        HttpRequest request;
+        int used = parseHttpRequest(reinterpret_cast<const char*>(input_.data()),
+                                    input_.size(), &request);
+        if (used < 0) {
+          close();
+          return;
+        }
+        if (used == 0) return;
+        input_.consume(static_cast<size_t>(used));
+        server_->requests_.push_back(request);
+        std::string response = server_->handler_(request);
+        // Small responses on loopback: one blocking-free write does it.
+        size_t off = 0;
+        while (off < response.size()) {
+          ssize_t n = ::write(fd_, response.data() + off, response.size() - off);
+          if (n <= 0) break;
+          off += static_cast<size_t>(n);
+        }
+        if (!request.keepAlive || response.find("Connection: close") != std::string::npos) {
+          close();
+          return;
+        }
+      }
+    }
+
+   private:
+    void close() {
+      if (fd_ < 0) return;
+      server_->loop_->remove(fd_);
+      ::close(fd_);
+      fd_ = -1;
+    }
+
+    MockHttpServer* server_;
+    int fd_;
+    ByteBuffer input_;
+  };
+
+  EventLoop* loop_;
+  Handler handler_;
+  int fd_ = -1;
+  SocketAddress address_;
+  std::vector<Connection*> connections_;
+  std::vector<HttpRequest> requests_;
+  size_t accepted_ = 0;
+};
+
+// Runs the loop until something calls quit(), or for at most timeoutMs.
+// False on the timeout. quit() is final, so a loop runs once.
+inline bool runLoop(EventLoop* loop, uint64_t timeoutMs = 5000) {
+  bool timedOut = false;
+  EventLoop::TimerId timer = loop->runAfter(timeoutMs, [loop, &timedOut] {
+    timedOut = true;
+    loop->quit();
+  });
+  loop->run();
+  if (!timedOut) loop->cancel(timer);
+  return !timedOut;
+}
+
+}  // namespace test
+}  // namespace nvr
+
+#endif  // NVR_TESTS_MOCK_HTTP_SERVER_H
@@ -0,0 +1,240 @@
+// ArchiveIndex over a live RecordingStore: refresh() follows the store's
+// generation as segments are sealed, and as retention deletes and rewrites
+// them under readers that already have them open.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "storage/archive_index.h"
+#include "storage/camera_reader.h"
+#include "storage/file_util.h"
+#include "storage/recording_store.h"
+#include "storage/retention_engine.h"
+#include "storage/segment_format.h"
+#include "storage/segment_index.h"
+#include "test_util.h"
+
+namespace {
+
+constexpr int64_t kSecondUs = 1000000;
+
+void removeTree(const std::string& dir) {
+  std::vector<std::string> groups;
+  nvr::listDirectory(dir, &groups);
+  for (const auto& group : groups) {
+    std::string groupDir = nvr::joinPath(dir, group);
+    std::vector<std::string> names;
+    nvr::listDirectory(groupDir, &names);
+    for (const auto& name : names) unlink(nvr::joinPath(groupDir, name).c_str());
+    rmdir(groupDir.c_str());
+  }
+  rmdir(dir.c_str());
+}
+
+class Fixture {
+ public:
+  Fixture() {
+    char dir[] = "/tmp/nvr_test_archive_XXXXXX";
+    dir_ = mkdtemp(dir) ? dir : "";
+    nvr::SegmentWriterOptions defaults;
+    defaults.dir = dir_;
+    store_.reset(new nvr::RecordingStore(defaults));
+    ok_ = !dir_.empty() && store_->start() == 0;
+  }
+
+  ~Fixture() {
+    if (ok_) store_->stop();
+    if (!dir_.empty()) removeTree(dir_);
+  }
+
+  bool ok() const { return ok_; }
+  const std::string& dir() const { return dir_; }
+  nvr::RecordingStore* store() { return store_.get(); }
+
+  // One sealed segment in group holding a keyframe of cameraId every
+  // second from fromS to toS.
+  void record(const std::string& group, const std::string& cameraId, int fromS, int toS) {
+    nvr::EventLoop loop;
+    std::unique_ptr<nvr::SegmentWriter> writer = store_->createWriter(&loop, group);
+    if (writer->open() < 0) return;
+    nvr::StreamInfo info;
+    info.cameraId = cameraId;
+    info.codec = "H264";
+    info.clockRate = 90000;
+    uint32_t stream = writer->addStream(info);
+    static const uint8_t kKey[] = {0, 0, 0, 1, 0x65, 0x88, 0x84, 0x21};
+    for (int s = fromS; s <= toS; ++s)
+      writer->append(stream, nvr::RecordType::Video, nvr::kRecordKeyframe, s * kSecondUs, kKey,
+                     sizeof(kKey));
+    writer->close([&loop] { loop.quit(); });
+    loop.run();
+  }
+
+ private:
+  std::string dir_;
+  std::unique_ptr<nvr::RecordingStore> store_;
+  bool ok_ = false;
+};
+
+void testRefreshFollowsSealedSegments() {
+  Fixture fixture;
+  CHECK(fixture.ok());
+  if (!fixture.ok()) return;
+  nvr::ArchiveIndex archive(fixture.dir());
+  CHECK_EQ(archive.refresh(fixture.store()->generation()), 1);
+  CHECK_EQ(archive.segments(), size_t(0));
+  CHECK_EQ(archive.refresh(fixture.store()->generation()), 0);
+  nvr::ArchiveSeekResult where;
+  CHECK(!archive.seek("cam", 5 * kSecondUs, &where));
+
+  uint64_t generation = fixture.store()->generation();
+  fixture.record("a", "cam", 1, 10);
+  CHECK_GT(fixture.store()->generation(), generation);
+  CHECK_EQ(archive.refresh(fixture.store()->generation()), 1);
+  CHECK_EQ(archive.segments(), size_t(1));
+  CHECK(archive.seek("cam", 5 * kSecondUs, &where));
+  CHECK_EQ(where.keyframe.timestampUs, 5 * kSecondUs);
+  std::string first = where.path;
+  // The end of the archive, until the next segment is sealed.
+  CHECK(!archive.seekAfter("cam", 10 * kSecondUs, &where));
+
+  fixture.record("b", "cam", 20, 25);
+  CHECK_EQ(archive.refresh(fixture.store()->generation()), 1);
+  CHECK_EQ(archive.segments(), size_t(2));
+  CHECK(archive.seekAfter("cam", 10 * kSecondUs, &where));
+  CHECK_EQ(where.keyframe.timestampUs, 20 * kSecondUs);
+  // The first segment's index was kept as it was.
+  CHECK(archive.seek("cam", 3 * kSecondUs, &where));
+  CHECK_EQ(where.path, first);
+  CHECK_EQ(where.keyframe.timestampUs, 3 * kSecondUs);
+}
+
+void testReloadDropsRemovedSegments() {
+  Fixture fixture;
+  CHECK(fixture.ok());
+  if (!fixture.ok()) return;
+  fixture.record("a", "cam", 1, 10);
+  fixture.record("b", "cam", 20, 25);
+  nvr::ArchiveIndex archive(fixture.dir());
+  CHECK_EQ(archive.load(), 2);
+  nvr::ArchiveSeekResult where;
+  CHECK(archive.seek("cam", 5 * kSecondUs, &where));
+  unlink(nvr::segmentIndexPath(where.path).c_str());
+  unlink(where.path.c_str());
+  CHECK_EQ(archive.load(), 1);
+  // Before the archive now: its first keyframe.
+  CHECK(archive.seek("cam", 5 * kSecondUs, &where));
+  CHECK_EQ(where.keyframe.timestampUs, 20 * kSecondUs);
+  CHECK(!archive.seekBefore("cam", 20 * kSecondUs, &where));
+}
+
+// A pass of the store's retention engine on the calling thread.
+nvr::RetentionEngine::Stats retain(Fixture* fixture, const std::string& policy) {
+  nvr::RetentionOptions options;
+  options.dir = fixture->dir();
+  nvr::parseRetentionPolicy(policy, &options.defaults);
+  options.maxBytesPerSecond = 0;
+  options.idlePriority = false;
+  nvr::RecordingStore* store = fixture->store();
+  options.changed = [store] { store->bumpGeneration(); };
+  nvr::RetentionEngine engine(options);
+  CHECK_EQ(engine.pass(), 0);
+  return engine.stats();
+}
+
+// Timestamps of the keyframes left to read.
+std::vector<int64_t> readAll(nvr::CameraReader* reader) {
+  std::vector<int64_t> out;
+  nvr::SegmentReader::Record record;
+  while (reader->next(&record))
+    if (record.header.type == static_cast<uint8_t>(nvr::RecordType::Video))
+      out.push_back(record.header.timestampUs / kSecondUs);
+  return out;
+}
+
+void testRetentionDeleteHandsOver() {
+  Fixture fixture;
+  CHECK(fixture.ok());
+  if (!fixture.ok()) return;
+  // Recorded in 1970: long expired, but for the group's newest segment.
+  fixture.record("a", "cam", 1, 10);
+  fixture.record("a", "cam", 20, 25);
+  nvr::ArchiveIndex archive(fixture.dir());
+  CHECK_EQ(archive.refresh(fixture.store()->generation()), 1);
+  CHECK_EQ(archive.segments(), size_t(2));
+  nvr::ArchiveSeekResult where;
+  CHECK(archive.seek("cam", 5 * kSecondUs, &where));
+  nvr::CameraReader reader;
+  CHECK_EQ(reader.open(where.path, "cam"), 0);
+  CHECK(reader.seek(5 * kSecondUs));
+
+  uint64_t generation = fixture.store()->generation();
+  nvr::RetentionEngine::Stats stats = retain(&fixture, "keep=1d,events=1d");
+  CHECK_EQ(stats.deleted, uint64_t(1));
+  CHECK_GT(fixture.store()->generation(), generation);
+  // Gone for new readers once the index has loaded again.
+  CHECK_EQ(archive.refresh(fixture.store()->generation()), 1);
+  CHECK_EQ(archive.segments(), size_t(1));
+  CHECK(archive.seek("cam", 5 * kSecondUs, &where));
+  CHECK_EQ(where.keyframe.timestampUs, 20 * kSecondUs);
+  // The reader that had it open reads on.
+  std::vector<int64_t> expected = {5, 6, 7, 8, 9, 10};
+  CHECK(readAll(&reader) == expected);
+}
+
+void testRetentionRewriteHandsOver() {
+  Fixture fixture;
+  CHECK(fixture.ok());
+  if (!fixture.ok()) return;
+  fixture.record("a", "cam", 1, 10);
+  fixture.record("a", "cam", 20, 25);
+  nvr::ArchiveIndex archive(fixture.dir());
+  CHECK_EQ(archive.refresh(fixture.store()->generation()), 1);
+  nvr::ArchiveSeekResult where;
+  CHECK(archive.seek("cam", 3 * kSecondUs, &where));
+  std::string path = where.path;
+  nvr::CameraReader before;
+  CHECK_EQ(before.open(path, "cam"), 0);
+  CHECK(before.seek(3 * kSecondUs));
+
+  // Kept forever, reduced to keyframes: both re-packed in place.
+  uint64_t generation = fixture.store()->generation();
+  nvr::RetentionEngine::Stats stats = retain(&fixture, "keep=0,keyframes=1d");
+  CHECK_EQ(stats.rewritten, uint64_t(2));
+  CHECK_EQ(stats.deleted, uint64_t(0));
+  CHECK_GT(fixture.store()->generation(), generation);
+  CHECK_EQ(archive.refresh(fixture.store()->generation()), 1);
+  CHECK_EQ(archive.segments(), size_t(2));
+  CHECK(archive.seek("cam", 3 * kSecondUs, &where));
+  CHECK_EQ(where.path, path);
+  CHECK_EQ(where.keyframe.timestampUs, 3 * kSecondUs);
+
+  // The old file, through the descriptor opened before; the new one, with
+  // its own index, through a new one.
+  std::vector<int64_t> expected = {3, 4, 5, 6, 7, 8, 9, 10};
+  CHECK(readAll(&before) == expected);
+  nvr::CameraReader after;
+  CHECK_EQ(after.open(path, "cam"), 0);
+  CHECK(after.indexed());
+  CHECK(!nvr::isSameFile(before.fd(), path));
+  CHECK(nvr::isSameFile(after.fd(), path));
+  CHECK(after.seek(3 * kSecondUs));
+  CHECK(readAll(&after) == expected);
+}
+
+}  // namespace
+
+int main() {
+  nvr::test::quiet();
+  TEST_RUN(testRefreshFollowsSealedSegments);
+  TEST_RUN(testReloadDropsRemovedSegments);
+  TEST_RUN(testRetentionDeleteHandsOver);
+  TEST_RUN(testRetentionRewriteHandsOver);
+  return nvr::test::finish();
+}
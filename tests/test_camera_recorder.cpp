@@ -0,0 +1,174 @@
+// CameraRecorder in event-only mode: what a trigger writes from the
+// pre-event ring and from the live stream, around frames broken by loss.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/clock.h"
+#include "base/event_loop.h"
+#include "media/frame_assembler.h"
+#include "rtsp/sdp.h"
+#include "storage/camera_recorder.h"
+#include "storage/file_util.h"
+#include "storage/pre_event_buffer.h"
+#include "storage/recording_store.h"
+#include "test_util.h"
+
+namespace {
+
+constexpr uint32_t kFrameTicks = 3600;  // 25 fps at 90 kHz
+
+void removeRecordings(const std::string& dir) {
+  std::vector<std::string> groups;
+  nvr::listDirectory(dir, &groups);
+  for (const auto& group : groups) {
+    std::string groupDir = nvr::joinPath(dir, group);
+    std::vector<std::string> names;
+    nvr::listDirectory(groupDir, &names);
+    for (const auto& name : names) unlink(nvr::joinPath(groupDir, name).c_str());
+    rmdir(groupDir.c_str());
+  }
+  rmdir(dir.c_str());
+}
+
+// A recorder in event-only mode on a store of its own, fed frames
+// directly.
+class Fixture {
+ public:
+  Fixture() : arena_(1, 1 << 20) {
+    char dir[] = "/tmp/nvr_test_recorder_XXXXXX";
+    dir_ = mkdtemp(dir) ? dir : "";
+    nvr::SegmentWriterOptions defaults;
+    defaults.dir = dir_;
+    store_.reset(new nvr::RecordingStore(defaults));
+    ok_ = !dir_.empty() && store_->start() == 0;
+    if (!ok_) return;
+    writer_ = store_->createWriter(&loop_, "test");
+    ok_ = writer_->open() == 0;
+    nvr::SdpMedia media;
+    media.type = "video";
+    media.payloadType = 96;
+    media.encoding = "H264";
+    media.clockRate = 90000;
+    recorder_.reset(new nvr::CameraRecorder(writer_.get(), "cam", media));
+    recorder_->setEventOnly(arena_.acquire(10 * 1000000LL));
+  }
+
+  ~Fixture() {
+    recorder_.reset();
+    if (writer_) {
+      writer_->close([this] { loop_.quit(); });
+      loop_.run();
+      writer_.reset();
+    }
+    if (ok_) store_->stop();
+    if (!dir_.empty()) removeRecordings(dir_);
+  }
+
+  bool ok() const { return ok_; }
+  nvr::CameraRecorder* recorder() { return recorder_.get(); }
+
+  void frame(bool keyframe, bool corrupt = false) {
+    static const uint8_t kKey[] = {0, 0, 0, 1, 0x65, 0x88, 0x84, 0x21};
+    static const uint8_t kDelta[] = {0, 0, 0, 1, 0x41, 0x9a, 0x02, 0x03};
+    nvr::Frame f;
+    f.data = keyframe ? kKey : kDelta;
+    f.size = sizeof(kKey);
+    f.rtpTimestamp = rtp_;
+    f.keyframe = keyframe;
+    f.corrupt = corrupt;
+    rtp_ += kFrameTicks;
+    recorder_->onFrame(f);
+  }
+
+ private:
+  nvr::EventLoop loop_;
+  nvr::PreEventArena arena_;
+  std::string dir_;
+  std::unique_ptr<nvr::RecordingStore> store_;
+  std::unique_ptr<nvr::SegmentWriter> writer_;
+  std::unique_ptr<nvr::CameraRecorder> recorder_;
+  uint32_t rtp_ = 1000;
+  bool ok_ = false;
+};
+
+void testTriggerWritesPreRollThenLive() {
+  Fixture fixture;
+  CHECK(fixture.ok());
+  if (!fixture.ok()) return;
+  fixture.frame(true);
+  fixture.frame(false);
+  fixture.frame(false);
+  CHECK_EQ(fixture.recorder()->stats().frames, uint64_t(0));
+  fixture.recorder()->trigger(nvr::wallClockUs() + 60 * 1000000LL);
+  CHECK_EQ(fixture.recorder()->stats().preEventFrames, uint64_t(3));
+  // The live stream goes on from the pre-roll's GOP.
+  fixture.frame(false);
+  CHECK_EQ(fixture.recorder()->stats().frames, uint64_t(4));
+}
+
+void testCorruptFrameBeforeTrigger() {
+  Fixture fixture;
+  CHECK(fixture.ok());
+  if (!fixture.ok()) return;
+  fixture.frame(true);
+  fixture.frame(false);
+  fixture.frame(false, true);
+  // References the broken frame: not buffered.
+  fixture.frame(false);
+  CHECK_EQ(fixture.recorder()->preEventRing()->frames(), size_t(2));
+  fixture.recorder()->trigger(nvr::wallClockUs() + 60 * 1000000LL);
+  CHECK_EQ(fixture.recorder()->stats().preEventFrames, uint64_t(2));
+  // Still broken after the flush: the live stream waits for a keyframe.
+  fixture.frame(false);
+  CHECK_EQ(fixture.recorder()->stats().frames, uint64_t(2));
+  fixture.frame(true);
+  fixture.frame(false);
+  CHECK_EQ(fixture.recorder()->stats().frames, uint64_t(4));
+  CHECK_EQ(fixture.recorder()->stats().corrupt, uint64_t(1));
+}
+
+void testCorruptFrameThenKeyframeBeforeTrigger() {
+  Fixture fixture;
+  CHECK(fixture.ok());
+  if (!fixture.ok()) return;
+  fixture.frame(true);
+  fixture.frame(false, true);
+  fixture.frame(false);
+  fixture.frame(true);
+  fixture.frame(false);
+  // The first GOP up to the break, then the second whole.
+  CHECK_EQ(fixture.recorder()->preEventRing()->frames(), size_t(3));
+  fixture.recorder()->trigger(nvr::wallClockUs() + 60 * 1000000LL);
+  fixture.frame(false);
+  CHECK_EQ(fixture.recorder()->stats().frames, uint64_t(4));
+}
+
+void testTriggerWithEmptyRingWaitsForKeyframe() {
+  Fixture fixture;
+  CHECK(fixture.ok());
+  if (!fixture.ok()) return;
+  // Nothing buffered yet: the stream started mid-GOP.
+  fixture.frame(false);
+  fixture.recorder()->trigger(nvr::wallClockUs() + 60 * 1000000LL);
+  fixture.frame(false);
+  CHECK_EQ(fixture.recorder()->stats().frames, uint64_t(0));
+  fixture.frame(true);
+  CHECK_EQ(fixture.recorder()->stats().frames, uint64_t(1));
+}
+
+}  // namespace
+
+int main() {
+  nvr::test::quiet();
+  TEST_RUN(testTriggerWritesPreRollThenLive);
+  TEST_RUN(testCorruptFrameBeforeTrigger);
+  TEST_RUN(testCorruptFrameThenKeyframeBeforeTrigger);
+  TEST_RUN(testTriggerWithEmptyRingWaitsForKeyframe);
+  return nvr::test::finish();
+}
@@ -0,0 +1,133 @@
+// EventTrigger: which records start a recording, which extend or end it,
+// and how cameras that never report off run out.
+//
+// The engine has no cameras, so triggerRecording() goes nowhere; the
+// trigger's own counters say what it asked for.
+
+#include <stdint.h>
+
+#include "base/event_loop.h"
+#include "event/event_channel.h"
+#include "ingest/event_trigger.h"
+#include "ingest/ingest_engine.h"
+#include "test_util.h"
+
+namespace {
+
+nvr::EventRecord record(uint32_t camera, nvr::EventTopic topic, bool active,
+                        uint32_t source = 1, uint8_t flags = 0) {
+  nvr::EventRecord r;
+  r.camera = camera;
+  r.source = source;
+  r.topic = topic;
+  r.active = active ? 1 : 0;
+  r.flags = flags;
+  return r;
+}
+
+void testMotionStartsAndEnds() {
+  nvr::EventLoop loop;
+  nvr::IngestEngine ingest;
+  nvr::EventTrigger trigger(&loop, &ingest);
+  trigger.addCamera(7, "cam-7");
+  CHECK(trigger.onEvent(record(7, nvr::EventTopic::Motion, true)));
+  // Already recording: no second start.
+  CHECK(!trigger.onEvent(record(7, nvr::EventTopic::Motion, true)));
+  CHECK_EQ(trigger.stats().active, size_t(1));
+  // Off: the post-roll is set, once.
+  CHECK(!trigger.onEvent(record(7, nvr::EventTopic::Motion, false)));
+  CHECK(!trigger.onEvent(record(7, nvr::EventTopic::Motion, false)));
+  nvr::EventTrigger::Stats stats = trigger.stats();
+  CHECK_EQ(stats.events, uint64_t(4));
+  CHECK_EQ(stats.starts, uint64_t(1));
+  CHECK_EQ(stats.triggers, uint64_t(2));
+  CHECK_EQ(stats.active, size_t(0));
+  // And again.
+  CHECK(trigger.onEvent(record(7, nvr::EventTopic::Motion, true)));
+  CHECK_EQ(trigger.stats().starts, uint64_t(2));
+}
+
+void testRunsWhileAnySourceIsOn() {
+  nvr::EventLoop loop;
+  nvr::IngestEngine ingest;
+  nvr::EventTrigger trigger(&loop, &ingest);
+  trigger.addCamera(1, "cam-1");
+  CHECK(trigger.onEvent(record(1, nvr::EventTopic::Motion, true, 10)));
+  CHECK(!trigger.onEvent(record(1, nvr::EventTopic::DigitalInput, true, 20)));
+  CHECK(!trigger.onEvent(record(1, nvr::EventTopic::Motion, false, 10)));
+  CHECK_EQ(trigger.stats().active, size_t(1));
+  CHECK_EQ(trigger.stats().triggers, uint64_t(1));
+  CHECK(!trigger.onEvent(record(1, nvr::EventTopic::DigitalInput, false, 20)));
+  CHECK_EQ(trigger.stats().active, size_t(0));
+  CHECK_EQ(trigger.stats().triggers, uint64_t(2));
+}
+
+void testUnknownIgnoredAndInitial() {
+  nvr::EventLoop loop;
+  nvr::IngestEngine ingest;
+  nvr::EventTriggerOptions options;
+  options.topics = nvr::eventTopicBit(nvr::EventTopic::Motion);
+  nvr::EventTrigger trigger(&loop, &ingest, options);
+  trigger.addCamera(1, "cam-1");
+  CHECK(!trigger.onEvent(record(2, nvr::EventTopic::Motion, true)));
+  CHECK(!trigger.onEvent(record(1, nvr::EventTopic::DigitalInput, true)));
+  CHECK(!trigger.onEvent(record(1, nvr::EventTopic::VideoLoss, true)));
+  // The snapshot on subscribe: off is the state, not an end.
+  CHECK(!trigger.onEvent(record(1, nvr::EventTopic::Motion, false, 1,
+                                nvr::EventRecord::kInitial)));
+  nvr::EventTrigger::Stats stats = trigger.stats();
+  CHECK_EQ(stats.unknown, uint64_t(1));
+  CHECK_EQ(stats.ignored, uint64_t(2));
+  CHECK_EQ(stats.triggers, uint64_t(0));
+  // On in the snapshot starts a recording like any other on.
+  CHECK(trigger.onEvent(record(1, nvr::EventTopic::Motion, true, 1, nvr::EventRecord::kInitial)));
+  // A motion source on at subscribe, then off.
+  CHECK(!trigger.onEvent(record(1, nvr::EventTopic::Motion, false, 1,
+                                nvr::EventRecord::kInitial)));
+  CHECK_EQ(trigger.stats().triggers, uint64_t(1));
+}
+
+void testRemovedCameraIsUnknown() {
+  nvr::EventLoop loop;
+  nvr::IngestEngine ingest;
+  nvr::EventTrigger trigger(&loop, &ingest);
+  trigger.addCamera(3, "cam-3");
+  CHECK(trigger.onEvent(record(3, nvr::EventTopic::Motion, true)));
+  trigger.removeCamera(3);
+  CHECK_EQ(trigger.stats().active, size_t(0));
+  CHECK(!trigger.onEvent(record(3, nvr::EventTopic::Motion, false)));
+  CHECK_EQ(trigger.stats().unknown, uint64_t(1));
+}
+
+void testRefreshExtendsThenExpires() {
+  nvr::EventLoop loop;
+  nvr::IngestEngine ingest;
+  nvr::EventTriggerOptions options;
+  options.refreshMs = 10;
+  options.maxActiveMs = 100;
+  nvr::EventTrigger trigger(&loop, &ingest, options);
+  trigger.addCamera(1, "cam-1");
+  CHECK(trigger.onEvent(record(1, nvr::EventTopic::Motion, true)));
+  loop.runAfter(300, [&loop] { loop.quit(); });
+  loop.run();
+  nvr::EventTrigger::Stats stats = trigger.stats();
+  // The start, then refreshes until maxActiveMs.
+  CHECK_GT(stats.triggers, uint64_t(3));
+  CHECK_LE(stats.triggers, uint64_t(1 + 100 / 10 + 2));
+  CHECK_EQ(stats.expired, uint64_t(1));
+  CHECK_EQ(stats.active, size_t(0));
+  // Its next event starts a new recording.
+  CHECK(trigger.onEvent(record(1, nvr::EventTopic::Motion, true)));
+}
+
+}  // namespace
+
+int main() {
+  nvr::test::quiet();
+  TEST_RUN(testMotionStartsAndEnds);
+  TEST_RUN(testRunsWhileAnySourceIsOn);
+  TEST_RUN(testUnknownIgnoredAndInitial);
+  TEST_RUN(testRemovedCameraIsUnknown);
+  TEST_RUN(testRefreshExtendsThenExpires);
+  return nvr::test::finish();
+}
@@ -0,0 +1,154 @@
+// PhiAccrualDetector: where the suspicion threshold is crossed for steady,
+// jittery and paused nodes, and how the window adapts.
+
+#include <stdint.h>
+
+#include <string>
+
+#include "cluster/failure_detector.h"
+#include "test_util.h"
+
+namespace {
+
+// Heartbeats every intervalMs, then every other one off by jitterMs each
+// way. Returns the time of the last one.
+uint64_t feed(nvr::PhiAccrualDetector* detector, const std::string& node, uint64_t startMs,
+              int count, uint64_t intervalMs, uint64_t jitterMs = 0) {
+  uint64_t nowMs = startMs;
+  for (int i = 0; i < count; ++i) {
+    if (i > 0) nowMs += i % 2 ? intervalMs + jitterMs : intervalMs - jitterMs;
+    detector->heartbeat(node, nowMs);
+  }
+  return nowMs;
+}
+
+// The first ms after lastMs at which the node is suspected.
+uint64_t suspectedAfter(const nvr::PhiAccrualDetector& detector, const std::string& node,
+                        uint64_t lastMs) {
+  uint64_t elapsed = 0;
+  while (!detector.suspect(node, lastMs + elapsed) && elapsed < 60000) ++elapsed;
+  return elapsed;
+}
+
+void testUnknownNodeIsNotSuspected() {
+  nvr::PhiAccrualDetector detector;
+  CHECK_EQ(detector.phi("node", 1000000), 0.0);
+  CHECK(!detector.suspect("node", 1000000));
+  CHECK_EQ(detector.lastHeartbeatMs("node"), uint64_t(0));
+}
+
+void testSteadyNodeIsSuspectedQuickly() {
+  nvr::PhiAccrualDetector detector;
+  uint64_t last = feed(&detector, "node", 1000, 300, 100);
+  CHECK_EQ(detector.lastHeartbeatMs("node"), last);
+  // On time and a little late: nowhere near the threshold.
+  CHECK_LT(detector.phi("node", last + 100), 1.0);
+  CHECK(!detector.suspect("node", last + 150));
+  // Mean 100 ms, deviation at its 20 ms floor: phi 8 is about 5.6
+  // deviations late.
+  uint64_t after = suspectedAfter(detector, "node", last);
+  CHECK_GT(after, uint64_t(180));
+  CHECK_LT(after, uint64_t(250));
+  CHECK(detector.suspect("node", last + 1000));
+}
+
+void testPhiGrowsWithSilence() {
+  nvr::PhiAccrualDetector detector;
+  uint64_t last = feed(&detector, "node", 0, 100, 100, 10);
+  double previous = -1;
+  for (uint64_t elapsed = 0; elapsed <= 400; elapsed += 10) {
+    double phi = detector.phi("node", last + elapsed);
+    CHECK_GE(phi, previous);
+    previous = phi;
+  }
+  // A heartbeat resets it.
+  detector.heartbeat("node", last + 400);
+  CHECK_LT(detector.phi("node", last + 400), 1.0);
+}
+
+void testJitteryNodeGetsLonger() {
+  nvr::PhiAccrualDetector detector;
+  // More heartbeats than the window, so the assumed first interval is gone.
+  uint64_t steady = feed(&detector, "steady", 0, 300, 100);
+  uint64_t jittery = feed(&detector, "jittery", 0, 300, 100, 60);
+  uint64_t steadyAfter = suspectedAfter(detector, "steady", steady);
+  uint64_t jitteryAfter = suspectedAfter(detector, "jittery", jittery);
+  CHECK_GT(jitteryAfter, steadyAfter + 150);
+  // Still bounded: deviation 60 ms puts phi 8 near 100 + 5.6 * 60.
+  CHECK_LT(jitteryAfter, uint64_t(500));
+  CHECK(detector.suspect("steady", steady + 250));
+  CHECK(!detector.suspect("jittery", jittery + 250));
+}
+
+void testThresholdAndPause() {
+  nvr::PhiAccrualOptions strict;
+  strict.threshold = 3;
+  nvr::PhiAccrualOptions paused;
+  paused.acceptablePauseMs = 500;
+  nvr::PhiAccrualDetector defaults;
+  nvr::PhiAccrualDetector low(strict);
+  nvr::PhiAccrualDetector pausing(paused);
+  uint64_t last = feed(&defaults, "node", 0, 100, 100);
+  feed(&low, "node", 0, 100, 100);
+  feed(&pausing, "node", 0, 100, 100);
+
+  uint64_t base = suspectedAfter(defaults, "node", last);
+  CHECK_LT(suspectedAfter(low, "node", last), base);
+  // The pause shifts the mean and so the crossing by as much.
+  uint64_t shifted = suspectedAfter(pausing, "node", last);
+  CHECK_GE(shifted, base + 490);
+  CHECK_LE(shifted, base + 510);
+}
+
+void testFirstIntervalUntilSamples() {
+  nvr::PhiAccrualOptions options;
+  options.firstIntervalMs = 1000;
+  nvr::PhiAccrualDetector detector(options);
+  detector.heartbeat("node", 5000);
+  // Assumed mean 1000 ms, deviation 250 ms.
+  CHECK(!detector.suspect("node", 5000 + 1500));
+  CHECK(detector.suspect("node", 5000 + 4000));
+}
+
+void testWindowForgetsOldIntervals() {
+  nvr::PhiAccrualOptions options;
+  options.windowSize = 50;
+  nvr::PhiAccrualDetector detector(options);
+  uint64_t last = feed(&detector, "node", 0, 100, 1000, 200);
+  CHECK(!detector.suspect("node", last + 1200));
+  CHECK(!detector.suspect("node", last + 400));
+  // A full window of 100 ms heartbeats replaces the 1 s ones.
+  last = feed(&detector, "node", last + 100, 60, 100);
+  CHECK(detector.suspect("node", last + 400));
+}
+
+void testRemoveForgetsTheNode() {
+  nvr::PhiAccrualDetector detector;
+  uint64_t last = feed(&detector, "node", 0, 20, 100);
+  CHECK(detector.suspect("node", last + 5000));
+  detector.remove("node");
+  CHECK_EQ(detector.phi("node", last + 5000), 0.0);
+  CHECK_EQ(detector.lastHeartbeatMs("node"), uint64_t(0));
+}
+
+void testLateHeartbeatDoesNotGoBack() {
+  nvr::PhiAccrualDetector detector;
+  uint64_t last = feed(&detector, "node", 1000, 20, 100);
+  detector.heartbeat("node", last - 50);
+  CHECK_EQ(detector.lastHeartbeatMs("node"), last);
+}
+
+}  // namespace
+
+int main() {
+  TEST_RUN(testUnknownNodeIsNotSuspected);
+  TEST_RUN(testSteadyNodeIsSuspectedQuickly);
+  TEST_RUN(testPhiGrowsWithSilence);
+  TEST_RUN(testJitteryNodeGetsLonger);
+  TEST_RUN(testThresholdAndPause);
+  TEST_RUN(testFirstIntervalUntilSamples);
+  TEST_RUN(testWindowForgetsOldIntervals);
+  TEST_RUN(testRemoveForgetsTheNode);
+  TEST_RUN(testLateHeartbeatDoesNotGoBack);
+  return nvr::test::finish();
+}
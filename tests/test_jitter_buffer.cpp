@@ -0,0 +1,250 @@
+// RtpJitterBuffer: reordering, giving up on gaps, late and duplicate
+// packets, and how the loss it reports marks frames corrupt on the way
+// through the depacketizer and the frame assembler.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "base/packet_buffer.h"
+#include "media/frame_assembler.h"
+#include "media/rtp_depacketizer.h"
+#include "rtp/rtp_jitter_buffer.h"
+#include "rtp/rtp_packet.h"
+#include "test_util.h"
+
+namespace {
+
+constexpr uint32_t kFrameTicks = 3600;
+
+// One H.264 frame per packet: an IDR slice every kGop, non-IDR otherwise.
+constexpr uint16_t kGop = 4;
+
+struct Received {
+  uint16_t sequence;
+  uint32_t lost;
+};
+
+// Everything the buffer lets out, and the frames it makes.
+class Sink : public nvr::RtpJitterBufferHandler, public nvr::FrameHandler {
+ public:
+  Sink()
+      : assembler_(nvr::VideoCodec::H264, this),
+        depacketizer_(nvr::VideoCodec::H264, &assembler_) {}
+
+  void onOrderedRtp(int, const nvr::PacketRef& packet, uint32_t lost) override {
+    nvr::RtpHeader header;
+    nvr::parseRtpHeader(packet.data(), packet.size(), &header);
+    received.push_back({header.sequence, lost});
+    depacketizer_.push(packet.data(), packet.size());
+  }
+
+  void onFrame(const nvr::Frame& frame) override {
+    frames.push_back(frame.rtpTimestamp / kFrameTicks);
+    if (frame.corrupt) corrupt.push_back(frame.rtpTimestamp / kFrameTicks);
+  }
+
+  std::vector<uint16_t> sequences() const {
+    std::vector<uint16_t> out;
+    for (const auto& r : received) out.push_back(r.sequence);
+    return out;
+  }
+
+  std::vector<Received> received;
+  std::vector<uint32_t> frames;   // by frame number
+  std::vector<uint32_t> corrupt;
+
+ private:
+  nvr::FrameAssembler assembler_;
+  nvr::RtpDepacketizer depacketizer_;
+};
+
+class Stream {
+ public:
+  explicit Stream(const nvr::RtpJitterBufferOptions& options = nvr::RtpJitterBufferOptions())
+      : pool_(nvr::PacketPools::kDatagramSize, 64), buffer_(0, &sink, options) {}
+
+  // Packet `sequence` arrives at nowUs; it carries frame `sequence`.
+  void arrive(uint16_t sequence, int64_t nowUs) {
+    nvr::PacketBuffer* buffer = pool_.acquire();
+    uint8_t* p = buffer->data();
+    uint32_t timestamp = static_cast<uint32_t>(sequence) * kFrameTicks;
+    p[0] = 0x80;
+    p[1] = 96 | 0x80;  // marker: one packet per frame
+    p[2] = static_cast<uint8_t>(sequence >> 8);
+    p[3] = static_cast<uint8_t>(sequence);
+    for (int b = 0; b < 4; ++b) p[4 + b] = static_cast<uint8_t>(timestamp >> (24 - 8 * b));
+    memset(p + 8, 0x11, 4);
+    p[12] = sequence % kGop == 0 ? 0x65 : 0x41;
+    memset(p + 13, 0x5a, 20);
+    nvr::PacketRef packet = nvr::PacketRef::adopt(buffer, 0, 33);
+    nvr::RtpHeader header;
+    nvr::parseRtpHeader(packet.data(), packet.size(), &header);
+    buffer_.push(packet, header, nowUs, 0);
+  }
+
+  nvr::RtpJitterBuffer& buffer() { return buffer_; }
+
+  Sink sink;
+
+ private:
+  nvr::PacketPool pool_;
+  nvr::RtpJitterBuffer buffer_;
+};
+
+void testInOrderPassesStraightThrough() {
+  Stream stream;
+  for (uint16_t s = 0; s < 8; ++s) {
+    stream.arrive(s, 1000 * s);
+    CHECK_EQ(stream.buffer().held(), size_t(0));
+  }
+  CHECK_EQ(stream.sink.received.size(), size_t(8));
+  CHECK_EQ(stream.buffer().deadlineUs(), int64_t(0));
+  CHECK_EQ(stream.buffer().stats().reordered, uint64_t(0));
+  CHECK_EQ(stream.sink.frames.size(), size_t(8));
+  CHECK(stream.sink.corrupt.empty());
+}
+
+void testReorderedPacketsComeOutInOrder() {
+  Stream stream;
+  stream.arrive(0, 0);
+  stream.arrive(1, 1000);
+  stream.arrive(3, 2000);
+  stream.arrive(4, 3000);
+  CHECK_EQ(stream.buffer().held(), size_t(2));
+  CHECK_GT(stream.buffer().deadlineUs(), int64_t(2000));
+  stream.arrive(2, 4000);
+  CHECK_EQ(stream.buffer().held(), size_t(0));
+  std::vector<uint16_t> expected = {0, 1, 2, 3, 4};
+  CHECK(stream.sink.sequences() == expected);
+  for (const auto& r : stream.sink.received) CHECK_EQ(r.lost, uint32_t(0));
+  CHECK_EQ(stream.buffer().stats().reordered, uint64_t(1));
+  CHECK_EQ(stream.buffer().stats().lost, uint64_t(0));
+  CHECK(stream.sink.corrupt.empty());
+}
+
+void testGapGivenUpOnAfterTheDelay() {
+  Stream stream;
+  stream.arrive(0, 0);
+  stream.arrive(1, 1000);
+  stream.arrive(3, 2000);
+  int64_t deadline = stream.buffer().deadlineUs();
+  CHECK_EQ(deadline, int64_t(2000 + stream.buffer().delayUs()));
+  stream.buffer().poll(deadline - 1);
+  CHECK_EQ(stream.sink.received.size(), size_t(2));
+  stream.buffer().poll(deadline);
+  CHECK_EQ(stream.sink.received.size(), size_t(3));
+  CHECK_EQ(stream.sink.received.back().sequence, uint16_t(3));
+  CHECK_EQ(stream.sink.received.back().lost, uint32_t(1));
+  CHECK_EQ(stream.buffer().stats().lost, uint64_t(1));
+  CHECK_EQ(stream.buffer().deadlineUs(), int64_t(0));
+}
+
+void testLatePacketIsDroppedAndRaisesTheDelay() {
+  Stream stream;
+  stream.arrive(0, 0);
+  stream.arrive(2, 1000);
+  uint32_t before = stream.buffer().delayUs();
+  stream.buffer().poll(stream.buffer().deadlineUs());
+  CHECK_EQ(stream.buffer().stats().lost, uint64_t(1));
+  // Turns up 30 ms after it was given up on.
+  int64_t lateUs = 1000 + before + 30000;
+  stream.arrive(1, lateUs);
+  CHECK_EQ(stream.buffer().stats().late, uint64_t(1));
+  CHECK_EQ(stream.sink.received.size(), size_t(2));
+  // The next gap is waited on for longer than that took.
+  stream.arrive(3, lateUs + 1000);
+  CHECK_GE(stream.buffer().delayUs(), before + 30000);
+}
+
+void testDuplicatesAreDropped() {
+  Stream stream;
+  stream.arrive(0, 0);
+  stream.arrive(0, 100);
+  stream.arrive(2, 1000);
+  stream.arrive(2, 1100);
+  stream.arrive(1, 2000);
+  std::vector<uint16_t> expected = {0, 1, 2};
+  CHECK(stream.sink.sequences() == expected);
+  CHECK_EQ(stream.buffer().stats().duplicates, uint64_t(2));
+}
+
+void testNoDelayMeansLossAtOnce() {
+  nvr::RtpJitterBufferOptions options;
+  options.maxDelayMs = 0;
+  Stream stream(options);
+  stream.arrive(0, 0);
+  stream.arrive(2, 1000);
+  CHECK_EQ(stream.buffer().held(), size_t(0));
+  CHECK_EQ(stream.sink.received.back().sequence, uint16_t(2));
+  CHECK_EQ(stream.sink.received.back().lost, uint32_t(1));
+}
+
+void testFullRingGivesUpEarly() {
+  nvr::RtpJitterBufferOptions options;
+  options.capacity = 16;
+  Stream stream(options);
+  stream.arrive(0, 0);
+  // Packet 1 never comes; more than a ring of packets pile up behind it.
+  for (uint16_t s = 2; s < 20; ++s) stream.arrive(s, 100 * s);
+  CHECK_GT(stream.buffer().stats().overflows, uint64_t(0));
+  CHECK_EQ(stream.buffer().stats().lost, uint64_t(1));
+  CHECK_LE(stream.buffer().held(), size_t(16));
+  CHECK_EQ(stream.sink.received[1].sequence, uint16_t(2));
+  CHECK_EQ(stream.sink.received[1].lost, uint32_t(1));
+}
+
+void testFlushReleasesEverythingHeld() {
+  Stream stream;
+  stream.arrive(0, 0);
+  stream.arrive(3, 1000);
+  stream.arrive(5, 2000);
+  stream.buffer().flush();
+  CHECK_EQ(stream.buffer().held(), size_t(0));
+  std::vector<uint16_t> expected = {0, 3, 5};
+  CHECK(stream.sink.sequences() == expected);
+  CHECK_EQ(stream.sink.received[1].lost, uint32_t(2));
+  CHECK_EQ(stream.sink.received[2].lost, uint32_t(1));
+}
+
+void testLossMarksTheFrameItBroke() {
+  Stream stream;
+  // Frames 0-8 at 25 fps, a keyframe every fourth; frame 2 is lost, and
+  // 5 arrives 2 ms after 6, inside the delay.
+  struct Arrival {
+    uint16_t sequence;
+    int64_t atUs;
+  };
+  Arrival arrivals[] = {{0, 0},      {1, 40000},  {3, 120000}, {4, 160000}, {6, 240000},
+                        {5, 242000}, {7, 280000}, {8, 320000}};
+  for (const Arrival& a : arrivals) {
+    stream.buffer().poll(a.atUs);
+    stream.arrive(a.sequence, a.atUs);
+  }
+  stream.buffer().flush();
+  // Frame 3 follows the gap: corrupt. Frame 4 is a keyframe, and the swap
+  // was put right.
+  std::vector<uint32_t> frames = {0, 1, 3, 4, 5, 6, 7, 8};
+  CHECK(stream.sink.frames == frames);
+  std::vector<uint32_t> corrupt = {3};
+  CHECK(stream.sink.corrupt == corrupt);
+  CHECK_EQ(stream.buffer().stats().lost, uint64_t(1));
+  CHECK_EQ(stream.buffer().stats().reordered, uint64_t(1));
+}
+
+}  // namespace
+
+int main() {
+  nvr::test::quiet();
+  TEST_RUN(testInOrderPassesStraightThrough);
+  TEST_RUN(testReorderedPacketsComeOutInOrder);
+  TEST_RUN(testGapGivenUpOnAfterTheDelay);
+  TEST_RUN(testLatePacketIsDroppedAndRaisesTheDelay);
+  TEST_RUN(testDuplicatesAreDropped);
+  TEST_RUN(testNoDelayMeansLossAtOnce);
+  TEST_RUN(testFullRingGivesUpEarly);
+  TEST_RUN(testFlushReleasesEverythingHeld);
+  TEST_RUN(testLossMarksTheFrameItBroke);
+  return nvr::test::finish();
+}
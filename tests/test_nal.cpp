@@ -0,0 +1,336 @@
+// NAL parsing: start code scanning (every implementation against the naive
+// one, at buffer edges and for three- and four-byte codes), Annex-B
+// splitting in arbitrary chunks, and the RTP payload formats of H.264
+// (single units, STAP-A, FU-A) and H.265 (single units, AP, FU), with the
+// start and end bits of fragments and what a lost one does.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <random>
+#include <vector>
+
+#include "media/nal.h"
+#include "media/rtp_depacketizer.h"
+#include "media/start_code.h"
+#include "rtp/rtp_packet.h"
+#include "test_util.h"
+
+namespace {
+
+using Bytes = std::vector<uint8_t>;
+
+// Every unit and loss the parsers report.
+class Units : public nvr::NalHandler {
+ public:
+  struct Unit {
+    Bytes data;
+    int type;
+    uint32_t timestamp;
+    bool end;
+  };
+
+  void onNal(const nvr::NalUnit& nal) override {
+    units.push_back({Bytes(nal.data, nal.data + nal.size), nal.type, nal.timestamp,
+                     nal.endOfAccessUnit});
+  }
+  void onLoss(uint32_t timestamp) override { losses.push_back(timestamp); }
+
+  std::vector<Unit> units;
+  std::vector<uint32_t> losses;
+};
+
+// ---- start codes
+
+size_t scanAt(nvr::StartCodeScanFn fn, const Bytes& data, size_t from, size_t to) {
+  return static_cast<size_t>(fn(data.data() + from, data.data() + to) - data.data());
+}
+
+void testStartCodeFixedVectors() {
+  nvr::StartCodeScanFn naive = nvr::startCodeScanFn(nvr::StartCodeScan::Naive);
+  CHECK(naive != nullptr);
+  struct Case {
+    Bytes data;
+    size_t expected;
+  };
+  std::vector<Case> cases = {
+      {{0, 0, 1, 0x65}, 0},
+      {{0, 0, 0, 1, 0x65}, 1},      // four bytes: found at the second
+      {{0x11, 0, 0, 1}, 1},         // ending exactly at the end
+      {{0x11, 0, 0}, 3},            // cut short: none
+      {{0, 1, 0, 0, 2, 0, 0}, 7},
+      {{}, 0},
+      {{0, 0, 0, 0, 0, 0, 0, 1}, 5},
+      {{1, 0, 0, 1, 0, 0, 1}, 1},
+  };
+  for (nvr::StartCodeScan scan : {nvr::StartCodeScan::Naive, nvr::StartCodeScan::Scalar,
+                                  nvr::StartCodeScan::Sse2, nvr::StartCodeScan::Avx2}) {
+    nvr::StartCodeScanFn fn = nvr::startCodeScanFn(scan);
+    if (fn == nullptr) continue;
+    for (const Case& c : cases) CHECK_EQ(scanAt(fn, c.data, 0, c.data.size()), c.expected);
+  }
+  // Codes straddling a 32-byte window, and the last possible position.
+  for (size_t at = 0; at + 3 <= 100; ++at) {
+    Bytes data(100, 0x42);
+    data[at] = data[at + 1] = 0;
+    data[at + 2] = 1;
+    CHECK_EQ(scanAt(nvr::findStartCode, data, 0, data.size()), at);
+    // The end cuts the code off.
+    CHECK_EQ(scanAt(nvr::findStartCode, data, 0, at + 2), at + 2);
+  }
+}
+
+void testStartCodeScannersAgree() {
+  nvr::StartCodeScanFn naive = nvr::startCodeScanFn(nvr::StartCodeScan::Naive);
+  std::mt19937 rng(7);
+  int compared = 0;
+  for (nvr::StartCodeScan scan :
+       {nvr::StartCodeScan::Scalar, nvr::StartCodeScan::Sse2, nvr::StartCodeScan::Avx2}) {
+    nvr::StartCodeScanFn fn = nvr::startCodeScanFn(scan);
+    if (fn == nullptr) continue;
+    ++compared;
+    for (int round = 0; round < 2000; ++round) {
+      // Mostly zeros and ones, so codes, near misses and runs of zeros are
+      // common; every alignment of start and end against the vectors.
+      Bytes data(1 + rng() % 160);
+      int zeros = 1 + static_cast<int>(rng() % 8);
+      for (auto& b : data) {
+        unsigned r = rng() % 10;
+        b = r < static_cast<unsigned>(zeros) ? 0 : r == 9 ? 1 : static_cast<uint8_t>(rng());
+      }
+      size_t from = rng() % data.size();
+      size_t to = from + rng() % (data.size() - from + 1);
+      size_t expected = scanAt(naive, data, from, to);
+      size_t actual = scanAt(fn, data, from, to);
+      CHECK_EQ(actual, expected);
+      if (actual != expected) {
+        printf("  %s, bytes [%zu, %zu) of %zu\n", nvr::startCodeScanName(scan), from, to,
+               data.size());
+        return;
+      }
+    }
+  }
+  CHECK_GT(compared, 0);
+}
+
+// ---- Annex-B
+
+Bytes annexB() {
+  return {0,    0,    0, 1, 0x67, 0x42, 0x00,                    // SPS, four-byte code
+          0,    0,    1, 0x68, 0xce, 0x38, 0x80,                 // PPS
+          0,    0,    0, 1, 0x65, 0x88, 0x00, 0x00, 0x03, 0x01,  // IDR, emulation prevention
+          0,    0,    1, 0x41, 0x9a, 0x00, 0x00};                // slice, trailing zeros
+}
+
+void testAnnexBSplit() {
+  Bytes stream = annexB();
+  Units units;
+  nvr::AnnexBParser::split(nvr::VideoCodec::H264, stream.data(), stream.size(), &units);
+  CHECK_EQ(units.units.size(), size_t(4));
+  if (units.units.size() != 4) return;
+  CHECK(units.units[0].data == Bytes({0x67, 0x42}));
+  CHECK(units.units[1].data == Bytes({0x68, 0xce, 0x38, 0x80}));
+  CHECK(units.units[2].data == Bytes({0x65, 0x88, 0x00, 0x00, 0x03, 0x01}));
+  CHECK(units.units[3].data == Bytes({0x41, 0x9a}));
+  CHECK_EQ(units.units[2].type, 5);
+}
+
+void testAnnexBChunksMatchTheWhole() {
+  Bytes stream = annexB();
+  stream.insert(stream.begin(), {0x12, 0x00});  // garbage before the first code
+  Units whole;
+  nvr::AnnexBParser::split(nvr::VideoCodec::H264, stream.data(), stream.size(), &whole);
+  // Every split in two and in three pieces.
+  for (size_t a = 0; a <= stream.size(); ++a) {
+    for (size_t b = a; b <= stream.size(); ++b) {
+      Units units;
+      nvr::AnnexBParser parser(nvr::VideoCodec::H264, &units);
+      parser.push(stream.data(), a);
+      parser.push(stream.data() + a, b - a);
+      parser.push(stream.data() + b, stream.size() - b);
+      parser.flush();
+      bool same = units.units.size() == whole.units.size();
+      for (size_t i = 0; same && i < units.units.size(); ++i)
+        same = units.units[i].data == whole.units[i].data;
+      CHECK(same);
+      if (!same) {
+        printf("  chunks of %zu, %zu and %zu bytes\n", a, b - a, stream.size() - b);
+        return;
+      }
+    }
+  }
+}
+
+// ---- RTP
+
+class Rtp {
+ public:
+  explicit Rtp(nvr::VideoCodec codec) : depacketizer(codec, &units) {}
+
+  void push(const Bytes& payload, uint32_t timestamp, bool marker) {
+    pushAt(sequence_++, payload, timestamp, marker);
+  }
+  void pushAt(uint16_t sequence, const Bytes& payload, uint32_t timestamp, bool marker) {
+    nvr::RtpHeader header;
+    header.sequence = sequence;
+    header.timestamp = timestamp;
+    header.marker = marker;
+    sequence_ = static_cast<uint16_t>(sequence + 1);
+    depacketizer.push(header, payload.data(), payload.size());
+  }
+  void skip() { ++sequence_; }
+
+  Units units;
+  nvr::RtpDepacketizer depacketizer;
+
+ private:
+  uint16_t sequence_ = 100;
+};
+
+void testH264SingleAndStapA() {
+  Rtp rtp(nvr::VideoCodec::H264);
+  rtp.push({0x67, 1, 2}, 10, false);
+  // STAP-A (NRI 3): SPS of 3 bytes, PPS of 2, IDR of 4; the marker goes
+  // with the last only.
+  rtp.push({0x78, 0, 3, 0x67, 1, 2, 0, 2, 0x68, 9, 0, 4, 0x65, 7, 7, 7}, 20, true);
+  CHECK_EQ(rtp.units.units.size(), size_t(4));
+  if (rtp.units.units.size() != 4) return;
+  CHECK(rtp.units.units[0].data == Bytes({0x67, 1, 2}));
+  CHECK_EQ(rtp.units.units[0].timestamp, uint32_t(10));
+  CHECK(rtp.units.units[1].data == Bytes({0x67, 1, 2}));
+  CHECK(!rtp.units.units[1].end);
+  CHECK(rtp.units.units[2].data == Bytes({0x68, 9}));
+  CHECK(!rtp.units.units[2].end);
+  CHECK(rtp.units.units[3].data == Bytes({0x65, 7, 7, 7}));
+  CHECK(rtp.units.units[3].end);
+  CHECK_EQ(rtp.units.units[3].timestamp, uint32_t(20));
+
+  // A size past the packet's end.
+  rtp.push({0x78, 0, 2, 0x68, 9, 0, 9, 0x65}, 30, true);
+  CHECK_EQ(rtp.depacketizer.stats().malformed, uint64_t(1));
+  CHECK_EQ(rtp.units.units.size(), size_t(5));
+  CHECK(rtp.units.losses.empty());
+
+  Bytes stapIdr = {0x78, 0, 1, 0x65};
+  nvr::RtpPayloadInfo info =
+      nvr::inspectRtpPayload(nvr::VideoCodec::H264, stapIdr.data(), stapIdr.size());
+  CHECK(info.keyframeStart);
+  CHECK(info.vcl);
+}
+
+void testH264FuA() {
+  Rtp rtp(nvr::VideoCodec::H264);
+  // IDR with NRI 3 in three fragments: indicator 0x7c, FU headers with S
+  // and E bits and type 5.
+  rtp.push({0x7c, 0x85, 1, 2}, 90, false);
+  rtp.push({0x7c, 0x05, 3}, 90, false);
+  rtp.push({0x7c, 0x45, 4, 5}, 90, true);
+  CHECK_EQ(rtp.units.units.size(), size_t(1));
+  if (rtp.units.units.size() == 1) {
+    CHECK(rtp.units.units[0].data == Bytes({0x65, 1, 2, 3, 4, 5}));
+    CHECK_EQ(rtp.units.units[0].type, 5);
+    CHECK(rtp.units.units[0].end);
+  }
+  CHECK_EQ(rtp.depacketizer.stats().fragmentedNals, uint64_t(1));
+
+  // The payload header tells a start fragment of an IDR from the rest, and
+  // a non-reference slice (NRI 0) from a reference one.
+  Bytes start = {0x7c, 0x85, 1};
+  Bytes middle = {0x7c, 0x05, 1};
+  Bytes nonReference = {0x1c, 0x81, 1};
+  CHECK(nvr::rtpPayloadStartsKeyframe(nvr::VideoCodec::H264, start.data(), start.size()));
+  CHECK(!nvr::rtpPayloadStartsKeyframe(nvr::VideoCodec::H264, middle.data(), middle.size()));
+  CHECK(!nvr::inspectRtpPayload(nvr::VideoCodec::H264, nonReference.data(), nonReference.size())
+             .reference);
+}
+
+void testH264LostFragments() {
+  Rtp rtp(nvr::VideoCodec::H264);
+  // The middle fragment is lost: the unit is dropped, the loss reported.
+  rtp.push({0x7c, 0x85, 1}, 90, false);
+  rtp.skip();
+  rtp.push({0x7c, 0x45, 3}, 90, true);
+  CHECK(rtp.units.units.empty());
+  CHECK(rtp.units.losses == std::vector<uint32_t>({90}));
+  CHECK_EQ(rtp.depacketizer.stats().gaps, uint64_t(1));
+  CHECK_EQ(rtp.depacketizer.stats().droppedFragments, uint64_t(2));
+
+  // A start without an end, then a whole unit: the fragments go, the unit
+  // does not.
+  rtp.push({0x7c, 0x85, 1}, 180, false);
+  rtp.push({0x41, 9}, 270, true);
+  CHECK_EQ(rtp.units.units.size(), size_t(1));
+  if (!rtp.units.units.empty()) CHECK(rtp.units.units[0].data == Bytes({0x41, 9}));
+  CHECK_EQ(rtp.depacketizer.stats().droppedFragments, uint64_t(3));
+
+  // A new start while one is open starts over.
+  rtp.push({0x7c, 0x81, 1}, 360, false);
+  rtp.push({0x7c, 0x81, 2}, 450, false);
+  rtp.push({0x7c, 0x41, 3}, 450, true);
+  CHECK_EQ(rtp.units.units.size(), size_t(2));
+  if (rtp.units.units.size() == 2) CHECK(rtp.units.units[1].data == Bytes({0x61, 2, 3}));
+  CHECK_EQ(rtp.depacketizer.stats().droppedFragments, uint64_t(4));
+  CHECK_EQ(rtp.units.losses.size(), size_t(1));
+}
+
+void testH265SingleApAndFu() {
+  Rtp rtp(nvr::VideoCodec::H265);
+  // VPS (type 32): header 0x40 0x01.
+  rtp.push({0x40, 0x01, 0xaa}, 10, false);
+  // AP (type 48: 0x60 0x01): SPS (33) and PPS (34).
+  rtp.push({0x60, 0x01, 0, 3, 0x42, 0x01, 0xbb, 0, 3, 0x44, 0x01, 0xcc}, 10, false);
+  // IDR_W_RADL (19) in two FUs (type 49: 0x62 0x01), the FU header's type
+  // replacing the payload header's.
+  rtp.push({0x62, 0x01, 0x80 | 19, 1, 2}, 20, false);
+  rtp.push({0x62, 0x01, 0x40 | 19, 3}, 20, true);
+  CHECK_EQ(rtp.units.units.size(), size_t(4));
+  if (rtp.units.units.size() != 4) return;
+  CHECK_EQ(rtp.units.units[0].type, 32);
+  CHECK(rtp.units.units[1].data == Bytes({0x42, 0x01, 0xbb}));
+  CHECK_EQ(rtp.units.units[1].type, 33);
+  CHECK(!rtp.units.units[1].end);
+  CHECK_EQ(rtp.units.units[2].type, 34);
+  CHECK(rtp.units.units[3].data == Bytes({19 << 1, 0x01, 1, 2, 3}));
+  CHECK_EQ(rtp.units.units[3].type, 19);
+  CHECK(rtp.units.units[3].end);
+
+  Bytes fuStart = {0x62, 0x01, 0x80 | 19, 1};
+  CHECK(nvr::rtpPayloadStartsKeyframe(nvr::VideoCodec::H265, fuStart.data(), fuStart.size()));
+
+  // PACI (type 50) is not supported; a FU end without its start is dropped.
+  rtp.push({0x64, 0x01, 0, 0}, 30, false);
+  rtp.push({0x62, 0x01, 0x40 | 1, 3}, 30, true);
+  CHECK_EQ(rtp.depacketizer.stats().unsupported, uint64_t(1));
+  CHECK_EQ(rtp.depacketizer.stats().droppedFragments, uint64_t(1));
+  CHECK_EQ(rtp.units.units.size(), size_t(4));
+}
+
+void testNalClassification() {
+  const uint8_t nonRef[] = {0x01};
+  const uint8_t ref[] = {0x21};
+  CHECK(!nvr::isReferenceNal(nvr::VideoCodec::H264, nonRef));
+  CHECK(nvr::isReferenceNal(nvr::VideoCodec::H264, ref));
+  const uint8_t trailN[] = {0 << 1, 1};
+  const uint8_t trailR[] = {1 << 1, 1};
+  CHECK(!nvr::isReferenceNal(nvr::VideoCodec::H265, trailN));
+  CHECK(nvr::isReferenceNal(nvr::VideoCodec::H265, trailR));
+  CHECK(nvr::isKeyframeNal(nvr::VideoCodec::H265, nvr::h265::kCraNut));
+  CHECK(!nvr::isKeyframeNal(nvr::VideoCodec::H265, 22));
+  CHECK(nvr::isParameterSetNal(nvr::VideoCodec::H264, nvr::h264::kSps));
+}
+
+}  // namespace
+
+int main() {
+  nvr::test::quiet();
+  TEST_RUN(testStartCodeFixedVectors);
+  TEST_RUN(testStartCodeScannersAgree);
+  TEST_RUN(testAnnexBSplit);
+  TEST_RUN(testAnnexBChunksMatchTheWhole);
+  TEST_RUN(testH264SingleAndStapA);
+  TEST_RUN(testH264FuA);
+  TEST_RUN(testH264LostFragments);
+  TEST_RUN(testH265SingleApAndFu);
+  TEST_RUN(testNalClassification);
+  return nvr::test::finish();
+}
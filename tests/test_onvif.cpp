@@ -0,0 +1,462 @@
+// XmlReader edge cases, and OnvifClient against a mock device that checks
+// WS-Security digests the way cameras do.
+
+#include <errno.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "base/base64.h"
+#include "base/event_loop.h"
+#include "http/http_client.h"
+#include "http/http_message.h"
+#include "mock_http_server.h"
+#include "onvif/onvif_client.h"
+#include "onvif/ws_security.h"
+#include "onvif/xml_reader.h"
+#include "test_util.h"
+
+namespace {
+
+using Token = nvr::XmlReader::Token;
+
+// Tokens of a whole document, as "<name", ">name", "'text" and "$" (End)
+// or "!" (Error).
+std::string tokens(const std::string& xml) {
+  nvr::XmlReader reader(xml);
+  std::string out;
+  for (;;) {
+    Token t = reader.next();
+    if (!out.empty()) out += ' ';
+    switch (t) {
+      case Token::StartElement: out += "<" + std::string(reader.localName()); break;
+      case Token::EndElement: out += ">" + std::string(reader.localName()); break;
+      case Token::Text: out += "'" + reader.text(); break;
+      case Token::End: return out + "$";
+      case Token::Error: return out + "!";
+    }
+  }
+}
+
+void testXmlBasics() {
+  CHECK_EQ(tokens("<a><b>x</b><c/></a>"), std::string("<a <b 'x >b <c >c >a $"));
+  CHECK_EQ(tokens("<?xml version=\"1.0\"?>\n<a>\n  <b/>\n</a>\n"),
+           std::string("<a <b >b >a $"));
+  CHECK_EQ(tokens("<a><!-- <b>not</b> --><c>y</c></a>"), std::string("<a <c 'y >c >a $"));
+  CHECK_EQ(tokens("<!DOCTYPE a [<!ENTITY x \"y\">]><a/>"), std::string("<a >a $"));
+  CHECK_EQ(tokens(""), std::string("$"));
+}
+
+void testXmlCdata() {
+  CHECK_EQ(tokens("<a><![CDATA[<b>&amp;</b>]]></a>"), std::string("<a '<b>&amp;</b> >a $"));
+  // Empty, and with brackets inside.
+  CHECK_EQ(tokens("<a><![CDATA[]]></a>"), std::string("<a ' >a $"));
+  CHECK_EQ(tokens("<a><![CDATA[x]y]]z]]></a>"), std::string("<a 'x]y]]z >a $"));
+  // readText joins CDATA with the text around it.
+  std::string doc = "<a> one <![CDATA[<two>]]> three </a>";
+  nvr::XmlReader reader(doc);
+  CHECK(reader.next() == Token::StartElement);
+  CHECK_EQ(reader.readText(), std::string("one <two> three"));
+  CHECK(reader.next() == Token::End);
+}
+
+void testXmlNamespaces() {
+  std::string doc =
+      "<env:Envelope xmlns:env=\"urn:e\" xmlns:tt=\"urn:t\"><env:Body>"
+      "<tt:Profile tt:token=\"P1\" fixed='true'><Name>main</Name></tt:Profile>"
+      "<other:Profile token=\"P2\"/></env:Body></env:Envelope>";
+  nvr::XmlReader reader(doc);
+  CHECK(reader.findElement("Profile"));
+  CHECK(reader.name() == "tt:Profile");
+  CHECK(reader.localName() == "Profile");
+  std::string value;
+  CHECK(reader.attribute("token", &value));
+  CHECK_EQ(value, std::string("P1"));
+  CHECK(reader.attribute("fixed", &value));
+  CHECK_EQ(value, std::string("true"));
+  CHECK(!reader.attribute("missing", &value));
+  CHECK_EQ(reader.depth(), 3);
+  CHECK(reader.findChild("Name", reader.depth()));
+  CHECK_EQ(reader.readText(), std::string("main"));
+  CHECK(reader.findElement("Profile"));
+  CHECK(reader.name() == "other:Profile");
+  CHECK(reader.attribute("token", &value));
+  CHECK_EQ(value, std::string("P2"));
+  CHECK(nvr::xmlLocalName("a:b:c") == "c");
+  CHECK(nvr::xmlLocalName("plain") == "plain");
+}
+
+void testXmlEntities() {
+  CHECK_EQ(tokens("<a>&lt;&gt;&amp;&quot;&apos;</a>"), std::string("<a '<>&\"' >a $"));
+  CHECK_EQ(tokens("<a>&#65;&#x42;&#xe9;</a>"), std::string("<a 'AB\xc3\xa9 >a $"));
+  CHECK_EQ(tokens("<a>&bogus;</a>"), std::string("<a !"));
+  CHECK_EQ(tokens("<a>&amp</a>"), std::string("<a !"));
+  std::string doc = "<a v=\"x &amp; y\"/>";
+  nvr::XmlReader reader(doc);
+  reader.next();
+  std::string value;
+  CHECK(reader.attribute("v", &value));
+  CHECK_EQ(value, std::string("x & y"));
+  CHECK_EQ(nvr::xmlEscape("<a & 'b'>\""), std::string("&lt;a &amp; &apos;b&apos;&gt;&quot;"));
+}
+
+void testXmlTruncated() {
+  // Every proper prefix of a document that cuts into the markup or the
+  // root element ends in Error, never End.
+  std::string doc =
+      "<?xml version=\"1.0\"?><s:Envelope xmlns:s=\"u\"><s:Body><!-- c -->"
+      "<m a=\"1\" b='2'><![CDATA[x]]>&amp;<n/></m></s:Body></s:Envelope>";
+  size_t declaration = doc.find("?>") + 2;
+  for (size_t len = 1; len < doc.size(); ++len) {
+    if (len == declaration) continue;
+    std::string prefix = doc.substr(0, len);
+    nvr::XmlReader reader(prefix.data(), prefix.size());
+    Token t;
+    int guard = 0;
+    do {
+      t = reader.next();
+    } while (t != Token::End && t != Token::Error && ++guard < 100);
+    CHECK(t == Token::Error);
+    // Sticky.
+    CHECK(reader.next() == Token::Error);
+  }
+  CHECK_EQ(tokens(doc), std::string("<Envelope <Body <m 'x '& <n >n >m >Body >Envelope $"));
+}
+
+void testXmlMalformed() {
+  CHECK_EQ(tokens("</a>"), std::string("!"));
+  CHECK_EQ(tokens("<a b></a>"), std::string("!"));
+  CHECK_EQ(tokens("<a b=c></a>"), std::string("!"));
+  CHECK_EQ(tokens("<a/ >"), std::string("!"));
+  CHECK_EQ(tokens("< a/>"), std::string("!"));
+  std::string doc = "<a><b><c/></b><d>t</d></a>";
+  nvr::XmlReader reader(doc);
+  CHECK(reader.findElement("b"));
+  CHECK(reader.skipElement());
+  CHECK(reader.next() == Token::StartElement);
+  CHECK(reader.localName() == "d");
+  std::string cut = "<a><b><c/>";
+  nvr::XmlReader truncated(cut);
+  CHECK(truncated.findElement("b"));
+  CHECK(!truncated.skipElement());
+}
+
+// The mock camera: GetSystemDateAndTime unauthenticated, everything else
+// with a UsernameToken digest for admin/secret.
+const char kHead[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?><env:Envelope "
+    "xmlns:env=\"http://www.w3.org/2003/05/soap-envelope\" "
+    "xmlns:tt=\"http://www.onvif.org/ver10/schema\"><env:Body>";
+const char kTail[] = "</env:Body></env:Envelope>";
+
+class MockCamera {
+ public:
+  explicit MockCamera(nvr::EventLoop* loop)
+      : server_(loop, [this](const nvr::HttpRequest& request) { return handle(request); }) {}
+
+  std::string url(const std::string& password = "secret") const {
+    return server_.url("/onvif/device_service", "admin:" + password);
+  }
+  const nvr::test::MockHttpServer& server() const { return server_; }
+
+  int64_t clockOffsetS = 0;
+  int rejectNext = 0;  // authenticated requests to refuse regardless
+  std::vector<std::string> operations;
+  std::vector<std::string> paths;
+
+ private:
+  std::string handle(const nvr::HttpRequest& request) {
+    std::string user, digest, nonce, created, operation;
+    nvr::XmlReader body(request.body);
+    for (;;) {
+      Token t = body.next();
+      if (t == Token::End || t == Token::Error) break;
+      if (t != Token::StartElement) continue;
+      std::string_view name = body.localName();
+      if (name == "Username") {
+        user = body.readText();
+      } else if (name == "Password") {
+        digest = body.readText();
+      } else if (name == "Nonce") {
+        nonce = body.readText();
+      } else if (name == "Created") {
+        created = body.readText();
+      } else if (name == "Body") {
+        if (body.next() == Token::StartElement) operation = body.localName();
+        break;
+      }
+    }
+    operations.push_back(operation);
+    paths.push_back(request.target);
+    if (operation != "GetSystemDateAndTime") {
+      std::string rawNonce;
+      bool ok = user == "admin" && nvr::base64Decode(nonce, &rawNonce) &&
+                digest == nvr::WsSecurity::passwordDigest(rawNonce, created, "secret");
+      if (rejectNext > 0) {
+        --rejectNext;
+        ok = false;
+      }
+      if (!ok) return fault("ter:NotAuthorized", "Sender not Authorized");
+    }
+    if (operation == "GetSystemDateAndTime") return reply(dateTime());
+    if (operation == "GetCapabilities") {
+      // Addresses the device believes in; only their paths are used.
+      return reply(
+          "<tds:GetCapabilitiesResponse><tds:Capabilities>"
+          "<tt:Device><tt:XAddr>http://10.1.1.1/onvif/dev</tt:XAddr></tt:Device>"
+          "<tt:Imaging><tt:XAddr>http://10.1.1.1/onvif/img</tt:XAddr></tt:Imaging>"
+          "<tt:Media><tt:XAddr>http://10.1.1.1:8080/onvif/media</tt:XAddr>"
+          "<tt:StreamingCapabilities><tt:RTP_TCP>true</tt:RTP_TCP>"
+          "</tt:StreamingCapabilities></tt:Media>"
+          "<tt:Events><tt:XAddr>http://10.1.1.1/onvif/events</tt:XAddr></tt:Events>"
+          "</tds:Capabilities></tds:GetCapabilitiesResponse>");
+    }
+    if (operation == "GetProfiles") {
+      return reply(
+          "<trt:GetProfilesResponse>"
+          "<trt:Profiles token=\"main\" fixed=\"true\"><tt:Name>Main</tt:Name>"
+          "<tt:VideoSourceConfiguration token=\"vs\"><tt:Name>ignored</tt:Name>"
+          "<tt:Bounds x=\"0\" y=\"0\" width=\"1\" height=\"1\"/></tt:VideoSourceConfiguration>"
+          "<tt:VideoEncoderConfiguration token=\"ve\"><tt:Name>enc</tt:Name>"
+          "<tt:Encoding>H264</tt:Encoding><tt:Resolution><tt:Width>1920</tt:Width>"
+          "<tt:Height>1080</tt:Height></tt:Resolution><tt:RateControl>"
+          "<tt:FrameRateLimit>25</tt:FrameRateLimit></tt:RateControl>"
+          "</tt:VideoEncoderConfiguration>"
+          "<tt:PTZConfiguration token=\"ptz\"><tt:Name>p</tt:Name></tt:PTZConfiguration>"
+          "</trt:Profiles>"
+          "<trt:Profiles token=\"sub\"><tt:Name>Sub</tt:Name>"
+          "<tt:VideoEncoderConfiguration><tt:Encoding>H265</tt:Encoding><tt:Resolution>"
+          "<tt:Width>640</tt:Width><tt:Height>360</tt:Height></tt:Resolution>"
+          "</tt:VideoEncoderConfiguration></trt:Profiles>"
+          "</trt:GetProfilesResponse>");
+    }
+    if (operation == "GetStreamUri") {
+      return reply(
+          "<trt:GetStreamUriResponse><trt:MediaUri><tt:Uri>"
+          "rtsp://10.1.1.1/stream?a=1&amp;b=2</tt:Uri></trt:MediaUri>"
+          "</trt:GetStreamUriResponse>");
+    }
+    if (operation == "PullMessages") {
+      return reply(
+          "<tev:PullMessagesResponse><tev:CurrentTime>2026-10-16T08:30:00Z</tev:CurrentTime>"
+          "<wsnt:NotificationMessage><wsnt:Topic Dialect=\"x\">"
+          "tns1:RuleEngine/CellMotionDetector/Motion</wsnt:Topic><wsnt:Message>"
+          "<tt:Message UtcTime=\"2026-10-16T08:30:00.250Z\" PropertyOperation=\"Changed\">"
+          "<tt:Source><tt:SimpleItem Name=\"VideoSourceConfigurationToken\" Value=\"vs1\"/>"
+          "<tt:SimpleItem Name=\"Rule\" Value=\"r\"/></tt:Source>"
+          "<tt:Data><tt:ElementItem Name=\"Shape\"><tt:Polygon/></tt:ElementItem>"
+          "<tt:SimpleItem Name=\"IsMotion\" Value=\"true\"/></tt:Data>"
+          "</tt:Message></wsnt:Message></wsnt:NotificationMessage>"
+          "<wsnt:NotificationMessage><wsnt:Topic>tns1:Device/Trigger/DigitalInput"
+          "</wsnt:Topic><wsnt:Message><tt:Message PropertyOperation=\"Initialized\">"
+          "<tt:Data><tt:SimpleItem Name=\"LogicalState\" Value=\"false\"/></tt:Data>"
+          "</tt:Message></wsnt:Message></wsnt:NotificationMessage>"
+          "</tev:PullMessagesResponse>");
+    }
+    return fault("ter:ActionNotSupported", "Not supported");
+  }
+
+  std::string dateTime() const {
+    time_t now = time(nullptr) + clockOffsetS;
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    char buf[400];
+    snprintf(buf, sizeof(buf),
+             "<tds:GetSystemDateAndTimeResponse><tds:SystemDateAndTime><tt:UTCDateTime>"
+             "<tt:Time><tt:Hour>%d</tt:Hour><tt:Minute>%d</tt:Minute><tt:Second>%d"
+             "</tt:Second></tt:Time><tt:Date><tt:Year>%d</tt:Year><tt:Month>%d</tt:Month>"
+             "<tt:Day>%d</tt:Day></tt:Date></tt:UTCDateTime></tds:SystemDateAndTime>"
+             "</tds:GetSystemDateAndTimeResponse>",
+             tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    return buf;
+  }
+
+  static std::string reply(const std::string& body) {
+    return nvr::buildHttpResponse(200, "OK", {{"Content-Type", "application/soap+xml"}},
+                                  kHead + body + kTail);
+  }
+
+  static std::string fault(const char* subcode, const char* text) {
+    return nvr::buildHttpResponse(
+        400, "Bad Request", {{"Content-Type", "application/soap+xml"}},
+        std::string(kHead) + "<env:Fault><env:Code><env:Value>env:Sender</env:Value>"
+        "<env:Subcode><env:Value>" + subcode + "</env:Value></env:Subcode></env:Code>"
+        "<env:Reason><env:Text xml:lang=\"en\">" + text + "</env:Text></env:Reason>"
+        "</env:Fault>" + kTail);
+  }
+
+  nvr::test::MockHttpServer server_;
+};
+
+void testOnvifProvisioningSequence() {
+  nvr::EventLoop loop;
+  MockCamera camera(&loop);
+  camera.clockOffsetS = 3600;
+  nvr::HttpClient http(&loop);
+  nvr::OnvifClient client(&http, camera.url());
+  CHECK(client.valid());
+
+  int dateError = -1, capsError = -1, profilesError = -1, uriError = -1;
+  std::vector<nvr::OnvifProfile> profiles;
+  std::string uri;
+  loop.post([&] {
+    client.getSystemDateAndTime([&](int error) {
+      dateError = error;
+      client.getCapabilities([&](int error) {
+        capsError = error;
+        client.getProfiles([&](int error, std::vector<nvr::OnvifProfile> list) {
+          profilesError = error;
+          profiles = std::move(list);
+          client.getStreamUri("main", [&](int error, std::string result) {
+            uriError = error;
+            uri = std::move(result);
+            loop.quit();
+          });
+        });
+      });
+    });
+  });
+  CHECK(nvr::test::runLoop(&loop));
+  CHECK_EQ(dateError, 0);
+  CHECK_EQ(capsError, 0);
+  CHECK_EQ(profilesError, 0);
+  CHECK_EQ(uriError, 0);
+
+  // Device clock an hour ahead, to the second.
+  int64_t offset = client.security().clockOffsetUs();
+  CHECK_GE(offset, 3598ll * 1000000);
+  CHECK_LE(offset, 3602ll * 1000000);
+
+  const nvr::OnvifServices& services = client.services();
+  CHECK_EQ(services.device, std::string("/onvif/dev"));
+  CHECK_EQ(services.media, std::string("/onvif/media"));
+  CHECK_EQ(services.events, std::string("/onvif/events"));
+  CHECK(services.hasEvents);
+  CHECK(!services.hasPtz);
+
+  CHECK_EQ(profiles.size(), size_t(2));
+  if (profiles.size() == 2) {
+    CHECK_EQ(profiles[0].token, std::string("main"));
+    CHECK_EQ(profiles[0].name, std::string("Main"));
+    CHECK_EQ(profiles[0].encoding, std::string("H264"));
+    CHECK_EQ(profiles[0].width, 1920);
+    CHECK_EQ(profiles[0].height, 1080);
+    CHECK_EQ(profiles[0].frameRate, 25);
+    CHECK(profiles[0].ptz);
+    CHECK_EQ(profiles[1].token, std::string("sub"));
+    CHECK_EQ(profiles[1].encoding, std::string("H265"));
+    CHECK_EQ(profiles[1].width, 640);
+    CHECK(!profiles[1].ptz);
+  }
+  CHECK_EQ(uri, std::string("rtsp://10.1.1.1/stream?a=1&b=2"));
+
+  // Calls after GetCapabilities go to the reported paths, on one
+  // kept-alive connection.
+  CHECK_EQ(camera.paths.size(), size_t(4));
+  if (camera.paths.size() == 4) {
+    CHECK_EQ(camera.paths[0], std::string("/onvif/device_service"));
+    CHECK_EQ(camera.paths[2], std::string("/onvif/media"));
+    CHECK_EQ(camera.paths[3], std::string("/onvif/media"));
+  }
+  CHECK_EQ(camera.server().accepted(), size_t(1));
+}
+
+void testOnvifWrongPassword() {
+  nvr::EventLoop loop;
+  MockCamera camera(&loop);
+  nvr::HttpClient http(&loop);
+  nvr::OnvifClient client(&http, camera.url("wrong"));
+  int error = 0;
+  loop.post([&] {
+    client.getProfiles([&](int e, std::vector<nvr::OnvifProfile>) {
+      error = e;
+      loop.quit();
+    });
+  });
+  CHECK(nvr::test::runLoop(&loop));
+  CHECK_EQ(error, -EACCES);
+  CHECK_EQ(client.lastFault(), std::string("Sender not Authorized"));
+}
+
+void testOnvifStaleTokenIsRetriedOnce() {
+  nvr::EventLoop loop;
+  MockCamera camera(&loop);
+  nvr::HttpClient http(&loop);
+  nvr::OnvifClient client(&http, camera.url(), 60000);
+  int first = -1, second = -1, third = 0;
+  loop.post([&] {
+    client.getStreamUri("main", [&](int e, std::string) {
+      first = e;
+      // The cached token is refused once: a fresh one goes out.
+      camera.rejectNext = 1;
+      client.getStreamUri("main", [&](int e, std::string) {
+        second = e;
+        // A fresh token refused is final.
+        camera.rejectNext = 2;
+        client.getStreamUri("main", [&](int e, std::string) {
+          third = e;
+          loop.quit();
+        });
+      });
+    });
+  });
+  CHECK(nvr::test::runLoop(&loop));
+  CHECK_EQ(first, 0);
+  CHECK_EQ(second, 0);
+  CHECK_EQ(third, -EACCES);
+  CHECK_EQ(camera.operations.size(), size_t(5));
+}
+
+void testOnvifPullMessages() {
+  nvr::EventLoop loop;
+  MockCamera camera(&loop);
+  nvr::HttpClient http(&loop);
+  nvr::OnvifClient client(&http, camera.url());
+  int error = -1;
+  std::vector<nvr::OnvifNotification> notifications;
+  loop.post([&] {
+    client.pullMessages("http://10.1.1.1/onvif/pull/7", 1, 10,
+                        [&](int e, std::vector<nvr::OnvifNotification> list) {
+                          error = e;
+                          notifications = std::move(list);
+                          loop.quit();
+                        });
+  });
+  CHECK(nvr::test::runLoop(&loop));
+  CHECK_EQ(error, 0);
+  CHECK_EQ(camera.paths.size(), size_t(1));
+  if (!camera.paths.empty()) CHECK_EQ(camera.paths[0], std::string("/onvif/pull/7"));
+  CHECK_EQ(notifications.size(), size_t(2));
+  if (notifications.size() == 2) {
+    const nvr::OnvifNotification& motion = notifications[0];
+    CHECK_EQ(motion.topic, std::string("tns1:RuleEngine/CellMotionDetector/Motion"));
+    CHECK_EQ(motion.operation, std::string("Changed"));
+    CHECK_EQ(motion.source, std::string("vs1"));
+    CHECK_EQ(motion.dataName, std::string("IsMotion"));
+    CHECK_EQ(motion.dataValue, std::string("true"));
+    CHECK_EQ(motion.utcTimeUs % 1000000, 250000ll);
+    const nvr::OnvifNotification& input = notifications[1];
+    CHECK_EQ(input.operation, std::string("Initialized"));
+    CHECK_EQ(input.dataName, std::string("LogicalState"));
+    CHECK_EQ(input.dataValue, std::string("false"));
+    CHECK_EQ(input.utcTimeUs, 0ll);
+  }
+}
+
+}  // namespace
+
+int main() {
+  nvr::test::quiet();
+  TEST_RUN(testXmlBasics);
+  TEST_RUN(testXmlCdata);
+  TEST_RUN(testXmlNamespaces);
+  TEST_RUN(testXmlEntities);
+  TEST_RUN(testXmlTruncated);
+  TEST_RUN(testXmlMalformed);
+  TEST_RUN(testOnvifProvisioningSequence);
+  TEST_RUN(testOnvifWrongPassword);
+  TEST_RUN(testOnvifStaleTokenIsRetriedOnce);
+  TEST_RUN(testOnvifPullMessages);
+  return nvr::test::finish();
+}
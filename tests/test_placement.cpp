@@ -0,0 +1,273 @@
+// PlacementScheduler against SimulatedNodes: bounded loads, incremental
+// moves when nodes join, make-before-break drains, failover and hot
+// standbys.
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cluster/placement.h"
+#include "cluster/simulated_node.h"
+#include "test_util.h"
+
+namespace {
+
+constexpr int kStartTicks = 2;
+constexpr uint64_t kTickMs = 1000;
+constexpr uint64_t kCameraBps = 4000000;
+constexpr uint64_t kDiskBps = 1000000000;  // 800 Mbit/s of capacity at 0.8
+
+class Cluster {
+ public:
+  explicit Cluster(const nvr::PlacementOptions& options = nvr::PlacementOptions())
+      : scheduler_(options) {}
+
+  nvr::SimulatedNode* addNode(const std::string& id, uint64_t diskBps = kDiskBps) {
+    auto& node = nodes_[id];
+    node.reset(new nvr::SimulatedNode(id, &scheduler_, kStartTicks));
+    nvr::NodeStatus status;
+    status.id = id;
+    status.diskBandwidthBps = diskBps;
+    status.freeBytes = 1ull << 40;
+    scheduler_.addNode(status, node.get());
+    return node.get();
+  }
+
+  void addCameras(int count, bool standby = false) {
+    for (int i = 0; i < count; ++i) {
+      std::string id = "cam-" + std::to_string(cameras_++);
+      scheduler_.addCamera(id, kCameraBps, standby);
+    }
+  }
+
+  // One round; false if a camera recorded before the round was left
+  // unrecorded by it.
+  bool tick() {
+    std::vector<std::string> before = recorded();
+    nowMs_ += kTickMs;
+    for (auto& kv : nodes_) kv.second->tick(nowMs_);
+    scheduler_.rebalance();
+    std::vector<std::string> after = recorded();
+    size_t j = 0;
+    for (const std::string& camera : before) {
+      while (j < after.size() && after[j] < camera) ++j;
+      if (j == after.size() || after[j] != camera) return false;
+    }
+    return true;
+  }
+
+  // Ticks until nothing is starting or moving; the number of ticks, or -1
+  // if a recorded camera went unrecorded on the way.
+  int settle(int maxTicks = 100) {
+    for (int i = 1; i <= maxTicks; ++i) {
+      if (!tick()) return -1;
+      nvr::PlacementStats stats = scheduler_.stats();
+      if (stats.starting == 0 && stats.handovers == 0 && stats.unplaced == 0) return i;
+    }
+    return maxTicks + 1;
+  }
+
+  std::vector<std::string> recorded() const {
+    std::vector<std::string> out;
+    for (const auto& kv : nodes_)
+      for (const std::string& camera : kv.second->recording()) out.push_back(camera);
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+  }
+
+  std::map<std::string, std::string> owners() const {
+    std::map<std::string, std::string> out;
+    for (int i = 0; i < cameras_; ++i) {
+      std::string id = "cam-" + std::to_string(i);
+      if (const std::string* owner = scheduler_.ownerOf(id)) out[id] = *owner;
+    }
+    return out;
+  }
+
+  size_t countOn(const std::string& nodeId) const {
+    size_t count = 0;
+    for (const auto& kv : owners()) count += kv.second == nodeId;
+    return count;
+  }
+
+  nvr::PlacementScheduler& scheduler() { return scheduler_; }
+  nvr::SimulatedNode* node(const std::string& id) { return nodes_[id].get(); }
+  uint64_t nowMs() const { return nowMs_; }
+  int cameras() const { return cameras_; }
+
+ private:
+  nvr::PlacementScheduler scheduler_;
+  std::map<std::string, std::unique_ptr<nvr::SimulatedNode>> nodes_;
+  int cameras_ = 0;
+  uint64_t nowMs_ = 0;
+};
+
+// Every node stays within (1 + epsilon) of its share, by count here since
+// all cameras have the same bitrate.
+void checkBounded(Cluster* cluster, const std::vector<std::string>& nodes, double epsilon) {
+  double share = static_cast<double>(cluster->cameras()) / static_cast<double>(nodes.size());
+  for (const std::string& node : nodes)
+    CHECK_LE(static_cast<double>(cluster->countOn(node)), share * (1 + epsilon) + 1);
+}
+
+void testInitialPlacementIsBounded() {
+  Cluster cluster;
+  for (int i = 0; i < 4; ++i) cluster.addNode("node-" + std::to_string(i));
+  cluster.addCameras(400);
+  CHECK_GT(cluster.settle(), 0);
+  CHECK_EQ(cluster.owners().size(), size_t(400));
+  CHECK_EQ(cluster.recorded().size(), size_t(400));
+  CHECK_EQ(cluster.scheduler().stats().overcommitted, size_t(0));
+  checkBounded(&cluster, {"node-0", "node-1", "node-2", "node-3"}, 0.25);
+}
+
+void testBoundHoldsWithUnequalCapacity() {
+  Cluster cluster;
+  cluster.addNode("small", kDiskBps);
+  cluster.addNode("big", 3 * kDiskBps);
+  cluster.addCameras(300);
+  CHECK_GT(cluster.settle(), 0);
+  // Shares by capacity: 75 and 225 cameras.
+  CHECK_LE(cluster.countOn("small"), size_t(75 * 1.25 + 1));
+  CHECK_LE(cluster.countOn("big"), size_t(225 * 1.25 + 1));
+  CHECK_EQ(cluster.owners().size(), size_t(300));
+}
+
+void testJoinMovesOnlyToTheNewNode() {
+  Cluster cluster;
+  for (int i = 0; i < 4; ++i) cluster.addNode("node-" + std::to_string(i));
+  cluster.addCameras(400);
+  CHECK_GT(cluster.settle(), 0);
+  std::map<std::string, std::string> before = cluster.owners();
+  uint64_t movesBefore = cluster.scheduler().stats().movesCompleted;
+
+  cluster.addNode("node-4");
+  CHECK_GT(cluster.settle(), 0);
+  std::map<std::string, std::string> after = cluster.owners();
+  size_t moved = 0;
+  for (const auto& kv : before) {
+    if (after[kv.first] == kv.second) continue;
+    ++moved;
+    CHECK_EQ(after[kv.first], std::string("node-4"));
+  }
+  // About a fifth of the cameras, never more than the new node's bound.
+  CHECK_GT(moved, size_t(0));
+  CHECK_LE(moved, size_t(80 * 1.25 + 1));
+  CHECK_EQ(cluster.scheduler().stats().movesCompleted - movesBefore, moved);
+  checkBounded(&cluster, {"node-0", "node-1", "node-2", "node-3", "node-4"}, 0.25);
+}
+
+void testMovesPerRoundAreCapped() {
+  nvr::PlacementOptions options;
+  options.maxMovesPerRound = 5;
+  Cluster cluster(options);
+  cluster.addNode("node-0");
+  cluster.addNode("node-1");
+  cluster.addCameras(100);
+  CHECK_GT(cluster.settle(), 0);
+  cluster.addNode("node-2");
+  uint64_t started = cluster.scheduler().stats().movesStarted;
+  cluster.tick();
+  CHECK_LE(cluster.scheduler().stats().movesStarted - started, uint64_t(5));
+  CHECK_GT(cluster.settle(), 1);
+  checkBounded(&cluster, {"node-0", "node-1", "node-2"}, 0.25);
+}
+
+void testDrainIsMakeBeforeBreak() {
+  Cluster cluster;
+  for (int i = 0; i < 3; ++i) cluster.addNode("node-" + std::to_string(i));
+  cluster.addCameras(150);
+  CHECK_GT(cluster.settle(), 0);
+  CHECK(!cluster.scheduler().drained("node-1"));
+
+  cluster.scheduler().drainNode("node-1");
+  // settle() fails if any tick leaves a recorded camera unrecorded.
+  CHECK_GT(cluster.settle(), 0);
+  CHECK(cluster.scheduler().drained("node-1"));
+  CHECK_EQ(cluster.countOn("node-1"), size_t(0));
+  CHECK(cluster.node("node-1")->recording().empty());
+  CHECK_EQ(cluster.recorded().size(), size_t(150));
+}
+
+void testFailureReplacesOnlyTheFailedNodesCameras() {
+  Cluster cluster;
+  for (int i = 0; i < 3; ++i) cluster.addNode("node-" + std::to_string(i));
+  cluster.addCameras(150);
+  CHECK_GT(cluster.settle(), 0);
+  std::map<std::string, std::string> before = cluster.owners();
+  size_t lost = cluster.countOn("node-2");
+
+  std::vector<nvr::FailoverReport> reports;
+  cluster.scheduler().setFailoverHandler(
+      [&reports](const nvr::FailoverReport& report) { reports.push_back(report); });
+  uint64_t lastSeen = cluster.nowMs();
+  cluster.node("node-2")->fail();
+  cluster.scheduler().removeNode("node-2", lastSeen);
+  cluster.settle();
+
+  std::map<std::string, std::string> after = cluster.owners();
+  CHECK_EQ(after.size(), size_t(150));
+  for (const auto& kv : before) {
+    if (kv.second == "node-2")
+      CHECK_NE(after[kv.first], std::string("node-2"));
+    else
+      CHECK_EQ(after[kv.first], kv.second);
+  }
+  CHECK_EQ(reports.size(), lost);
+  for (const nvr::FailoverReport& report : reports) {
+    CHECK(!report.standby);
+    CHECK_EQ(report.fromNode, std::string("node-2"));
+    CHECK_GT(report.gapMs(), uint64_t(0));
+  }
+  CHECK_EQ(cluster.scheduler().stats().failovers, uint64_t(lost));
+}
+
+void testStandbyFailoverHasNoGap() {
+  Cluster cluster;
+  for (int i = 0; i < 3; ++i) cluster.addNode("node-" + std::to_string(i));
+  cluster.addCameras(30, true);
+  CHECK_GT(cluster.settle(), 0);
+  for (int i = 0; i < 30; ++i) {
+    std::string id = "cam-" + std::to_string(i);
+    const std::string* owner = cluster.scheduler().ownerOf(id);
+    const std::string* standby = cluster.scheduler().standbyOf(id);
+    CHECK(owner && standby);
+    if (owner && standby) CHECK_NE(*owner, *standby);
+  }
+  CHECK_EQ(cluster.scheduler().stats().standbys, size_t(30));
+
+  std::vector<nvr::FailoverReport> reports;
+  cluster.scheduler().setFailoverHandler(
+      [&reports](const nvr::FailoverReport& report) { reports.push_back(report); });
+  size_t lost = cluster.countOn("node-0");
+  cluster.node("node-0")->fail();
+  cluster.scheduler().removeNode("node-0", cluster.nowMs());
+  CHECK_EQ(reports.size(), lost);
+  for (const nvr::FailoverReport& report : reports) {
+    CHECK(report.standby);
+    CHECK_EQ(report.gapMs(), uint64_t(0));
+  }
+  CHECK_GT(cluster.settle(), 0);
+  // settle() does not wait for the replacement standbys to confirm.
+  for (int i = 0; i < kStartTicks; ++i) CHECK(cluster.tick());
+  CHECK_EQ(cluster.scheduler().stats().standbys, size_t(30));
+}
+
+}  // namespace
+
+int main() {
+  nvr::test::quiet();
+  TEST_RUN(testInitialPlacementIsBounded);
+  TEST_RUN(testBoundHoldsWithUnequalCapacity);
+  TEST_RUN(testJoinMovesOnlyToTheNewNode);
+  TEST_RUN(testMovesPerRoundAreCapped);
+  TEST_RUN(testDrainIsMakeBeforeBreak);
+  TEST_RUN(testFailureReplacesOnlyTheFailedNodesCameras);
+  TEST_RUN(testStandbyFailoverHasNoGap);
+  return nvr::test::finish();
+}
@@ -0,0 +1,322 @@
+// PsiaClient against a mock device that checks HTTP Digest the way cameras
+// do: the challenge round trip, the documents it reads, and the errors it
+// turns ResponseStatus bodies into.
+
+#include <errno.h>
+
+#include <string>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "base/md5.h"
+#include "http/http_client.h"
+#include "http/http_message.h"
+#include "mock_http_server.h"
+#include "psia/psia_client.h"
+#include "rtsp/rtsp_message.h"
+#include "test_util.h"
+
+namespace {
+
+const char kRealm[] = "DS-2CD2143G2-I";
+const char kNonce[] = "4e6a5931";
+
+const char kDeviceInfo[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<DeviceInfo version=\"1.0\" xmlns=\"urn:psialliance-org\">\n"
+    "<deviceName>Lobby</deviceName>\n<deviceID>88</deviceID>\n"
+    "<model>DS-2CD2143G2-I</model>\n<serialNumber>SN123</serialNumber>\n"
+    "<macAddress>44:47:cc:00:00:01</macAddress>\n<firmwareVersion>V5.7.3</firmwareVersion>\n"
+    "</DeviceInfo>\n";
+
+// The main stream, and a sub stream that is off. The nested <id> and
+// <enabled> elements are not the channel's.
+const char kChannels[] =
+    "<StreamingChannelList version=\"1.0\" xmlns=\"urn:psialliance-org\">\n"
+    "<StreamingChannel><id>101</id><channelName>Camera 01</channelName>"
+    "<enabled>true</enabled><Transport><rtspPortNo>8554</rtspPortNo>"
+    "<Multicast><enabled>false</enabled><id>9</id></Multicast></Transport>"
+    "<Video><enabled>true</enabled><videoCodecType>H.264</videoCodecType>"
+    "<videoResolutionWidth>1920</videoResolutionWidth>"
+    "<videoResolutionHeight>1080</videoResolutionHeight>"
+    "<maxFrameRate>2500</maxFrameRate></Video>"
+    "<Audio><enabled>true</enabled><videoCodecType>G.711</videoCodecType></Audio>"
+    "</StreamingChannel>\n"
+    "<StreamingChannel><id>102</id><enabled>false</enabled><Transport>"
+    "<rtspPortNo>554</rtspPortNo></Transport><Video><enabled>false</enabled>"
+    "<videoCodecType>MJPEG</videoCodecType><maxFrameRate>1250</maxFrameRate></Video>"
+    "</StreamingChannel>\n"
+    "</StreamingChannelList>\n";
+
+const char kTriggers[] =
+    "<EventTriggerList version=\"1.0\" xmlns=\"urn:psialliance-org\">\n"
+    "<EventTrigger><id>VMD-1</id><eventType>VMD</eventType>"
+    "<videoInputChannelID>1</videoInputChannelID><EventTriggerNotificationList>"
+    "<EventTriggerNotification><id>center</id><notificationMethod>center"
+    "</notificationMethod></EventTriggerNotification><EventTriggerNotification>"
+    "<id>record-1</id><notificationMethod>record</notificationMethod>"
+    "</EventTriggerNotification></EventTriggerNotificationList></EventTrigger>\n"
+    "<EventTrigger><id>IO-1</id><eventType>IO</eventType><inputIOPortID>2</inputIOPortID>"
+    "</EventTrigger>\n"
+    "</EventTriggerList>\n";
+
+std::string responseStatus(const std::string& path, int code, const std::string& text) {
+  return "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+         "<ResponseStatus version=\"1.0\" xmlns=\"urn:psialliance-org\">\n<requestURL>" +
+         path + "</requestURL>\n<statusCode>" + std::to_string(code) +
+         "</statusCode>\n<statusString>" + text + "</statusString>\n</ResponseStatus>\n";
+}
+
+// Digest (qop=auth) for admin/secret, the nonce counts it saw, and canned
+// documents. A PUT is answered with putStatus.
+class MockDevice {
+ public:
+  explicit MockDevice(nvr::EventLoop* loop)
+      : server_(loop, [this](const nvr::HttpRequest& request) { return handle(request); }) {}
+
+  std::string url(const std::string& password = "secret") const {
+    return server_.url("/", "admin:" + password);
+  }
+  const nvr::test::MockHttpServer& server() const { return server_; }
+
+  int putStatus = 200;
+  int putCode = 1;
+  std::string putText = "OK";
+  bool brokenDocuments = false;
+  std::vector<std::string> nonceCounts;  // of the authorized requests
+  std::vector<std::string> bodies;       // of the PUTs
+
+ private:
+  std::string handle(const nvr::HttpRequest& request) {
+    if (!authorized(request)) {
+      nvr::HeaderList headers = {
+          {"WWW-Authenticate", std::string("Basic realm=\"") + kRealm + "\""},
+          {"WWW-Authenticate", std::string("Digest qop=\"auth\", realm=\"") + kRealm +
+                                   "\", nonce=\"" + kNonce + "\", stale=\"FALSE\""}};
+      return nvr::buildHttpResponse(401, "Unauthorized", headers,
+                                    responseStatus(request.target, 4, "Unauthorized"));
+    }
+    if (request.method == "PUT") {
+      bodies.push_back(request.body);
+      return nvr::buildHttpResponse(putStatus, putStatus == 200 ? "OK" : "Bad Request",
+                                    xmlHeaders(),
+                                    responseStatus(request.target, putCode, putText));
+    }
+    std::string body;
+    if (brokenDocuments) {
+      body = "<Other/>";
+    } else if (request.target == "/PSIA/System/deviceInfo") {
+      body = kDeviceInfo;
+    } else if (request.target == "/PSIA/Streaming/channels") {
+      body = kChannels;
+    } else if (request.target == "/PSIA/Custom/Event/triggers") {
+      body = kTriggers;
+    } else {
+      return nvr::buildHttpResponse(404, "Not Found", xmlHeaders(),
+                                    responseStatus(request.target, 4, "Invalid Operation"));
+    }
+    return nvr::buildHttpResponse(200, "OK", xmlHeaders(), body);
+  }
+
+  bool authorized(const nvr::HttpRequest& request) {
+    const std::string* header = request.header("Authorization");
+    if (!header || header->compare(0, 7, "Digest ") != 0) return false;
+    std::string user, realm, nonce, uri, nc, cnonce, response;
+    for (const auto& kv : nvr::splitParameters(header->substr(7), ',')) {
+      if (kv.first == "username") user = kv.second;
+      else if (kv.first == "realm") realm = kv.second;
+      else if (kv.first == "nonce") nonce = kv.second;
+      else if (kv.first == "uri") uri = kv.second;
+      else if (kv.first == "nc") nc = kv.second;
+      else if (kv.first == "cnonce") cnonce = kv.second;
+      else if (kv.first == "response") response = kv.second;
+    }
+    if (user != "admin" || realm != kRealm || nonce != kNonce || uri != request.target)
+      return false;
+    std::string ha1 = nvr::Md5::hex(user + ":" + realm + ":secret");
+    std::string ha2 = nvr::Md5::hex(request.method + ":" + uri);
+    if (response != nvr::Md5::hex(ha1 + ":" + nonce + ":" + nc + ":" + cnonce + ":auth:" + ha2))
+      return false;
+    nonceCounts.push_back(nc);
+    return true;
+  }
+
+  static nvr::HeaderList xmlHeaders() {
+    return {{"Content-Type", "application/xml; charset=\"UTF-8\""}};
+  }
+
+  nvr::test::MockHttpServer server_;
+};
+
+void testPsiaDiscoverySequence() {
+  nvr::EventLoop loop;
+  MockDevice device(&loop);
+  nvr::HttpClient http(&loop);
+  nvr::PsiaClient client(&http, device.url());
+  CHECK(client.valid());
+
+  int infoError = -1, channelsError = -1, triggersError = -1;
+  nvr::PsiaDeviceInfo info;
+  std::vector<nvr::PsiaChannel> channels;
+  std::vector<nvr::PsiaTrigger> triggers;
+  loop.post([&] {
+    client.getDeviceInfo([&](int error, nvr::PsiaDeviceInfo result) {
+      infoError = error;
+      info = std::move(result);
+      client.getChannels([&](int error, std::vector<nvr::PsiaChannel> list) {
+        channelsError = error;
+        channels = std::move(list);
+        client.getEventTriggers([&](int error, std::vector<nvr::PsiaTrigger> list) {
+          triggersError = error;
+          triggers = std::move(list);
+          loop.quit();
+        });
+      });
+    });
+  });
+  CHECK(nvr::test::runLoop(&loop));
+  CHECK_EQ(infoError, 0);
+  CHECK_EQ(channelsError, 0);
+  CHECK_EQ(triggersError, 0);
+
+  CHECK_EQ(info.deviceName, std::string("Lobby"));
+  CHECK_EQ(info.deviceId, std::string("88"));
+  CHECK_EQ(info.model, std::string("DS-2CD2143G2-I"));
+  CHECK_EQ(info.serialNumber, std::string("SN123"));
+  CHECK_EQ(info.firmwareVersion, std::string("V5.7.3"));
+  CHECK_EQ(info.macAddress, std::string("44:47:cc:00:00:01"));
+
+  CHECK_EQ(channels.size(), size_t(2));
+  if (channels.size() == 2) {
+    CHECK_EQ(channels[0].id, std::string("101"));
+    CHECK_EQ(channels[0].name, std::string("Camera 01"));
+    CHECK(channels[0].enabled);
+    CHECK_EQ(channels[0].codec, std::string("H264"));
+    CHECK_EQ(channels[0].width, 1920);
+    CHECK_EQ(channels[0].height, 1080);
+    CHECK_EQ(channels[0].frameRate, 25);
+    CHECK_EQ(channels[0].rtspPort, uint16_t(8554));
+    CHECK_EQ(client.streamUri(channels[0]),
+             std::string("rtsp://127.0.0.1:8554/PSIA/Streaming/channels/101"));
+    CHECK_EQ(channels[1].id, std::string("102"));
+    CHECK(!channels[1].enabled);
+    CHECK_EQ(channels[1].codec, std::string("JPEG"));
+    CHECK_EQ(channels[1].frameRate, 12);
+    CHECK_EQ(client.streamUri(channels[1]),
+             std::string("rtsp://127.0.0.1/PSIA/Streaming/channels/102"));
+  }
+
+  CHECK_EQ(triggers.size(), size_t(2));
+  if (triggers.size() == 2) {
+    CHECK_EQ(triggers[0].id, std::string("VMD-1"));
+    CHECK_EQ(triggers[0].eventType, std::string("VMD"));
+    CHECK_EQ(triggers[0].inputId, std::string("1"));
+    CHECK(triggers[0].records);
+    CHECK_EQ(triggers[1].id, std::string("IO-1"));
+    CHECK_EQ(triggers[1].inputId, std::string("2"));
+    CHECK(!triggers[1].records);
+  }
+
+  // Digest picked over Basic; one 401, then the nonce count goes up, on
+  // one kept-alive connection.
+  CHECK_EQ(client.stats().challenges, uint64_t(1));
+  CHECK_EQ(client.stats().requests, uint64_t(4));
+  std::vector<std::string> counts = {"00000001", "00000002", "00000003"};
+  CHECK(device.nonceCounts == counts);
+  CHECK_EQ(device.server().requests().size(), size_t(4));
+  CHECK_EQ(device.server().accepted(), size_t(1));
+}
+
+void testPsiaWrongPassword() {
+  nvr::EventLoop loop;
+  MockDevice device(&loop);
+  nvr::HttpClient http(&loop);
+  nvr::PsiaClient client(&http, device.url("wrong"));
+  int error = 0;
+  loop.post([&] {
+    client.getDeviceInfo([&](int e, nvr::PsiaDeviceInfo) {
+      error = e;
+      loop.quit();
+    });
+  });
+  CHECK(nvr::test::runLoop(&loop));
+  CHECK_EQ(error, -EACCES);
+  CHECK_EQ(client.lastFault(), std::string("HTTP 401"));
+  // Answered once; the same nonce failing again is final.
+  CHECK_EQ(client.stats().requests, uint64_t(2));
+}
+
+void testPsiaPutResponseStatus() {
+  nvr::EventLoop loop;
+  MockDevice device(&loop);
+  nvr::HttpClient http(&loop);
+  nvr::PsiaClient client(&http, device.url());
+  const std::string xml = "<StreamingChannel><id>102</id><enabled>true</enabled>"
+                          "</StreamingChannel>";
+  int accepted = -1, reboot = -1, refused = 0;
+  std::string fault;
+  loop.post([&] {
+    client.putResource("/PSIA/Streaming/channels/102", xml, [&](int error) {
+      accepted = error;
+      device.putCode = 7;
+      device.putText = "Reboot Required";
+      client.putResource("/PSIA/Streaming/channels/102", xml, [&](int error) {
+        reboot = error;
+        device.putStatus = 400;
+        device.putCode = 6;
+        device.putText = "Invalid XML Content";
+        client.putResource("/PSIA/Streaming/channels/102", xml, [&](int error) {
+          refused = error;
+          loop.quit();
+        });
+      });
+    });
+  });
+  CHECK(nvr::test::runLoop(&loop));
+  CHECK_EQ(accepted, 0);
+  CHECK_EQ(reboot, 0);
+  CHECK_EQ(refused, -EPROTO);
+  CHECK_EQ(client.lastFault(), std::string("Invalid XML Content"));
+  CHECK_EQ(device.bodies.size(), size_t(3));
+  if (!device.bodies.empty()) CHECK_EQ(device.bodies[0], xml);
+}
+
+void testPsiaMissingDocuments() {
+  nvr::EventLoop loop;
+  MockDevice device(&loop);
+  device.brokenDocuments = true;
+  nvr::HttpClient http(&loop);
+  nvr::PsiaClient client(&http, device.url());
+  int infoError = 0, channelsError = 0, triggersError = -1;
+  size_t triggerCount = 1;
+  loop.post([&] {
+    client.getDeviceInfo([&](int error, nvr::PsiaDeviceInfo) {
+      infoError = error;
+      client.getChannels([&](int error, std::vector<nvr::PsiaChannel>) {
+        channelsError = error;
+        // No triggers configured is a valid answer.
+        client.getEventTriggers([&](int error, std::vector<nvr::PsiaTrigger> list) {
+          triggersError = error;
+          triggerCount = list.size();
+          loop.quit();
+        });
+      });
+    });
+  });
+  CHECK(nvr::test::runLoop(&loop));
+  CHECK_EQ(infoError, -EBADMSG);
+  CHECK_EQ(channelsError, -EBADMSG);
+  CHECK_EQ(triggersError, 0);
+  CHECK_EQ(triggerCount, size_t(0));
+}
+
+}  // namespace
+
+int main() {
+  nvr::test::quiet();
+  TEST_RUN(testPsiaDiscoverySequence);
+  TEST_RUN(testPsiaWrongPassword);
+  TEST_RUN(testPsiaPutResponseStatus);
+  TEST_RUN(testPsiaMissingDocuments);
+  return nvr::test::finish();
+}
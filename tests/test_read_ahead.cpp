@@ -0,0 +1,257 @@
+// ReadAheadBudget accounting (acquire, deny, peak, release, from several
+// threads at once) and ReadAhead::advance(): which ranges it hints, how
+// nearby chunks merge into one, that a seek starts the window over, and
+// that everything hinted goes back to the budget.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "storage/io_backend.h"
+#include "storage/read_ahead.h"
+#include "storage/segment_index.h"
+#include "test_util.h"
+
+namespace {
+
+constexpr uint64_t kKiB = 1024;
+
+void testBudget() {
+  nvr::ReadAheadBudget budget(100);
+  CHECK(budget.acquire(60));
+  CHECK(!budget.acquire(50));
+  CHECK_EQ(budget.used(), uint64_t(60));
+  CHECK_EQ(budget.denied(), uint64_t(1));
+  CHECK(!budget.exhausted());
+  CHECK(budget.acquire(40));  // up to the limit exactly
+  CHECK(budget.exhausted());
+  CHECK_EQ(budget.peak(), uint64_t(100));
+  budget.release(100);
+  CHECK_EQ(budget.used(), uint64_t(0));
+  CHECK_EQ(budget.peak(), uint64_t(100));
+
+  // A charge goes past the limit; acquires wait for it to come back.
+  budget.charge(150);
+  CHECK_EQ(budget.used(), uint64_t(150));
+  CHECK_EQ(budget.peak(), uint64_t(150));
+  CHECK(!budget.acquire(1));
+  CHECK_EQ(budget.denied(), uint64_t(2));
+  budget.release(150);
+  CHECK(budget.acquire(1));
+  budget.release(1);
+  CHECK_EQ(budget.used(), uint64_t(0));
+}
+
+void testBudgetAcrossThreads() {
+  nvr::ReadAheadBudget budget(1000);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&budget] {
+      for (int i = 0; i < 100000; ++i) {
+        if (budget.acquire(300)) budget.release(300);
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  CHECK_EQ(budget.used(), uint64_t(0));
+  // Never more than three at once.
+  CHECK_LE(budget.peak(), uint64_t(900));
+  CHECK_GE(budget.peak(), uint64_t(300));
+}
+
+// A fixed window of 64 KiB, hints of at most 32 KiB spanning gaps of up
+// to 4 KiB, over a scratch file.
+class Fixture {
+ public:
+  explicit Fixture(uint64_t budgetBytes = 1 << 20) : budget(budgetBytes) {
+    options.minWindow = options.maxWindow = 64 * kKiB;
+    options.maxRead = 32 * kKiB;
+    options.maxGap = 4 * kKiB;
+    nvr::IoBackendOptions ioOptions;
+    ioOptions.kind = nvr::IoBackendKind::Threads;
+    ioOptions.threads = 1;
+    io = nvr::createIoBackend(ioOptions);
+    ok = io && io->start() == 0;
+    char path[] = "/tmp/nvr_test_read_ahead_XXXXXX";
+    fd = mkstemp(path);
+    if (fd >= 0) {
+      unlink(path);
+      ok = ok && ftruncate(fd, 1 << 20) == 0;
+    } else {
+      ok = false;
+    }
+  }
+
+  ~Fixture() {
+    if (io) io->stop();
+    if (fd >= 0) ::close(fd);
+  }
+
+  std::unique_ptr<nvr::ReadAhead> readAhead() {
+    std::unique_ptr<nvr::ReadAhead> ra(new nvr::ReadAhead(&loop, io.get(), &budget, options));
+    ra->open(fd);
+    return ra;
+  }
+
+  nvr::EventLoop loop;
+  nvr::ReadAheadOptions options;
+  nvr::ReadAheadBudget budget;
+  std::unique_ptr<nvr::IoBackend> io;
+  int fd = -1;
+  bool ok = false;
+};
+
+// count chunks of size bytes, one every stride bytes.
+std::vector<nvr::ChunkEntry> chunks(size_t count, uint64_t stride, uint64_t size) {
+  std::vector<nvr::ChunkEntry> out(count);
+  for (size_t i = 0; i < count; ++i) {
+    out[i].offset = i * stride;
+    out[i].size = size;
+  }
+  return out;
+}
+
+void advance(nvr::ReadAhead* ra, const std::vector<nvr::ChunkEntry>& c, size_t at) {
+  ra->advance(c[at], c.data() + at + 1, c.size() - at - 1);
+}
+
+void testAdvanceFillsTheWindow() {
+  Fixture fixture;
+  CHECK(fixture.ok);
+  if (!fixture.ok) return;
+  std::unique_ptr<nvr::ReadAhead> ra = fixture.readAhead();
+  std::vector<nvr::ChunkEntry> c = chunks(64, 4 * kKiB, 4 * kKiB);
+
+  // Two hints of 32 KiB, [4K, 36K) and [36K, 68K), fill the window.
+  advance(ra.get(), c, 0);
+  CHECK_EQ(ra->windowBytes(), 64 * kKiB);
+  CHECK_EQ(ra->stats().hints, uint64_t(2));
+  CHECK_EQ(ra->hintedBytes(), 64 * kKiB);
+  CHECK_EQ(fixture.budget.used(), 64 * kKiB);
+
+  // Reading inside the first range asks for nothing more.
+  advance(ra.get(), c, 1);
+  advance(ra.get(), c, 8);
+  CHECK_EQ(ra->stats().hints, uint64_t(2));
+  CHECK_EQ(ra->stats().restarts, uint64_t(0));
+
+  // Past it, the first range goes back to the budget and the window
+  // moves on by one hint.
+  advance(ra.get(), c, 9);
+  CHECK_EQ(ra->stats().hints, uint64_t(3));
+  CHECK_EQ(ra->stats().hintedBytes, 96 * kKiB);
+  CHECK_EQ(ra->hintedBytes(), 64 * kKiB);
+  CHECK_EQ(fixture.budget.used(), 64 * kKiB);
+  CHECK_EQ(ra->stats().restarts, uint64_t(0));
+
+  // Another file: all of it released.
+  ra->open(fixture.fd);
+  CHECK_EQ(ra->hintedBytes(), uint64_t(0));
+  CHECK_EQ(fixture.budget.used(), uint64_t(0));
+}
+
+void testNearbyChunksMerge() {
+  Fixture fixture;
+  CHECK(fixture.ok);
+  if (!fixture.ok) return;
+
+  // 2 KiB of other cameras' chunks between ours: one hint spans them, up
+  // to maxRead. From 6K, five chunks end at 34K; a sixth would reach 40K.
+  std::unique_ptr<nvr::ReadAhead> ra = fixture.readAhead();
+  std::vector<nvr::ChunkEntry> near = chunks(6, 6 * kKiB, 4 * kKiB);
+  advance(ra.get(), near, 0);
+  CHECK_EQ(ra->stats().hints, uint64_t(1));
+  CHECK_EQ(ra->hintedBytes(), 28 * kKiB);
+
+  // 12 KiB between them: a hint each.
+  std::unique_ptr<nvr::ReadAhead> far = fixture.readAhead();
+  std::vector<nvr::ChunkEntry> apart = chunks(6, 16 * kKiB, 4 * kKiB);
+  advance(far.get(), apart, 0);
+  CHECK_EQ(far->stats().hints, uint64_t(5));
+  CHECK_EQ(far->hintedBytes(), 20 * kKiB);
+
+  // Backward, chunks merge all the same.
+  std::unique_ptr<nvr::ReadAhead> back = fixture.readAhead();
+  std::vector<nvr::ChunkEntry> c = chunks(64, 4 * kKiB, 4 * kKiB);
+  std::vector<nvr::ChunkEntry> reversed(c.rbegin(), c.rend());
+  advance(back.get(), reversed, 0);
+  CHECK_EQ(back->stats().hints, uint64_t(2));
+  CHECK_EQ(back->hintedBytes(), 64 * kKiB);
+  advance(back.get(), reversed, 12);
+  CHECK_EQ(back->stats().restarts, uint64_t(0));
+
+  ra.reset();
+  far.reset();
+  back.reset();
+  CHECK_EQ(fixture.budget.used(), uint64_t(0));
+}
+
+void testSeekRestartsTheWindow() {
+  Fixture fixture;
+  CHECK(fixture.ok);
+  if (!fixture.ok) return;
+  std::unique_ptr<nvr::ReadAhead> ra = fixture.readAhead();
+  std::vector<nvr::ChunkEntry> c = chunks(128, 4 * kKiB, 4 * kKiB);
+  advance(ra.get(), c, 0);
+  CHECK_EQ(ra->stats().hints, uint64_t(2));
+
+  // A chunk outside everything hinted: released, and hinted again from
+  // there.
+  advance(ra.get(), c, 80);
+  CHECK_EQ(ra->stats().restarts, uint64_t(1));
+  CHECK_EQ(ra->stats().hints, uint64_t(4));
+  CHECK_EQ(ra->hintedBytes(), 64 * kKiB);
+  CHECK_EQ(fixture.budget.used(), 64 * kKiB);
+  advance(ra.get(), c, 81);
+  CHECK_EQ(ra->stats().restarts, uint64_t(1));
+
+  // And back.
+  advance(ra.get(), c, 2);
+  CHECK_EQ(ra->stats().restarts, uint64_t(2));
+  CHECK_EQ(fixture.budget.used(), 64 * kKiB);
+  ra.reset();
+  CHECK_EQ(fixture.budget.used(), uint64_t(0));
+}
+
+void testBudgetHoldsHintsBack() {
+  // Room for one 32 KiB hint and a bit.
+  Fixture fixture(40 * kKiB);
+  CHECK(fixture.ok);
+  if (!fixture.ok) return;
+  std::vector<nvr::ChunkEntry> c = chunks(64, 4 * kKiB, 4 * kKiB);
+  std::unique_ptr<nvr::ReadAhead> first = fixture.readAhead();
+  advance(first.get(), c, 0);
+  CHECK_EQ(first->stats().hints, uint64_t(1));
+  CHECK_EQ(first->stats().denied, uint64_t(1));
+
+  std::unique_ptr<nvr::ReadAhead> second = fixture.readAhead();
+  advance(second.get(), c, 20);
+  CHECK_EQ(second->stats().hints, uint64_t(0));
+  CHECK_EQ(second->stats().denied, uint64_t(1));
+  CHECK_EQ(fixture.budget.denied(), uint64_t(2));
+  CHECK_EQ(fixture.budget.peak(), 32 * kKiB);
+
+  // Once the first is done with it, the second gets its turn.
+  first.reset();
+  advance(second.get(), c, 21);
+  CHECK_EQ(second->stats().hints, uint64_t(1));
+  CHECK_EQ(second->hintedBytes(), 32 * kKiB);
+}
+
+}  // namespace
+
+int main() {
+  nvr::test::quiet();
+  TEST_RUN(testBudget);
+  TEST_RUN(testBudgetAcrossThreads);
+  TEST_RUN(testAdvanceFillsTheWindow);
+  TEST_RUN(testNearbyChunksMerge);
+  TEST_RUN(testSeekRestartsTheWindow);
+  TEST_RUN(testBudgetHoldsHintsBack);
+  return nvr::test::finish();
+}
@@ -0,0 +1,309 @@
+// RTSP message parsing: incomplete input, size limits, start lines and
+// parameter lists, then RtspClient's interleaved framing against a
+// scripted camera that splits '$' frames across reads and mixes in
+// responses, server requests, unknown channels and garbage.
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "base/byte_buffer.h"
+#include "base/event_loop.h"
+#include "base/packet_buffer.h"
+#include "base/socket_util.h"
+#include "mock_http_server.h"
+#include "rtsp/rtsp_client.h"
+#include "rtsp/rtsp_message.h"
+#include "test_util.h"
+
+namespace {
+
+int parseRequest(const std::string& text, nvr::RtspRequest* out) {
+  return nvr::parseRtspRequest(text.data(), text.size(), out);
+}
+
+int parseResponse(const std::string& text, nvr::RtspResponse* out) {
+  return nvr::parseRtspResponse(text.data(), text.size(), out);
+}
+
+void testIncompleteInput() {
+  std::string request =
+      "ANNOUNCE rtsp://cam/live RTSP/1.0\r\nCSeq: 4\r\nContent-Length: 5\r\n\r\nv=0\r\n";
+  nvr::RtspRequest out;
+  // Every proper prefix needs more data, the whole is one message, and
+  // whatever follows it is left alone.
+  for (size_t n = 0; n < request.size(); ++n)
+    CHECK_EQ(nvr::parseRtspRequest(request.data(), n, &out), 0);
+  CHECK_EQ(parseRequest(request + "OPTIONS", &out), static_cast<int>(request.size()));
+  CHECK_EQ(out.method, std::string("ANNOUNCE"));
+  CHECK_EQ(out.uri, std::string("rtsp://cam/live"));
+  CHECK_EQ(out.cseq(), 4);
+  CHECK_EQ(out.body, std::string("v=0\r\n"));
+
+  std::string response = "RTSP/1.0 200 OK\r\nCSeq: 2\r\n\r\n";
+  nvr::RtspResponse reply;
+  for (size_t n = 0; n < response.size(); ++n)
+    CHECK_EQ(nvr::parseRtspResponse(response.data(), n, &reply), 0);
+  CHECK_EQ(parseResponse(response, &reply), static_cast<int>(response.size()));
+  CHECK_EQ(reply.status, 200);
+  CHECK_EQ(reply.reason, std::string("OK"));
+  CHECK_EQ(reply.cseq(), 2);
+  CHECK(reply.header("cseq") != nullptr);
+  CHECK(reply.header("Session") == nullptr);
+}
+
+void testSizeLimits() {
+  nvr::RtspResponse out;
+  std::string filler = "X-Filler: " + std::string(1000, 'a') + "\r\n";
+  std::string big = "RTSP/1.0 200 OK\r\nCSeq: 1\r\n";
+  while (big.size() <= 64 * 1024) big += filler;
+  // Over 64 KB of headers without an end, and with one.
+  CHECK_EQ(parseResponse(big, &out), -1);
+  CHECK_EQ(parseResponse(big + "\r\n", &out), -1);
+  // Just under the limit is fine.
+  std::string fits = "RTSP/1.0 200 OK\r\nCSeq: 1\r\n";
+  while (fits.size() + filler.size() + 2 <= 64 * 1024) fits += filler;
+  fits += "\r\n";
+  CHECK_EQ(parseResponse(fits, &out), static_cast<int>(fits.size()));
+
+  std::string head = "RTSP/1.0 200 OK\r\nCSeq: 1\r\nContent-Length: ";
+  CHECK_EQ(parseResponse(head + "16777217\r\n\r\n", &out), -1);
+  CHECK_EQ(parseResponse(head + "-1\r\n\r\n", &out), -1);
+  CHECK_EQ(parseResponse(head + "-16\r\n\r\nbody", &out), -1);
+  // Up to 16 MB is waited for.
+  CHECK_EQ(parseResponse(head + "16777216\r\n\r\nbody", &out), 0);
+}
+
+void testStartLines() {
+  nvr::RtspRequest request;
+  CHECK_EQ(parseRequest("DESCRIBE rtsp://cam/live\r\nCSeq: 1\r\n\r\n", &request), -1);
+  CHECK_EQ(parseRequest("DESCRIBE rtsp://cam/live HTTP/1.1\r\nCSeq: 1\r\n\r\n", &request), -1);
+  CHECK_EQ(parseRequest("DESCRIBE\r\nCSeq: 1\r\n\r\n", &request), -1);
+  std::string ok = "GET_PARAMETER rtsp://cam/live RTSP/1.0\r\nCSeq: 9\r\n\r\n";
+  CHECK_EQ(parseRequest(ok, &request), static_cast<int>(ok.size()));
+  CHECK_EQ(request.method, std::string("GET_PARAMETER"));
+
+  nvr::RtspResponse response;
+  CHECK_EQ(parseResponse("HTTP/1.0 200 OK\r\nCSeq: 1\r\n\r\n", &response), -1);
+  CHECK_EQ(parseResponse("RTSP/1.0\r\nCSeq: 1\r\n\r\n", &response), -1);
+  CHECK_EQ(parseResponse("RTSP/1.0 abc\r\nCSeq: 1\r\n\r\n", &response), -1);
+  std::string noReason = "RTSP/1.0 454\r\nCSeq: 1\r\n\r\n";
+  CHECK_EQ(parseResponse(noReason, &response), static_cast<int>(noReason.size()));
+  CHECK_EQ(response.status, 454);
+  CHECK_EQ(response.reason, std::string(""));
+}
+
+void testParameters() {
+  nvr::HeaderList transport =
+      nvr::splitParameters(" RTP/AVP/TCP ; unicast;Interleaved=0-1 ;ssrc=1A2B3C4D;; ");
+  CHECK_EQ(transport.size(), size_t(4));
+  if (transport.size() == 4) {
+    CHECK_EQ(transport[0].first, std::string("rtp/avp/tcp"));
+    CHECK_EQ(transport[1].first, std::string("unicast"));
+    CHECK_EQ(transport[1].second, std::string(""));
+    CHECK_EQ(transport[2].first, std::string("interleaved"));
+    CHECK_EQ(transport[2].second, std::string("0-1"));
+    CHECK_EQ(transport[3].second, std::string("1A2B3C4D"));
+  }
+
+  // Quotes come off, and a separator inside them does not split.
+  nvr::HeaderList digest = nvr::splitParameters(
+      "realm=\"Camera, Inc\", nonce=\"a1b2\", stale=FALSE, opaque=\"\"", ',');
+  CHECK_EQ(digest.size(), size_t(4));
+  if (digest.size() == 4) {
+    CHECK_EQ(digest[0].first, std::string("realm"));
+    CHECK_EQ(digest[0].second, std::string("Camera, Inc"));
+    CHECK_EQ(digest[1].second, std::string("a1b2"));
+    CHECK_EQ(digest[2].second, std::string("FALSE"));
+    CHECK_EQ(digest[3].second, std::string(""));
+  }
+  nvr::HeaderList session = nvr::splitParameters("47112344;timeout=\"60\"");
+  CHECK_EQ(session.size(), size_t(2));
+  if (session.size() == 2) CHECK_EQ(session[1].second, std::string("60"));
+  CHECK(nvr::splitParameters("").empty());
+}
+
+// ---- RtspClient framing
+
+// One camera, one video track on interleaved channels 0-1. After PLAY it
+// writes `script`, one piece per 5 ms so that each lands in its own read.
+class ScriptedCamera : public nvr::EventHandler {
+ public:
+  ScriptedCamera(nvr::EventLoop* loop, std::vector<std::string> script)
+      : loop_(loop), script_(std::move(script)) {
+    nvr::SocketAddress any;
+    nvr::resolveAddress("127.0.0.1", 0, &any);
+    listenFd_ = nvr::tcpListen(any);
+    nvr::SocketAddress local;
+    if (listenFd_ >= 0 && nvr::localAddress(listenFd_, &local) == 0) {
+      url_ = "rtsp://127.0.0.1:" + std::to_string(local.port()) + "/cam";
+      loop_->add(listenFd_, EPOLLIN, this);
+    }
+  }
+
+  ~ScriptedCamera() override {
+    if (timer_) loop_->cancel(timer_);
+    for (int* fd : {&fd_, &listenFd_}) {
+      if (*fd < 0) continue;
+      loop_->remove(*fd);
+      ::close(*fd);
+    }
+  }
+
+  const std::string& url() const { return url_; }
+  const std::vector<std::string>& methods() const { return methods_; }
+
+  void onEvents(uint32_t) override {
+    if (fd_ < 0) {
+      fd_ = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd_ >= 0) loop_->add(fd_, EPOLLIN, &connection_);
+    }
+  }
+
+ private:
+  struct Connection : nvr::EventHandler {
+    explicit Connection(ScriptedCamera* camera) : camera(camera) {}
+    void onEvents(uint32_t) override { camera->onReadable(); }
+    ScriptedCamera* camera;
+  };
+
+  void onReadable() {
+    while (input_.readFd(fd_) > 0) {
+    }
+    for (;;) {
+      nvr::RtspRequest request;
+      int n = nvr::parseRtspRequest(reinterpret_cast<const char*>(input_.data()), input_.size(),
+                                    &request);
+      if (n <= 0) return;
+      input_.consume(static_cast<size_t>(n));
+      methods_.push_back(request.method);
+      respond(request);
+    }
+  }
+
+  void respond(const nvr::RtspRequest& request) {
+    nvr::HeaderList headers;
+    std::string body;
+    if (request.method == "OPTIONS") {
+      headers.emplace_back("Public", "OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN");
+    } else if (request.method == "DESCRIBE") {
+      headers.emplace_back("Content-Base", url_ + "/");
+      headers.emplace_back("Content-Type", "application/sdp");
+      body = "v=0\r\no=- 1 1 IN IP4 127.0.0.1\r\ns=cam\r\nt=0 0\r\na=control:*\r\n"
+             "m=video 0 RTP/AVP 96\r\na=rtpmap:96 H264/90000\r\na=control:track1\r\n";
+    } else if (request.method == "SETUP") {
+      headers.emplace_back("Transport", "RTP/AVP/TCP;unicast;interleaved=0-1");
+      headers.emplace_back("Session", "5A1B;timeout=60");
+    }
+    write(nvr::buildRtspResponse(200, request.cseq(), headers, body));
+    if (request.method == "PLAY") timer_ = loop_->runEvery(5, [this] { writeNext(); });
+  }
+
+  void writeNext() {
+    if (next_ < script_.size()) write(script_[next_++]);
+    if (next_ < script_.size()) return;
+    loop_->cancel(timer_);
+    timer_ = 0;
+  }
+
+  void write(const std::string& data) {
+    CHECK_EQ(::send(fd_, data.data(), data.size(), MSG_NOSIGNAL),
+             static_cast<ssize_t>(data.size()));
+  }
+
+  nvr::EventLoop* loop_;
+  std::vector<std::string> script_;
+  size_t next_ = 0;
+  int listenFd_ = -1;
+  int fd_ = -1;
+  Connection connection_{this};
+  nvr::ByteBuffer input_;
+  std::string url_;
+  std::vector<std::string> methods_;
+  nvr::EventLoop::TimerId timer_ = 0;
+};
+
+class Collector : public nvr::RtspClientListener {
+ public:
+  Collector(nvr::EventLoop* loop, size_t rtpExpected) : loop_(loop), expected_(rtpExpected) {}
+
+  void onRtpPacket(nvr::RtspClient*, int track, const nvr::PacketRef& packet) override {
+    rtp.push_back(std::to_string(track) + ":" + bytes(packet));
+    if (rtp.size() == expected_) loop_->quit();
+  }
+  void onRtcpPacket(nvr::RtspClient*, int track, const nvr::PacketRef& packet) override {
+    rtcp.push_back(std::to_string(track) + ":" + bytes(packet));
+  }
+  void onRtspDisconnected(nvr::RtspClient*, int error) override { errors.push_back(error); }
+
+  std::vector<std::string> rtp;
+  std::vector<std::string> rtcp;
+  std::vector<int> errors;
+
+ private:
+  static std::string bytes(const nvr::PacketRef& packet) {
+    return std::string(reinterpret_cast<const char*>(packet.data()), packet.size());
+  }
+
+  nvr::EventLoop* loop_;
+  size_t expected_;
+};
+
+std::string frame(uint8_t channel, const std::string& payload) {
+  std::string out = {'$', static_cast<char>(channel), static_cast<char>(payload.size() >> 8),
+                     static_cast<char>(payload.size() & 0xff)};
+  return out + payload;
+}
+
+void testClientInterleavedFraming() {
+  std::string big(1500, 'v');
+  std::string split = frame(0, "abcd");
+  std::string large = frame(0, big);
+  std::vector<std::string> script = {
+      frame(0, "first") + frame(1, "sr!") + split.substr(0, 3),  // header cut short
+      split.substr(3, 3),                                        // payload cut short
+      split.substr(6) +
+          // A camera's own request, a stale response and a channel nobody
+          // set up are skipped without losing the frames around them.
+          "SET_PARAMETER rtsp://127.0.0.1/cam RTSP/1.0\r\nCSeq: 1\r\n\r\n" + frame(0, "second") +
+          "RTSP/1.0 200 OK\r\nCSeq: 99\r\n\r\n" + frame(7, "stray") + large.substr(0, 700),
+      large.substr(700),
+      // Garbage is skipped up to the next '$'.
+      "\x01\x02junk" + frame(0, "last"),
+  };
+  nvr::EventLoop loop;
+  ScriptedCamera camera(&loop, script);
+  CHECK(!camera.url().empty());
+  nvr::PacketPools pools;
+  Collector collector(&loop, 5);
+  nvr::RtspClient client(&loop, &pools, camera.url(), nvr::RtspClientOptions(), &collector);
+  client.start();
+  CHECK(nvr::test::runLoop(&loop));
+  CHECK(client.state() == nvr::RtspClient::State::Playing);
+  client.stop();
+
+  CHECK(camera.methods() ==
+        std::vector<std::string>({"OPTIONS", "DESCRIBE", "SETUP", "PLAY"}));
+  CHECK(collector.rtp == std::vector<std::string>(
+                             {"0:first", "0:abcd", "0:second", "0:" + big, "0:last"}));
+  CHECK(collector.rtcp == std::vector<std::string>({"0:sr!"}));
+  CHECK(collector.errors.empty());
+  CHECK_EQ(client.stats().rtpPackets, uint64_t(5));
+  CHECK_EQ(client.stats().rtcpPackets, uint64_t(1));
+}
+
+}  // namespace
+
+int main() {
+  nvr::test::quiet();
+  TEST_RUN(testIncompleteInput);
+  TEST_RUN(testSizeLimits);
+  TEST_RUN(testStartLines);
+  TEST_RUN(testParameters);
+  TEST_RUN(testClientInterleavedFraming);
+  return nvr::test::finish();
+}
@@ -0,0 +1,289 @@
+// Crash recovery of a segment: a header left unsealed is rebuilt from the
+// blocks' checksums and sequence numbers, up to the first block that fails
+// either, and RecordingStore::start() reseals it and indexes it again.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/event_loop.h"
+#include "storage/file_util.h"
+#include "storage/recording_store.h"
+#include "storage/segment_format.h"
+#include "storage/segment_index.h"
+#include "storage/segment_reader.h"
+#include "test_util.h"
+
+namespace {
+
+constexpr int64_t kSecondUs = 1000000;
+constexpr int kFrames = 24;
+
+void removeTree(const std::string& dir) {
+  std::vector<std::string> groups;
+  nvr::listDirectory(dir, &groups);
+  for (const auto& group : groups) {
+    std::string groupDir = nvr::joinPath(dir, group);
+    std::vector<std::string> names;
+    nvr::listDirectory(groupDir, &names);
+    for (const auto& name : names) unlink(nvr::joinPath(groupDir, name).c_str());
+    rmdir(groupDir.c_str());
+  }
+  rmdir(dir.c_str());
+}
+
+struct Block {
+  uint64_t offset = 0;
+  nvr::BlockHeader header;
+};
+
+// One segment of kFrames keyframes, one a second from 1 s, in blocks of
+// about two frames each, written and sealed by a SegmentWriter.
+class Fixture {
+ public:
+  Fixture() {
+    char dir[] = "/tmp/nvr_test_recovery_XXXXXX";
+    dir_ = mkdtemp(dir) ? dir : "";
+    defaults_.dir = dir_;
+    defaults_.blockSize = 4096;
+    defaults_.maxBuffers = 64;  // all of it appended before the loop runs
+    if (dir_.empty() || !write()) return;
+    std::string groupDir = nvr::joinPath(dir_, "g");
+    std::vector<std::string> names;
+    nvr::listDirectory(groupDir, &names);
+    for (const auto& name : names) {
+      uint64_t id;
+      if (nvr::parseSegmentFileName(name, &id)) path_ = nvr::joinPath(groupDir, name);
+    }
+    int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    ok_ = fd >= 0 && nvr::readSegmentHeader(fd, &sealed_) == 0 && sealed_.sealed;
+    // The blocks as written, up to the sealed header's data end.
+    for (uint64_t offset = nvr::kBlockAlign; ok_ && offset < sealed_.dataEnd;) {
+      Block block;
+      block.offset = offset;
+      ok_ = pread(fd, &block.header, sizeof(block.header), static_cast<off_t>(offset)) ==
+            static_cast<ssize_t>(sizeof(block.header));
+      blocks_.push_back(block);
+      offset += nvr::alignUp(sizeof(nvr::BlockHeader) + block.header.payloadSize);
+    }
+    if (fd >= 0) ::close(fd);
+    ok_ = ok_ && blocks_.size() >= 6;
+  }
+
+  ~Fixture() {
+    if (!dir_.empty()) removeTree(dir_);
+  }
+
+  bool ok() const { return ok_; }
+  const std::string& path() const { return path_; }
+  const nvr::SegmentHeader& sealed() const { return sealed_; }
+  const std::vector<Block>& blocks() const { return blocks_; }
+
+  // As a crash leaves it: the header as written when the segment opened.
+  void unseal() {
+    nvr::SegmentHeader header = sealed_;
+    header.dataEnd = 0;
+    header.blocks = 0;
+    header.firstTimestampUs = header.lastTimestampUs = 0;
+    header.sealed = 0;
+    header.crc = nvr::segmentHeaderCrc(header);
+    writeAt(0, &header, sizeof(header));
+  }
+
+  void writeAt(uint64_t offset, const void* data, size_t size) {
+    int fd = ::open(path_.c_str(), O_WRONLY | O_CLOEXEC);
+    CHECK_EQ(pwrite(fd, data, size, static_cast<off_t>(offset)), static_cast<ssize_t>(size));
+    ::close(fd);
+  }
+
+  // What a scan stopping before block `end` reports.
+  nvr::SegmentScan expectedUpTo(size_t end) const {
+    nvr::SegmentScan scan;
+    scan.dataEnd = end < blocks_.size() ? blocks_[end].offset : sealed_.dataEnd;
+    scan.blocks = static_cast<uint32_t>(end);
+    for (size_t i = 0; i < end; ++i) {
+      const nvr::BlockHeader& h = blocks_[i].header;
+      scan.records += h.records;
+      if (h.firstTimestampUs == 0) continue;
+      if (scan.firstTimestampUs == 0) scan.firstTimestampUs = h.firstTimestampUs;
+      scan.lastTimestampUs = h.lastTimestampUs;
+    }
+    return scan;
+  }
+
+  // Runs the store's start-up recovery over the directory.
+  int recoverStore() {
+    nvr::RecordingStore store(defaults_);
+    int rc = store.start();
+    if (rc == 0) store.stop();
+    return rc;
+  }
+
+ private:
+  bool write() {
+    nvr::RecordingStore store(defaults_);
+    if (store.start() < 0) return false;
+    nvr::EventLoop loop;
+    std::unique_ptr<nvr::SegmentWriter> writer = store.createWriter(&loop, "g");
+    if (writer->open() < 0) return false;
+    nvr::StreamInfo info;
+    info.cameraId = "cam";
+    info.codec = "H264";
+    info.clockRate = 90000;
+    uint32_t stream = writer->addStream(info);
+    std::vector<uint8_t> frame(1500, 0x5a);
+    const uint8_t kIdr[] = {0, 0, 0, 1, 0x65};
+    memcpy(frame.data(), kIdr, sizeof(kIdr));
+    for (int s = 1; s <= kFrames; ++s)
+      writer->append(stream, nvr::RecordType::Video, nvr::kRecordKeyframe, s * kSecondUs,
+                     frame.data(), frame.size());
+    writer->close([&loop] { loop.quit(); });
+    loop.run();
+    store.stop();
+    return true;
+  }
+
+  std::string dir_;
+  nvr::SegmentWriterOptions defaults_;
+  std::string path_;
+  nvr::SegmentHeader sealed_;
+  std::vector<Block> blocks_;
+  bool ok_ = false;
+};
+
+nvr::SegmentScan scan(const std::string& path) {
+  nvr::SegmentScan out;
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  nvr::SegmentHeader header;
+  CHECK_EQ(nvr::readSegmentHeader(fd, &header), 0);
+  CHECK_EQ(header.sealed, uint32_t(0));
+  CHECK_EQ(nvr::scanSegment(fd, header, &out), 0);
+  ::close(fd);
+  return out;
+}
+
+void checkScan(const nvr::SegmentScan& actual, const nvr::SegmentScan& expected) {
+  CHECK_EQ(actual.dataEnd, expected.dataEnd);
+  CHECK_EQ(actual.blocks, expected.blocks);
+  CHECK_EQ(actual.records, expected.records);
+  CHECK_EQ(actual.firstTimestampUs, expected.firstTimestampUs);
+  CHECK_EQ(actual.lastTimestampUs, expected.lastTimestampUs);
+}
+
+// The store resealed the segment with scan's figures and indexed only the
+// keyframes left in it.
+void checkRecovered(const Fixture& fixture, const nvr::SegmentScan& expected) {
+  int fd = ::open(fixture.path().c_str(), O_RDONLY | O_CLOEXEC);
+  nvr::SegmentHeader header;
+  CHECK_EQ(nvr::readSegmentHeader(fd, &header), 0);
+  ::close(fd);
+  CHECK_EQ(header.sealed, uint32_t(1));
+  CHECK_EQ(header.dataEnd, expected.dataEnd);
+  CHECK_EQ(header.blocks, expected.blocks);
+  CHECK_EQ(header.firstTimestampUs, expected.firstTimestampUs);
+  CHECK_EQ(header.lastTimestampUs, expected.lastTimestampUs);
+
+  nvr::SegmentIndex index;
+  CHECK_EQ(index.open(nvr::segmentIndexPath(fixture.path())), 0);
+  CHECK(index.sealed());
+  CHECK_EQ(index.streamCount(), size_t(1));
+  if (index.streamCount() != 1) return;
+  std::vector<nvr::KeyframeEntry> keyframes;
+  index.entries(0, &keyframes);
+  CHECK_EQ(keyframes.size(), static_cast<size_t>(expected.lastTimestampUs / kSecondUs));
+  if (keyframes.empty()) return;
+  CHECK_EQ(keyframes.front().timestampUs, kSecondUs);
+  CHECK_EQ(keyframes.back().timestampUs, expected.lastTimestampUs);
+  CHECK_LT(keyframes.back().blockOffset, expected.dataEnd);
+
+  // Read back, the segment ends at the same place.
+  nvr::SegmentReader reader;
+  CHECK_EQ(reader.open(fixture.path()), 0);
+  nvr::SegmentReader::Record record;
+  int64_t last = 0;
+  while (reader.next(&record)) last = record.header.timestampUs;
+  CHECK_EQ(last, expected.lastTimestampUs);
+}
+
+void testUnsealedTailIsRecoveredWhole() {
+  Fixture fixture;
+  CHECK(fixture.ok());
+  if (!fixture.ok()) return;
+  nvr::SegmentScan all = fixture.expectedUpTo(fixture.blocks().size());
+  CHECK_EQ(all.dataEnd, fixture.sealed().dataEnd);
+  CHECK_EQ(all.blocks, fixture.sealed().blocks);
+  CHECK_EQ(all.lastTimestampUs, kFrames * kSecondUs);
+  fixture.unseal();
+  checkScan(scan(fixture.path()), all);
+  CHECK_EQ(fixture.recoverStore(), 0);
+  checkRecovered(fixture, all);
+  // Sealed now: a second recovery leaves it alone.
+  CHECK_EQ(nvr::recoverSegment(fixture.path()), 0);
+}
+
+void testBadPayloadChecksumEndsTheData() {
+  Fixture fixture;
+  CHECK(fixture.ok());
+  if (!fixture.ok()) return;
+  size_t bad = fixture.blocks().size() / 2;
+  const Block& block = fixture.blocks()[bad];
+  // One byte of the payload: the header still checks out.
+  uint8_t byte = 0;
+  int fd = ::open(fixture.path().c_str(), O_RDONLY | O_CLOEXEC);
+  uint64_t at = block.offset + sizeof(nvr::BlockHeader) + block.header.payloadSize / 2;
+  CHECK_EQ(pread(fd, &byte, 1, static_cast<off_t>(at)), ssize_t(1));
+  ::close(fd);
+  byte ^= 0xff;
+  fixture.writeAt(at, &byte, 1);
+  fixture.unseal();
+
+  nvr::SegmentScan expected = fixture.expectedUpTo(bad);
+  CHECK_LT(expected.lastTimestampUs, kFrames * kSecondUs);
+  CHECK_GT(expected.lastTimestampUs, int64_t(0));
+  checkScan(scan(fixture.path()), expected);
+  CHECK_EQ(fixture.recoverStore(), 0);
+  checkRecovered(fixture, expected);
+}
+
+void testOutOfSequenceBlockEndsTheData() {
+  Fixture fixture;
+  CHECK(fixture.ok());
+  if (!fixture.ok()) return;
+  size_t bad = fixture.blocks().size() / 2 + 1;
+  // A well-formed block, but not the one that comes next: left over from
+  // an earlier use of the file space, say.
+  nvr::BlockHeader header = fixture.blocks()[bad].header;
+  header.sequence += 5;
+  header.headerCrc = 0;
+  header.headerCrc = nvr::blockHeaderCrc(header);
+  fixture.writeAt(fixture.blocks()[bad].offset, &header, sizeof(header));
+  fixture.unseal();
+  // A crash leaves no sealed index behind.
+  unlink(nvr::segmentIndexPath(fixture.path()).c_str());
+
+  nvr::SegmentScan expected = fixture.expectedUpTo(bad);
+  checkScan(scan(fixture.path()), expected);
+  // Sealed by recoverSegment() itself this time; the store then only
+  // finds the index missing.
+  nvr::SegmentScan recovered;
+  CHECK_EQ(nvr::recoverSegment(fixture.path(), &recovered), 1);
+  checkScan(recovered, expected);
+  CHECK_EQ(fixture.recoverStore(), 0);
+  checkRecovered(fixture, expected);
+}
+
+}  // namespace
+
+int main() {
+  nvr::test::quiet();
+  TEST_RUN(testUnsealedTailIsRecoveredWhole);
+  TEST_RUN(testBadPayloadChecksumEndsTheData);
+  TEST_RUN(testOutOfSequenceBlockEndsTheData);
+  return nvr::test::finish();
+}
@@ -0,0 +1,145 @@
+// TimerWheel: timers run on their own tick whichever wheel they start in,
+// through the cascades down to the finest wheel and from the overflow
+// list, and in deadline order when one advance() covers many.
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "base/timer_wheel.h"
+#include "test_util.h"
+
+namespace {
+
+// The ticks timers ran on. Inside a task now() is already the tick after.
+struct Runs {
+  void schedule(nvr::TimerWheel* wheel, uint64_t deadline) {
+    wheel->schedule(deadline, [this, wheel] { ticks.push_back(wheel->now() - 1); });
+  }
+
+  std::vector<uint64_t> ticks;
+};
+
+void testRunsOnItsTickFromEveryLevel() {
+  // Either side of each wheel's boundary.
+  std::vector<uint64_t> deadlines = {1,     255,   256,   257,     511,
+                                     65535, 65536, 65537, 70000,   1 << 24,
+                                     (1 << 24) + 300,     (1 << 24) + 65536 + 1};
+  nvr::TimerWheel wheel;
+  Runs runs;
+  for (uint64_t d : deadlines) runs.schedule(&wheel, d);
+  CHECK_EQ(wheel.size(), deadlines.size());
+  for (uint64_t d : deadlines) {
+    size_t before = runs.ticks.size();
+    wheel.advance(d - 1);
+    CHECK_EQ(runs.ticks.size(), before);
+    wheel.advance(d);
+    CHECK_EQ(runs.ticks.size(), before + 1);
+    if (runs.ticks.size() == before + 1) CHECK_EQ(runs.ticks.back(), d);
+  }
+  CHECK(wheel.empty());
+}
+
+void testOneAdvanceRunsInDeadlineOrder() {
+  std::vector<uint64_t> deadlines = {(1ull << 32) + 5, 300,     1ull << 33, 2,
+                                     16777217,         65536,   70000,      256,
+                                     (1ull << 32) - 1, 4000000, 1};
+  nvr::TimerWheel wheel;
+  Runs runs;
+  for (uint64_t d : deadlines) runs.schedule(&wheel, d);
+  wheel.advance(1ull << 34);
+  std::sort(deadlines.begin(), deadlines.end());
+  CHECK(runs.ticks == deadlines);
+  CHECK(wheel.empty());
+  CHECK_EQ(wheel.nextDeadline(), UINT64_MAX);
+}
+
+void testCascadesFromAnUnalignedStart() {
+  // Just short of the top wheel's turn: the far timers wait in the
+  // overflow list and are sorted in at 2^32.
+  uint64_t start = (1ull << 32) - 3;
+  nvr::TimerWheel wheel(start);
+  Runs runs;
+  std::vector<uint64_t> deadlines = {start + 1, 1ull << 32, (1ull << 32) + 2,
+                                     (1ull << 32) + 256 + 7, (1ull << 32) + 65536 * 3};
+  for (uint64_t d : deadlines) runs.schedule(&wheel, d);
+  for (uint64_t d : deadlines) {
+    wheel.advance(d - 1);
+    wheel.advance(d);
+  }
+  CHECK(runs.ticks == deadlines);
+}
+
+void testNextDeadlineIsALowerBound() {
+  nvr::TimerWheel wheel;
+  Runs runs;
+  runs.schedule(&wheel, 1000);
+  // In the second wheel: the start of its slot.
+  uint64_t next = wheel.nextDeadline();
+  CHECK_LE(next, uint64_t(1000));
+  CHECK_GT(next, uint64_t(0));
+  // Cascaded into the finest wheel: exact.
+  wheel.advance(next);
+  CHECK(runs.ticks.empty());
+  CHECK_EQ(wheel.nextDeadline(), uint64_t(1000));
+  wheel.advance(1000);
+  CHECK_EQ(runs.ticks.size(), size_t(1));
+}
+
+void testCancelAfterCascade() {
+  nvr::TimerWheel wheel;
+  Runs runs;
+  nvr::TimerWheel::Id id = wheel.schedule(70000, [&runs] { runs.ticks.push_back(0); });
+  // Moves it from the third wheel into the second.
+  wheel.advance(65536);
+  CHECK(wheel.cancel(id));
+  CHECK(!wheel.cancel(id));
+  CHECK(wheel.empty());
+  wheel.advance(200000);
+  CHECK(runs.ticks.empty());
+}
+
+void testPeriodicAcrossBoundaries() {
+  nvr::TimerWheel wheel;
+  std::vector<uint64_t> ticks;
+  nvr::TimerWheel::Id id = 0;
+  id = wheel.schedule(
+      200,
+      [&] {
+        ticks.push_back(wheel.now() - 1);
+        if (ticks.size() == 5) wheel.cancel(id);
+      },
+      100);
+  for (uint64_t now = 0; now <= 2000; ++now) wheel.advance(now);
+  std::vector<uint64_t> expected = {200, 300, 400, 500, 600};
+  CHECK(ticks == expected);
+  CHECK(wheel.empty());
+}
+
+void testScheduledFromATaskForNowRunsNextAdvance() {
+  nvr::TimerWheel wheel(500);
+  Runs runs;
+  // Already passed: the next tick.
+  wheel.schedule(10, [&] { runs.schedule(&wheel, 0); });
+  wheel.advance(500);
+  CHECK(runs.ticks.empty());
+  CHECK_EQ(wheel.size(), size_t(1));
+  wheel.advance(501);
+  std::vector<uint64_t> expected = {501};
+  CHECK(runs.ticks == expected);
+}
+
+}  // namespace
+
+int main() {
+  nvr::test::quiet();
+  TEST_RUN(testRunsOnItsTickFromEveryLevel);
+  TEST_RUN(testOneAdvanceRunsInDeadlineOrder);
+  TEST_RUN(testCascadesFromAnUnalignedStart);
+  TEST_RUN(testNextDeadlineIsALowerBound);
+  TEST_RUN(testCancelAfterCascade);
+  TEST_RUN(testPeriodicAcrossBoundaries);
+  TEST_RUN(testScheduledFromATaskForNowRunsNextAdvance);
+  return nvr::test::finish();
+}
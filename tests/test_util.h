@@ -0,0 +1,75 @@
+// Minimal checks for the unit tests.
+//
+// A failed check reports itself and the test goes on; main() returns
+// nvr::test::finish(), non-zero if anything failed. TEST_RUN names each
+// case in the output.
+
+#ifndef NVR_TESTS_TEST_UTIL_H
+#define NVR_TESTS_TEST_UTIL_H
+
+#include <stdio.h>
+
+#include <sstream>
+#include <string>
+
+#include "base/log.h"
+
+namespace nvr {
+namespace test {
+
+inline int& failures() {
+  static int count = 0;
+  return count;
+}
+
+inline void fail(const char* file, int line, const std::string& what) {
+  fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what.c_str());
+  ++failures();
+}
+
+template <typename A, typename B>
+std::string describe(const char* expr, const A& a, const B& b) {
+  std::ostringstream out;
+  out << expr << " (" << a << " vs " << b << ")";
+  return out.str();
+}
+
+inline void quiet() { setLogLevel(LogLevel::Error); }
+
+inline int finish() {
+  if (failures() == 0) return 0;
+  fprintf(stderr, "%d check(s) failed\n", failures());
+  return 1;
+}
+
+}  // namespace test
+}  // namespace nvr
+
+#define CHECK(cond)                                           \
+  do {                                                        \
+    if (!(cond)) ::nvr::test::fail(__FILE__, __LINE__, #cond); \
+  } while (0)
+
+#define CHECK_OP(a, op, b)                                                        \
+  do {                                                                            \
+    const auto& check_a_ = (a);                                                   \
+    const auto& check_b_ = (b);                                                   \
+    if (!(check_a_ op check_b_))                                                  \
+      ::nvr::test::fail(__FILE__, __LINE__,                                       \
+                        ::nvr::test::describe(#a " " #op " " #b, check_a_, check_b_)); \
+  } while (0)
+
+#define CHECK_EQ(a, b) CHECK_OP(a, ==, b)
+#define CHECK_NE(a, b) CHECK_OP(a, !=, b)
+#define CHECK_LT(a, b) CHECK_OP(a, <, b)
+#define CHECK_LE(a, b) CHECK_OP(a, <=, b)
+#define CHECK_GT(a, b) CHECK_OP(a, >, b)
+#define CHECK_GE(a, b) CHECK_OP(a, >=, b)
+
+#define TEST_RUN(fn)                       \
+  do {                                     \
+    fprintf(stderr, "[ RUN  ] %s\n", #fn); \
+    fn();                                  \
+  } while (0)
+
+#endif  // NVR_TESTS_TEST_UTIL_H